@@ -44,6 +44,10 @@ ADDITIONAL_BUILD_PROPERTIES += \
 # Atom optimizations to improve memory benchmarks.
 -include device/asus/a500cg/OptAtom.mk
 
+# Profile-guided build of the modules including OptPgo.mk: empty,
+# instrument or optimize.
+TARGET_PGO ?=
+
 TARGET_RECOVERY_FSTAB := device/asus/a500cg/recovery.fstab
 
 TARGET_BOARD_PLATFORM := clovertrail
@@ -0,0 +1,38 @@
+# Profile-guided optimization of the hottest modules, on top of the
+# flags of OptAtom.mk. A module opts in by including this file right
+# before its include $(BUILD_...):
+#
+#   include $(LOCAL_PATH)/../OptPgo.mk
+#
+# TARGET_PGO := instrument
+#   The module is built with profile counters, which its processes write
+#   on the device under /data/local/tmp/pgo when they exit, or on
+#   "dumpsys display.intel.mds pgo-flush" for MDS. pgo_collect.sh runs
+#   the benchmarks and merges the profiles into pgo/.
+# TARGET_PGO := optimize
+#   The module is built with the profile of pgo/, which gives it the
+#   branch probabilities and block layout of the benchmark runs. Without
+#   a profile there, it is built as usual.
+#
+# Profiles only match the sources and flags they were collected with,
+# collect them again after any change; the stale functions are built
+# without a profile.
+
+PGO_DEVICE_PATH := /data/local/tmp/pgo
+PGO_PROFILE_PATH := $(patsubst %/,%,$(dir $(lastword $(MAKEFILE_LIST))))/pgo
+
+ifeq ($(TARGET_PGO),instrument)
+LOCAL_CFLAGS += -fprofile-generate=$(PGO_DEVICE_PATH) -DPGO_INSTRUMENT
+LOCAL_LDFLAGS += -fprofile-generate=$(PGO_DEVICE_PATH)
+endif
+
+ifeq ($(TARGET_PGO),optimize)
+ifneq ($(wildcard $(PGO_PROFILE_PATH)),)
+# The counters of the threads are not updated atomically, their small
+# inconsistencies are corrected rather than reported
+LOCAL_CFLAGS += \
+                -fprofile-use=$(PGO_PROFILE_PATH) \
+                -fprofile-correction \
+                -Wno-coverage-mismatch
+endif
+endif
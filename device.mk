@@ -64,6 +64,14 @@ PRODUCT_COPY_FILES += \
 PRODUCT_PROPERTY_OVERRIDES += \
     ro.sf.lcd_density=320
 
+# Graphics memory accounting
+PRODUCT_PACKAGES += \
+    memtrack.clovertrail
+
+# Performance counters of the device modules
+PRODUCT_PACKAGES += \
+    metrics_dump
+
 # Modules (currently from ASUS)
 PRODUCT_COPY_FILES += \
     $(call find-copy-subdir-files,*,device/asus/a500cg/ramdisk,root)
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HEALTHD_BATTERY_RING_H
+#define HEALTHD_BATTERY_RING_H
+
+#include <stdint.h>
+
+/*
+ * Recent battery samples, written by healthd on each battery update into
+ * a file which collectors map read-only and read in one shot.
+ *
+ * healthd is the only writer: it fills the sample at head % size, then
+ * increments head. A reader copies head, then the samples, then reads
+ * head again: the samples it copied are valid but for those which were
+ * overwritten in between, i.e. of index below the second head - size.
+ */
+#define BATTERY_RING_PATH     "/dev/healthd_battery"
+#define BATTERY_RING_MAGIC    0x52544248  /* "HBTR" */
+#define BATTERY_RING_VERSION  1
+#define BATTERY_RING_SAMPLES  256
+
+/* flags of a sample */
+#define BATTERY_SAMPLE_AC        (1 << 0)
+#define BATTERY_SAMPLE_USB       (1 << 1)
+#define BATTERY_SAMPLE_WIRELESS  (1 << 2)
+
+struct battery_sample {
+    int64_t timestamp;      /* CLOCK_BOOTTIME, in ns */
+    int32_t level;          /* percent */
+    int32_t voltage;        /* mV, as reported by healthd */
+    int32_t ocv;            /* open circuit voltage in mV, or -1 */
+    int32_t current;        /* uA, as reported by healthd */
+    int32_t temperature;    /* tenths of degree C */
+    int32_t status;         /* BATTERY_STATUS_* */
+    uint32_t flags;         /* chargers online */
+    uint32_t reserved;
+};
+
+struct battery_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          /* number of samples */
+    uint32_t sample_size;   /* sizeof(struct battery_sample) */
+    volatile uint32_t head; /* number of samples written */
+    uint32_t reserved[3];
+    struct battery_sample samples[BATTERY_RING_SAMPLES];
+};
+
+#endif
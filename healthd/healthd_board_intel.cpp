@@ -28,44 +28,54 @@
 #include <unistd.h>
 #include <utils/String8.h>
 #include <cutils/klog.h>
-#include <cutils/properties.h>
+#define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <sys/_system_properties.h>
 #include <sys/inotify.h>
-#include <sys/epoll.h>
-#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <healthd.h>
+#include "healthd_battery_ring.h"
+#include "device_metrics.h"
 
 #define POWER_SUPPLY_SUBSYSTEM "power_supply"
 #define POWER_SUPPLY_SYSFS_PATH "/sys/class/" POWER_SUPPLY_SUBSYSTEM
 #define PERIODIC_CHORES_INTERVAL_FAST (60 * 1)
+#define PERIODIC_CHORES_INTERVAL_MAX  (60 * 30)
 
 #define FG_HELPER           "fg_conf"
 #define FG_HELPER_PATH      "/system/bin/" FG_HELPER
-#define FG_HELPER_EXEC      FG_HELPER_PATH " -r"
+#define FG_HELPER_ARG       "-r"
 #define INOTIFY_PATH        "/sys/devices/virtual/misc/watchdog"
 
 static struct healthd_config *ghc;
 static int savedStatus, savedLevel;
+static int ocvFd = -1;
+static struct battery_ring *batteryRing;
+// Published in the "healthd" device metrics, NULL without them
+static struct device_metric *batteryUpdates;
+static struct device_metric *batteryUpdateUs;
 static bool isHelperPresent;
 static int mos;
-static sem_t fg_sem;
-static bool sem_valid = true;
-static bool kill_thread = false;
+
+// The fuel gauge configuration is saved by a single worker thread, so
+// that the saves never run concurrently nor block the health loop.
+// Requests are numbered, fg_saved being the last one done.
+static pthread_mutex_t fg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fg_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int fg_requested, fg_saved;
+static bool fg_worker_running;
 
 using namespace android;
 
-static int readFromFile(const String8& path, char* buf, size_t size) {
+// Reads an attribute from its start, so that an open fd can be read again
+static int readFromFd(int fd, char* buf, size_t size) {
     char *cp = NULL;
 
-    if (path.isEmpty())
-        return -1;
-    int fd = open(path.string(), O_RDONLY, 0);
-    if (fd == -1) {
-        KLOG_ERROR(LOG_TAG, "Could not open '%s'\n", path.string());
-        return -1;
-    }
-
-    ssize_t count = TEMP_FAILURE_RETRY(read(fd, buf, size));
+    ssize_t count = TEMP_FAILURE_RETRY(pread(fd, buf, size, 0));
     if (count > 0)
             cp = (char *)memrchr(buf, '\n', count);
 
@@ -74,16 +84,26 @@ static int readFromFile(const String8& path, char* buf, size_t size) {
     else
         buf[0] = '\0';
 
-    close(fd);
     return count;
 }
 
-static bool isBattery(const String8 &path)
+// The type attribute, relative to the power supply directory dirfd
+static bool isBattery(int dirfd, const char *name)
 {
     const int SIZE = 128;
     char buf[SIZE] = {0};
+    String8 path;
 
-    int length = readFromFile(path, buf, SIZE);
+    path.appendFormat("%s/type", name);
+    int fd = openat(dirfd, path.string(), O_RDONLY);
+    if (fd == -1) {
+        KLOG_ERROR(LOG_TAG, "Could not open '%s/%s'\n",
+                   POWER_SUPPLY_SYSFS_PATH, path.string());
+        return false;
+    }
+
+    int length = readFromFd(fd, buf, SIZE);
+    close(fd);
 
     if (length <= 0)
         return false;
@@ -94,6 +114,15 @@ static bool isBattery(const String8 &path)
     return false;
 }
 
+// Voltage attributes of a battery, by order of preference
+static const char *batteryVoltageAttrs[] = {
+    "voltage_ocv",
+    "voltage_now",
+    "batt_vol",
+};
+
+// The paths are resolved relative to the directory fd, without walking
+// /sys/class/power_supply again for each attribute
 static void init_battery_path(struct healthd_config *hc) {
     String8 path;
 
@@ -102,6 +131,7 @@ static void init_battery_path(struct healthd_config *hc) {
         KLOG_ERROR(LOG_TAG, "Could not open %s\n", POWER_SUPPLY_SYSFS_PATH);
     } else {
         struct dirent* entry;
+        int dfd = dirfd(dir);
 
         while ((entry = readdir(dir))) {
             const char* name = entry->d_name;
@@ -109,40 +139,88 @@ static void init_battery_path(struct healthd_config *hc) {
             if (!strcmp(name, ".") || !strcmp(name, ".."))
                 continue;
 
-            char buf[20];
             // Look for "type" file in each subdirectory
+            if (!isBattery(dfd, name))
+                continue;
+
+            // Kept open for the telemetry
             path.clear();
-            path.appendFormat("%s/%s/type", POWER_SUPPLY_SYSFS_PATH, name);
-            if (isBattery(path)) {
-                if (hc->batteryVoltagePath.isEmpty()) {
-                    path.clear();
-                    path.appendFormat("%s/%s/voltage_ocv",
-                                      POWER_SUPPLY_SYSFS_PATH, name);
-                    if (access(path, R_OK) == 0) {
-                        hc->batteryVoltagePath = path;
-                    } else {
-                        path.clear();
-                        path.appendFormat("%s/%s/voltage_now",
-                                          POWER_SUPPLY_SYSFS_PATH, name);
-                        if (access(path, R_OK) == 0) {
-                            hc->batteryVoltagePath = path;
-                        } else {
-                                path.clear();
-                                path.appendFormat("%s/%s/batt_vol",
-                                          POWER_SUPPLY_SYSFS_PATH, name);
-                                if (access(path, R_OK) == 0)
-                                    hc->batteryVoltagePath = path;
-                        }
-                    }
+            path.appendFormat("%s/voltage_ocv", name);
+            ocvFd = openat(dfd, path.string(), O_RDONLY);
+
+            for (size_t i = 0; hc->batteryVoltagePath.isEmpty() &&
+                     i < sizeof(batteryVoltageAttrs) /
+                     sizeof(batteryVoltageAttrs[0]); i++) {
+                path.clear();
+                path.appendFormat("%s/%s", name, batteryVoltageAttrs[i]);
+                if (faccessat(dfd, path.string(), R_OK, 0) == 0) {
+                    hc->batteryVoltagePath.setTo(POWER_SUPPLY_SYSFS_PATH "/");
+                    hc->batteryVoltagePath.append(path);
                     break;
                 }
-
             }
+            break;
         }
         closedir(dir);
     }
 }
 
+static void init_battery_ring(void)
+{
+    int fd = open(BATTERY_RING_PATH, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                  0644);
+    if (fd < 0) {
+        KLOG_ERROR(LOG_TAG, "Could not create %s\n", BATTERY_RING_PATH);
+        return;
+    }
+
+    if (ftruncate(fd, sizeof(struct battery_ring)) == 0) {
+        void *ring = mmap(NULL, sizeof(struct battery_ring),
+                          PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring != MAP_FAILED)
+            batteryRing = (struct battery_ring *)ring;
+    }
+    close(fd);
+
+    if (!batteryRing) {
+        KLOG_ERROR(LOG_TAG, "Could not map %s\n", BATTERY_RING_PATH);
+        return;
+    }
+    batteryRing->version = BATTERY_RING_VERSION;
+    batteryRing->size = BATTERY_RING_SAMPLES;
+    batteryRing->sample_size = sizeof(struct battery_sample);
+    __atomic_store_n(&batteryRing->magic, BATTERY_RING_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void record_battery_sample(const struct android::BatteryProperties *props)
+{
+    char buf[32];
+    struct timespec now;
+
+    if (!batteryRing)
+        return;
+
+    uint32_t head = batteryRing->head;
+    struct battery_sample *sample =
+            &batteryRing->samples[head % BATTERY_RING_SAMPLES];
+
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    sample->timestamp = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    sample->level = props->batteryLevel;
+    sample->voltage = props->batteryVoltage;
+    sample->ocv = (ocvFd >= 0 && readFromFd(ocvFd, buf, sizeof(buf) - 1) > 0) ?
+            atoi(buf) / 1000 : -1;
+    sample->current = props->batteryCurrentNow;
+    sample->temperature = props->batteryTemperature;
+    sample->status = props->batteryStatus;
+    sample->flags = (props->chargerAcOnline ? BATTERY_SAMPLE_AC : 0) |
+                    (props->chargerUsbOnline ? BATTERY_SAMPLE_USB : 0) |
+                    (props->chargerWirelessOnline ? BATTERY_SAMPLE_WIRELESS : 0);
+
+    // The sample is complete before readers see it
+    __atomic_store_n(&batteryRing->head, head + 1, __ATOMIC_RELEASE);
+}
+
 #define MAX_COMMAND_LINE_BUF	1024
 static int is_mos()
 {
@@ -173,95 +251,301 @@ static int is_mos()
     return mos;
 }
 
-static int healthd_process_inotify_evt(int fd)
+// Runs the helper directly, without a shell in between
+static void fg_save(void)
+{
+    pid_t pid = vfork();
+
+    if (pid == 0) {
+        execl(FG_HELPER_PATH, FG_HELPER, FG_HELPER_ARG, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        KLOG_ERROR(LOG_TAG, "Cannot execute %s: %s\n", FG_HELPER_PATH,
+                   strerror(errno));
+        return;
+    }
+
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status))
+        KLOG_ERROR(LOG_TAG, "%s " FG_HELPER_ARG " failed\n", FG_HELPER_PATH);
+}
+
+static void *fg_worker(void * /* p */)
+{
+    pthread_mutex_lock(&fg_lock);
+    while (1) {
+        while (fg_saved == fg_requested)
+            pthread_cond_wait(&fg_cond, &fg_lock);
+
+        // Requests made before this save starts are all served by it
+        unsigned int target = fg_requested;
+        pthread_mutex_unlock(&fg_lock);
+        fg_save();
+        pthread_mutex_lock(&fg_lock);
+        fg_saved = target;
+        pthread_cond_broadcast(&fg_cond);
+    }
+    return NULL;
+}
+
+// Asks for a save of the fuel gauge configuration, and waits for it
+// when wait is true
+static void fg_request_save(bool wait)
+{
+    pthread_mutex_lock(&fg_lock);
+    if (!fg_worker_running) {
+        // No worker, save from here, still one at a time
+        fg_save();
+        pthread_mutex_unlock(&fg_lock);
+        return;
+    }
+
+    unsigned int ticket = ++fg_requested;
+    pthread_cond_broadcast(&fg_cond);
+    while (wait && (int)(fg_saved - ticket) < 0)
+        pthread_cond_wait(&fg_cond, &fg_lock);
+    pthread_mutex_unlock(&fg_lock);
+}
+
+#define PROP_SHUTDOWN  "sys.shutdown.requested"
+
+static int inotify_fd = -1;
+static int inotify_wd = -1;
+
+// The property is only read again when its serial changed since the
+// last watchdog event
+static const prop_info *shutdown_pi;
+static unsigned int shutdown_serial;
+
+static bool is_shutdown_requested(void)
+{
+    char prop_shutdown[PROP_VALUE_MAX];
+
+    if (!shutdown_pi)
+        shutdown_pi = __system_property_find(PROP_SHUTDOWN);
+    if (!shutdown_pi)
+        return false;
+
+    unsigned int serial = __system_property_serial(shutdown_pi);
+    if (serial == shutdown_serial)
+        return false;
+    shutdown_serial = serial;
+
+    __system_property_read(shutdown_pi, NULL, prop_shutdown);
+    return strcmp(prop_shutdown, "NONE") != 0;
+}
+
+// Called from the healthd event loop on the watchdog inotify events
+static void healthd_watchdog_event(uint32_t /* epevents */)
 {
 #define BUF_LEN        1024
 #define INOTIFY_SIZE   (sizeof(struct inotify_event))
-#define PROP_SHUTDOWN  "sys.shutdown.requested"
 
     char buffer[BUF_LEN];
     int length, i = 0;
-    int prop_len;
-    char prop_shutdown[128];
+    bool modified = false;
 
-    length = read(fd, buffer, BUF_LEN);
+    length = read(inotify_fd, buffer, BUF_LEN);
 
     if (length < 0) {
         KLOG_ERROR(LOG_TAG, "error reading inotify %d", length);
-        return -1;
+        return;
     }
 
     while (i < length) {
         struct inotify_event *event = (struct inotify_event *) &buffer[i];
-        if (event->len) {
-            if (event->mask & IN_MODIFY) {
-                prop_len = property_get(PROP_SHUTDOWN, prop_shutdown, "NONE");
-                if (strcmp(prop_shutdown, "NONE")) {
-                    /* shutdown is triggered */
-                    if (sem_valid)
-                        sem_wait(&fg_sem);
-                    if (system(FG_HELPER_EXEC) < 0) {
-                        KLOG_ERROR(LOG_TAG, "Cannot execute %s\n",
-                                                     FG_HELPER_EXEC);
-                    }
-                    if (sem_valid)
-                        sem_post(&fg_sem);
-                    kill_thread = true;
-                }
-            }
-        }
+        if (event->len && (event->mask & IN_MODIFY))
+            modified = true;
         i += INOTIFY_SIZE + event->len;
     }
-    return 0;
-}
 
-static void *healthd_inotify_thread(void * /* p */)
-{
-    struct epoll_event evt, nevts[1];
-    int i, inotify_fd, inotify_wd, epoll_fd;
-
-    epoll_fd = epoll_create(1);
-    if (epoll_fd < 0) {
-        KLOG_ERROR(LOG_TAG, "error epoll %d", epoll_fd);
-        return NULL;
+    if (modified && is_shutdown_requested()) {
+        /* shutdown is triggered, the save must be done */
+        fg_request_save(true);
+        inotify_rm_watch(inotify_fd, inotify_wd);
+        inotify_wd = -1;
     }
+}
 
+static void healthd_watchdog_init(void)
+{
     inotify_fd = inotify_init();
     if (inotify_fd < 0) {
         KLOG_ERROR(LOG_TAG, "error inotify %d", inotify_fd);
-        close(epoll_fd);
-        return NULL;
+        return;
     }
 
     inotify_wd = inotify_add_watch(inotify_fd, INOTIFY_PATH, IN_MODIFY);
 
-    evt.events = EPOLLIN;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &evt);
-
-    do {
-       epoll_wait(epoll_fd, nevts, 1, -1);
-       for (i = 0; i < 1; i++) {
-           healthd_process_inotify_evt(inotify_fd);
-           if (kill_thread)
-               break;
-       }
-    }while(1);
-
-    inotify_rm_watch(inotify_fd, inotify_wd);
-    close(inotify_fd);
-    close(epoll_fd);
-    if (sem_valid)
-        sem_destroy(&fg_sem);
-    return NULL;
+    if (healthd_register_event(inotify_fd, healthd_watchdog_event)) {
+        KLOG_ERROR(LOG_TAG, "cannot register the watchdog event");
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
+
+#define KSM_PATH            "/sys/kernel/mm/ksm/"
+#define BACKLIGHT_PATH      "/sys/class/backlight/psb-bl/brightness"
+
+// The KSM scan rate follows the pages it merges: the scan is sped up
+// while pages_sharing grows, after app launches, and slowed down when
+// nothing merges. Screen off on battery, it only idles.
+#define KSM_PERIOD          10      // seconds
+#define KSM_PERIOD_IDLE     60
+#define KSM_PAGES_MIN       100
+#define KSM_PAGES_MAX       1600
+#define KSM_SLEEP_MIN       100     // milliseconds
+#define KSM_SLEEP_MAX       2000
+#define KSM_SLEEP_IDLE      5000
+// New shared pages per scanned page above which the scan pays off
+#define KSM_GAIN_BOOST      8
+#define KSM_GAIN_SLOW       64
+
+static int ksm_timer_fd = -1;
+static int ksm_sharing_fd = -1;
+static int ksm_backlight_fd = -1;
+static long ksm_last_sharing = -1;
+static int ksm_pages = KSM_PAGES_MIN;
+static int ksm_sleep = 500;
+static bool ksm_charging;
+static bool ksm_idle;
+
+static void ksm_write(const char *name, int value)
+{
+    char buf[16];
+    int fd = open(name, O_WRONLY);
+
+    if (fd < 0)
+        return;
+    int length = snprintf(buf, sizeof(buf), "%d", value);
+    if (TEMP_FAILURE_RETRY(write(fd, buf, length)) != length)
+        KLOG_ERROR(LOG_TAG, "Could not write %s\n", name);
+    close(fd);
+}
+
+static void ksm_set_rate(int pages, int sleep)
+{
+    if (pages != ksm_pages) {
+        ksm_pages = pages;
+        ksm_write(KSM_PATH "pages_to_scan", pages);
+    }
+    if (sleep != ksm_sleep) {
+        ksm_sleep = sleep;
+        ksm_write(KSM_PATH "sleep_millisecs", sleep);
+    }
+}
+
+static void ksm_arm_timer(int period)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = period;
+    its.it_interval.tv_sec = period;
+    timerfd_settime(ksm_timer_fd, 0, &its, NULL);
+}
+
+static bool ksm_screen_on(void)
+{
+    char buf[16];
+
+    if (ksm_backlight_fd < 0 ||
+        readFromFd(ksm_backlight_fd, buf, sizeof(buf) - 1) <= 0)
+        return true;
+    return atoi(buf) > 0;
+}
+
+static void ksm_govern(void)
+{
+    char buf[32];
+
+    bool idle = !ksm_charging && !ksm_screen_on();
+    if (idle != ksm_idle) {
+        ksm_idle = idle;
+        ksm_arm_timer(idle ? KSM_PERIOD_IDLE : KSM_PERIOD);
+    }
+    if (idle) {
+        ksm_set_rate(KSM_PAGES_MIN, KSM_SLEEP_IDLE);
+        ksm_last_sharing = -1;
+        return;
+    }
+
+    if (readFromFd(ksm_sharing_fd, buf, sizeof(buf) - 1) <= 0)
+        return;
+    long sharing = atol(buf);
+    long gained = ksm_last_sharing < 0 ? 0 : sharing - ksm_last_sharing;
+    ksm_last_sharing = sharing;
+
+    // Pages scanned during the last period
+    long scanned = (long)ksm_pages * KSM_PERIOD * 1000 / ksm_sleep;
+    int pages = ksm_pages;
+    int sleep = ksm_sleep;
+
+    if (gained * KSM_GAIN_BOOST >= scanned) {
+        pages = pages * 2 > KSM_PAGES_MAX ? KSM_PAGES_MAX : pages * 2;
+        sleep = sleep / 2 < KSM_SLEEP_MIN ? KSM_SLEEP_MIN : sleep / 2;
+    } else if (gained * KSM_GAIN_SLOW < scanned) {
+        pages = pages / 2 < KSM_PAGES_MIN ? KSM_PAGES_MIN : pages / 2;
+        sleep = sleep * 2 > KSM_SLEEP_MAX ? KSM_SLEEP_MAX : sleep * 2;
+    }
+    // Charging, the CPU time of the scan is of no concern
+    if (ksm_charging && sleep > KSM_SLEEP_MIN * 5)
+        sleep = KSM_SLEEP_MIN * 5;
+    ksm_set_rate(pages, sleep);
+}
+
+static void ksm_timer_event(uint32_t /* epevents */)
+{
+    uint64_t expirations;
+
+    if (TEMP_FAILURE_RETRY(read(ksm_timer_fd, &expirations,
+                                sizeof(expirations))) < 0)
+        return;
+    ksm_govern();
+}
+
+static void ksm_set_charging(bool charging)
+{
+    if (ksm_timer_fd < 0 || charging == ksm_charging)
+        return;
+    ksm_charging = charging;
+    ksm_govern();
+}
+
+static void ksm_governor_init(void)
+{
+    ksm_sharing_fd = open(KSM_PATH "pages_sharing", O_RDONLY);
+    if (ksm_sharing_fd < 0)
+        return;
+    ksm_backlight_fd = open(BACKLIGHT_PATH, O_RDONLY);
+
+    ksm_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (ksm_timer_fd < 0) {
+        KLOG_ERROR(LOG_TAG, "cannot create the KSM timer");
+        return;
+    }
+    if (healthd_register_event(ksm_timer_fd, ksm_timer_event)) {
+        KLOG_ERROR(LOG_TAG, "cannot register the KSM timer");
+        close(ksm_timer_fd);
+        ksm_timer_fd = -1;
+        return;
+    }
+    ksm_arm_timer(KSM_PERIOD);
 }
 
 void healthd_board_init(struct healthd_config *config)
 {
      int fd;
-     pthread_t inotify_thread;
+     pthread_t fg_thread;
 
      mos = is_mos();
      init_battery_path(config);
+     init_battery_ring();
+     struct device_metrics *metrics = device_metrics_map("healthd");
+     batteryUpdates = device_metrics_get(metrics, "battery_updates", DEVICE_METRIC_COUNTER);
+     batteryUpdateUs = device_metrics_get(metrics, "battery_update_us", DEVICE_METRIC_HISTOGRAM);
      config->periodic_chores_interval_fast = -1;
      config->periodic_chores_interval_slow = -1;
      ghc = config;
@@ -270,39 +554,96 @@ void healthd_board_init(struct healthd_config *config)
      isHelperPresent = (fd < 0) ? false: true;
      if (isHelperPresent) {
          close(fd);
+         if (pthread_create(&fg_thread, NULL, fg_worker, NULL) == 0)
+             fg_worker_running = true;
+         else
+             KLOG_ERROR(LOG_TAG, "cannot create the fuel gauge thread.");
      }
-     if (sem_init(&fg_sem, 0, 1) < 0) {
-         KLOG_ERROR(LOG_TAG, "unable to initialize sem");
-         sem_valid = false;
-     }
-     if (pthread_create(&inotify_thread, NULL,
-                        healthd_inotify_thread, NULL) < 0) {
-         KLOG_ERROR(LOG_TAG, "cannot create thread.");
-     }
+     healthd_watchdog_init();
+     ksm_governor_init();
 }
 
-static void *execfn(void * /* p */)
+// Levels at which the fuel gauge configuration is saved, see
+// healthd_board_battery_update, plus full for the charge
+static const int reportLevels[] = { 100, 70, 5, 0 };
+
+static int lastLevel = -1;
+static bool lastCharging;
+static struct timespec lastUpdate;
+static double levelRate;              // percent per second, 0 if unknown
+
+// The battery is polled only when a report level is near enough to be
+// missed between two uevents of the fuel gauge: at half the estimated
+// time to reach it, so that the level is still seen once on the way.
+// It is otherwise left to the uevents.
+static int next_poll_interval(const struct android::BatteryProperties *props,
+                              bool charging)
 {
-     if (sem_valid)
-         sem_wait(&fg_sem);
+    struct timespec now;
+    int level = props->batteryLevel;
+    int target = -1;
+
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    if (lastLevel >= 0 && charging == lastCharging && level != lastLevel) {
+        double elapsed = (now.tv_sec - lastUpdate.tv_sec) +
+                         (now.tv_nsec - lastUpdate.tv_nsec) / 1e9;
+        if (elapsed > 0) {
+            double rate = abs(level - lastLevel) / elapsed;
+            levelRate = levelRate ? (levelRate + rate) / 2 : rate;
+        }
+    } else if (charging != lastCharging) {
+        // The rate of the other direction is of no use
+        levelRate = 0;
+    }
+    if (level != lastLevel || charging != lastCharging) {
+        lastLevel = level;
+        lastCharging = charging;
+        lastUpdate = now;
+    }
 
-     if (system(FG_HELPER_EXEC) < 0)
-         KLOG_ERROR(LOG_TAG, "Cannot execute %s\n",FG_HELPER_EXEC);
+    // The gauge doesn't report an empty battery getting charged
+    if (charging && level == 0)
+        return PERIODIC_CHORES_INTERVAL_FAST;
+
+    // The closest report level in the direction of the change
+    for (size_t i = 0; i < sizeof(reportLevels) / sizeof(reportLevels[0]); i++) {
+        if (charging) {
+            if (reportLevels[i] > level)
+                target = reportLevels[i];
+        } else if (reportLevels[i] < level) {
+            target = reportLevels[i];
+            break;
+        }
+    }
+    if (target < 0 || !levelRate)
+        return -1;
 
-     if (sem_valid)
-         sem_post(&fg_sem);
-     return NULL;
+    double interval = abs(target - level) / levelRate / 2;
+    if (interval > PERIODIC_CHORES_INTERVAL_MAX)
+        return -1;
+    if (interval < PERIODIC_CHORES_INTERVAL_FAST)
+        return PERIODIC_CHORES_INTERVAL_FAST;
+    return (int)interval;
 }
 
-
 int healthd_board_battery_update(struct android::BatteryProperties *props)
 {
-    pthread_t t;
+    struct timespec start, end;
 
-    if ((props->chargerAcOnline | props->chargerUsbOnline |
-           props->chargerWirelessOnline) && (props->batteryLevel == 0))
-        ghc->periodic_chores_interval_fast =
-                                     PERIODIC_CHORES_INTERVAL_FAST;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    record_battery_sample(props);
+
+    bool online = props->chargerAcOnline | props->chargerUsbOnline |
+                  props->chargerWirelessOnline;
+    int interval = next_poll_interval(props,
+            online && props->batteryStatus != BATTERY_STATUS_DISCHARGING);
+    ksm_set_charging(online);
+
+    // healthd uses the fast interval while a charger is online
+    if (online)
+        ghc->periodic_chores_interval_fast = interval;
+    else
+        ghc->periodic_chores_interval_slow = interval;
 
     if (isHelperPresent) {
 	if (((props->batteryLevel != savedLevel) &&
@@ -311,12 +652,7 @@ int healthd_board_battery_update(struct android::BatteryProperties *props)
             ((props->batteryStatus != savedStatus) &&
             (props->batteryStatus == BATTERY_STATUS_FULL ||
              props->batteryStatus == BATTERY_STATUS_DISCHARGING))) {
-             if (pthread_create(&t, NULL, execfn, NULL) < 0) {
-                    KLOG_ERROR(LOG_TAG, "cannot create thread\n");
-             }
-             else {
-                pthread_join(t, NULL);
-             }
+             fg_request_save(false);
              savedStatus = props->batteryStatus;
              savedLevel = props->batteryLevel;
         }
@@ -328,5 +664,9 @@ int healthd_board_battery_update(struct android::BatteryProperties *props)
            props->chargerAcOnline = false;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    device_metric_add(batteryUpdates, 1);
+    device_metric_observe(batteryUpdateUs, (end.tv_sec - start.tv_sec) * 1000000LL +
+            (end.tv_nsec - start.tv_nsec) / 1000);
     return 0;
 }
@@ -5,13 +5,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 /******************************************************************************
  * Init interface pointer between hook and libhoudini
  *****************************************************************************/
 #define HOUDINI_PATH            "/system/lib/libhoudini.so"
 #define HOUDINI_BUILD_PROP      "sys.app.houdini"
+#define HOUDINI_CACHE_PROP      "persist.sys.houdini.cache"
+#define HOUDINI_CACHE_DIR       "/data/dalvik-cache/houdini"
+#define HOUDINI_PROF_PROP       "persist.sys.houdini.prof"
+#define HOUDINI_PROF_DUMP_PROP  "debug.houdini.prof.dump"
 
 typedef int   (*HOUDINI_INIT)(void*);
 typedef void* (*HOUDINI_DLOPEN)(const char*, int);
@@ -20,6 +34,10 @@ typedef int   (*HOUDINI_NATIVE_HELPER)(bool, void*, unsigned char,
         void*, unsigned int, const unsigned char*, const void **);
 typedef bool  (*HOUDINI_NEEDED)(void*);
 typedef int   (*HOUDINI_CREATE_ACTIVITY)(void*, void*, void*, void*, size_t);
+typedef void* (*HOUDINI_DLOPEN_CACHED)(const char*, int, const char*);
+typedef int   (*HOUDINI_PREWARM)(const char*, const char*);
+typedef void  (*HOUDINI_SYMBOL_CALLBACK)(void*, const char*, void*);
+typedef int   (*HOUDINI_DLSYM_ALL)(void*, const char*, HOUDINI_SYMBOL_CALLBACK, void*);
 
 struct houdiniHook {
     /*libhoudini function pointers and init flag */
@@ -30,6 +48,11 @@ struct houdiniHook {
     HOUDINI_NATIVE_HELPER       dvm2hdNativeMethodHelper;
     HOUDINI_NEEDED              dvm2hdNeeded;
     HOUDINI_CREATE_ACTIVITY     androidrt2hdCreateActivity;
+    /* optional, NULL when this libhoudini has no translation cache */
+    HOUDINI_DLOPEN_CACHED       dvm2hdDlopenCached;
+    HOUDINI_PREWARM             dvm2hdPrewarm;
+    /* optional, NULL when this libhoudini resolves symbols one by one */
+    HOUDINI_DLSYM_ALL           dvm2hdDlsymAll;
 };
 
 //Need this pointer to unify gHoudini in dalvik and native activity module
@@ -39,7 +62,11 @@ extern const char* dvmGetMethodShorty(void*);
 
 static struct houdiniHook *gHoudini = NULL;
 
-bool houdiniHookInit() {
+static pthread_once_t gHoudiniOnce = PTHREAD_ONCE_INIT;
+static bool gHoudiniReady = false;
+static bool gHoudiniProf = false;
+
+static void houdiniHookInitOnce() {
 
     struct dvm2hdEnv {
         void *logger;
@@ -51,56 +78,79 @@ bool houdiniHookInit() {
     //setting HOUDINI_BUILD_PROP to "on" or do not set this
     //property will enable houdini
     if(strcmp(propBuf, "on") && strcmp(propBuf, "")) {
-        return false;
+        return;
     }
 
+    property_get(HOUDINI_PROF_PROP, propBuf, "");
+    gHoudiniProf = !strcmp(propBuf, "on");
+
     env.logger = (void*)__android_log_print;
     env.getShorty = (void*)dvmGetMethodShorty;
     if (!gHoudiniHook) {
-        gHoudini = (struct houdiniHook*)malloc(sizeof(struct houdiniHook));
-        if (gHoudini == NULL) {
+        struct houdiniHook *houdini =
+            (struct houdiniHook*)calloc(1, sizeof(struct houdiniHook));
+        if (houdini == NULL) {
             ALOGE("libhoudini memory allocation failed!\n");
-            return false;
+            return;
         }
 
         //TODO: hard code the path currently
-        void *handle = dlopen(HOUDINI_PATH,RTLD_NOW);
+        //Lazy binding: most of libhoudini is not needed before translating
+        void *handle = dlopen(HOUDINI_PATH, RTLD_LAZY);
         if (handle == NULL) {
-            return false;
+            free(houdini);
+            return;
         }
-        gHoudini->handle = handle; // Record down the handle in global data structure
-                                   // in case we need to close it later
-        gHoudini->dvm2hdInit = (HOUDINI_INIT)dlsym(handle, "dvm2hdInit");
-        if (gHoudini->dvm2hdInit == NULL) {
+        houdini->handle = handle; // Record down the handle in global data structure
+                                  // in case we need to close it later
+        houdini->dvm2hdInit = (HOUDINI_INIT)dlsym(handle, "dvm2hdInit");
+        if (houdini->dvm2hdInit == NULL) {
             ALOGE("Cannot find symbol dvm2hdInit, please check the "
                     "libhoudini library is correct: %s!\n", dlerror());
-            return false;
+            goto fail;
         }
-        if (!gHoudini->dvm2hdInit((void*)&env)) {
+        if (!houdini->dvm2hdInit((void*)&env)) {
             ALOGE("libhoudini init failed!\n");
-            return false;
+            goto fail;
         }
 
-        gHoudini->dvm2hdDlopen = (HOUDINI_DLOPEN)dlsym(handle, "dvm2hdDlopen");
-        gHoudini->dvm2hdDlsym = (HOUDINI_DLSYM)dlsym(handle, "dvm2hdDlsym");
-        gHoudini->dvm2hdNeeded = (HOUDINI_NEEDED)dlsym(handle, "dvm2hdNeeded");
-        gHoudini->dvm2hdNativeMethodHelper =
+        houdini->dvm2hdDlopen = (HOUDINI_DLOPEN)dlsym(handle, "dvm2hdDlopen");
+        houdini->dvm2hdDlsym = (HOUDINI_DLSYM)dlsym(handle, "dvm2hdDlsym");
+        houdini->dvm2hdNeeded = (HOUDINI_NEEDED)dlsym(handle, "dvm2hdNeeded");
+        houdini->dvm2hdNativeMethodHelper =
             (HOUDINI_NATIVE_HELPER)dlsym(handle, "dvm2hdNativeMethodHelper");
-        gHoudini->androidrt2hdCreateActivity =
-            (HOUDINI_CREATE_ACTIVITY)dlsym(handle, "androidrt2hdCreateActivity");
-        if (!gHoudini->dvm2hdDlopen || !gHoudini->dvm2hdDlsym
-                || !gHoudini->dvm2hdNeeded || !gHoudini->dvm2hdNativeMethodHelper
-                || !gHoudini->androidrt2hdCreateActivity) {
+        // androidrt2hdCreateActivity is resolved on the first native activity
+        if (!houdini->dvm2hdDlopen || !houdini->dvm2hdDlsym
+                || !houdini->dvm2hdNeeded || !houdini->dvm2hdNativeMethodHelper) {
             ALOGE("The library symbol is missing, please check the libhoudini "
                     "library is correct: %s!\n", dlerror());
-            return false;
+            goto fail;
         }
-        gHoudiniHook = (void*)gHoudini;
+        houdini->dvm2hdDlopenCached =
+            (HOUDINI_DLOPEN_CACHED)dlsym(handle, "dvm2hdDlopenCached");
+        houdini->dvm2hdPrewarm = (HOUDINI_PREWARM)dlsym(handle, "dvm2hdPrewarm");
+        houdini->dvm2hdDlsymAll = (HOUDINI_DLSYM_ALL)dlsym(handle, "dvm2hdDlsymAll");
+        // Published once complete, for the lock-free readers
+        __sync_synchronize();
+        gHoudini = houdini;
+        gHoudiniHook = (void*)houdini;
+        gHoudiniReady = true;
+        return;
+
+fail:
+        dlclose(handle);
+        free(houdini);
+        return;
     } else {
         gHoudini = (struct houdiniHook*)gHoudiniHook;
     }
 
-    return true;
+    gHoudiniReady = true;
+}
+
+bool houdiniHookInit() {
+    pthread_once(&gHoudiniOnce, houdiniHookInitOnce);
+    return gHoudiniReady;
 }
 
 /******************************************************************************
@@ -111,14 +161,270 @@ namespace houdini {
 /******************************************************************************
  * For register JNI method and JNI downcall
  *****************************************************************************/
+
+/*
+ * Verdicts of dvm2hdNeeded, per function. A slot is claimed once for a
+ * function, its verdict is stored right after: until then, a reader asks
+ * houdini again.
+ */
+#define NEEDED_CACHE_SIZE       1024    /* power of 2 */
+#define NEEDED_CACHE_PROBES     8
+
+#define NEEDED_UNKNOWN          0
+#define NEEDED_NO               1
+#define NEEDED_YES              2
+
+static void* volatile gNeededFuncs[NEEDED_CACHE_SIZE];
+static volatile unsigned char gNeededVerdicts[NEEDED_CACHE_SIZE];
+
 bool hookCheckMethod(void *fnPtr) {
+    unsigned int hash = ((uintptr_t)fnPtr >> 2) * 2654435761u;
+    int slot = -1;
+    bool needed;
+
     if (gHoudini == NULL)
         gHoudini = (struct houdiniHook*)gHoudiniHook;
 
-    if (gHoudini && gHoudini->dvm2hdNeeded(fnPtr))
-        return true;
-    else
+    if (gHoudini == NULL)
         return false;
+
+    for (int i = 0; i < NEEDED_CACHE_PROBES; i++) {
+        int index = (hash + i) & (NEEDED_CACHE_SIZE - 1);
+        void* func = gNeededFuncs[index];
+        if (func == NULL &&
+                __sync_bool_compare_and_swap(&gNeededFuncs[index], NULL, fnPtr)) {
+            slot = index;
+            break;
+        }
+        if (gNeededFuncs[index] == fnPtr) {
+            unsigned char verdict = gNeededVerdicts[index];
+            if (verdict != NEEDED_UNKNOWN)
+                return verdict == NEEDED_YES;
+            break;
+        }
+    }
+
+    needed = gHoudini->dvm2hdNeeded(fnPtr);
+    if (slot >= 0) {
+        __sync_synchronize();
+        gNeededVerdicts[slot] = needed ? NEEDED_YES : NEEDED_NO;
+    }
+    return needed;
+}
+
+/*
+ * The argument layout of a method, derived once from its shorty: the types
+ * passed to houdini and the word offset of each argument in argv, after the
+ * "this" of an instance method. Methods with more arguments are not cached.
+ */
+#define INVOKE_CACHE_SIZE       1024    /* power of 2 */
+#define INVOKE_CACHE_PROBES     8
+#define INVOKE_MAX_ARGS         32
+
+struct invokeLayout {
+    void*               func;
+    const char*         shorty;
+    char                retType;
+    int                 count;          /* including env and clazz */
+    unsigned char       types[INVOKE_MAX_ARGS + 3];
+    unsigned char       offsets[INVOKE_MAX_ARGS];
+    /* profiling, see HOUDINI_PROF_PROP */
+    volatile uint64_t   calls;
+    volatile uint64_t   ns;
+};
+
+// Slots are only ever filled, once, so that lookups need no lock
+static struct invokeLayout* volatile gInvokeCache[INVOKE_CACHE_SIZE];
+
+static unsigned int invokeCacheHash(void* func) {
+    return ((uintptr_t)func >> 2) * 2654435761u;
+}
+
+static struct invokeLayout* invokeLayoutCreate(void* func, const char* shorty) {
+    struct invokeLayout* layout;
+    char sigByte;
+    int dstArg = 2;
+    int offset = 0;
+
+    if (strlen(shorty) - 1 > INVOKE_MAX_ARGS)
+        return NULL;
+
+    layout = (struct invokeLayout*)calloc(1, sizeof(struct invokeLayout));
+    if (layout == NULL)
+        return NULL;
+
+    layout->func = func;
+    layout->shorty = shorty;
+    layout->retType = *shorty;
+    layout->types[0] = 'L';
+    layout->types[1] = 'L';
+    while ((sigByte = *++shorty) != '\0') {
+        layout->types[dstArg] = sigByte;
+        layout->offsets[dstArg++ - 2] = offset++;
+        if (sigByte == 'D' || sigByte == 'J')
+            offset++;
+    }
+    layout->types[dstArg] = '\0';
+    layout->count = dstArg;
+    return layout;
+}
+
+static struct invokeLayout* invokeLayoutGet(void* func, const char* shorty) {
+    unsigned int hash = invokeCacheHash(func);
+    struct invokeLayout* layout;
+    struct invokeLayout* created = NULL;
+
+    for (int i = 0; i < INVOKE_CACHE_PROBES; i++) {
+        struct invokeLayout* volatile* slot =
+            &gInvokeCache[(hash + i) & (INVOKE_CACHE_SIZE - 1)];
+        layout = *slot;
+        if (layout == NULL) {
+            if (created == NULL) {
+                created = invokeLayoutCreate(func, shorty);
+                if (created == NULL)
+                    return NULL;
+            }
+            if (__sync_bool_compare_and_swap(slot, NULL, created))
+                return created;
+            // Another thread filled the slot in between
+            layout = *slot;
+        }
+        /* The same function may be registered for methods of other shorties */
+        if (layout->func == func && layout->shorty == shorty) {
+            free(created);
+            return layout;
+        }
+    }
+
+    // No room left: the caller marshals the arguments itself
+    free(created);
+    return NULL;
+}
+
+/*
+ * Profiling of the crossings to ARM code, when HOUDINI_PROF_PROP is "on".
+ * The calls and time of each method are kept with its layout, and the
+ * totals are logged, with the hottest methods, whenever the value of
+ * HOUDINI_PROF_DUMP_PROP changes, e.g. "setprop debug.houdini.prof.dump 1".
+ */
+#define PROF_NAMES_SIZE         1024    /* power of 2 */
+#define PROF_NAMES_PROBES       8
+#define PROF_TOP                10
+#define PROF_CHECK_NS           1000000000LL
+
+struct profName {
+    void*       func;
+    char        name[];
+};
+
+static volatile uint64_t gProfInvokeCalls, gProfInvokeNs;
+static volatile uint64_t gProfDlsymCalls, gProfDlsymNs;
+static volatile int64_t gProfNextCheck;
+static char gProfDumpSeen[PROPERTY_VALUE_MAX];
+static pthread_mutex_t gProfLock = PTHREAD_MUTEX_INITIALIZER;
+// The symbols houdini resolved, to name the hottest methods
+static struct profName* volatile gProfNames[PROF_NAMES_SIZE];
+
+static int64_t profNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void profAddName(void* func, const char* symbol) {
+    unsigned int hash = invokeCacheHash(func);
+    size_t len = strlen(symbol) + 1;
+    struct profName* name = (struct profName*)malloc(sizeof(struct profName) + len);
+
+    if (name == NULL)
+        return;
+    name->func = func;
+    memcpy(name->name, symbol, len);
+    for (int i = 0; i < PROF_NAMES_PROBES; i++) {
+        struct profName* volatile* slot =
+            &gProfNames[(hash + i) & (PROF_NAMES_SIZE - 1)];
+        if (__sync_bool_compare_and_swap(slot, NULL, name))
+            return;
+        if ((*slot)->func == func)
+            break;
+    }
+    free(name);
+}
+
+static const char* profFindName(void* func) {
+    unsigned int hash = invokeCacheHash(func);
+
+    for (int i = 0; i < PROF_NAMES_PROBES; i++) {
+        struct profName* name = gProfNames[(hash + i) & (PROF_NAMES_SIZE - 1)];
+        if (name == NULL)
+            break;
+        if (name->func == func)
+            return name->name;
+    }
+    return NULL;
+}
+
+static void profDump() {
+    struct invokeLayout* top[PROF_TOP];
+    int count = 0;
+
+    ALOGI("houdini: %llu JNI calls in %llu us, %llu dlsym in %llu us\n",
+            (unsigned long long)gProfInvokeCalls,
+            (unsigned long long)gProfInvokeNs / 1000,
+            (unsigned long long)gProfDlsymCalls,
+            (unsigned long long)gProfDlsymNs / 1000);
+
+    // Insertion in the PROF_TOP slowest, by total time
+    for (int i = 0; i < INVOKE_CACHE_SIZE; i++) {
+        struct invokeLayout* layout = gInvokeCache[i];
+        int j;
+        if (layout == NULL || layout->calls == 0)
+            continue;
+        if (count == PROF_TOP && layout->ns <= top[count - 1]->ns)
+            continue;
+        if (count < PROF_TOP)
+            count++;
+        for (j = count - 1; j > 0 && top[j - 1]->ns < layout->ns; j--)
+            top[j] = top[j - 1];
+        top[j] = layout;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const char* name = profFindName(top[i]->func);
+        ALOGI("houdini: %2d. %s%s%p (%s): %llu calls in %llu us\n", i + 1,
+                name ? name : "", name ? " " : "", top[i]->func, top[i]->shorty,
+                (unsigned long long)top[i]->calls,
+                (unsigned long long)top[i]->ns / 1000);
+    }
+}
+
+// At most once per PROF_CHECK_NS, dump when asked to
+static void profCheckDump(int64_t now) {
+    char value[PROPERTY_VALUE_MAX];
+
+    if (now < gProfNextCheck || pthread_mutex_trylock(&gProfLock))
+        return;
+    gProfNextCheck = now + PROF_CHECK_NS;
+    property_get(HOUDINI_PROF_DUMP_PROP, value, "");
+    if (strcmp(value, gProfDumpSeen)) {
+        strcpy(gProfDumpSeen, value);
+        if (value[0])
+            profDump();
+    }
+    pthread_mutex_unlock(&gProfLock);
+}
+
+static void profInvoke(struct invokeLayout* layout, int64_t start) {
+    int64_t now = profNow();
+    uint64_t ns = now - start;
+
+    __sync_fetch_and_add(&gProfInvokeCalls, 1);
+    __sync_fetch_and_add(&gProfInvokeNs, ns);
+    if (layout) {
+        __sync_fetch_and_add(&layout->calls, 1);
+        __sync_fetch_and_add(&layout->ns, ns);
+    }
+    profCheckDump(now);
 }
 
 //Assume gHoudini has been initialized
@@ -126,21 +432,39 @@ void dvmHookPlatformInvoke(void* pEnv, void* clazz, int argInfo, int argc,
     const int* argv, const char* shorty, void* func, void* pReturn)
 {
     const int kMaxArgs = argc+2;    /* +1 for env, maybe +1 for clazz */
+    struct invokeLayout* layout;
     unsigned char types[kMaxArgs+1];
+    int64_t start = gHoudiniProf ? profNow() : 0;
     void* values[kMaxArgs];
     char retType;
     char sigByte;
     int dstArg;
 
-    types[0] = 'L';
-    values[0] = &pEnv;
+    if (gHoudini == NULL) {
+        ALOGE("Houdini has not been initialized!");
+        return;
+    }
 
-    types[1] = 'L';
+    values[0] = &pEnv;
     if (clazz != NULL) {
         values[1] = &clazz;
     } else {
         values[1] = (void*)argv++;
     }
+
+    layout = invokeLayoutGet(func, shorty);
+    if (layout != NULL) {
+        for (dstArg = 2; dstArg < layout->count; dstArg++)
+            values[dstArg] = (void*)(argv + layout->offsets[dstArg - 2]);
+        gHoudini->dvm2hdNativeMethodHelper(false, func, layout->retType, pReturn,
+            layout->count, layout->types, (const void**)values);
+        if (gHoudiniProf)
+            profInvoke(layout, start);
+        return;
+    }
+
+    types[0] = 'L';
+    types[1] = 'L';
     dstArg = 2;
 
     /*
@@ -157,39 +481,97 @@ void dvmHookPlatformInvoke(void* pEnv, void* clazz, int argInfo, int argc,
     }
     types[dstArg] = '\0';
 
-    if (gHoudini)
-        gHoudini->dvm2hdNativeMethodHelper(false, func, retType, pReturn, dstArg,
-            types, (const void**)values);
-    else
-        ALOGE("Houdini has not been initialized!");
+    gHoudini->dvm2hdNativeMethodHelper(false, func, retType, pReturn, dstArg,
+        types, (const void**)values);
+    if (gHoudiniProf)
+        profInvoke(NULL, start);
 }
 
 
 /******************************************************************************
  * For hook dlopen, dlsym and ABI2 func execution
  *****************************************************************************/
+
+/*
+ * Verdicts of hookCheckABI2Header, per library path. An entry is only
+ * used while the file has the same inode, size and mtime, so that an
+ * updated library is checked again.
+ */
+#define ABI2_CACHE_SIZE         64
+
+struct abi2Verdict {
+    char*       path;
+    dev_t       dev;
+    ino_t       ino;
+    off_t       size;
+    time_t      mtime;
+    bool        arm;
+    bool        hashed;
+    uint64_t    hash;       /* of the content, when hashed */
+};
+
+static struct abi2Verdict gABI2Cache[ABI2_CACHE_SIZE];
+static unsigned int gABI2Next;
+static pthread_mutex_t gABI2Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct abi2Verdict* hookFindABI2Verdict(const char *filename) {
+    for (int i = 0; i < ABI2_CACHE_SIZE; i++) {
+        struct abi2Verdict *v = &gABI2Cache[i];
+        if (v->path && !strcmp(v->path, filename))
+            return v;
+    }
+    return NULL;
+}
+
 static bool hookCheckABI2Header(const char *filename) {
     int fd = -1;
     unsigned char header[64];
     Elf32_Ehdr *hdr;
+    struct stat st;
+    struct abi2Verdict *v;
+    bool arm;
 
-    if ((fd = open(filename, O_RDONLY)) == -1)
-        return true; // open fail, probablly the file isn't exist, return true to keep align with bionic linker's implementation.
+    if (stat(filename, &st) == -1)
+        return true; // stat fail, probablly the file isn't exist, return true to keep align with bionic linker's implementation.
                      // The linker will check libname first instead of its existence
 
-    if (lseek(fd, 0, SEEK_SET) < 0)
-        goto fail;
+    pthread_mutex_lock(&gABI2Lock);
+    v = hookFindABI2Verdict(filename);
+    if (v && v->dev == st.st_dev && v->ino == st.st_ino &&
+            v->size == st.st_size && v->mtime == st.st_mtime) {
+        arm = v->arm;
+        pthread_mutex_unlock(&gABI2Lock);
+        return arm;
+    }
+    pthread_mutex_unlock(&gABI2Lock);
 
-    if (read(fd, &header[0], 64) < 0)
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return true;
+
+    if (pread(fd, &header[0], 64, 0) < (ssize_t)sizeof(Elf32_Ehdr))
         goto fail;
 
     close(fd);
 
     hdr = (Elf32_Ehdr*)header;
-    if (hdr->e_machine == EM_ARM)
-        return true;
-    else
-        return false;
+    arm = hdr->e_machine == EM_ARM;
+
+    pthread_mutex_lock(&gABI2Lock);
+    v = hookFindABI2Verdict(filename);
+    if (v == NULL) {
+        v = &gABI2Cache[gABI2Next++ % ABI2_CACHE_SIZE];
+        free(v->path);
+        v->path = strdup(filename);
+    }
+    v->dev = st.st_dev;
+    v->ino = st.st_ino;
+    v->size = st.st_size;
+    v->mtime = st.st_mtime;
+    v->arm = arm;
+    v->hashed = false;
+    pthread_mutex_unlock(&gABI2Lock);
+
+    return arm;
 
 fail:
     if (fd != -1)
@@ -197,6 +579,71 @@ fail:
     return false;
 }
 
+/*
+ * Translation cache: houdini may keep the code it translated for a library
+ * in a file of the cache directory, named after the hash of the library so
+ * that an updated one is translated again.
+ */
+static uint64_t hookHashFile(int fd, off_t size) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    const unsigned char *data;
+
+    if (size == 0)
+        return hash;
+    data = (const unsigned char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return 0;
+    for (off_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    munmap((void*)data, size);
+    return hash;
+}
+
+static bool hookCachePath(const char *filename, char *path, size_t size) {
+    char dir[PROPERTY_VALUE_MAX];
+    struct stat st;
+    struct abi2Verdict *v;
+    uint64_t hash = 0;
+    bool hashed = false;
+    int fd;
+
+    property_get(HOUDINI_CACHE_PROP, dir, HOUDINI_CACHE_DIR);
+    if (!strcmp(dir, "off") || stat(filename, &st) == -1)
+        return false;
+
+    pthread_mutex_lock(&gABI2Lock);
+    v = hookFindABI2Verdict(filename);
+    if (v && v->hashed && v->dev == st.st_dev && v->ino == st.st_ino &&
+            v->size == st.st_size && v->mtime == st.st_mtime) {
+        hash = v->hash;
+        hashed = true;
+    }
+    pthread_mutex_unlock(&gABI2Lock);
+
+    if (!hashed) {
+        if ((fd = open(filename, O_RDONLY)) == -1)
+            return false;
+        hash = hookHashFile(fd, st.st_size);
+        close(fd);
+        if (hash == 0)
+            return false;
+
+        pthread_mutex_lock(&gABI2Lock);
+        v = hookFindABI2Verdict(filename);
+        if (v && v->dev == st.st_dev && v->ino == st.st_ino &&
+                v->size == st.st_size && v->mtime == st.st_mtime) {
+            v->hash = hash;
+            v->hashed = true;
+        }
+        pthread_mutex_unlock(&gABI2Lock);
+    }
+
+    return snprintf(path, size, "%s/%016llx", dir,
+            (unsigned long long)hash) < (int)size;
+}
+
 void* hookDlopen(const char *filename, int flag, bool* useHoudini) {
     void *handle = dlopen(filename, flag);
     *useHoudini = false;
@@ -211,21 +658,284 @@ void* hookDlopen(const char *filename, int flag, bool* useHoudini) {
 
     //houdiniHookInit will make sure gHoudini initialized
     *useHoudini = houdiniHookInit();
-    if (*useHoudini == true)
+    if (*useHoudini == true) {
+        char cachePath[PATH_MAX];
+        if (gHoudini->dvm2hdDlopenCached &&
+                hookCachePath(filename, cachePath, sizeof(cachePath)))
+            return gHoudini->dvm2hdDlopenCached(filename, flag, cachePath);
         return gHoudini->dvm2hdDlopen(filename, flag);
-    else
+    } else
         return NULL;
 }
 
+/*
+ * Translates the ARM libraries of libDir into the translation cache, e.g.
+ * once a package is installed, so that its first launch reuses them.
+ * Return the number of libraries translated.
+ */
+int hookPrewarmLibraries(const char *libDir) {
+    char filename[PATH_MAX];
+    char cachePath[PATH_MAX];
+    char dir[PROPERTY_VALUE_MAX];
+    struct dirent *de;
+    DIR *d;
+    int count = 0;
+
+    if (!houdiniHookInit() || gHoudini->dvm2hdPrewarm == NULL)
+        return 0;
+
+    property_get(HOUDINI_CACHE_PROP, dir, HOUDINI_CACHE_DIR);
+    if (!strcmp(dir, "off"))
+        return 0;
+    if (mkdir(dir, 0771) == -1 && errno != EEXIST) {
+        ALOGE("Cannot create the houdini cache %s: %s\n", dir, strerror(errno));
+        return 0;
+    }
+
+    if ((d = opendir(libDir)) == NULL)
+        return 0;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len < 3 || strcmp(de->d_name + len - 3, ".so"))
+            continue;
+        if (snprintf(filename, sizeof(filename), "%s/%s", libDir,
+                    de->d_name) >= (int)sizeof(filename))
+            continue;
+        if (access(filename, R_OK) || !hookCheckABI2Header(filename))
+            continue;
+        if (!hookCachePath(filename, cachePath, sizeof(cachePath)))
+            continue;
+        // Already translated by an earlier pass
+        if (access(cachePath, F_OK) == 0)
+            continue;
+        if (gHoudini->dvm2hdPrewarm(filename, cachePath))
+            count++;
+    }
+    closedir(d);
+
+    return count;
+}
+
+static void* hookPrewarmThread(void *arg) {
+    char *libDir = (char*)arg;
+    int count = hookPrewarmLibraries(libDir);
+    if (count)
+        ALOGD("houdini translated %d libraries of %s\n", count, libDir);
+    free(libDir);
+    return NULL;
+}
+
+// The same, in the background
+void hookPrewarmLibrariesAsync(const char *libDir) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    char *arg = strdup(libDir);
+
+    if (arg == NULL)
+        return;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, hookPrewarmThread, arg))
+        free(arg);
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * The symbols houdini resolved, per library handle, found or not: dalvik
+ * looks each native method up by its short JNI name, then by its long
+ * one, at class init. Libraries loaded through houdini are never closed,
+ * so an entry stays right for the life of the process. Slots are only
+ * ever filled, once, so that lookups need no lock.
+ */
+#define SYM_CACHE_SIZE          4096    /* power of 2 */
+#define SYM_CACHE_PROBES        16
+#define SYM_HANDLES_MAX         64
+#define JNI_PREFIX              "Java_"
+
+struct symEntry {
+    void*       handle;
+    unsigned int hash;
+    void*       func;
+    char        name[];
+};
+
+static struct symEntry* volatile gSymCache[SYM_CACHE_SIZE];
+
+/*
+ * The libraries whose JNI symbols were asked for with dvm2hdDlsymAll, in
+ * one round trip to houdini; complete when they all went in the cache,
+ * so that a JNI name which is not there is not in the library.
+ */
+struct symHandle {
+    void*       handle;
+    bool        complete;
+};
+
+static struct symHandle gSymHandles[SYM_HANDLES_MAX];
+static int gSymHandleCount;
+static pthread_mutex_t gSymLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int symCacheHash(void* handle, const char* symbol) {
+    unsigned int hash = 2166136261u;    // FNV-1a
+
+    while (*symbol)
+        hash = (hash ^ (unsigned char)*symbol++) * 16777619u;
+    return hash ^ (((uintptr_t)handle >> 2) * 2654435761u);
+}
+
+static struct symEntry* symCacheFind(void* handle, const char* symbol,
+        unsigned int hash) {
+    for (int i = 0; i < SYM_CACHE_PROBES; i++) {
+        struct symEntry* entry = gSymCache[(hash + i) & (SYM_CACHE_SIZE - 1)];
+        if (entry == NULL)
+            break;
+        if (entry->hash == hash && entry->handle == handle &&
+                !strcmp(entry->name, symbol))
+            return entry;
+    }
+    return NULL;
+}
+
+// false if there is no room left for it
+static bool symCacheAdd(void* handle, const char* symbol, void* func) {
+    unsigned int hash = symCacheHash(handle, symbol);
+    size_t len = strlen(symbol) + 1;
+    struct symEntry* entry = (struct symEntry*)malloc(sizeof(struct symEntry) + len);
+
+    if (entry == NULL)
+        return false;
+    entry->handle = handle;
+    entry->hash = hash;
+    entry->func = func;
+    memcpy(entry->name, symbol, len);
+    __sync_synchronize();
+    for (int i = 0; i < SYM_CACHE_PROBES; i++) {
+        struct symEntry* volatile* slot =
+            &gSymCache[(hash + i) & (SYM_CACHE_SIZE - 1)];
+        if (__sync_bool_compare_and_swap(slot, NULL, entry))
+            return true;
+        // Another thread added it in between
+        if ((*slot)->hash == hash && (*slot)->handle == handle &&
+                !strcmp((*slot)->name, symbol))
+            break;
+    }
+    free(entry);
+    return false;
+}
+
+struct symResolveState {
+    void*       handle;
+    bool        complete;
+};
+
+static void symResolveCallback(void* arg, const char* symbol, void* func) {
+    struct symResolveState* state = (struct symResolveState*)arg;
+    unsigned int hash = symCacheHash(state->handle, symbol);
+
+    if (symCacheFind(state->handle, symbol, hash) == NULL &&
+            !symCacheAdd(state->handle, symbol, func))
+        state->complete = false;
+    if (func && gHoudiniProf)
+        profAddName(func, symbol);
+}
+
+// Return the handle state, NULL when no bulk resolve was done for it
+static struct symHandle* symFindHandle(void* handle) {
+    for (int i = 0; i < gSymHandleCount; i++) {
+        if (gSymHandles[i].handle == handle)
+            return &gSymHandles[i];
+    }
+    return NULL;
+}
+
+/*
+ * Resolves all the JNI symbols exported by an ARM library into the cache,
+ * in one round trip to houdini, e.g. right after hookDlopen. hookDlsym
+ * does it on the first JNI name looked up in a library. Return the
+ * number of symbols resolved, 0 if houdini can't or it was done already.
+ */
+int hookResolveJniSymbols(bool useHoudini, void* handle) {
+    struct symResolveState state;
+    struct symHandle* sh;
+    int count;
+
+    if (!useHoudini || gHoudini == NULL || gHoudini->dvm2hdDlsymAll == NULL)
+        return 0;
+
+    pthread_mutex_lock(&gSymLock);
+    if (symFindHandle(handle) != NULL || gSymHandleCount >= SYM_HANDLES_MAX) {
+        pthread_mutex_unlock(&gSymLock);
+        return 0;
+    }
+    sh = &gSymHandles[gSymHandleCount++];
+    sh->handle = handle;
+    sh->complete = false;
+
+    state.handle = handle;
+    state.complete = true;
+    int64_t start = gHoudiniProf ? profNow() : 0;
+    count = gHoudini->dvm2hdDlsymAll(handle, JNI_PREFIX, symResolveCallback, &state);
+    if (gHoudiniProf) {
+        __sync_fetch_and_add(&gProfDlsymCalls, 1);
+        __sync_fetch_and_add(&gProfDlsymNs, (uint64_t)(profNow() - start));
+    }
+    // Published after the entries, for the lock-free readers
+    __sync_synchronize();
+    sh->complete = count >= 0 && state.complete;
+    pthread_mutex_unlock(&gSymLock);
+
+    return count > 0 ? count : 0;
+}
+
+// For a JNI name, the JNI symbols of the library are resolved in bulk
+// first. Return true when they all are in the cache.
+static bool symResolveJni(void* handle, const char* symbol) {
+    struct symHandle* sh;
+    bool complete;
+
+    if (strncmp(symbol, JNI_PREFIX, sizeof(JNI_PREFIX) - 1))
+        return false;
+    hookResolveJniSymbols(true, handle);
+    pthread_mutex_lock(&gSymLock);
+    sh = symFindHandle(handle);
+    complete = sh != NULL && sh->complete;
+    pthread_mutex_unlock(&gSymLock);
+    return complete;
+}
+
 //Assume gHoudini has been initialized
 void* hookDlsym(bool useHoudini, void* handle, const char* symbol) {
     if (useHoudini) {
-        if (gHoudini)
-            return gHoudini->dvm2hdDlsym(handle, symbol);
-        else {
+        if (gHoudini == NULL) {
             ALOGE("Houdini has not been initialized!");
             return NULL;
         }
+        unsigned int hash = symCacheHash(handle, symbol);
+        struct symEntry* entry = symCacheFind(handle, symbol, hash);
+        if (entry)
+            return entry->func;
+        bool complete = symResolveJni(handle, symbol);
+        entry = symCacheFind(handle, symbol, hash);
+        if (entry)
+            return entry->func;
+        // Not exported by the library
+        if (complete)
+            return NULL;
+
+        void* func;
+        if (gHoudiniProf) {
+            int64_t start = profNow();
+            func = gHoudini->dvm2hdDlsym(handle, symbol);
+            int64_t now = profNow();
+            __sync_fetch_and_add(&gProfDlsymCalls, 1);
+            __sync_fetch_and_add(&gProfDlsymNs, (uint64_t)(now - start));
+            if (func)
+                profAddName(func, symbol);
+            profCheckDump(now);
+        } else
+            func = gHoudini->dvm2hdDlsym(handle, symbol);
+        symCacheAdd(handle, symbol, func);
+        return func;
     } else
         return dlsym(handle, symbol);
 }
@@ -254,11 +964,23 @@ typedef void (*CreateActivityFunc)(void* activity, void* savedState, size_t save
 void hookCreateActivity(bool useHoudini, void* createActivityFunc, void* activity,
         void*houdiniActivity, void* savedState, size_t savedStateSize) {
     if (useHoudini) {
-        if (gHoudini)
-            gHoudini->androidrt2hdCreateActivity(createActivityFunc, activity,
-                houdiniActivity, savedState, savedStateSize);
-        else
+        if (gHoudini == NULL) {
             ALOGE("Houdini has not been initialized!");
+            return;
+        }
+        HOUDINI_CREATE_ACTIVITY createActivity = gHoudini->androidrt2hdCreateActivity;
+        if (createActivity == NULL) {
+            createActivity = (HOUDINI_CREATE_ACTIVITY)dlsym(gHoudini->handle,
+                "androidrt2hdCreateActivity");
+            if (createActivity == NULL) {
+                ALOGE("The library symbol is missing, please check the libhoudini "
+                        "library is correct: %s!\n", dlerror());
+                return;
+            }
+            gHoudini->androidrt2hdCreateActivity = createActivity;
+        }
+        createActivity(createActivityFunc, activity,
+            houdiniActivity, savedState, savedStateSize);
     } else {
         (*(CreateActivityFunc)createActivityFunc)(activity, savedState, savedStateSize);
     }
@@ -0,0 +1,251 @@
+/*
+ ** Copyright 2014 Intel Corporation
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **      http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+#pragma once
+
+#include "SampleSpec.h"
+#include "AudioUtils.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+namespace android_audio_legacy {
+
+/**
+ * Process wide pool of the period and conversion buffers of the streams.
+ * A buffer holds a number of frames of a sample specification, rounded up to the 16 frames
+ * AudioFlinger works with (@see AudioUtils::alignOn16), and is aligned on a cache line, so
+ * that the SIMD kernels of the remixer and of the resampler always get aligned memory.
+ * Released buffers are kept per sample specification and period size: a stream opened again,
+ * or reconfigured on a route change, takes back the buffers of the previous one instead of
+ * allocating new ones. Only the first stream of a given sample specification and period
+ * allocates.
+ */
+class AudioBufferPool
+{
+public:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    /**
+     * Takes a buffer from the pool, or allocates one if there is none of this size.
+     *
+     * @param[in] ss sample specifications of the buffer.
+     * @param[in] frames number of frames the buffer must hold.
+     * @param[out] bytes size of the buffer, in bytes, if not NULL.
+     *
+     * @return cache line aligned buffer, NULL if out of memory.
+     */
+    static void *acquire(const SampleSpec &ss, size_t frames, size_t *bytes = NULL)
+    {
+        Key key = getKey(ss, frames);
+        if (bytes) {
+
+            *bytes = key.bytes;
+        }
+        Pool &pool = getPool();
+        pthread_mutex_lock(&pool.lock);
+        Bucket *bucket = find(pool, key);
+        if (bucket && bucket->nbFree) {
+
+            void *buffer = bucket->free[--bucket->nbFree];
+            pthread_mutex_unlock(&pool.lock);
+            return buffer;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        void *block;
+        if (posix_memalign(&block, CACHE_LINE_SIZE, HEADER_SIZE + key.bytes)) {
+
+            return NULL;
+        }
+        *static_cast<Key *>(block) = key;
+        return static_cast<uint8_t *>(block) + HEADER_SIZE;
+    }
+
+    /**
+     * Gives a buffer of acquire() back to the pool, or frees it if the pool is full.
+     *
+     * @param[in] buffer to release, may be NULL.
+     */
+    static void release(void *buffer)
+    {
+        if (!buffer) {
+
+            return;
+        }
+        uint8_t *block = static_cast<uint8_t *>(buffer) - HEADER_SIZE;
+        const Key &key = *reinterpret_cast<const Key *>(block);
+        Pool &pool = getPool();
+        pthread_mutex_lock(&pool.lock);
+        Bucket *bucket = find(pool, key);
+        if (!bucket && pool.nbBuckets < MAX_BUCKETS) {
+
+            bucket = &pool.buckets[pool.nbBuckets++];
+            bucket->key = key;
+            bucket->nbFree = 0;
+        }
+        if (bucket && bucket->nbFree < MAX_FREE_PER_BUCKET) {
+
+            bucket->free[bucket->nbFree++] = buffer;
+            buffer = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+        if (buffer) {
+
+            free(block);
+        }
+    }
+
+private:
+    static const uint32_t MAX_BUCKETS = 16;
+    static const uint32_t MAX_FREE_PER_BUCKET = 4;
+
+    struct Key {
+        uint32_t channels;
+        uint32_t format;
+        uint32_t rate;
+        uint32_t frames; /**< rounded up to a multiple of 16. */
+        size_t bytes; /**< rounded up to a multiple of the cache line. */
+
+        bool operator==(const Key &right) const
+        {
+            return channels == right.channels && format == right.format &&
+                   rate == right.rate && frames == right.frames;
+        }
+    };
+
+    /** The key of a buffer is stored right before it, on its own cache line. */
+    static const size_t HEADER_SIZE = CACHE_LINE_SIZE;
+
+    struct Bucket {
+        Key key;
+        uint32_t nbFree;
+        void *free[MAX_FREE_PER_BUCKET];
+    };
+
+    struct Pool {
+        pthread_mutex_t lock;
+        uint32_t nbBuckets;
+        Bucket buckets[MAX_BUCKETS];
+    };
+
+    static Pool &getPool()
+    {
+        static Pool pool = { PTHREAD_MUTEX_INITIALIZER, 0 };
+        return pool;
+    }
+
+    static Key getKey(const SampleSpec &ss, size_t frames)
+    {
+        Key key;
+        key.channels = ss.getChannelCount();
+        key.format = ss.getFormat();
+        key.rate = ss.getSampleRate();
+        key.frames = (frames + FRAME_ALIGNMENT - 1) & ~(FRAME_ALIGNMENT - 1);
+        key.bytes = (key.frames * ss.getFrameSize() + CACHE_LINE_SIZE - 1) &
+                    ~(CACHE_LINE_SIZE - 1);
+        return key;
+    }
+
+    static Bucket *find(Pool &pool, const Key &key)
+    {
+        for (uint32_t i = 0; i < pool.nbBuckets; i++) {
+
+            if (pool.buckets[i].key == key) {
+
+                return &pool.buckets[i];
+            }
+        }
+        return NULL;
+    }
+
+    /** Same as the 16 of AudioUtils::alignOn16, but rounding up to hold a whole period. */
+    static const uint32_t FRAME_ALIGNMENT = 16;
+};
+
+/**
+ * Buffer of a stream, taken from AudioBufferPool.
+ * configure() is called when the stream is opened or reconfigured: the buffer is kept if it
+ * already has the size asked for, otherwise it goes back to the pool and one of the new size
+ * is taken. The buffer is released when the object is destroyed.
+ */
+class AudioPoolBuffer
+{
+public:
+    AudioPoolBuffer() : _data(NULL), _bytes(0), _frames(0) {}
+
+    ~AudioPoolBuffer() { AudioBufferPool::release(_data); }
+
+    /**
+     * Makes the buffer hold frames of ss.
+     *
+     * @param[in] ss sample specifications of the buffer.
+     * @param[in] frames number of frames, e.g. a period.
+     *
+     * @return false if out of memory.
+     */
+    bool configure(const SampleSpec &ss, size_t frames)
+    {
+        if (_data && ss.getChannelCount() == _ss.getChannelCount() &&
+            ss.getFormat() == _ss.getFormat() && ss.getSampleRate() == _ss.getSampleRate() &&
+            frames == _frames) {
+
+            return true;
+        }
+        AudioBufferPool::release(_data);
+        _data = AudioBufferPool::acquire(ss, frames, &_bytes);
+        if (!_data) {
+
+            _bytes = 0;
+            _frames = 0;
+            return false;
+        }
+        _ss = ss;
+        _frames = frames;
+        return true;
+    }
+
+    /**
+     * Makes the buffer hold the conversion of srcFrames of ssSrc to ssDst, as sized by
+     * AudioUtils::convertSrcToDstInFrames, e.g. the output of the resampler for a period.
+     *
+     * @param[in] ssSrc source sample specifications.
+     * @param[in] ssDst destination sample specifications, those of the buffer.
+     * @param[in] srcFrames number of frames in the source sample specification.
+     *
+     * @return false if out of memory.
+     */
+    bool configure(const SampleSpec &ssSrc, const SampleSpec &ssDst, size_t srcFrames)
+    {
+        return configure(ssDst, SrcToDstRatio(ssSrc, ssDst).convertSrcToDstInFrames(srcFrames));
+    }
+
+    void *data() const { return _data; }
+
+    /** Size of the buffer in bytes, at least the frames asked for. */
+    size_t size() const { return _bytes; }
+
+private:
+    AudioPoolBuffer(const AudioPoolBuffer &);
+    AudioPoolBuffer &operator=(const AudioPoolBuffer &);
+
+    void *_data;
+    size_t _bytes;
+    size_t _frames;
+    SampleSpec _ss;
+};
+
+}; // namespace android
@@ -17,6 +17,7 @@
 
 #include "SampleSpec.h"
 #include <tinyalsa/asoundlib.h>
+#include <assert.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -42,7 +43,9 @@ public:
      * It translates a number of bytes in the source sample specification to a number of bytes
      * in the destination sample specification corresponding to the same period of time represented
      * by the source bytes.
-     * This function asserts if overflow is detected.
+     * This function asserts if overflow is detected. The period and conversion buffers of the
+     * streams should come from AudioPoolBuffer, which sizes them the same way and keeps them
+     * across stream opens and route changes.
      *
      * @param[in] bytes in the source sample specification.
      * @param[in] ssSrc source sample specifications.
@@ -97,7 +100,8 @@ public:
      * Converts a card name into its index.
      * Tiny ALSA does not provide any utility to translate a name into a card index.
      * This function gets information from procfs to translate a card name into the corresponding
-     * index
+     * index. Streams opened on each route change should use SoundCardTable::getCardIndexByName,
+     * which keeps the answer until a sound card hotplug uevent.
      *
      * @param[in] name of the sound card.
      *
@@ -134,5 +138,117 @@ private:
     static const uint32_t FRAME_ALIGNEMENT_ON_16 = 16; /**< 16 is an audioflinger requirement. */
 };
 
+/**
+ * Precomputed source to destination conversion of a stream.
+ * Built once when the stream is opened, it gives the same results as
+ * AudioUtils::convertSrcToDstInFrames and AudioUtils::convertSrcToDstInBytes for the
+ * sample specifications it was built with (round up of frames * dstRate / srcRate), without
+ * a 64 bits division per buffer: the rate ratio is reduced and the divisions by its
+ * denominator and by the source frame size are done with a fixed point reciprocal, corrected
+ * by the remainder. Only conversions whose intermediate result does not fit on 32 bits fall
+ * back to the 64 bits computation.
+ */
+class SrcToDstRatio
+{
+public:
+    /**
+     * @param[in] ssSrc source sample specifications.
+     * @param[in] ssDst destination sample specifications.
+     */
+    SrcToDstRatio(const SampleSpec &ssSrc, const SampleSpec &ssDst)
+    {
+        assert(ssSrc.getSampleRate() != 0);
+        assert(ssSrc.getFrameSize() != 0);
+        uint32_t gcd = computeGcd(ssSrc.getSampleRate(), ssDst.getSampleRate());
+        _num = ssDst.getSampleRate() / gcd;
+        _rate.init(ssSrc.getSampleRate() / gcd);
+        _srcFrame.init(ssSrc.getFrameSize());
+        _dstFrameSize = ssDst.getFrameSize();
+        _maxFastFrames = _num ? (MAX_UINT32 - (_rate.divisor - 1)) / _num : MAX_UINT32;
+    }
+
+    /**
+     * Same as AudioUtils::convertSrcToDstInFrames.
+     *
+     * @param[in] frames in the source sample specification.
+     *
+     * @return number of frames in the destination sample specification.
+     */
+    size_t convertSrcToDstInFrames(size_t frames) const
+    {
+        if (frames <= _maxFastFrames) {
+
+            return _rate.divide(static_cast<uint32_t>(frames) * _num + _rate.divisor - 1);
+        }
+        uint64_t dstFrames = (static_cast<uint64_t>(frames) * _num + _rate.divisor - 1) /
+                             _rate.divisor;
+        assert(dstFrames <= MAX_UINT32);
+        return dstFrames;
+    }
+
+    /**
+     * Same as AudioUtils::convertSrcToDstInBytes.
+     *
+     * @param[in] bytes in the source sample specification.
+     *
+     * @return number of bytes in the destination sample specification.
+     */
+    size_t convertSrcToDstInBytes(size_t bytes) const
+    {
+        size_t frames = bytes <= MAX_UINT32 ? _srcFrame.divide(static_cast<uint32_t>(bytes)) :
+                                              bytes / _srcFrame.divisor;
+        return convertSrcToDstInFrames(frames) * _dstFrameSize;
+    }
+
+private:
+    /**
+     * Division of 32 bits values by a constant: the quotient estimated with the reciprocal
+     * is at most one below the exact one, the remainder tells when to correct it.
+     */
+    struct Divider {
+        void init(uint32_t d)
+        {
+            divisor = d;
+            reciprocal = d > 1 ? static_cast<uint32_t>((static_cast<uint64_t>(1) << 32) / d) : 0;
+        }
+
+        uint32_t divide(uint32_t n) const
+        {
+            if (divisor == 1) {
+
+                return n;
+            }
+            uint32_t q = static_cast<uint32_t>((static_cast<uint64_t>(n) * reciprocal) >> 32);
+            if (n - q * divisor >= divisor) {
+
+                q++;
+            }
+            return q;
+        }
+
+        uint32_t divisor;
+        uint32_t reciprocal; /**< floor(2^32 / divisor). */
+    };
+
+    static uint32_t computeGcd(uint32_t a, uint32_t b)
+    {
+        while (b) {
+
+            uint32_t r = a % b;
+            a = b;
+            b = r;
+        }
+        return a;
+    }
+
+    static const uint32_t MAX_UINT32 = 0xFFFFFFFF;
+
+    uint32_t _num; /**< reduced destination rate. */
+    Divider _rate; /**< by the reduced source rate. */
+    Divider _srcFrame; /**< by the source frame size. */
+    size_t _dstFrameSize;
+    size_t _maxFastFrames; /**< largest frames count for the 32 bits path. */
+};
+
 }; // namespace android
 
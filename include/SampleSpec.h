@@ -202,5 +202,89 @@ private:
     static const uint32_t MAX_CHANNELS = 32; /**< supports until 32 channels. */
 };
 
+/**
+ * Sample specifications fixed at compile time.
+ * Same conversion API as SampleSpec for the configurations used on the audio write path
+ * (see the typedefs below): frame size and rate are constants, so the conversions reduce
+ * to shifts and multiplications by constants, and the usec conversions use a 32 bits
+ * multiply/divide by a constant as long as the result cannot overflow. Results are the
+ * same as the SampleSpec conversions for the same channels, format and rate.
+ */
+template <uint32_t channelCount, uint32_t format, uint32_t sampleRate>
+class FixedSampleSpec {
+
+public:
+    uint32_t getChannelCount() const { return channelCount; }
+    uint32_t getSampleRate() const { return sampleRate; }
+    audio_format_t getFormat() const { return static_cast<audio_format_t>(format); }
+
+    bool isMono() const { return channelCount == 1; }
+
+    bool isStereo() const { return channelCount == 2; }
+
+    size_t getFrameSize() const { return FRAME_SIZE; }
+
+    size_t convertBytesToFrames(size_t bytes) const { return bytes / FRAME_SIZE; }
+
+    size_t convertFramesToBytes(size_t frames) const { return frames * FRAME_SIZE; }
+
+    size_t convertFramesToUsec(uint32_t frames) const {
+
+        if (frames <= MAX_UINT32 / USEC_NUM) {
+
+            return (frames * USEC_NUM) / USEC_DEN;
+        }
+        return (static_cast<uint64_t>(frames) * USEC_NUM) / USEC_DEN;
+    }
+
+    size_t convertUsecToframes(uint32_t intervalUsec) const {
+
+        if (intervalUsec <= MAX_UINT32 / USEC_DEN) {
+
+            return (intervalUsec * USEC_DEN) / USEC_NUM;
+        }
+        return (static_cast<uint64_t>(intervalUsec) * USEC_DEN) / USEC_NUM;
+    }
+
+    /**
+     * Dynamic sample spec equivalent, for the APIs taking a SampleSpec.
+     */
+    SampleSpec toSampleSpec() const { return SampleSpec(channelCount, format, sampleRate); }
+
+private:
+    template <uint32_t a, uint32_t b>
+    struct Gcd {
+        static const uint32_t value = Gcd<b, a % b>::value;
+    };
+    template <uint32_t a>
+    struct Gcd<a, 0> {
+        static const uint32_t value = a;
+    };
+
+    template <uint32_t fmt, int dummy = 0>
+    struct BytesPerSample;
+    template <int dummy>
+    struct BytesPerSample<AUDIO_FORMAT_PCM_16_BIT, dummy> {
+        static const uint32_t value = 2;
+    };
+    template <int dummy>
+    struct BytesPerSample<AUDIO_FORMAT_PCM_8_24_BIT, dummy> {
+        static const uint32_t value = 4;
+    };
+
+    static const uint32_t FRAME_SIZE = channelCount * BytesPerSample<format>::value;
+
+    static const uint32_t MAX_UINT32 = 0xFFFFFFFF;
+    static const uint32_t USEC_PER_SEC = 1000000; /**<  to convert sec to-from microseconds. */
+    /** usec per frame as the reduced fraction USEC_NUM / USEC_DEN. */
+    static const uint32_t USEC_NUM = USEC_PER_SEC / Gcd<USEC_PER_SEC, sampleRate>::value;
+    static const uint32_t USEC_DEN = sampleRate / Gcd<USEC_PER_SEC, sampleRate>::value;
+};
+
+typedef FixedSampleSpec<2, AUDIO_FORMAT_PCM_16_BIT, 48000> StereoS16At48kSampleSpec;
+typedef FixedSampleSpec<2, AUDIO_FORMAT_PCM_16_BIT, 44100> StereoS16At44k1SampleSpec;
+typedef FixedSampleSpec<1, AUDIO_FORMAT_PCM_16_BIT, 16000> MonoS16At16kSampleSpec;
+typedef FixedSampleSpec<1, AUDIO_FORMAT_PCM_16_BIT, 8000> MonoS16At8kSampleSpec;
+
 }; // namespace android
 
@@ -0,0 +1,278 @@
+/*
+ **
+ ** Copyright 2013 Intel Corporation
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **      http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+#pragma once
+
+#include "SampleSpec.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace android_audio_legacy {
+
+/**
+ * Channel and format converter between two sample specifications of the same rate.
+ * configure() compiles the channel policies, channel counts and formats of a stream into a
+ * mapping and picks the kernel for it once: plain copy, mono to stereo and stereo to mono
+ * (SSE2 when available), format only, or the generic per channel mapping. convert() then
+ * only runs that kernel on each buffer.
+ *
+ * Channel mapping, for each destination channel:
+ *      -Ignore: silence.
+ *      -Average: average of the valid (non Ignore) source channels.
+ *      -Copy: the source channel of the same index if it is valid and the destination is not
+ *       mono, otherwise the source Average channel if any, otherwise the average of the
+ *       valid source channels (so that a downmix to mono keeps all the channels).
+ * Supported formats are AUDIO_FORMAT_PCM_16_BIT and AUDIO_FORMAT_PCM_8_24_BIT.
+ */
+class SampleSpecRemixer
+{
+public:
+    SampleSpecRemixer()
+        : _kernel(NULL), _srcChannels(0), _dstChannels(0), _srcFrameSize(0), _dstFrameSize(0) {}
+
+    /**
+     * Builds the mapping from ssSrc to ssDst.
+     *
+     * @param[in] ssSrc source sample specifications.
+     * @param[in] ssDst destination sample specifications.
+     *
+     * @return false if the conversion needs resampling or a format is not supported.
+     */
+    bool configure(const SampleSpec &ssSrc, const SampleSpec &ssDst)
+    {
+        _kernel = NULL;
+        if (ssSrc.getSampleRate() != ssDst.getSampleRate() ||
+            !isSupportedFormat(ssSrc.getFormat()) || !isSupportedFormat(ssDst.getFormat()) ||
+            !ssSrc.getChannelCount() || ssSrc.getChannelCount() > MAX_CHANNELS ||
+            !ssDst.getChannelCount() || ssDst.getChannelCount() > MAX_CHANNELS) {
+
+            return false;
+        }
+        _srcChannels = ssSrc.getChannelCount();
+        _dstChannels = ssDst.getChannelCount();
+        _srcIs16 = ssSrc.getFormat() == AUDIO_FORMAT_PCM_16_BIT;
+        _dstIs16 = ssDst.getFormat() == AUDIO_FORMAT_PCM_16_BIT;
+        _srcFrameSize = ssSrc.getFrameSize();
+        _dstFrameSize = ssDst.getFrameSize();
+
+        // Valid source channels and the source "Average" channel, if any.
+        uint32_t valid[MAX_CHANNELS];
+        uint32_t nbValid = 0;
+        int averageChannel = -1;
+        for (uint32_t c = 0; c < _srcChannels; c++) {
+
+            SampleSpec::ChannelsPolicy policy = ssSrc.getChannelsPolicy(c);
+            if (policy != SampleSpec::Ignore) {
+
+                valid[nbValid++] = c;
+            }
+            if (policy == SampleSpec::Average && averageChannel < 0) {
+
+                averageChannel = c;
+            }
+        }
+
+        bool directCopy = (_srcChannels == _dstChannels);
+        for (uint32_t d = 0; d < _dstChannels; d++) {
+
+            Mix &mix = _mix[d];
+            mix.nbSources = 0;
+            SampleSpec::ChannelsPolicy policy = ssDst.getChannelsPolicy(d);
+            if (policy == SampleSpec::Copy && d < _srcChannels &&
+                (_dstChannels > 1 || _srcChannels == 1) &&
+                ssSrc.getChannelsPolicy(d) != SampleSpec::Ignore) {
+
+                mix.sources[mix.nbSources++] = d;
+            } else if (policy == SampleSpec::Copy && averageChannel >= 0) {
+
+                mix.sources[mix.nbSources++] = averageChannel;
+            } else if (policy != SampleSpec::Ignore) {
+
+                for (uint32_t i = 0; i < nbValid; i++) {
+
+                    mix.sources[mix.nbSources++] = valid[i];
+                }
+            }
+            directCopy = directCopy && mix.nbSources == 1 && mix.sources[0] == d;
+        }
+
+        // Pick the kernel.
+        if (directCopy && _srcIs16 == _dstIs16) {
+
+            _kernel = &SampleSpecRemixer::convertCopy;
+        } else if (directCopy) {
+
+            _kernel = &SampleSpecRemixer::convertFormat;
+        } else if (_srcIs16 && _dstIs16 && _srcChannels == 1 && _dstChannels == 2 &&
+                   _mix[0].nbSources == 1 && _mix[1].nbSources == 1) {
+
+            _kernel = &SampleSpecRemixer::convertMonoToStereo16;
+        } else if (_srcIs16 && _dstIs16 && _srcChannels == 2 && _dstChannels == 1 &&
+                   _mix[0].nbSources == 2) {
+
+            _kernel = &SampleSpecRemixer::convertStereoToMono16;
+        } else {
+
+            _kernel = &SampleSpecRemixer::convertGeneric;
+        }
+        return true;
+    }
+
+    /**
+     * Converts frames from the source to the destination sample specification.
+     *
+     * @param[in] src source buffer, in the source sample specification.
+     * @param[out] dst destination buffer, large enough for frames in the destination spec.
+     * @param[in] frames number of frames to convert.
+     *
+     * @return number of bytes written in dst.
+     */
+    size_t convert(const void *src, void *dst, size_t frames) const
+    {
+        if (!_kernel) {
+
+            return 0;
+        }
+        (this->*_kernel)(src, dst, frames);
+        return frames * _dstFrameSize;
+    }
+
+private:
+    typedef void (SampleSpecRemixer::*Kernel)(const void *src, void *dst, size_t frames) const;
+
+    static const uint32_t MAX_CHANNELS = 32; /**< same limit as SampleSpec. */
+    static const int32_t MAX_S16 = 32767;
+    static const int32_t MIN_S16 = -32768;
+
+    struct Mix {
+        uint32_t nbSources;
+        uint32_t sources[MAX_CHANNELS];
+    };
+
+    static bool isSupportedFormat(audio_format_t format)
+    {
+        return format == AUDIO_FORMAT_PCM_16_BIT || format == AUDIO_FORMAT_PCM_8_24_BIT;
+    }
+
+    // Samples are handled in the 8.24 domain by the generic kernels.
+    int32_t readSample(const void *src, size_t index) const
+    {
+        return _srcIs16 ? static_cast<int32_t>(static_cast<const int16_t *>(src)[index]) << 8 :
+                          static_cast<const int32_t *>(src)[index];
+    }
+
+    void writeSample(void *dst, size_t index, int32_t sample) const
+    {
+        if (_dstIs16) {
+
+            sample >>= 8;
+            static_cast<int16_t *>(dst)[index] =
+                sample > MAX_S16 ? MAX_S16 : sample < MIN_S16 ? MIN_S16 : sample;
+        } else {
+
+            static_cast<int32_t *>(dst)[index] = sample;
+        }
+    }
+
+    void convertCopy(const void *src, void *dst, size_t frames) const
+    {
+        memcpy(dst, src, frames * _srcFrameSize);
+    }
+
+    void convertFormat(const void *src, void *dst, size_t frames) const
+    {
+        size_t samples = frames * _srcChannels;
+        for (size_t i = 0; i < samples; i++) {
+
+            writeSample(dst, i, readSample(src, i));
+        }
+    }
+
+    void convertMonoToStereo16(const void *src, void *dst, size_t frames) const
+    {
+        const int16_t *in = static_cast<const int16_t *>(src);
+        int16_t *out = static_cast<int16_t *>(dst);
+        size_t i = 0;
+#ifdef __SSE2__
+        for (; i + 8 <= frames; i += 8) {
+
+            __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i),
+                             _mm_unpacklo_epi16(samples, samples));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 8),
+                             _mm_unpackhi_epi16(samples, samples));
+        }
+#endif
+        for (; i < frames; i++) {
+
+            out[2 * i] = out[2 * i + 1] = in[i];
+        }
+    }
+
+    void convertStereoToMono16(const void *src, void *dst, size_t frames) const
+    {
+        const int16_t *in = static_cast<const int16_t *>(src);
+        int16_t *out = static_cast<int16_t *>(dst);
+        size_t i = 0;
+#ifdef __SSE2__
+        // (l + r) >> 1, computed on 32 bits to match the scalar path.
+        for (; i + 4 <= frames; i += 4) {
+
+            __m128i lr = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2 * i));
+            __m128i sum = _mm_srai_epi32(_mm_madd_epi16(lr, _mm_set1_epi16(1)), 1);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(sum, sum));
+        }
+#endif
+        for (; i < frames; i++) {
+
+            out[i] = (static_cast<int32_t>(in[2 * i]) + in[2 * i + 1]) >> 1;
+        }
+    }
+
+    void convertGeneric(const void *src, void *dst, size_t frames) const
+    {
+        for (size_t f = 0; f < frames; f++) {
+
+            for (uint32_t d = 0; d < _dstChannels; d++) {
+
+                const Mix &mix = _mix[d];
+                int64_t sum = 0;
+                for (uint32_t i = 0; i < mix.nbSources; i++) {
+
+                    sum += readSample(src, f * _srcChannels + mix.sources[i]);
+                }
+                writeSample(dst, f * _dstChannels + d,
+                            mix.nbSources ? static_cast<int32_t>(sum / (int32_t)mix.nbSources) : 0);
+            }
+        }
+    }
+
+    Kernel _kernel; /**< conversion picked by configure(). */
+    uint32_t _srcChannels;
+    uint32_t _dstChannels;
+    size_t _srcFrameSize;
+    size_t _dstFrameSize;
+    bool _srcIs16;
+    bool _dstIs16;
+    Mix _mix[MAX_CHANNELS]; /**< source channels mixed into each destination channel. */
+};
+
+}; // namespace android
@@ -0,0 +1,194 @@
+/*
+ ** Copyright 2013 Intel Corporation
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **      http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+
+namespace android_audio_legacy {
+
+/**
+ * Process wide table of the ALSA card names.
+ * getCardIndexByName() gives the same answer as AudioUtils::getCardIndexByName, but
+ * /proc/asound/cards is only parsed when the table is built, not on each stream open or route
+ * change. The table is rebuilt after a uevent of the sound subsystem (card hotplug, e.g. HDMI
+ * audio appearing or disappearing), and when a name is not in the table, in case the uevent of
+ * a new card has not been received yet. Uevents are read from a non blocking netlink socket
+ * drained on each lookup, so no listener thread is needed. If the socket cannot be opened, the
+ * cards are parsed on each lookup.
+ */
+class SoundCardTable
+{
+public:
+    /**
+     * Converts a card name into its index.
+     *
+     * @param[in] name of the sound card.
+     *
+     * @return index if found, negative value otherwise.
+     */
+    static int getCardIndexByName(const char *name)
+    {
+        Table &table = getTable();
+        pthread_mutex_lock(&table.lock);
+
+        if (table.ueventFd < 0) {
+
+            table.ueventFd = openUeventSocket();
+            table.valid = false;
+        }
+        if (table.ueventFd < 0 || hasSoundUevent(table.ueventFd)) {
+
+            table.valid = false;
+        }
+        if (!table.valid) {
+
+            table.valid = load(table);
+        }
+        int index = find(table, name);
+        if (index < 0) {
+
+            // May be a card whose uevent is not there yet.
+            table.valid = load(table);
+            index = find(table, name);
+        }
+
+        pthread_mutex_unlock(&table.lock);
+        return index;
+    }
+
+private:
+    static const uint32_t MAX_CARDS = 8; /**< same as SNDRV_CARDS. */
+    static const uint32_t MAX_CARD_ID = 32; /**< card id length in the kernel, with the 0. */
+    static const size_t UEVENT_MSG_LEN = 2048;
+
+    struct Card {
+        int index;
+        char id[MAX_CARD_ID];
+    };
+
+    struct Table {
+        pthread_mutex_t lock;
+        int ueventFd;
+        bool valid;
+        uint32_t nbCards;
+        Card cards[MAX_CARDS];
+    };
+
+    static Table &getTable()
+    {
+        static Table table = { PTHREAD_MUTEX_INITIALIZER, -1, false, 0 };
+        return table;
+    }
+
+    static int openUeventSocket()
+    {
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_pid = 0; // let the kernel pick a port, others may listen in this process
+        addr.nl_groups = 0xffffffff;
+
+        int fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+        if (fd < 0) {
+
+            return -1;
+        }
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+            bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /**
+     * Drains the pending uevents.
+     *
+     * @return true if one of them is from the sound subsystem.
+     */
+    static bool hasSoundUevent(int fd)
+    {
+        char msg[UEVENT_MSG_LEN + 2];
+        bool sound = false;
+        ssize_t len;
+        while ((len = recv(fd, msg, UEVENT_MSG_LEN, 0)) > 0) {
+
+            msg[len] = msg[len + 1] = '\0';
+            for (const char *key = msg; *key; key += strlen(key) + 1) {
+
+                if (!strcmp(key, "SUBSYSTEM=sound")) {
+
+                    sound = true;
+                    break;
+                }
+            }
+        }
+        if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+
+            // Uevents may have been lost (ENOBUFS): do not trust the table.
+            sound = true;
+        }
+        return sound;
+    }
+
+    /**
+     * Parses /proc/asound/cards, whose card lines read "<index> [<id> ]: <driver> - <name>".
+     */
+    static bool load(Table &table)
+    {
+        table.nbCards = 0;
+        FILE *cards = fopen("/proc/asound/cards", "r");
+        if (!cards) {
+
+            return false;
+        }
+        char line[256];
+        while (table.nbCards < MAX_CARDS && fgets(line, sizeof(line), cards)) {
+
+            Card &card = table.cards[table.nbCards];
+            if (sscanf(line, "%d [%31[^] ]", &card.index, card.id) == 2) {
+
+                table.nbCards++;
+            }
+        }
+        fclose(cards);
+        return true;
+    }
+
+    static int find(const Table &table, const char *name)
+    {
+        for (uint32_t i = 0; i < table.nbCards; i++) {
+
+            if (!strcmp(table.cards[i].id, name)) {
+
+                return table.cards[i].index;
+            }
+        }
+        return -ENODEV;
+    }
+};
+
+}; // namespace android
@@ -0,0 +1,354 @@
+/******************************************************************************
+
+File Name:          iasrc_pipeline.h
+Description:        Single-context s16 -> float -> resample -> output format
+                    pipeline on top of the iasrc_resampler API
+
+******************************************************************************/
+#ifndef IASRC_PIPELINE_H
+#define IASRC_PIPELINE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "iasrc_resampler.h"
+
+/*
+    A period is processed in blocks of IASRC_PIPELINE_BLOCK_FRAMES frames:
+    each block is converted to float, resampled and converted to the output
+    format while it is still in L1, instead of making three passes over the
+    whole period with period-sized intermediate buffers.
+*/
+#define IASRC_PIPELINE_BLOCK_FRAMES	256
+#define IASRC_PIPELINE_MAX_CHANNELS	8
+#define IASRC_PIPELINE_MAX_BATCH	8	/* streams per batch call */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	struct iasrc_pipeline {
+		void *ctx;
+		int num_channels;
+		int iprate;
+		int oprate;
+		unsigned out_block_frames;	/* output capacity per block */
+		float *in_block;
+		float *out_block;
+	};
+
+	/*
+	 * Create the resampler and the block buffers of a pipeline
+	 */
+	static inline int iasrc_pipeline_init(struct iasrc_pipeline *p,
+					      int num_channels,
+					      int iprate, int oprate)
+	{
+		int ret;
+
+		if (num_channels <= 0
+		    || num_channels > IASRC_PIPELINE_MAX_CHANNELS
+		    || iprate <= 0 || oprate <= 0)
+			return -1;
+
+		p->ctx = NULL;
+		p->num_channels = num_channels;
+		p->iprate = iprate;
+		p->oprate = oprate;
+		/* Rounded up, plus one frame of filter phase slack */
+		p->out_block_frames = (unsigned)(((int64_t)IASRC_PIPELINE_BLOCK_FRAMES
+						  * oprate + iprate - 1) / iprate) + 1;
+		p->in_block = (float *)malloc(IASRC_PIPELINE_BLOCK_FRAMES
+					      * num_channels * sizeof(float));
+		p->out_block = (float *)malloc(p->out_block_frames
+					       * num_channels * sizeof(float));
+		if (!p->in_block || !p->out_block)
+			goto free_blocks;
+
+		ret = iaresamplib_new(&p->ctx, num_channels, iprate, oprate);
+		if (ret < 0 || !p->ctx)
+			goto free_blocks;
+		return 0;
+
+free_blocks:
+		free(p->in_block);
+		free(p->out_block);
+		p->in_block = p->out_block = NULL;
+		return -1;
+	}
+
+	/*
+	 * Free the resampler and the block buffers
+	 */
+	static inline void iasrc_pipeline_free(struct iasrc_pipeline *p)
+	{
+		if (p->ctx)
+			iaresamplib_delete(&p->ctx);
+		free(p->in_block);
+		free(p->out_block);
+		p->in_block = p->out_block = NULL;
+	}
+
+	/*
+	 * Resample one block of in_n_frames (<= IASRC_PIPELINE_BLOCK_FRAMES)
+	 * frames to out, returns the number of frames written or < 0.
+	 */
+	static inline int iasrc_pipeline_process_block(struct iasrc_pipeline *p,
+						       int16_t *in,
+						       unsigned in_n_frames,
+						       int32_t *out,
+						       int16_t *vol)
+	{
+		unsigned out_n_frames = p->out_block_frames;
+		int ret;
+
+		iaresamplib_convert_short_2_float(in, p->in_block,
+						  in_n_frames * p->num_channels);
+		ret = iaresamplib_process_float(p->ctx, p->in_block, in_n_frames,
+						p->out_block, &out_n_frames);
+		if (ret < 0)
+			return ret;
+		iaresamplib_convert_2_output_format(p->out_block, out,
+						    out_n_frames * p->num_channels,
+						    p->num_channels, vol);
+		return (int)out_n_frames;
+	}
+
+	/*
+	 * Resample a period: s16 interleaved in, output format (with volume)
+	 * out. *out_n_frames is the capacity of out on entry and the number of
+	 * frames written on return.
+	 */
+	static inline int iasrc_pipeline_process(struct iasrc_pipeline *p,
+						 int16_t *in,
+						 unsigned in_n_frames,
+						 int32_t *out,
+						 unsigned *out_n_frames,
+						 int16_t *vol)
+	{
+		unsigned capacity = *out_n_frames;
+		unsigned done = 0;
+		int ret;
+
+		*out_n_frames = 0;
+		while (done < in_n_frames) {
+			unsigned n = in_n_frames - done;
+
+			if (n > IASRC_PIPELINE_BLOCK_FRAMES)
+				n = IASRC_PIPELINE_BLOCK_FRAMES;
+			if (*out_n_frames + (unsigned)(((int64_t)n * p->oprate
+							+ p->iprate - 1) / p->iprate) + 1
+			    > capacity)
+				return -1;
+			ret = iasrc_pipeline_process_block(p,
+					in + done * p->num_channels, n,
+					out + *out_n_frames * p->num_channels,
+					vol);
+			if (ret < 0)
+				return ret;
+			*out_n_frames += ret;
+			done += n;
+		}
+		return 0;
+	}
+
+	/*
+	 * Resample a period of several streams with the same iprate/oprate
+	 * pair (e.g. music, notification and voice prompt in the mixer).
+	 * The streams are processed block by block in turn, so the polyphase
+	 * coefficient tables of the rate pair, which the resampler keeps per
+	 * conversion, stay in cache across streams instead of being reloaded
+	 * for each one. Arguments are per stream, as for
+	 * iasrc_pipeline_process().
+	 */
+	static inline int iasrc_pipeline_process_batch(struct iasrc_pipeline **p,
+						       unsigned n_streams,
+						       int16_t **in,
+						       unsigned *in_n_frames,
+						       int32_t **out,
+						       unsigned *out_n_frames,
+						       int16_t **vol)
+	{
+		unsigned capacity[IASRC_PIPELINE_MAX_BATCH];
+		unsigned done[IASRC_PIPELINE_MAX_BATCH];
+		unsigned i, pending;
+		int ret;
+
+		if (n_streams > IASRC_PIPELINE_MAX_BATCH)
+			return -1;
+		for (i = 0; i < n_streams; i++) {
+			if (p[i]->iprate != p[0]->iprate
+			    || p[i]->oprate != p[0]->oprate)
+				return -1;
+			capacity[i] = out_n_frames[i];
+			out_n_frames[i] = 0;
+			done[i] = 0;
+		}
+
+		do {
+			pending = 0;
+			for (i = 0; i < n_streams; i++) {
+				struct iasrc_pipeline *s = p[i];
+				unsigned n = in_n_frames[i] - done[i];
+
+				if (!n)
+					continue;
+				if (n > IASRC_PIPELINE_BLOCK_FRAMES)
+					n = IASRC_PIPELINE_BLOCK_FRAMES;
+				if (out_n_frames[i] + (unsigned)(((int64_t)n * s->oprate
+								  + s->iprate - 1) / s->iprate) + 1
+				    > capacity[i])
+					return -1;
+				ret = iasrc_pipeline_process_block(s,
+						in[i] + done[i] * s->num_channels, n,
+						out[i] + out_n_frames[i] * s->num_channels,
+						vol[i]);
+				if (ret < 0)
+					return ret;
+				out_n_frames[i] += ret;
+				done[i] += n;
+				if (done[i] < in_n_frames[i])
+					pending++;
+			}
+		} while (pending);
+		return 0;
+	}
+
+#ifdef __cplusplus
+}
+
+#include <pthread.h>
+
+/*
+    Process wide cache of idle resampler contexts, keyed by
+    (channels, iprate, oprate), and of iaresamplib_supported_conversion()
+    answers. Stream open and re-routing (HDMI, BT) then take a context that
+    only needs iaresamplib_reset() instead of building the filter state
+    again. C++ only: the cache lives in function statics shared by all
+    users in the process.
+*/
+#define IASRC_CACHE_MAX_CONTEXTS	8
+#define IASRC_CACHE_MAX_CONVERSIONS	32
+
+struct iasrc_cached_context {
+	void *ctx;
+	int num_channels;
+	int iprate;
+	int oprate;
+};
+
+struct iasrc_cached_conversion {
+	int iprate;
+	int oprate;
+	int supported;
+};
+
+struct iasrc_cache {
+	pthread_mutex_t lock;
+	unsigned n_contexts;
+	unsigned n_conversions;
+	struct iasrc_cached_context contexts[IASRC_CACHE_MAX_CONTEXTS];
+	struct iasrc_cached_conversion conversions[IASRC_CACHE_MAX_CONVERSIONS];
+};
+
+inline struct iasrc_cache *iasrc_get_cache()
+{
+	static struct iasrc_cache cache = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+	return &cache;
+}
+
+/*
+ * Same as iaresamplib_supported_conversion(), answered from the cache
+ * after the first call for a rate pair
+ */
+inline int iasrc_supported_conversion_cached(int ip_samplerate,
+					     int op_samplerate)
+{
+	struct iasrc_cache *cache = iasrc_get_cache();
+	unsigned i;
+	int supported;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < cache->n_conversions; i++) {
+		if (cache->conversions[i].iprate == ip_samplerate
+		    && cache->conversions[i].oprate == op_samplerate) {
+			supported = cache->conversions[i].supported;
+			pthread_mutex_unlock(&cache->lock);
+			return supported;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	supported = iaresamplib_supported_conversion(ip_samplerate,
+						     op_samplerate);
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->n_conversions < IASRC_CACHE_MAX_CONVERSIONS) {
+		i = cache->n_conversions++;
+		cache->conversions[i].iprate = ip_samplerate;
+		cache->conversions[i].oprate = op_samplerate;
+		cache->conversions[i].supported = supported;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return supported;
+}
+
+/*
+ * Same as iaresamplib_new(), reusing an idle context of the same
+ * configuration when the cache has one
+ */
+inline int iasrc_new_cached(void **ctx, int num_channels,
+			    int iprate, int oprate)
+{
+	struct iasrc_cache *cache = iasrc_get_cache();
+	unsigned i;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < cache->n_contexts; i++) {
+		struct iasrc_cached_context *c = &cache->contexts[i];
+
+		if (c->num_channels == num_channels
+		    && c->iprate == iprate && c->oprate == oprate) {
+			*ctx = c->ctx;
+			*c = cache->contexts[--cache->n_contexts];
+			pthread_mutex_unlock(&cache->lock);
+			/* Reset when taken, so release is cheap on the audio path */
+			return iaresamplib_reset(*ctx);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return iaresamplib_new(ctx, num_channels, iprate, oprate);
+}
+
+/*
+ * Gives a context from iasrc_new_cached() back to the cache, or frees it
+ * with iaresamplib_delete() when the cache is full
+ */
+inline int iasrc_delete_cached(void **ctx, int num_channels,
+			       int iprate, int oprate)
+{
+	struct iasrc_cache *cache = iasrc_get_cache();
+
+	if (!*ctx)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->n_contexts < IASRC_CACHE_MAX_CONTEXTS) {
+		struct iasrc_cached_context *c =
+			&cache->contexts[cache->n_contexts++];
+
+		c->ctx = *ctx;
+		c->num_channels = num_channels;
+		c->iprate = iprate;
+		c->oprate = oprate;
+		pthread_mutex_unlock(&cache->lock);
+		*ctx = NULL;
+		return 0;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return iaresamplib_delete(ctx);
+}
+#endif
+#endif				/*IASRC_PIPELINE_H */
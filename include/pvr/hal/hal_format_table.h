@@ -0,0 +1,219 @@
+/* Copyright (c) Imagination Technologies Ltd.
+ *
+ * The contents of this file are subject to the MIT license as set out below.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef HAL_FORMAT_TABLE_H
+#define HAL_FORMAT_TABLE_H
+
+/* Users of the gralloc HAL which resolve a format on each allocation can
+ * flatten the linked list of GetBufferFormats() into this table once, when
+ * they load the module, and then find a format without walking the list.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "hal_public.h"
+
+/* The Android formats are small, they are indexed directly */
+#define IMG_FORMAT_TABLE_DIRECT		0x200
+
+/* The vendor formats are fourccs, they are hashed. Must be a power of 2. */
+#define IMG_FORMAT_TABLE_HASHED		64
+
+/* Recent results of pfnComputeParams. Must be a power of 2. */
+#define IMG_FORMAT_PARAMS_CACHE		64
+
+typedef struct
+{
+	/* All the inputs of pfnComputeParams */
+	const IMG_buffer_format_public_t *psFormat;
+	unsigned int uiPlane;
+	int iWidth, iHeight, iStride, iVStride;
+	unsigned long ulPlaneOffset;
+
+	/* And its results */
+	int iResult;
+	int iOutWidth, iOutHeight, iOutStride, iOutVStride;
+	unsigned long ulOutPlaneOffset;
+}
+IMG_buffer_format_params_t;
+
+typedef struct
+{
+	/* The list, for the formats which did not fit in the table */
+	const IMG_buffer_format_public_t *psHead;
+
+	const IMG_buffer_format_public_t *apsDirect[IMG_FORMAT_TABLE_DIRECT];
+	const IMG_buffer_format_public_t *apsHashed[IMG_FORMAT_TABLE_HASHED];
+	int bOverflow;
+
+	pthread_mutex_t sParamsLock;
+	IMG_buffer_format_params_t asParams[IMG_FORMAT_PARAMS_CACHE];
+}
+IMG_buffer_format_table_t;
+
+static inline unsigned int IMGBufferFormatHash(int iFormat)
+{
+	unsigned int uiHash = (unsigned int)iFormat * 2654435761u;
+	return uiHash >> 16;
+}
+
+/* Fills the table from the list of the module. The table is read only
+ * afterwards, except the cache of parameters which has its own lock.
+ */
+static inline void IMGBufferFormatTableInit(IMG_buffer_format_table_t *psTable,
+	const IMG_gralloc_module_public_t *psModule)
+{
+	const IMG_buffer_format_public_t *psFormat;
+
+	memset(psTable, 0, sizeof(*psTable));
+	pthread_mutex_init(&psTable->sParamsLock, NULL);
+	psTable->psHead = psModule->GetBufferFormats();
+
+	for (psFormat = psTable->psHead; psFormat; psFormat = psFormat->psNext)
+	{
+		int iFormat = psFormat->iHalPixelFormat;
+		unsigned int uiSlot, i;
+
+		if (iFormat >= 0 && iFormat < IMG_FORMAT_TABLE_DIRECT)
+		{
+			/* Like the list walk, the first registration wins */
+			if (!psTable->apsDirect[iFormat])
+				psTable->apsDirect[iFormat] = psFormat;
+			continue;
+		}
+
+		uiSlot = IMGBufferFormatHash(iFormat);
+		for (i = 0; i < IMG_FORMAT_TABLE_HASHED; i++)
+		{
+			const IMG_buffer_format_public_t **ppsSlot =
+				&psTable->apsHashed[(uiSlot + i) & (IMG_FORMAT_TABLE_HASHED - 1)];
+
+			if (!*ppsSlot)
+			{
+				*ppsSlot = psFormat;
+				break;
+			}
+			if ((*ppsSlot)->iHalPixelFormat == iFormat)
+				break;
+		}
+		if (i == IMG_FORMAT_TABLE_HASHED)
+			psTable->bOverflow = 1;
+	}
+}
+
+/* Same result as GetBufferFormat(iFormat), NULL for an unknown format */
+static inline const IMG_buffer_format_public_t *
+IMGBufferFormatTableLookup(const IMG_buffer_format_table_t *psTable, int iFormat)
+{
+	const IMG_buffer_format_public_t *psFormat;
+	unsigned int uiSlot, i;
+
+	if (iFormat >= 0 && iFormat < IMG_FORMAT_TABLE_DIRECT)
+		return psTable->apsDirect[iFormat];
+
+	uiSlot = IMGBufferFormatHash(iFormat);
+	for (i = 0; i < IMG_FORMAT_TABLE_HASHED; i++)
+	{
+		psFormat = psTable->apsHashed[(uiSlot + i) & (IMG_FORMAT_TABLE_HASHED - 1)];
+		if (!psFormat)
+			return NULL;
+		if (psFormat->iHalPixelFormat == iFormat)
+			return psFormat;
+	}
+
+	if (!psTable->bOverflow)
+		return NULL;
+	for (psFormat = psTable->psHead; psFormat; psFormat = psFormat->psNext)
+		if (psFormat->iHalPixelFormat == iFormat)
+			return psFormat;
+	return NULL;
+}
+
+/* Calls pfnComputeParams of the format, or returns its result for the same
+ * inputs from the cache. The parameters are left as they are, and 0 is
+ * returned, when the format has no pfnComputeParams.
+ */
+static inline int IMGBufferFormatTableComputeParams(IMG_buffer_format_table_t *psTable,
+	const IMG_buffer_format_public_t *psFormat, unsigned int uiPlane,
+	int *piWidth, int *piHeight, int *piStride, int *piVStride,
+	unsigned long *pulPlaneOffset)
+{
+	IMG_buffer_format_params_t *psParams;
+	unsigned int uiSlot;
+	int iResult;
+
+	if (!psFormat->pfnComputeParams)
+		return 0;
+
+	uiSlot = IMGBufferFormatHash(psFormat->iHalPixelFormat ^ (int)(uiPlane << 24) ^
+		(*piWidth << 12) ^ *piHeight ^ *piStride ^ *piVStride) &
+		(IMG_FORMAT_PARAMS_CACHE - 1);
+	psParams = &psTable->asParams[uiSlot];
+
+	pthread_mutex_lock(&psTable->sParamsLock);
+	if (psParams->psFormat == psFormat && psParams->uiPlane == uiPlane &&
+		psParams->iWidth == *piWidth && psParams->iHeight == *piHeight &&
+		psParams->iStride == *piStride && psParams->iVStride == *piVStride &&
+		psParams->ulPlaneOffset == *pulPlaneOffset)
+	{
+		*piWidth = psParams->iOutWidth;
+		*piHeight = psParams->iOutHeight;
+		*piStride = psParams->iOutStride;
+		*piVStride = psParams->iOutVStride;
+		*pulPlaneOffset = psParams->ulOutPlaneOffset;
+		iResult = psParams->iResult;
+		pthread_mutex_unlock(&psTable->sParamsLock);
+		return iResult;
+	}
+	pthread_mutex_unlock(&psTable->sParamsLock);
+
+	{
+		IMG_buffer_format_params_t sParams;
+
+		sParams.psFormat = psFormat;
+		sParams.uiPlane = uiPlane;
+		sParams.iWidth = *piWidth;
+		sParams.iHeight = *piHeight;
+		sParams.iStride = *piStride;
+		sParams.iVStride = *piVStride;
+		sParams.ulPlaneOffset = *pulPlaneOffset;
+
+		iResult = psFormat->pfnComputeParams(uiPlane, piWidth, piHeight,
+			piStride, piVStride, pulPlaneOffset);
+
+		sParams.iResult = iResult;
+		sParams.iOutWidth = *piWidth;
+		sParams.iOutHeight = *piHeight;
+		sParams.iOutStride = *piStride;
+		sParams.iOutVStride = *piVStride;
+		sParams.ulOutPlaneOffset = *pulPlaneOffset;
+
+		pthread_mutex_lock(&psTable->sParamsLock);
+		*psParams = sParams;
+		pthread_mutex_unlock(&psTable->sParamsLock);
+	}
+	return iResult;
+}
+
+#endif /* HAL_FORMAT_TABLE_H */
@@ -2,7 +2,7 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := pack.c
+LOCAL_SRC_FILES := pack.c bootheader.c
 LOCAL_CFLAGS += -I/usr/include/
 LOCAL_MODULE := pack_intel
 LOCAL_MODULE_TAGS := optional
@@ -10,9 +10,18 @@ include $(BUILD_HOST_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := unpack.c
+LOCAL_SRC_FILES := unpack.c bootheader.c
 LOCAL_CFLAGS += -I/usr/include/
 LOCAL_MODULE := unpack_intel
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_HOST_EXECUTABLE)
 $(call dist-for-goals,dist_files,$(LOCAL_BUILT_MODULE))
+
+# Header manipulation for the updater
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bootheader.c
+LOCAL_MODULE := libbootheader
+LOCAL_MODULE_TAGS := optional
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+include $(BUILD_STATIC_LIBRARY)
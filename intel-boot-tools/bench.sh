@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Measures pack_intel and unpack_intel over a corpus of boot images: each
+# image is unpacked, then packed again from its own bootstub, RUNS times.
+# Reports the throughput, the syscalls of a run (when strace is there)
+# and the layout of the image: the padding after the ramdisk and the
+# alignment of the ramdisk start.
+#
+# Usage: bench.sh <boot.img>...
+#
+
+RUNS=${RUNS:-10}
+BINDIR=${BINDIR:-$(dirname "$0")}
+PACK="$BINDIR/pack_intel"
+UNPACK="$BINDIR/unpack_intel"
+HEADER_SIZE=13280	# sizeof(struct bootheader)
+SECTOR_SIZE=512
+
+if [ $# -eq 0 ]; then
+	echo "Usage: $0 <boot.img>..." >&2
+	exit 1
+fi
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+now() {
+	date +%s%N
+}
+
+# Runs "$@" RUNS times, prints the MB/s for size bytes
+throughput() {
+	size=$1
+	shift
+	start=$(now)
+	i=0
+	while [ $i -lt $RUNS ]; do
+		"$@" > /dev/null || return 1
+		i=$((i + 1))
+	done
+	ns=$(($(now) - start))
+	[ $ns -gt 0 ] || ns=1
+	echo $((size * RUNS * 1000 / ns))
+}
+
+# Number of syscalls of one run of "$@", or - without strace
+syscalls() {
+	if command -v strace > /dev/null; then
+		strace -f -c -o "$TMP/strace" "$@" > /dev/null 2>&1 &&
+			awk '$NF == "total" { print $(NF - 2) }' "$TMP/strace"
+	else
+		echo -
+	fi
+}
+
+printf "%-24s %10s %9s %9s %8s %8s %8s %9s\n" image bytes "unpack" "pack" \
+	"sys(u)" "sys(p)" padding "rd align"
+total_padding=0
+status=0
+for img in "$@"; do
+	name=$(basename "$img")
+	size=$(wc -c < "$img")
+
+	if ! "$UNPACK" "$img" "$TMP/bzImage" "$TMP/ramdisk" 2> /dev/null; then
+		echo "$name: not a boot image" >&2
+		status=1
+		continue
+	fi
+	bz=$(wc -c < "$TMP/bzImage")
+	rd=$(wc -c < "$TMP/ramdisk")
+
+	unpack_mbs=$(throughput $size "$UNPACK" "$img" "$TMP/bzImage" "$TMP/ramdisk")
+	pack_mbs=$(throughput $size "$PACK" "$img" "$TMP/bzImage" "$TMP/ramdisk" "$TMP/out")
+	unpack_sys=$(syscalls "$UNPACK" "$img" "$TMP/bzImage" "$TMP/ramdisk")
+	pack_sys=$(syscalls "$PACK" "$img" "$TMP/bzImage" "$TMP/ramdisk" "$TMP/out")
+
+	# A repacked image must be identical, but for its header
+	if ! cmp -s -i $HEADER_SIZE "$img" "$TMP/out"; then
+		echo "$name: repacked payload differs" >&2
+		status=1
+	fi
+
+	out=$(wc -c < "$TMP/out")
+	padding=$((out - HEADER_SIZE - bz - rd))
+	total_padding=$((total_padding + padding))
+	rd_start=$((HEADER_SIZE + bz))
+
+	printf "%-24s %10d %4d MB/s %4d MB/s %8s %8s %8d %4d/%4d\n" "$name" $size \
+		$unpack_mbs $pack_mbs "$unpack_sys" "$pack_sys" $padding \
+		$((rd_start % SECTOR_SIZE)) $((rd_start % 4096))
+done
+echo "padding: $total_padding bytes in total"
+
+exit $status
@@ -0,0 +1,136 @@
+/*
+ * bootheader.c
+ *
+ * Copyright 2012 Emilio López <turl@tuxfamily.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifdef __APPLE__
+  #include <libkern/OSByteOrder.h>
+
+  #define htole32(x) OSSwapHostToLittleInt32(x)
+  #define le32toh(x) OSSwapLittleToHostInt32(x)
+#else
+#include <endian.h>
+#endif  /* __APPLE__ */
+
+#include "bootheader.h"
+
+uint8_t bootheader_xor(const struct bootheader *hdr)
+{
+	const uint8_t *data = (const uint8_t *) hdr;
+	uint8_t sum = 0;
+	int i;
+
+	for (i = 0; i < HEADER_SIZE; i++)
+		if (data + i != &hdr->xor)
+			sum ^= data[i];
+
+	return sum;
+}
+
+int bootheader_check(const struct bootheader *hdr, uint64_t image_size)
+{
+	uint64_t total;
+
+	if (memcmp(hdr->magic, BOOTHEADER_MAGIC, strlen(BOOTHEADER_MAGIC)) ||
+	    bootheader_xor(hdr) != hdr->xor)
+		return -1;
+
+	total = sizeof(struct bootheader) + (uint64_t)le32toh(hdr->bzImageSize) +
+		le32toh(hdr->initrdSize);
+	total = (total + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+	if (((uint64_t)le32toh(hdr->sectors) + 1) * SECTOR_SIZE < total)
+		return -1;
+	if (image_size && total > image_size)
+		return -1;
+
+	return 0;
+}
+
+uint32_t bootheader_set_sizes(struct bootheader *hdr, uint32_t bzImageSize,
+			      uint32_t initrdSize)
+{
+	uint32_t total = sizeof(struct bootheader) + bzImageSize + initrdSize;
+	uint32_t paddings = 0;
+
+	if ((total % SECTOR_SIZE) > 0) {
+		paddings = SECTOR_SIZE - (total % SECTOR_SIZE);
+		total += paddings;
+	}
+
+	hdr->bzImageSize = htole32(bzImageSize);
+	hdr->initrdSize = htole32(initrdSize);
+	hdr->sectors = htole32(total / SECTOR_SIZE - 1);
+	hdr->xor = bootheader_xor(hdr);
+
+	return paddings;
+}
+
+int bootheader_set_cmdline(struct bootheader *hdr, const char *cmdline)
+{
+	size_t len = strlen(cmdline);
+
+	/* The bootstub wants it NUL terminated */
+	if (len >= CMDLINE_SIZE)
+		return -1;
+
+	memset(hdr->cmdline, 0, CMDLINE_SIZE);
+	memcpy(hdr->cmdline, cmdline, len);
+	return 0;
+}
+
+int bootheader_patch(int fd, int64_t offset, const struct bootheader *orig,
+		     const struct bootheader *hdr, size_t from)
+{
+	const uint8_t *old = (const uint8_t *) orig;
+	const uint8_t *new = (const uint8_t *) hdr;
+	size_t pos, size, done;
+	ssize_t ret;
+	int count = 0;
+
+	/* Sectors of the image, i.e. of the header from its start */
+	for (pos = from; pos < sizeof(struct bootheader); pos += size) {
+		size = SECTOR_SIZE - pos % SECTOR_SIZE;
+		if (size > sizeof(struct bootheader) - pos)
+			size = sizeof(struct bootheader) - pos;
+		if (!memcmp(old + pos, new + pos, size))
+			continue;
+
+		for (done = 0; done < size; done += ret) {
+			ret = pwrite(fd, new + pos + done, size - done,
+				     offset + (pos - from) + done);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0)
+				return -1;
+		}
+		count++;
+	}
+
+	return count;
+}
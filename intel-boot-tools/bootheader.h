@@ -67,4 +67,32 @@ struct bootheader {
 typedef char z[(sizeof(struct bootheader) == HEADER_SIZE + HEAD_PADDING + UNKNOWN_SIZE + 0x3000) ? 1 : -1];
 // 0x2000 = (size of cmdline + 16 + padding1) + (size of bootstubstack)
 
+#define BOOTHEADER_MAGIC					"$OS$"
+
+/*
+ * Header manipulation, shared by the host tools and the updater. Sizes
+ * are stored little endian in the header, the arguments are host ones.
+ */
+
+/* XOR of the HEADER_SIZE first bytes, xor excluded */
+uint8_t bootheader_xor(const struct bootheader *hdr);
+
+/* 0 if hdr is a valid header of an image of image_size bytes, knowing that
+ * image_size 0 skips the checks of the payload sizes. Else -1. */
+int bootheader_check(const struct bootheader *hdr, uint64_t image_size);
+
+/* Sets the payload sizes, then the sectors and xor to match. Returns the
+ * number of padding bytes to write after the ramdisk. */
+uint32_t bootheader_set_sizes(struct bootheader *hdr, uint32_t bzImageSize,
+			      uint32_t initrdSize);
+
+/* Replaces the kernel command line. -1 if it does not fit. */
+int bootheader_set_cmdline(struct bootheader *hdr, const char *cmdline);
+
+/* Writes the sectors of hdr which differ from orig, the copy of the header
+ * on fd. The byte from of the header is at offset of fd, the bytes before
+ * it are not patched. Returns the number of sectors written, or -1. */
+int bootheader_patch(int fd, int64_t offset, const struct bootheader *orig,
+		     const struct bootheader *hdr, size_t from);
+
 #endif
@@ -25,7 +25,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #ifdef __APPLE__
   #include <libkern/OSByteOrder.h>
@@ -53,101 +60,149 @@
 
 #define ERROR(...) do { fprintf(stderr, __VA_ARGS__); return 1; } while(0)
 
-uint8_t calculate_checksum(struct bootheader * hdr) {
-        uint8_t sum = hdr->xor;
-        uint8_t *data = (uint8_t *) hdr;
-        int i;
-        
-        for (i = 0; i < HEADER_SIZE; i++) { 
-                sum ^= data[i]; 
-        } 
-        
-        return sum;	
-}	
-               
-int main(int argc, char *argv[])
+/* Write all of buf at offset, in spite of short writes */
+static int write_at(int fd, const void *buf, size_t size, off_t offset)
 {
-	char *origin;
-	char *bzImage;
-	char *ramdisk;
-	char *output;
-	FILE *forigin;
-	FILE *foutput;
-	FILE *fbzImage;
-	FILE *framdisk;
-	struct stat st;
-	uint32_t tmp, paddings, totalImageSize;
-	char buf[BUFSIZ];
-	size_t size;
-	struct bootheader *file;
-
-	if (argc != 5)
-		ERROR("Usage: %s <valid image> <bzImage> <ramdisk> <output>\n", argv[0]);
-
-	origin = argv[1];
-	bzImage = argv[2];
-	ramdisk = argv[3];
-	output = argv[4];
-
-	forigin = fopen(origin, "r");
-	fbzImage = fopen(bzImage, "r");
-	framdisk = fopen(ramdisk, "r");
-	foutput = fopen(output, "w");
-	if (!forigin || !foutput)
-		ERROR("ERROR: failed to open origin or output image\n");
+	const char *p = buf;
+	ssize_t done;
+
+	while (size > 0) {
+		done = pwrite(fd, p, size, offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return -1;
+		p += done;
+		size -= done;
+		offset += done;
+	}
+	return 0;
+}
 
-	/* Allocate memory and copy bootstub to it */
-	file = calloc(sizeof(struct bootheader), sizeof(char));
-	if (file == NULL)
-		ERROR("ERROR allocating memory\n");
+/* Copy size bytes of in to out at offset, without going through a buffer
+ * of ours: by sendfile where the kernel allows it, else from a mapping */
+static int copy_at(int in, int out, size_t size, off_t offset)
+{
+	void *data;
+	int ret;
+
+	if (size == 0)
+		return 0;
+
+#ifdef __linux__
+	if (lseek(out, offset, SEEK_SET) == offset) {
+		off_t pos = 0;
+		ssize_t done;
+
+		while ((size_t)pos < size) {
+			done = sendfile(out, in, &pos, size - pos);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done <= 0)
+				break;
+		}
+		if ((size_t)pos == size)
+			return 0;
+		if (pos != 0)
+			return -1;
+		/* Not supported for these files, nothing written yet */
+	}
+#endif
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	ret = write_at(out, data, size, offset);
+	munmap(data, size);
+	return ret;
+}
 
-	if (fread(file, sizeof(struct bootheader), 1, forigin) != 1)
-		ERROR("ERROR reading bootstub\n");
+/* Build output from the bootstub of origin, and the bzImage and ramdisk */
+static int pack(const struct bootheader *origin, const char *bzImage,
+		const char *ramdisk, const char *output)
+{
+	int fbzImage, framdisk, foutput;
+	struct stat st;
+	uint32_t bzImageSize, initrdSize, paddings, totalImageSize;
+	char buf[SECTOR_SIZE];
+	struct bootheader file;
 
-	/* Figure out the bzImage size and set it */
-	if (stat(bzImage, &st) == 0) {
-		tmp = st.st_size;
-		totalImageSize = tmp;
-		file->bzImageSize = htole32(tmp);
-	} else
+	fbzImage = open(bzImage, O_RDONLY);
+	if (fbzImage < 0 || fstat(fbzImage, &st) != 0)
 		ERROR("ERROR reading bzImage size\n");
+	bzImageSize = st.st_size;
 
-	totalImageSize += sizeof(struct bootheader);
-
-	/* Figure out the ramdisk size and set it */
-	if (stat(ramdisk, &st) == 0) {
-		tmp = st.st_size;
-		totalImageSize += tmp;
-		if ((totalImageSize % SECTOR_SIZE) > 0) {
-			paddings = SECTOR_SIZE - (totalImageSize % SECTOR_SIZE);
-			totalImageSize += paddings;
-		}
-		file->initrdSize = htole32(tmp);
-	} else
+	framdisk = open(ramdisk, O_RDONLY);
+	if (framdisk < 0 || fstat(framdisk, &st) != 0)
 		ERROR("ERROR reading ramdisk\n");
+	initrdSize = st.st_size;
 
-	file->sectors = htole32(totalImageSize / SECTOR_SIZE - 1);
-	file->xor = calculate_checksum(file);
+	foutput = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (foutput < 0)
+		ERROR("ERROR: failed to open output image %s\n", output);
 
-	/* Write the patched bootstub to the new image */
-	if (fwrite(file, sizeof(struct bootheader), 1, foutput) != 1)
-		ERROR("ERROR writing image\n");
+	file = *origin;
+	paddings = bootheader_set_sizes(&file, bzImageSize, initrdSize);
+	totalImageSize = (le32toh(file.sectors) + 1) * SECTOR_SIZE;
 
-	/* Then copy the new bzImage */
-	while ((size = fread(buf, 1, BUFSIZ, fbzImage))) {
-		fwrite(buf, 1, size, foutput);
-	}
+	/* Reserve the whole image at once, where the system can */
+#ifdef __linux__
+	posix_fallocate(foutput, 0, totalImageSize);
+#endif
 
-	/* And finally copy the ramdisk */
-	while ((size = fread(buf, 1, BUFSIZ, framdisk))) {
-		fwrite(buf, 1, size, foutput);
-	}
+	/* Copy the new bzImage after the bootstub */
+	if (copy_at(fbzImage, foutput, bzImageSize, sizeof(struct bootheader)))
+		ERROR("ERROR writing bzImage to %s\n", output);
+
+	/* Then the ramdisk */
+	if (copy_at(framdisk, foutput, initrdSize,
+		    sizeof(struct bootheader) + bzImageSize))
+		ERROR("ERROR writing ramdisk to %s\n", output);
 
 	if (paddings != 0) {
 		memset(buf, 0xff, paddings);
-		if (fwrite(buf, paddings, 1, foutput) != 1) 
-			ERROR("ERROR writing output image\n");			
+		if (write_at(foutput, buf, paddings, totalImageSize - paddings))
+			ERROR("ERROR writing output image\n");
 	}
 
+	/* And finally the patched bootstub, once the image is complete */
+	if (write_at(foutput, &file, sizeof(struct bootheader), 0))
+		ERROR("ERROR writing image\n");
+
+	close(fbzImage);
+	close(framdisk);
+	if (close(foutput))
+		ERROR("ERROR writing %s\n", output);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *forigin;
+	struct bootheader *origin;
+	int i;
+
+	if (argc < 5 || (argc - 2) % 3)
+		ERROR("Usage: %s <valid image> <bzImage> <ramdisk> <output> "
+		      "[<bzImage> <ramdisk> <output>]...\n", argv[0]);
+
+	forigin = fopen(argv[1], "r");
+	if (!forigin)
+		ERROR("ERROR: failed to open origin image\n");
+
+	/* Allocate memory and copy bootstub to it */
+	origin = calloc(sizeof(struct bootheader), sizeof(char));
+	if (origin == NULL)
+		ERROR("ERROR allocating memory\n");
+
+	if (fread(origin, sizeof(struct bootheader), 1, forigin) != 1)
+		ERROR("ERROR reading bootstub\n");
+	fclose(forigin);
+
+	/* Each triple is packed with the same bootstub */
+	for (i = 2; i < argc; i += 3)
+		if (pack(origin, argv[i], argv[i + 1], argv[i + 2]))
+			return 1;
+
 	return 0;
 }
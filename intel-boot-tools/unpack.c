@@ -25,6 +25,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #ifdef __APPLE__
   #include <libkern/OSByteOrder.h>
@@ -52,76 +60,123 @@
 
 #define ERROR(...) do { fprintf(stderr, __VA_ARGS__); return 1; } while(0)
 
+/* Write size bytes of the image, at offset in it, to path: by sendfile
+ * where the kernel allows it, else from the mapping of the image */
+static int extract(int fd, const uint8_t *image, off_t offset, size_t size,
+		   const char *path)
+{
+	const uint8_t *p = image + offset;
+	ssize_t done;
+	int out;
+
+	out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+		return -1;
+
+#ifdef __linux__
+	{
+		off_t pos = offset;
+
+		while (size > 0) {
+			done = sendfile(out, fd, &pos, size);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done <= 0)
+				break;
+			size -= done;
+		}
+		/* Not supported for these files: the rest from the mapping */
+		p = image + pos;
+	}
+#else
+	(void)fd;
+#endif
+
+	while (size > 0) {
+		done = write(out, p, size);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0) {
+			close(out);
+			return -1;
+		}
+		p += done;
+		size -= done;
+	}
+
+	return close(out);
+}
+
 int main(int argc, char *argv[])
 {
 	char *origin;
-	char *bzImage;
-	char *ramdisk;
-	FILE *forigin;
-	FILE *fbzImage;
-	FILE *framdisk;
+	char *bzImage = NULL;
+	char *ramdisk = NULL;
+	int fd;
+	struct stat st;
+	const uint8_t *image;
+	const struct bootheader *hdr;
 	uint32_t bzImageLen;
 	uint32_t ramdiskLen;
-	uint32_t missing;
-	char buf[BUFSIZ];
-	size_t size;
-
-	if (argc != 4)
-		ERROR("Usage: %s <image to unpack> <bzImage out> <ramdisk out>\n", argv[0]);
-
-	origin = argv[1];
-	bzImage = argv[2];
-	ramdisk = argv[3];
-
-	forigin = fopen(origin, "r");
-	fbzImage = fopen(bzImage, "w");
-	framdisk = fopen(ramdisk, "w");
-	if (!forigin || !bzImage || !framdisk)
-		ERROR("ERROR: failed to open origin or output images\n");
-
-	/* Read bzImage length from the image to unpack */
-	if (fseek(forigin, CMDLINE_END, SEEK_SET) == -1)
-		ERROR("ERROR: failed to seek on image\n");
-
-	if (fread(&bzImageLen, sizeof(uint32_t), 1, forigin) != 1)
-		ERROR("ERROR: failed to read bzImage length\n");
-	else
-		bzImageLen = le32toh(bzImageLen);
-
-	/* Read ramdisk length from the image to unpack */
-	if (fseek(forigin, (CMDLINE_END+sizeof(uint32_t)), SEEK_SET) == -1)
-		ERROR("ERROR: failed to seek on image\n");
-
-	if (fread(&ramdiskLen, sizeof(uint32_t), 1, forigin) != 1)
-		ERROR("ERROR: failed to read ramdisk length\n");
-	else
-		ramdiskLen = le32toh(ramdiskLen);
+	uint32_t sectors;
+	uint64_t total;
+	int list = 0;
+	int valid = 1;
+
+	if (argc == 3 && !strcmp(argv[1], "-l")) {
+		list = 1;
+		origin = argv[2];
+	} else if (argc == 4) {
+		origin = argv[1];
+		bzImage = argv[2];
+		ramdisk = argv[3];
+	} else
+		ERROR("Usage: %s <image to unpack> <bzImage out> <ramdisk out>\n"
+		      "       %s -l <image to check>\n", argv[0], argv[0]);
+
+	fd = open(origin, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+		ERROR("ERROR: failed to open origin image\n");
+
+	if ((uint64_t)st.st_size < sizeof(struct bootheader))
+		ERROR("ERROR: %s is too short for a boot image\n", origin);
+
+	/* The whole image, the header is read in place */
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED)
+		ERROR("ERROR: failed to map %s\n", origin);
+	hdr = (const struct bootheader *)image;
+
+	bzImageLen = le32toh(hdr->bzImageSize);
+	ramdiskLen = le32toh(hdr->initrdSize);
+	sectors = le32toh(hdr->sectors);
+	total = sizeof(struct bootheader) + (uint64_t)bzImageLen + ramdiskLen;
+
+	if (bootheader_check(hdr, 0)) {
+		fprintf(stderr, "WARNING: bad magic, checksum or sectors in header\n");
+		valid = 0;
+	}
+	if (total > (uint64_t)st.st_size)
+		ERROR("ERROR: bzImage and ramdisk overrun the image\n");
+
+	if (list) {
+		printf("bzImage: %u bytes at 0x%zx\n", bzImageLen,
+		       sizeof(struct bootheader));
+		printf("ramdisk: %u bytes at 0x%llx\n", ramdiskLen,
+		       (unsigned long long)(sizeof(struct bootheader) + bzImageLen));
+		printf("sectors: %u\n", sectors + 1);
+		printf("cmdline: %.*s\n", CMDLINE_SIZE, hdr->cmdline);
+		return !valid;
+	}
 
 	/* Copy bzImage */
-	if (fseek(forigin, sizeof(struct bootheader), SEEK_SET) == -1)
-		ERROR("ERROR: failed to seek when copying bzImage\n");
-
-	missing = bzImageLen;
-	while (missing > 0) {
-		size = fread(buf, 1, ((missing > BUFSIZ) ? BUFSIZ : missing), forigin);
-		if (size != 0) {
-			fwrite(buf, 1, size, fbzImage);
-			missing -= size;
-		}
-	}
+	if (extract(fd, image, sizeof(struct bootheader), bzImageLen, bzImage))
+		ERROR("ERROR: failed to write bzImage to %s\n", bzImage);
 
 	/* Copy ramdisk */
-	if (fseek(forigin, (sizeof(struct bootheader)+bzImageLen), SEEK_SET) == -1)
-		ERROR("ERROR: failed to seek when copying ramdisk\n");
-
-	missing = ramdiskLen;
-	while (missing > 0) {
-		size = fread(buf, 1, ((missing > BUFSIZ) ? BUFSIZ : missing), forigin);
-		if (size != 0) {
-			fwrite(buf, 1, size, framdisk);
-			missing -= size;
-		}
-	}
+	if (extract(fd, image, sizeof(struct bootheader) + bzImageLen,
+		    ramdiskLen, ramdisk))
+		ERROR("ERROR: failed to write ramdisk to %s\n", ramdisk);
 
 	return 0;
 }
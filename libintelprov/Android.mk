@@ -29,6 +29,8 @@ CONFIG_INTELPROV_OSIP := y
 CONFIG_INTELPROV_SCU_EMMC := y
 CONFIG_INTELPROV_SCU_IPC := y
 CONFIG_INTELPROV_ULPMC := y
+# LZ4 images, when the tree has the library
+CONFIG_INTELPROV_LZ4 := $(if $(wildcard external/lz4/lib/lz4frame.h),y)
 
 MODULES-SOURCES :=
 INTELPROV_CONFIGS := $(filter CONFIG_INTELPROV_%,$(.VARIABLES))
@@ -41,6 +43,8 @@ common_libintelprov_files := \
 	update_osip.c \
 	fw_version_check.c \
 	util.c \
+	block_write.c \
+	partition_index.c \
 	flash_ops.c \
 	flash.c \
 	$(MODULES-SOURCES)
@@ -48,6 +52,15 @@ common_libintelprov_files := \
 common_libintelprov_includes := \
 	$(call include-path-for, libc-private) \
 	$(call include-path-for, mkbootimg) \
+	$(LOCAL_PATH)/../intel-boot-tools \
+	$(LOCAL_PATH)/../metrics \
+
+# Image decompression of block_write.c
+common_libintelprov_libraries := libz
+ifeq ($(CONFIG_INTELPROV_LZ4),y)
+common_libintelprov_includes += external/lz4/lib
+common_libintelprov_libraries += liblz4
+endif
 
 chaabi_dir := $(TOP)/vendor/intel/hardware/PRIVATE/chaabi
 sep_lib_includes := $(chaabi_dir)/SepMW/VOS6/External/Linux/inc/
@@ -80,9 +93,10 @@ LOCAL_MODULE := libintel_updater
 LOCAL_SRC_FILES := updater.c $(common_libintelprov_files)
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_CLASS := STATIC_LIBRARIES
-LOCAL_C_INCLUDES := bootable/recovery $(common_libintelprov_includes) $(LOCAL_PATH)/gpt/lib/include
+LOCAL_C_INCLUDES := bootable/recovery bootable/recovery/applypatch $(common_libintelprov_includes) $(LOCAL_PATH)/gpt/lib/include
 LOCAL_CFLAGS := -Wall -Werror -Wno-unused-parameter
-LOCAL_WHOLE_STATIC_LIBRARIES := liboempartitioning_static
+LOCAL_WHOLE_STATIC_LIBRARIES := liboempartitioning_static libbootheader
+LOCAL_STATIC_LIBRARIES := $(common_libintelprov_libraries)
 ifeq ($(TARGET_BOARD_PLATFORM),clovertrail)
   LOCAL_CFLAGS += -DCLVT
 endif
@@ -123,7 +137,8 @@ LOCAL_C_INCLUDES := bootable/droidboot bootable/recovery $(common_libintelprov_i
 
 LOCAL_SRC_FILES := droidboot.c bootloader.c $(common_libintelprov_files)
 
-LOCAL_WHOLE_STATIC_LIBRARIES := liboempartitioning_static
+LOCAL_WHOLE_STATIC_LIBRARIES := liboempartitioning_static libbootheader
+LOCAL_STATIC_LIBRARIES := $(common_libintelprov_libraries)
 
 ifeq ($(external_release),no)
 LOCAL_SRC_FILES += $(common_pmdb_files) $(token_implementation)
@@ -158,6 +173,7 @@ include $(CLEAR_VARS)
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE := flashtool
 LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_STATIC_LIBRARIES := libmincrypt libbootheader $(common_libintelprov_libraries)
 
 LOCAL_C_INCLUDES := $(common_libintelprov_includes) bootable/recovery
 LOCAL_SRC_FILES := flashtool.c $(common_libintelprov_files)
@@ -179,7 +195,10 @@ LOCAL_SRC_FILES:= update_recovery.c $(common_libintelprov_files)
 LOCAL_C_INCLUDES := $(common_libintelprov_includes) bootable/recovery/applypatch bootable/recovery $(call include-path-for, mkbootimg)
 LOCAL_CFLAGS := -Wall -Wno-unused-parameter
 LOCAL_SHARED_LIBRARIES := liblog libcutils libz
-LOCAL_STATIC_LIBRARIES := libmincrypt libapplypatch libbz
+LOCAL_STATIC_LIBRARIES := libmincrypt libapplypatch libbz libbootheader
+ifeq ($(CONFIG_INTELPROV_LZ4),y)
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 LOCAL_CFLAGS += $(INTELPROV_DEFINES)
 include $(BUILD_EXECUTABLE)
 endif
@@ -0,0 +1,1326 @@
+/*
+ * Copyright 2013 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <mincrypt/sha.h>
+#include <mincrypt/sha256.h>
+#include <zlib.h>
+#ifdef CONFIG_INTELPROV_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "block_write.h"
+#include "device_metrics.h"
+#include "util.h"
+
+/* Alignment of the buffers and of the device offsets for O_DIRECT */
+#define BLOCK_WRITE_ALIGN	4096
+#define BLOCK_WRITE_SECTOR	512
+/* Without O_DIRECT, the written pages are flushed and dropped per window */
+#define BLOCK_WRITE_SYNC_WINDOW	(8 * 1024 * 1024)
+
+/* Enough for the reader, the hasher and the writer to never wait on
+ * each other while the eMMC keeps up */
+#define BLOCK_WRITE_BUFFERS	4
+
+/* Threads hashing the segments of a tree digest, the caller included */
+#define BLOCK_DIGEST_WORKERS	8
+
+/* Chunks written between two commits of the journal */
+#define BLOCK_JOURNAL_COMMIT	8
+#define BLOCK_JOURNAL_MAGIC	0x4a574249	/* IBWJ */
+#define BLOCK_JOURNAL_VERSION	1
+
+/* Followed by the SHA-1 of the first chunks of the image */
+struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+	char device[64];
+	uint64_t offset;
+	uint64_t total;
+	uint32_t chunk_size;
+	uint32_t chunks;
+};
+
+/* Published in the "intelprov" device metrics, NULL without them */
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static struct device_metric *metric_bytes;
+static struct device_metric *metric_chunk_us;
+static struct device_metric *metric_images;
+static struct device_metric *metric_failures;
+
+static void map_metrics(void)
+{
+	struct device_metrics *m = device_metrics_map("intelprov");
+
+	metric_bytes = device_metrics_get(m, "block_write_bytes", DEVICE_METRIC_COUNTER);
+	metric_chunk_us = device_metrics_get(m, "block_write_chunk_us", DEVICE_METRIC_HISTOGRAM);
+	metric_images = device_metrics_get(m, "block_write_images", DEVICE_METRIC_COUNTER);
+	metric_failures = device_metrics_get(m, "block_write_failures", DEVICE_METRIC_COUNTER);
+}
+
+static int64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Compressed data read at once by the decompressing readers */
+#define BLOCK_WRITE_INPUT	(256 * 1024)
+#define GZIP_MAGIC0		0x1f
+#define GZIP_MAGIC1		0x8b
+#define LZ4_FRAME_MAGIC		0x184d2204
+
+/* Android sparse image format, as written by libsparse */
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define CHUNK_TYPE_RAW		0xcac1
+#define CHUNK_TYPE_FILL		0xcac2
+#define CHUNK_TYPE_DONT_CARE	0xcac3
+#define CHUNK_TYPE_CRC32	0xcac4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+};
+
+/* A buffer goes round the ring: read, then hashed if needed, then written */
+enum {
+	BUF_FREE,
+	BUF_READ,
+	BUF_HASHED,
+};
+
+struct block_buffer {
+	void *data;
+	size_t size;
+	off64_t offset;
+	int state;
+};
+
+/* The caller thread reads the image, and a hasher and a writer thread
+ * take the chunks in the same order. All the fields below the lock are
+ * protected by it. */
+struct block_pipeline {
+	struct block_write *bw;
+	const char *name;
+	/* The image, a file, or data if src is -1 */
+	int src;
+	const unsigned char *data;
+	/* Bytes of the device covered by the image */
+	off64_t total;
+	/* Owned by the reader */
+	int (*reader) (struct block_pipeline *p);
+	int next;
+	bool stopped;
+	/* Compressed image, of which the size of the output is unknown */
+	off64_t src_size;
+	off64_t src_pos;
+	unsigned char *input;
+	/* Owned by the writer thread once started */
+	int fd;
+	bool direct;
+	/* The device reads the discarded blocks as zeros */
+	bool skip_zeros;
+	off64_t flushed;
+	off64_t synced;
+	/* Owned by the writer thread, with a journal: the SHA-1 of the
+	 * chunks of the last run, then of the chunks written, which are
+	 * committed once on the device */
+	bool journaling;
+	uint8_t *journal;
+	unsigned int journal_size;
+	unsigned int resumable;
+	unsigned int committed;
+	unsigned int chunks;
+	/* Owned by the hasher thread */
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct block_buffer buffers[BLOCK_WRITE_BUFFERS];
+	/* Bytes written, or skipped */
+	off64_t written;
+	int error;
+	/* All the chunks are read, or all of them are hashed */
+	bool read;
+	bool hashed;
+};
+
+static int safe_pwrite(int fd, const void *data, size_t size, off64_t offset)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	while (size) {
+		ssize_t ret = pwrite64(fd, bytes, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		bytes += ret;
+		size -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static int safe_pread(int fd, void *data, size_t size, off64_t offset)
+{
+	unsigned char *bytes = (unsigned char *)data;
+	while (size) {
+		ssize_t ret = pread64(fd, bytes, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return -1;
+		}
+		bytes += ret;
+		size -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+size_t block_write_digest_size(int hash)
+{
+	switch (hash) {
+	case BLOCK_WRITE_SHA1:
+		return SHA_DIGEST_SIZE;
+	case BLOCK_WRITE_SHA256:
+	case BLOCK_WRITE_SHA256_TREE:
+		return SHA256_DIGEST_SIZE;
+	default:
+		return 0;
+	}
+}
+
+struct block_digest {
+	int hash;
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+};
+
+static int digest_init(struct block_digest *d, int hash)
+{
+	d->hash = hash;
+	if (hash == BLOCK_WRITE_SHA1)
+		SHA_init(&d->sha1);
+	else if (hash == BLOCK_WRITE_SHA256)
+		SHA256_init(&d->sha256);
+	else
+		return -1;
+	return 0;
+}
+
+static void digest_update(struct block_digest *d, const void *data, size_t size)
+{
+	if (d->hash == BLOCK_WRITE_SHA1)
+		SHA_update(&d->sha1, data, size);
+	else
+		SHA256_update(&d->sha256, data, size);
+}
+
+static void digest_final(struct block_digest *d, uint8_t *digest)
+{
+	if (d->hash == BLOCK_WRITE_SHA1)
+		memcpy(digest, SHA_final(&d->sha1), SHA_DIGEST_SIZE);
+	else
+		memcpy(digest, SHA256_final(&d->sha256), SHA256_DIGEST_SIZE);
+}
+
+/* The segments of a tree digest, taken in turn by the workers */
+struct tree_digest {
+	/* The data, from fd at offset if data is NULL */
+	const unsigned char *data;
+	int fd;
+	off64_t offset;
+	off64_t size;
+	unsigned int segments;
+	uint8_t *leaves;
+
+	pthread_mutex_t lock;
+	unsigned int next;
+	int error;
+};
+
+static void *tree_worker(void *arg)
+{
+	struct tree_digest *t = (struct tree_digest *)arg;
+	unsigned char *buf = NULL;
+	const unsigned char *segment;
+	unsigned int i;
+	off64_t pos;
+	size_t len;
+
+	if (!t->data && !(buf = malloc(BLOCK_DIGEST_SEGMENT))) {
+		pthread_mutex_lock(&t->lock);
+		t->error = ENOMEM;
+		pthread_mutex_unlock(&t->lock);
+		return NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&t->lock);
+		i = t->next++;
+		if (t->error || i >= t->segments) {
+			pthread_mutex_unlock(&t->lock);
+			break;
+		}
+		pthread_mutex_unlock(&t->lock);
+
+		pos = (off64_t)i * BLOCK_DIGEST_SEGMENT;
+		len = t->size - pos < BLOCK_DIGEST_SEGMENT ? t->size - pos : BLOCK_DIGEST_SEGMENT;
+		if (t->data) {
+			segment = t->data + pos;
+		} else if (safe_pread(t->fd, buf, len, t->offset + pos)) {
+			pthread_mutex_lock(&t->lock);
+			t->error = errno ? errno : EIO;
+			pthread_mutex_unlock(&t->lock);
+			break;
+		} else {
+			segment = buf;
+		}
+		SHA256_hash(segment, len, t->leaves + i * SHA256_DIGEST_SIZE);
+	}
+	free(buf);
+	return NULL;
+}
+
+static int tree_digest(struct tree_digest *t, uint8_t *digest)
+{
+	pthread_t workers[BLOCK_DIGEST_WORKERS - 1];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int count, started;
+	int ret = -1;
+
+	t->segments = (t->size + BLOCK_DIGEST_SEGMENT - 1) / BLOCK_DIGEST_SEGMENT;
+	/* Not NULL for empty data */
+	t->leaves = malloc((size_t)t->segments * SHA256_DIGEST_SIZE + 1);
+	if (!t->leaves) {
+		error("%s: Memory allocation failure\n", __func__);
+		return -1;
+	}
+	t->next = 0;
+	t->error = 0;
+	pthread_mutex_init(&t->lock, NULL);
+
+	count = cpus < 1 ? 1 : cpus > BLOCK_DIGEST_WORKERS ? BLOCK_DIGEST_WORKERS : cpus;
+	if (count > t->segments)
+		count = t->segments ? t->segments : 1;
+	/* With fewer threads, the remaining ones take more segments */
+	for (started = 0; started + 1 < count; started++)
+		if (pthread_create(&workers[started], NULL, tree_worker, t))
+			break;
+	tree_worker(t);
+	while (started)
+		pthread_join(workers[--started], NULL);
+
+	if (t->error) {
+		error("%s: hashing failed: %s\n", __func__, strerror(t->error));
+		goto out;
+	}
+	SHA256_hash(t->leaves, t->segments * SHA256_DIGEST_SIZE, digest);
+	ret = 0;
+out:
+	pthread_mutex_destroy(&t->lock);
+	free(t->leaves);
+	return ret;
+}
+
+int block_digest_fd(int fd, off64_t offset, off64_t size, int hash, uint8_t *digest)
+{
+	struct block_digest d;
+	unsigned char *buf;
+	off64_t pos;
+	int ret = -1;
+
+	if (hash == BLOCK_WRITE_SHA256_TREE) {
+		struct tree_digest t;
+
+		memset(&t, 0, sizeof(t));
+		t.fd = fd;
+		t.offset = offset;
+		t.size = size;
+		return tree_digest(&t, digest);
+	}
+	if (digest_init(&d, hash))
+		return -1;
+	buf = malloc(BLOCK_WRITE_CHUNK);
+	if (!buf) {
+		error("%s: Memory allocation failure\n", __func__);
+		return -1;
+	}
+	for (pos = 0; pos < size; pos += BLOCK_WRITE_CHUNK) {
+		size_t len = size - pos < BLOCK_WRITE_CHUNK ? size - pos : BLOCK_WRITE_CHUNK;
+		if (safe_pread(fd, buf, len, offset + pos)) {
+			error("%s: read failed: %s\n", __func__, strerror(errno));
+			goto out;
+		}
+		digest_update(&d, buf, len);
+	}
+	digest_final(&d, digest);
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+int block_digest_data(const void *data, size_t size, int hash, uint8_t *digest)
+{
+	struct block_digest d;
+
+	if (hash == BLOCK_WRITE_SHA256_TREE) {
+		struct tree_digest t;
+
+		memset(&t, 0, sizeof(t));
+		t.data = (const unsigned char *)data;
+		t.size = size;
+		return tree_digest(&t, digest);
+	}
+	if (digest_init(&d, hash))
+		return -1;
+	digest_update(&d, data, size);
+	digest_final(&d, digest);
+	return 0;
+}
+
+/* Called with the lock held. Waits until the buffer gets to state,
+ * returns NULL if it never will: the previous stage is over, or a
+ * stage failed. */
+static struct block_buffer *next_buffer(struct block_pipeline *p, int index,
+					int state, const bool *over)
+{
+	struct block_buffer *b = &p->buffers[index];
+
+	while (b->state != state && !(over && *over) && !p->error)
+		pthread_cond_wait(&p->cond, &p->lock);
+	if (b->state != state || p->error)
+		return NULL;
+	return b;
+}
+
+static void set_state(struct block_pipeline *p, struct block_buffer *b, int state)
+{
+	b->state = state;
+	pthread_cond_broadcast(&p->cond);
+}
+
+/* Starts the writeback of the last window, and waits for the one before,
+ * so that the device is always busy but the dirty pages stay bounded. */
+static void flush_window(struct block_pipeline *p, off64_t end)
+{
+	if (end - p->synced < BLOCK_WRITE_SYNC_WINDOW)
+		return;
+	sync_file_range(p->fd, p->synced, end - p->synced, SYNC_FILE_RANGE_WRITE);
+	if (p->flushed < p->synced) {
+		sync_file_range(p->fd, p->flushed, p->synced - p->flushed,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(p->fd, p->flushed, p->synced - p->flushed, POSIX_FADV_DONTNEED);
+	}
+	p->flushed = p->synced;
+	p->synced = end;
+}
+
+static int write_range(struct block_pipeline *p, const unsigned char *data,
+		       size_t size, off64_t offset)
+{
+	size_t aligned = p->direct ? size & ~(BLOCK_WRITE_SECTOR - 1) : size;
+
+	if (aligned && safe_pwrite(p->fd, data, aligned, offset))
+		return -1;
+	if (aligned < size) {
+		/* Only the last chunk may end off a sector boundary */
+		int flags = fcntl(p->fd, F_GETFL);
+		if (flags == -1 || fcntl(p->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+			return -1;
+		p->direct = false;
+		p->synced = p->flushed = offset + aligned;
+		if (safe_pwrite(p->fd, data + aligned, size - aligned, offset + aligned))
+			return -1;
+	}
+	if (!p->direct)
+		flush_window(p, offset + size);
+	return 0;
+}
+
+/* Whether the block at pos of the buffer is whole and all zeros. The
+ * buffers and the blocks are aligned on BLOCK_WRITE_ALIGN. */
+static bool is_zero_block(const struct block_buffer *b, size_t pos)
+{
+	size_t n;
+
+	if (pos + BLOCK_WRITE_ALIGN > b->size)
+		return false;
+#ifdef __SSE2__
+	const __m128i *v = (const __m128i *)((const char *)b->data + pos);
+	__m128i acc = _mm_setzero_si128();
+
+	for (n = 0; n < BLOCK_WRITE_ALIGN / sizeof(*v); n += 4, v += 4)
+		acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(v[0], v[1]),
+						     _mm_or_si128(v[2], v[3])));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+#else
+	const uint64_t *w = (const uint64_t *)((const char *)b->data + pos);
+	uint64_t acc = 0;
+
+	for (n = 0; n < BLOCK_WRITE_ALIGN / sizeof(*w); n += 4, w += 4)
+		acc |= w[0] | w[1] | w[2] | w[3];
+	return acc == 0;
+#endif
+}
+
+static int write_chunk(struct block_pipeline *p, const struct block_buffer *b)
+{
+	const unsigned char *data = (const unsigned char *)b->data;
+	size_t start, end;
+
+	if (!p->skip_zeros)
+		return write_range(p, data, b->size, b->offset);
+
+	/* Only the runs of blocks with data are written, the discarded
+	 * device already reads the others as zeros */
+	for (start = 0; start < b->size; start = end) {
+		bool zero = is_zero_block(b, start);
+
+		for (end = start + BLOCK_WRITE_ALIGN; end < b->size; end += BLOCK_WRITE_ALIGN)
+			if (is_zero_block(b, end) != zero)
+				break;
+		if (end > b->size)
+			end = b->size;
+		if (!zero && write_range(p, data + start, end - start, b->offset + start))
+			return -1;
+	}
+	return 0;
+}
+
+static void *hasher_thread(void *arg)
+{
+	struct block_pipeline *p = (struct block_pipeline *)arg;
+	struct block_buffer *b;
+	int i = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while ((b = next_buffer(p, i, BUF_READ, &p->read)) != NULL) {
+		pthread_mutex_unlock(&p->lock);
+		if (p->bw->hash == BLOCK_WRITE_SHA1)
+			SHA_update(&p->sha1, b->data, b->size);
+		else
+			SHA256_update(&p->sha256, b->data, b->size);
+		pthread_mutex_lock(&p->lock);
+		set_state(p, b, BUF_HASHED);
+		i = (i + 1) % BLOCK_WRITE_BUFFERS;
+	}
+	p->hashed = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* Room for the SHA-1 of chunk index, which was not written yet */
+static uint8_t *journal_slot(struct block_pipeline *p, unsigned int index)
+{
+	if (index >= p->journal_size) {
+		unsigned int size = p->journal_size ? p->journal_size : 64;
+		uint8_t *journal;
+
+		while (size <= index)
+			size *= 2;
+		journal = realloc(p->journal, (size_t)size * SHA_DIGEST_SIZE);
+		if (!journal)
+			return NULL;
+		p->journal = journal;
+		p->journal_size = size;
+	}
+	return p->journal + (size_t)index * SHA_DIGEST_SIZE;
+}
+
+static void load_journal(struct block_pipeline *p)
+{
+	struct journal_header h;
+	void *data;
+	size_t size;
+
+	if (access(p->bw->journal, F_OK) || file_read(p->bw->journal, &data, &size))
+		return;
+	if (size < sizeof(h))
+		goto out;
+	memcpy(&h, data, sizeof(h));
+	h.device[sizeof(h.device) - 1] = '\0';
+	/* A journal of another write only costs the first run of this one */
+	if (h.magic != BLOCK_JOURNAL_MAGIC || h.version != BLOCK_JOURNAL_VERSION ||
+	    strcmp(h.device, p->bw->device) || h.offset != (uint64_t)p->bw->offset ||
+	    h.total != (uint64_t)p->total || h.chunk_size != BLOCK_WRITE_CHUNK ||
+	    size != sizeof(h) + (size_t)h.chunks * SHA_DIGEST_SIZE ||
+	    (h.chunks && !journal_slot(p, h.chunks - 1)))
+		goto out;
+	memcpy(p->journal, (uint8_t *)data + sizeof(h), (size_t)h.chunks * SHA_DIGEST_SIZE);
+	p->resumable = p->committed = h.chunks;
+	print("Resuming the write of %s, %u chunks journaled\n", p->name, h.chunks);
+out:
+	free(data);
+}
+
+/* Records the chunks written so far, once they are on the device.
+ * Its failure only costs the resumption, and stops the journaling,
+ * e.g. when /cache is not mounted. */
+static void commit_journal(struct block_pipeline *p)
+{
+	struct journal_header *h;
+	unsigned int chunks = p->chunks > p->resumable ? p->chunks : p->resumable;
+	size_t size = sizeof(*h) + (size_t)chunks * SHA_DIGEST_SIZE;
+
+	if (chunks == p->committed || fdatasync(p->fd))
+		return;
+	h = calloc(1, size);
+	if (!h)
+		return;
+	h->magic = BLOCK_JOURNAL_MAGIC;
+	h->version = BLOCK_JOURNAL_VERSION;
+	strncpy(h->device, p->bw->device, sizeof(h->device) - 1);
+	h->offset = p->bw->offset;
+	h->total = p->total;
+	h->chunk_size = BLOCK_WRITE_CHUNK;
+	h->chunks = chunks;
+	memcpy(h + 1, p->journal, (size_t)chunks * SHA_DIGEST_SIZE);
+	if (!file_write_atomic(p->bw->journal, h, size))
+		p->committed = chunks;
+	else
+		p->journaling = false;
+	free(h);
+}
+
+/* Writes the chunk, unless the journal shows it is on the device */
+static int write_journaled_chunk(struct block_pipeline *p, const struct block_buffer *b)
+{
+	unsigned int index = (b->offset - p->bw->offset) / BLOCK_WRITE_CHUNK;
+	uint8_t digest[SHA_DIGEST_SIZE];
+	uint8_t *slot;
+
+	SHA_hash(b->data, b->size, digest);
+	if (index < p->resumable &&
+	    !memcmp(p->journal + (size_t)index * SHA_DIGEST_SIZE, digest, SHA_DIGEST_SIZE))
+		goto written;
+	if (write_chunk(p, b))
+		return -1;
+	slot = journal_slot(p, index);
+	if (!slot) {
+		/* Without room, the written chunks are not all recorded */
+		p->journaling = false;
+		return 0;
+	}
+	memcpy(slot, digest, SHA_DIGEST_SIZE);
+
+written:
+	p->chunks = index + 1;
+	if (p->chunks % BLOCK_JOURNAL_COMMIT == 0)
+		commit_journal(p);
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct block_pipeline *p = (struct block_pipeline *)arg;
+	bool hash = p->bw->hash != BLOCK_WRITE_NO_HASH;
+	struct block_buffer *b;
+	bool failed;
+	int i = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while ((b = next_buffer(p, i, hash ? BUF_HASHED : BUF_READ,
+				hash ? &p->hashed : &p->read)) != NULL) {
+		pthread_mutex_unlock(&p->lock);
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int ret = p->journaling ? write_journaled_chunk(p, b) : write_chunk(p, b);
+		int err = errno ? errno : EIO;
+		device_metric_observe(metric_chunk_us, elapsed_us(&start));
+		pthread_mutex_lock(&p->lock);
+		if (ret) {
+			p->error = err;
+			pthread_cond_broadcast(&p->cond);
+			break;
+		}
+		p->written += b->size;
+		device_metric_add(metric_bytes, b->size);
+		set_state(p, b, BUF_FREE);
+		i = (i + 1) % BLOCK_WRITE_BUFFERS;
+	}
+	failed = p->error != 0;
+	pthread_mutex_unlock(&p->lock);
+	/* What reached the device is not written again by the next run */
+	if (p->journaling && failed)
+		commit_journal(p);
+	return NULL;
+}
+
+static void report(struct block_pipeline *p)
+{
+	off64_t written;
+
+	if (!p->bw->progress)
+		return;
+	if (p->src_size) {
+		/* Only called by the reader, which owns src_pos */
+		p->bw->progress(p->bw->ctx, p->src_pos, p->src_size);
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	written = p->written;
+	pthread_mutex_unlock(&p->lock);
+	p->bw->progress(p->bw->ctx, written, p->total);
+}
+
+/* Waits for the next free buffer of the ring, for size bytes at pos
+ * in the device. Returns NULL, and stops the reader, if a stage failed. */
+static struct block_buffer *get_buffer(struct block_pipeline *p, off64_t size, off64_t pos)
+{
+	struct block_buffer *b;
+
+	pthread_mutex_lock(&p->lock);
+	b = next_buffer(p, p->next, BUF_FREE, NULL);
+	pthread_mutex_unlock(&p->lock);
+	if (!b) {
+		p->stopped = true;
+		return NULL;
+	}
+	p->next = (p->next + 1) % BLOCK_WRITE_BUFFERS;
+	report(p);
+
+	b->size = size < BLOCK_WRITE_CHUNK ? size : BLOCK_WRITE_CHUNK;
+	b->offset = p->bw->offset + pos;
+	return b;
+}
+
+static void put_buffer(struct block_pipeline *p, struct block_buffer *b)
+{
+	pthread_mutex_lock(&p->lock);
+	set_state(p, b, BUF_READ);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Accounts for size bytes of the device which are not written */
+static void skip_range(struct block_pipeline *p, off64_t size)
+{
+	pthread_mutex_lock(&p->lock);
+	p->written += size;
+	pthread_mutex_unlock(&p->lock);
+}
+
+static int read_file(struct block_pipeline *p)
+{
+	struct block_buffer *b;
+	off64_t pos;
+
+	for (pos = 0; pos < p->total; pos += b->size) {
+		if (!(b = get_buffer(p, p->total - pos, pos)))
+			break;
+		if (safe_pread(p->src, b->data, b->size, pos)) {
+			error("Failed to read %s, %s.", p->name, strerror(errno));
+			return -1;
+		}
+		/* The image pages are not needed any more either */
+		posix_fadvise(p->src, pos, b->size, POSIX_FADV_DONTNEED);
+		put_buffer(p, b);
+	}
+	return 0;
+}
+
+/* Points *in to the next part of the compressed image, read into
+ * p->input from a file. Returns its size, 0 at the end, or -1. */
+static ssize_t next_input(struct block_pipeline *p, const unsigned char **in)
+{
+	off64_t left = p->src_size - p->src_pos;
+	size_t size = left < BLOCK_WRITE_INPUT ? left : BLOCK_WRITE_INPUT;
+
+	if (!size)
+		return 0;
+	if (p->src == -1) {
+		*in = p->data + p->src_pos;
+	} else {
+		if (safe_pread(p->src, p->input, size, p->src_pos)) {
+			error("Failed to read %s, %s.", p->name, strerror(errno));
+			return -1;
+		}
+		posix_fadvise(p->src, p->src_pos, size, POSIX_FADV_DONTNEED);
+		*in = p->input;
+	}
+	p->src_pos += size;
+	return size;
+}
+
+/* Queues the size decompressed bytes of the buffer. Only the last
+ * buffer may be partial. */
+static int put_output(struct block_pipeline *p, struct block_buffer *b, size_t size)
+{
+	if (b->offset == p->bw->offset && block_write_is_sparse(b->data, size)) {
+		error("%s is a compressed sparse image, which is not supported.", p->name);
+		errno = EINVAL;
+		return -1;
+	}
+	b->size = size;
+	put_buffer(p, b);
+	return 0;
+}
+
+static int alloc_input(struct block_pipeline *p)
+{
+	if (p->src == -1)
+		return 0;
+	p->input = malloc(BLOCK_WRITE_INPUT);
+	if (!p->input) {
+		error("Failed to allocate the input of %s.", p->name);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_gzip(struct block_pipeline *p)
+{
+	struct block_buffer *b = NULL;
+	const unsigned char *in = NULL;
+	bool eof = false;
+	off64_t pos = 0;
+	ssize_t len;
+	z_stream z;
+	int zret = Z_OK;
+	int ret = -1;
+
+	if (alloc_input(p))
+		return -1;
+	memset(&z, 0, sizeof(z));
+	/* 16 over the window bits only accepts the gzip wrapper */
+	if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+		error("Failed to start inflating %s.", p->name);
+		goto free_input;
+	}
+
+	for (;;) {
+		if (!z.avail_in && !eof) {
+			len = next_input(p, &in);
+			if (len < 0)
+				goto end;
+			eof = !len;
+			z.next_in = (Bytef *)in;
+			z.avail_in = len;
+		}
+		if (zret == Z_STREAM_END) {
+			if (!z.avail_in)
+				break;
+			/* Concatenated members, as written by pigz */
+			if (inflateReset(&z) != Z_OK)
+				goto corrupted;
+		}
+		if (!b) {
+			if (!(b = get_buffer(p, BLOCK_WRITE_CHUNK, pos))) {
+				ret = 0;
+				goto end;
+			}
+			z.next_out = (Bytef *)b->data;
+			z.avail_out = BLOCK_WRITE_CHUNK;
+		}
+		zret = inflate(&z, Z_NO_FLUSH);
+		if ((zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) ||
+		    (zret == Z_BUF_ERROR && eof))
+			goto corrupted;
+		if (!z.avail_out) {
+			pos += BLOCK_WRITE_CHUNK;
+			if (put_output(p, b, BLOCK_WRITE_CHUNK))
+				goto end;
+			b = NULL;
+		}
+	}
+	if (b && put_output(p, b, BLOCK_WRITE_CHUNK - z.avail_out))
+		goto end;
+	ret = 0;
+	goto end;
+
+corrupted:
+	error("Corrupted gzip image %s, %s.", p->name, z.msg ? z.msg : "truncated");
+	errno = EINVAL;
+end:
+	inflateEnd(&z);
+free_input:
+	free(p->input);
+	return ret;
+}
+
+#ifdef CONFIG_INTELPROV_LZ4
+static int read_lz4(struct block_pipeline *p)
+{
+	LZ4F_decompressionContext_t dctx;
+	struct block_buffer *b = NULL;
+	const unsigned char *in = NULL;
+	size_t in_len = 0, filled = 0, out, used;
+	/* Output of the last call, LZ4F keeps what did not fit */
+	size_t last_out = 1;
+	size_t hint = 1;
+	bool eof = false;
+	off64_t pos = 0;
+	ssize_t len;
+	int ret = -1;
+
+	if (alloc_input(p))
+		return -1;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		error("Failed to start decompressing %s.", p->name);
+		goto free_input;
+	}
+
+	for (;;) {
+		if (!in_len && !eof) {
+			len = next_input(p, &in);
+			if (len < 0)
+				goto end;
+			eof = !len;
+			in_len = len;
+		}
+		if (!in_len && eof) {
+			/* A frame ended, or its end is missing */
+			if (!hint)
+				break;
+			if (!last_out)
+				goto corrupted;
+		}
+		if (!b) {
+			if (!(b = get_buffer(p, BLOCK_WRITE_CHUNK, pos))) {
+				ret = 0;
+				goto end;
+			}
+			filled = 0;
+		}
+		out = BLOCK_WRITE_CHUNK - filled;
+		used = in_len;
+		hint = LZ4F_decompress(dctx, (unsigned char *)b->data + filled, &out, in, &used, NULL);
+		if (LZ4F_isError(hint)) {
+			error("Corrupted LZ4 image %s, %s.", p->name, LZ4F_getErrorName(hint));
+			errno = EINVAL;
+			goto end;
+		}
+		in += used;
+		in_len -= used;
+		filled += out;
+		last_out = out;
+		if (filled == BLOCK_WRITE_CHUNK) {
+			pos += BLOCK_WRITE_CHUNK;
+			if (put_output(p, b, BLOCK_WRITE_CHUNK))
+				goto end;
+			b = NULL;
+		}
+	}
+	if (b && put_output(p, b, filled))
+		goto end;
+	ret = 0;
+	goto end;
+
+corrupted:
+	error("Corrupted LZ4 image %s, truncated.", p->name);
+	errno = EINVAL;
+end:
+	LZ4F_freeDecompressionContext(dctx);
+free_input:
+	free(p->input);
+	return ret;
+}
+#endif
+
+/* Sets the decompressing reader of the size bytes of the image, which
+ * start with head. Returns false if the image is not compressed. */
+static bool set_decompressor(struct block_pipeline *p, const unsigned char *head,
+			     size_t head_size, off64_t size)
+{
+	if (!(p->bw->flags & BLOCK_WRITE_DECOMPRESS))
+		return false;
+
+	if (head_size >= 2 && head[0] == GZIP_MAGIC0 && head[1] == GZIP_MAGIC1) {
+		p->reader = read_gzip;
+#ifdef CONFIG_INTELPROV_LZ4
+	} else if (head_size >= 4 && (head[0] | head[1] << 8 | head[2] << 16 |
+				      (uint32_t)head[3] << 24) == LZ4_FRAME_MAGIC) {
+		p->reader = read_lz4;
+#endif
+	} else {
+		return false;
+	}
+	p->src_size = size;
+	/* Unknown, so that no range is discarded */
+	p->total = 0;
+	return true;
+}
+
+/* Queues size bytes of data for pos in the device */
+static void queue_data(struct block_pipeline *p, const unsigned char *data,
+		       off64_t size, off64_t pos)
+{
+	struct block_buffer *b;
+	off64_t done;
+
+	for (done = 0; done < size; done += b->size) {
+		if (!(b = get_buffer(p, size - done, pos + done)))
+			break;
+		memcpy(b->data, data + done, b->size);
+		put_buffer(p, b);
+	}
+}
+
+static void queue_fill(struct block_pipeline *p, uint32_t value, off64_t size, off64_t pos)
+{
+	struct block_buffer *b;
+	off64_t done;
+	size_t i;
+
+	for (done = 0; done < size; done += b->size) {
+		if (!(b = get_buffer(p, size - done, pos + done)))
+			break;
+		for (i = 0; i < b->size / sizeof(value); i++)
+			((uint32_t *)b->data)[i] = value;
+		put_buffer(p, b);
+	}
+}
+
+static int read_data(struct block_pipeline *p)
+{
+	queue_data(p, p->data, p->total, 0);
+	return 0;
+}
+
+/* The image was checked by check_sparse() */
+static int read_sparse(struct block_pipeline *p)
+{
+	struct sparse_header sh;
+	struct chunk_header ch;
+	const unsigned char *chunk;
+	uint32_t fill, i;
+	off64_t pos = 0;
+
+	memcpy(&sh, p->data, sizeof(sh));
+	chunk = p->data + sh.file_hdr_sz;
+	for (i = 0; i < sh.total_chunks && !p->stopped; i++, chunk += ch.total_sz) {
+		const unsigned char *body = chunk + sh.chunk_hdr_sz;
+		off64_t size;
+
+		memcpy(&ch, chunk, sizeof(ch));
+		size = (off64_t)ch.chunk_sz * sh.blk_sz;
+		switch (ch.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			queue_data(p, body, size, pos);
+			break;
+		case CHUNK_TYPE_FILL:
+			memcpy(&fill, body, sizeof(fill));
+			if (fill == 0 && p->skip_zeros)
+				skip_range(p, size);
+			else
+				queue_fill(p, fill, size, pos);
+			break;
+		default:
+			skip_range(p, size);
+			break;
+		}
+		pos += size;
+	}
+	return 0;
+}
+
+static int check_sparse(const unsigned char *data, size_t size, off64_t *total)
+{
+	struct sparse_header sh;
+	struct chunk_header ch;
+	uint64_t blocks = 0;
+	size_t pos;
+	uint32_t i;
+
+	if (!block_write_is_sparse(data, size))
+		return -1;
+	memcpy(&sh, data, sizeof(sh));
+	if (sh.major_version != 1 || sh.file_hdr_sz < sizeof(sh) ||
+	    sh.chunk_hdr_sz < sizeof(ch) || !sh.blk_sz || sh.blk_sz % BLOCK_WRITE_SECTOR) {
+		error("Unsupported sparse image version %d.%d.", sh.major_version,
+		      sh.minor_version);
+		return -1;
+	}
+
+	for (i = 0, pos = sh.file_hdr_sz; i < sh.total_chunks; i++, pos += ch.total_sz) {
+		uint64_t body;
+
+		if (pos > size || size - pos < sh.chunk_hdr_sz)
+			goto corrupted;
+		memcpy(&ch, data + pos, sizeof(ch));
+		if (ch.total_sz < sh.chunk_hdr_sz || ch.total_sz > size - pos)
+			goto corrupted;
+		body = ch.total_sz - sh.chunk_hdr_sz;
+		switch (ch.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (body != (uint64_t)ch.chunk_sz * sh.blk_sz)
+				goto corrupted;
+			break;
+		case CHUNK_TYPE_FILL:
+			if (body < sizeof(uint32_t))
+				goto corrupted;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+		case CHUNK_TYPE_CRC32:
+			break;
+		default:
+			goto corrupted;
+		}
+		blocks += ch.chunk_sz;
+	}
+	if (blocks > sh.total_blks)
+		goto corrupted;
+
+	*total = (off64_t)sh.total_blks * sh.blk_sz;
+	return 0;
+
+corrupted:
+	error("Corrupted sparse image, chunk %d.", i);
+	return -1;
+}
+
+/* Discards the range of the image, so that the device may skip the
+ * blocks of zeros. Not all the devices support it, nor read the
+ * discarded blocks as zeros. */
+static void discard_range(struct block_pipeline *p)
+{
+	uint64_t range[2];
+	unsigned int zeroes = 0;
+
+	range[0] = p->bw->offset;
+	range[1] = p->total & ~(BLOCK_WRITE_SECTOR - 1);
+	if (range[0] % BLOCK_WRITE_SECTOR || !range[1])
+		return;
+	if (ioctl(p->fd, BLKDISCARD, &range) == -1)
+		return;
+	if (ioctl(p->fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes)
+		p->skip_zeros = true;
+}
+
+/* Runs the pipeline in the caller thread, which reads the chunks */
+static int run_pipeline(struct block_pipeline *p)
+{
+	struct block_write *bw = p->bw;
+	bool hash = bw->hash != BLOCK_WRITE_NO_HASH;
+	pthread_t hasher, writer;
+	int i, err = 0;
+	int ret = -1;
+
+	if (bw->hash == BLOCK_WRITE_SHA256_TREE) {
+		error("No tree digest of a written image.");
+		return -1;
+	}
+	pthread_once(&metrics_once, map_metrics);
+
+	/* O_DIRECT needs the device offset on a sector boundary */
+	p->direct = (bw->offset % BLOCK_WRITE_SECTOR) == 0;
+	p->fd = open(bw->device, O_WRONLY | (p->direct ? O_DIRECT : 0));
+	if (p->fd == -1 && p->direct) {
+		p->direct = false;
+		p->fd = open(bw->device, O_WRONLY);
+	}
+	if (p->fd == -1) {
+		error("Failed to open %s device block, %s.", bw->device, strerror(errno));
+		return -1;
+	}
+	p->flushed = p->synced = bw->offset;
+	/* The chunks of a sparse image are not in order */
+	p->journaling = bw->journal && p->reader != read_sparse;
+	if (p->journaling)
+		load_journal(p);
+	/* The journaled chunks are already there */
+	if ((bw->flags & BLOCK_WRITE_DISCARD) && !p->resumable)
+		discard_range(p);
+
+	for (i = 0; i < BLOCK_WRITE_BUFFERS; i++) {
+		if (posix_memalign(&p->buffers[i].data, BLOCK_WRITE_ALIGN, BLOCK_WRITE_CHUNK)) {
+			error("Failed to allocate the write buffers.");
+			goto free_buffers;
+		}
+	}
+	if (bw->hash == BLOCK_WRITE_SHA1)
+		SHA_init(&p->sha1);
+	else if (bw->hash == BLOCK_WRITE_SHA256)
+		SHA256_init(&p->sha256);
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (pthread_create(&writer, NULL, writer_thread, p)) {
+		error("Failed to start the writer thread.");
+		goto destroy;
+	}
+	if (hash && pthread_create(&hasher, NULL, hasher_thread, p)) {
+		error("Failed to start the hasher thread.");
+		hash = false;
+		err = EAGAIN;
+	}
+
+	if (!err && p->reader(p))
+		err = errno ? errno : EIO;
+
+	pthread_mutex_lock(&p->lock);
+	p->read = true;
+	if (err) {
+		/* The chunks of a partial image are not written */
+		p->error = err;
+	}
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	if (hash)
+		pthread_join(hasher, NULL);
+	pthread_join(writer, NULL);
+
+	if (err)
+		goto destroy;
+	if (p->error) {
+		error("Failed to write into %s device block, %s.", bw->device, strerror(p->error));
+		goto destroy;
+	}
+	if (fsync(p->fd) == -1) {
+		error("Failed to sync %s, %s.", bw->device, strerror(errno));
+		goto destroy;
+	}
+	if (bw->hash == BLOCK_WRITE_SHA1)
+		memcpy(bw->digest, SHA_final(&p->sha1), SHA_DIGEST_SIZE);
+	else if (bw->hash == BLOCK_WRITE_SHA256)
+		memcpy(bw->digest, SHA256_final(&p->sha256), SHA256_DIGEST_SIZE);
+	if (bw->journal)
+		unlink(bw->journal);
+	report(p);
+	ret = 0;
+
+destroy:
+	device_metric_add(ret ? metric_failures : metric_images, 1);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+free_buffers:
+	for (i = 0; i < BLOCK_WRITE_BUFFERS; i++)
+		free(p->buffers[i].data);
+	free(p->journal);
+	close(p->fd);
+	return ret;
+}
+
+int block_write_file(struct block_write *bw, const char *filename)
+{
+	struct block_pipeline p;
+	struct stat64 sb;
+	int ret = -1;
+
+	memset(&p, 0, sizeof(p));
+	p.bw = bw;
+	p.src = open(filename, O_RDONLY);
+	if (p.src == -1) {
+		error("Failed to open %s file, %s.", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat64(p.src, &sb) == -1) {
+		error("Failed to get stat on %s file, %s.", filename, strerror(errno));
+		goto close_src;
+	}
+	p.name = filename;
+	p.total = sb.st_size;
+	p.reader = read_file;
+	if (bw->flags & BLOCK_WRITE_DECOMPRESS) {
+		unsigned char head[4];
+		size_t head_size = sb.st_size < (off64_t)sizeof(head) ? sb.st_size : sizeof(head);
+
+		if (safe_pread(p.src, head, head_size, 0)) {
+			error("Failed to read %s file, %s.", filename, strerror(errno));
+			goto close_src;
+		}
+		set_decompressor(&p, head, head_size, sb.st_size);
+	}
+	posix_fadvise(p.src, 0, 0, POSIX_FADV_SEQUENTIAL);
+	ret = run_pipeline(&p);
+
+close_src:
+	close(p.src);
+	return ret;
+}
+
+int block_write_data(struct block_write *bw, const void *data, size_t size)
+{
+	struct block_pipeline p;
+
+	memset(&p, 0, sizeof(p));
+	p.bw = bw;
+	p.src = -1;
+	p.name = "image";
+	p.data = (const unsigned char *)data;
+	p.total = size;
+	p.reader = read_data;
+	set_decompressor(&p, p.data, size, size);
+	return run_pipeline(&p);
+}
+
+bool block_write_is_sparse(const void *data, size_t size)
+{
+	uint32_t magic;
+
+	if (size < sizeof(struct sparse_header))
+		return false;
+	memcpy(&magic, data, sizeof(magic));
+	return magic == SPARSE_HEADER_MAGIC;
+}
+
+int block_write_sparse(struct block_write *bw, const void *data, size_t size)
+{
+	struct block_pipeline p;
+
+	if (bw->hash != BLOCK_WRITE_NO_HASH) {
+		error("No digest of a sparse image.");
+		return -1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.bw = bw;
+	p.src = -1;
+	p.name = "sparse image";
+	p.data = (const unsigned char *)data;
+	p.reader = read_sparse;
+	if (check_sparse(p.data, size, &p.total))
+		return -1;
+	return run_pipeline(&p);
+}
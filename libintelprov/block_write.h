@@ -0,0 +1,94 @@
+/*
+ * Copyright 2013 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BLOCK_WRITE_H
+#define BLOCK_WRITE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Size of the chunks read from the image and written to the device */
+#define BLOCK_WRITE_CHUNK	(2 * 1024 * 1024)
+
+/* Digest of the written data */
+#define BLOCK_WRITE_NO_HASH	0
+#define BLOCK_WRITE_SHA1	1
+#define BLOCK_WRITE_SHA256	2
+/* SHA-256 of the SHA-256 of each BLOCK_DIGEST_SEGMENT bytes segment of
+ * the data, concatenated, the last segment being the remainder. The
+ * segments are hashed in parallel. Only for block_digest_fd() and
+ * block_digest_data(), the written data is hashed in order. */
+#define BLOCK_WRITE_SHA256_TREE	3
+
+#define BLOCK_DIGEST_SEGMENT	(1024 * 1024)
+
+#define BLOCK_WRITE_DIGEST_MAX	32
+
+/* Discards the range of the image before writing it, and skips its
+ * blocks of zeros when the device then reads them as zeros */
+#define BLOCK_WRITE_DISCARD	(1 << 0)
+
+/* Decompresses the image while it is written, when its first bytes
+ * are the ones of a gzip stream, or of an LZ4 frame with
+ * CONFIG_INTELPROV_LZ4. The digest is the one of the decompressed
+ * image, which may not be a sparse one. */
+#define BLOCK_WRITE_DECOMPRESS	(1 << 1)
+
+/* Called between the chunks, with the number of bytes written so far */
+typedef void (*block_write_progress_t) (void *ctx, off64_t done, off64_t total);
+
+/* Progress of the writes which may be resumed, see block_write.journal */
+#define BLOCK_WRITE_JOURNAL_FILE	"/cache/recovery/intelprov_journal"
+
+struct block_write {
+	const char *device;
+	off64_t offset;
+	int flags;
+	/* If not NULL, the file recording the SHA-1 of the chunks which
+	 * reached the device. A write of the same device range started
+	 * again after a failure or a power loss does not rewrite the
+	 * chunks whose SHA-1 is recorded, and the file is removed once
+	 * the whole image is written. Not used for sparse images. */
+	const char *journal;
+	int hash;
+	/* Set on success, when hash is not BLOCK_WRITE_NO_HASH */
+	uint8_t digest[BLOCK_WRITE_DIGEST_MAX];
+	block_write_progress_t progress;
+	void *ctx;
+};
+
+/* Streams the image into bw->device at bw->offset. Reading, hashing
+ * and writing run in threads of their own, through a ring of chunks
+ * which bypass the page cache when the device allows it, so that a
+ * large image never fills the memory. Return 0, or -1 on error. */
+int block_write_file(struct block_write *bw, const char *filename);
+int block_write_data(struct block_write *bw, const void *data, size_t size);
+
+/* Android sparse images. Only the raw and fill chunks are written,
+ * the don't care ones are left as they are. No digest is computed. */
+bool block_write_is_sparse(const void *data, size_t size);
+int block_write_sparse(struct block_write *bw, const void *data, size_t size);
+
+/* Size of the digest of hash */
+size_t block_write_digest_size(int hash);
+
+/* Digest of the size bytes of fd at offset, read one chunk at a time,
+ * or of data. Return 0, or -1 on error. */
+int block_digest_fd(int fd, off64_t offset, off64_t size, int hash, uint8_t *digest);
+int block_digest_data(const void *data, size_t size, int hash, uint8_t *digest);
+
+#endif
@@ -46,16 +46,50 @@ static bool next_component(struct bootloader_hdr *bootl_hdr,
 	return (unsigned long)*c_hdr - (unsigned long)bootl_hdr < sz;
 }
 
-static bool next_component_filter(struct bootloader_hdr *bootl_hdr,
-				  struct component_hdr **c_hdr, unsigned sz,
-				  const char* filter)
+static const char *magics[] = { DROIDBOOT_MAGIC, IFWI_MAGIC, SPLASHSCREEN_MAGIC, CAPSULE_MAGIC, ESP_MAGIC};
+static const char *names[] = { FASTBOOT_OS_NAME, IFWI_NAME, SPLASHSCREEN_NAME, CAPSULE_NAME, ESP_UPDATE_NAME};
+
+#define TARGETS			ARRAY_SIZE(magics)
+#define MAX_TARGET_COMPONENTS	8
+
+/* Components to flash for each target, in their order in the file */
+struct flash_plan {
+	struct component_hdr *components[TARGETS][MAX_TARGET_COMPONENTS];
+	unsigned count[TARGETS];
+};
+
+/* Sorts out all the components in a single walk, checking that each
+ * one is within the downloaded file */
+static int plan_components(struct bootloader_hdr *bootl_hdr, unsigned sz,
+			   struct flash_plan *plan)
 {
-	printf("Looking for %s\n", filter);
-	while (next_component(bootl_hdr, c_hdr, sz))
-		if (!strncmp((*c_hdr)->magic, filter, strlen(filter)) &&
-		    (*c_hdr)->flags & FLAG_FLASH)
-			return true;
-	return false;
+	struct component_hdr *c_hdr = NULL;
+	unsigned long offset;
+	unsigned i;
+
+	memset(plan, 0, sizeof(*plan));
+	while (next_component(bootl_hdr, &c_hdr, sz)) {
+		offset = (unsigned long)(c_hdr + 1) - (unsigned long)bootl_hdr;
+		if (offset > sz || c_hdr->size > sz - offset) {
+			fastboot_fail("truncated bootloader component !");
+			return -1;
+		}
+		if (!(c_hdr->flags & FLAG_FLASH))
+			continue;
+
+		for (i = 0; i < TARGETS; i++)
+			if (!strncmp(c_hdr->magic, magics[i], strlen(magics[i])))
+				break;
+		if (i == TARGETS)
+			continue;
+
+		if (plan->count[i] == MAX_TARGET_COMPONENTS) {
+			fastboot_fail("too many bootloader components !");
+			return -1;
+		}
+		plan->components[i][plan->count[i]++] = c_hdr;
+	}
+	return 0;
 }
 
 int flash_bootloader(void *data, unsigned sz)
@@ -74,20 +108,20 @@ int flash_bootloader(void *data, unsigned sz)
 		return ret;
 	}
 
-	unsigned i;
+	struct flash_plan plan;
+	unsigned i, j;
 
 	printf("Found bootloader rev %d version %02d.%02d\n", bootl_hdr->revision,
 		bootl_hdr->version.major, bootl_hdr->version.minor);
 
-	const char *magics[] = { DROIDBOOT_MAGIC, IFWI_MAGIC, SPLASHSCREEN_MAGIC, CAPSULE_MAGIC, ESP_MAGIC};
-	const char *names[] = { FASTBOOT_OS_NAME, IFWI_NAME, SPLASHSCREEN_NAME, CAPSULE_NAME, ESP_UPDATE_NAME};
+	if (plan_components(bootl_hdr, sz, &plan))
+		return ret;
+
 	bool something_flashed = false;
-	for (i = 0; i < ARRAY_SIZE(magics); i++) {
-		bool present = false;
+	for (i = 0; i < TARGETS; i++) {
 		bool flashed = false;
-		c_hdr = NULL;
-		while (next_component_filter(bootl_hdr, &c_hdr, sz, magics[i])) {
-			present = true;
+		for (j = 0; j < plan.count[i]; j++) {
+			c_hdr = plan.components[i][j];
 			printf("flashing %s\n", names[i]);
 			ret =  aboot_flash(names[i], c_hdr + 1, c_hdr->size);
 			if (ret != 0 && ret != -EPERM)
@@ -95,7 +129,7 @@ int flash_bootloader(void *data, unsigned sz)
 			if (ret == 0)
 				flashed = true;
 		}
-		if (present && !flashed) {
+		if (plan.count[i] && !flashed) {
 			if (!strcmp(names[i], FASTBOOT_OS_NAME)) {
 				error("Bootloader version not supported\n");
 				return ret;
@@ -24,11 +24,15 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <cutils/properties.h>
+#define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <sys/_system_properties.h>
 #include <cutils/android_reboot.h>
 #include <unistd.h>
 #include <charger/charger.h>
 #include <linux/ioctl.h>
 #include <sys/mount.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "volumeutils/ufdisk.h"
 #include "update_osip.h"
@@ -203,18 +207,96 @@ out:
 #define K_MAX_ARG_LEN 256
 
 #ifndef EXTERNAL
+/* Shared by wait_property and its waiter, which may outlive it on a
+ * timeout until the next property change, so the last one frees it */
+struct property_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char prop[PROPERTY_KEY_MAX];
+	char value[PROPERTY_VALUE_MAX];
+	bool done;
+	bool cancelled;
+	int refs;
+};
+
+static void property_wait_put(struct property_wait *w)
+{
+	bool last;
+
+	pthread_mutex_lock(&w->lock);
+	last = --w->refs == 0;
+	pthread_mutex_unlock(&w->lock);
+	if (!last)
+		return;
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+/* Sleeps on the serial of the property area, which changes with any
+ * property, and checks the awaited one each time it does */
+static void *property_waiter(void *arg)
+{
+	struct property_wait *w = arg;
+	char v[PROPERTY_VALUE_MAX];
+	unsigned int serial = 0;
+	bool stop;
+
+	do {
+		serial = __system_property_wait_any(serial);
+		property_get(w->prop, v, NULL);
+		pthread_mutex_lock(&w->lock);
+		if (!strcmp(v, w->value)) {
+			w->done = true;
+			pthread_cond_signal(&w->cond);
+		}
+		stop = w->done || w->cancelled;
+		pthread_mutex_unlock(&w->lock);
+	} while (!stop);
+
+	property_wait_put(w);
+	return NULL;
+}
+
 static int wait_property(char *prop, char *value, int timeout_sec)
 {
-	int i;
+	struct property_wait *w;
+	struct timespec deadline;
+	pthread_t thread;
 	char v[PROPERTY_VALUE_MAX];
+	int ret = 0;
 
-	for (i = 0; i < timeout_sec; i++) {
-		property_get(prop, v, NULL);
-		if (!strcmp(v, value))
-			return 0;
-		sleep(1);
+	property_get(prop, v, NULL);
+	if (!strcmp(v, value))
+		return 0;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -1;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	snprintf(w->prop, sizeof(w->prop), "%s", prop);
+	snprintf(w->value, sizeof(w->value), "%s", value);
+	w->refs = 2;
+
+	if (pthread_create(&thread, NULL, property_waiter, w)) {
+		free(w);
+		return -1;
 	}
-	return -1;
+	pthread_detach(thread);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_sec;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->done && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+	ret = w->done ? 0 : -1;
+	w->cancelled = true;
+	pthread_mutex_unlock(&w->lock);
+
+	property_wait_put(w);
+	return ret;
 }
 
 static int oem_backup_factory(int argc, char **argv)
@@ -445,6 +527,165 @@ end:
 	return ret;
 }
 
+/* Images flashed by oem flash-many, with the queue of the device they
+ * are written to. The queues run concurrently, each one serially. The
+ * boot images are streamed from their file, the others read whole. */
+enum flash_queue {
+	QUEUE_USER_AREA,
+	QUEUE_BOOT_AREA,
+	QUEUE_COUNT
+};
+
+static const struct {
+	const char *name;
+	int (*flash) (void *data, unsigned sz);
+	enum flash_queue queue;
+	bool stream;
+} flash_many_targets[] = {
+	{ ANDROID_OS_NAME, flash_android_kernel, QUEUE_USER_AREA, true },
+	{ RECOVERY_OS_NAME, flash_recovery_kernel, QUEUE_USER_AREA, true },
+	{ FASTBOOT_OS_NAME, flash_fastboot_kernel, QUEUE_USER_AREA, true },
+	{ TEST_OS_NAME, flash_testos, QUEUE_USER_AREA, false },
+	{ ESP_PART_NAME, flash_esp, QUEUE_USER_AREA, false },
+	{ SPLASHSCREEN_NAME, flash_splashscreen_image1, QUEUE_USER_AREA, false },
+	{ SPLASHSCREEN_NAME1, flash_splashscreen_image1, QUEUE_USER_AREA, false },
+	{ SPLASHSCREEN_NAME2, flash_splashscreen_image2, QUEUE_USER_AREA, false },
+	{ SPLASHSCREEN_NAME3, flash_splashscreen_image3, QUEUE_USER_AREA, false },
+	{ SPLASHSCREEN_NAME4, flash_splashscreen_image4, QUEUE_USER_AREA, false },
+	{ "ifwi", flash_ifwi, QUEUE_BOOT_AREA, false },
+	{ "token_umip", flash_token_umip, QUEUE_BOOT_AREA, false },
+};
+
+#define FLASH_MANY_MAX	16
+
+struct flash_request {
+	unsigned target;
+	const char *path;
+};
+
+struct flash_queue_run {
+	pthread_t thread;
+	struct flash_request requests[FLASH_MANY_MAX];
+	unsigned count;
+	/* The failed request, or NULL */
+	struct flash_request *failed;
+};
+
+/* The handlers report through util, which must not reach fastboot
+ * from several threads at once */
+static void flash_many_log(const char *msg)
+{
+	LOGI("%s", msg);
+}
+
+static void *run_flash_queue(void *arg)
+{
+	struct flash_queue_run *run = arg;
+	struct flash_request *req;
+	void *data;
+	size_t size;
+	unsigned i;
+
+	for (i = 0; i < run->count; i++) {
+		req = &run->requests[i];
+		LOGI("flash-many: flashing %s from %s\n", flash_many_targets[req->target].name, req->path);
+		if (flash_many_targets[req->target].stream) {
+			if (flash_image_file(req->path, flash_many_targets[req->target].name)) {
+				run->failed = req;
+				break;
+			}
+			continue;
+		}
+		if (file_read(req->path, &data, &size)) {
+			run->failed = req;
+			break;
+		}
+		if (flash_many_targets[req->target].flash(data, size)) {
+			free(data);
+			run->failed = req;
+			break;
+		}
+		free(data);
+	}
+	return NULL;
+}
+
+static int oem_flash_many(int argc, char **argv)
+{
+	struct flash_queue_run runs[QUEUE_COUNT];
+	struct flash_request *failed = NULL;
+	struct flash_queue_run *run;
+	bool started[QUEUE_COUNT];
+	char *path;
+	unsigned i, target;
+	int arg;
+
+	if (argc < 2) {
+		fastboot_fail("Usage: flash-many <name>:<file> [<name>:<file>...]");
+		return -EINVAL;
+	}
+
+	memset(runs, 0, sizeof(runs));
+	for (arg = 1; arg < argc; arg++) {
+		path = strchr(argv[arg], ':');
+		if (!path) {
+			fastboot_fail("flash-many images must be given as <name>:<file>");
+			return -EINVAL;
+		}
+		*path++ = '\0';
+
+		for (target = 0; target < ARRAY_SIZE(flash_many_targets); target++)
+			if (!strcmp(argv[arg], flash_many_targets[target].name))
+				break;
+		if (target == ARRAY_SIZE(flash_many_targets)) {
+			fastboot_fail("flash-many does not support this image");
+			return -EINVAL;
+		}
+
+		run = &runs[flash_many_targets[target].queue];
+		if (run->count == FLASH_MANY_MAX) {
+			fastboot_fail("Too many images for flash-many");
+			return -EINVAL;
+		}
+		run->requests[run->count].target = target;
+		run->requests[run->count].path = path;
+		run->count++;
+	}
+
+	util_init(flash_many_log, flash_many_log);
+	for (i = 0; i < QUEUE_COUNT; i++) {
+		started[i] = false;
+		if (!runs[i].count)
+			continue;
+		if (pthread_create(&runs[i].thread, NULL, run_flash_queue, &runs[i])) {
+			/* Run it in the end instead */
+			LOGE("flash-many: no thread for queue %u\n", i);
+			continue;
+		}
+		started[i] = true;
+	}
+	for (i = 0; i < QUEUE_COUNT; i++) {
+		if (!runs[i].count)
+			continue;
+		if (started[i])
+			pthread_join(runs[i].thread, NULL);
+		else
+			run_flash_queue(&runs[i]);
+		if (runs[i].failed && !failed)
+			failed = runs[i].failed;
+	}
+	util_init(fastboot_fail, fastboot_info);
+
+	if (failed) {
+		LOGE("flash-many: failed to flash %s\n", flash_many_targets[failed->target].name);
+		fastboot_fail("flash-many failed");
+		return -1;
+	}
+
+	fastboot_okay("");
+	return 0;
+}
+
 #ifdef USE_GUI
 #define PROP_FILE					"/default.prop"
 #define SERIAL_NUM_FILE			"/sys/class/android_usb/android0/iSerial"
@@ -664,6 +905,7 @@ void libintel_droidboot_init(void)
 	ret |= aboot_register_oem_cmd("wipe", oem_wipe_partition);
 	ret |= aboot_register_oem_cmd("config", oem_config);
 	ret |= aboot_register_oem_cmd("mount", oem_mount);
+	ret |= aboot_register_oem_cmd("flash-many", oem_flash_many);
 
 #ifdef TEE_FRAMEWORK
 	print_fun = fastboot_info;
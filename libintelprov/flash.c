@@ -14,11 +14,23 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block_write.h"
 #include "flash.h"
 #include "flash_ops.h"
 #include "util.h"
 
-static void *o;
+/* Per thread, as images on distinct devices may be flashed concurrently */
+static __thread void *o;
 
 #define ops_call(op, func, ...) \
 	(o = op##_ops()) && ((struct op##_operations *)o)->func ? ((struct op##_operations *)o)->func(__VA_ARGS__) : stub_operation(#func)
@@ -78,11 +90,264 @@ int flash_capsule(void *data, unsigned sz)
 	return ops_call(capsule, flash_capsule, data, sz);
 }
 
+int recovery_generation(uint32_t *generation)
+{
+	void *data;
+	size_t size;
+	int ret = -1;
+
+	if (access(RECOVERY_GENERATION_FILE, F_OK))
+		return -1;
+	if (file_read(RECOVERY_GENERATION_FILE, &data, &size))
+		return -1;
+	if (size == sizeof(*generation)) {
+		memcpy(generation, data, sizeof(*generation));
+		ret = 0;
+	}
+	free(data);
+	return ret;
+}
+
+int new_recovery_generation(uint32_t *generation)
+{
+	uint32_t current;
+
+	if (recovery_generation(&current))
+		current = 0;
+	*generation = current + 1;
+	if (file_write_atomic(RECOVERY_GENERATION_FILE, generation, sizeof(*generation))) {
+		/* Without a generation, no verification is trusted */
+		unlink(RECOVERY_GENERATION_FILE);
+		return -1;
+	}
+	return 0;
+}
+
+/* Called before the recovery image is written, so that even an
+ * interrupted write outdates the last verification of the previous one */
+static void recovery_written(const char *name)
+{
+	uint32_t generation;
+
+	if (!strcmp(name, RECOVERY_OS_NAME))
+		new_recovery_generation(&generation);
+}
+
 int flash_image(void *data, unsigned sz, const char *name)
 {
+	recovery_written(name);
 	return ops_call(bootimage, flash_image, data, sz, name);
 }
 
+int flash_image_stream(const char *name, size_t size, image_fill_t fill, void *ctx)
+{
+	recovery_written(name);
+	return ops_call(bootimage, flash_image_stream, name, size, fill, ctx);
+}
+
+int image_sink_write(struct image_sink *sink, const void *data, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	size_t header_len;
+	ssize_t ret;
+
+	if (len > sink->size - sink->pos) {
+		error("Image is larger than the expected %zu bytes\n", sink->size);
+		return -1;
+	}
+
+	if (sink->pos < sink->header_size) {
+		header_len = sink->header_size - sink->pos;
+		if (header_len > len)
+			header_len = len;
+		memcpy(sink->header + sink->pos, bytes, header_len);
+		sink->pos += header_len;
+		bytes += header_len;
+		len -= header_len;
+	}
+
+	while (len) {
+		ret = pwrite64(sink->fd, bytes, len, sink->offset + sink->pos - sink->header_size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			error("Failed to write the image: %s\n", strerror(errno));
+			return -1;
+		}
+		sink->pos += ret;
+		bytes += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Ring of the chunks read from an image file and not yet written */
+struct file_ring {
+	int fd;
+	size_t size;
+	unsigned char *chunks[FLASH_FILE_RING_CHUNKS];
+	size_t lengths[FLASH_FILE_RING_CHUNKS];
+	unsigned head;		/* next chunk read */
+	unsigned tail;		/* next chunk written */
+	unsigned count;
+	bool eof;		/* the reader is done, maybe on an error */
+	bool failed;		/* on either side */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *read_file_ring(void *arg)
+{
+	struct file_ring *ring = (struct file_ring *)arg;
+	size_t done = 0, len;
+	unsigned char *chunk;
+
+	while (done < ring->size) {
+		pthread_mutex_lock(&ring->lock);
+		while (ring->count == FLASH_FILE_RING_CHUNKS && !ring->failed)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if (ring->failed) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		chunk = ring->chunks[ring->head];
+		pthread_mutex_unlock(&ring->lock);
+
+		/* The chunk at head is not used by the writer until pushed */
+		len = ring->size - done;
+		if (len > FLASH_FILE_CHUNK_SIZE)
+			len = FLASH_FILE_CHUNK_SIZE;
+		if (safe_read(ring->fd, chunk, len)) {
+			pthread_mutex_lock(&ring->lock);
+			ring->failed = true;
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		done += len;
+
+		pthread_mutex_lock(&ring->lock);
+		ring->lengths[ring->head] = len;
+		ring->head = (ring->head + 1) % FLASH_FILE_RING_CHUNKS;
+		ring->count++;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	ring->eof = true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+static int fill_file_ring(struct image_sink *sink, void *ctx)
+{
+	struct file_ring *ring = (struct file_ring *)ctx;
+	int ret = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	while (!ring->failed) {
+		while (!ring->count && !ring->eof)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if (!ring->count || ring->failed)
+			break;
+		pthread_mutex_unlock(&ring->lock);
+
+		/* The chunk at tail is not reused by the reader until popped */
+		ret = image_sink_write(sink, ring->chunks[ring->tail], ring->lengths[ring->tail]);
+
+		pthread_mutex_lock(&ring->lock);
+		if (ret) {
+			ring->failed = true;
+		} else {
+			ring->tail = (ring->tail + 1) % FLASH_FILE_RING_CHUNKS;
+			ring->count--;
+		}
+		pthread_cond_broadcast(&ring->cond);
+	}
+	if (ring->failed)
+		ret = -1;
+	pthread_mutex_unlock(&ring->lock);
+	return ret;
+}
+
+static int flash_image_file_whole(const char *path, const char *name)
+{
+	void *data;
+	size_t size;
+	int ret;
+
+	if (file_read(path, &data, &size))
+		return -1;
+	ret = flash_image(data, size, name);
+	free(data);
+	return ret;
+}
+
+int flash_image_file(const char *path, const char *name)
+{
+	/* Larger than the sparse header */
+	unsigned char header[64];
+	struct file_ring ring;
+	pthread_t reader;
+	struct stat st;
+	unsigned i;
+	int ret = -1;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = open(path, O_RDONLY);
+	if (ring.fd < 0) {
+		error("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(ring.fd, &st)) {
+		error("Failed to stat %s: %s\n", path, strerror(errno));
+		goto out;
+	}
+	ring.size = st.st_size;
+
+	/* The sparse format is expanded by flash_image only */
+	if (ring.size >= sizeof(header) && pread(ring.fd, header, sizeof(header), 0) == sizeof(header) &&
+	    block_write_is_sparse(header, sizeof(header))) {
+		ret = flash_image_file_whole(path, name);
+		goto out;
+	}
+
+	for (i = 0; i < FLASH_FILE_RING_CHUNKS; i++) {
+		ring.chunks[i] = malloc(FLASH_FILE_CHUNK_SIZE);
+		if (!ring.chunks[i]) {
+			error("Failed to allocate the chunks of %s\n", path);
+			goto out;
+		}
+	}
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+
+	if (pthread_create(&reader, NULL, read_file_ring, &ring)) {
+		error("Failed to start the reader of %s\n", path);
+		goto destroy;
+	}
+	ret = flash_image_stream(name, ring.size, fill_file_ring, &ring);
+	if (ret) {
+		/* Wakes the reader up if it is waiting for a free chunk */
+		pthread_mutex_lock(&ring.lock);
+		ring.failed = true;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+	pthread_join(reader, NULL);
+
+destroy:
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+out:
+	for (i = 0; i < FLASH_FILE_RING_CHUNKS; i++)
+		free(ring.chunks[i]);
+	close(ring.fd);
+	return ret;
+}
+
 int read_image(const char *name, void **data)
 {
 	return ops_call(bootimage, read_image, name, data);
@@ -93,6 +358,25 @@ int read_image_signature(void **buf, char *name)
 	return ops_call(bootimage, read_image_signature, buf, name);
 }
 
+int hash_image(const char *name, int hash, uint8_t *digest)
+{
+	void *data;
+	int size;
+
+	o = bootimage_ops();
+	if (o && ((struct bootimage_operations *)o)->hash_image)
+		return ((struct bootimage_operations *)o)->hash_image(name, hash, digest);
+
+	/* No reader streaming the image, it is hashed in memory */
+	size = read_image(name, &data);
+	if (size < 0)
+		return -1;
+	if (block_digest_data(data, size, hash, digest))
+		size = -1;
+	free(data);
+	return size;
+}
+
 int is_image_signed(const char *name)
 {
 	return ops_call(bootimage, is_image_signed, name);
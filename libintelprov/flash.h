@@ -17,6 +17,7 @@
 #ifndef _FLASH_H_
 #define _FLASH_H_
 
+#include <stdint.h>
 #include <sys/types.h>
 
 #define ANDROID_OS_NAME     "boot"
@@ -54,6 +55,10 @@ int read_dnx_timeout(void);
 int flash_image(void *data, unsigned sz, const char *name);
 int read_image(const char *name, void **data);
 int read_image_signature(void **buf, char *name);
+/* Digest (BLOCK_WRITE_SHA1 or BLOCK_WRITE_SHA256) of the image returned
+ * by read_image, computed while it is read where the platform allows.
+ * Returns the size of the image, or -1. */
+int hash_image(const char *name, int hash, uint8_t *digest);
 int get_device_path(char **path, const char *name);
 int flash_android_kernel(void *data, unsigned sz);
 int flash_recovery_kernel(void *data, unsigned sz);
@@ -68,6 +73,44 @@ int flash_testos(void *data, unsigned sz);
 int flash_silent_binary();
 int flash_bootloader(void *data, unsigned sz);
 
+/* Flashing of an image of a known size produced on the fly, e.g. by
+ * a patch, which is never held in memory. fill writes the image in
+ * as many parts as it wants with image_sink_write. */
+struct image_sink {
+	int fd;
+	off64_t offset;		/* of the image on fd, after the header */
+	size_t size;
+	size_t pos;
+	unsigned char *header;	/* keeps the first header_size bytes */
+	size_t header_size;
+};
+
+typedef int (*image_fill_t) (struct image_sink *sink, void *ctx);
+
+int image_sink_write(struct image_sink *sink, const void *data, size_t len);
+
+/* Generation of the recovery image, changed before each write of it
+ * through libintelprov. No generation means it is unknown, e.g. the
+ * file could not be written. Both return 0 or -1. */
+#define RECOVERY_GENERATION_FILE "/cache/recovery/intelprov_generation"
+
+int recovery_generation(uint32_t *generation);
+int new_recovery_generation(uint32_t *generation);
+
+/* Returns 0 if fill succeeded and wrote the whole image. On the
+ * platforms with image slots, name only refers to the new image once
+ * this is the case. */
+int flash_image_stream(const char *name, size_t size, image_fill_t fill, void *ctx);
+
+/* Flashes the image of the file at path, read chunk by chunk while
+ * the previous chunks are written, so that only FLASH_FILE_RING_CHUNKS
+ * chunks are held in memory. Sparse images, which are not streamed,
+ * are read whole. Returns 0 or -1. */
+#define FLASH_FILE_CHUNK_SIZE	(1024 * 1024)
+#define FLASH_FILE_RING_CHUNKS	4
+
+int flash_image_file(const char *path, const char *name);
+
 /* Returns:
  * -1: error
  * 0: unsigned image
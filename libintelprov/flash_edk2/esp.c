@@ -47,9 +47,14 @@ bool is_edk2(void)
  * this new function as soon as we find a better solution.  */
 static int ensure_esp_mounted()
 {
+	static bool esp_mounted;
 	int ret;
 	char *path = NULL;
 
+	/* The ESP stays mounted for the rest of the session */
+	if (esp_mounted)
+		return 0;
+
 	ret = get_device_path(&path, ESP_LABEL);
 	if (ret) {
 		error("%s: Unable to get the ESP block device path\n", __func__);
@@ -70,6 +75,7 @@ static int ensure_esp_mounted()
 	} else if (errno == EBUSY)
 		ret = 0;
 
+	esp_mounted = (ret == 0);
 out:
 	free(path);
 	return ret;
@@ -85,7 +91,8 @@ int flash_capsule_esp(void *data, unsigned sz)
 		return ret;
 	}
 
-	ret = file_write(CAPSULE_BIN_FILE, data, sz);
+	/* The firmware must never find a partial capsule */
+	ret = file_write_atomic(CAPSULE_BIN_FILE, data, sz);
 	if (ret != 0) {
 		error("%s : write data to file %s failed\n", __func__, CAPSULE_BIN_FILE);
 		return ret;
@@ -24,6 +24,7 @@
 #include "util.h"
 #include "capsule.h"
 #include "flash.h"
+#include "block_write.h"
 
 #define CAPSULE_PARTITION_LABEL "FWUP"
 #define CAPSULE_UPDATE_FLAG_PATH "/sys/firmware/osnib/fw_update"
@@ -87,6 +88,23 @@ static void print_capsule_header(struct capsule *c)
 	       (ver->sec_version & 0xFFFF), refs->sec_size, refs->sec_offset + sizeof(*sig));
 }
 
+/* All the regions the header refers to must be in the capsule */
+static bool check_capsule_refs(struct capsule *c, unsigned sz)
+{
+	struct capsule_refs *refs = &(c->header.refs);
+	u64 base = sizeof(c->header.sig);
+
+	if (base + refs->iafw_stage1_offset + refs->iafw_stage1_size > sz ||
+	    base + refs->iafw_stage2_offset + refs->iafw_stage2_size > sz ||
+	    base + refs->pdr_offset + refs->pdr_size > sz ||
+	    base + refs->sec_offset + refs->sec_size > sz) {
+		error("Capsule header refers to data out of the capsule\n");
+		return false;
+	}
+
+	return true;
+}
+
 static bool check_capsule(struct capsule *c, u32 iafw_version, sec_version_t sec_version, u32 pdr_version)
 {
 	u8 *cdata = (u8 *) c;
@@ -182,6 +200,7 @@ int flash_capsule_fdk(void *data, unsigned sz)
 	u32 pdr_version = 0;
 
 	char *dev_path = NULL;
+	struct block_write bw;
 
 	/* Get current FW version */
 	property_get("sys.ia32.version", iafw_stage1_version_str, "00.00");
@@ -209,6 +228,9 @@ int flash_capsule_fdk(void *data, unsigned sz)
 	c = (struct capsule *)data;
 	print_capsule_header(c);
 
+	if (!check_capsule_refs(c, sz))
+		goto exit;
+
 	/* Check capsule vs current FW version */
 	capsule_update = check_capsule(c, iafw_version, sec_version, pdr_version);
 
@@ -224,7 +246,9 @@ int flash_capsule_fdk(void *data, unsigned sz)
 		goto exit;
 	}
 
-	if ((ret_status = file_write(dev_path, data, sz))) {
+	memset(&bw, 0, sizeof(bw));
+	bw.device = dev_path;
+	if ((ret_status = block_write_data(&bw, data, sz))) {
 		error("Capsule flashing failed: %s\n", strerror(errno));
 		goto exit;
 	}
@@ -16,6 +16,7 @@
 
 #include <bootimg.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -23,6 +24,8 @@
 #include <fcntl.h>
 #include "util.h"
 #include "flash.h"
+#include "block_write.h"
+#include "partition_index.h"
 
 #define DISK_BY_LABEL_DIR		"/dev/disk/by-label"
 #define BASE_PLATFORM_INTEL_LABEL	"/dev/block/platform/intel/by-label"
@@ -56,9 +59,17 @@ int get_device_path(char **path, const char *name)
 
 	unsigned int i;
 	char *tmp;
+
+	partition_index_build(PREFIXES, ARRAY_SIZE(PREFIXES));
+	*path = partition_index_lookup(name);
+	if (*path)
+		return 0;
+
+	/* The device may have shown up after the index was built */
 	for (i = 0 ; i < ARRAY_SIZE(PREFIXES) ; i++) {
 		tmp = try_prefix(PREFIXES[i], name);
 		if (tmp) {
+			partition_index_add(name, tmp);
 			*path = tmp;
 			return 0;
 		}
@@ -79,6 +90,7 @@ bool is_gpt(void)
 
 int flash_image_gpt(void *data, unsigned sz, const char *name)
 {
+	struct block_write bw;
 	char *block_dev;
 	int ret;
 
@@ -88,7 +100,47 @@ int flash_image_gpt(void *data, unsigned sz, const char *name)
 	if (get_device_path(&block_dev, name))
 		return -1;
 
-	ret = file_write(block_dev, data, sz);
+	memset(&bw, 0, sizeof(bw));
+	bw.device = block_dev;
+	bw.flags = BLOCK_WRITE_DISCARD | BLOCK_WRITE_DECOMPRESS;
+	if (block_write_is_sparse(data, sz))
+		ret = block_write_sparse(&bw, data, sz);
+	else
+		ret = block_write_data(&bw, data, sz);
+	free(block_dev);
+	return ret;
+}
+
+/* There is no spare partition, the image is written in place */
+int flash_image_stream_gpt(const char *name, size_t size, image_fill_t fill, void *ctx)
+{
+	struct image_sink sink;
+	char *block_dev;
+	int ret = -1;
+
+	if (!strcmp(name, TEST_OS_NAME))
+		name = ANDROID_OS_NAME;
+
+	if (get_device_path(&block_dev, name))
+		return -1;
+
+	memset(&sink, 0, sizeof(sink));
+	sink.size = size;
+	sink.fd = open(block_dev, O_WRONLY);
+	if (sink.fd < 0) {
+		error("Failed to open %s: %s\n", block_dev, strerror(errno));
+		goto out;
+	}
+
+	if (fill(&sink, ctx) || sink.pos != size)
+		error("Failed to write the %s image\n", name);
+	else if (fsync(sink.fd))
+		error("Failed to sync %s: %s\n", block_dev, strerror(errno));
+	else
+		ret = 0;
+
+	close(sink.fd);
+out:
 	free(block_dev);
 	return ret;
 }
@@ -178,6 +230,34 @@ out:
 	return ret;
 }
 
+/* The image is read once, in chunks, and never held in memory */
+int hash_image_gpt(const char *name, int hash, uint8_t *digest)
+{
+	ssize_t size;
+	struct boot_img_hdr hdr;
+	int ret = -1;
+	int fd;
+
+	fd = open_bootimage(name);
+	if (fd < 0) {
+		error("Failed to open %s image\n", name);
+		goto out;
+	}
+
+	size = bootimage_size(fd, &hdr, true);
+	if (size <= 0) {
+		error("Invalid %s image\n", name);
+		goto close;
+	}
+
+	if (!block_digest_fd(fd, 0, size, hash, digest))
+		ret = size;
+close:
+	close(fd);
+out:
+	return ret;
+}
+
 int read_image_signature_gpt(void **buf, char *name)
 {
 	return -1;
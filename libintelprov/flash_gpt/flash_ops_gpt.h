@@ -27,6 +27,8 @@ int flash_image_gpt(void *data, unsigned sz, const char *name);
 int read_image_gpt(const char *name, void **data);
 int read_image_signature_gpt(void **buf, char *name);
 int is_image_signed_gpt(const char *name);
+int flash_image_stream_gpt(const char *name, size_t size, image_fill_t fill, void *ctx);
+int hash_image_gpt(const char *name, int hash, uint8_t *digest);
 
 #else	/* CONFIG_INTELPROV_GPT */
 
@@ -55,6 +57,16 @@ int is_image_signed_gpt(const char *name)
 	return stub_operation(__func__);
 }
 
+int flash_image_stream_gpt(const char *name, size_t size, image_fill_t fill, void *ctx)
+{
+	return stub_operation(__func__);
+}
+
+int hash_image_gpt(const char *name, int hash, uint8_t *digest)
+{
+	return stub_operation(__func__);
+}
+
 #endif	/* CONFIG_INTELPROV_GPT */
 
 struct bootimage_operations gpt_bootimage_operations = {
@@ -62,6 +74,8 @@ struct bootimage_operations gpt_bootimage_operations = {
 	.read_image = read_image_gpt,
 	.read_image_signature = read_image_signature_gpt,
 	.is_image_signed = is_image_signed_gpt,
+	.flash_image_stream = flash_image_stream_gpt,
+	.hash_image = hash_image_gpt,
 };
 
 #endif	/* _FLASH_OPS_GPT_H_ */
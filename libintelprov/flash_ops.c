@@ -21,8 +21,18 @@
 #include "flash_edk2/flash_ops_edk2.h"
 #include "flash_fdk/flash_ops_fdk.h"
 
+#include <pthread.h>
 #include <stdio.h>
-struct bootimage_operations *bootimage_ops(void)
+
+/* The platform is probed once, on the first dispatch, rather than on
+ * each call. A probe which found nothing is retried, as the partitions
+ * it looks for may only exist once the disk has been partitioned. */
+static pthread_mutex_t ops_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bootimage_operations *resolved_bootimage;
+static struct ifwi_operations *resolved_ifwi;
+static struct capsule_operations *resolved_capsule;
+
+static struct bootimage_operations *probe_bootimage_ops(void)
 {
 	if (is_gpt())
 		return &gpt_bootimage_operations;
@@ -33,7 +43,7 @@ struct bootimage_operations *bootimage_ops(void)
 	return NULL;
 }
 
-struct ifwi_operations *ifwi_ops(void)
+static struct ifwi_operations *probe_ifwi_ops(void)
 {
 	if (is_scu_ipc()) {
 		return &scu_ipc_ifwi_operations;
@@ -46,7 +56,7 @@ struct ifwi_operations *ifwi_ops(void)
 	return NULL;
 }
 
-struct capsule_operations *capsule_ops(void)
+static struct capsule_operations *probe_capsule_ops(void)
 {
 	if (is_edk2())
 		return &edk2_capsule_operations;
@@ -56,3 +66,51 @@ struct capsule_operations *capsule_ops(void)
 
 	return NULL;
 }
+
+struct bootimage_operations *bootimage_ops(void)
+{
+	struct bootimage_operations *ops;
+
+	pthread_mutex_lock(&ops_lock);
+	if (!resolved_bootimage)
+		resolved_bootimage = probe_bootimage_ops();
+	ops = resolved_bootimage;
+	pthread_mutex_unlock(&ops_lock);
+
+	return ops;
+}
+
+struct ifwi_operations *ifwi_ops(void)
+{
+	struct ifwi_operations *ops;
+
+	pthread_mutex_lock(&ops_lock);
+	if (!resolved_ifwi)
+		resolved_ifwi = probe_ifwi_ops();
+	ops = resolved_ifwi;
+	pthread_mutex_unlock(&ops_lock);
+
+	return ops;
+}
+
+struct capsule_operations *capsule_ops(void)
+{
+	struct capsule_operations *ops;
+
+	pthread_mutex_lock(&ops_lock);
+	if (!resolved_capsule)
+		resolved_capsule = probe_capsule_ops();
+	ops = resolved_capsule;
+	pthread_mutex_unlock(&ops_lock);
+
+	return ops;
+}
+
+void invalidate_flash_ops(void)
+{
+	pthread_mutex_lock(&ops_lock);
+	resolved_bootimage = NULL;
+	resolved_ifwi = NULL;
+	resolved_capsule = NULL;
+	pthread_mutex_unlock(&ops_lock);
+}
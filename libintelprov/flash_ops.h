@@ -19,6 +19,7 @@
 
 #include <sys/types.h>
 #include "util.h"
+#include "flash.h"
 
 static inline int stub_operation(const char *func)
 {
@@ -31,6 +32,8 @@ struct bootimage_operations {
 	int (*read_image) (const char *name, void **data);
 	int (*read_image_signature) (void **buf, char *name);
 	int (*is_image_signed) (const char *name);
+	int (*flash_image_stream) (const char *name, size_t size, image_fill_t fill, void *ctx);
+	int (*hash_image) (const char *name, int hash, uint8_t *digest);
 };
 
 struct ifwi_operations {
@@ -53,5 +56,7 @@ struct capsule_operations {
 struct bootimage_operations *bootimage_ops(void);
 struct ifwi_operations *ifwi_ops(void);
 struct capsule_operations *capsule_ops(void);
+/* Probes the platform again on the next dispatch, after a repartition */
+void invalidate_flash_ops(void);
 
 #endif	/* _FLASH_OPS_H_ */
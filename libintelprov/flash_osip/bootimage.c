@@ -79,6 +79,78 @@ int flash_image_osip(void *data, unsigned sz, const char *name)
 	return write_stitch_image(data, sz, index);
 }
 
+struct osip_stream {
+	image_fill_t fill;
+	void *ctx;
+	int attr;
+};
+
+/* The stitched image goes to the free slot at offset, its OSIP header
+ * is kept to complete the record once the image is written */
+static int write_osip_stream(int fd, off64_t offset, size_t size, struct OSII *osii, void *ctx)
+{
+	struct osip_stream *stream = (struct osip_stream *)ctx;
+	unsigned char lba[LBA_SIZE];
+	struct OSIP_header *header = (struct OSIP_header *)lba;
+	struct image_sink sink;
+
+	memset(&sink, 0, sizeof(sink));
+	sink.fd = fd;
+	sink.offset = offset;
+	sink.size = size + LBA_SIZE;
+	sink.header = lba;
+	sink.header_size = LBA_SIZE;
+
+	if (stream->fill(&sink, stream->ctx) || sink.pos != sink.size) {
+		error("Failed to write the stitched image\n");
+		return -1;
+	}
+
+	if (header->num_pointers != 1 || header->desc[0].size_of_os_image != osii->size_of_os_image) {
+		error("Bad OSIP header in the stitched image\n");
+		return -1;
+	}
+
+	/* Same attribute fix as flash_image_osip */
+	osii->os_rev_minor = header->desc[0].os_rev_minor;
+	osii->os_rev_major = header->desc[0].os_rev_major;
+	osii->ddr_load_address = header->desc[0].ddr_load_address;
+	osii->entry_point = header->desc[0].entry_point;
+	osii->attribute = stream->attr + (header->desc[0].attribute & ATTR_UNSIGNED_KERNEL);
+	return 0;
+}
+
+int flash_image_stream_osip(const char *name, size_t size, image_fill_t fill, void *ctx)
+{
+	struct osip_stream stream;
+	struct OSII osii;
+	int index;
+
+	if (!strcmp(name, TEST_OS_NAME)) {
+		error("%s can't be streamed\n", name);
+		return -1;
+	}
+
+	if (size <= LBA_SIZE || size % LBA_SIZE) {
+		error("%zu bytes is not the size of a stitched image\n", size);
+		return -1;
+	}
+
+	index = get_named_osii_index(name, WRITE_OSIP_HEADER);
+	if (check_index_outofbound(index))
+		return -1;
+
+	/* The slot only depends on the kind of image and on its size */
+	stream.fill = fill;
+	stream.ctx = ctx;
+	stream.attr = get_named_osii_attr(name, NULL);
+	memset(&osii, 0, sizeof(osii));
+	osii.attribute = stream.attr;
+	osii.size_of_os_image = (size - LBA_SIZE) / LBA_SIZE;
+
+	return write_stitch_image_stream(&osii, index, write_osip_stream, &stream);
+}
+
 int read_image_signature_osip(void **buf, char *name)
 {
 	int fd = -1;
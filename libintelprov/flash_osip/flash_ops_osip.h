@@ -26,6 +26,7 @@ int flash_image_osip(void *data, unsigned sz, const char *name);
 int read_image_osip(const char *name, void **data);
 int read_image_signature_osip(void **buf, char *name);
 int is_image_signed_osip(const char *name);
+int flash_image_stream_osip(const char *name, size_t size, image_fill_t fill, void *ctx);
 
 #else	/* CONFIG_INTELPROV_OSIP */
 
@@ -54,6 +55,11 @@ int is_image_signed_osip(const char *name)
 	return stub_operation(__func__);
 };
 
+int flash_image_stream_osip(const char *name, size_t size, image_fill_t fill, void *ctx)
+{
+	return stub_operation(__func__);
+};
+
 #endif	/* CONFIG_INTELPROV_OSIP */
 
 struct bootimage_operations osip_bootimage_operations = {
@@ -61,6 +67,7 @@ struct bootimage_operations osip_bootimage_operations = {
 	.read_image = read_image_osip,
 	.read_image_signature = read_image_signature_osip,
 	.is_image_signed = is_image_signed_osip,
+	.flash_image_stream = flash_image_stream_osip,
 };
 
 #endif	/* _FLASH_OPS_OSIP_H_ */
@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <sys/types.h>
@@ -22,7 +23,9 @@
 #include <fcntl.h>
 #include <cutils/properties.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "fw_version_check.h"
+#include "util.h"
 
 
 #define FORCE_RW_OPT "0"
@@ -32,6 +35,8 @@
 #define BOOT_UMIP_XOR_OFFSET 0x7
 #define BOOT_UMIP_3GPP_OFFSET 0x76F
 #define BOOT_IFWI_XOR_OFFSET 0x0112d8
+#define BOOT_IFWI_PAGE_SIZE 0x1000
+#define BOOT_IFWI_XOR_PAGE (BOOT_IFWI_XOR_OFFSET & ~(BOOT_IFWI_PAGE_SIZE - 1))
 #define BOOT_DNX_TIMEOUT_OFFSET 0x400
 #define IFWI_OFFSET 0
 #define TOKEN_UMIP_AREA_OFFSET 0x4000
@@ -147,135 +152,257 @@ static void xor_update(char *ptr)
 	*(uint32_t *)(ptr + BOOT_IFWI_XOR_OFFSET) = xor;
 }
 
-static int write_umip_emmc(uint32_t addr_offset, void *data, size_t size)
+/* Update the UMIP xors after a change in the sectors first to last,
+ * and the IFWI xor from the UMIP contents it had before, old */
+static void xor_update_umip(char *ptr, const char *old, uint16_t first, uint16_t last)
 {
-	int boot_fd = 0;
-	int boot_index;
-	char boot_partition[64];
-	char boot_partition_force_ro[64];
-	char *ptr;
-	char *token_data;
+	uint16_t i;
+	uint32_t xor;
 
-	if (addr_offset == IFWI_OFFSET) {
-		token_data = malloc(TOKEN_UMIP_AREA_SIZE);
-		if (!token_data) {
-			fprintf(stderr, "write_umip_emmc: Malloc error\n");
-			return -1;
-		}
+	if (first < 2)
+		first = 2;
+	for (i = first; i <= last && i < 128; i++) {
+		xor = xor_compute(ptr + i * BOOT_UMIP_SECTOR_SIZE, BOOT_UMIP_SECTOR_SIZE);
+		*(uint32_t *)(ptr + 4 * i) = xor;
+	}
+
+	*(ptr + BOOT_UMIP_XOR_OFFSET) = 0;
+	xor = xor_compute(ptr, BOOT_UMIP_SIZE);
+	*(ptr + BOOT_UMIP_XOR_OFFSET) = xor_factorize(xor);
+
+	/* The IFWI xor word lies out of the UMIP: the words which changed
+	 * are removed from it and the new ones are added */
+	*(uint32_t *)(ptr + BOOT_IFWI_XOR_OFFSET) ^=
+		xor_compute((char *)old, BOOT_UMIP_SIZE) ^ xor_compute(ptr, BOOT_UMIP_SIZE);
+}
+
+/* Write to fd the pages of ptr which differ from old, return the
+ * number of pages written or -1 */
+static int write_changed_pages(int fd, const char *ptr, const char *old, uint32_t size)
+{
+	uint32_t start, end;
+	int pages = 0;
 
-		if (size > BOOT_IFWI_SIZE) {
-			fprintf(stderr, "write_umip_emmc: Truncating last %zd bytes from the IFWI\n",
-			(size - BOOT_IFWI_SIZE));
-			/* Since the last 144 bytes are the FUP header which are not required,*/
-			/* we truncate it to fit into the boot partition. */
-			size = BOOT_IFWI_SIZE;
+	for (start = 0; start < size; start = end) {
+		if (!memcmp(ptr + start, old + start, BOOT_IFWI_PAGE_SIZE)) {
+			end = start + BOOT_IFWI_PAGE_SIZE;
+			continue;
 		}
+		for (end = start + BOOT_IFWI_PAGE_SIZE; end < size; end += BOOT_IFWI_PAGE_SIZE)
+			if (!memcmp(ptr + end, old + end, BOOT_IFWI_PAGE_SIZE))
+				break;
+
+		if (lseek(fd, start, SEEK_SET) < 0 || safe_write(fd, ptr + start, end - start))
+			return -1;
+		pages += (end - start) / BOOT_IFWI_PAGE_SIZE;
 	}
 
-	for (boot_index = 0; boot_index < 2; boot_index++) {
-		snprintf(boot_partition, 64, "/dev/block/mmcblk0boot%d", boot_index);
-		snprintf(boot_partition_force_ro, 64, "/sys/block/mmcblk0boot%d/force_ro", boot_index);
+	return pages;
+}
 
-		if (force_rw(boot_partition_force_ro)) {
-			fprintf(stderr, "write_umip_emmc: unable to force_ro %s\n", boot_partition);
-			goto err_boot1;
-		}
-		boot_fd = open(boot_partition, O_RDWR);
-		if (boot_fd < 0) {
-			fprintf(stderr, "write_umip_emmc: failed to open %s\n", boot_partition);
-			goto err_boot1;
-		}
+/* The UMIP of boot0 as read by readbyte_umip_emmc, one sector at a
+ * time, and as written by write_umip_boot */
+static pthread_mutex_t umip_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char umip_cache[BOOT_UMIP_SIZE];
+static bool umip_cache_valid[BOOT_UMIP_SIZE / BOOT_UMIP_SECTOR_SIZE];
 
-		ptr = (char *)mmap(NULL, BOOT_IFWI_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, boot_fd, 0);
-		if (ptr == MAP_FAILED) {
-			fprintf(stderr, "write_umip_emmc: mmap failed on boot%d with error : %s\n", boot_index, strerror(errno));
-			goto err_boot1;
-		}
+/* umip is NULL when the content of boot0 is unknown */
+static void umip_cache_update(const char *umip)
+{
+	pthread_mutex_lock(&umip_cache_lock);
+	if (umip)
+		memcpy(umip_cache, umip, BOOT_UMIP_SIZE);
+	memset(umip_cache_valid, umip != NULL, sizeof(umip_cache_valid));
+	pthread_mutex_unlock(&umip_cache_lock);
+}
 
-		if (addr_offset == IFWI_OFFSET)
-			memcpy(token_data, ptr + TOKEN_UMIP_AREA_OFFSET, TOKEN_UMIP_AREA_SIZE);
-
-		/* Write the data */
-		if (addr_offset + size <= BOOT_IFWI_SIZE)
-			if (data == NULL)
-				memset(ptr + addr_offset, 0, size);
-			else
-				memcpy(ptr + addr_offset, data, size);
-		else {
-			fprintf(stderr, "write_umip_emmc: write failed\n");
-			goto err_boot2;
-		}
+struct umip_write {
+	int boot_index;
+	uint32_t addr_offset;
+	void *data;
+	size_t size;
+	int ret;
+};
 
-		if (addr_offset == IFWI_OFFSET)
-			memcpy(ptr + TOKEN_UMIP_AREA_OFFSET, token_data, TOKEN_UMIP_AREA_SIZE);
+/* The area read from the boot partition is the UMIP and the page of
+ * the IFWI xor for the writes which stay in the UMIP, the whole IFWI
+ * otherwise. Only the pages which changed are written back. */
+static void *write_umip_boot(void *arg)
+{
+	struct umip_write *w = (struct umip_write *)arg;
+	char boot_partition[64];
+	char boot_partition_force_ro[64];
+	bool in_umip = w->addr_offset + w->size <= BOOT_UMIP_SIZE;
+	uint32_t length = in_umip ? BOOT_IFWI_XOR_PAGE + BOOT_IFWI_PAGE_SIZE : BOOT_IFWI_SIZE;
+	char *ptr = NULL;
+	char *old = NULL;
+	int boot_fd;
+	int pages;
+
+	w->ret = -1;
+	snprintf(boot_partition, 64, "/dev/block/mmcblk0boot%d", w->boot_index);
+	snprintf(boot_partition_force_ro, 64, "/sys/block/mmcblk0boot%d/force_ro", w->boot_index);
+
+	if (force_rw(boot_partition_force_ro)) {
+		fprintf(stderr, "write_umip_emmc: unable to force_ro %s\n", boot_partition);
+		return NULL;
+	}
+	boot_fd = open(boot_partition, O_RDWR);
+	if (boot_fd < 0) {
+		fprintf(stderr, "write_umip_emmc: failed to open %s\n", boot_partition);
+		return NULL;
+	}
+
+	ptr = malloc(length);
+	old = malloc(length);
+	if (!ptr || !old) {
+		fprintf(stderr, "write_umip_emmc: Malloc error\n");
+		goto out;
+	}
 
-		/* Compute and write xor */
+	/* Between the UMIP and the page of the IFWI xor, nothing changes
+	 * and only the xor word is read */
+	if (in_umip) {
+		memset(old + BOOT_UMIP_SIZE, 0, length - BOOT_UMIP_SIZE);
+		if (safe_read(boot_fd, old, BOOT_UMIP_SIZE) ||
+		    lseek(boot_fd, BOOT_IFWI_XOR_OFFSET, SEEK_SET) < 0 ||
+		    safe_read(boot_fd, old + BOOT_IFWI_XOR_OFFSET, sizeof(uint32_t))) {
+			fprintf(stderr, "write_umip_emmc: read failed on boot%d\n", w->boot_index);
+			goto out;
+		}
+	} else if (safe_read(boot_fd, old, length)) {
+		fprintf(stderr, "write_umip_emmc: read failed on boot%d\n", w->boot_index);
+		goto out;
+	}
+	memcpy(ptr, old, length);
+
+	/* Write the data, the tokens are kept over an IFWI update */
+	if (w->data == NULL)
+		memset(ptr + w->addr_offset, 0, w->size);
+	else
+		memcpy(ptr + w->addr_offset, w->data, w->size);
+
+	if (w->addr_offset == IFWI_OFFSET)
+		memcpy(ptr + TOKEN_UMIP_AREA_OFFSET, old + TOKEN_UMIP_AREA_OFFSET, TOKEN_UMIP_AREA_SIZE);
+
+	/* Compute xor */
+	if (in_umip)
+		xor_update_umip(ptr, old, w->addr_offset / BOOT_UMIP_SECTOR_SIZE,
+				(w->addr_offset + w->size - 1) / BOOT_UMIP_SECTOR_SIZE);
+	else
 		xor_update(ptr);
 
-		munmap(ptr, BOOT_IFWI_SIZE);
-		close(boot_fd);
+	/* In the page of the IFWI xor, only the word itself is known */
+	if (in_umip) {
+		if (memcmp(ptr + BOOT_IFWI_XOR_OFFSET, old + BOOT_IFWI_XOR_OFFSET, sizeof(uint32_t)) &&
+		    (lseek(boot_fd, BOOT_IFWI_XOR_OFFSET, SEEK_SET) < 0 ||
+		     safe_write(boot_fd, ptr + BOOT_IFWI_XOR_OFFSET, sizeof(uint32_t)))) {
+			fprintf(stderr, "write_umip_emmc: write failed on boot%d\n", w->boot_index);
+			goto out;
+		}
+		length = BOOT_UMIP_SIZE;
 	}
 
-	if (addr_offset == IFWI_OFFSET)
-		free(token_data);
-	return 0;
+	pages = write_changed_pages(boot_fd, ptr, old, length);
+	if (pages < 0 || fsync(boot_fd)) {
+		fprintf(stderr, "write_umip_emmc: write failed on boot%d\n", w->boot_index);
+		goto out;
+	}
 
-err_boot2:
-	munmap(ptr, BOOT_IFWI_SIZE);
+	fprintf(stderr, "write_umip_emmc: %d pages updated on boot%d\n", pages, w->boot_index);
+	w->ret = 0;
 
-err_boot1:
-	if (addr_offset == IFWI_OFFSET)
-		free(token_data);
+out:
+	if (w->boot_index == 0)
+		umip_cache_update(w->ret ? NULL : ptr);
+	free(ptr);
+	free(old);
 	close(boot_fd);
-	return -1;
+	return NULL;
 }
 
-static int readbyte_umip_emmc(uint32_t addr_offset)
+/* Both boot partitions are written at the same time */
+static int write_umip_emmc(uint32_t addr_offset, void *data, size_t size)
 {
-	int boot_fd = 0;
-	char *ptr;
-	int value = 0;
+	struct umip_write w[2];
+	pthread_t thread;
+	bool joined = false;
+	int boot_index;
 
-	if (force_rw("/sys/block/mmcblk0boot0/force_ro")) {
-		fprintf(stderr, "read_umip_emmc: unable to force_ro\n");
-		goto err_boot1;
-	}
-	boot_fd = open("/dev/block/mmcblk0boot0", O_RDWR);
-	if (boot_fd < 0) {
-		fprintf(stderr, "read_umip_emmc: failed to open /dev/block/mmcblk0boot0\n");
-		goto err_boot1;
+	if (addr_offset == IFWI_OFFSET && size > BOOT_IFWI_SIZE) {
+		fprintf(stderr, "write_umip_emmc: Truncating last %zd bytes from the IFWI\n",
+		(size - BOOT_IFWI_SIZE));
+		/* Since the last 144 bytes are the FUP header which are not required,*/
+		/* we truncate it to fit into the boot partition. */
+		size = BOOT_IFWI_SIZE;
 	}
 
-	ptr = (char *)mmap(NULL, BOOT_UMIP_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, boot_fd, 0);
-	if (ptr == MAP_FAILED) {
-		fprintf(stderr, "read_umip_emmc: mmap failed on boot0 with error : %s\n", strerror(errno));
-		goto err_boot1;
+	if (addr_offset + size > BOOT_IFWI_SIZE) {
+		fprintf(stderr, "write_umip_emmc: write failed\n");
+		return -1;
 	}
 
-	/* Read the data */
-	if (addr_offset < BOOT_UMIP_SIZE)
-		value = (int)*(ptr + addr_offset);
-	else {
-		fprintf(stderr, "read_umip_emmc: read failed\n");
-		goto err_boot2;
+	for (boot_index = 0; boot_index < 2; boot_index++) {
+		w[boot_index].boot_index = boot_index;
+		w[boot_index].addr_offset = addr_offset;
+		w[boot_index].data = data;
+		w[boot_index].size = size;
 	}
 
-	munmap(ptr, BOOT_UMIP_SIZE);
-	close(boot_fd);
+	/* boot0 is written by the calling thread if boot1 gets none */
+	if (pthread_create(&thread, NULL, write_umip_boot, &w[1]) == 0)
+		joined = true;
+	write_umip_boot(&w[0]);
+	if (joined)
+		pthread_join(thread, NULL);
+	else
+		write_umip_boot(&w[1]);
 
-	return value;
+	return (w[0].ret || w[1].ret) ? -1 : 0;
+}
 
-err_boot2:
-	munmap(ptr, BOOT_UMIP_SIZE);
+static int readbyte_umip_emmc(uint32_t addr_offset)
+{
+	uint32_t sector = addr_offset / BOOT_UMIP_SECTOR_SIZE;
+	int boot_fd;
+	int value = -1;
 
-err_boot1:
-	close(boot_fd);
-	return -1;
+	if (addr_offset >= BOOT_UMIP_SIZE) {
+		fprintf(stderr, "read_umip_emmc: read failed\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&umip_cache_lock);
+	if (!umip_cache_valid[sector]) {
+		/* Only read, force_ro is left as it is */
+		boot_fd = open("/dev/block/mmcblk0boot0", O_RDONLY);
+		if (boot_fd < 0) {
+			fprintf(stderr, "read_umip_emmc: failed to open /dev/block/mmcblk0boot0\n");
+			goto out;
+		}
+		if (pread(boot_fd, umip_cache + sector * BOOT_UMIP_SECTOR_SIZE,
+			  BOOT_UMIP_SECTOR_SIZE, sector * BOOT_UMIP_SECTOR_SIZE) != BOOT_UMIP_SECTOR_SIZE) {
+			fprintf(stderr, "read_umip_emmc: read failed on boot0 with error : %s\n", strerror(errno));
+			close(boot_fd);
+			goto out;
+		}
+		close(boot_fd);
+		umip_cache_valid[sector] = true;
+	}
+	value = (int)umip_cache[addr_offset];
+out:
+	pthread_mutex_unlock(&umip_cache_lock);
+	return value;
 }
 
 int update_ifwi_file_scu_emmc(void *data, size_t size)
 {
-	return write_umip_emmc(IFWI_OFFSET, data, size);
+	int ret;
+
+	ret = write_umip_emmc(IFWI_OFFSET, data, size);
+	if (!ret)
+		invalidate_fw_rev_cache();
+	return ret;
 }
 
 int flash_token_umip_scu_emmc(void *data, size_t size)
@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <cutils/properties.h>
 
 #include "util.h"
@@ -15,8 +17,6 @@
 #define IFWI_SYSFS_INT		"/sys/devices/ipc/intel_fw_update.0/ifwi"
 #define IFWI_SYSFS_INT_ALT  "/sys/kernel/fw_update/ifwi"
 
-#define BUF_SIZ	4096
-
 #define IPC_DEVICE_NAME		"/dev/mid_ipc"
 #define DEVICE_FW_UPGRADE	0xA4
 
@@ -33,11 +33,49 @@ struct update_info {
 	uint32_t reserved;
 };
 
-static int ifwi_downgrade_allowed(const char *ifwi)
+/* A firmware file mapped once, and parsed and written from the mapping */
+struct fw_image {
+	void *data;
+	size_t size;
+};
+
+static int fw_image_map(struct fw_image *image, const char *filename)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open %s failed\n", filename);
+		return -1;
+	}
+	if (fstat(fd, &sb) || sb.st_size == 0) {
+		fprintf(stderr, "stat %s failed\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	image->data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image->data == MAP_FAILED) {
+		fprintf(stderr, "mmap %s failed\n", filename);
+		return -1;
+	}
+
+	image->size = sb.st_size;
+	return 0;
+}
+
+static void fw_image_unmap(struct fw_image *image)
+{
+	munmap(image->data, image->size);
+}
+
+static int ifwi_downgrade_allowed(const struct fw_image_desc *ifwi)
 {
 	uint8_t pti_field;
 
-	if (crack_update_fw_pti_field(ifwi, &pti_field)) {
+	if (fw_image_desc_pti_field(ifwi, &pti_field)) {
 		fprintf(stderr, "Coudn't crack ifwi file to get PTI field!\n");
 		return -1;
 	}
@@ -52,14 +90,24 @@ static int ifwi_downgrade_allowed(const char *ifwi)
 	return 0;
 }
 
-static int retry_write(char *buf, int cont, FILE * f)
+/* The whole buffer is handed to the kernel, which may take it in
+ * several parts, e.g. a page at a time for a sysfs attribute */
+static int retry_write(const char *buf, size_t cont, int fd)
 {
-	int w_bytes = 0, retry = 0;
-
-	while (w_bytes < cont && retry++ < 3) {
-		w_bytes += fwrite(buf + w_bytes, 1, cont - w_bytes, f);
-		if (w_bytes < cont)
+	size_t w_bytes = 0;
+	int retry = 0;
+	ssize_t ret;
+
+	while (w_bytes < cont && retry < 3) {
+		ret = write(fd, buf + w_bytes, cont - w_bytes);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			retry++;
 			sleep(1);
+			continue;
+		}
+		w_bytes += ret;
 	}
 
 	if (w_bytes < cont) {
@@ -69,17 +117,34 @@ static int retry_write(char *buf, int cont, FILE * f)
 	return 0;
 }
 
-int update_ifwi_file_scu_ipc(const char *dnx, const char *ifwi)
+static int write_fw_sysfs(const char *name, const char *alt, const void *data, size_t size)
+{
+	int fd;
+	int ret;
+
+	fd = open(name, O_WRONLY);
+	if (fd < 0) {
+		fd = open(alt, O_WRONLY);
+		if (fd < 0) {
+			fprintf(stderr, "open %s failed\n", alt);
+			return -1;
+		}
+	}
+
+	ret = retry_write(data, size, fd);
+	close(fd);
+	return ret;
+}
+
+static int update_ifwi_scu_ipc(const char *dnx, const struct fw_image_desc *ifwi)
 {
 	int ret = 0;
 	int ifwi_allowed;
-	size_t cont;
-	char buff[BUF_SIZ];
-	FILE *f_src, *f_dst;
+	struct fw_image dnx_image;
 	struct fw_version img_ifwi_rev;
 	struct firmware_versions dev_fw_rev;
 
-	if (crack_update_fw(ifwi, &img_ifwi_rev)) {
+	if (fw_image_desc_ifwi_version(ifwi, &img_ifwi_rev)) {
 		fprintf(stderr, "Coudn't crack ifwi file!\n");
 		return -1;
 	}
@@ -141,70 +206,49 @@ int update_ifwi_file_scu_ipc(const char *dnx, const char *ifwi)
 	fprintf(stderr, "Found IFWI to be flashed (maj=%02X min=%02X)\n", img_ifwi_rev.major,
 		img_ifwi_rev.minor);
 
-	f_src = fopen(dnx, "rb");
-	if (f_src == NULL) {
-		fprintf(stderr, "open %s failed\n", dnx);
+	if (fw_image_map(&dnx_image, dnx)) {
 		ret = -1;
 		goto end;
 	}
 
-	f_dst = fopen(DNX_SYSFS_INT, "wb");
-	if (f_dst == NULL) {
-		f_dst = fopen(DNX_SYSFS_INT_ALT, "wb");
-		if (f_dst == NULL) {
-			fprintf(stderr, "open %s failed\n", DNX_SYSFS_INT_ALT);
-			ret = -1;
-			goto err;
-		}
-	}
-
-	while ((cont = fread(buff, 1, sizeof(buff), f_src)) > 0) {
-		if (retry_write(buff, cont, f_dst) == -1) {
-			fprintf(stderr, "DNX write failed\n");
-			fclose(f_dst);
-			ret = -1;
-			goto err;
-		}
-	}
-
-	fclose(f_src);
-	fclose(f_dst);
-
-	f_src = fopen(ifwi, "rb");
-	if (f_src == NULL) {
-		fprintf(stderr, "open %s failed\n", ifwi);
+	if (write_fw_sysfs(DNX_SYSFS_INT, DNX_SYSFS_INT_ALT, dnx_image.data, dnx_image.size)) {
+		fprintf(stderr, "DNX write failed\n");
 		ret = -1;
-		goto end;
-	}
-
-	f_dst = fopen(IFWI_SYSFS_INT, "wb");
-	if (f_dst == NULL) {
-		f_dst = fopen(IFWI_SYSFS_INT_ALT, "wb");
-		if (f_dst == NULL) {
-			fprintf(stderr, "open %s failed\n", IFWI_SYSFS_INT_ALT);
-			ret = -1;
-			goto err;
-		}
+		goto err;
 	}
 
-	while ((cont = fread(buff, 1, sizeof(buff), f_src)) > 0) {
-		if (retry_write(buff, cont, f_dst) == -1) {
-			fprintf(stderr, "IFWI write failed\n");
-			fclose(f_dst);
-			ret = -1;
-			goto err;
-		}
+	if (write_fw_sysfs(IFWI_SYSFS_INT, IFWI_SYSFS_INT_ALT, ifwi->data, ifwi->size)) {
+		fprintf(stderr, "IFWI write failed\n");
+		ret = -1;
+		goto err;
 	}
 
-	fclose(f_dst);
+	invalidate_fw_rev_cache();
 
 err:
-	fclose(f_src);
+	fw_image_unmap(&dnx_image);
 end:
 	fprintf(stderr, "IFWI flashed\n");
 	return ret;
 }
 
+int update_ifwi_file_scu_ipc(const char *dnx, const char *ifwi)
+{
+	struct fw_image ifwi_image;
+	struct fw_image_desc desc;
+	int ret = -1;
+
+	if (fw_image_map(&ifwi_image, ifwi))
+		return -1;
+
+	if (!fw_image_desc_init(&desc, ifwi_image.data, ifwi_image.size)) {
+		ret = update_ifwi_scu_ipc(dnx, &desc);
+		fw_image_desc_free(&desc);
+	}
+	fw_image_unmap(&ifwi_image);
+	return ret;
+}
+
 int update_ifwi_image_scu_ipc(void *data, size_t size, unsigned reset_flag)
 {
 	struct update_info *packet;
@@ -255,13 +299,14 @@ int update_ifwi_image_scu_ipc(void *data, size_t size, unsigned reset_flag)
 	close(fd);
 	if (ret < 0)
 		pr_perror("DEVICE_FW_UPGRADE");
+	else
+		invalidate_fw_rev_cache();
 out:
 	free(packet);
 	return ret;
 }
 
 #define BIN_DNX  "/tmp/__dnx.bin"
-#define BIN_IFWI "/tmp/__ifwi.bin"
 
 int flash_dnx_scu_ipc(void *data, unsigned sz)
 {
@@ -276,30 +321,35 @@ int flash_dnx_scu_ipc(void *data, unsigned sz)
 int flash_ifwi_scu_ipc(void *data, unsigned sz)
 {
 	struct firmware_versions img_fw_rev;
+	struct fw_image_desc desc;
+	int ret = -1;
 
 	if (access(BIN_DNX, F_OK)) {
 		error("dnx binary must be flashed to board first\n");
 		return -1;
 	}
 
-	if (get_image_fw_rev(data, sz, &img_fw_rev)) {
-		error("Coudn't extract FW version data from image");
+	/* The image is already in memory, no need for a copy in a file,
+	 * and it is scanned once for all the version checks */
+	if (fw_image_desc_init(&desc, data, sz))
 		return -1;
+
+	if (fw_image_desc_rev(&desc, &img_fw_rev)) {
+		error("Coudn't extract FW version data from image");
+		goto out;
 	}
 
 	printf("Image FW versions:\n");
 	dump_fw_versions(&img_fw_rev);
 
-	if (file_write(BIN_IFWI, data, sz)) {
-		error("Couldn't write ifwi file to %s\n", BIN_IFWI);
-		return -1;
-	}
-
-	if (update_ifwi_file_scu_ipc(BIN_DNX, BIN_IFWI)) {
+	if (update_ifwi_scu_ipc(BIN_DNX, &desc)) {
 		error("IFWI flashing failed!");
-		return -1;
+		goto out;
 	}
-	return 0;
+	ret = 0;
+out:
+	fw_image_desc_free(&desc);
+	return ret;
 }
 
 bool is_scu_ipc(void)
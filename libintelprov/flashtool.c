@@ -107,8 +107,6 @@ static void cmd_write_fw(char *filename)
 
 static void cmd_read_osip(char *entry, char *filename)
 {
-	void *data;
-	size_t size;
 	int index;
 	if (!entry || !filename) {
 		fprintf(stderr, "Must specifiy image index and filename!\n");
@@ -117,12 +115,8 @@ static void cmd_read_osip(char *entry, char *filename)
 	index = get_named_osii_index(entry, READ_OSIP_HEADER);
 	if (check_index_outofbound(index))
 		exit(1);
-	if (read_osimage_data(&data, &size, index)) {
-		fprintf(stderr, "Failed to read OSIP entry\n");
-		exit(1);
-	}
-	if (file_write(filename, data, size)) {
-		fprintf(stderr, "Can't write to output file %s\n", filename);
+	if (read_osimage_file(filename, index)) {
+		fprintf(stderr, "Failed to read OSIP entry into %s\n", filename);
 		exit(1);
 	}
 }
@@ -130,8 +124,6 @@ static void cmd_read_osip(char *entry, char *filename)
 static void cmd_write_osip(char *entry, char *filename)
 {
 	int index;
-	size_t size;
-	void *data;
 
 	if (!entry || !filename) {
 		fprintf(stderr, "Must specifiy image entry and filename!\n");
@@ -142,11 +134,7 @@ static void cmd_write_osip(char *entry, char *filename)
 		exit(1);
 
 	printf("flashing '%s' to '%s' osip[%d]\n", filename, entry, index);
-	if (file_read(filename, &data, &size)) {
-		fprintf(stderr, "failed to read input file!\n");
-		exit(1);
-	}
-	if (write_stitch_image(data, size, index)) {
+	if (write_stitch_image_file(filename, index, 0)) {
 		fprintf(stderr, "error writing image\n");
 		exit(1);
 	}
@@ -20,10 +20,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "fw_version_check.h"
 
@@ -126,7 +128,7 @@ struct FIP_header_long {
 	struct fip_version_block_long ifwi_rev;
 };
 
-static int read_fw_revision(unsigned int *fw_revision, int len)
+static int query_fw_revision(unsigned int *fw_revision, int len)
 {
 	int i, fw_info, ret;
 	const char *sep = " ";
@@ -165,6 +167,32 @@ err:
 	return ret;
 }
 
+/* The revisions reported by the SCU only change with a firmware
+ * update, the first query is kept until invalidate_fw_rev_cache */
+static unsigned int fw_revision_cache[SCU_IPC_VERSION_LEN_LONG];
+static bool fw_revision_cached;
+
+static int read_fw_revision(unsigned int *fw_revision, int len)
+{
+	int ret;
+
+	if (!fw_revision_cached) {
+		memset(fw_revision_cache, 0, sizeof(fw_revision_cache));
+		ret = query_fw_revision(fw_revision_cache, SCU_IPC_VERSION_LEN_LONG);
+		if (ret)
+			return ret;
+		fw_revision_cached = true;
+	}
+
+	memcpy(fw_revision, fw_revision_cache, len * sizeof(*fw_revision));
+	return 0;
+}
+
+void invalidate_fw_rev_cache(void)
+{
+	fw_revision_cached = false;
+}
+
 /* Bytes in scu_ipc_version after the ioctl():
  * 00 SCU RT Firmware Minor Revision
  * 01 SCU RT Firmware Major Revision
@@ -307,12 +335,138 @@ void dump_fw_versions(struct firmware_versions *v)
 	printf("   chaabi ext: %02X.%02X\n", v->chaabi_ext.major, v->chaabi_ext.minor);
 }
 
-int get_image_fw_rev(void *data, unsigned sz, struct firmware_versions *v)
+static void apply_fip(const struct FIP_header *h, struct firmware_versions *v)
 {
 	struct FIP_header fip;
-	unsigned char *databytes = (unsigned char *)data;
-	int magic;
+
+	memcpy(&fip, h, sizeof(fip));
+
+	/* don't update if null */
+	if (fip.ifwi_rev.major != 0)
+		v->ifwi.major = fip.ifwi_rev.major;
+	if (fip.ifwi_rev.minor != 0)
+		v->ifwi.minor = fip.ifwi_rev.minor;
+	if (fip.scu_rev.major != 0)
+		v->scu.major = fip.scu_rev.major;
+	if (fip.scu_rev.minor != 0)
+		v->scu.minor = fip.scu_rev.minor;
+	if (fip.oem_rev.major != 0)
+		v->oem.major = fip.oem_rev.major;
+	if (fip.oem_rev.minor != 0)
+		v->oem.minor = fip.oem_rev.minor;
+	if (fip.punit_rev.major != 0)
+		v->punit.major = fip.punit_rev.major;
+	if (fip.punit_rev.minor != 0)
+		v->punit.minor = fip.punit_rev.minor;
+	if (fip.ia32_rev.major != 0)
+		v->ia32.major = fip.ia32_rev.major;
+	if (fip.ia32_rev.minor != 0)
+		v->ia32.minor = fip.ia32_rev.minor;
+	if (fip.suppia32_rev.major != 0)
+		v->supp_ia32.major = fip.suppia32_rev.major;
+	if (fip.suppia32_rev.minor != 0)
+		v->supp_ia32.minor = fip.suppia32_rev.minor;
+	if (fip.chaabi_rev.icache.major != 0)
+		v->chaabi_icache.major = fip.chaabi_rev.icache.major;
+	if (fip.chaabi_rev.icache.minor != 0)
+		v->chaabi_icache.minor = fip.chaabi_rev.icache.minor;
+	if (fip.chaabi_rev.resident.major != 0)
+		v->chaabi_res.major = fip.chaabi_rev.resident.major;
+	if (fip.chaabi_rev.resident.minor != 0)
+		v->chaabi_res.minor = fip.chaabi_rev.resident.minor;
+	if (fip.chaabi_rev.ext.major != 0)
+		v->chaabi_ext.major = fip.chaabi_rev.ext.major;
+	if (fip.chaabi_rev.ext.minor != 0)
+		v->chaabi_ext.minor = fip.chaabi_rev.ext.minor;
+}
+
+static void apply_fip_long(const struct FIP_header_long *h, struct firmware_versions_long *v)
+{
+	struct FIP_header_long fip;
+
+	memcpy(&fip, h, sizeof(fip));
+
+	/* not available in ifwi file */
+	v->scubootstrap.minor = 0;
+	v->scubootstrap.major = 0;
+
+	/* don't update if null */
+	if (fip.scuc_rev.minor != 0)
+		v->scu.minor = fip.scuc_rev.minor;
+	if (fip.scuc_rev.major != 0)
+		v->scu.major = fip.scuc_rev.major;
+	if (fip.ia32_rev.minor != 0)
+		v->ia32.minor = fip.ia32_rev.minor;
+	if (fip.ia32_rev.major != 0)
+		v->ia32.major = fip.ia32_rev.major;
+	if (fip.oem_rev.minor != 0)
+		v->valhooks.minor = fip.oem_rev.minor;
+	if (fip.oem_rev.major != 0)
+		v->valhooks.major = fip.oem_rev.major;
+	if (fip.ifwi_rev.minor != 0)
+		v->ifwi.minor = fip.ifwi_rev.minor;
+	if (fip.ifwi_rev.major != 0)
+		v->ifwi.major = fip.ifwi_rev.major;
+	if (fip.ch00_rev.minor != 0)
+		v->chaabi.minor = fip.ch00_rev.minor;
+	if (fip.ch00_rev.major != 0)
+		v->chaabi.major = fip.ch00_rev.major;
+	if (fip.mia_rev.minor != 0)
+		v->mia.minor = fip.mia_rev.minor;
+	if (fip.mia_rev.major != 0)
+		v->mia.major = fip.mia_rev.major;
+}
+
+int fw_image_desc_init(struct fw_image_desc *desc, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	size_t *fip;
+	unsigned max = 0;
+	uint32_t magic;
+	size_t i;
+
+	desc->data = data;
+	desc->size = size;
+	desc->fip = NULL;
+	desc->fip_count = 0;
+	desc->smip = -1;
+
+	/* The FIP headers are found on any byte by the update file
+	 * parsing, and on a word boundary by the version parsing */
+	for (i = 0; i + sizeof(magic) <= size; i++) {
+		memcpy(&magic, bytes + i, sizeof(magic));
+		if (magic == SMIP_PATTERN && desc->smip < 0)
+			desc->smip = i;
+		if (magic != FIP_PATTERN)
+			continue;
+		if (desc->fip_count == max) {
+			max = max ? 2 * max : 8;
+			fip = realloc(desc->fip, max * sizeof(*fip));
+			if (!fip) {
+				fprintf(stderr, "Couldn't index the FIP headers!\n");
+				fw_image_desc_free(desc);
+				return -1;
+			}
+			desc->fip = fip;
+		}
+		desc->fip[desc->fip_count++] = i;
+	}
+
+	return 0;
+}
+
+void fw_image_desc_free(struct fw_image_desc *desc)
+{
+	free(desc->fip);
+	desc->fip = NULL;
+	desc->fip_count = 0;
+}
+
+int fw_image_desc_rev(const struct fw_image_desc *desc, struct firmware_versions *v)
+{
+	const unsigned char *bytes = (const unsigned char *)desc->data;
 	int magic_found = 0;
+	unsigned i;
 
 	if (v == NULL) {
 		fprintf(stderr, "Null pointer !\n");
@@ -320,80 +474,28 @@ int get_image_fw_rev(void *data, unsigned sz, struct firmware_versions *v)
 	} else
 		memset((void *)v, 0, sizeof(struct firmware_versions));
 
-	while (sz >= sizeof(fip)) {
-
-		/* Scan for the FIP magic */
-		while (sz >= sizeof(fip)) {
-			memcpy(&magic, databytes, sizeof(magic));
-			if (magic == FIP_PATTERN) {
-				magic_found = 1;
-				break;
-			}
-			databytes += sizeof(magic);
-			sz -= sizeof(magic);
-		}
-
-		if (!magic_found) {
-			fprintf(stderr, "Couldn't find FIP magic in image!\n");
-			return -1;
-		}
-		if (sz < sizeof(fip)) {
-			break;
-		}
+	for (i = 0; i < desc->fip_count; i++) {
+		if (desc->fip[i] % sizeof(uint32_t) ||
+		    desc->fip[i] + sizeof(struct FIP_header) > desc->size)
+			continue;
+		apply_fip((const struct FIP_header *)(bytes + desc->fip[i]), v);
+		magic_found = 1;
+	}
 
-		memcpy(&fip, databytes, sizeof(fip));
-
-		/* don't update if null */
-		if (fip.ifwi_rev.major != 0)
-			v->ifwi.major = fip.ifwi_rev.major;
-		if (fip.ifwi_rev.minor != 0)
-			v->ifwi.minor = fip.ifwi_rev.minor;
-		if (fip.scu_rev.major != 0)
-			v->scu.major = fip.scu_rev.major;
-		if (fip.scu_rev.minor != 0)
-			v->scu.minor = fip.scu_rev.minor;
-		if (fip.oem_rev.major != 0)
-			v->oem.major = fip.oem_rev.major;
-		if (fip.oem_rev.minor != 0)
-			v->oem.minor = fip.oem_rev.minor;
-		if (fip.punit_rev.major != 0)
-			v->punit.major = fip.punit_rev.major;
-		if (fip.punit_rev.minor != 0)
-			v->punit.minor = fip.punit_rev.minor;
-		if (fip.ia32_rev.major != 0)
-			v->ia32.major = fip.ia32_rev.major;
-		if (fip.ia32_rev.minor != 0)
-			v->ia32.minor = fip.ia32_rev.minor;
-		if (fip.suppia32_rev.major != 0)
-			v->supp_ia32.major = fip.suppia32_rev.major;
-		if (fip.suppia32_rev.minor != 0)
-			v->supp_ia32.minor = fip.suppia32_rev.minor;
-		if (fip.chaabi_rev.icache.major != 0)
-			v->chaabi_icache.major = fip.chaabi_rev.icache.major;
-		if (fip.chaabi_rev.icache.minor != 0)
-			v->chaabi_icache.minor = fip.chaabi_rev.icache.minor;
-		if (fip.chaabi_rev.resident.major != 0)
-			v->chaabi_res.major = fip.chaabi_rev.resident.major;
-		if (fip.chaabi_rev.resident.minor != 0)
-			v->chaabi_res.minor = fip.chaabi_rev.resident.minor;
-		if (fip.chaabi_rev.ext.major != 0)
-			v->chaabi_ext.major = fip.chaabi_rev.ext.major;
-		if (fip.chaabi_rev.ext.minor != 0)
-			v->chaabi_ext.minor = fip.chaabi_rev.ext.minor;
-
-		databytes += sizeof(magic);
-		sz -= sizeof(magic);
+	/* An image smaller than a header has no version */
+	if (!magic_found && desc->size >= sizeof(struct FIP_header)) {
+		fprintf(stderr, "Couldn't find FIP magic in image!\n");
+		return -1;
 	}
 
 	return 0;
 }
 
-int get_image_fw_rev_long(void *data, unsigned sz, struct firmware_versions_long *v)
+int fw_image_desc_rev_long(const struct fw_image_desc *desc, struct firmware_versions_long *v)
 {
-	struct FIP_header_long fip;
-	unsigned char *databytes = (unsigned char *)data;
-	int magic;
+	const unsigned char *bytes = (const unsigned char *)desc->data;
 	int magic_found = 0;
+	unsigned i;
 
 	if (v == NULL) {
 		fprintf(stderr, "Null pointer !\n");
@@ -401,166 +503,179 @@ int get_image_fw_rev_long(void *data, unsigned sz, struct firmware_versions_long
 	} else
 		memset((void *)v, 0, sizeof(struct firmware_versions_long));
 
-	while (sz >= sizeof(fip)) {
-
-		/* Scan for the FIP magic */
-		while (sz >= sizeof(fip)) {
-			memcpy(&magic, databytes, sizeof(magic));
-			if (magic == FIP_PATTERN) {
-				magic_found = 1;
-				break;
-			}
-			databytes += sizeof(magic);
-			sz -= sizeof(magic);
-		}
-
-		if (!magic_found) {
-			fprintf(stderr, "Couldn't find FIP magic in image!\n");
-			return -1;
-		}
-		if (sz < sizeof(fip)) {
-			break;
-		}
+	for (i = 0; i < desc->fip_count; i++) {
+		if (desc->fip[i] % sizeof(uint32_t) ||
+		    desc->fip[i] + sizeof(struct FIP_header_long) > desc->size)
+			continue;
+		apply_fip_long((const struct FIP_header_long *)(bytes + desc->fip[i]), v);
+		magic_found = 1;
+	}
 
-		memcpy(&fip, databytes, sizeof(fip));
-
-		/* not available in ifwi file */
-		v->scubootstrap.minor = 0;
-		v->scubootstrap.major = 0;
-
-		/* don't update if null */
-		if (fip.scuc_rev.minor != 0)
-			v->scu.minor = fip.scuc_rev.minor;
-		if (fip.scuc_rev.major != 0)
-			v->scu.major = fip.scuc_rev.major;
-		if (fip.ia32_rev.minor != 0)
-			v->ia32.minor = fip.ia32_rev.minor;
-		if (fip.ia32_rev.major != 0)
-			v->ia32.major = fip.ia32_rev.major;
-		if (fip.oem_rev.minor != 0)
-			v->valhooks.minor = fip.oem_rev.minor;
-		if (fip.oem_rev.major != 0)
-			v->valhooks.major = fip.oem_rev.major;
-		if (fip.ifwi_rev.minor != 0)
-			v->ifwi.minor = fip.ifwi_rev.minor;
-		if (fip.ifwi_rev.major != 0)
-			v->ifwi.major = fip.ifwi_rev.major;
-		if (fip.ch00_rev.minor != 0)
-			v->chaabi.minor = fip.ch00_rev.minor;
-		if (fip.ch00_rev.major != 0)
-			v->chaabi.major = fip.ch00_rev.major;
-		if (fip.mia_rev.minor != 0)
-			v->mia.minor = fip.mia_rev.minor;
-		if (fip.mia_rev.major != 0)
-			v->mia.major = fip.mia_rev.major;
-
-		databytes += sizeof(magic);
-		sz -= sizeof(magic);
+	if (!magic_found && desc->size >= sizeof(struct FIP_header_long)) {
+		fprintf(stderr, "Couldn't find FIP magic in image!\n");
+		return -1;
 	}
 
 	return 0;
 }
 
-int crack_update_fw(const char *fw_file, struct fw_version *ifwi_version)
+int fw_image_desc_ifwi_version(const struct fw_image_desc *desc, struct fw_version *ifwi_version)
 {
+	const unsigned char *bytes = (const unsigned char *)desc->data;
 	struct FIP_header fip;
-	FILE *fd;
-	int tmp = 0;
-	int location;
+	size_t start = 0;
+	unsigned i;
 
-	memset((void *)&fip, 0, sizeof(fip));
-
-	if ((fd = fopen(fw_file, "rb")) == NULL) {
-		fprintf(stderr, "fopen error: Unable to open file\n");
-		return -1;
-	}
 	ifwi_version->major = 0;
 	ifwi_version->minor = 0;
 
-	while ((ifwi_version->minor == 0) && (ifwi_version->major == 0)) {
-
-		while (tmp != FIP_PATTERN) {
-			int cur;
-			fread(&tmp, sizeof(int), 1, fd);
-			if (ferror(fd) || feof(fd)) {
-				fprintf(stderr, "find FIP_pattern failed\n");
-				fclose(fd);
-				return -1;
-			}
-			cur = ftell(fd) - sizeof(int);
-			fseek(fd, cur + sizeof(char), SEEK_SET);
-		}
-		location = ftell(fd) - sizeof(char);
-
-		fseek(fd, location, SEEK_SET);
-		fread((void *)&fip, sizeof(fip), 1, fd);
-		if (ferror(fd) || feof(fd)) {
+	/* The first header with a version, the search going on after
+	 * the end of a header without one */
+	for (i = 0; i < desc->fip_count; i++) {
+		if (desc->fip[i] < start)
+			continue;
+		if (desc->fip[i] + sizeof(fip) > desc->size) {
 			fprintf(stderr, "read of FIP_header failed\n");
-			fclose(fd);
 			return -1;
 		}
+		memcpy(&fip, bytes + desc->fip[i], sizeof(fip));
 		ifwi_version->major = fip.ifwi_rev.major;
 		ifwi_version->minor = fip.ifwi_rev.minor;
-		tmp = 0;
+		if (ifwi_version->major || ifwi_version->minor)
+			return 0;
+		start = desc->fip[i] + sizeof(fip);
+	}
+
+	fprintf(stderr, "find FIP_pattern failed\n");
+	return -1;
+}
 
+int fw_image_desc_pti_field(const struct fw_image_desc *desc, uint8_t * pti_field)
+{
+	*pti_field = 0x00000000;
+
+	if (desc->smip < 0) {
+		fprintf(stderr, "find SMIP_PATTERN failed\n");
+		return -1;
+	}
+
+	/* The PTI field is at an offset of the SMIP area. */
+	if (desc->smip + PTI_FIELD_OFFSET >= desc->size) {
+		fprintf(stderr, "reposition to PTI field offset failed\n");
+		return -1;
 	}
-	fclose(fd);
 
+	/* Fill given param with found value. */
+	*pti_field = ((const uint8_t *)desc->data)[desc->smip + PTI_FIELD_OFFSET];
 	return 0;
 }
 
-int crack_update_fw_pti_field(const char *fw_file, uint8_t * pti_field)
+int get_image_fw_rev(void *data, unsigned sz, struct firmware_versions *v)
 {
-	FILE *fd;
-	int tmp = 0;
-	int location;
-	uint8_t smip_data;
+	struct fw_image_desc desc;
+	int ret;
 
-	if ((fd = fopen(fw_file, "rb")) == NULL) {
-		fprintf(stderr, "fopen error: Unable to open file\n");
+	if (fw_image_desc_init(&desc, data, sz))
 		return -1;
-	}
 
-	*pti_field = 0x00000000;
+	ret = fw_image_desc_rev(&desc, v);
+	fw_image_desc_free(&desc);
+	return ret;
+}
 
-	/* Search for SMIP area. */
-	while (tmp != SMIP_PATTERN) {
-		int cur;
-		fread(&tmp, sizeof(int), 1, fd);
-		if (ferror(fd) || feof(fd)) {
-			fprintf(stderr, "find SMIP_PATTERN failed\n");
-			fclose(fd);
-			return -1;
-		}
-		cur = ftell(fd) - sizeof(int);
+int get_image_fw_rev_long(void *data, unsigned sz, struct firmware_versions_long *v)
+{
+	struct fw_image_desc desc;
+	int ret;
 
-		fseek(fd, cur + sizeof(char), SEEK_SET);
-		if (ferror(fd) || feof(fd)) {
-			fprintf(stderr, "reposition to SMIP_PATTERN failed\n");
-			fclose(fd);
-			return -1;
-		}
-	}
-	location = ftell(fd) - sizeof(char);
+	if (fw_image_desc_init(&desc, data, sz))
+		return -1;
 
-	/* Move to the offset where the PIT field is located. */
-	fseek(fd, location + PTI_FIELD_OFFSET, SEEK_SET);
-	if (ferror(fd) || feof(fd)) {
-		fprintf(stderr, "reposition to PTI field offset failed\n");
-		fclose(fd);
+	ret = fw_image_desc_rev_long(&desc, v);
+	fw_image_desc_free(&desc);
+	return ret;
+}
+
+int crack_update_fw_data(const void *data, size_t size, struct fw_version *ifwi_version)
+{
+	struct fw_image_desc desc;
+	int ret;
+
+	if (fw_image_desc_init(&desc, data, size))
 		return -1;
-	}
 
-	fread(&smip_data, 1, 1, fd);
-	if (ferror(fd) || feof(fd)) {
-		fprintf(stderr, "read of FIP_header failed\n");
-		fclose(fd);
+	ret = fw_image_desc_ifwi_version(&desc, ifwi_version);
+	fw_image_desc_free(&desc);
+	return ret;
+}
+
+int crack_update_fw_pti_field_data(const void *data, size_t size, uint8_t * pti_field)
+{
+	struct fw_image_desc desc;
+	int ret;
+
+	if (fw_image_desc_init(&desc, data, size))
 		return -1;
+
+	ret = fw_image_desc_pti_field(&desc, pti_field);
+	fw_image_desc_free(&desc);
+	return ret;
+}
+
+static void *map_fw_file(const char *fw_file, size_t *size)
+{
+	struct stat sb;
+	void *data;
+	int fd;
+
+	fd = open(fw_file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open error: Unable to open file\n");
+		return NULL;
+	}
+	if (fstat(fd, &sb) || sb.st_size == 0) {
+		fprintf(stderr, "stat error: Unable to get file size\n");
+		close(fd);
+		return NULL;
 	}
 
-	/* Fill given param with found value. */
-	*pti_field = smip_data;
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mmap error: Unable to map file\n");
+		return NULL;
+	}
 
-	fclose(fd);
-	return 0;
+	*size = sb.st_size;
+	return data;
+}
+
+int crack_update_fw(const char *fw_file, struct fw_version *ifwi_version)
+{
+	size_t size;
+	void *data;
+	int ret;
+
+	data = map_fw_file(fw_file, &size);
+	if (!data)
+		return -1;
+
+	ret = crack_update_fw_data(data, size, ifwi_version);
+	munmap(data, size);
+	return ret;
+}
+
+int crack_update_fw_pti_field(const char *fw_file, uint8_t * pti_field)
+{
+	size_t size;
+	void *data;
+	int ret;
+
+	data = map_fw_file(fw_file, &size);
+	if (!data)
+		return -1;
+
+	ret = crack_update_fw_pti_field_data(data, size, pti_field);
+	munmap(data, size);
+	return ret;
 }
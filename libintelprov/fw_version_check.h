@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 #include <stdint.h>
+#include <stddef.h>
 
 struct fw_version {
 	uint8_t major;
@@ -56,12 +57,34 @@ struct firmware_versions_long {
 int get_current_fw_rev(struct firmware_versions *v);
 int get_current_fw_rev_long(struct firmware_versions_long *v);
 
+/* The current versions are queried once, this forces a new query after
+ * a firmware update */
+void invalidate_fw_rev_cache(void);
+
 /* Assuming data points to a blob of memory containing an IFWI
  * firmware image, inpsect the FIP header inside it and
  * populate the fields in v. Returns nonzero on error */
 int get_image_fw_rev(void *data, unsigned sz, struct firmware_versions *v);
 int get_image_fw_rev_long(void *data, unsigned sz, struct firmware_versions_long *v);
 
+/* The offsets of the headers of a firmware image, found in a single
+ * scan, which answer all the queries below. data must stay valid
+ * until fw_image_desc_free. Returns nonzero on error */
+struct fw_image_desc {
+	const void *data;
+	size_t size;
+	size_t *fip;
+	unsigned fip_count;
+	long smip;
+};
+
+int fw_image_desc_init(struct fw_image_desc *desc, const void *data, size_t size);
+void fw_image_desc_free(struct fw_image_desc *desc);
+int fw_image_desc_rev(const struct fw_image_desc *desc, struct firmware_versions *v);
+int fw_image_desc_rev_long(const struct fw_image_desc *desc, struct firmware_versions_long *v);
+int fw_image_desc_ifwi_version(const struct fw_image_desc *desc, struct fw_version *ifwi_version);
+int fw_image_desc_pti_field(const struct fw_image_desc *desc, uint8_t * pti_field);
+
 /* Dump all the firmware component versions to stdout */
 void dump_fw_versions(struct firmware_versions *v);
 
@@ -71,8 +94,10 @@ int fw_vercmp(struct firmware_versions *v1, struct firmware_versions *v2);
 
 /* Crack ifwi firmware file */
 int crack_update_fw(const char *fw_file, struct fw_version *ifwi_version);
+int crack_update_fw_data(const void *data, size_t size, struct fw_version *ifwi_version);
 
 /* Crack ifwi firmware file to get the PTI Field. */
 int crack_update_fw_pti_field(const char *fw_file, uint8_t * pti_field);
+int crack_update_fw_pti_field_data(const void *data, size_t size, uint8_t * pti_field);
 
 #endif
@@ -63,7 +63,30 @@ static int cmd_stop_partitioning(int argc, char **argv)
     return 0;
 }
 
-static int _oem_partition_gpt_sub_command(int argc, char **argv)
+/* In batch mode, the last reload command, which only runs once the GPT
+ * is written */
+static int pending_reload_argc;
+static char **pending_reload_argv;
+
+static void free_args(int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++)
+        free(argv[i]);
+    free(argv);
+}
+
+static int request_reload(int argc, char **argv)
+{
+    if (pending_reload_argv)
+        free_args(pending_reload_argc, pending_reload_argv);
+    pending_reload_argc = argc;
+    pending_reload_argv = argv;
+    return 0;
+}
+
+static int _oem_partition_gpt_sub_command(int argc, char **argv, int batch)
 {
 
     static struct {
@@ -105,39 +128,57 @@ static int _oem_partition_gpt_sub_command(int argc, char **argv)
         }
     }
 
-    if (match_count == 1)
+    if (match_count == 1) {
+        if (batch && cmds[match_index].fp == cmd_reload)
+            return request_reload(argc, argv);
         return cmds[match_index].fp(argc, argv);
+    }
 
     return -1;
 }
 
-static int oem_partition_gpt_handler(FILE *fp)
+/* In batch mode, the commands share a single load of the GPT, which is
+ * only written once they all succeeded, and the kernel reads it again
+ * once if it changed, however many reload commands there are. */
+static int oem_partition_gpt_handler(FILE *fp, int batch)
 {
     //printf("%s\n", __func__);
     char buffer[K_MAX_ARG_LEN];
     char **argv=NULL;
     int argc=0;
-    int i;
     int ret=0;
 
     uuid_generator=cgpt_uuid_generate;
     dup2(2, 1);
 
+    if (batch)
+        DriveBatchBegin();
+
     while (fgets(buffer, sizeof(buffer), fp)) {
         buffer[strlen(buffer)-1]='\0';
         argv=str_to_array(buffer, &argc);
-            ret|=_oem_partition_gpt_sub_command(argc, argv);
+        if (!argv)
+            continue;
+        ret|=_oem_partition_gpt_sub_command(argc, argv, batch);
 
-        for(i = 0;i<argc; i++) {
-            if (argv[i]) {
-                free(argv[i]);
-                argv[i]=NULL;
-            }
-        }
+        if (argv != pending_reload_argv)
+            free_args(argc, argv);
+        argv=NULL;
 
-        if (argv) {
-            free(argv);
-            argv=NULL;
+        /* the changes of a failed command are not to be written */
+        if (batch && ret)
+            break;
+    }
+
+    if (batch) {
+        if (CGPT_OK != DriveBatchEnd(!ret))
+            ret = -1;
+        if (pending_reload_argv) {
+            optind = 0;
+            if (!ret && DriveBatchWritten())
+                ret = cmd_reload(pending_reload_argc, pending_reload_argv);
+            free_args(pending_reload_argc, pending_reload_argv);
+            pending_reload_argv = NULL;
         }
     }
 
@@ -150,11 +191,20 @@ static int oem_partition_mbr_handler(FILE *fp)
 }
 
 
+/* gfdisk [-b] FILE, where FILE is - for the standard input. With -b,
+ * the commands of FILE run in batch mode. */
 int main(int argc, char **argv)
 {
     char buffer[K_MAX_ARG_LEN];
     char partition_type[K_MAX_ARG_LEN];
     FILE *fp;
+    int batch = 0;
+
+    if (argc == 3 && !strcmp(argv[1], "-b")) {
+        batch = 1;
+        argv++;
+        argc--;
+    }
 
     memset(buffer, 0, sizeof(buffer));
     int j=1;
@@ -162,7 +212,7 @@ int main(int argc, char **argv)
     while (j--) {
         if (argc == 2) {
 
-            fp = fopen(argv[1], "r");
+            fp = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin;
             if (!fp)
                 return -1;
 
@@ -175,7 +225,7 @@ int main(int argc, char **argv)
                 return -1;
 
             if (!strncmp("gpt", partition_type, strlen(partition_type)))
-                ret=oem_partition_gpt_handler(fp);
+                ret=oem_partition_gpt_handler(fp, batch);
 
             if (!strncmp("mbr", partition_type, strlen(partition_type)))
                 ret=oem_partition_mbr_handler(fp);
@@ -26,6 +26,12 @@
 #include "cgptlib_internal.h"
 #include "crc32.h"
 
+// The ASCII runs of the names are converted 8 or 16 code units at once.
+#if defined(__SSE2__) && __BYTE_ORDER == __LITTLE_ENDIAN
+#include <emmintrin.h>
+#define ASCII_FAST_PATH 1
+#endif
+
 const char* progname = "cgpt";
 const char* command = "cgpt";
 
@@ -52,6 +58,9 @@ void Error(const char *format, ...) {
 
 
 int CheckValid(const struct drive *drive) {
+  // Only the primary copy was checked
+  if (drive->gpt.secondary_deferred)
+    return CGPT_OK;
   if ((drive->gpt.valid_headers != MASK_BOTH) ||
       (drive->gpt.valid_entries != MASK_BOTH)) {
     fprintf(stderr, "\nWARNING: one of the GPT header/entries is invalid, "
@@ -61,19 +70,17 @@ int CheckValid(const struct drive *drive) {
   return CGPT_OK;
 }
 
-/* Loads sectors from 'fd'.
- * *buf is pointed to an allocated memory when returned, and should be
- * freed by cgpt_close().
+/* Loads sectors from 'fd' into 'buf', in a single read.
  *
  *   fd -- file descriptot.
- *   buf -- pointer to buffer pointer
+ *   buf -- buffer of at least sector_bytes * sector_count
  *   sector -- offset of starting sector (in sectors)
  *   sector_bytes -- bytes per sector
  *   sector_count -- number of sectors to load
  *
- * Returns CGPT_OK for successful. Aborts if any error occurs.
+ * Returns CGPT_OK for successful, CGPT_FAILED for failed.
  */
-static int Load(const int fd, uint8_t **buf,
+static int Load(const int fd, uint8_t *buf,
                 const uint64_t sector,
                 const uint64_t sector_bytes,
                 const uint64_t sector_count) {
@@ -93,27 +100,16 @@ static int Load(const int fd, uint8_t **buf,
     return CGPT_FAILED;
   }
   count = sector_bytes * sector_count;
-  *buf = malloc(count);
-  require(*buf);
 
   uint64_t where = sector * sector_bytes;
-  if (-1 == lseek64(fd, where, SEEK_SET)) {
-    Error("Can't lseek to  %llu: %s \n", where, strerror(errno));
-    goto error_free;
-  }
-
-  nread = read(fd, *buf, count);
+  nread = pread64(fd, buf, count, where);
   if (nread < count) {
-    Error("Can't read enough: %d, not %d\n", nread, count);
-    goto error_free;
+    Error("Can't read enough at %llu: %d, not %d: %s\n",
+          where, nread, count, nread < 0 ? strerror(errno) : "short read");
+    return CGPT_FAILED;
   }
 
   return CGPT_OK;
-
-error_free:
-  free(*buf);
-  *buf = 0;
-  return CGPT_FAILED;
 }
 
 
@@ -139,7 +135,7 @@ int WritePMBR(struct drive *drive) {
   return CGPT_OK;
 }
 
-/* Saves sectors to 'fd'.
+/* Saves sectors to 'fd', in a single write.
  *
  *   fd -- file descriptot.
  *   buf -- pointer to buffer
@@ -159,10 +155,7 @@ static int Save(const int fd, const uint8_t *buf,
   require(buf);
   count = sector_bytes * sector_count;
 
-  if (-1 == lseek64(fd, sector * sector_bytes, SEEK_SET))
-    return CGPT_FAILED;
-
-  nwrote = write(fd, buf, count);
+  nwrote = pwrite64(fd, buf, count, sector * sector_bytes);
   if (nwrote < count)
     return CGPT_FAILED;
 
@@ -170,13 +163,35 @@ static int Save(const int fd, const uint8_t *buf,
 }
 
 
+// The copy, as on the drive, of the sectors of gpt_buf at buf
+static uint8_t *Loaded(struct drive *drive, uint8_t *buf) {
+  return buf + GPT_BUF_SECTORS * drive->gpt.sector_bytes;
+}
+
+static void SaveLoaded(struct drive *drive, uint8_t *buf,
+                       uint64_t sector_count) {
+  memcpy(Loaded(drive, buf), buf, sector_count * drive->gpt.sector_bytes);
+}
+
+static int LoadSecondary(struct drive *drive) {
+  return Load(drive->fd, drive->gpt.secondary_entries,
+              drive->gpt.drive_sectors - GPT_SECONDARY_SECTORS,
+              drive->gpt.sector_bytes, GPT_SECONDARY_SECTORS);
+}
+
 // Opens a block device or file, loads raw GPT data from it.
-// mode should be O_RDONLY or O_RDWR
+// mode should be O_RDONLY or O_RDWR. A read-only drive whose primary
+// GPT is valid is loaded without its secondary GPT, which is only read
+// by DriveLoadSecondary(), see secondary_deferred.
 //
 // Returns CGPT_FAILED if any error happens.
 // Returns CGPT_OK if success and information are stored in 'drive'. */
-int DriveOpen(const char *drive_path, struct drive *drive, int mode) {
+static int DriveSave(struct drive *drive, int update_as_needed);
+
+static int DriveLoad(const char *drive_path, struct drive *drive, int mode) {
   struct stat stat;
+  uint64_t sector_bytes;
+  uint8_t *secondary;
 
   require(drive_path);
   require(drive);
@@ -216,96 +231,273 @@ int DriveOpen(const char *drive_path, struct drive *drive, int mode) {
 
   drive->gpt.drive_sectors = drive->size / drive->gpt.sector_bytes;
 
-  // Read the data.
-  if (CGPT_OK != Load(drive->fd, &drive->gpt.primary_header,
-                      GPT_PMBR_SECTOR,
-                      drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
+  // Read the data: the PMBR, the primary header and the primary entries
+  // in one read, the secondary entries and header in another if needed,
+  // both into a single buffer.
+  sector_bytes = drive->gpt.sector_bytes;
+  if (drive->gpt.drive_sectors < GPT_BUF_SECTORS) {
+    Error("Media size (%llu) is too small for a GPT\n",
+          (long long unsigned int)drive->size);
     goto error_close;
   }
-  if (CGPT_OK != Load(drive->fd, &drive->gpt.secondary_header,
-                      drive->gpt.drive_sectors - GPT_PMBR_SECTOR,
-                      drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
+  if (posix_memalign((void **)&drive->gpt_buf, GPT_BUF_ALIGN,
+                     2 * GPT_BUF_SECTORS * sector_bytes)) {
+    Error("Can't allocate the GPT buffer\n");
+    drive->gpt_buf = 0;
     goto error_close;
   }
-  if (CGPT_OK != Load(drive->fd, &drive->gpt.primary_entries,
-                      GPT_PMBR_SECTOR + GPT_HEADER_SECTOR,
-                      drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
-        goto error_close;
-  }
-  if (CGPT_OK != Load(drive->fd, &drive->gpt.secondary_entries,
-                      drive->gpt.drive_sectors - GPT_HEADER_SECTOR
-                      - GPT_ENTRIES_SECTORS,
-                      drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
+  secondary = drive->gpt_buf + GPT_PRIMARY_SECTORS * sector_bytes;
+  if (CGPT_OK != Load(drive->fd, drive->gpt_buf, 0,
+                      sector_bytes, GPT_PRIMARY_SECTORS)) {
     goto error_close;
   }
 
+  memcpy(&drive->pmbr, drive->gpt_buf, sizeof(struct pmbr));
+  drive->gpt.primary_header = drive->gpt_buf + GPT_PMBR_SECTOR * sector_bytes;
+  drive->gpt.primary_entries = drive->gpt.primary_header +
+                               GPT_HEADER_SECTOR * sector_bytes;
+  drive->gpt.secondary_entries = secondary;
+  drive->gpt.secondary_header = secondary + GPT_ENTRIES_SECTORS * sector_bytes;
+
+  // Nothing is written through a read-only drive, so the secondary GPT,
+  // at the end of the drive, is not needed while the primary is valid.
+  if (mode == O_RDONLY) {
+    memset(secondary, 0, GPT_SECONDARY_SECTORS * sector_bytes);
+    drive->gpt.secondary_deferred = 1;
+    if (GPT_SUCCESS == GptSanityCheck(&drive->gpt)) {
+      SaveLoaded(drive, drive->gpt_buf, GPT_PRIMARY_SECTORS);
+      return CGPT_OK;
+    }
+  }
+  drive->gpt.secondary_deferred = 0;
+  if (CGPT_OK != LoadSecondary(drive))
+    goto error_close;
+  SaveLoaded(drive, drive->gpt_buf, GPT_BUF_SECTORS);
+
   // We just load the data. Caller must validate it.
   return CGPT_OK;
 
 error_close:
-  (void) DriveClose(drive, 0);
+  (void) DriveSave(drive, 0);
   return CGPT_FAILED;
 }
 
 
-int DriveClose(struct drive *drive, int update_as_needed) {
-  int errors = 0;
+// Writes the modified parts of one side of the GPT, header and entries
+// being contiguous on the drive and in gpt_buf. Only the sectors which
+// differ from the drive are written, one write per run of them, e.g. a
+// repair of the header alone, or of a stale copy only partly different,
+// is written as such. Returns the number of errors, and adds the number
+// of sectors written to *written.
+static int SaveSide(struct drive *drive, const char *side,
+                    int header_modified, uint8_t *header, uint64_t header_lba,
+                    int entries_modified, uint8_t *entries, uint64_t entries_lba,
+                    uint64_t *written) {
+  uint64_t sector_bytes = drive->gpt.sector_bytes;
+  uint8_t *buf, *loaded;
+  uint64_t lba, count, i, run;
+
+  if (header_modified && entries_modified) {
+    buf = header_lba < entries_lba ? header : entries;
+    lba = header_lba < entries_lba ? header_lba : entries_lba;
+    count = GPT_HEADER_SECTOR + GPT_ENTRIES_SECTORS;
+  } else if (header_modified) {
+    buf = header;
+    lba = header_lba;
+    count = GPT_HEADER_SECTOR;
+  } else if (entries_modified) {
+    buf = entries;
+    lba = entries_lba;
+    count = GPT_ENTRIES_SECTORS;
+  } else {
+    return 0;
+  }
 
-  if (update_as_needed) {
-    if (drive->gpt.modified & GPT_MODIFIED_HEADER1) {
-      if (CGPT_OK != Save(drive->fd, drive->gpt.primary_header,
-                          GPT_PMBR_SECTOR,
-                          drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
-        errors++;
-        Error("Cannot write primary header: %s\n", strerror(errno));
-      }
+  loaded = Loaded(drive, buf);
+  for (i = 0; i < count; i += run) {
+    if (!memcmp(buf + i * sector_bytes, loaded + i * sector_bytes,
+                sector_bytes)) {
+      run = 1;
+      continue;
     }
-
-    if (drive->gpt.modified & GPT_MODIFIED_HEADER2) {
-      if(CGPT_OK != Save(drive->fd, drive->gpt.secondary_header,
-                         drive->gpt.drive_sectors - GPT_PMBR_SECTOR,
-                         drive->gpt.sector_bytes, GPT_HEADER_SECTOR)) {
-        errors++;
-        Error("Cannot write secondary header: %s\n", strerror(errno));
-      }
+    for (run = 1; i + run < count; run++) {
+      if (!memcmp(buf + (i + run) * sector_bytes,
+                  loaded + (i + run) * sector_bytes, sector_bytes))
+        break;
     }
-    if (drive->gpt.modified & GPT_MODIFIED_ENTRIES1) {
-      if (CGPT_OK != Save(drive->fd, drive->gpt.primary_entries,
-                          GPT_PMBR_SECTOR + GPT_HEADER_SECTOR,
-                          drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
-        errors++;
-        Error("Cannot write primary entries: %s\n", strerror(errno));
-      }
+    if (CGPT_OK != Save(drive->fd, buf + i * sector_bytes, lba + i,
+                        sector_bytes, run)) {
+      Error("Cannot write %s GPT at sector %llu: %s\n", side,
+            (long long unsigned int)(lba + i), strerror(errno));
+      return 1;
     }
-    if (drive->gpt.modified & GPT_MODIFIED_ENTRIES2) {
-      if (CGPT_OK != Save(drive->fd, drive->gpt.secondary_entries,
-                          drive->gpt.drive_sectors - GPT_HEADER_SECTOR
-                          - GPT_ENTRIES_SECTORS,
-                          drive->gpt.sector_bytes, GPT_ENTRIES_SECTORS)) {
-        errors++;
-        Error("Cannot write secondary entries: %s\n", strerror(errno));
-      }
+    memcpy(loaded + i * sector_bytes, buf + i * sector_bytes,
+           run * sector_bytes);
+    *written += run;
+  }
+  return 0;
+}
+
+int DriveLoadSecondary(struct drive *drive) {
+  if (!drive->gpt.secondary_deferred)
+    return CGPT_OK;
+  if (CGPT_OK != LoadSecondary(drive))
+    return CGPT_FAILED;
+  SaveLoaded(drive, drive->gpt.secondary_entries, GPT_SECONDARY_SECTORS);
+  drive->gpt.secondary_deferred = 0;
+  return CGPT_OK;
+}
+
+static int DriveSave(struct drive *drive, int update_as_needed) {
+  int errors = 0;
+  uint8_t modified = drive->gpt.modified;
+
+  if (update_as_needed && modified) {
+    uint64_t primary = 0, secondary = 0;
+
+    errors += SaveSide(drive, "primary",
+                       modified & GPT_MODIFIED_HEADER1,
+                       drive->gpt.primary_header, GPT_PMBR_SECTOR,
+                       modified & GPT_MODIFIED_ENTRIES1,
+                       drive->gpt.primary_entries,
+                       GPT_PMBR_SECTOR + GPT_HEADER_SECTOR, &primary);
+    // The primary is on the drive before the secondary is overwritten,
+    // so that a power loss in between always leaves a valid copy
+    if (primary && (modified & (GPT_MODIFIED_HEADER2 | GPT_MODIFIED_ENTRIES2)) &&
+        fsync(drive->fd) == -1) {
+      errors++;
+      Error("Cannot sync the primary GPT: %s\n", strerror(errno));
+    }
+    errors += SaveSide(drive, "secondary",
+                       modified & GPT_MODIFIED_HEADER2,
+                       drive->gpt.secondary_header,
+                       drive->gpt.drive_sectors - GPT_PMBR_SECTOR,
+                       modified & GPT_MODIFIED_ENTRIES2,
+                       drive->gpt.secondary_entries,
+                       drive->gpt.drive_sectors - GPT_HEADER_SECTOR
+                       - GPT_ENTRIES_SECTORS, &secondary);
+    if ((primary || secondary) && fsync(drive->fd) == -1) {
+      errors++;
+      Error("Cannot sync the GPT: %s\n", strerror(errno));
     }
   }
 
   close(drive->fd);
 
-  if (drive->gpt.primary_header)
-    free(drive->gpt.primary_header);
+  free(drive->labels);
+  drive->labels = 0;
+  drive->num_labels = 0;
+
+  // All the GPT pointers point into gpt_buf
+  free(drive->gpt_buf);
+  drive->gpt_buf = 0;
   drive->gpt.primary_header = 0;
-  if (drive->gpt.primary_entries)
-    free(drive->gpt.primary_entries);
   drive->gpt.primary_entries = 0;
-  if (drive->gpt.secondary_header)
-    free(drive->gpt.secondary_header);
   drive->gpt.secondary_header = 0;
-  if (drive->gpt.secondary_entries)
-    free(drive->gpt.secondary_entries);
   drive->gpt.secondary_entries = 0;
 
   return errors ? CGPT_FAILED : CGPT_OK;
 }
 
+// The drive shared by the commands of a batch, read-write, and loaded by
+// the first one.
+static struct {
+  int active;
+  int written;      // the GPT of a drive was written since DriveBatchBegin
+  char *path;
+  struct drive drive;
+} batch;
+
+static int IsBatchDrive(const struct drive *drive) {
+  return batch.path && drive->gpt_buf == batch.drive.gpt_buf;
+}
+
+int DriveOpen(const char *drive_path, struct drive *drive, int mode) {
+  if (!batch.active)
+    return DriveLoad(drive_path, drive, mode);
+
+  if (batch.path && strcmp(batch.path, drive_path)) {
+    // Leave the batch drive alone for a mere look at another one
+    if (mode == O_RDONLY)
+      return DriveLoad(drive_path, drive, mode);
+    if (CGPT_OK != DriveBatchFlush())
+      return CGPT_FAILED;
+  }
+
+  if (!batch.path) {
+    if (CGPT_OK != DriveLoad(drive_path, &batch.drive, O_RDWR))
+      return CGPT_FAILED;
+    batch.path = strdup(drive_path);
+    if (!batch.path) {
+      DriveSave(&batch.drive, 0);
+      return CGPT_FAILED;
+    }
+  }
+
+  // The copy points into the buffer of the batch, so the changes made
+  // through it are seen by the next commands.
+  memcpy(drive, &batch.drive, sizeof(*drive));
+  return CGPT_OK;
+}
+
+int DriveClose(struct drive *drive, int update_as_needed) {
+  if (!IsBatchDrive(drive))
+    return DriveSave(drive, update_as_needed);
+
+  // Record what is to be written. A failed command makes the whole
+  // batch fail, which drops its changes.
+  if (update_as_needed) {
+    memcpy(&batch.drive.gpt, &drive->gpt, sizeof(drive->gpt));
+    memcpy(&batch.drive.pmbr, &drive->pmbr, sizeof(drive->pmbr));
+  }
+  // The labels follow the names, whether the changes are kept or not
+  batch.drive.labels = drive->labels;
+  batch.drive.num_labels = drive->num_labels;
+  drive->gpt_buf = 0;
+  drive->labels = 0;
+  return CGPT_OK;
+}
+
+void DriveBatchBegin(void) {
+  batch.active = 1;
+  batch.written = 0;
+}
+
+int DriveBatchActive(void) {
+  return batch.active;
+}
+
+int DriveBatchWritten(void) {
+  return batch.written;
+}
+
+int DriveBatchFlush(void) {
+  int ret = CGPT_OK;
+
+  if (batch.path) {
+    if (batch.drive.gpt.modified)
+      batch.written = 1;
+    ret = DriveSave(&batch.drive, 1);
+    free(batch.path);
+    batch.path = 0;
+  }
+  return ret;
+}
+
+int DriveBatchEnd(int commit) {
+  int ret = CGPT_OK;
+
+  if (commit) {
+    ret = DriveBatchFlush();
+  } else if (batch.path) {
+    DriveSave(&batch.drive, 0);
+    free(batch.path);
+    batch.path = 0;
+  }
+  batch.active = 0;
+  return ret;
+}
+
 
 /* GUID conversion functions. Accepted format:
  *
@@ -368,6 +560,54 @@ void GuidToStr(const Guid *guid, char *str, unsigned int buflen) {
                   guid->u.Uuid.node[4], guid->u.Uuid.node[5]) == GUID_STRLEN-1);
 }
 
+/* Converts the leading ASCII code units of utf16, by whole chunks of 8,
+ * and returns their number. The rest of the string is left to the
+ * state machine of UTF16ToUTF8(), from the first chunk holding a
+ * terminator or a non ASCII code unit. */
+static size_t AsciiFromUTF16(const uint16_t *utf16, size_t maxinput,
+                             uint8_t *utf8, size_t maxoutput) {
+  size_t n = 0;
+#ifdef ASCII_FAST_PATH
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+
+  while (n + 8 <= maxinput && n + 8 <= maxoutput) {
+    __m128i units = _mm_loadu_si128((const __m128i *)(utf16 + n));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(units, zero)) ||
+        _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, non_ascii),
+                                          zero)) != 0xFFFF)
+      break;
+    _mm_storel_epi64((__m128i *)(utf8 + n), _mm_packus_epi16(units, units));
+    n += 8;
+  }
+#endif
+  return n;
+}
+
+/* Same as AsciiFromUTF16() the other way round, by chunks of 16 bytes
+ * of the len bytes of utf8. */
+static size_t AsciiToUTF16(const uint8_t *utf8, size_t len,
+                           uint16_t *utf16, size_t maxoutput) {
+  size_t n = 0;
+#ifdef ASCII_FAST_PATH
+  const __m128i zero = _mm_setzero_si128();
+
+  while (n + 16 <= len && n + 16 <= maxoutput) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(utf8 + n));
+
+    // The terminator is not within len, only the high bit is to be checked
+    if (_mm_movemask_epi8(bytes))
+      break;
+    _mm_storeu_si128((__m128i *)(utf16 + n), _mm_unpacklo_epi8(bytes, zero));
+    _mm_storeu_si128((__m128i *)(utf16 + n + 8),
+                     _mm_unpackhi_epi8(bytes, zero));
+    n += 16;
+  }
+#endif
+  return n;
+}
+
 /* Convert possibly unterminated UTF16 string to UTF8.
  * Caller must prepare enough space for UTF8, which could be up to
  * twice the byte length of UTF16 string plus the terminating '\0'.
@@ -399,7 +639,10 @@ int UTF16ToUTF8(const uint16_t *utf16, unsigned int maxinput,
 
   maxoutput--;                             /* plan for termination now */
 
-  for (s16idx = s8idx = 0;
+  s16idx = s8idx = AsciiFromUTF16(utf16, maxinput, utf8, maxoutput);
+  maxoutput -= s8idx;
+
+  for (;
        s16idx < maxinput && utf16[s16idx] && maxoutput;
        s16idx++) {
     uint16_t codeunit = le16toh(utf16[s16idx]);
@@ -488,7 +731,11 @@ int UTF8ToUTF16(const uint8_t *utf8, uint16_t *utf16, unsigned int maxoutput)
 
   maxoutput--;                             /* plan for termination */
 
-  for (s8idx = s16idx = 0;
+  s8idx = s16idx = AsciiToUTF16(utf8, strlen((const char *)utf8),
+                                utf16, maxoutput);
+  maxoutput -= s16idx;
+
+  for (;
        utf8[s8idx] && maxoutput;
        s8idx++) {
     uint8_t code_unit;
@@ -680,6 +927,31 @@ GptEntry *GetEntry(GptData *gpt, int secondary, uint32_t entry_index) {
   return (GptEntry*)(&entries[stride * entry_index]);
 }
 
+const char *DriveLabel(struct drive *drive, uint32_t entry_index) {
+  GptEntry *entry = GetEntry(&drive->gpt, ANY_VALID, entry_index);
+  struct drive_label *label;
+
+  if (entry_index >= drive->num_labels) {
+    uint32_t count = GetNumberOfEntries(&drive->gpt);
+
+    label = realloc(drive->labels, count * sizeof(*label));
+    require(label);
+    memset(label + drive->num_labels, 0,
+           (count - drive->num_labels) * sizeof(*label));
+    drive->labels = label;
+    drive->num_labels = count;
+  }
+
+  label = &drive->labels[entry_index];
+  if (!label->state || memcmp(label->name, entry->name, sizeof(label->name))) {
+    memcpy(label->name, entry->name, sizeof(label->name));
+    label->state = CGPT_OK == UTF16ToUTF8(entry->name,
+        sizeof(entry->name) / sizeof(entry->name[0]),
+        (uint8_t *)label->utf8, sizeof(label->utf8)) ? 1 : -1;
+  }
+  return label->state > 0 ? label->utf8 : NULL;
+}
+
 void SetPriority(GptData *gpt, int secondary, uint32_t entry_index,
                  unsigned int priority) {
   GptEntry *entry;
@@ -2,9 +2,11 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #define _LARGEFILE64_SOURCE
+#include <fcntl.h>
 
 #include "cgpt.h"
 #include "cgpt_params.h"
@@ -15,32 +17,182 @@
 #define BUFSIZE 1024
 // FIXME: currently we only support 512-byte sectors.
 #define LBA_SIZE 512
+#define READ_ALIGN 4096
+
+// The entries of a drive, kept from a search to the next one. The index
+// is valid as long as both GPT headers of the drive are unchanged, as
+// they hold the CRC of the entries.
+typedef struct {
+  GptEntry entry;
+  int partnum;
+  int label_ok;               // label could be converted from UTF16
+  char label[GPT_PARTNAME_LEN];
+} FindEntry;
+
+typedef struct {
+  char *path;
+  int has_gpt;
+  uint64_t drive_sectors;
+  uint32_t sector_bytes;
+  uint8_t headers[2 * LBA_SIZE];   // primary then secondary header
+  int count;
+  FindEntry *entries;
+} FindDrive;
+
+static FindDrive *find_drives;
+static int find_drive_count;
+
+// Reads both GPT header sectors of fd into headers.
+static int ReadHeaders(int fd, uint64_t drive_sectors, uint32_t sector_bytes,
+                       uint8_t *headers) {
+  if (sector_bytes != LBA_SIZE)
+    return 0;
+  if (pread64(fd, headers, LBA_SIZE, (off64_t)GPT_PMBR_SECTOR * LBA_SIZE) !=
+      LBA_SIZE)
+    return 0;
+  if (pread64(fd, headers + LBA_SIZE, LBA_SIZE,
+              (off64_t)(drive_sectors - GPT_HEADER_SECTOR) * LBA_SIZE) !=
+      LBA_SIZE)
+    return 0;
+  return 1;
+}
+
+static int IndexStillValid(FindDrive *fdrive) {
+  uint8_t headers[2 * LBA_SIZE];
+  int fd, valid;
+
+  fd = open(fdrive->path, O_RDONLY | O_LARGEFILE | O_NOFOLLOW);
+  if (fd == -1)
+    return 0;
+  valid = ReadHeaders(fd, fdrive->drive_sectors, fdrive->sector_bytes,
+                      headers) &&
+          !memcmp(headers, fdrive->headers, sizeof(headers));
+  close(fd);
+  return valid;
+}
+
+static void IndexFree(FindDrive *fdrive) {
+  free(fdrive->entries);
+  fdrive->entries = 0;
+  fdrive->count = 0;
+  fdrive->has_gpt = 0;
+}
+
+static int IndexLoad(FindDrive *fdrive) {
+  struct drive drive;
+  unsigned int i, n;
+  GptEntry *entry;
+
+  IndexFree(fdrive);
+  if (CGPT_OK != DriveOpen(fdrive->path, &drive, O_RDONLY))
+    return 1;
+
+  if (GPT_SUCCESS != GptSanityCheck(&drive.gpt)) {
+    (void) DriveClose(&drive, 0);
+    return 1;
+  }
+
+  n = GetNumberOfEntries(&drive.gpt);
+  fdrive->entries = calloc(n ? n : 1, sizeof(FindEntry));
+  if (!fdrive->entries) {
+    (void) DriveClose(&drive, 0);
+    return 0;
+  }
+  for (i = 0; i < n; ++i) {
+    FindEntry *fentry = &fdrive->entries[fdrive->count];
+    const char *label;
+
+    entry = GetEntry(&drive.gpt, ANY_VALID, i);
+    if (IsZero(&entry->type))
+      continue;
+    memcpy(&fentry->entry, entry, sizeof(*entry));
+    fentry->partnum = i + 1;
+    label = DriveLabel(&drive, i);
+    fentry->label_ok = label != NULL;
+    if (label)
+      memcpy(fentry->label, label, sizeof(fentry->label));
+    fdrive->count++;
+  }
+
+  fdrive->drive_sectors = drive.gpt.drive_sectors;
+  fdrive->sector_bytes = drive.gpt.sector_bytes;
+  // The secondary GPT may not have been loaded, read both headers as
+  // IndexStillValid() does
+  fdrive->has_gpt = ReadHeaders(drive.fd, fdrive->drive_sectors,
+                                fdrive->sector_bytes, fdrive->headers);
+  (void) DriveClose(&drive, 0);
+  if (!fdrive->has_gpt)
+    IndexFree(fdrive);
+  return fdrive->has_gpt;
+}
+
+// Returns the index of the drive at path, loading it when it is not known
+// yet or when its GPT changed, or 0 on error.
+static FindDrive *GetIndex(const char *path) {
+  FindDrive *drives;
+  FindDrive *fdrive = 0;
+  int i;
+
+  for (i = 0; i < find_drive_count; i++)
+    if (!strcmp(find_drives[i].path, path))
+      fdrive = &find_drives[i];
+
+  if (!fdrive) {
+    drives = realloc(find_drives, (find_drive_count + 1) * sizeof(FindDrive));
+    if (!drives)
+      return 0;
+    find_drives = drives;
+    fdrive = &find_drives[find_drive_count];
+    memset(fdrive, 0, sizeof(*fdrive));
+    fdrive->path = strdup(path);
+    if (!fdrive->path)
+      return 0;
+    find_drive_count++;
+  } else if (fdrive->has_gpt && IndexStillValid(fdrive)) {
+    return fdrive;
+  }
 
+  // A drive without a GPT is loaded again on each search
+  if (!IndexLoad(fdrive))
+    return 0;
+  return fdrive;
+}
 
 // fill comparebuf with the data to be examined, returning true on success.
+// The data is read in a single read of the aligned blocks holding it.
 static int FillBuffer(CgptFindParams *params, int fd, uint64_t pos,
                        uint64_t count) {
-  uint8_t *bufptr = params->comparebuf;
+  uint64_t start = pos & ~((uint64_t)READ_ALIGN - 1);
+  uint64_t end = (pos + count + READ_ALIGN - 1) & ~((uint64_t)READ_ALIGN - 1);
+  uint8_t *buf;
+  uint64_t done = 0;
+  int ret = 0;
 
-  if (-1 == lseek64(fd, pos, SEEK_SET))
+  if (posix_memalign((void **)&buf, READ_ALIGN, end - start))
     return 0;
 
-  // keep reading until done or error
-  while (count) {
-    ssize_t bytes_read = read(fd, bufptr, count);
-    // negative means error, 0 means (unexpected) EOF
-    if (bytes_read <= 0)
-      return 0;
-    count -= bytes_read;
-    bufptr += bytes_read;
+  while (done < end - start) {
+    ssize_t bytes_read = pread64(fd, buf + done, end - start - done,
+                                 start + done);
+    if (bytes_read < 0)
+      goto out;
+    // The partition may end the drive before the aligned end
+    if (bytes_read == 0)
+      break;
+    done += bytes_read;
   }
-
-  return 1;
+  if (done < pos - start + count)
+    goto out;
+
+  memcpy(params->comparebuf, buf + (pos - start), count);
+  ret = 1;
+out:
+  free(buf);
+  return ret;
 }
 
 // check partition data content. return true for match, 0 for no match or error
-static int match_content(CgptFindParams *params, struct drive *drive,
-                             GptEntry *entry) {
+static int match_content(CgptFindParams *params, int fd, GptEntry *entry) {
   uint64_t part_size;
 
   if (!params->matchlen)
@@ -53,8 +205,9 @@ static int match_content(CgptFindParams *params, struct drive *drive,
   }
 
   // Read the partition data.
-  if (!FillBuffer(params,
-                  drive->fd,
+  if (fd == -1 ||
+      !FillBuffer(params,
+                  fd,
                   (LBA_SIZE * entry->starting_lba) + params->matchoffset,
                   params->matchlen)) {
     Error("unable to read partition data\n");
@@ -84,16 +237,13 @@ static void showmatch(CgptFindParams *params, char *filename,
     EntryDetails(entry, partnum - 1, params->numeric);
 }
 
-// This returns true if a GPT partition matches the search criteria. If a match
-// isn't found (or if the file doesn't contain a GPT), it returns false. The
-// filename and partition number that matched is left in a global, since we
-// could have multiple hits.
-static int do_search(CgptFindParams *params, char *fileName) {
+// Searches the GPT of the drive as DriveOpen gives it, without index.
+static int do_search_drive(CgptFindParams *params, char *fileName) {
   int retval = 0;
   unsigned int i;
   struct drive drive;
   GptEntry *entry;
-  char partlabel[GPT_PARTNAME_LEN];
+  const char *partlabel;
 
   if (CGPT_OK != DriveOpen(fileName, &drive, O_RDONLY))
     return 0;
@@ -114,16 +264,15 @@ static int do_search(CgptFindParams *params, char *fileName) {
         || (params->set_type && GuidEqual(&params->type_guid, &entry->type))) {
       found = 1;
     } else if (params->set_label) {
-      if (CGPT_OK != UTF16ToUTF8(entry->name,
-                                 sizeof(entry->name) / sizeof(entry->name[0]),
-                                 (uint8_t *)partlabel, sizeof(partlabel))) {
+      partlabel = DriveLabel(&drive, i);
+      if (!partlabel) {
         Error("The label cannot be converted from UTF16, so abort.\n");
         return 0;
       }
-      if (!strncmp(params->label, partlabel, sizeof(partlabel)))
+      if (!strncmp(params->label, partlabel, GPT_PARTNAME_LEN))
         found = 1;
     }
-    if (found && match_content(params, &drive, entry)) {
+    if (found && match_content(params, drive.fd, entry)) {
       params->hits++;
       retval++;
       showmatch(params, fileName, i+1, entry);
@@ -138,6 +287,65 @@ static int do_search(CgptFindParams *params, char *fileName) {
 }
 
 
+// This returns true if a GPT partition matches the search criteria. If a match
+// isn't found (or if the file doesn't contain a GPT), it returns false. The
+// filename and partition number that matched is left in a global, since we
+// could have multiple hits.
+static int do_search(CgptFindParams *params, char *fileName) {
+  int retval = 0;
+  int i;
+  int fd = -1;
+  FindDrive *fdrive;
+  FindEntry *fentry;
+
+  // While a batch is open, the GPT in memory is not the one on the drive
+  if (DriveBatchActive())
+    return do_search_drive(params, fileName);
+
+  // Without an index, e.g. for sectors of another size, search the drive
+  fdrive = GetIndex(fileName);
+  if (!fdrive)
+    return do_search_drive(params, fileName);
+  if (!fdrive->has_gpt)
+    return 0;
+
+  for (i = 0; i < fdrive->count; ++i) {
+    fentry = &fdrive->entries[i];
+
+    int found = 0;
+    if ((params->set_unique &&
+         GuidEqual(&params->unique_guid, &fentry->entry.unique))
+        || (params->set_type &&
+            GuidEqual(&params->type_guid, &fentry->entry.type))) {
+      found = 1;
+    } else if (params->set_label) {
+      if (!fentry->label_ok) {
+        Error("The label cannot be converted from UTF16, so abort.\n");
+        retval = 0;
+        break;
+      }
+      if (!strncmp(params->label, fentry->label, sizeof(fentry->label)))
+        found = 1;
+    }
+    if (!found)
+      continue;
+    if (params->matchlen && fd == -1)
+      fd = open(fileName, O_RDONLY | O_LARGEFILE | O_NOFOLLOW);
+    if (match_content(params, fd, &fentry->entry)) {
+      params->hits++;
+      retval++;
+      showmatch(params, fileName, fentry->partnum, &fentry->entry);
+      if (!params->match_partnum)
+        params->match_partnum = fentry->partnum;
+    }
+  }
+
+  if (fd != -1)
+    close(fd);
+  return retval;
+}
+
+
 #define PROC_PARTITIONS "/proc/partitions"
 #define DEV_DIR "/dev"
 #define SYS_BLOCK_DIR "/sys/block"
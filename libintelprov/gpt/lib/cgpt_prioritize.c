@@ -10,100 +10,118 @@
 #include "cgpt_params.h"
 
 //////////////////////////////////////////////////////////////////////////////
-// We need a sorted list of priority groups, where each element in the list
-// contains an unordered list of GPT partition numbers.
+// Partitions of the same priority form a group, and the groups keep their
+// order. A group is known by its priority, plus one "higher" for the
+// partition being raised, so there is at most MAX_GROUPS of them and the
+// new priority of each is found with a table instead of by sorting.
 
 #define MAX_GROUPS 17                   // 0-15, plus one "higher"
+#define RAISED_GROUP (MAX_GROUPS - 1)
 
+// A kernel partition, as seen by the rebalancer
 typedef struct {
-  unsigned int priority;                         // priority of this group
-  unsigned int num_parts;                        // number of partitions in this group
-  uint32_t *part;                       // array of partitions in this group
-} group_t;
-
-typedef struct {
-  unsigned int max_parts;                       // max number of partitions in any group
-  unsigned int num_groups;                      // number of non-empty groups
-  group_t group[MAX_GROUPS];           // array of groups
-} group_list_t;
-
-
-static group_list_t *NewGroupList(unsigned int max_p) {
-  unsigned int i;
-  group_list_t *gl = (group_list_t *)malloc(sizeof(group_list_t));
-  require(gl);
-  gl->max_parts = max_p;
-  gl->num_groups = 0;
-  // reserve space for the maximum number of partitions in every group
-  for (i=0; i<MAX_GROUPS; i++) {
-    gl->group[i].priority = -1;
-    gl->group[i].num_parts = 0;
-    gl->group[i].part = (uint32_t *)malloc(sizeof(uint32_t) * max_p);
-    require(gl->group[i].part);
-  }
+  GptEntry *entry;
+  uint8_t group;
+} kernel_t;
 
-  return gl;
+static unsigned int EntryPriority(const GptEntry *entry) {
+  return (entry->attrs.fields.gpt_att & CGPT_ATTRIBUTE_PRIORITY_MASK) >>
+      CGPT_ATTRIBUTE_PRIORITY_OFFSET;
 }
 
-static void FreeGroups(group_list_t *gl) {
-  unsigned int i;
-  for (i=0; i<MAX_GROUPS; i++)
-    free(gl->group[i].part);
-  free(gl);
-}
+int GptPrioritize(GptData *gpt, uint32_t set_partition, int set_friends,
+                  int max_priority, int *orig_priority) {
+  GptEntry *entries;
+  uint32_t max_part;
+  kernel_t *kernels;
+  unsigned int num_kernels = 0;
+  int present[MAX_GROUPS] = { 0 };
+  unsigned int new_priority[MAX_GROUPS];
+  unsigned int num_groups = 0;
+  unsigned int group, priority, i;
+  int orig = -1;
+
+  // The primary copy is the one RepairEntries() then copies over. A
+  // valid header has entries of the size of GptEntry, so they are an
+  // array of them.
+  max_part = GetNumberOfEntries(gpt);
+  if (!max_part)
+    return CGPT_FAILED;
+  entries = GetEntry(gpt, PRIMARY, 0);
 
-static void AddToGroup(group_list_t *gl, unsigned int priority, unsigned int partition) {
-  unsigned int i;
-  // See if I've already got a group with this priority
-  for (i=0; i<gl->num_groups; i++)
-    if (gl->group[i].priority == priority)
-      break;
-  if (i == gl->num_groups) {
-    // no, add a group
-    require(i < MAX_GROUPS);
-    gl->num_groups++;
-    gl->group[i].priority = priority;
-  }
-  // add the partition to it
-  unsigned int j = gl->group[i].num_parts;
-  gl->group[i].part[j] = partition;
-  gl->group[i].num_parts++;
-}
+  if (set_partition > max_part)
+    set_partition = 0;
+
+  kernels = malloc(sizeof(kernel_t) * max_part);
+  if (!kernels)
+    return CGPT_FAILED;
 
-static void ChangeGroup(group_list_t *gl, unsigned int old_priority, unsigned int new_priority) {
-  unsigned int i;
-  for (i=0; i<gl->num_groups; i++)
-    if (gl->group[i].priority == old_priority) {
-      gl->group[i].priority = new_priority;
-      break;
+  // Find the kernels and their groups in a single pass over the entries
+  for (i = 0; i < max_part; i++) {
+    GptEntry *entry = &entries[i];
+
+    if (!GuidEqual(&entry->type, &guid_chromeos_kernel))
+      continue;
+    kernels[num_kernels].entry = entry;
+    kernels[num_kernels].group = EntryPriority(entry);
+    if (i + 1 == set_partition) {
+      orig = EntryPriority(entry);
+      kernels[num_kernels].group = RAISED_GROUP;
     }
-}
+    num_kernels++;
+  }
 
-static void SortGroups(group_list_t *gl) {
-  unsigned int i, j;
-  group_t tmp;
+  if (orig_priority && orig >= 0)
+    *orig_priority = orig;
+
+  // With friends, the whole original group of the partition is raised
+  for (i = 0; i < num_kernels; i++) {
+    if (set_friends && orig >= 0 && kernels[i].group == orig)
+      kernels[i].group = RAISED_GROUP;
+    present[kernels[i].group] = 1;
+  }
 
-  // straight insertion sort is fast enough
-  for (i=1; i<gl->num_groups; i++) {
-    tmp = gl->group[i];
-    for (j=i; j && (gl->group[j-1].priority < tmp.priority); j--)
-      gl->group[j] = gl->group[j-1];
-    gl->group[j] = tmp;
+  // We'll never lower anything to zero, so the priority zero group is
+  // left as it is.
+  for (group = 1; group < MAX_GROUPS; group++)
+    num_groups += present[group];
+
+  // Where do we start?
+  if (max_priority)
+    priority = max_priority;
+  else
+    priority = num_groups > 15 ? 15 : num_groups;
+
+  // Figure out what the new values should be, from the highest group
+  new_priority[0] = 0;
+  for (group = MAX_GROUPS - 1; group > 0; group--) {
+    if (!present[group])
+      continue;
+    new_priority[group] = priority;
+    if (priority > 1)
+      priority--;
   }
+
+  // Now apply the ranking to the entries, in place
+  for (i = 0; i < num_kernels; i++) {
+    GptEntry *entry = kernels[i].entry;
+
+    entry->attrs.fields.gpt_att &= ~CGPT_ATTRIBUTE_PRIORITY_MASK;
+    entry->attrs.fields.gpt_att |=
+        new_priority[kernels[i].group] << CGPT_ATTRIBUTE_PRIORITY_OFFSET;
+  }
+
+  free(kernels);
+  return CGPT_OK;
 }
 
 int cgpt_prioritize(CgptPrioritizeParams *params) {
   struct drive drive;
 
-  int priority;
-
   int gpt_retval;
   GptEntry *entry;
   uint32_t index;
   uint32_t max_part;
-  int num_kernels;
-  unsigned int i,j;
-  group_list_t *groups;
 
   if (params == NULL)
     return CGPT_FAILED;
@@ -134,71 +152,11 @@ int cgpt_prioritize(CgptPrioritizeParams *params) {
     }
   }
 
-  // How many kernel partitions do I have?
-  num_kernels = 0;
-  for (i = 0; i < max_part; i++) {
-    entry = GetEntry(&drive.gpt, PRIMARY, i);
-    if (GuidEqual(&entry->type, &guid_chromeos_kernel))
-      num_kernels++;
-  }
-
-  if (num_kernels) {
-    // Determine the current priority groups
-    groups = NewGroupList(num_kernels);
-    for (i = 0; i < max_part; i++) {
-      entry = GetEntry(&drive.gpt, PRIMARY, i);
-      if (!GuidEqual(&entry->type, &guid_chromeos_kernel))
-        continue;
-
-      priority = GetPriority(&drive.gpt, PRIMARY, i);
-
-      // Is this partition special?
-      if (params->set_partition && (i+1 == params->set_partition)) {
-        params->orig_priority = priority;  // remember the original priority
-        if (params->set_friends)
-          AddToGroup(groups, priority, i); // we'll move them all later
-        else
-          AddToGroup(groups, 99, i);       // move only this one
-      } else {
-        AddToGroup(groups, priority, i);   // just remember
-      }
-    }
-
-    // If we're including friends, then change the original group priority
-    if (params->set_partition && params->set_friends) {
-      ChangeGroup(groups, params->orig_priority, 99);
-    }
-
-    // Sorting gives the new order. Now we just need to reassign the
-    // priorities.
-    SortGroups(groups);
-
-    // We'll never lower anything to zero, so if the last group is priority zero
-    // we can ignore it.
-    i = groups->num_groups;
-    if (groups->group[i-1].priority == 0)
-      groups->num_groups--;
-
-    // Where do we start?
-    if (params->max_priority)
-      priority = params->max_priority;
-    else
-      priority = groups->num_groups > 15 ? 15 : groups->num_groups;
-
-    // Figure out what the new values should be
-    for (i=0; i<groups->num_groups; i++) {
-      groups->group[i].priority = priority;
-      if (priority > 1)
-        priority--;
-    }
-
-    // Now apply the ranking to the GPT
-    for (i=0; i<groups->num_groups; i++)
-      for (j=0; j<groups->group[i].num_parts; j++)
-        SetPriority(&drive.gpt, PRIMARY,
-                    groups->group[i].part[j], groups->group[i].priority);
-
-    FreeGroups(groups);
+  if (CGPT_OK != GptPrioritize(&drive.gpt, params->set_partition,
+                               params->set_friends, params->max_priority,
+                               &params->orig_priority)) {
+    Error("Unable to prioritize the kernel partitions\n");
+    goto bad;
   }
 
   // Write it all out
@@ -6,6 +6,7 @@
 
 #define __STDC_FORMAT_MACROS
 
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -203,6 +204,145 @@ done:
   return retval;
 }
 
+// The JSON dump is built in memory, to be written at once
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+} DumpBuf;
+
+static void DumpPrintf(DumpBuf *buf, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+    va_end(ap);
+    require(n >= 0);
+    if (buf->len + n < buf->size)
+      break;
+    buf->size = (buf->len + n + 1) * 2;
+    buf->data = realloc(buf->data, buf->size);
+    require(buf->data);
+  }
+  buf->len += n;
+}
+
+static void DumpString(DumpBuf *buf, const char *str) {
+  DumpPrintf(buf, "\"");
+  for (; *str; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\')
+      DumpPrintf(buf, "\\%c", c);
+    else if (c < 0x20)
+      DumpPrintf(buf, "\\u%04x", c);
+    else
+      DumpPrintf(buf, "%c", c);
+  }
+  DumpPrintf(buf, "\"");
+}
+
+static void DumpEntry(DumpBuf *buf, struct drive *drive, uint32_t index) {
+  GptEntry *entry = GetEntry(&drive->gpt, ANY_VALID, index);
+  const char *label = DriveLabel(drive, index);
+  char guid[GUID_STRLEN];
+
+  DumpPrintf(buf, "{\"number\":%u,\"start\":%" PRIu64 ",\"size\":%" PRIu64,
+             index + 1, entry->starting_lba,
+             entry->ending_lba - entry->starting_lba + 1);
+  GuidToStr(&entry->type, guid, sizeof(guid));
+  DumpPrintf(buf, ",\"type\":\"%s\"", guid);
+  if (CGPT_OK == ResolveType(&entry->type, guid)) {
+    DumpPrintf(buf, ",\"type_name\":");
+    DumpString(buf, guid);
+  }
+  GuidToStr(&entry->unique, guid, sizeof(guid));
+  DumpPrintf(buf, ",\"unique\":\"%s\",\"label\":", guid);
+  DumpString(buf, label ? label : "");
+  DumpPrintf(buf, ",\"attributes\":%u,\"priority\":%d,\"tries\":%d,"
+             "\"successful\":%d}", entry->attrs.fields.gpt_att,
+             GetPriority(&drive->gpt, ANY_VALID, index),
+             GetTries(&drive->gpt, ANY_VALID, index),
+             GetSuccessful(&drive->gpt, ANY_VALID, index));
+}
+
+static void DumpTable(DumpBuf *buf, struct drive *drive,
+                      CgptShowParams *params) {
+  uint32_t i;
+  int first = 1;
+
+  DumpPrintf(buf, "{\"sector_bytes\":%u,\"drive_sectors\":%" PRIu64 ","
+             "\"primary\":{\"header\":%s,\"entries\":%s},"
+             "\"secondary\":{\"header\":%s,\"entries\":%s},"
+             "\"partitions\":[",
+             drive->gpt.sector_bytes, drive->gpt.drive_sectors,
+             drive->gpt.valid_headers & MASK_PRIMARY ? "true" : "false",
+             drive->gpt.valid_entries & MASK_PRIMARY ? "true" : "false",
+             drive->gpt.valid_headers & MASK_SECONDARY ? "true" : "false",
+             drive->gpt.valid_entries & MASK_SECONDARY ? "true" : "false");
+
+  params->num_partitions = 0;
+  for (i = 0; i < GetNumberOfEntries(&drive->gpt); ++i) {
+    GptEntry *entry = GetEntry(&drive->gpt, ANY_VALID, i);
+
+    if (IsZero(&entry->type))
+      continue;
+    params->num_partitions++;
+    if (params->partition && params->partition != i + 1)
+      continue;
+    if (!first)
+      DumpPrintf(buf, ",");
+    first = 0;
+    DumpEntry(buf, drive, i);
+  }
+  DumpPrintf(buf, "]}\n");
+}
+
+// Serializes the table, or only the partition of params->partition, as
+// JSON into params->dump, and counts the partitions as
+// cgpt_get_num_non_empty_partitions() does.
+int cgpt_dump(CgptShowParams *params) {
+  struct drive drive;
+  int gpt_retval;
+  DumpBuf buf = { 0, 0, 0 };
+
+  if (params == NULL)
+    return CGPT_FAILED;
+
+  params->dump = NULL;
+  params->dump_len = 0;
+
+  if (CGPT_OK != DriveOpen(params->drive_name, &drive, O_RDONLY))
+    return CGPT_FAILED;
+
+  if (CGPT_OK != DriveLoadSecondary(&drive)) {
+    Error("Unable to read the secondary GPT\n");
+    DriveClose(&drive, 0);
+    return CGPT_FAILED;
+  }
+
+  if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
+    Error("GptSanityCheck() returned %d: %s\n",
+          gpt_retval, GptError(gpt_retval));
+    DriveClose(&drive, 0);
+    return CGPT_FAILED;
+  }
+
+  if (params->partition > GetNumberOfEntries(&drive.gpt)) {
+    Error("invalid partition number: %d\n", params->partition);
+    DriveClose(&drive, 0);
+    return CGPT_FAILED;
+  }
+
+  DumpTable(&buf, &drive, params);
+  DriveClose(&drive, 0);
+
+  params->dump = buf.data;
+  params->dump_len = buf.len;
+  return CGPT_OK;
+}
+
 int cgpt_show(CgptShowParams *params) {
   struct drive drive;
   int gpt_retval;
@@ -210,9 +350,26 @@ int cgpt_show(CgptShowParams *params) {
   if (params == NULL)
     return CGPT_FAILED;
 
+  if (params->json) {
+    if (CGPT_OK != cgpt_dump(params))
+      return CGPT_FAILED;
+    gpt_retval = fwrite(params->dump, 1, params->dump_len, stdout) ==
+        params->dump_len && !fflush(stdout);
+    free(params->dump);
+    params->dump = NULL;
+    return gpt_retval ? CGPT_OK : CGPT_FAILED;
+  }
+
   if (CGPT_OK != DriveOpen(params->drive_name, &drive, O_RDONLY))
     return CGPT_FAILED;
 
+  // The whole table shows the state of both copies
+  if (!params->partition && CGPT_OK != DriveLoadSecondary(&drive)) {
+    Error("Unable to read the secondary GPT\n");
+    DriveClose(&drive, 0);
+    return CGPT_FAILED;
+  }
+
   if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive.gpt))) {
     Error("GptSanityCheck() returned %d: %s\n",
           gpt_retval, GptError(gpt_retval));
@@ -246,11 +403,11 @@ int cgpt_show(CgptShowParams *params) {
         GuidToStr(&entry->unique, buf, sizeof(buf));
         printf("%s\n", buf);
         break;
-      case 'l':
-        UTF16ToUTF8(entry->name, sizeof(entry->name) / sizeof(entry->name[0]),
-                    (uint8_t *)buf, sizeof(buf));
-        printf("%s\n", buf);
+      case 'l': {
+        const char *label = DriveLabel(&drive, index);
+        printf("%s\n", label ? label : "");
         break;
+      }
       case 'S':
         printf("%d\n", GetSuccessful(&drive.gpt, ANY_VALID, index));
         break;
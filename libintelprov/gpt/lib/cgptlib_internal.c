@@ -116,11 +116,57 @@ int IsKernelEntry(const GptEntry* e) {
 }
 
 
+/* LBA range of a used entry, for the overlap check. */
+typedef struct {
+  uint64_t starting_lba;
+  uint64_t ending_lba;
+} EntryRange;
+
+/* Moves ranges[root] down the heap of the first end ranges. */
+static void SiftDown(EntryRange* ranges, uint32_t root, uint32_t end) {
+  EntryRange tmp;
+  uint32_t child;
+
+  for (; (child = 2 * root + 1) < end; root = child) {
+    if (child + 1 < end &&
+        ranges[child].starting_lba < ranges[child + 1].starting_lba)
+      child++;
+    if (ranges[root].starting_lba >= ranges[child].starting_lba)
+      return;
+    tmp = ranges[root];
+    ranges[root] = ranges[child];
+    ranges[child] = tmp;
+  }
+}
+
+/* Sorts ranges by starting LBA, in place (heapsort). */
+static void SortRanges(EntryRange* ranges, uint32_t count) {
+  EntryRange tmp;
+  uint32_t i;
+
+  for (i = count / 2; i-- > 0; )
+    SiftDown(ranges, i, count);
+  for (i = count; i-- > 1; ) {
+    tmp = ranges[0];
+    ranges[0] = ranges[i];
+    ranges[i] = tmp;
+    SiftDown(ranges, 0, i);
+  }
+}
+
+/* Slots of the unique GUID set, a power of two above twice
+ * MAX_NUMBER_OF_ENTRIES so that it never fills up. */
+#define GUID_SET_SIZE 1024
+
 int CheckEntries(GptEntry* entries, GptHeader* h) {
 
   GptEntry* entry;
   uint32_t crc32;
   uint32_t i;
+  EntryRange ranges[MAX_NUMBER_OF_ENTRIES];
+  uint16_t guid_set[GUID_SET_SIZE];  /* entry index + 1, 0 when free */
+  uint32_t count = 0;
+  uint64_t last_end;
 
   /* Check CRC before examining entries. */
   crc32 = Crc32((const uint8_t *)entries,
@@ -128,10 +174,11 @@ int CheckEntries(GptEntry* entries, GptHeader* h) {
   if (crc32 != h->entries_crc32)
     return GPT_ERROR_CRC_CORRUPTED;
 
+  Memset(guid_set, 0, sizeof(guid_set));
+
   /* Check all entries. */
   for (i = 0, entry = entries; i < h->number_of_entries; i++, entry++) {
-    GptEntry* e2;
-    uint32_t i2;
+    uint32_t slot;
 
     if (IsUnusedEntry(entry))
       continue;
@@ -142,22 +189,31 @@ int CheckEntries(GptEntry* entries, GptHeader* h) {
         (entry->ending_lba < entry->starting_lba))
       return GPT_ERROR_OUT_OF_REGION;
 
-    /* Entry must not overlap other entries. */
-    for (i2 = 0, e2 = entries; i2 < h->number_of_entries; i2++, e2++) {
-      if (i2 == i || IsUnusedEntry(e2))
-        continue;
-
-      if ((entry->starting_lba >= e2->starting_lba) &&
-          (entry->starting_lba <= e2->ending_lba))
-        return GPT_ERROR_START_LBA_OVERLAP;
-      if ((entry->ending_lba >= e2->starting_lba) &&
-          (entry->ending_lba <= e2->ending_lba))
-        return GPT_ERROR_END_LBA_OVERLAP;
-
-      /* UniqueGuid field must be unique. */
-      if (0 == Memcmp(&entry->unique, &e2->unique, sizeof(Guid)))
+    /* UniqueGuid field must be unique. Its time_low field is random
+     * enough to hash it, collisions are probed linearly. */
+    for (slot = entry->unique.u.Uuid.time_low & (GUID_SET_SIZE - 1);
+         guid_set[slot];
+         slot = (slot + 1) & (GUID_SET_SIZE - 1)) {
+      if (0 == Memcmp(&entry->unique, &entries[guid_set[slot] - 1].unique,
+                      sizeof(Guid)))
         return GPT_ERROR_DUP_GUID;
     }
+    guid_set[slot] = i + 1;
+
+    ranges[count].starting_lba = entry->starting_lba;
+    ranges[count].ending_lba = entry->ending_lba;
+    count++;
+  }
+
+  /* Entry must not overlap other entries: once sorted by starting LBA,
+   * an entry overlaps a previous one when it starts before the end of
+   * any of them. */
+  SortRanges(ranges, count);
+  for (i = 1, last_end = count ? ranges[0].ending_lba : 0; i < count; i++) {
+    if (ranges[i].starting_lba <= last_end)
+      return GPT_ERROR_START_LBA_OVERLAP;
+    if (ranges[i].ending_lba > last_end)
+      last_end = ranges[i].ending_lba;
   }
 
   /* Success */
@@ -213,6 +269,17 @@ int GptSanityCheck(GptData *gpt) {
   if (retval != GPT_SUCCESS)
     return retval;
 
+  /* Without the secondary copy, the primary one must be valid on its own. */
+  if (gpt->secondary_deferred) {
+    if (0 != CheckHeader(header1, 0, gpt->drive_sectors))
+      return GPT_ERROR_INVALID_HEADERS;
+    if (0 != CheckEntries(entries1, header1))
+      return GPT_ERROR_INVALID_ENTRIES;
+    gpt->valid_headers = MASK_PRIMARY;
+    gpt->valid_entries = MASK_PRIMARY;
+    return GPT_SUCCESS;
+  }
+
   /* Check both headers; we need at least one valid header. */
   if (0 == CheckHeader(header1, 0, gpt->drive_sectors)) {
     gpt->valid_headers |= MASK_PRIMARY;
@@ -4,15 +4,174 @@
 
 #include "cgpt.h"
 
+#include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <stdlib.h>
 #include <string.h>
+#include <linux/blkpg.h>
 #include <linux/fs.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "cgpt_params.h"
+#include "cgptlib_internal.h"
 
 #ifndef STORAGE_BASE_PATH
 #define STORAGE_BASE_PATH "/dev/block/mmcblk0"
 #endif
 
+#define MAX_EXTRA_PARTITIONS 16
+
+// A partition as the kernel has it, in bytes
+struct kernel_partition {
+  long long start;
+  long long length;
+};
+
+static long long ReadSysfsNumber(const char *dir, const char *entry,
+                                 const char *name) {
+  char path[256];
+  char value[32];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s/%s/%s", dir, entry, name);
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  if (!fgets(value, sizeof(value), fp))
+    value[0] = '\0';
+  fclose(fp);
+  return value[0] ? strtoll(value, NULL, 10) : -1;
+}
+
+// Fills parts[] with the partitions of the disk of fd from its sysfs
+// directory, parts[pno - 1] being all 0 when there is no partition pno.
+// The numbers of the partitions beyond count, which are only to be
+// deleted, go to extra[]. Returns the number of partitions, or -1.
+static int GetKernelPartitions(int fd, struct kernel_partition *parts,
+                               uint32_t count, int *extra, int *extra_count) {
+  struct stat sb;
+  struct dirent *entry;
+  char dir[64];
+  DIR *d;
+  int found = 0;
+
+  if (fstat(fd, &sb) == -1 || !S_ISBLK(sb.st_mode)) {
+    Error("not a block device\n");
+    return -1;
+  }
+  snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u",
+           major(sb.st_rdev), minor(sb.st_rdev));
+  d = opendir(dir);
+  if (!d) {
+    Error("Can't open %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  memset(parts, 0, count * sizeof(*parts));
+  *extra_count = 0;
+  while ((entry = readdir(d)) != NULL) {
+    long long pno, start, size;
+
+    if (entry->d_name[0] == '.')
+      continue;
+    pno = ReadSysfsNumber(dir, entry->d_name, "partition");
+    if (pno <= 0)
+      continue;
+    start = ReadSysfsNumber(dir, entry->d_name, "start");
+    size = ReadSysfsNumber(dir, entry->d_name, "size");
+    if (start < 0 || size < 0)
+      continue;
+    found++;
+    if (pno <= count) {
+      // sysfs counts in 512 bytes sectors, whatever the sector size
+      parts[pno - 1].start = start * 512;
+      parts[pno - 1].length = size * 512;
+    } else if (*extra_count < MAX_EXTRA_PARTITIONS) {
+      extra[(*extra_count)++] = (int)pno;
+    }
+  }
+  closedir(d);
+  return found;
+}
+
+static int UpdatePartition(int fd, int op, int pno,
+                           long long start, long long length) {
+  struct blkpg_partition part;
+  struct blkpg_ioctl_arg arg;
+
+  memset(&part, 0, sizeof(part));
+  part.pno = pno;
+  part.start = start;
+  part.length = length;
+  memset(&arg, 0, sizeof(arg));
+  arg.op = op;
+  arg.datalen = sizeof(part);
+  arg.data = &part;
+  if (ioctl(fd, BLKPG, &arg) == -1) {
+    Error("Can't %s partition %d: %s\n",
+          op == BLKPG_ADD_PARTITION ? "add" : "delete", pno, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+// Brings the partitions of the kernel in line with the GPT of drive,
+// deleting and adding only the ones which changed, so that the nodes of
+// the others stay, and are not all removed and created again as with a
+// BLKRRPART. Returns the number of errors.
+static int ReloadPartitions(struct drive *drive) {
+  struct kernel_partition *parts;
+  int extra[MAX_EXTRA_PARTITIONS];
+  int extra_count;
+  uint32_t count = GetNumberOfEntries(&drive->gpt);
+  uint64_t sector_bytes = drive->gpt.sector_bytes;
+  int errorcnt = 0;
+  int changed = 0;
+  uint32_t i;
+  int gpt_retval;
+
+  if (GPT_SUCCESS != (gpt_retval = GptSanityCheck(&drive->gpt))) {
+    Error("GptSanityCheck() returned %d: %s\n",
+          gpt_retval, GptError(gpt_retval));
+    return 1;
+  }
+  parts = calloc(count, sizeof(*parts));
+  if (!parts)
+    return 1;
+  if (GetKernelPartitions(drive->fd, parts, count, extra, &extra_count) < 0) {
+    free(parts);
+    return 1;
+  }
+
+  for (i = 0; i < (uint32_t)extra_count; i++) {
+    errorcnt += UpdatePartition(drive->fd, BLKPG_DEL_PARTITION, extra[i], 0, 0);
+    changed++;
+  }
+  for (i = 0; i < count; i++) {
+    GptEntry *entry = GetEntry(&drive->gpt, ANY_VALID, i);
+    long long start = 0, length = 0;
+
+    if (!IsUnusedEntry(entry)) {
+      start = entry->starting_lba * sector_bytes;
+      length = (entry->ending_lba - entry->starting_lba + 1) * sector_bytes;
+    }
+    if (parts[i].start == start && parts[i].length == length)
+      continue;
+    changed++;
+    if (parts[i].length &&
+        UpdatePartition(drive->fd, BLKPG_DEL_PARTITION, i + 1, 0, 0)) {
+      errorcnt++;
+      continue;
+    }
+    if (length)
+      errorcnt += UpdatePartition(drive->fd, BLKPG_ADD_PARTITION, i + 1,
+                                  start, length);
+  }
+  free(parts);
+  printf("reload: %d partitions changed\n", changed);
+  return errorcnt;
+}
+
 static void Usage(void)
 {
   printf("\nUsage: %s reload DRIVE\n\n"
@@ -21,7 +180,7 @@ static void Usage(void)
 
 int cmd_reload(int argc, char *argv[]) {
   char *drive = { STORAGE_BASE_PATH } ;
-  int fd;
+  struct drive gpt_drive;
   int c;
   int errorcnt = 0;
 
@@ -62,18 +221,24 @@ int cmd_reload(int argc, char *argv[]) {
   int i;
   for (i=0; i<argc; i++)
       printf("argv[%d]=%s\n", i, argv[i]);
-  if ( (fd=open(drive, O_RDWR | O_LARGEFILE | O_NOFOLLOW)) == -1 ) {
-      errorcnt = 1;
-      goto error;
+  // In a batch, this is the GPT already loaded by the batch. The kernel
+  // is only told of a GPT which is on the drive.
+  if (CGPT_OK != DriveOpen(drive, &gpt_drive, O_RDONLY)) {
+    errorcnt = 1;
+    goto error;
+  }
+  if (gpt_drive.gpt.modified) {
+    Error("the GPT of %s is not written yet\n", drive);
+    errorcnt = 1;
+  } else {
+    errorcnt = ReloadPartitions(&gpt_drive);
   }
-
-  errorcnt |= ioctl(fd, BLKRRPART, 0);
 
   if (errorcnt) {
-    fprintf(stderr, "could not re-read partition table on %s\n", drive);
+    fprintf(stderr, "could not reload the partitions of %s\n", drive);
   }
 
-  close(fd);
+  DriveClose(&gpt_drive, 0);
 
 error:
   return errorcnt;
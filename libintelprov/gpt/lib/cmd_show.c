@@ -29,6 +29,7 @@ static void Usage(void)
          "               -P  Priority flag\n"
          "               -A  raw 64-bit attribute value\n"
          "  -d           Debug output (including invalid headers)\n"
+         "  -j           JSON output of the whole table (or of -i NUM)\n"
          "\n", progname);
 }
 
@@ -41,7 +42,7 @@ int cmd_show(int argc, char *argv[]) {
   char *e = 0;
 
   opterr = 0;                     // quiet, you
-  while ((c=getopt(argc, argv, ":hnvqi:bstulSTPAd")) != -1)
+  while ((c=getopt(argc, argv, ":hnvqi:bstulSTPAdj")) != -1)
   {
     switch (c)
     {
@@ -77,6 +78,9 @@ int cmd_show(int argc, char *argv[]) {
     case 'd':
       params.debug = 1;
       break;
+    case 'j':
+      params.json = 1;
+      break;
 
     case 'h':
       Usage();
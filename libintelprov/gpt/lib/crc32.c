@@ -97,12 +97,54 @@ static uint32_t crc32_tab[] = {
 };
 
 /* Returns a 32-bit CRC of the contents of the buffer. */
-uint32_t Crc32(const void *buffer, uint32_t len) {
-  uint8_t *byte = (uint8_t*)buffer;
-  uint32_t i;
-  uint32_t value = ~0U;
+/* The slice-by-8 tables: crc32_slice[k][i] is the CRC of byte i followed
+ * by k zero bytes. crc32_slice[0] is crc32_tab. Built on the first use,
+ * the GPT library is not used from several threads. */
+static uint32_t crc32_slice[8][256];
+static int crc32_slice_ready;
+
+static void Crc32InitSlices(void) {
+  uint32_t i, k;
+
+  for (i = 0; i < 256; ++i)
+    crc32_slice[0][i] = crc32_tab[i];
+  for (k = 1; k < 8; ++k) {
+    for (i = 0; i < 256; ++i) {
+      uint32_t prev = crc32_slice[k - 1][i];
+      crc32_slice[k][i] = (prev >> 8) ^ crc32_tab[prev & 0xff];
+    }
+  }
+  crc32_slice_ready = 1;
+}
+
+uint32_t Crc32Update(uint32_t crc, const void *buffer, uint32_t len) {
+  const uint8_t *byte = (const uint8_t*)buffer;
+  uint32_t value = ~crc;
 
-  for (i = 0; i < len; ++i)
-    value = crc32_tab[(value ^ byte[i]) & 0xff] ^ (value >> 8);
+  if (!crc32_slice_ready)
+    Crc32InitSlices();
+
+  /* Eight bytes at a time, read byte by byte to not depend on the
+   * endianness nor on the alignment of the buffer */
+  for (; len >= 8; len -= 8, byte += 8) {
+    uint32_t one = value ^ (byte[0] | byte[1] << 8 | byte[2] << 16 |
+                            (uint32_t)byte[3] << 24);
+    uint32_t two = byte[4] | byte[5] << 8 | byte[6] << 16 |
+                   (uint32_t)byte[7] << 24;
+    value = crc32_slice[7][one & 0xff] ^
+            crc32_slice[6][(one >> 8) & 0xff] ^
+            crc32_slice[5][(one >> 16) & 0xff] ^
+            crc32_slice[4][one >> 24] ^
+            crc32_slice[3][two & 0xff] ^
+            crc32_slice[2][(two >> 8) & 0xff] ^
+            crc32_slice[1][(two >> 16) & 0xff] ^
+            crc32_slice[0][two >> 24];
+  }
+  for (; len; --len, ++byte)
+    value = crc32_tab[(value ^ *byte) & 0xff] ^ (value >> 8);
   return value ^ ~0U;
 }
+
+uint32_t Crc32(const void *buffer, uint32_t len) {
+  return Crc32Update(0, buffer, len);
+}
@@ -54,17 +54,55 @@ struct pmbr {
 void PMBRToStr(struct pmbr *pmbr, char *str, int buflen);
 
 // Handle to the drive storing the GPT.
+/* Sectors read at once from the beginning and from the end of the
+ * drive: the PMBR, header and entries, then the entries and header */
+#define GPT_PRIMARY_SECTORS (GPT_PMBR_SECTOR + GPT_HEADER_SECTOR + \
+                             GPT_ENTRIES_SECTORS)
+#define GPT_SECONDARY_SECTORS (GPT_ENTRIES_SECTORS + GPT_HEADER_SECTOR)
+#define GPT_BUF_SECTORS (GPT_PRIMARY_SECTORS + GPT_SECONDARY_SECTORS)
+#define GPT_BUF_ALIGN 4096
+
+// Size in chars of the GPT Entry's PartitionName field
+#define GPT_PARTNAME_LEN 72
+
+/* UTF-8 name of an entry, kept along the UTF-16 name it comes from */
+struct drive_label {
+  uint16_t name[36];
+  int state;        /* 0: not converted yet, 1: converted, -1: can't be */
+  char utf8[GPT_PARTNAME_LEN];
+};
+
 struct drive {
   int fd;           /* file descriptor */
   uint64_t size;    /* total size (in bytes) */
   GptData gpt;
   struct pmbr pmbr;
+  uint8_t *gpt_buf; /* the sectors loaded, gpt points into it, followed
+                     * by their copy as on the drive, see DriveSave() */
+  struct drive_label *labels;  /* see DriveLabel() */
+  uint32_t num_labels;
 };
 
 
 /* mode should be O_RDONLY or O_RDWR */
 int DriveOpen(const char *drive_path, struct drive *drive, int mode);
 int DriveClose(struct drive *drive, int update_as_needed);
+/* Reads the secondary GPT of a drive opened without it. */
+int DriveLoadSecondary(struct drive *drive);
+/* UTF-8 name of an entry, or NULL when it can't be converted. It is only
+ * converted again when the UTF-16 name changes, until DriveClose(). */
+const char *DriveLabel(struct drive *drive, uint32_t entry_index);
+
+/* Between DriveBatchBegin and DriveBatchEnd, the commands writing to
+ * the same drive share a single load of its GPT, and their changes are
+ * only written once, by DriveBatchFlush or DriveBatchEnd(1), e.g. for
+ * the commands of a whole partition file. DriveBatchEnd(0) drops them. */
+void DriveBatchBegin(void);
+int DriveBatchFlush(void);
+int DriveBatchEnd(int commit);
+int DriveBatchActive(void);
+/* Whether the last batch wrote a GPT, i.e. it is to be reloaded */
+int DriveBatchWritten(void);
 int CheckValid(const struct drive *drive);
 
 /* GUID conversion functions. Accepted format:
@@ -122,6 +160,14 @@ GptEntry *GetEntry(GptData *gpt, int secondary, uint32_t entry_index);
 void SetPriority(GptData *gpt, int secondary, uint32_t entry_index,
                  unsigned int priority);
 int GetPriority(GptData *gpt, int secondary, uint32_t entry_index);
+
+/* Renumbers the priorities of the kernel partitions in the primary
+ * entries, keeping their order, and raising set_partition (1-N, or 0)
+ * above the others, with its friends of the same priority if asked.
+ * The caller repairs the secondary copy and updates the CRCs. */
+int GptPrioritize(GptData *gpt, uint32_t set_partition, int set_friends,
+                  int max_priority, int *orig_priority);
+
 void SetTries(GptData *gpt, int secondary, uint32_t entry_index, unsigned int tries);
 int GetTries(GptData *gpt, int secondary, uint32_t entry_index);
 void SetSuccessful(GptData *gpt, int secondary, uint32_t entry_index,
@@ -161,9 +207,6 @@ int cmd_legacy(int argc, char *argv[]);
 #define ARRAY_COUNT(array) (sizeof(array)/sizeof((array)[0]))
 const char *GptError(unsigned int errnum);
 
-// Size in chars of the GPT Entry's PartitionName field
-#define GPT_PARTNAME_LEN 72
-
 /* The standard "assert" macro goes away when NDEBUG is defined. This doesn't.
  */
 #define require(A) do { \
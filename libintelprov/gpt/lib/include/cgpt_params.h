@@ -46,9 +46,12 @@ typedef struct CgptShowParams {
   uint32_t partition;
   int single_item;
   int debug;
+  int json;
 
   // This is filled in by the relevant methods in cgpt_show.c
   int num_partitions;
+  char *dump;                  // JSON table of cgpt_dump(), to be freed
+  size_t dump_len;
 } CgptShowParams;
 
 typedef struct CgptRepairParams {
@@ -112,6 +115,7 @@ int cgpt_get_boot_partition_number(CgptBootParams *params);
 // show/get related methods.
 int cgpt_show(CgptShowParams *params);
 int cgpt_get_num_non_empty_partitions(CgptShowParams *params);
+int cgpt_dump(CgptShowParams *params);
 
 // repair related methods.
 int cgpt_repair(CgptRepairParams *params);
@@ -58,6 +58,9 @@ typedef struct {
                                   *   header (size: 16 KB) */
   uint32_t sector_bytes;         /* Size of a LBA sector, in bytes */
   uint64_t drive_sectors;        /* Size of drive in LBA sectors, in sectors */
+  uint8_t secondary_deferred;    /* Non-zero when the secondary header and
+                                  *   table were not read, GptSanityCheck()
+                                  *   then trusts a valid primary alone */
 
   /* Outputs */
   uint8_t modified;              /* Which inputs have been modified?
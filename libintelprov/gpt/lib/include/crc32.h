@@ -9,4 +9,8 @@
 
 uint32_t Crc32(const void *buffer, uint32_t len);
 
+/* Continues the CRC32 crc, 0 for an empty buffer, with len more bytes.
+ * Crc32Update(Crc32(a, n), b, m) is the CRC32 of a followed by b. */
+uint32_t Crc32Update(uint32_t crc, const void *buffer, uint32_t len);
+
 #endif  /* VBOOT_REFERENCE_GPT_CRC32_H_ */
@@ -14,17 +14,24 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include "oem_partition.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <cgpt.h>
 #include <cutils/properties.h>
 #include <roots.h>
 
 #include "util.h"
 #include "update_osip.h"
+#include "partition_index.h"
 
 
 
@@ -91,6 +98,18 @@ void oem_partition_disable_cmd_reload()
 	indirected_cmd_reload = cmd_noop;
 }
 
+/* The last reload command of a partition file, which only runs once
+ * the GPT is written */
+static int pending_reload_argc;
+static char **pending_reload_argv;
+
+static int request_reload(int argc, char **argv)
+{
+	pending_reload_argc = argc;
+	pending_reload_argv = argv;
+	return 0;
+}
+
 static int oem_partition_gpt_sub_command(int argc, char **argv)
 {
 	unsigned int i;
@@ -107,7 +126,7 @@ static int oem_partition_gpt_sub_command(int argc, char **argv)
 		{"find", cmd_find},
 		{"prioritize", cmd_prioritize},
 		{"legacy", cmd_legacy},
-		{"reload", indirected_cmd_reload},
+		{"reload", request_reload},
 	};
 
 	optind = 0;
@@ -118,13 +137,12 @@ static int oem_partition_gpt_sub_command(int argc, char **argv)
 	return -1;
 }
 
-static int oem_partition_gpt_handler(FILE *fp)
+/* The commands share a single load of the GPT, which is only written
+ * once they all succeeded. The kernel then reads it again once, however
+ * many reload commands there are */
+static int oem_partition_gpt_handler(struct partition_file *pf)
 {
-	int argc = 0;
-	int ret = 0;
 	int i;
-	char buffer[K_MAX_ARG_LEN];
-	char **argv = NULL;
 	char value[PROPERTY_VALUE_MAX] = { '\0' };
 
 	property_get("sys.partitioning", value, NULL);
@@ -134,43 +152,327 @@ static int oem_partition_gpt_handler(FILE *fp)
 	}
 
 	uuid_generator = cgpt_uuid_generate;
+	pending_reload_argv = NULL;
+	DriveBatchBegin();
+	for (i = 0; i < pf->count; i++) {
+		if (oem_partition_gpt_sub_command(pf->cmds[i].argc, pf->cmds[i].argv)) {
+			DriveBatchEnd(0);
+			error("GPT command failed\n");
+			return -1;
+		}
+	}
+	if (CGPT_OK != DriveBatchEnd(1)) {
+		error("GPT write failed\n");
+		return -1;
+	}
+
+	if (pending_reload_argv) {
+		optind = 0;
+		if (indirected_cmd_reload(pending_reload_argc, pending_reload_argv)) {
+			error("GPT command failed\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int oem_partition_mbr_handler(struct partition_file *pf)
+{
+	print("Using MBR\n");
+	return ufdisk.create_partition();
+}
+
+int partition_file_load(const char *filename, struct partition_file *pf)
+{
+	char buffer[K_MAX_ARG_LEN];
+	struct partition_cmd *cmds;
+	char **argv;
+	int argc;
+	int size = 0;
+	FILE *fp;
+
+	memset(pf, 0, sizeof(*pf));
+	memset(buffer, 0, sizeof(buffer));
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		error("Can't open partition file");
+		return -1;
+	}
+
+	if (!fgets(buffer, sizeof(buffer), fp)) {
+		error("partition file is empty");
+		goto error;
+	}
+
+	buffer[strlen(buffer) - 1] = '\0';
+
+	if (sscanf(buffer, "%*[^=]=%255s", pf->type) != 1) {
+		error("partition file is invalid");
+		goto error;
+	}
+
 	while (fgets(buffer, sizeof(buffer), fp)) {
 		if (buffer[strlen(buffer) - 1] == '\n')
 			buffer[strlen(buffer) - 1] = '\0';
 		argv = str_to_array(buffer, &argc);
-
-		if (argv != NULL) {
-			ret = oem_partition_gpt_sub_command(argc, argv);
-
-			for (i = 0; i < argc; i++) {
-				if (argv[i]) {
-					free(argv[i]);
-					argv[i] = NULL;
-				}
-			}
+		if (argv == NULL) {
+			error("GPT str_to_array error. Malformed string ?\n");
+			goto error;
+		}
+		if (argc == 0) {
 			free(argv);
-			argv = NULL;
+			continue;
+		}
 
-			if (ret) {
-				error("GPT command failed\n");
-				return -1;
+		if (pf->count == size) {
+			size = size ? size * 2 : 32;
+			cmds = realloc(pf->cmds, size * sizeof(*cmds));
+			if (!cmds) {
+				error("Can't allocate the partition commands");
+				goto error_argv;
 			}
-		} else {
-			error("GPT str_to_array error. Malformed string ?\n");
+			pf->cmds = cmds;
+		}
+		pf->cmds[pf->count].argc = argc;
+		pf->cmds[pf->count].argv = argv;
+		pf->count++;
+	}
+
+	fclose(fp);
+	return 0;
+
+error_argv:
+	while (argc--)
+		free(argv[argc]);
+	free(argv);
+error:
+	fclose(fp);
+	partition_file_free(pf);
+	return -1;
+}
+
+void partition_file_free(struct partition_file *pf)
+{
+	int i, j;
+
+	for (i = 0; i < pf->count; i++) {
+		for (j = 0; j < pf->cmds[i].argc; j++)
+			free(pf->cmds[i].argv[j]);
+		free(pf->cmds[i].argv);
+	}
+	free(pf->cmds);
+	pf->cmds = NULL;
+	pf->count = 0;
+}
+
+int oem_partition_run(struct partition_file *pf)
+{
+	int retval = -1;
+
+	if (!strncmp("gpt", pf->type, strlen(pf->type)))
+		retval = oem_partition_gpt_handler(pf);
+
+	if (!strncmp("mbr", pf->type, strlen(pf->type)))
+		retval = oem_partition_mbr_handler(pf);
+
+	invalidate_partition_index();
+	return retval;
+}
+
+/* Samples of the device read back after a quick nuke */
+#define NUKE_SAMPLES		64
+#define NUKE_SAMPLE_SIZE	(64 * 1024)
+
+/* Erases the whole device with a secure discard, a discard or a
+ * BLKZEROOUT, instead of writing it, then checks that samples of the
+ * device read back as zeros. zero and pbufRead are at least
+ * NUKE_SAMPLE_SIZE. Returns 1 if the device supports none of them. */
+static int quick_nuke(int fd, const char *device, char *zero, char *pbufRead)
+{
+	uint64_t range[2];
+	uint64_t size, pos, len;
+	unsigned int zeroes = 0;
+	int i;
+
+	if (ioctl(fd, BLKGETSIZE64, &size) == -1)
+		return 1;
+	range[0] = 0;
+	range[1] = size;
+
+	if (ioctl(fd, BLKSECDISCARD, &range) == 0 || ioctl(fd, BLKDISCARD, &range) == 0) {
+		if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == -1)
+			zeroes = 0;
+	}
+	if (!zeroes) {
+		/* The discarded blocks, if any, may read back as anything */
+		if (ioctl(fd, BLKZEROOUT, &range) == -1)
+			return 1;
+	}
+	print("erased volume \"%s\", size=%llu\n", device, (unsigned long long)size);
+
+	len = size < NUKE_SAMPLE_SIZE ? size : NUKE_SAMPLE_SIZE;
+	memset(zero, 0, len);
+	for (i = 0; i < NUKE_SAMPLES; i++) {
+		/* From the very first to the very last bytes */
+		pos = (size - len) * i / (NUKE_SAMPLES - 1);
+		if (pread64(fd, pbufRead, len, pos) != (ssize_t)len) {
+			error("nuke_volume: failed to read data");
+			return -1;
+		}
+		if (memcmp(zero, pbufRead, len) != 0) {
+			error("nuke_volume failed read back check at %llu!! \"%s\"\n",
+			      (unsigned long long)pos, device);
 			return -1;
 		}
 	}
 
+	print("read back %d samples \"%s\"\n", NUKE_SAMPLES, device);
 	return 0;
 }
 
-static int oem_partition_mbr_handler(FILE *fp)
+/* The full nuke keeps the eMMC queue busy with several O_DIRECT writes */
+#define NUKE_THREADS		4
+#define NUKE_CHUNK		(4 * 1024 * 1024)
+#define NUKE_ALIGN		4096
+/* Percentage of the volume between two throughput reports */
+#define NUKE_REPORT_STEP	10
+
+/* The workers write the pattern at the next offset, until the end of
+ * the device. All the fields below the lock are protected by it. */
+struct nuke_pool {
+	int fd;
+	const char *pattern;
+	uint64_t size;
+	const char *device;
+	struct timespec start;
+
+	pthread_mutex_t lock;
+	uint64_t next;
+	uint64_t done;
+	int reported;
+	int error;
+};
+
+static long long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Called with the lock held */
+static void nuke_report(struct nuke_pool *pool)
 {
-	print("Using MBR\n");
-	return ufdisk.create_partition();
+	int percent = pool->done * 100 / pool->size;
+	long long ms;
+
+	if (percent < pool->reported + NUKE_REPORT_STEP && pool->done != pool->size)
+		return;
+	pool->reported = percent;
+	ms = elapsed_ms(&pool->start);
+	print("erased %d%% of \"%s\", %lld MB/s\n", percent, pool->device,
+	      ms ? (long long)(pool->done / 1000 / ms) : 0);
+}
+
+static void *nuke_worker(void *arg)
+{
+	struct nuke_pool *pool = (struct nuke_pool *)arg;
+	uint64_t pos, len;
+	ssize_t ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->error && pool->next < pool->size) {
+		pos = pool->next;
+		len = pool->size - pos < NUKE_CHUNK ? pool->size - pos : NUKE_CHUNK;
+		pool->next += len;
+		pthread_mutex_unlock(&pool->lock);
+
+		do {
+			ret = pwrite64(pool->fd, pool->pattern, len, pos);
+		} while (ret == -1 && errno == EINTR);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret != (ssize_t)len) {
+			pool->error = ret == -1 ? errno : EIO;
+			break;
+		}
+		pool->done += len;
+		progress(pool->done, pool->size);
+		nuke_report(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Writes the pattern byte over the whole device, bypassing the page cache */
+static int overwrite_volume(const char *device, uint64_t size, int pattern)
+{
+	pthread_t threads[NUKE_THREADS];
+	struct nuke_pool pool;
+	void *buf;
+	int i, started;
+	int ret = -1;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.size = size;
+	pool.device = device;
+	pool.fd = open(device, O_WRONLY | O_DIRECT);
+	if (pool.fd == -1)
+		pool.fd = open(device, O_WRONLY);
+	if (pool.fd == -1) {
+		error("nuke_volume failed to open for writing \"%s\"\n", device);
+		return -1;
+	}
+
+	if (posix_memalign(&buf, NUKE_ALIGN, NUKE_CHUNK)) {
+		error("nuke_volume: malloc pattern failed\n");
+		goto close;
+	}
+	memset(buf, pattern, NUKE_CHUNK);
+	pool.pattern = buf;
+
+	/* The workers report with the lock held */
+	util_log_async_start();
+	pthread_mutex_init(&pool.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &pool.start);
+	for (started = 0; started < NUKE_THREADS; started++)
+		if (pthread_create(&threads[started], NULL, nuke_worker, &pool))
+			break;
+	if (started == 0) {
+		error("nuke_volume: failed to start the writers\n");
+		goto destroy;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (pool.error) {
+		error("nuke_volume: failed to write file, %s\n", strerror(pool.error));
+		goto destroy;
+	}
+	if (fsync(pool.fd) == -1) {
+		error("nuke_volume: failed to sync \"%s\"\n", device);
+		goto destroy;
+	}
+	print("wrote %llu bytes in %lld ms \"%s\"\n", (unsigned long long)size,
+	      elapsed_ms(&pool.start), device);
+	ret = 0;
+
+destroy:
+	pthread_mutex_destroy(&pool.lock);
+	util_log_async_stop();
+	free(buf);
+close:
+	close(pool.fd);
+	return ret;
 }
 
-static int nuke_volume(const char *volume, long int bufferSize)
+/* Erases the volume, with the eMMC erase commands unless full is set
+ * or the device does not support them. The full nuke writes 0xFF to
+ * the whole device, and reads it all back. */
+static int nuke_volume(const char *volume, long int bufferSize, bool full)
 {
 	Volume *v = volume_for_path(volume);
 	int fd, count, count_w, offset;
@@ -217,6 +519,13 @@ static int nuke_volume(const char *volume, long int bufferSize)
 		goto end2;
 	}
 
+	if (!full) {
+		ret = quick_nuke(fd, v->device, pbuf, pbufRead);
+		if (ret <= 0)
+			goto end1;
+		print("no discard on \"%s\", writing it\n", v->device);
+	}
+
 	memset(pbuf, 0xFF, bufferSize * sizeof(char));
 
 	size = lseek64(fd, 0, SEEK_END);
@@ -238,19 +547,9 @@ static int nuke_volume(const char *volume, long int bufferSize)
 	print("erasing volume \"%s\", size=%lld...\n", volume, size);
 
 	//now blast the device with F's until we hit the end.
-	count = 0;
-	do {
-		ret = write(fd, pbuf, bufferSize);
-
-		if (ret == -1) {
-			error("nuke_volume: failed to write file");
-			goto end1;
-		}
-
-		count++;
-	} while (ret == bufferSize);
-
-	print("wrote ret %ld, count %d,  \"%s\"\n", ret, count, v->device);
+	ret = overwrite_volume(v->device, size, 0xFF);
+	if (ret)
+		goto end1;
 
 	//now do readback check that data is as expected
 	offset = lseek(fd, 0, SEEK_SET);
@@ -260,7 +559,8 @@ static int nuke_volume(const char *volume, long int bufferSize)
 		goto end1;
 	}
 
-	count_w = count;
+	/* The number of reads, the last one being short */
+	count_w = size / bufferSize + 1;
 	count = 0;
 	do {
 		ret = read(fd, pbufRead, bufferSize);
@@ -319,46 +619,24 @@ int oem_partition_stop_handler(int argc, char **argv)
 
 int oem_partition_cmd_handler(int argc, char **argv)
 {
-	char buffer[K_MAX_ARG_LEN];
-	char partition_type[K_MAX_ARG_LEN];
-	FILE *fp;
-	int retval = -1;
+	struct partition_file pf;
+	int retval;
 
-	memset(buffer, 0, sizeof(buffer));
-
-	if (argc == 2) {
-		fp = fopen(argv[1], "r");
-		if (!fp) {
-			error("Can't open partition file");
-			return -1;
-		}
-
-		if (!fgets(buffer, sizeof(buffer), fp)) {
-			error("partition file is empty");
-			return -1;
-		}
-
-		buffer[strlen(buffer) - 1] = '\0';
-
-		if (sscanf(buffer, "%*[^=]=%255s", partition_type) != 1) {
-			error("partition file is invalid");
-			return -1;
-		}
-
-		if (!strncmp("gpt", partition_type, strlen(partition_type)))
-			retval = oem_partition_gpt_handler(fp);
+	if (argc != 2)
+		return -1;
 
-		if (!strncmp("mbr", partition_type, strlen(partition_type)))
-			retval = oem_partition_mbr_handler(fp);
+	if (partition_file_load(argv[1], &pf))
+		return -1;
 
-		fclose(fp);
-	}
+	retval = oem_partition_run(&pf);
+	partition_file_free(&pf);
 
 	return retval;
 }
 
 #define MOUNT_POINT_SIZE    50	/* /dev/<whatever> */
 #define BUFFER_SIZE         4000000	/* 4Mb */
+#define FULL_NUKE_ARG       "full"
 
 static int get_mountpoint(char *name, char *mnt_point)
 {
@@ -390,8 +668,11 @@ int oem_erase_partition(int argc, char **argv)
 {
 	int retval = -1;
 	char mnt_point[MOUNT_POINT_SIZE] = "";
+	bool full;
 
-	if (argc != 2) {
+	/* oem erase <partition> [full] */
+	full = argc == 3 && !strcmp(argv[2], FULL_NUKE_ARG);
+	if (argc != 2 && !full) {
 		/* Should not pass here ! */
 		error("oem erase called with wrong parameter!");
 		goto end;
@@ -403,7 +684,7 @@ int oem_erase_partition(int argc, char **argv)
 	print("CMD '%s %s'...\n", argv[0], mnt_point);
 
 	print("ERASE step 1/2...\n");
-	retval = nuke_volume(mnt_point, BUFFER_SIZE);
+	retval = nuke_volume(mnt_point, BUFFER_SIZE, full);
 	if (retval != 0) {
 		error("format_volume failed: %s\n", mnt_point);
 		goto end;
@@ -434,6 +715,7 @@ int oem_repart_partition(int argc, char **argv)
 	}
 
 	retval = ufdisk.create_partition();
+	invalidate_partition_index();
 	if (retval != 0)
 		error("cannot write partition");
 
@@ -461,11 +743,16 @@ int oem_retrieve_partitions(int argc, char **argv)
 		return -1;
 	}
 
+	/* Both commands share a single load of the GPT. The boot command
+	 * only writes the PMBR, so the GPT the reload gives to the kernel is
+	 * the one on the drive */
+	DriveBatchBegin();
 	boot_argv[1] = boot_opt;
 	boot_argv[2] = drive;
 	printf("boot %s %s\n", boot_argv[1], boot_argv[2]);
 	ret = cmd_bootable(3, boot_argv);
 	if (ret) {
+		DriveBatchEnd(0);
 		error("gpt boot command failed\n");
 		return ret;
 	}
@@ -473,6 +760,8 @@ int oem_retrieve_partitions(int argc, char **argv)
 	reload_argv[1] = drive;
 	printf("reload %s\n", reload_argv[1]);
 	ret = cmd_reload(2, reload_argv);
+	DriveBatchEnd(0);
+	invalidate_partition_index();
 	if (ret) {
 		error("gpt reload command failed\n");
 		return ret;
@@ -497,8 +786,11 @@ int oem_wipe_partition(int argc, char **argv)
 {
 	int retval = -1;
 	char mnt_point[MOUNT_POINT_SIZE] = "";
+	bool full;
 
-	if (argc != 2) {
+	/* oem wipe <partition> [full] */
+	full = argc == 3 && !strcmp(argv[2], FULL_NUKE_ARG);
+	if (argc != 2 && !full) {
 		error("oem erase called with wrong parameter!");
 		goto end;
 	}
@@ -508,7 +800,7 @@ int oem_wipe_partition(int argc, char **argv)
 
 	print("CMD '%s %s'...\n", argv[0], mnt_point);
 
-	retval = nuke_volume(mnt_point, BUFFER_SIZE);
+	retval = nuke_volume(mnt_point, BUFFER_SIZE, full);
 	if (retval != 0)
 		error("wipe partition failed: %s\n", mnt_point);
 
@@ -31,6 +31,23 @@ int oem_wipe_partition(int argc, char **argv);
 void oem_partition_disable_cmd_reload();
 char **str_to_array(char *str, int *argc);
 
+/* A partition file, parsed once: its type, then a command per line */
+struct partition_cmd {
+	int argc;
+	char **argv;
+};
+
+struct partition_file {
+	char type[K_MAX_ARG_LEN];
+	int count;
+	struct partition_cmd *cmds;
+};
+
+int partition_file_load(const char *filename, struct partition_file *pf);
+void partition_file_free(struct partition_file *pf);
+/* Partitions as the file says, partitioning must be started */
+int oem_partition_run(struct partition_file *pf);
+
 struct ufdisk {
 	void (*umount_all) (void);
 	int (*create_partition) (void);
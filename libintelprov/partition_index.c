@@ -0,0 +1,200 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flash_ops.h"
+#include "partition_index.h"
+#include "update_osip.h"
+#include "util.h"
+
+/* Power of 2, well above the 128 entries of a GPT */
+#define INDEX_SIZE	256
+
+struct index_entry {
+	char *name;
+	char *path;
+};
+
+/* Flashing threads resolve the partitions concurrently */
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct index_entry entries[INDEX_SIZE];
+static bool built;
+/* Watches the scanned directories, whose links change when the
+ * partition table is rewritten by another process, e.g. cgpt */
+static int watch_fd = -1;
+
+static uint32_t hash_name(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* The entry of name, or the free one where it goes, NULL if full */
+static struct index_entry *find_entry(const char *name)
+{
+	uint32_t i = hash_name(name);
+	unsigned int probes;
+
+	for (probes = 0; probes < INDEX_SIZE; probes++, i++) {
+		struct index_entry *e = &entries[i & (INDEX_SIZE - 1)];
+		if (!e->name || !strcmp(e->name, name))
+			return e;
+	}
+	return NULL;
+}
+
+static void drop_entries(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < INDEX_SIZE; i++) {
+		free(entries[i].name);
+		free(entries[i].path);
+		entries[i].name = entries[i].path = NULL;
+	}
+	built = false;
+	if (watch_fd >= 0) {
+		close(watch_fd);
+		watch_fd = -1;
+	}
+}
+
+/* Any event since the scan, even a partial read, makes it stale */
+static void check_watch(void)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+
+	if (watch_fd < 0)
+		return;
+	if (read(watch_fd, buf, sizeof(buf)) > 0 || errno != EAGAIN)
+		drop_entries();
+}
+
+char *partition_index_lookup(const char *name)
+{
+	struct index_entry *e;
+	char *path = NULL;
+
+	pthread_mutex_lock(&index_lock);
+	e = find_entry(name);
+	if (e && e->name)
+		path = strdup(e->path);
+	pthread_mutex_unlock(&index_lock);
+	return path;
+}
+
+static int add_entry(const char *name, const char *path)
+{
+	struct index_entry *e = find_entry(name);
+
+	if (!e)
+		return -1;
+	if (e->name)
+		return 0;
+
+	e->name = strdup(name);
+	e->path = strdup(path);
+	if (!e->name || !e->path) {
+		free(e->name);
+		free(e->path);
+		e->name = e->path = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int partition_index_add(const char *name, const char *path)
+{
+	int ret;
+
+	pthread_mutex_lock(&index_lock);
+	ret = add_entry(name, path);
+	pthread_mutex_unlock(&index_lock);
+	return ret;
+}
+
+static void scan_dir(const char *dir)
+{
+	struct dirent *d;
+	struct stat buf;
+	char *path;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+	if (watch_fd >= 0)
+		inotify_add_watch(watch_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+				  IN_MOVED_TO | IN_DELETE_SELF);
+
+	while ((d = readdir(dp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (asprintf(&path, "%s/%s", dir, d->d_name) == -1)
+			break;
+		/* The entries are links to the block devices */
+		if (stat(path, &buf) == 0 && S_ISBLK(buf.st_mode))
+			add_entry(d->d_name, path);
+		free(path);
+	}
+	closedir(dp);
+}
+
+void partition_index_build(const char *const *dirs, unsigned int count)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&index_lock);
+	check_watch();
+	if (!built) {
+		/* Watched before the scan, so that no change is missed */
+		watch_fd = inotify_init();
+		if (watch_fd >= 0 && fcntl(watch_fd, F_SETFL, O_NONBLOCK)) {
+			close(watch_fd);
+			watch_fd = -1;
+		}
+		for (i = 0; i < count; i++)
+			scan_dir(dirs[i]);
+		built = true;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+void invalidate_partition_index(void)
+{
+	pthread_mutex_lock(&index_lock);
+	drop_entries();
+	pthread_mutex_unlock(&index_lock);
+	invalidate_OSIP_cache();
+	invalidate_flash_ops();
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PARTITION_INDEX_H_
+#define _PARTITION_INDEX_H_
+
+/* In-process index of the partitions, from their name to their block
+ * device path. It is built once, by scanning the by-name directories,
+ * and kept until a repartition invalidates it, or until the links of
+ * the directories change. It is safe to use from several threads. */
+
+/* Scans the directories, the first ones first, unless already done */
+void partition_index_build(const char *const *dirs, unsigned int count);
+/* Returns a copy of the block device path of name, to be freed, or
+ * NULL if it is not indexed */
+char *partition_index_lookup(const char *name);
+/* Indexes a partition found afterwards, returns 0 or -1 */
+int partition_index_add(const char *name, const char *path);
+
+/* Drops the partition index and the cached OSIP header, to be called
+ * whenever the partition table may have changed */
+void invalidate_partition_index(void);
+
+#endif	/* _PARTITION_INDEX_H_ */
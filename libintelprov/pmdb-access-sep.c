@@ -21,6 +21,7 @@
 #include <chaabi/secure_token.h>
 #include <chaabi/umip_access.h>
 #include <string.h>
+#include <stdbool.h>
 
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 #define min(a,b) (((a) < (b)) ? (a) : (b))
@@ -41,6 +42,19 @@ static size_t pmdb_area_size(sep_pmdb_area_t type)
 	return size;
 }
 
+/* The databases of the current transaction, indexed by database - 1 */
+static struct pmdb_txn_area {
+	bool loaded;
+	bool dirty;
+	uint8_t buffer[MAX_BUF_SIZE];
+} txn_areas[2];
+static bool txn_active;
+
+static sep_pmdb_area_t pmdb_area_type(enum pmdb_database db)
+{
+	return (WO == db) ? SEP_PMDB_WRITE_ONCE : SEP_PMDB_WRITE_MANY;
+}
+
 static int pmdb_read_modify_write(sep_pmdb_area_t type, uint8_t data[], size_t size, unsigned int offset)
 {
 	uint8_t buffer[MAX_BUF_SIZE];
@@ -66,6 +80,57 @@ done:
 
 int pmdb_access_write(unsigned char *buf, enum pmdb_database db, unsigned int offset, size_t size)
 {
-	return pmdb_read_modify_write((WO == db) ? SEP_PMDB_WRITE_ONCE :
-				      SEP_PMDB_WRITE_MANY, buf, size, offset);
+	sep_pmdb_area_t type = pmdb_area_type(db);
+	struct pmdb_txn_area *area = &txn_areas[db - 1];
+
+	if (!txn_active)
+		return pmdb_read_modify_write(type, buf, size, offset);
+
+	if (offset + size > pmdb_area_size(type))
+		return -1;
+
+	if (!area->loaded) {
+		if (PMDB_SUCCESSFUL != sep_pmdb_read(type, area->buffer, pmdb_area_size(type)))
+			return -1;
+		area->loaded = true;
+	}
+
+	memcpy(area->buffer + offset, buf, size);
+	area->dirty = true;
+	return 0;
+}
+
+int pmdb_access_begin(void)
+{
+	if (txn_active)
+		return -1;
+
+	memset(txn_areas, 0, sizeof(txn_areas));
+	txn_active = true;
+	return 0;
+}
+
+int pmdb_access_commit(void)
+{
+	enum pmdb_database db;
+	int ret = 0;
+
+	if (!txn_active)
+		return -1;
+	txn_active = false;
+
+	for (db = WO; db <= WM; db++) {
+		sep_pmdb_area_t type = pmdb_area_type(db);
+		struct pmdb_txn_area *area = &txn_areas[db - 1];
+
+		if (area->dirty && PMDB_SUCCESSFUL !=
+		    sep_pmdb_write(type, area->buffer, pmdb_area_size(type)))
+			ret = -1;
+	}
+	return ret;
+}
+
+void pmdb_access_abort(void)
+{
+	txn_active = false;
 }
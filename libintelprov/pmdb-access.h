@@ -21,4 +21,11 @@ enum pmdb_database { WO = 1, WM };
 int pmdb_access_write(unsigned char *buf, enum pmdb_database db, unsigned int offset, size_t size);
 int pmdb_access_read(unsigned char *buf, enum pmdb_database db, unsigned int offset, size_t size);
 
+/* Between begin and commit, each database is read once, by its first
+ * write, and the writes are applied in memory. commit writes back the
+ * modified databases, abort drops the writes. */
+int pmdb_access_begin(void);
+int pmdb_access_commit(void);
+void pmdb_access_abort(void);
+
 #endif
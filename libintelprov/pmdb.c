@@ -42,40 +42,61 @@ struct pmdb_field_s {
 	size_t size;
 };
 
-static struct pmdb_field_s pmdb_fields[] = {
-	{"fru", WM, PMDB_FRU_OFFSET, PMDB_FRU_SIZE},
-	{"fru+cs", WM, PMDB_FRU_OFFSET, PMDB_FRU_SIZE + CHECKSUM_SIZE},
+/* Indexed by field ID */
+static struct pmdb_field_s pmdb_fields[PMDB_FIELD_COUNT] = {
+	[PMDB_FIELD_FRU] = {"fru", WM, PMDB_FRU_OFFSET, PMDB_FRU_SIZE},
+	[PMDB_FIELD_FRU_CS] = {"fru+cs", WM, PMDB_FRU_OFFSET, PMDB_FRU_SIZE + CHECKSUM_SIZE},
 };
 
-static struct pmdb_field_s *pmdb_field(const char *name)
+int pmdb_write_field(enum pmdb_field_id id, void *buf, size_t size)
 {
-	unsigned int i;
+	struct pmdb_field_s *field;
 
-	for (i = 0; i < sizeof(pmdb_fields) / sizeof(*pmdb_fields); i++) {
-		if (!strcmp(pmdb_fields[i].name, name))
-			return &pmdb_fields[i];
+	if ((unsigned)id >= PMDB_FIELD_COUNT)
+		return -4;
+	field = &pmdb_fields[id];
+
+	if (size != field->size) {
+		pr_error("invalid %s size", field->name);
+		return -3;
 	}
-	return 0;
+
+	return pmdb_access_write(buf, field->db, field->offset, size);
 }
 
-static int pmdb_write_field(const char *name, unsigned char *buf, size_t size)
+int pmdb_begin(void)
 {
-	int ret = -4;
+	return pmdb_access_begin();
+}
 
-	struct pmdb_field_s *field = pmdb_field(name);
-	if (!field)
-		goto done;
+int pmdb_commit(void)
+{
+	return pmdb_access_commit();
+}
 
-	if (size != field->size) {
-		pr_error("invalid %s size", field->name);
-		ret = -3;
-		goto done;
-	}
+void pmdb_abort(void)
+{
+	pmdb_access_abort();
+}
+#else
+/* The FRU is written through the TEE, in a single call */
+int pmdb_begin(void)
+{
+	return 0;
+}
+
+int pmdb_write_field(enum pmdb_field_id id, void *buf, size_t size)
+{
+	return -4;
+}
 
-	ret = pmdb_access_write(buf, field->db, field->offset, size);
+int pmdb_commit(void)
+{
+	return 0;
+}
 
-done:
-	return ret;
+void pmdb_abort(void)
+{
 }
 #endif	/* TEE_FRAMEWORK */
 
@@ -97,6 +118,6 @@ int pmdb_write_fru(void *buf, unsigned size)
 	memcpy(with_cs, buf, min(size, PMDB_FRU_SIZE));
 	twoscomplement(&with_cs[PMDB_FRU_SIZE], with_cs, PMDB_FRU_SIZE);
 
-	return pmdb_write_field("fru+cs", with_cs, sizeof(with_cs));
+	return pmdb_write_field(PMDB_FIELD_FRU_CS, with_cs, sizeof(with_cs));
 #endif	/* TEE_FRAMEWORK */
 }
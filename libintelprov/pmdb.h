@@ -21,4 +21,18 @@
 #define PMDB_FRU_SIZE		10
 int pmdb_write_fru(void *buf, unsigned size);
 
+enum pmdb_field_id {
+	PMDB_FIELD_FRU,
+	PMDB_FIELD_FRU_CS,	/* fru followed by its checksum */
+	PMDB_FIELD_COUNT
+};
+
+/* Writes of several fields in a row: the PMDB is read once by the first
+ * write after pmdb_begin, and written once by pmdb_commit. Writes outside
+ * of a pmdb_begin/pmdb_commit pair are committed one by one. */
+int pmdb_begin(void);
+int pmdb_write_field(enum pmdb_field_id id, void *buf, size_t size);
+int pmdb_commit(void);
+void pmdb_abort(void);
+
 #endif
@@ -308,13 +308,15 @@ class EdifyGenerator(object):
     self.Print("Updating IFWI image...\n");
     self.script.append('flash_ifwi("/tmp/%s");' % (filename,))
 
-  def InvalidateOs(self, name):
-    """Invalidate os image in osip table"""
-    self.script.append('invalidate_os("%s");' % (name,))
-
-  def RestoreOs(self, name):
-    """Restore os image in osip table"""
-    self.script.append('restore_os("%s");' % (name,))
+  def InvalidateOs(self, *names):
+    """Invalidate os images in osip table, with a single osip write"""
+    self.script.append('invalidate_os(%s);' %
+                       (", ".join(['"%s"' % (n,) for n in names]),))
+
+  def RestoreOs(self, *names):
+    """Restore os images in osip table, with a single osip write"""
+    self.script.append('restore_os(%s);' %
+                       (", ".join(['"%s"' % (n,) for n in names]),))
 
   def FlashCapsule(self, name):
     self.Print("Updating IFWI with capsule...\n");
@@ -32,8 +32,8 @@ struct data_items {
 	const size_t size;
 };
 
-static const uint32_t PAYLOAD_MAX_SIZE = 32;
-static const uint32_t PRINT_BUFFER_SIZE = 1024;
+/* Initial size of the buffer of a datagroup, which grows as needed.  */
+static const size_t DATAGROUP_BUFFER_SIZE = 256;
 
 /* Datagroups and item IDs.  */
 static const uint32_t SPID_DATAGROUP = 1;
@@ -86,12 +86,10 @@ static int output_fd = -1;
 
 static void output_data(uint8_t * data, size_t size)
 {
-	size_t i;
-
-	if (output_fd != -1)
-		for (i = 0; i < size; i++)
-			write(output_fd, data + i, sizeof(uint8_t));
-	else
+	if (output_fd != -1) {
+		if (safe_write(output_fd, data, size))
+			raise_error("Failed to write the output file, error: %s", strerror(errno));
+	} else
 		hexdump_buffer(data, size, print_fun, size);
 }
 
@@ -133,21 +131,104 @@ static int parse_datagroup_id(char *arg)
 	return ret;
 }
 
-static int parse_token(int dg, int flags)
+/* A datagroup read in one pass, kept for the life of the process (e.g. a
+   teeprov batch or droidboot) until a token is written, removed or
+   updated. The items are read one after the other in DATA, as they are
+   printed: the FRU ones are kept nibble swapped.  */
+struct datagroup_item {
+	uint32_t subgroup_id;
+	uint32_t item_id;
+	size_t offset;
+	size_t size;
+};
+
+struct datagroup {
+	uint32_t id;
+	int flags;
+	size_t count;
+	struct datagroup_item *items;
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	struct datagroup *next;
+};
+
+static struct datagroup *datagroups;
+
+static void free_datagroup(struct datagroup *group)
 {
-	uint32_t print_pos = 0;
+	free(group->items);
+	free(group->data);
+	free(group);
+}
+
+/* Makes room for SIZE more bytes in the buffer of GROUP.  */
+static int grow_datagroup(struct datagroup *group, size_t size)
+{
+	size_t capacity = group->capacity ? group->capacity : DATAGROUP_BUFFER_SIZE;
+	uint8_t *data;
+
+	while (capacity < group->size + size)
+		capacity *= 2;
+	if (capacity == group->capacity)
+		return 0;
+
+	data = realloc(group->data, capacity);
+	if (!data)
+		return -1;
+	group->data = data;
+	group->capacity = capacity;
+	return 0;
+}
+
+static void forget_datagroups(void)
+{
+	struct datagroup *next;
+
+	for (; datagroups; datagroups = next) {
+		next = datagroups->next;
+		free_datagroup(datagroups);
+	}
+}
+
+static struct datagroup *cached_datagroup(uint32_t dg, int flags)
+{
+	struct datagroup *group;
+
+	for (group = datagroups; group; group = group->next)
+		if (group->id == dg && group->flags == flags)
+			return group;
+	return NULL;
+}
+
+/* Reads all the items of datagroup DG, or returns the cached ones.  */
+static int read_datagroup(uint32_t dg, int flags, struct datagroup **result)
+{
+	struct datagroup *group;
+	struct datagroup_item *items;
 	uint32_t *sg_list = NULL;
 	uint32_t *item_list = NULL;
 	size_t sg_count = 0;
-	uint8_t print_data[PRINT_BUFFER_SIZE];
+	size_t s, it;
+	int ret;
+
+	*result = cached_datagroup(dg, flags);
+	if (*result)
+		return 0;
+
+	group = calloc(1, sizeof(*group));
+	if (!group) {
+		raise_error("Failed to allocate datagroup, error: %s", strerror(ENOMEM));
+		return EXIT_FAILURE;
+	}
+	group->id = dg;
+	group->flags = flags;
 
-	int ret = tee_token_sgids_get(dg, &sg_list, &sg_count, flags);
+	ret = tee_token_sgids_get(dg, &sg_list, &sg_count, flags);
 	if (ret != 0)
-		goto end;
+		goto error;
 
-	size_t s;
 	for (s = 0; s < sg_count; s++) {
-		size_t it;
 		size_t item_count = 0;
 
 		ret = tee_token_itemids_get(dg, sg_list[s], &item_list, &item_count, flags);
@@ -156,64 +237,101 @@ static int parse_token(int dg, int flags)
 			goto error;
 		}
 
+		items = realloc(group->items, (group->count + item_count) * sizeof(*items));
+		if (!items && group->count + item_count) {
+			raise_error("Failed to allocate datagroup, error: %s", strerror(ENOMEM));
+			ret = EXIT_FAILURE;
+			goto error_items;
+		}
+		group->items = items;
+
 		for (it = 0; it < item_count; it++) {
+			struct datagroup_item *item = &group->items[group->count];
 			size_t payload_size = 0;
-			uint8_t payload[PAYLOAD_MAX_SIZE];
-
-			memset(payload, 0, PAYLOAD_MAX_SIZE);
+			size_t i;
 
 			ret = tee_token_item_size_get(dg, sg_list[s], item_list[it], &payload_size, flags);
 			if (ret != 0) {
 				raise_error("tee_token_item_size_get call failed, return 0x%x\n", ret);
-				free(item_list);
-				goto error;
+				goto error_items;
 			}
 
-			if (payload_size > PAYLOAD_MAX_SIZE) {
-				raise_error("Returned payload size ( %u ) is more than max size ( %u )\n",
-					    payload_size, PAYLOAD_MAX_SIZE);
-				free(item_list);
-				ret = 1;
-				goto error;
+			if (grow_datagroup(group, payload_size)) {
+				raise_error("Failed to allocate datagroup, error: %s", strerror(ENOMEM));
+				ret = EXIT_FAILURE;
+				goto error_items;
 			}
 
+			item->subgroup_id = sg_list[s];
+			item->item_id = item_list[it];
+			item->offset = group->size;
+			item->size = payload_size;
+
 			ret = tee_token_item_read(dg, sg_list[s], item_list[it], 0,
-						  payload, payload_size, flags);
+						  group->data + item->offset, payload_size, flags);
 			if (ret != 0) {
 				raise_error("tee_token_item_read call failed, return 0x%x\n", ret);
-				free(item_list);
-				goto error;
+				goto error_items;
 			}
 
-			if (print_pos + payload_size >= PRINT_BUFFER_SIZE) {
-				raise_error("Print buffer full\n");
-				free(item_list);
-				ret = 1;
-				goto error;
-			}
+			/* Need to bit swap each byte */
+			if (FRU_DATAGROUP == dg)
+				for (i = item->offset; i < item->offset + payload_size; i++)
+					group->data[i] = group->data[i] << 4 | group->data[i] >> 4;
 
-			memcpy(print_data + print_pos, payload, payload_size);
-			print_pos += payload_size;
+			group->size += payload_size;
+			group->count++;
 		}
 
 		free(item_list);
+		item_list = NULL;
 	}
 
+	free(sg_list);
+	group->next = datagroups;
+	datagroups = group;
+	*result = group;
+	return 0;
+
+error_items:
+	free(item_list);
 error:
 	free(sg_list);
+	free_datagroup(group);
+	return ret;
+}
 
-end:
-	if (print_pos <= 0)
-		return ret;
+/* Reads an item, from its datagroup when that one was already read.  */
+static int read_item(uint32_t dg, const struct data_items *desc, uint8_t *data)
+{
+	struct datagroup *group = cached_datagroup(dg, 0);
+	size_t i;
+	int ret;
 
-	if (FRU_DATAGROUP == (uint32_t) dg) {
-		uint32_t i;
+	for (i = 0; group && i < group->count; i++)
+		if (group->items[i].subgroup_id == desc->subgroup_id &&
+		    group->items[i].item_id == desc->item_id &&
+		    group->items[i].size >= desc->size) {
+			memcpy(data, group->data + group->items[i].offset, desc->size);
+			return 0;
+		}
 
-		/* Need to bit swap each byte */
-		for (i = 0; i < print_pos; i++)
-			print_data[i] = print_data[i] << 4 | print_data[i] >> 4;
-	}
-	output_data(print_data, print_pos);
+	ret = tee_token_item_read(dg, desc->subgroup_id, desc->item_id, 0, data, desc->size, 0);
+	if (ret != 0)
+		raise_error("tee_token_item_read() call failed, return=0x%x", ret);
+	return ret;
+}
+
+static int parse_token(int dg, int flags)
+{
+	struct datagroup *group;
+
+	int ret = read_datagroup(dg, flags, &group);
+	if (ret != 0)
+		return ret;
+
+	if (group->size > 0)
+		output_data(group->data, group->size);
 
 	return ret;
 }
@@ -243,11 +361,8 @@ int get_ssn(int argc, char **argv)
 	int ret;
 	uint8_t data[ssn_item.size];
 
-	ret = tee_token_item_read(SERIAL_NUMBER_DATAGROUP, ssn_item.subgroup_id,
-				  ssn_item.item_id, 0, data, ssn_item.size, 0);
-	if (ret != 0)
-		raise_error("tee_token_item_read() call failed, return=0x%x", ret);
-	else
+	ret = read_item(SERIAL_NUMBER_DATAGROUP, &ssn_item, data);
+	if (ret == 0)
 		output_data(data, ssn_item.size);
 
 	return ret;
@@ -257,6 +372,7 @@ int start_update(int argc, char **argv)
 {
 	int ret;
 
+	forget_datagroups();
 	ret = tee_token_update_start(0);
 	if (ret != 0)
 		raise_error("tee_token_update_start() call failed, return=0x%x", ret);
@@ -268,6 +384,7 @@ int cancel_update(int argc, char **argv)
 {
 	int ret;
 
+	forget_datagroups();
 	ret = tee_token_update_cancel(0);
 	if (ret != 0)
 		raise_error("tee_token_update_cancel() call failed, return=0x%x", ret);
@@ -279,6 +396,7 @@ int finalize_update(int argc, char **argv)
 {
 	int ret;
 
+	forget_datagroups();
 	ret = tee_token_update_end(0);
 	if (ret != 0)
 		raise_error("tee_token_update_end() call failed, return=0x%x", ret);
@@ -302,12 +420,9 @@ int get_spid(int argc, char **argv)
 	uint8_t *tmp = payload;
 
 	for (i = 0; i < sizeof(SPID_ITEMS) / sizeof(struct data_items); i++) {
-		ret = tee_token_item_read(SPID_DATAGROUP, SPID_ITEMS[i].subgroup_id,
-					  SPID_ITEMS[i].item_id, 0, tmp, SPID_ITEMS[i].size, 0);
-		if (ret != 0) {
-			raise_error("tee_token_item_read() call failed, return=0x%x", ret);
+		ret = read_item(SPID_DATAGROUP, &SPID_ITEMS[i], tmp);
+		if (ret != 0)
 			goto exit;
-		}
 
 		tmp += SPID_ITEMS[i].size;
 	}
@@ -342,6 +457,7 @@ int write_token(void *data, size_t size)
 {
 	int ret;
 
+	forget_datagroups();
 	ret = tee_token_write(data, size, 0);
 	if (ret != 0)
 		raise_error("tee_token_write() call failed, return=0x%x", ret);
@@ -423,6 +539,7 @@ int remove_token(int argc, char **argv)
 	if (datagroup_id == -1)
 		return EXIT_FAILURE;
 
+	forget_datagroups();
 	ret = tee_token_remove(datagroup_id, 0);
 	if (ret != 0)
 		raise_error("tee_token_remove() call failed, return=0x%x", ret);
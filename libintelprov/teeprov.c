@@ -24,6 +24,8 @@
 #include <sys/mman.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
 #include <cutils/log.h>
 #include "tee_connector.h"
 
@@ -66,6 +68,10 @@ When used, -o option must the first.\n\
   -e, --generate-ecc                       generate ECC public key\n\
   -g, --generate=FILE1 FILE2               generate RSA public and private key\n\
   -i, --get-oem-id                         retrieve the Public OEM ID of the device\n\
+  -b, --batch=FILE                         run the commands of FILE, or of the standard\n\
+                                           input if FILE is -, in a single session: one\n\
+                                           per line, a long option followed by its\n\
+                                           arguments, e.g. \"read-token 5\"\n\
   -h, --help                               display this help\n\
 ");
 	exit(status);
@@ -140,10 +146,119 @@ static struct option const long_options[] = {
 	{"generate", required_argument, NULL, 'g'},
 	{"get-oem-id", no_argument, NULL, 'i'},
 	{"output-file", required_argument, NULL, 'o'},
+	{"batch", required_argument, NULL, 'b'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0}
 };
 
+#define BATCH_MAX_ARGS	4
+
+/* Runs one command of a batch, ARGV[0] being the long option name.  */
+static int run_batch_command(int argc, char **argv)
+{
+	const struct option *opt;
+
+	for (opt = long_options; opt->name; opt++)
+		if (!strcmp(opt->name, argv[0]))
+			break;
+
+	if (!opt->name || opt->val == 'b' || opt->val == 'h') {
+		raise_error("Unknown batch command \"%s\"", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (opt->val == 'g') {
+		if (argc != 3) {
+			raise_error("generate MUST have 2 file arguments");
+			return EXIT_FAILURE;
+		}
+		return generate_shared_rsa(3, argv);
+	}
+	if ((opt->has_arg == required_argument) != (argc == 2)) {
+		raise_error("Wrong number of arguments for \"%s\"", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	switch (opt->val) {
+	case 's':
+		return get_spid(0, NULL);
+	case 'f':
+		return get_fru(0, NULL);
+	case 'p':
+		return get_part_id(0, NULL);
+	case 'l':
+		return get_lifetime(0, NULL);
+	case 'n':
+		return get_ssn(0, NULL);
+	case 'u':
+		return start_update(0, NULL);
+	case 'c':
+		return cancel_update(0, NULL);
+	case 'z':
+		return finalize_update(0, NULL);
+	case 'w':
+		return write_chaabi_file(argv[1], write_token);
+	case 'r':
+		return read_token(2, argv);
+	case 'R':
+		return read_token_payload(2, argv);
+	case 'm':
+		return remove_token(2, argv);
+	case 'y':
+		return write_chaabi_file(argv[1], send_cryptid_request);
+	case 'e':
+		return generate_shared_ecc(0, NULL);
+	case 'i':
+		return get_oem_id(0, NULL);
+	case 'o':
+		/* Each output file holds the data of the commands after it */
+		close_output_file_when_open();
+		return set_output_file(argv[1]);
+	}
+	return EXIT_FAILURE;
+}
+
+/* Runs the commands of PATH in this process, so that the datagroups read
+   are read once, until the first one which fails.  */
+static int run_batch(const char *path)
+{
+	char line[PATH_MAX + 64];
+	char *argv[BATCH_MAX_ARGS + 1];
+	char *save;
+	FILE *file;
+	int argc, ret = 0, lineno = 0;
+
+	file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!file) {
+		raise_error("Failed to open \"%s\" file, error: %s", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while (ret == 0 && fgets(line, sizeof(line), file)) {
+		lineno++;
+		argc = 0;
+		argv[0] = strtok_r(line, " \t\r\n", &save);
+		while (argv[argc] && argv[argc][0] != '#' && argc < BATCH_MAX_ARGS)
+			argv[++argc] = strtok_r(NULL, " \t\r\n", &save);
+		/* Blank line or comment */
+		if (argc == 0)
+			continue;
+		if (argc == BATCH_MAX_ARGS && argv[argc] && argv[argc][0] != '#') {
+			raise_error("Too many arguments on line %d", lineno);
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		ret = run_batch_command(argc, argv);
+		if (ret != 0)
+			raise_error("Batch stopped at line %d", lineno);
+	}
+
+	if (file != stdin)
+		fclose(file);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	int ret, c;
@@ -152,7 +267,7 @@ int main(int argc, char **argv)
 	error_fun = teeprov_error;
 	atexit(close_output_file_when_open);
 
-	while ((c = getopt_long(argc, argv, "sfplnuczw:y:eg:r:R:o:hm:i", long_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "sfplnuczw:y:eg:r:R:o:hm:ib:", long_options, NULL)) != -1) {
 		switch (c) {
 		case 's':
 			return get_spid(0, NULL);
@@ -206,6 +321,9 @@ int main(int argc, char **argv)
 		case 'i':
 			return get_oem_id(0, NULL);
 
+		case 'b':
+			return run_batch(optarg);
+
 		case 'o':
 			if (optind != 3) {
 				raise_error("-o, --output-file=FILE MUST be the first option");
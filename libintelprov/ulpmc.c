@@ -15,18 +15,97 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "util.h"
 
 #define ULPMC_PATH "/dev/ulpmc-fwupdate"
+
+/* Transfer size when the driver has no preferred one, and the largest
+ * one, so that the progress moves during the transfer */
+#define ULPMC_CHUNK_DEFAULT	4096
+#define ULPMC_CHUNK_MAX		(64 * 1024)
+
+#define ULPMC_VERSION_MAX	64
+
+static size_t ulpmc_chunk_size(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || st.st_blksize <= 0)
+		return ULPMC_CHUNK_DEFAULT;
+	if (st.st_blksize > ULPMC_CHUNK_MAX)
+		return ULPMC_CHUNK_MAX;
+	return st.st_blksize;
+}
+
+static int ulpmc_write(int fd, const unsigned char *data, unsigned sz)
+{
+	size_t chunk = ulpmc_chunk_size(fd);
+	unsigned done = 0;
+	ssize_t ret;
+
+	while (done < sz) {
+		size_t len = sz - done < chunk ? sz - done : chunk;
+
+		ret = write(fd, data + done, len);
+		if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return -1;
+		}
+		done += ret;
+		progress(done, sz);
+	}
+	/* Character devices may have no fsync */
+	if (fsync(fd) && errno != EINVAL)
+		return -1;
+	return 0;
+}
+
+/* The driver reports the version of the running firmware on a read of
+ * the update node once the update is done. Older drivers have no read,
+ * the version is then only missing from the log. */
+static void ulpmc_print_version(int fd)
+{
+	char version[ULPMC_VERSION_MAX];
+	ssize_t ret;
+
+	do {
+		ret = read(fd, version, sizeof(version) - 1);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0) {
+		print("ULPMC firmware version not available\n");
+		return;
+	}
+	version[ret] = '\0';
+	version[strcspn(version, "\r\n")] = '\0';
+	print("ULPMC firmware version %s\n", version);
+}
+
 int flash_ulpmc(void *data, unsigned sz)
 {
-	/*
-	 * TODO: check version after flashing
-	 */
-	if (file_write(ULPMC_PATH, data, sz)) {
+	int fd;
+
+	fd = open(ULPMC_PATH, O_RDWR);
+	if (fd < 0 && errno == EACCES)
+		fd = open(ULPMC_PATH, O_WRONLY);
+	if (fd < 0) {
+		error("ULPMC flashing failed, can't open %s: %s\n", ULPMC_PATH, strerror(errno));
+		return -1;
+	}
+
+	if (ulpmc_write(fd, data, sz)) {
 		error("ULPMC flashing failed: %s\n", strerror(errno));
+		close(fd);
 		return -1;
 	}
 
+	ulpmc_print_version(fd);
+	close(fd);
 	return 0;
 }
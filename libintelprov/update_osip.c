@@ -26,9 +26,11 @@
 #include <unistd.h>
 #include <strings.h>
 
+#include "block_write.h"
 #include "update_osip.h"
 #include "util.h"
 #include "flash.h"
+#include "bootheader.h"
 
 #define UEFI_FW_IDX         0
 
@@ -234,6 +236,8 @@ void dump_osip_header(struct OSIP_header *osip)
 {
 	int i;
 
+	if (!log_enabled(LOG_LEVEL_DEBUG))
+		return;
 	fprintf(stderr, "OSIP:\n");
 	fprintf(stderr, "sig 0x%x, header_size %d, revision %02X.%02X\n",
 	       osip->sig, osip->header_size, osip->header_rev_major, osip->header_rev_minor);
@@ -250,6 +254,8 @@ void dump_OS_page(struct OSIP_header *osip, int os_index, int numpages)
 	static uint8_t buffer[8192 + 1024];
 	unsigned short *temp;
 
+	if (!log_enabled(LOG_LEVEL_DEBUG))
+		return;
 	dump_osip_index(osip, os_index);
 
 	for (i = 0; i < numpages; i++) {
@@ -275,11 +281,25 @@ void dump_OS_page(struct OSIP_header *osip, int os_index, int numpages)
 
 }
 
+/* The OSIP header as last read or written, until invalidate_OSIP_cache() */
+static struct OSIP_header osip_cache;
+static bool osip_cached;
+
+void invalidate_OSIP_cache(void)
+{
+	osip_cached = false;
+}
+
 int read_OSIP(struct OSIP_header *osip)
 {
 	int fd;
 	int ret = -1;
 
+	if (osip_cached) {
+		memcpy(osip, &osip_cache, sizeof(*osip));
+		return 0;
+	}
+
 	memset((void *)osip, 0, sizeof(*osip));
 	fd = open(MMC_DEV_POS, O_RDONLY);
 	if (fd < 0) {
@@ -295,6 +315,8 @@ int read_OSIP(struct OSIP_header *osip)
 		fprintf(stderr, "OSIP is corrupt!");
 		goto out;
 	}
+	memcpy(&osip_cache, osip, sizeof(osip_cache));
+	osip_cached = true;
 	ret = 0;
 out:
 	close(fd);
@@ -312,6 +334,7 @@ int write_OSIP(struct OSIP_header *osip)
 	osip->header_checksum = get_osip_crc(osip);
 
 	sz = sizeof(*osip);
+	osip_cached = false;
 
 	fd = open(MMC_DEV_POS, O_RDWR);
 	if (fd < 0) {
@@ -331,6 +354,8 @@ int write_OSIP(struct OSIP_header *osip)
 	}
 	fsync(fd);
 	close(fd);
+	memcpy(&osip_cache, osip, sizeof(osip_cache));
+	osip_cached = true;
 	return 0;
 }
 
@@ -354,37 +379,15 @@ static int crack_stitched_image(void *data, struct OSII **rec, uint8_t ** blob)
 	return 0;
 }
 
-/* Pull the OS image data off the NAND into a .osupdate.bin for application of
- * a bsdiff patch */
-int read_osimage_data(void **data, size_t * size, int osii_index)
+/* Builds the first LBA of a .osupdate.bin, a fake OSIP header with the
+ * single record osii */
+static void build_file_osip(const struct OSII *osii, unsigned char *lba)
 {
-	struct OSIP_header osip;
 	struct OSIP_header file_osip;
-	struct OSII *osii, *file_osii;
-	unsigned char *blob;
-	size_t blob_size;
-	int fd;
+	struct OSII *file_osii;
+	unsigned char *blob = lba;
 	size_t i;
 
-	if (read_OSIP(&osip)) {
-		fprintf(stderr, "read_OSIP fails\n");
-		return -1;
-	}
-
-	osii = &osip.desc[osii_index];
-
-	/* Add one LBA for the OSIP header */
-	blob_size = (osii->size_of_os_image + 1) * LBA_SIZE;
-
-	blob = malloc(blob_size);
-	*size = blob_size;
-	*data = blob;
-
-	if (!blob) {
-		pr_perror("malloc");
-		return -1;
-	}
-
 	/* Set up the fake OSIP header and write it */
 	memset(&file_osip, 0, sizeof(file_osip));
 	file_osip.sig = OSIP_SIG;
@@ -406,23 +409,53 @@ int read_osimage_data(void **data, size_t * size, int osii_index)
 	/* Create the checksum */
 	file_osip.header_checksum = 0;
 	file_osip.header_checksum = get_osip_crc(&file_osip);
+	memset(blob, 0, LBA_SIZE);
 	memcpy(blob, &file_osip, sizeof(file_osip));
 
 	/* Write out the rest of block 0. There's a long string of 0xFF, some
 	 * empty space, and the MBR magic cookie */
 	blob += 0x38;
-	blob_size -= 0x38;
 	for (i = 0; i < 384; i++) {
 		*blob = 0xFF;
 		blob++;
-		blob_size--;
 	}
 	blob += 70;
-	blob_size -= 70;
 	blob[0] = 0x55;
 	blob[1] = 0xAA;
-	blob += 2;
-	blob_size -= 2;
+}
+
+/* Pull the OS image data off the NAND into a .osupdate.bin for application of
+ * a bsdiff patch */
+int read_osimage_data(void **data, size_t * size, int osii_index)
+{
+	struct OSIP_header osip;
+	struct OSII *osii;
+	unsigned char *blob;
+	size_t blob_size;
+	int fd;
+
+	if (read_OSIP(&osip)) {
+		fprintf(stderr, "read_OSIP fails\n");
+		return -1;
+	}
+
+	osii = &osip.desc[osii_index];
+
+	/* Add one LBA for the OSIP header */
+	blob_size = (osii->size_of_os_image + 1) * LBA_SIZE;
+
+	blob = malloc(blob_size);
+	*size = blob_size;
+	*data = blob;
+
+	if (!blob) {
+		pr_perror("malloc");
+		return -1;
+	}
+
+	build_file_osip(osii, blob);
+	blob += LBA_SIZE;
+	blob_size -= LBA_SIZE;
 
 	fd = open(MMC_DEV_POS, O_RDONLY);
 	if (fd < 0) {
@@ -449,7 +482,48 @@ out_error:
 	return -1;
 }
 
-#define OSIP_BACKUP_OFFSET 0xE0
+/* Copies size bytes from src at src_pos to dst at dst_pos, a chunk at a time */
+/* Same as read_osimage_data, into filename, whatever the image size */
+int read_osimage_file(const char *filename, int osii_index)
+{
+	struct OSIP_header osip;
+	struct OSII *osii;
+	unsigned char lba[LBA_SIZE];
+	int fd, out;
+	int ret = -1;
+
+	if (read_OSIP(&osip)) {
+		fprintf(stderr, "read_OSIP fails\n");
+		return -1;
+	}
+
+	osii = &osip.desc[osii_index];
+	build_file_osip(osii, lba);
+
+	out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fd = open(MMC_DEV_POS, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("open");
+		goto close_out;
+	}
+
+	if (safe_write(out, lba, LBA_SIZE) == 0 &&
+	    fd_copy(out, LBA_SIZE, fd, (off64_t)osii->logical_start_block * LBA_SIZE,
+			(size_t)osii->size_of_os_image * LBA_SIZE) == 0)
+		ret = 0;
+
+	close(fd);
+close_out:
+	if (close(out) && !ret) {
+		pr_perror("close");
+		ret = -1;
+	}
+	return ret;
+}
 
 int destroy_the_osip_backup(void)
 {
@@ -489,22 +563,33 @@ int write_stitch_image(void *data, size_t size, int osii_index)
 	return write_stitch_image_ex(data, size, osii_index, 0);
 }
 
-int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_image)
+/* Journaled, so that a retry after an interruption resumes the write,
+ * the interrupted one having left the slot free */
+static int write_blob(int fd, off64_t offset, size_t size, struct OSII *osii, void *ctx)
+{
+	struct block_write bw;
+
+	memset(&bw, 0, sizeof(bw));
+	bw.device = MMC_DEV_POS;
+	bw.offset = offset;
+	bw.journal = BLOCK_WRITE_JOURNAL_FILE;
+	return block_write_data(&bw, ctx, size);
+}
+
+static int copy_stitch_file(int fd, off64_t offset, size_t size, struct OSII *osii, void *ctx)
+{
+	return fd_copy(fd, offset, *(int *)ctx, LBA_SIZE, size);
+}
+
+/* Writes the payload of a stitched image of osii record, size bytes after
+ * the first LBA, with writer at the free slot */
+static int write_stitch_payload(struct OSII *osii, size_t size, int osii_index,
+				int large_image, stitch_writer_t writer, void *ctx)
 {
 	struct OSIP_header osip;
-	struct OSII *osii;
-	uint8_t *blob;
 	unsigned max_size_lba;
 	int fd;
 
-	if (check_index_outofbound(osii_index))
-		return -1;
-
-	printf("Writing %zu byte image to osip[%d]\n", size, osii_index);
-	if (crack_stitched_image(data, &osii, &blob)) {
-		fprintf(stderr, "crack_stitched_image fails\n");
-		return -1;
-	}
 	if ((osii->size_of_os_image * LBA_SIZE) != size - LBA_SIZE) {
 		fprintf(stderr, "data format is not correct! \n");
 		return -1;
@@ -560,6 +645,22 @@ int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_ima
 		fprintf(stderr, "unable to find free slot in emmc for osimage!\n");
 		return -1;
 	}
+	/* Write the blob of data out to the disk */
+	fd = open(MMC_DEV_POS, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "fail open %s\n", MMC_DEV_POS);
+		return -1;
+	}
+
+	if (writer(fd, (off64_t)osii->logical_start_block * LBA_SIZE, size - LBA_SIZE, osii, ctx)) {
+		close(fd);
+		return -1;
+	}
+
+	fsync(fd);
+	close(fd);
+
+	/* The writer may have completed osii */
 	if (osii_index >= osip.num_pointers) {
 		osip.num_pointers = osii_index + 1;
 		osip.header_size = (osip.num_pointers * 0x18) + 0x20;
@@ -594,36 +695,69 @@ int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_ima
 		}
 	}
 
-	/* Write the blob of data out to the disk */
-	fd = open(MMC_DEV_POS, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "fail open %s\n", MMC_DEV_POS);
+	/* New data is written out completely, OK to update the OSIP with
+	 * the new LBA values now */
+	return write_OSIP(&osip);
+}
+
+int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_image)
+{
+	struct OSII *osii;
+	uint8_t *blob;
+
+	if (check_index_outofbound(osii_index))
 		return -1;
-	}
-	if (lseek(fd, osii->logical_start_block * LBA_SIZE, SEEK_SET) < 0) {
-		pr_perror("lseek");
-		close(fd);
+
+	printf("Writing %zu byte image to osip[%d]\n", size, osii_index);
+	if (crack_stitched_image(data, &osii, &blob)) {
+		fprintf(stderr, "crack_stitched_image fails\n");
 		return -1;
 	}
+	return write_stitch_payload(osii, size, osii_index, large_image, write_blob, blob);
+}
 
-	size -= LBA_SIZE;
-	while (size) {
-		int ret = write(fd, blob, size);
-		if (ret <= 0 && errno != EINTR) {
-			pr_perror("write");
-			close(fd);
-			return -1;
-		}
-		blob += ret;
-		size -= ret;
+int write_stitch_image_file(const char *filename, int osii_index, int large_image)
+{
+	struct OSII *osii;
+	uint8_t *blob;
+	uint8_t lba[LBA_SIZE];
+	struct stat sb;
+	int fd, ret = -1;
+
+	if (check_index_outofbound(osii_index))
+		return -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < LBA_SIZE) {
+		fprintf(stderr, "%s is not a stitched image\n", filename);
+		goto out;
 	}
 
-	fsync(fd);
+	printf("Writing %lld byte image to osip[%d]\n", (long long)sb.st_size, osii_index);
+	/* Only the header is kept in memory, the payload is streamed */
+	if (safe_read(fd, lba, LBA_SIZE) || crack_stitched_image(lba, &osii, &blob)) {
+		fprintf(stderr, "crack_stitched_image fails\n");
+		goto out;
+	}
+	ret = write_stitch_payload(osii, sb.st_size, osii_index, large_image, copy_stitch_file, &fd);
+out:
 	close(fd);
+	return ret;
+}
 
-	/* New data is written out completely, OK to update the OSIP with
-	 * the new LBA values now */
-	return write_OSIP(&osip);
+int write_stitch_image_stream(struct OSII *osii, int osii_index, stitch_writer_t writer, void *ctx)
+{
+	size_t size = LBA_SIZE + (size_t)osii->size_of_os_image * LBA_SIZE;
+
+	if (check_index_outofbound(osii_index))
+		return -1;
+
+	printf("Writing %zu byte image to osip[%d]\n", size, osii_index);
+	return write_stitch_payload(osii, size, osii_index, 0, writer, ctx);
 }
 
 int get_named_osii_attr(const char *destination, int *instance)
@@ -664,7 +798,28 @@ int get_named_osii_attr(const char *destination, int *instance)
 	return attr;
 }
 
-int get_named_osii_index(const char *destination, enum osip_operation_type operation) {
+static int find_osii_index(const struct OSIP_header *osip, int attr, int instance,
+			   enum osip_operation_type operation)
+{
+	int i;
+	int current_instance = 1;
+
+	for (i = 0; i < osip->num_pointers; i++) {
+		if ((osip->desc[i].attribute & (~1)) == attr) {
+			if (current_instance == instance)
+				return i;
+			current_instance++;
+		}
+	}
+
+	if (current_instance == instance && operation == WRITE_OSIP_HEADER)
+		return osip->num_pointers;
+	return -1;
+}
+
+static int find_named_osii_index(const struct OSIP_header *osip, const char *destination,
+				 enum osip_operation_type operation)
+{
 	int tmp;
 	int attr;
 	int instance = 1;
@@ -681,15 +836,12 @@ int get_named_osii_index(const char *destination, enum osip_operation_type opera
 		return -1;
 	}
 
-	tmp = get_attribute_osii_index(attr, instance, operation);
+	tmp = find_osii_index(osip, attr, instance, operation);
 	fprintf(stderr,"ATTR : %d -> index %d\n",attr,tmp);
 	return tmp;
 }
 
-int get_attribute_osii_index(int attr, int instance, enum osip_operation_type operation)
-{
-	int i;
-	int current_instance = 1;
+int get_named_osii_index(const char *destination, enum osip_operation_type operation) {
 	struct OSIP_header osip;
 
 	if (read_OSIP(&osip)) {
@@ -697,39 +849,66 @@ int get_attribute_osii_index(int attr, int instance, enum osip_operation_type op
 		return -1;
 	}
 
-	for (i = 0; i < osip.num_pointers; i++) {
-		if ((osip.desc[i].attribute & (~1)) == attr) {
-			if (current_instance == instance)
-				return i;
-			current_instance++;
-		}
-	}
-
-	if (current_instance == instance && operation == WRITE_OSIP_HEADER)
-		return osip.num_pointers;
-	return -1;
+	return find_named_osii_index(&osip, destination, operation);
 }
 
-int update_osii(char *destination, int ddr_load_address, int entry_point)
+int get_attribute_osii_index(int attr, int instance, enum osip_operation_type operation)
 {
-	int osii_index;
 	struct OSIP_header osip;
 
-	// destination parameter validity is tested in function get_named_osii_index
-	osii_index = get_named_osii_index(destination, READ_OSIP_HEADER);
-	if (check_index_outofbound(osii_index))
+	if (read_OSIP(&osip)) {
+		fprintf(stderr, "Can't read OSIP!\n");
 		return -1;
+	}
 
-	if (read_OSIP(&osip)) {
+	return find_osii_index(&osip, attr, instance, operation);
+}
+
+int osip_edit_begin(struct osip_edit *edit)
+{
+	edit->dirty = false;
+	if (read_OSIP(&edit->osip)) {
 		fprintf(stderr, "Can't read OSIP!\n");
 		return -1;
 	}
+	return 0;
+}
+
+int osip_edit_osii(struct osip_edit *edit, const char *destination,
+		   int ddr_load_address, int entry_point)
+{
+	int osii_index;
+
+	// destination parameter validity is tested in function find_named_osii_index
+	osii_index = find_named_osii_index(&edit->osip, destination, READ_OSIP_HEADER);
+	if (check_index_outofbound(osii_index))
+		return -1;
 
 	/* Update the pointers of the OS image */
-	osip.desc[osii_index].ddr_load_address = ddr_load_address;
-	osip.desc[osii_index].entry_point = entry_point;
+	edit->osip.desc[osii_index].ddr_load_address = ddr_load_address;
+	edit->osip.desc[osii_index].entry_point = entry_point;
+	edit->dirty = true;
+	return 0;
+}
 
-	return write_OSIP(&osip);
+int osip_edit_commit(struct osip_edit *edit)
+{
+	if (!edit->dirty)
+		return 0;
+	edit->dirty = false;
+	/* write_OSIP computes the checksum */
+	return write_OSIP(&edit->osip);
+}
+
+int update_osii(char *destination, int ddr_load_address, int entry_point)
+{
+	struct osip_edit edit;
+
+	if (osip_edit_begin(&edit))
+		return -1;
+	if (osip_edit_osii(&edit, destination, ddr_load_address, entry_point))
+		return -1;
+	return osip_edit_commit(&edit);
 }
 
 int invalidate_osii(char *destination)
@@ -758,12 +937,16 @@ int oem_write_osip_header(int argc, char **argv)
 		.header_size = 0
 	};
 
+	struct osip_edit edit;
+
 	fprintf(stderr, "Write OSIP header\n");
-	default_osip.header_checksum = get_osip_crc(&default_osip);
-	write_OSIP(&default_osip);
-	restore_osii("boot");
-	restore_osii("recovery");
-	restore_osii("fastboot");
+	/* The default header and its restored pointers, in a single write */
+	edit.osip = default_osip;
+	edit.dirty = true;
+	osip_edit_osii(&edit, "boot", DDR_LOAD_ADDX, ENTRY_POINT);
+	osip_edit_osii(&edit, "recovery", DDR_LOAD_ADDX, ENTRY_POINT);
+	osip_edit_osii(&edit, "fastboot", DDR_LOAD_ADDX, ENTRY_POINT);
+	osip_edit_commit(&edit);
 	return 0;
 }
 
@@ -794,3 +977,66 @@ int64_t get_named_osii_logical_start_block(const char *destination)
 	osii = &osip.desc[osii_index];
 	return  osii->logical_start_block;
 }
+
+/* The OS images are stored without their first LBA, the OSIP record */
+typedef char bootheader_lba_check[(SECTOR_SIZE == LBA_SIZE) ? 1 : -1];
+
+int update_osimage_cmdline(const char *destination, const char *cmdline)
+{
+	struct OSIP_header osip;
+	struct OSII *osii;
+	struct bootheader orig, hdr;
+	uint64_t payload;
+	off64_t offset;
+	int osii_index, fd, ret;
+
+	osii_index = get_named_osii_index(destination, READ_OSIP_HEADER);
+	if (check_index_outofbound(osii_index))
+		return -1;
+	if (read_OSIP(&osip)) {
+		fprintf(stderr, "read_OSIP fails\n");
+		return -1;
+	}
+	osii = &osip.desc[osii_index];
+	if (osii->attribute != ATTR_UNSIGNED_KERNEL)
+		fprintf(stderr, "%s is signed, its new cmdline may not verify\n", destination);
+
+	fd = open(MMC_DEV_POS, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "fail open %s\n", MMC_DEV_POS);
+		return -1;
+	}
+
+	/* Only the bootheader of the image, after its OSIP record */
+	memset(&orig, 0, sizeof(orig));
+	offset = (off64_t)osii->logical_start_block * LBA_SIZE;
+	if (lseek64(fd, offset, SEEK_SET) < 0 ||
+	    safe_read(fd, (uint8_t *)&orig + LBA_SIZE, sizeof(orig) - LBA_SIZE)) {
+		fprintf(stderr, "Can't read the header of %s\n", destination);
+		goto err;
+	}
+	payload = sizeof(orig) + (uint64_t)orig.bzImageSize + orig.initrdSize;
+	if (payload > LBA_SIZE + (uint64_t)osii->size_of_os_image * LBA_SIZE) {
+		fprintf(stderr, "%s has no valid bootheader\n", destination);
+		goto err;
+	}
+
+	hdr = orig;
+	if (bootheader_set_cmdline(&hdr, cmdline)) {
+		fprintf(stderr, "cmdline is too long for %s\n", destination);
+		goto err;
+	}
+	ret = bootheader_patch(fd, offset, &orig, &hdr, LBA_SIZE);
+	if (ret < 0) {
+		pr_perror("Writing the header");
+		goto err;
+	}
+	printf("Patched %d sectors of %s\n", ret, destination);
+
+	fsync(fd);
+	close(fd);
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
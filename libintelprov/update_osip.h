@@ -71,6 +71,8 @@ struct OSIP_header {		// os image profile
 uint8_t get_osip_crc(struct OSIP_header *osip);
 int write_OSIP(struct OSIP_header *osip);
 int read_OSIP(struct OSIP_header *osip);
+/* read_OSIP() reads the header once, until this is called */
+void invalidate_OSIP_cache(void);
 void dump_osip_header(struct OSIP_header *osip);
 void dump_OS_page(struct OSIP_header *osip, int os_index, int numpages);
 
@@ -78,6 +80,14 @@ int read_osimage_data(void **data, size_t * size, int osii_index);
 inline int check_index_outofbound(int osii_index);
 int write_stitch_image(void *data, size_t size, int osii_index);
 int write_stitch_image_ex(void *data, size_t size, int osii_index, int large_image);
+/* Streaming variants, which only hold a chunk of the image in memory */
+int read_osimage_file(const char *filename, int osii_index);
+int write_stitch_image_file(const char *filename, int osii_index, int large_image);
+/* Writes a stitched image produced on the fly. osii gives its kind and
+ * its size, writer writes the payload at offset of fd and may complete
+ * the other fields of osii. The OSIP is only updated if writer succeeds */
+typedef int (*stitch_writer_t) (int fd, off64_t offset, size_t size, struct OSII *osii, void *ctx);
+int write_stitch_image_stream(struct OSII *osii, int osii_index, stitch_writer_t writer, void *ctx);
 int get_named_osii_index(const char *destination, enum osip_operation_type operation);
 int get_named_osii_attr(const char *destination, int *instance);
 int invalidate_osii(char *destination);
@@ -89,6 +99,22 @@ int verify_osip_sizes(struct OSIP_header *osip);
 int oem_write_osip_header(int argc, char **argv);
 int oem_erase_osip_header(int argc, char **argv);
 
+/* Batches edits of the OSIP header: it is read once by osip_edit_begin,
+ * and its checksum computed, written and synced once by osip_edit_commit */
+struct osip_edit {
+	struct OSIP_header osip;
+	bool dirty;
+};
+
+int osip_edit_begin(struct osip_edit *edit);
+int osip_edit_osii(struct osip_edit *edit, const char *destination,
+		   int ddr_load_address, int entry_point);
+int osip_edit_commit(struct osip_edit *edit);
+
+/* Replaces the kernel command line of the OS image of destination in
+ * place, writing only the sectors of its header which change */
+int update_osimage_cmdline(const char *destination, const char *cmdline);
+
 #define ATTR_SIGNED_KERNEL      0
 #define ATTR_UNSIGNED_KERNEL    1
 #define ATTR_SIGNED_COS		0x0A
@@ -29,6 +29,7 @@
 
 #include <bootimg.h>
 
+#include "block_write.h"
 #include "flash.h"
 #include "update_osip.h"
 #include "util.h"
@@ -38,6 +39,62 @@
 
 #define TGT_SIZE_MAX    (LBA_SIZE * OS_MAX_LBA)
 
+/* Last successful verification of the recovery image. It is trusted
+ * while the recovery generation is unchanged, and for VERIFY_MAX_BOOTS
+ * boots at most, to catch the writes made without libintelprov */
+#define VERIFY_RECORD_FILE	"/cache/recovery/recovery_verified"
+#define VERIFY_RECORD_MAGIC	0x52435652
+#define VERIFY_MAX_BOOTS	32
+
+struct verify_record {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t boot_count;
+	uint8_t digest[SHA_DIGEST_SIZE];
+};
+
+/* Returns 1 if the image was verified against digest since its last
+ * write, 0 if it has to be examined */
+static int already_verified(const uint8_t *digest)
+{
+	struct verify_record *record;
+	uint32_t generation;
+	size_t size;
+	int verified = 0;
+
+	if (access(VERIFY_RECORD_FILE, F_OK) || recovery_generation(&generation))
+		return 0;
+	if (file_read(VERIFY_RECORD_FILE, (void **)&record, &size))
+		return 0;
+
+	if (size == sizeof(*record) && record->magic == VERIFY_RECORD_MAGIC
+	    && record->generation == generation && record->boot_count < VERIFY_MAX_BOOTS
+	    && !memcmp(record->digest, digest, SHA_DIGEST_SIZE)) {
+		record->boot_count++;
+		if (file_write_atomic(VERIFY_RECORD_FILE, record, sizeof(*record)))
+			unlink(VERIFY_RECORD_FILE);
+		else
+			verified = 1;
+	}
+	free(record);
+	return verified;
+}
+
+static void save_verification(const uint8_t *digest)
+{
+	struct verify_record record;
+
+	if (recovery_generation(&record.generation)
+	    && new_recovery_generation(&record.generation))
+		return;
+
+	record.magic = VERIFY_RECORD_MAGIC;
+	record.boot_count = 0;
+	memcpy(record.digest, digest, SHA_DIGEST_SIZE);
+	if (file_write_atomic(VERIFY_RECORD_FILE, &record, sizeof(record)))
+		ALOGE("Failed to save the recovery verification");
+}
+
 /* Compare the first SIG_SIZE bytes of the current recovery.img
  * with the SHA1 passed in, to determine if we need to update it.
  * These last bytes have the digital signature from LFSTK and would
@@ -54,6 +111,12 @@ static int check_recovery_header(const char *tgt_sha1, int *needs_patching)
 		return -1;
 	}
 
+	if (already_verified(tgt_digest)) {
+		ALOGI("Recovery signature already verified");
+		*needs_patching = 0;
+		return 0;
+	}
+
 	sig_size = read_image_signature(&buf, RECOVERY_OS_NAME);
 	if (sig_size == -1) {
 		ALOGE("Failed to read boot signature\n");
@@ -63,13 +126,13 @@ static int check_recovery_header(const char *tgt_sha1, int *needs_patching)
 	free(buf);
 
 	*needs_patching = memcmp(src_digest, tgt_digest, SHA_DIGEST_SIZE);
+	if (!*needs_patching)
+		save_verification(tgt_digest);
 	return 0;
 }
 
 static int check_recovery_image(const char *tgt_sha1, int *needs_patching)
 {
-	void *data;
-	int sz;
 	uint8_t tgt_digest[SHA_DIGEST_SIZE];
 	uint8_t expected_tgt_digest[SHA_DIGEST_SIZE];
 
@@ -79,63 +142,81 @@ static int check_recovery_image(const char *tgt_sha1, int *needs_patching)
 	}
 	printf("Good SHA1 digest passed in\n");
 
-	if ((sz = read_image(RECOVERY_OS_NAME, &data)) == -1) {
+	if (already_verified(expected_tgt_digest)) {
+		ALOGI("Recovery image already verified");
+		*needs_patching = 0;
+		return 0;
+	}
+
+	/* Hashed while it is read, the image is never held in memory */
+	if (hash_image(RECOVERY_OS_NAME, BLOCK_WRITE_SHA1, tgt_digest) == -1) {
 		ALOGE("failed to read recovery image");
 		*needs_patching = 1;
 		return 0;
 	}
 	printf("read recovery image success\n");
-	SHA_hash(data, sz, tgt_digest);
 
 	*needs_patching = memcmp(tgt_digest, expected_tgt_digest, SHA_DIGEST_SIZE);
-	free(data);
+	if (!*needs_patching)
+		save_verification(expected_tgt_digest);
 	return 0;
 }
 
-typedef struct {
-	unsigned char *buffer;
-	ssize_t size;
-	ssize_t pos;
-} MemorySinkInfo;
+/* The patched image is written to its partition as it is produced */
+struct patch_fill {
+	void *src_data;
+	int src_size;
+	Value *patch;
+	uint8_t *expected_tgt_digest;
+};
 
-static ssize_t MemorySink(unsigned char *data, ssize_t len, void *token)
+static ssize_t ImageSink(unsigned char *data, ssize_t len, void *token)
 {
-	MemorySinkInfo *msi = (MemorySinkInfo *) token;
-	if (msi->size - msi->pos < len) {
+	if (image_sink_write((struct image_sink *)token, data, len))
 		return -1;
-	}
-	memcpy(msi->buffer + msi->pos, data, len);
-	msi->pos += len;
 	return len;
 }
 
+static int fill_recovery(struct image_sink *sink, void *data)
+{
+	struct patch_fill *fill = (struct patch_fill *)data;
+	SHA_CTX ctx;
+
+	SHA_init(&ctx);
+        printf("before applyimagepatch\n");
+	if (ApplyImagePatch(fill->src_data, fill->src_size, fill->patch, ImageSink, sink, &ctx, NULL)) {
+		ALOGE("Patching process failed");
+		return -1;
+	}
+        printf("after applyimagepatch\n");
+	/* ApplyImagePatch hashed the output while writing it */
+	if (memcmp(SHA_final(&ctx), fill->expected_tgt_digest, SHA_DIGEST_SIZE)) {
+		ALOGE("output recovery image digest mismatch");
+		return -1;
+	}
+	return 0;
+}
+
 static int patch_recovery(const char *src_sha1, const char *tgt_sha1,
 			  unsigned int tgt_size, const char *patchfile)
 {
-	MemorySinkInfo msi;
+	struct patch_fill fill;
 	void *src_data;
-	void *recovery_data;
 	int src_size;
-	int recovery_size;
 	uint8_t expected_src_digest[SHA_DIGEST_SIZE];
 	uint8_t src_digest[SHA_DIGEST_SIZE];
 	uint8_t expected_tgt_digest[SHA_DIGEST_SIZE];
-	uint8_t tgt_digest[SHA_DIGEST_SIZE];
-	SHA_CTX ctx;
 
 	Value patchval;
 
-	msi.buffer = NULL;
 	src_data = NULL;
 	patchval.data = NULL;
-	SHA_init(&ctx);
 
 	if (ParseSha1(src_sha1, expected_src_digest)) {
 		ALOGE("Bad SHA1 src SHA1 digest %s passed in", src_sha1);
 		return -1;
 	}
         printf("src_sha1 : %s\n",src_sha1);
-        printf("expected_digest_src_sha1 : %x\n",expected_src_digest);
 
 	if (ParseSha1(tgt_sha1, expected_tgt_digest)) {
 		ALOGE("Bad SHA1 tgt SHA1 digest %s passed in", tgt_sha1);
@@ -143,7 +224,6 @@ static int patch_recovery(const char *src_sha1, const char *tgt_sha1,
 	}
 
 	src_size = read_image(ANDROID_OS_NAME, &src_data);
-	recovery_size = read_image(RECOVERY_OS_NAME, &recovery_data);
         printf("read size : %d\n",src_size);
 	if (src_size == -1) {
 		ALOGE("Failed to read image %s\n", ANDROID_OS_NAME);
@@ -151,23 +231,15 @@ static int patch_recovery(const char *src_sha1, const char *tgt_sha1,
 	}
 
 	SHA_hash(src_data, src_size, src_digest);
-        printf("digests : %x vs %x\n",src_digest,expected_src_digest);
 	if (memcmp(src_digest, expected_src_digest, SHA_DIGEST_SIZE)) {
 		ALOGE("boot image digests don't match!");
 		goto out;
 	}
 
-	msi.pos = 0;
 	if (tgt_size > TGT_SIZE_MAX) {
 		ALOGE("tgt_size is too big!");
 		goto out;
 	}
-	msi.size = tgt_size;
-	msi.buffer = malloc(tgt_size);
-	if (!msi.buffer) {
-		LOGPERROR("malloc");
-		goto out;
-	}
 
 	if (file_read(patchfile, (void **)&patchval.data, (size_t *) & patchval.size)) {
 		ALOGE("Coudln't read patch data");
@@ -175,18 +247,11 @@ static int patch_recovery(const char *src_sha1, const char *tgt_sha1,
 	}
 	patchval.type = VAL_BLOB;
 
-        printf("before applyimagepatch\n");
-	if (ApplyImagePatch(src_data, src_size, &patchval, MemorySink, &msi, &ctx, NULL)) {
-		ALOGE("Patching process failed");
-		goto out;
-	}
-        printf("after applyimagepatch\n");
-	SHA_hash(msi.buffer, msi.size, tgt_digest);
-	if (memcmp(tgt_digest, expected_tgt_digest, SHA_DIGEST_SIZE)) {
-		ALOGE("output recovery image digest mismatch %s vs %s",tgt_digest,expected_tgt_digest);
-		goto out;
-	}
-	if (flash_recovery_kernel(msi.buffer, msi.size)) {
+	fill.src_data = src_data;
+	fill.src_size = src_size;
+	fill.patch = &patchval;
+	fill.expected_tgt_digest = expected_tgt_digest;
+	if (flash_image_stream(RECOVERY_OS_NAME, tgt_size, fill_recovery, &fill)) {
 		ALOGE("error writing patched recovery image");
 		goto out;
 	}
@@ -195,7 +260,6 @@ static int patch_recovery(const char *src_sha1, const char *tgt_sha1,
 out:
 	free(src_data);
 	free(patchval.data);
-	free(msi.buffer);
 	return 0;
 }
 
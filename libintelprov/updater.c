@@ -20,23 +20,26 @@
 #include <string.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <stdarg.h>
 #include <libgen.h>
 #include <edify/expr.h>
 #include <updater/updater.h>
+#include <applypatch.h>
 #include <common.h>
 #include <cutils/properties.h>
-#include <sys/mman.h>
 
 #include "update_osip.h"
 #include "util.h"
 #include "fw_version_check.h"
+#include "partition_index.h"
 #ifdef TEE_FRAMEWORK
 #include "tee_connector.h"
 #endif
 #include "oem_partition.h"
 
 #include "flash.h"
+#include "block_write.h"
 
 Value *ExtractImageFn(const char *name, State * state, int argc, Expr * argv[])
 {
@@ -82,42 +85,92 @@ done:
 	return ret;
 }
 
-Value *ExecuteOsipFunction(const char *name, State * state, int argc, Expr * argv[], int (*action) (char *))
+/* Sets the pointers of all the destinations, with a single OSIP write */
+Value *ExecuteOsipFunction(const char *name, State * state, int argc, Expr * argv[],
+			   int ddr_load_address, int entry_point)
 {
 	Value *ret = NULL;
-	char *destination = NULL;
+	struct osip_edit edit;
+	char **destinations;
+	int i;
 
-	if (ReadArgs(state, argv, 1, &destination) < 0) {
+	if (argc < 1) {
+		ErrorAbort(state, "%s: Invalid parameters.", name);
 		return NULL;
 	}
 
-	if (destination == NULL || strlen(destination) == 0) {
-		ErrorAbort(state, "destination argument to %s can't be empty", name);
+	destinations = ReadVarArgs(state, argc, argv);
+	if (destinations == NULL)
+		return NULL;
+
+	if (osip_edit_begin(&edit)) {
+		ErrorAbort(state, "%s: Can't read OSIP", name);
 		goto done;
 	}
 
-	if (action(destination) == -1) {
-		ErrorAbort(state, "Error writing %s to OSIP", destination);
+	for (i = 0; i < argc; i++) {
+		if (strlen(destinations[i]) == 0) {
+			ErrorAbort(state, "destination argument to %s can't be empty", name);
+			goto done;
+		}
+		if (osip_edit_osii(&edit, destinations[i], ddr_load_address, entry_point)) {
+			ErrorAbort(state, "Error writing %s to OSIP", destinations[i]);
+			goto done;
+		}
+	}
+
+	if (osip_edit_commit(&edit)) {
+		ErrorAbort(state, "%s: Error writing OSIP", name);
 		goto done;
 	}
 
 	ret = StringValue(strdup("t"));
 
 done:
-	if (destination)
-		free(destination);
+	for (i = 0; i < argc; i++)
+		free(destinations[i]);
+	free(destinations);
 
 	return ret;
 }
 
 Value *InvalidateOsFn(const char *name, State * state, int argc, Expr * argv[])
 {
-	return ExecuteOsipFunction(name, state, argc, argv, invalidate_osii);
+	/* Invalidate the pointers of the OS images */
+	return ExecuteOsipFunction(name, state, argc, argv, 0, 0);
 }
 
 Value *RestoreOsFn(const char *name, State * state, int argc, Expr * argv[])
 {
-	return ExecuteOsipFunction(name, state, argc, argv, restore_osii);
+	return ExecuteOsipFunction(name, state, argc, argv, DDR_LOAD_ADDX, ENTRY_POINT);
+}
+
+Value *UpdateOsCmdlineFn(const char *name, State * state, int argc, Expr * argv[])
+{
+	Value *ret = NULL;
+	char *destination = NULL;
+	char *cmdline = NULL;
+
+	if (ReadArgs(state, argv, 2, &destination, &cmdline) < 0) {
+		return NULL;
+	}
+
+	if (strlen(destination) == 0) {
+		ErrorAbort(state, "destination argument to %s can't be empty", name);
+		goto done;
+	}
+
+	if (update_osimage_cmdline(destination, cmdline)) {
+		ErrorAbort(state, "%s: Error updating the cmdline of %s", name, destination);
+		goto done;
+	}
+
+	ret = StringValue(strdup("t"));
+done:
+	free(destination);
+	free(cmdline);
+
+	return ret;
 }
 
 #define IFWI_BIN_PATH "/tmp/ifwi.bin"
@@ -476,6 +529,23 @@ done:
 	return ret;
 }
 
+/* Moves the recovery progress bar, within the show_progress() of the
+ * script. Only the bar is redrawn, unlike for a ui_print. */
+static void updater_set_progress(void *ctx, double fraction)
+{
+	State *state = (State *)ctx;
+	UpdaterInfo *ui = (UpdaterInfo *)(state->cookie);
+
+	fprintf(ui->cmd_pipe, "set_progress %f\n", fraction);
+	fflush(ui->cmd_pipe);
+}
+
+/* Progress of a raw image write, throttled by progress() */
+static void updater_progress(void *ctx, off64_t done, off64_t total)
+{
+	progress(done, total);
+}
+
 Value *FlashUlpmcFn(const char *name, State * state, int argc, Expr * argv[])
 {
 	Value *ret = NULL;
@@ -498,10 +568,13 @@ Value *FlashUlpmcFn(const char *name, State * state, int argc, Expr * argv[])
 		goto done;
 	}
 
+	util_init_progress(updater_set_progress, state);
 	if (flash_ulpmc(data, size) != 0) {
+		util_init_progress(NULL, NULL);
 		ErrorAbort(state, "flash_ulpmc failed");
 		goto done;
 	}
+	util_init_progress(NULL, NULL);
 
 	/* no error */
 	ret = StringValue(strdup("t"));
@@ -619,16 +692,58 @@ exit:
 	return funret;
 }
 
+/* Writes the image at offset in the eMMC, decompressed if it is a gzip
+ * or LZ4 one. The SHA-1 of the written data is computed while it is
+ * written, and checked if sha1 is not NULL. An interrupted write is
+ * resumed by the next one of the same image. */
+static int write_raw_image(const char *name, State * state, const char *filename,
+			   off64_t offset, const char *sha1)
+{
+	struct block_write bw;
+	unsigned char expected[BLOCK_WRITE_DIGEST_MAX];
+	size_t size = block_write_digest_size(BLOCK_WRITE_SHA1);
+	int ret;
+
+	memset(&bw, 0, sizeof(bw));
+	bw.device = MMC_DEV_POS;
+	bw.offset = offset;
+	bw.flags = BLOCK_WRITE_DECOMPRESS;
+	bw.journal = BLOCK_WRITE_JOURNAL_FILE;
+	bw.progress = updater_progress;
+	bw.ctx = state;
+	if (sha1) {
+		if (hex_to_bytes(sha1, expected, size)) {
+			ErrorAbort(state, "%s: Invalid SHA-1 %s.", name, sha1);
+			return -1;
+		}
+		bw.hash = BLOCK_WRITE_SHA1;
+	}
+
+	util_init_progress(updater_set_progress, state);
+	ret = block_write_file(&bw, filename);
+	util_init_progress(NULL, NULL);
+	/* The image may cover the partition table */
+	invalidate_partition_index();
+	if (ret) {
+		ErrorAbort(state, "%s: Failed to write %s into %s device block.",
+			   name, filename, MMC_DEV_POS);
+		return -1;
+	}
+	if (sha1 && memcmp(bw.digest, expected, size)) {
+		ErrorAbort(state, "%s: SHA-1 of %s does not match %s.", name, filename, sha1);
+		return -1;
+	}
+	return 0;
+}
+
 Value *FlashImageAtOffset(const char *name, State * state, int argc, Expr * argv[])
 {
 	Value *funret = NULL;
 	char *filename, *offset_str;
-	void *data;
-	off_t offset;
-	int fd;
-	int ret;
+	char *sha1 = NULL;
+	off64_t offset;
 
-	if (argc != 2) {
+	if (argc != 2 && argc != 3) {
 		ErrorAbort(state, "%s: Invalid parameters.", name);
 		goto exit;
 	}
@@ -638,62 +753,248 @@ Value *FlashImageAtOffset(const char *name, State * state, int argc, Expr * argv
 		goto exit;
 	}
 
+	/* Optional SHA-1 of the image */
+	if (argc == 3 && ReadArgs(state, argv + 2, 1, &sha1) < 0) {
+		ErrorAbort(state, "%s: ReadArgs failed.", name);
+		goto free;
+	}
+
 	char *end;
-	offset = strtoul(offset_str, &end, 10);
+	errno = 0;
+	offset = strtoull(offset_str, &end, 10);
 	if (*end != '\0' || errno == ERANGE) {
 		ErrorAbort(state, "%s: offset argument parsing failed.", name);
 		goto free;
 	}
 
-	int length = file_size(filename);
-	if (length == -1)
+	if (write_raw_image(name, state, filename, offset, sha1))
+		goto free;
+
+	funret = StringValue(strdup("t"));
+
+free:
+	free(sha1);
+	free(filename);
+	free(offset_str);
+exit:
+	return funret;
+}
+
+static const struct {
+	const char *name;
+	int hash;
+} digest_algorithms[] = {
+	{ "sha1", BLOCK_WRITE_SHA1 },
+	{ "sha256", BLOCK_WRITE_SHA256 },
+	/* Hashed by all the CPUs, see block_write.h */
+	{ "sha256_tree", BLOCK_WRITE_SHA256_TREE },
+};
+
+/* partition_digest(partition, algorithm[, size]): the hexadecimal
+ * digest of the partition, or of its first size bytes */
+Value *PartitionDigestFn(const char *name, State * state, int argc, Expr * argv[])
+{
+	Value *funret = NULL;
+	char *partition, *algorithm, *size_str = NULL;
+	uint8_t digest[BLOCK_WRITE_DIGEST_MAX];
+	char hex[BLOCK_WRITE_DIGEST_MAX * 2 + 1];
+	char *path = NULL, *end;
+	off64_t size;
+	unsigned int i;
+	int hash = -1;
+	int fd = -1;
+
+	if (argc != 2 && argc != 3) {
+		ErrorAbort(state, "%s: Invalid parameters.", name);
+		goto exit;
+	}
+
+	if (ReadArgs(state, argv, 2, &partition, &algorithm) < 0) {
+		ErrorAbort(state, "%s: ReadArgs failed.", name);
+		goto exit;
+	}
+
+	if (argc == 3 && ReadArgs(state, argv + 2, 1, &size_str) < 0) {
+		ErrorAbort(state, "%s: ReadArgs failed.", name);
 		goto free;
+	}
 
-	data = file_mmap(filename, length, false);
-	if (data == MAP_FAILED) {
+	for (i = 0; i < ARRAY_SIZE(digest_algorithms); i++)
+		if (!strcmp(algorithm, digest_algorithms[i].name))
+			hash = digest_algorithms[i].hash;
+	if (hash == -1) {
+		ErrorAbort(state, "%s: Unknown %s digest.", name, algorithm);
 		goto free;
 	}
 
-	fd = open(MMC_DEV_POS, O_WRONLY);
+	if (get_device_path(&path, partition)) {
+		ErrorAbort(state, "%s: No %s partition.", name, partition);
+		goto free;
+	}
+	fd = open(path, O_RDONLY);
 	if (fd == -1) {
-		ErrorAbort(state, "%s: Failed to open %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
-		goto unmmap_file;
-	}
-
-	ret = lseek(fd, offset, SEEK_SET);
-	if (ret == -1) {
-		ErrorAbort(state, "%s: Failed to seek into %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
-		goto close;
-	}
-
-	char *ptr = (char *)data;
-	ret = 0;
-	for (; length; length -= ret, ptr += ret) {
-		ret = write(fd, ptr, length);
-		if (ret == -1) {
-			ErrorAbort(state, "%s: Failed to write into %s device block, %s.",
-				   name, MMC_DEV_POS, strerror(errno));
-			goto close;
+		ErrorAbort(state, "%s: Failed to open %s, %s.", name, path, strerror(errno));
+		goto free;
+	}
+
+	size = lseek64(fd, 0, SEEK_END);
+	if (size_str) {
+		errno = 0;
+		off64_t length = strtoull(size_str, &end, 10);
+		if (*end != '\0' || errno == ERANGE || length > size) {
+			ErrorAbort(state, "%s: Invalid size %s.", name, size_str);
+			goto free;
 		}
+		size = length;
 	}
 
-	ret = fsync(fd);
-	if (ret == -1) {
-		ErrorAbort(state, "%s: Failed to sync %s, %s.", name, MMC_DEV_POS, strerror(errno));
-		goto close;
+	if (size < 0 || block_digest_fd(fd, 0, size, hash, digest)) {
+		ErrorAbort(state, "%s: Failed to hash %s.", name, partition);
+		goto free;
+	}
+
+	for (i = 0; i < block_write_digest_size(hash); i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	funret = StringValue(strdup(hex));
+
+free:
+	if (fd != -1)
+		close(fd);
+	free(path);
+	free(size_str);
+	free(partition);
+	free(algorithm);
+exit:
+	return funret;
+}
+
+/* The patched image is written as it is produced */
+struct image_patch {
+	const unsigned char *src_data;
+	ssize_t src_size;
+	Value *patch;
+	const uint8_t *expected_tgt_digest;
+};
+
+static ssize_t image_patch_sink(unsigned char *data, ssize_t len, void *token)
+{
+	if (image_sink_write((struct image_sink *)token, data, len))
+		return -1;
+	return len;
+}
+
+static int fill_patched_image(struct image_sink *sink, void *ctx)
+{
+	struct image_patch *patch = (struct image_patch *)ctx;
+	SHA_CTX sha;
+	int ret;
+
+	SHA_init(&sha);
+	if (patch->patch->size >= 8 && !memcmp(patch->patch->data, "IMGDIFF2", 8)) {
+		ret = ApplyImagePatch(patch->src_data, patch->src_size, patch->patch,
+				      image_patch_sink, sink, &sha, NULL);
+	} else if (patch->patch->size >= 8 && !memcmp(patch->patch->data, "BSDIFF40", 8)) {
+		ret = ApplyBSDiffPatch(patch->src_data, patch->src_size, patch->patch, 0,
+				       image_patch_sink, sink, &sha);
+	} else {
+		error("Unknown patch format\n");
+		return -1;
+	}
+	if (ret) {
+		error("Failed to apply the patch\n");
+		return -1;
+	}
+	/* Before the new image replaces the old one, on OSIP */
+	if (memcmp(SHA_final(&sha), patch->expected_tgt_digest, SHA_DIGEST_SIZE)) {
+		error("Patched image digest mismatch\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* apply_image_patch(target, source, src_sha1, tgt_sha1, tgt_size, patch):
+ * writes the target image patched from the current source one, e.g. an
+ * OSIP entry from itself. On OSIP, the OS slot is only switched to the
+ * new image once its digest is checked. On GPT, it is written in place,
+ * so target should not be the running image. */
+Value *ApplyImagePatchFn(const char *name, State * state, int argc, Expr * argv[])
+{
+	Value *funret = NULL;
+	char *target, *source, *src_sha1, *tgt_sha1, *tgt_size_str, *patchfile;
+	uint8_t expected_src_digest[SHA_DIGEST_SIZE];
+	uint8_t expected_tgt_digest[SHA_DIGEST_SIZE];
+	uint8_t src_digest[SHA_DIGEST_SIZE];
+	struct image_patch patch;
+	void *src_data = NULL;
+	Value patchval;
+	size_t tgt_size;
+	int src_size;
+	char *end;
+
+	patchval.data = NULL;
+
+	if (argc != 6) {
+		ErrorAbort(state, "%s: Invalid parameters.", name);
+		goto exit;
+	}
+
+	if (ReadArgs(state, argv, 6, &target, &source, &src_sha1, &tgt_sha1,
+		     &tgt_size_str, &patchfile) < 0) {
+		ErrorAbort(state, "%s: ReadArgs failed.", name);
+		goto exit;
+	}
+
+	if (ParseSha1(src_sha1, expected_src_digest) ||
+	    ParseSha1(tgt_sha1, expected_tgt_digest)) {
+		ErrorAbort(state, "%s: Invalid SHA-1.", name);
+		goto free;
+	}
+
+	errno = 0;
+	tgt_size = strtoul(tgt_size_str, &end, 10);
+	if (*end != '\0' || errno == ERANGE || !tgt_size) {
+		ErrorAbort(state, "%s: Invalid target size %s.", name, tgt_size_str);
+		goto free;
+	}
+
+	src_size = read_image(source, &src_data);
+	if (src_size < 0) {
+		ErrorAbort(state, "%s: Failed to read the %s image.", name, source);
+		goto free;
+	}
+	SHA_hash(src_data, src_size, src_digest);
+	if (memcmp(src_digest, expected_src_digest, SHA_DIGEST_SIZE)) {
+		ErrorAbort(state, "%s: SHA-1 of the %s image does not match %s.",
+			   name, source, src_sha1);
+		goto free;
+	}
+
+	if (file_read(patchfile, (void **)&patchval.data, (size_t *)&patchval.size)) {
+		ErrorAbort(state, "%s: Failed to read %s.", name, patchfile);
+		goto free;
+	}
+	patchval.type = VAL_BLOB;
+
+	patch.src_data = (const unsigned char *)src_data;
+	patch.src_size = src_size;
+	patch.patch = &patchval;
+	patch.expected_tgt_digest = expected_tgt_digest;
+	if (flash_image_stream(target, tgt_size, fill_patched_image, &patch)) {
+		ErrorAbort(state, "%s: Failed to write the patched %s image.", name, target);
+		goto free;
 	}
 
 	funret = StringValue(strdup("t"));
 
-close:
-	close(fd);
-unmmap_file:
-	munmap(data, length);
 free:
-	free(filename);
-	free(offset_str);
+	free(patchval.data);
+	free(src_data);
+	free(target);
+	free(source);
+	free(src_sha1);
+	free(tgt_sha1);
+	free(tgt_size_str);
+	free(patchfile);
 exit:
 	return funret;
 }
@@ -713,25 +1014,80 @@ Value *FlashPartition(const char *name, State * state, int argc, Expr * argv[])
 	 * are still mounted, reload would failed.  */
 	oem_partition_disable_cmd_reload();
 
+	/* A nuke of a volume moves the progress bar */
+	util_init_progress(updater_set_progress, state);
 	property_set("sys.partitioning", "1");
 	ret = CommandFunction(oem_partition_cmd_handler, name, state, argc, argv);
 	property_set("sys.partitioning", "0");
+	util_init_progress(NULL, NULL);
 
 	return ret;
 }
 
-#define PARTITION_UPDATE "/tmp/partition_update.tbl"
+/* The partition file of the OTA, parsed once for all the functions
+ * which need it */
+static struct partition_file partition_plan;
+static char *partition_plan_name;
+
+static struct partition_file *get_partition_plan(const char *filename)
+{
+	if (partition_plan_name && !strcmp(partition_plan_name, filename))
+		return &partition_plan;
+
+	if (partition_plan_name) {
+		partition_file_free(&partition_plan);
+		free(partition_plan_name);
+		partition_plan_name = NULL;
+	}
+	if (partition_file_load(filename, &partition_plan))
+		return NULL;
+	partition_plan_name = strdup(filename);
+	if (!partition_plan_name) {
+		partition_file_free(&partition_plan);
+		return NULL;
+	}
+	return &partition_plan;
+}
+
+/* Appends a copy of cmd to pf, whose cmds can hold it */
+static int copy_partition_cmd(struct partition_file *pf, const struct partition_cmd *cmd)
+{
+	struct partition_cmd *copy = &pf->cmds[pf->count];
+	int i;
+
+	copy->argv = calloc(cmd->argc, sizeof(*copy->argv));
+	if (!copy->argv)
+		return -1;
+	copy->argc = cmd->argc;
+	pf->count++;
+	for (i = 0; i < cmd->argc; i++) {
+		copy->argv[i] = strdup(cmd->argv[i]);
+		if (!copy->argv[i])
+			return -1;
+	}
+	return 0;
+}
+
+static int set_partition_arg(char **arg, const char *fmt, int64_t value)
+{
+	char *str;
+
+	if (asprintf(&str, fmt, value) == -1)
+		return -1;
+	free(*arg);
+	*arg = str;
+	return 0;
+}
 
 Value *FlashOsipToGPTPartition(const char *name, State * state, int argc, Expr * argv[])
 {
-	FILE *fp, *fp_update;
+	struct partition_file *plan;
+	struct partition_file update;
+	struct partition_cmd *cmd;
 	char *filename;
-	char buffer[K_MAX_ARG_LEN];
-	char partition_type[K_MAX_ARG_LEN];
-	char **gpt_argv = NULL;
+	char **gpt_argv;
 	unsigned int j;
-	int i, gpt_argc = 0;
-	Value *ret = NULL;
+	int i, k, gpt_argc;
 	struct OSIP_header osip;
 
 
@@ -754,47 +1110,26 @@ Value *FlashOsipToGPTPartition(const char *name, State * state, int argc, Expr *
 	}
 	dump_osip_header(&osip);
 
-	/* Open partition and partition update files */
-	fp = fopen(filename, "r");
-	if (!fp) {
-		ErrorAbort(state, "%s: Can't open %s partition file.", name, filename);
-		free(filename);
-		ret = StringValue(strdup(""));
-		goto exit;
-	}
-	fp_update = fopen(PARTITION_UPDATE, "w+");
-	if (!fp_update) {
-		ErrorAbort(state, "%s: Can't create %s partition file\n", name, PARTITION_UPDATE);
-		fclose(fp);
-		free(filename);
-		ret = StringValue(strdup(""));
-		goto exit;
+	plan = get_partition_plan(filename);
+	free(filename);
+	if (!plan) {
+		ErrorAbort(state, "%s: Can't load the partition file.", name);
+		return StringValue(strdup(""));
 	}
 
-	/* Check first line of partition file */
-	memset(buffer, 0, sizeof(buffer));
-	if (!fgets(buffer, sizeof(buffer), fp)) {
-		ErrorAbort(state, "partition file is empty");
-		ret = StringValue(strdup(""));
-		goto error;
-	}
-	buffer[strlen(buffer) - 1] = '\0';
-	if (sscanf(buffer, "%*[^=]=%255s", partition_type) != 1) {
-		ErrorAbort(state, "partition file is invalid");
-		ret = StringValue(strdup(""));
-		goto error;
+	/* The plan is kept as it is for the next functions */
+	memset(&update, 0, sizeof(update));
+	strcpy(update.type, plan->type);
+	update.cmds = calloc(plan->count ? plan->count : 1, sizeof(*update.cmds));
+	if (!update.cmds) {
+		ErrorAbort(state, "%s: Can't allocate the partition update.", name);
+		return StringValue(strdup(""));
 	}
 
-	/* Write first line in update file */
-	fprintf(fp_update, "%s\n", buffer);
-
-	/* parse partitition files line to catch update_partitions */
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (buffer[strlen(buffer) - 1] == '\n')
-			buffer[strlen(buffer) - 1] = '\0';
-		gpt_argv = str_to_array(buffer, &gpt_argc);
-		if (gpt_argv == NULL)
-			continue;
+	/* catch the update_partitions in the commands */
+	for (k = 0; k < plan->count; k++) {
+		gpt_argv = plan->cmds[k].argv;
+		gpt_argc = plan->cmds[k].argc;
 		char *command = gpt_argv[0];
 		uint64_t  size, lba_start;
 		int64_t osii_lba;
@@ -814,7 +1149,6 @@ Value *FlashOsipToGPTPartition(const char *name, State * state, int argc, Expr *
 					if (0 == strncmp(update_partitions[j], gpt_argv[i], strlen(gpt_argv[i]))) {
 						if ((osii_lba = get_named_osii_logical_start_block(gpt_argv[i])) == -1) {
 							ErrorAbort(state, "Unable to get LBA of %s partition", gpt_argv[i]);
-							ret = StringValue(strdup(""));
 							goto error;
 						}
 						printf("Found %s partition at osii_lba %"PRId64"\n", gpt_argv[i], osii_lba);
@@ -825,93 +1159,79 @@ Value *FlashOsipToGPTPartition(const char *name, State * state, int argc, Expr *
 				if (update_need || !update_write)
 					break;
 			}
+		}
 
-			/* update size and LBA */
-			if (update_need) {
-				for (i = 0; i < gpt_argc; i++) {
-					if (0 == strncmp("-s", gpt_argv[i], strlen(gpt_argv[i]))) {
-						size = strtoull(gpt_argv[i+1], &e, 0);
-						if (e && *e) {
-							ErrorAbort(state, "Unable to get size of partition %s", buffer);
-							ret = StringValue(strdup(""));
-							goto error;
-						}
-						printf("Size was %"PRIu64" new is %u \n", size, OS_MAX_LBA);
-						sprintf(gpt_argv[i+1],"%d", OS_MAX_LBA);
-					}
-					if (0 == strncmp("-b", gpt_argv[i], strlen(gpt_argv[i]))) {
-						lba_start = strtoull(gpt_argv[i+1], &e, 0);
-						if (e && *e) {
-							ErrorAbort(state, "Unable to get LBA of partition %s", buffer);
-							ret = StringValue(strdup(""));
-							goto error;
-						}
-						printf("LBA was %"PRIu64" new is %"PRId64" \n", lba_start, osii_lba);
-						sprintf(gpt_argv[i+1],"%"PRId64"", osii_lba);
-					}
-				}
-			}
+		if (!update_write)
+			continue;
+		if (copy_partition_cmd(&update, &plan->cmds[k])) {
+			ErrorAbort(state, "%s: Can't allocate the partition update.", name);
+			goto error;
 		}
+		if (!update_need)
+			continue;
 
-		/* write lines in partition update */
-		for (i = 0; i < gpt_argc; i++) {
-			if (update_write)
-				fprintf(fp_update,"%s ",gpt_argv[i]);
-			free(gpt_argv[i]);
-			gpt_argv[i] = NULL;
+		/* update size and LBA */
+		cmd = &update.cmds[update.count - 1];
+		for (i = 0; i + 1 < gpt_argc; i++) {
+			if (0 == strncmp("-s", gpt_argv[i], strlen(gpt_argv[i]))) {
+				size = strtoull(gpt_argv[i+1], &e, 0);
+				if (e && *e) {
+					ErrorAbort(state, "Unable to get size of partition %s", gpt_argv[i+1]);
+					goto error;
+				}
+				printf("Size was %"PRIu64" new is %u \n", size, OS_MAX_LBA);
+				if (set_partition_arg(&cmd->argv[i+1], "%"PRId64, OS_MAX_LBA)) {
+					ErrorAbort(state, "%s: Can't allocate the partition update.", name);
+					goto error;
+				}
+			}
+			if (0 == strncmp("-b", gpt_argv[i], strlen(gpt_argv[i]))) {
+				lba_start = strtoull(gpt_argv[i+1], &e, 0);
+				if (e && *e) {
+					ErrorAbort(state, "Unable to get LBA of partition %s", gpt_argv[i+1]);
+					goto error;
+				}
+				printf("LBA was %"PRIu64" new is %"PRId64" \n", lba_start, osii_lba);
+				if (set_partition_arg(&cmd->argv[i+1], "%"PRId64, osii_lba)) {
+					ErrorAbort(state, "%s: Can't allocate the partition update.", name);
+					goto error;
+				}
+			}
 		}
-		if (update_write)
-			fprintf(fp_update,"\n");
-		free(gpt_argv);
-		gpt_argv = NULL;
 	}
 
-	/* Ensure to close fp_update as it will be re-open by oem_partition_cmd_handler */
-	free(filename);
-	fclose(fp);
-	fclose(fp_update);
-
-	/* partition with new partition file */
+	/* partition with the updated commands */
 	property_set("sys.partitioning", "1");
 
-	char *path[] = {0,PARTITION_UPDATE};
 	int partret = -1;
 
-	if ((partret = oem_partition_cmd_handler(2,(char **)path)) == -1) {
+	if ((partret = oem_partition_run(&update)) == -1) {
 		ErrorAbort(state, "%s: re-partitionning fails with error %d", name, partret);
-		ret = StringValue(strdup(""));
+		property_set("sys.partitioning", "0");
+		goto error;
 	}
-	else
-		ret = StringValue(strdup("t"));
 	property_set("sys.partitioning", "0");
 
-	goto exit;
+	partition_file_free(&update);
+	return StringValue(strdup("t"));
 
 error:
-	free(filename);
-	fclose(fp);
-	fclose(fp_update);
-exit:
-	return ret;
+	partition_file_free(&update);
+	return StringValue(strdup(""));
 }
 
 
 Value *FlashImageAtPartition(const char *name, State * state, int argc, Expr * argv[])
 {
-	Value *funret = NULL;
+	struct partition_file *plan;
 	char *osname, *filename, *parttable;
-	void *data;
-	off_t offset = 0;
-	int fd;
-	FILE *fp;
-	char buffer[K_MAX_ARG_LEN];
-	char partition_type[K_MAX_ARG_LEN];
-	char **gpt_argv = NULL;
-	int i, gpt_argc = 0;
+	char *sha1 = NULL;
+	off64_t offset = 0;
+	char **gpt_argv;
+	int i, k, gpt_argc;
 	Value *ret = NULL;
-	int fret;
 
-	if (argc != 3) {
+	if (argc != 3 && argc != 4) {
 		ErrorAbort(state, "%s: Invalid parameters.", name);
 		goto exit;
 	}
@@ -921,36 +1241,25 @@ Value *FlashImageAtPartition(const char *name, State * state, int argc, Expr * a
 		goto exit;
 	}
 
-	/* Open partition file */
-	fp = fopen(parttable, "r");
-	if (!fp) {
-		ErrorAbort(state, "%s: Can't open %s partition file.", name, parttable);
+	/* Optional SHA-1 of the image */
+	if (argc == 4 && ReadArgs(state, argv + 3, 1, &sha1) < 0) {
+		ErrorAbort(state, "%s: ReadArgs failed.", name);
 		ret = StringValue(strdup(""));
 		goto free;
 	}
 
-	/* Check first line of partition file */
-	memset(buffer, 0, sizeof(buffer));
-	if (!fgets(buffer, sizeof(buffer), fp)) {
-		ErrorAbort(state, "partition file is empty");
-		ret = StringValue(strdup(""));
-		goto free;
-	}
-	buffer[strlen(buffer) - 1] = '\0';
-	if (sscanf(buffer, "%*[^=]=%255s", partition_type) != 1) {
-		ErrorAbort(state, "partition file is invalid");
+	plan = get_partition_plan(parttable);
+	if (!plan) {
+		ErrorAbort(state, "%s: Can't load %s partition file.", name, parttable);
 		ret = StringValue(strdup(""));
 		goto free;
 	}
 
 	bool found = false;
-	/* parse partitition files line to catch osname */
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (buffer[strlen(buffer) - 1] == '\n')
-			buffer[strlen(buffer) - 1] = '\0';
-		gpt_argv = str_to_array(buffer, &gpt_argc);
-		if (gpt_argv == NULL)
-			continue;
+	/* look for osname in the commands */
+	for (k = 0; k < plan->count && !found; k++) {
+		gpt_argv = plan->cmds[k].argv;
+		gpt_argc = plan->cmds[k].argc;
 		char *command = gpt_argv[0];
 		char* e;
 		/* catch add commands */
@@ -964,90 +1273,39 @@ Value *FlashImageAtPartition(const char *name, State * state, int argc, Expr * a
 			}
 			/* get offset of osname */
 			if (found) {
-				for (i=0; i < gpt_argc; i++) {
+				for (i=0; i + 1 < gpt_argc; i++) {
 					if (0 == strncmp("-b", gpt_argv[i], strlen(gpt_argv[i]))) {
 						offset = strtoull(gpt_argv[i+1], &e, 0) * 512;
 						if (e && *e) {
-							ErrorAbort(state, "Unable to get LBA of partition %s", buffer);
+							ErrorAbort(state, "Unable to get LBA of partition %s", gpt_argv[i+1]);
 							ret = StringValue(strdup(""));
 							goto free;
 						}
-						printf("at LBA %s offset % ld \n", gpt_argv[i+1], offset);
+						printf("at LBA %s offset %lld \n", gpt_argv[i+1], (long long)offset);
 					}
 				}
 			}
 		}
-		/* free gpt_argv */
-		for (i = 0; i < gpt_argc; i++) {
-			free(gpt_argv[i]);
-			gpt_argv[i] = NULL;
-		}
-		free(gpt_argv);
-		gpt_argv = NULL;
-		if (found)
-			break;
 	}
-	fclose(fp);
 
 	if (!found) {
 		ErrorAbort(state, "partition %s not found in %s", name, parttable);
 		ret = StringValue(strdup(""));
 		goto free;
 	} else {
-		printf("%s: found partition %s at offset %ld\n", name, osname, offset);
+		printf("%s: found partition %s at offset %lld\n", name, osname, (long long)offset);
 	}
 
 	/* Flash image at offset */
-	int length = file_size(filename);
-	if (length == -1)
-		goto free;
-
-	data = file_mmap(filename, length, false);
-	if (data == MAP_FAILED) {
-		goto free;
-	}
-
-	fd = open(MMC_DEV_POS, O_WRONLY);
-	if (fd == -1) {
-		ErrorAbort(state, "%s: Failed to open %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
-		goto unmmap_file;
-	}
-
-	fret = lseek(fd, offset, SEEK_SET);
-	if (fret == -1) {
-		ErrorAbort(state, "%s: Failed to seek into %s device block, %s.",
-			   name, MMC_DEV_POS, strerror(errno));
+	if (write_raw_image(name, state, filename, offset, sha1)) {
 		ret = StringValue(strdup(""));
-		goto close;
-	}
-
-	char *ptr = (char *)data;
-	fret = 0;
-	for (; length; length -= fret, ptr += fret) {
-		fret = write(fd, ptr, length);
-		if (fret == -1) {
-			ErrorAbort(state, "%s: Failed to write into %s device block, %s.",
-				   name, MMC_DEV_POS, strerror(errno));
-			ret = StringValue(strdup(""));
-			goto close;
-		}
-	}
-
-	fret = fsync(fd);
-	if (fret == -1) {
-		ErrorAbort(state, "%s: Failed to sync %s, %s.", name, MMC_DEV_POS, strerror(errno));
-		ret = StringValue(strdup(""));
-		goto close;
+		goto free;
 	}
 
 	ret = StringValue(strdup("t"));
 
-close:
-	close(fd);
-unmmap_file:
-	munmap(data, length);
 free:
+	free(sha1);
 	free(osname);
 	free(filename);
 	free(parttable);
@@ -1055,7 +1313,6 @@ exit:
 	return ret;
 }
 
-
 Value *EraseOsipHeader(const char *name, State * state, int argc, Expr * argv[])
 {
 	Value *ret = NULL;
@@ -1074,6 +1331,7 @@ void Register_libintel_updater(void)
 	RegisterFunction("extract_image", ExtractImageFn);
 	RegisterFunction("invalidate_os", InvalidateOsFn);
 	RegisterFunction("restore_os", RestoreOsFn);
+	RegisterFunction("update_os_cmdline", UpdateOsCmdlineFn);
 
 	RegisterFunction("flash_capsule", FlashCapsuleFn);
 	RegisterFunction("flash_esp_update", FlashEspUpdateFn);
@@ -1082,6 +1340,8 @@ void Register_libintel_updater(void)
 	RegisterFunction("flash_osiptogpt_partition", FlashOsipToGPTPartition);
 	RegisterFunction("flash_image_at_partition", FlashImageAtPartition);
 	RegisterFunction("flash_image_at_offset", FlashImageAtOffset);
+	RegisterFunction("partition_digest", PartitionDigestFn);
+	RegisterFunction("apply_image_patch", ApplyImagePatchFn);
 	RegisterFunction("flash_os_image", FlashOSImage);
 	RegisterFunction("write_osip_image", FlashOSImage);
 	RegisterFunction("erase_osip", EraseOsipHeader);
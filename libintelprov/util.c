@@ -23,10 +23,15 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
 
 #include "util.h"
 
@@ -50,6 +55,24 @@ int safe_read(int fd, void *data, size_t size)
 	return 0;
 }
 
+int safe_write(int fd, const void *data, size_t size)
+{
+	int ret;
+	const unsigned char *bytes = (const unsigned char *)data;
+	while (size) {
+		ret = write(fd, bytes, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			pr_perror("write");
+			return -1;
+		}
+		size -= ret;
+		bytes += ret;
+	}
+	return 0;
+}
+
 int file_read(const char *filename, void **datap, size_t * szp)
 {
 	struct stat sb;
@@ -114,6 +137,135 @@ int file_write(const char *filename, const void *data, size_t sz)
 	return 0;
 }
 
+/* The data is written to filename.tmp then renamed, so that filename is
+ * either the former file or the complete new one after a power loss */
+int file_write_atomic(const char *filename, const void *data, size_t sz)
+{
+	char *tmp = NULL;
+	char *dir = NULL;
+	int ret = -1;
+	int fd;
+
+	if (asprintf(&tmp, "%s.tmp", filename) == -1) {
+		tmp = NULL;
+		goto out;
+	}
+	dir = strdup(filename);
+	if (!dir)
+		goto out;
+
+	if (file_write(tmp, data, sz))
+		goto out;
+
+	if (rename(tmp, filename)) {
+		printf("file_write_atomic: Can't rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	/* The rename itself has to reach the disk */
+	fd = open(dirname(dir), O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	ret = 0;
+
+out:
+	free(tmp);
+	free(dir);
+	return ret;
+}
+
+/* Chunk of the copies which go through a buffer */
+#define COPY_CHUNK	(1024 * 1024)
+
+static int copy_range(int out_fd, off64_t *out_offset, int in_fd, off64_t *in_offset, size_t *size)
+{
+#ifdef __NR_copy_file_range
+	while (*size) {
+		loff_t in_off = *in_offset, out_off = *out_offset;
+		ssize_t ret = syscall(__NR_copy_file_range, in_fd, &in_off, out_fd, &out_off, *size, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret == 0 ? -1 : -errno;
+		*in_offset += ret;
+		*out_offset += ret;
+		*size -= ret;
+	}
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+static int send_range(int out_fd, off64_t *out_offset, int in_fd, off64_t *in_offset, size_t *size)
+{
+	off_t offset = *in_offset;
+
+	/* sendfile works at the current position of out_fd, with an
+	 * offset of in_fd which may be only 32 bits wide */
+	if (offset != *in_offset || (off64_t)(offset + *size) < offset)
+		return -EOVERFLOW;
+	if (lseek64(out_fd, *out_offset, SEEK_SET) < 0)
+		return -errno;
+
+	while (*size) {
+		ssize_t ret = sendfile(out_fd, in_fd, &offset, *size > COPY_CHUNK ? COPY_CHUNK : *size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret == 0 ? -1 : -errno;
+		*in_offset += ret;
+		*out_offset += ret;
+		*size -= ret;
+	}
+	return 0;
+}
+
+int fd_copy(int out_fd, off64_t out_offset, int in_fd, off64_t in_offset, size_t size)
+{
+	unsigned char *buf;
+	int ret;
+
+	/* In the kernel, between files of a same filesystem, or at least
+	 * without going through a user space buffer. Both fall back on
+	 * the next way from where they stopped. */
+	ret = copy_range(out_fd, &out_offset, in_fd, &in_offset, &size);
+	if (ret == 0)
+		return 0;
+	ret = send_range(out_fd, &out_offset, in_fd, &in_offset, &size);
+	if (ret == 0)
+		return 0;
+	if (ret == -1) {
+		error("Unexpected end of file while copying");
+		return -1;
+	}
+
+	buf = malloc(size < COPY_CHUNK ? size : COPY_CHUNK);
+	if (!buf) {
+		pr_perror("malloc");
+		return -1;
+	}
+
+	ret = -1;
+	if (lseek64(in_fd, in_offset, SEEK_SET) < 0 || lseek64(out_fd, out_offset, SEEK_SET) < 0) {
+		pr_perror("lseek");
+		goto out;
+	}
+	while (size) {
+		size_t len = size < COPY_CHUNK ? size : COPY_CHUNK;
+		if (safe_read(in_fd, buf, len) || safe_write(out_fd, buf, len))
+			goto out;
+		size -= len;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
 /**
  * Copies a file from specified source to destination.
  *
@@ -128,8 +280,8 @@ int file_copy(const char *src, const char *dst)
 	int ret = -1;
 	int in_fd = -1;
 	int out_fd = -1;
+	bool copied = false;
 	struct stat sb;
-	off_t offset = 0;
 
 	if (!src || !dst) {
 		error("Wrong input");
@@ -153,9 +305,11 @@ int file_copy(const char *src, const char *dst)
 		goto out;
 	}
 
-	if (sendfile(out_fd, in_fd, &offset, sb.st_size) == -1) {
+	if (fd_copy(out_fd, 0, in_fd, 0, sb.st_size)) {
 		error("Copying file failed (errno = %s)", strerror(errno));
+		goto out;
 	}
+	copied = true;
 
 out:
 	if (in_fd >= 0)
@@ -163,7 +317,7 @@ out:
 	if (out_fd >= 0) {
 		if (close(out_fd) < 0)
 			error("Error while closing %s: %d", dst, errno);
-		else
+		else if (copied)
 			ret = 0;
 	}
 
@@ -275,6 +429,25 @@ int is_hex(char c)
 	return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
 }
 
+static unsigned char hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	return (c | 0x20) - 'a' + 10;
+}
+
+int hex_to_bytes(const char *str, unsigned char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (!is_hex(str[2 * i]) || !is_hex(str[2 * i + 1]))
+			return -1;
+		buf[i] = hex_value(str[2 * i]) << 4 | hex_value(str[2 * i + 1]);
+	}
+	return str[2 * size] == '\0' ? 0 : -1;
+}
+
 void eprintf(const char *msg)
 {
 	fprintf(stderr, "%s", msg);
@@ -286,159 +459,425 @@ static void (*print_fun) (const char *msg) = (void (*)(const char *))printf;
 
 #define MSG_BUF_LENGTH 256
 
-void error(const char *fmt, ...)
+int util_log_level = LOG_LEVEL_DEBUG;
+
+static void emit_message(bool is_error, const char *buf)
 {
+	if (is_error) {
+		error_fun(buf);
+		/* Be sure that logs are printed in any ways */
+		if ((void *)error_fun != (void *)printf)
+			printf("%s", buf);
+	} else {
+		print_fun(buf);
+		/* Be sure that logs are printed in any ways */
+		if (print_fun != eprintf)
+			eprintf(buf);
+	}
+}
+
+/* Asynchronous sink. The producers claim a slot by moving tail with a
+ * compare and swap, and publish it with its sequence number. The
+ * flusher thread emits the slots in order from head. A message which
+ * finds the ring full is dropped and counted, the caller never waits. */
+#define LOG_RING_SLOTS		256
+#define LOG_FLUSH_PERIOD_NS	(20 * 1000 * 1000)
+
+struct log_slot {
+	volatile unsigned int seq;
+	bool is_error;
 	char buf[MSG_BUF_LENGTH];
+};
+
+static struct log_slot log_ring[LOG_RING_SLOTS];
+static volatile unsigned int log_head;
+static volatile unsigned int log_tail;
+static volatile unsigned int log_dropped;
+static volatile bool log_stopping;
+static pthread_t log_thread;
+static pthread_mutex_t log_users_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_users;
+static volatile bool log_async;
+/* Producers between their check of log_async and their queuing */
+static volatile int log_writers;
+
+static void queue_message(bool is_error, const char *fmt, va_list ap)
+{
+	struct log_slot *slot;
+	unsigned int tail;
+
+	do {
+		tail = log_tail;
+		if (tail - log_head >= LOG_RING_SLOTS) {
+			__sync_fetch_and_add(&log_dropped, 1);
+			return;
+		}
+	} while (!__sync_bool_compare_and_swap(&log_tail, tail, tail + 1));
 
-	va_list argptr;
-	va_start(argptr, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, argptr);
-	va_end(argptr);
+	slot = &log_ring[tail % LOG_RING_SLOTS];
+	slot->is_error = is_error;
+	vsnprintf(slot->buf, sizeof(slot->buf), fmt, ap);
+	__sync_synchronize();
+	slot->seq = tail + 1;
+}
 
-	error_fun(buf);
-	/* Be sure that logs are printed in any ways */
-	if ((void *)error_fun != (void *)printf)
-		printf("%s", buf);
+/* Emits the published slots, returns the number of them */
+static int flush_messages(void)
+{
+	struct log_slot *slot;
+	char buf[MSG_BUF_LENGTH];
+	unsigned int dropped;
+	int count = 0;
+
+	while (log_head != log_tail) {
+		slot = &log_ring[log_head % LOG_RING_SLOTS];
+		if (slot->seq != log_head + 1)
+			break;	/* Claimed but not written yet */
+		__sync_synchronize();
+		emit_message(slot->is_error, slot->buf);
+		__sync_synchronize();
+		log_head++;
+		count++;
+	}
+
+	dropped = __sync_fetch_and_and(&log_dropped, 0);
+	if (dropped) {
+		snprintf(buf, sizeof(buf), "%u log messages dropped\n", dropped);
+		emit_message(true, buf);
+	}
+	return count;
 }
 
-void print(const char *fmt, ...)
+static void *log_flusher(void *arg)
+{
+	struct timespec period = { 0, LOG_FLUSH_PERIOD_NS };
+
+	while (!log_stopping) {
+		if (!flush_messages())
+			nanosleep(&period, NULL);
+	}
+	return NULL;
+}
+
+int util_log_async_start(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&log_users_lock);
+	if (log_users == 0) {
+		log_stopping = false;
+		if (pthread_create(&log_thread, NULL, log_flusher, NULL)) {
+			ret = -1;
+			goto unlock;
+		}
+		log_async = true;
+	}
+	log_users++;
+unlock:
+	pthread_mutex_unlock(&log_users_lock);
+	return ret;
+}
+
+void util_log_async_stop(void)
+{
+	pthread_mutex_lock(&log_users_lock);
+	if (log_users > 0 && --log_users == 0) {
+		log_async = false;
+		__sync_synchronize();
+		while (log_writers)
+			sched_yield();
+		log_stopping = true;
+		pthread_join(log_thread, NULL);
+		flush_messages();
+	}
+	pthread_mutex_unlock(&log_users_lock);
+}
+
+static void log_message(bool is_error, const char *fmt, va_list ap)
 {
 	char buf[MSG_BUF_LENGTH];
+	bool queued = false;
 
+	if (log_async) {
+		__sync_fetch_and_add(&log_writers, 1);
+		if (log_async) {
+			queue_message(is_error, fmt, ap);
+			queued = true;
+		}
+		__sync_fetch_and_sub(&log_writers, 1);
+		if (queued)
+			return;
+	}
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	emit_message(is_error, buf);
+}
+
+void error(const char *fmt, ...)
+{
 	va_list argptr;
+
 	va_start(argptr, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, argptr);
+	log_message(true, fmt, argptr);
 	va_end(argptr);
+}
+
+void print(const char *fmt, ...)
+{
+	va_list argptr;
 
-	print_fun(buf);
-	/* Be sure that logs are printed in any ways */
-	if (print_fun != eprintf)
-		eprintf(buf);
+	va_start(argptr, fmt);
+	log_message(false, fmt, argptr);
+	va_end(argptr);
 }
 
-/* External program management.  */
-static int allocated_time_expired;
+/* Progress management. The last fraction is in thousandths. */
+static void (*progress_fun) (void *ctx, double fraction);
+static void *progress_ctx;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long progress_last_ms;
+static int progress_last = -1;
 
-static void sigalarm_handler(int signal)
+static long long monotonic_ms(void)
 {
-	allocated_time_expired = 1;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-static void run_program(const char *path, int output_fd, char *argv[])
+void progress(off64_t done, off64_t total)
 {
-	int ret;
-	int err_fd;
+	long long now;
+	int permille;
 
-	if ((err_fd = dup(STDERR_FILENO)) == -1) {
-		error("Failed to save stderr.");
-		goto exit;
-	}
+	if (!progress_fun || total <= 0)
+		return;
 
-	if ((dup2(output_fd, STDOUT_FILENO) == -1) || (dup2(output_fd, STDERR_FILENO) == -1)) {
-		error("Failed to redirect %s program output.", path);
-		goto exit;
+	permille = done >= total ? 1000 : (int)(done * 1000 / total);
+	now = monotonic_ms();
+	pthread_mutex_lock(&progress_lock);
+	if (permille != progress_last &&
+	    (permille == 1000 || now - progress_last_ms >= 1000 / PROGRESS_RATE)) {
+		progress_last = permille;
+		progress_last_ms = now;
+		progress_fun(progress_ctx, permille / 1000.0);
 	}
+	pthread_mutex_unlock(&progress_lock);
+}
 
-	argv[0] = basename(path);
+/* External program management.  */
 
-	ret = execv(path, argv);
-	if (ret != -1)
-		goto exit;
+/* Lines of the program output longer than this are split */
+#define PROGRAM_LINE_LENGTH	MSG_BUF_LENGTH
+
+struct program_capture {
+	const char *pass_string;
+	bool passed;
+	int log_fd;
+	char *output;
+	size_t output_size;
+	size_t output_len;
+	char line[PROGRAM_LINE_LENGTH];
+	size_t line_len;
+};
+
+static void capture_line(struct program_capture *c)
+{
+	c->line[c->line_len] = '\0';
+	if (strstr(c->line, c->pass_string))
+		c->passed = true;
+	print("%s\n", c->line);
+	c->line_len = 0;
+}
 
-	FILE *file = fdopen(err_fd, "w");
-	if (file == NULL)
-		goto exit;
+/* Streams a chunk of the output to the UI, the log file and the buffer */
+static void capture_output(struct program_capture *c, const char *data, size_t size)
+{
+	size_t i, len;
 
-	fprintf(file, "execv failed on %s, %s\n", path, strerror(errno));
-	fclose(file);
+	if (c->log_fd != -1 && safe_write(c->log_fd, data, size)) {
+		error("Failed to write the program log, %s.", strerror(errno));
+		close(c->log_fd);
+		c->log_fd = -1;
+	}
 
-exit:
-	_exit(EXIT_FAILURE);
+	if (c->output_len + 1 < c->output_size) {
+		len = c->output_size - 1 - c->output_len;
+		len = size < len ? size : len;
+		memcpy(c->output + c->output_len, data, len);
+		c->output_len += len;
+		c->output[c->output_len] = '\0';
+	}
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n') {
+			capture_line(c);
+			continue;
+		}
+		c->line[c->line_len++] = data[i];
+		if (c->line_len == sizeof(c->line) - 1)
+			capture_line(c);
+	}
 }
 
-int call_program(const char *path, const char *log_file,
-		 const char *pass_string, unsigned int timeout, char *argv[])
+/* Starts the program with its output into output_fd. The child of
+ * vfork() only redirects and execs, and reports a failure through the
+ * memory it shares with the parent. Returns the pid, or -1. */
+static pid_t spawn_program(const char *path, int output_fd, int read_fd, char *argv[])
 {
+	volatile int exec_errno = 0;
 	pid_t pid;
-	char buf[strlen(pass_string) + 1];
-	int fd, status, ret;
-	FILE *file = NULL;
-	int fun_ret = EXIT_FAILURE;
 
-	fd = open(log_file, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+	argv[0] = basename(path);
 
-	if (fd == -1) {
-		error("Failed to open %s file.", log_file);
-		return EXIT_FAILURE;
+	pid = vfork();
+	if (pid == 0) {
+		close(read_fd);
+		if (dup2(output_fd, STDOUT_FILENO) == -1 || dup2(output_fd, STDERR_FILENO) == -1) {
+			exec_errno = errno;
+			_exit(EXIT_FAILURE);
+		}
+		execv(path, argv);
+		exec_errno = errno;
+		_exit(EXIT_FAILURE);
 	}
-
-	pid = fork();
 	if (pid == -1) {
-		error("Fork() systemcall failed, %s.", strerror(errno));
-		goto close;
+		error("vfork() systemcall failed, %s.", strerror(errno));
+		return -1;
 	}
+	if (exec_errno) {
+		error("execv failed on %s, %s.", path, strerror(exec_errno));
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
 
-	if (pid == 0)
-		run_program(path, fd, argv);
+int call_program_capture(const char *path, const char *log_file,
+			 const char *pass_string, unsigned int timeout, char *argv[],
+			 char *output, size_t output_size)
+{
+	struct program_capture capture;
+	struct pollfd pfd;
+	char chunk[4096];
+	long long deadline = 0, left;
+	int fds[2];
+	pid_t pid;
+	ssize_t len = -1;
+	int status, ret;
+	int fun_ret = EXIT_FAILURE;
 
-	const struct sigaction alarm_sigaction = {
-		.sa_handler = sigalarm_handler,
-	};
-	struct sigaction old_alarm_sigaction;
-	ret = sigaction(SIGALRM, &alarm_sigaction, &old_alarm_sigaction);
-	if (ret == -1) {
-		error("Failed to install SIGALRM handler.");
-		goto close;
+	memset(&capture, 0, sizeof(capture));
+	capture.pass_string = pass_string;
+	capture.output = output;
+	capture.output_size = output_size;
+	capture.log_fd = -1;
+	if (output && output_size)
+		output[0] = '\0';
+
+	if (log_file) {
+		capture.log_fd = open(log_file, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (capture.log_fd == -1) {
+			error("Failed to open %s file.", log_file);
+			return EXIT_FAILURE;
+		}
 	}
 
-	alarm(timeout);
-	ret = waitpid(pid, &status, 0);
-	sigaction(SIGALRM, &old_alarm_sigaction, NULL);
-	if (ret == -1) {
-		if (allocated_time_expired) {
-			error("%s program takes too long, aborting.", path);
-			kill(pid, SIGTERM);
-		} else
-			error("Wait for %s program completion failed.", path);
-		goto close;
+	if (pipe(fds) == -1) {
+		error("Failed to create the %s program pipe, %s.", path, strerror(errno));
+		goto close_log;
 	}
-
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
-		error("%s program ended unexpectedly.", path);
-		goto close;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+	pid = spawn_program(path, fds[1], fds[0], argv);
+	close(fds[1]);
+	if (pid == -1)
+		goto close_pipe;
+
+	if (timeout)
+		deadline = monotonic_ms() + timeout * 1000LL;
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	while (true) {
+		left = -1;
+		if (timeout) {
+			left = deadline - monotonic_ms();
+			if (left <= 0)
+				break;
+		}
+		ret = poll(&pfd, 1, left);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1) {
+			error("Wait for %s program output failed, %s.", path, strerror(errno));
+			break;
+		}
+		if (ret == 0)
+			continue;
+		len = read(fds[0], chunk, sizeof(chunk));
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		capture_output(&capture, chunk, len);
 	}
+	if (capture.line_len)
+		capture_line(&capture);
 
-	if (lseek(fd, 0, SEEK_SET) == -1) {
-		error("Seek failed on %s file, %s.", log_file, strerror(errno));
-		goto close;
+	if (len != 0) {
+		if (timeout && left <= 0)
+			error("%s program takes too long, aborting.", path);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		goto close_pipe;
 	}
 
-	file = fdopen(fd, "r+");
-	if (file == NULL) {
-		error("Failed to fdopen on %s (already opened via open), %s.", log_file, strerror(errno));
-		goto close;
+	while ((ret = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+		;
+	if (ret == -1) {
+		error("Wait for %s program completion failed.", path);
+		goto close_pipe;
 	}
 
-	while (fgets(buf, sizeof(buf), file) != NULL)
-		if (strstr(buf, pass_string)) {
-			fun_ret = EXIT_SUCCESS;
-			goto close;
-		}
-
-	error("The %s program failed to perform its task.", path);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		error("%s program ended unexpectedly.", path);
+		goto close_pipe;
+	}
 
-close:
-	if (file)
-		fclose(file);
+	if (capture.passed)
+		fun_ret = EXIT_SUCCESS;
 	else
-		close(fd);
+		error("The %s program failed to perform its task.", path);
+
+close_pipe:
+	close(fds[0]);
+close_log:
+	if (capture.log_fd != -1)
+		close(capture.log_fd);
 
 	return fun_ret;
 }
 
+int call_program(const char *path, const char *log_file,
+		 const char *pass_string, unsigned int timeout, char *argv[])
+{
+	return call_program_capture(path, log_file, pass_string, timeout, argv, NULL, 0);
+}
+
 /* Initialization.  */
 void util_init(void (*err_fun) (const char *), void (*pr_fun) (const char *))
 {
 	error_fun = err_fun ? err_fun : error_fun;
 	print_fun = pr_fun ? pr_fun : print_fun;
 }
+
+void util_init_progress(void (*prog_fun) (void *ctx, double fraction), void *ctx)
+{
+	pthread_mutex_lock(&progress_lock);
+	progress_fun = prog_fun;
+	progress_ctx = ctx;
+	progress_last = -1;
+	progress_last_ms = 0;
+	pthread_mutex_unlock(&progress_lock);
+}
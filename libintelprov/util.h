@@ -19,31 +19,81 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #define BY_NAME_DIR "/dev/block/by-name"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 
 int file_write(const char *filename, const void *what, size_t sz);
+int file_write_atomic(const char *filename, const void *what, size_t sz);
 int file_string_write(const char *filename, const char *what);
 void dump_trace_file(const char *filename);
 int file_read(const char *filename, void **datap, size_t * szp);
 int file_copy(const char *src, const char *dst);
+/* Copies size bytes between the offsets of two descriptors, in the
+ * kernel when it can, through a buffer otherwise. Returns 0 or -1 */
+int fd_copy(int out_fd, off64_t out_offset, int in_fd, off64_t in_offset, size_t size);
 int file_size(const char *filename);
 void *file_mmap(const char *filename, size_t length, bool writable);
 int safe_read(int fd, void *data, size_t size);
+int safe_write(int fd, const void *data, size_t size);
 int snhexdump(char *str, size_t size, const unsigned char *data, unsigned int sz);
 void hexdump_buffer(const unsigned char *buffer, unsigned int buffer_size, void
 		     (*printrow) (const char *text), unsigned int bytes_per_row);
 void twoscomplement(unsigned char *cs, unsigned char *buf, unsigned int size);
 int is_hex(char c);
+/* Parses exactly size bytes of hexadecimal, returns 0 or -1 */
+int hex_to_bytes(const char *str, unsigned char *buf, size_t size);
 
 void error(const char *fmt, ...);
 void print(const char *fmt, ...);
 
+/* Levels of the messages, filtered where they are emitted so that the
+ * arguments of a disabled message are not even computed */
+#define LOG_LEVEL_ERROR	0
+#define LOG_LEVEL_INFO	1
+#define LOG_LEVEL_DEBUG	2
+
+extern int util_log_level;
+
+#define log_enabled(level)	((level) <= util_log_level)
+#define debug(...) \
+	do { \
+		if (log_enabled(LOG_LEVEL_DEBUG)) \
+			print(__VA_ARGS__); \
+	} while (0)
+
+/* Between these calls, print() and error() only queue the messages in a
+ * ring which a background thread writes out, so that a slow console or
+ * UI never stalls an I/O loop. The calls nest, the last stop flushes
+ * the ring. Start returns 0, or -1 when the messages stay synchronous. */
+int util_log_async_start(void);
+void util_log_async_stop(void);
+
+/* Updates of the progress bar a second, the last one is always shown */
+#define PROGRESS_RATE	10
+
+/* Progress of a long write, done out of total bytes. The writers may
+ * call it for each chunk, the updates are coalesced to PROGRESS_RATE
+ * and only reach the progress function when the bar moves. */
+void progress(off64_t done, off64_t total);
+
+/* Runs the program, with no more than timeout seconds if not 0, and
+ * succeeds when it exits successfully and a line of its output contains
+ * pass_string. The output is streamed from a pipe to print(), and also
+ * written to log_file unless it is NULL. call_program_capture() keeps
+ * the beginning of the output, NUL terminated, in output_size bytes of
+ * output. Returns EXIT_SUCCESS or EXIT_FAILURE. */
 int call_program(const char *path, const char *log_file,
 		 const char *pass_string, unsigned int timeout, char *argv[]);
+int call_program_capture(const char *path, const char *log_file,
+			 const char *pass_string, unsigned int timeout, char *argv[],
+			 char *output, size_t output_size);
 
 void util_init(void (*err_fun) (const char *), void (*pr_fun) (const char *));
+/* Sets the progress function, called with ctx and a fraction in [0, 1],
+ * or NULL to drop the progress */
+void util_init_progress(void (*prog_fun) (void *ctx, double fraction), void *ctx);
 
 #endif
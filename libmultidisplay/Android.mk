@@ -24,10 +24,15 @@ LOCAL_COPY_HEADERS := \
     native/include/IMultiDisplayConnectionObserver.h \
     native/include/IMultiDisplayInfoProvider.h \
     native/include/IMultiDisplayDecoderConfig.h \
+    native/include/MultiDisplayStatePage.h \
     native/include/MultiDisplayService.h
 
 LOCAL_COPY_HEADERS += videoclient/MultiDisplayVideoClient.h
 
+ifeq ($(ENABLE_IMG_GRAPHICS),true)
+LOCAL_COPY_HEADERS += videoclient/MultiDisplayVideoBuffer.h
+endif
+
 ifeq ($(TARGET_HAS_ISV),true)
 LOCAL_COPY_HEADERS += \
     native/include/IMultiDisplayVppConfig.h
@@ -39,6 +44,7 @@ include $(BUILD_COPY_HEADERS)
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= \
     native/MultiDisplayComposer.cpp \
+    native/MultiDisplayStats.cpp \
     native/IMultiDisplayListener.cpp \
     native/IMultiDisplayCallback.cpp \
     native/IMultiDisplayInfoProvider.cpp \
@@ -97,9 +103,12 @@ LOCAL_SHARED_LIBRARIES += libvpp_setting
 endif
 
 LOCAL_C_INCLUDES += $(call include-path-for, frameworks-av)
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/common
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../metrics
 
 #LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)
 
+include $(LOCAL_PATH)/../OptPgo.mk
 include $(BUILD_SHARED_LIBRARY)
 
 # Build MDS Video Client static library
@@ -119,6 +128,47 @@ LOCAL_CFLAGS += -DLOG_TAG=\"MultiDisplay\"
 
 include $(BUILD_STATIC_LIBRARY)
 
+ifeq ($(ENABLE_IMG_GRAPHICS),true)
+# Build MDS scanout video buffer static library
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := videoclient/MultiDisplayVideoBuffer.cpp
+
+LOCAL_MODULE := libmultidisplayvideobuffer
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SHARED_LIBRARIES += libcutils libutils libdrm
+
+LOCAL_C_INCLUDES := \
+     $(TARGET_OUT_HEADERS)/libdrm \
+     $(TARGET_OUT_HEADERS)/libttm
+
+LOCAL_CFLAGS += -DLOG_TAG=\"MultiDisplay\"
+
+include $(BUILD_STATIC_LIBRARY)
+endif
+
+# Build MDS stress benchmark
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := benchmark/mds_bench.cpp
+
+LOCAL_MODULE := mds_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SHARED_LIBRARIES := \
+     libcutils \
+     libutils \
+     libbinder \
+     libmultidisplay
+
+ifeq ($(TARGET_HAS_ISV),true)
+LOCAL_CFLAGS += -DTARGET_HAS_ISV
+endif
+LOCAL_CFLAGS += -DLOG_TAG=\"mds_bench\"
+
+include $(BUILD_EXECUTABLE)
+
 # Build JNI library
 include $(CLEAR_VARS)
 
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Stress benchmark of MultiDisplayService.
+//
+//   mds_bench [-p processes] [-t threads] [-n iterations] [-H hotplug_ms]
+//
+// Each thread of each process runs a mix of calls: updateVideoState on a
+// session of its own, getDisplayMode, registerListener/unregisterListener
+// and getVideoState, while one more thread per process sends an HDMI
+// hotplug notification every hotplug_ms (0: none). MDS probes the connector
+// again on each of them, so the real HDMI state is kept. The report gives
+// the calls per second and the latency percentiles of each call, over all
+// the processes. "dumpsys display.intel.mds" shows the same calls from the
+// service side, including the lock waits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include <utils/Timers.h>
+#include <utils/Vector.h>
+#include <utils/threads.h>
+#include <cutils/atomic.h>
+#include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
+
+#include <display/MultiDisplayService.h>
+
+using namespace android;
+using namespace android::intel;
+
+enum {
+    OP_UPDATE_VIDEO_STATE,
+    OP_GET_DISPLAY_MODE,
+    OP_REGISTER_LISTENER,
+    OP_UNREGISTER_LISTENER,
+    OP_GET_VIDEO_STATE,
+    OP_HOTPLUG,
+    OP_COUNT
+};
+
+static const char* const kOpNames[OP_COUNT] = {
+    "updateVideoState",
+    "getDisplayMode",
+    "registerListener",
+    "unregisterListener",
+    "getVideoState",
+    "hotplug",
+};
+
+// Latencies of all the calls of a process, or of all of them
+struct Results {
+    Vector<nsecs_t> samples[OP_COUNT];
+    nsecs_t elapsed;
+    int32_t errors;
+    int32_t messages;
+};
+
+struct Worker {
+    pthread_t thread;
+    int iterations;
+    Vector<nsecs_t> samples[OP_COUNT];
+    int32_t errors;
+};
+
+static Mutex gLock;
+static Condition gStartCond;
+static bool gStarted = false;
+static volatile int32_t gWorkersDone = 0;
+static volatile int32_t gMessages = 0;
+static int gHotplugMs = 10;
+
+class BenchListener : public BnMultiDisplayListener {
+public:
+    virtual status_t onMdsMessage(int msg, void* value, int size) {
+        android_atomic_inc(&gMessages);
+        return NO_ERROR;
+    }
+};
+
+static sp<IMDService> GetService() {
+    sp<IServiceManager> sm = defaultServiceManager();
+    if (sm == NULL)
+        return NULL;
+    return interface_cast<IMDService>(
+            sm->getService(String16(INTEL_MDS_SERVICE_NAME)));
+}
+
+static void WaitStart() {
+    Mutex::Autolock _l(gLock);
+    while (!gStarted)
+        gStartCond.wait(gLock);
+}
+
+static inline void Record(Worker* w, int op, nsecs_t start, bool ok) {
+    w->samples[op].push(systemTime() - start);
+    if (!ok)
+        w->errors++;
+}
+
+static void* RunWorker(void* arg) {
+    Worker* w = (Worker*)arg;
+    sp<IMDService> mds = GetService();
+    if (mds == NULL) {
+        w->errors++;
+        android_atomic_inc(&gWorkersDone);
+        return NULL;
+    }
+    sp<IMultiDisplayVideoControl> video = mds->getVideoControl();
+    sp<IMultiDisplayInfoProvider> info = mds->getInfoProvider();
+    sp<IMultiDisplaySinkRegistrar> sink = mds->getSinkRegistrar();
+    sp<BenchListener> listener = new BenchListener();
+    int session = video->allocateVideoSessionId();
+    if (session < 0)
+        w->errors++;
+    for (int op = 0; op < OP_COUNT; op++)
+        w->samples[op].setCapacity(w->iterations / 4 + 1);
+
+    WaitStart();
+    for (int i = 0; i < w->iterations; i++) {
+        nsecs_t start = systemTime();
+        switch (i % 4) {
+        case 0: {
+            // Clear content: UNPREPARED -> PREPARED -> UNPREPARED
+            MDS_VIDEO_STATE state = ((i / 4) & 1) ?
+                MDS_VIDEO_UNPREPARED : MDS_VIDEO_PREPARED;
+            status_t result = video->updateVideoState(session, state);
+            Record(w, OP_UPDATE_VIDEO_STATE, start, result == NO_ERROR);
+        } break;
+        case 1:
+            info->getDisplayMode(false);
+            Record(w, OP_GET_DISPLAY_MODE, start, true);
+            break;
+        case 2: {
+            int32_t id = sink->registerListener(
+                    listener, "mds_bench", MDS_MSG_MODE_CHANGE);
+            Record(w, OP_REGISTER_LISTENER, start, id >= 0);
+            if (id < 0)
+                break;
+            start = systemTime();
+            status_t result = sink->unregisterListener(id);
+            Record(w, OP_UNREGISTER_LISTENER, start, result == NO_ERROR);
+        } break;
+        case 3:
+            info->getVideoState(session);
+            Record(w, OP_GET_VIDEO_STATE, start, true);
+            break;
+        }
+    }
+    if (session >= 0)
+        video->updateVideoState(session, MDS_VIDEO_UNPREPARED);
+    android_atomic_inc(&gWorkersDone);
+    return NULL;
+}
+
+static void* RunHotplug(void* arg) {
+    Worker* w = (Worker*)arg;
+    sp<IMDService> mds = GetService();
+    if (mds == NULL) {
+        w->errors++;
+        return NULL;
+    }
+    sp<IMultiDisplayConnectionObserver> observer = mds->getConnectionObserver();
+    bool connected = false;
+    WaitStart();
+    while (android_atomic_acquire_load(&gWorkersDone) < w->iterations) {
+        nsecs_t start = systemTime();
+        status_t result = observer->updateHdmiConnectionStatus(connected);
+        Record(w, OP_HOTPLUG, start, result == NO_ERROR);
+        connected = !connected;
+        usleep(gHotplugMs * 1000);
+    }
+    return NULL;
+}
+
+static void RunProcess(int threads, int iterations, Results* results) {
+    ProcessState::self()->startThreadPool();
+    Worker* workers = new Worker[threads + 1];
+    for (int i = 0; i <= threads; i++) {
+        workers[i].iterations = iterations;
+        workers[i].errors = 0;
+    }
+    // The hotplug thread runs until all the workers are done
+    workers[threads].iterations = threads;
+    for (int i = 0; i < threads; i++)
+        pthread_create(&workers[i].thread, NULL, RunWorker, &workers[i]);
+    if (gHotplugMs > 0)
+        pthread_create(&workers[threads].thread, NULL, RunHotplug, &workers[threads]);
+
+    // Let all the threads get their proxies before the clock starts
+    usleep(100000);
+    nsecs_t start = systemTime();
+    {
+        Mutex::Autolock _l(gLock);
+        gStarted = true;
+        gStartCond.broadcast();
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    results->elapsed = systemTime() - start;
+    if (gHotplugMs > 0)
+        pthread_join(workers[threads].thread, NULL);
+
+    results->errors = 0;
+    for (int i = 0; i <= threads; i++) {
+        if (i == threads && gHotplugMs <= 0)
+            break;
+        for (int op = 0; op < OP_COUNT; op++)
+            results->samples[op].appendVector(workers[i].samples[op]);
+        results->errors += workers[i].errors;
+    }
+    results->messages = android_atomic_acquire_load(&gMessages);
+    delete[] workers;
+}
+
+static bool WriteFully(int fd, const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool ReadFully(int fd, void* data, size_t size) {
+    uint8_t* p = (uint8_t*)data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void WriteResults(int fd, const Results& results) {
+    WriteFully(fd, &results.elapsed, sizeof(results.elapsed));
+    WriteFully(fd, &results.errors, sizeof(results.errors));
+    WriteFully(fd, &results.messages, sizeof(results.messages));
+    for (int op = 0; op < OP_COUNT; op++) {
+        int32_t count = results.samples[op].size();
+        WriteFully(fd, &count, sizeof(count));
+        WriteFully(fd, results.samples[op].array(), count * sizeof(nsecs_t));
+    }
+}
+
+// Adds the results of a child process to the total
+static bool ReadResults(int fd, Results* total) {
+    nsecs_t elapsed;
+    int32_t errors, messages;
+    if (!ReadFully(fd, &elapsed, sizeof(elapsed)) ||
+            !ReadFully(fd, &errors, sizeof(errors)) ||
+            !ReadFully(fd, &messages, sizeof(messages)))
+        return false;
+    if (elapsed > total->elapsed)
+        total->elapsed = elapsed;
+    total->errors += errors;
+    total->messages += messages;
+    for (int op = 0; op < OP_COUNT; op++) {
+        int32_t count;
+        if (!ReadFully(fd, &count, sizeof(count)) || count < 0)
+            return false;
+        size_t base = total->samples[op].size();
+        total->samples[op].insertAt(0, base, count);
+        if (!ReadFully(fd, total->samples[op].editArray() + base,
+                count * sizeof(nsecs_t)))
+            return false;
+    }
+    return true;
+}
+
+static int CompareSamples(const void* a, const void* b) {
+    nsecs_t x = *(const nsecs_t*)a;
+    nsecs_t y = *(const nsecs_t*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+static double Percentile(const Vector<nsecs_t>& sorted, double p) {
+    size_t index = (size_t)(p * (sorted.size() - 1));
+    return sorted[index] / 1000.0;
+}
+
+static void PrintReport(Results* total) {
+    double seconds = total->elapsed / 1e9;
+    int32_t calls = 0;
+    printf("%-20s %8s %10s %9s %9s %9s %9s %9s\n", "call", "count", "calls/s",
+            "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (int op = 0; op < OP_COUNT; op++) {
+        Vector<nsecs_t>& samples = total->samples[op];
+        if (samples.size() == 0)
+            continue;
+        qsort(samples.editArray(), samples.size(), sizeof(nsecs_t), CompareSamples);
+        printf("%-20s %8d %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                kOpNames[op], (int)samples.size(), samples.size() / seconds,
+                Percentile(samples, 0.5), Percentile(samples, 0.9),
+                Percentile(samples, 0.99), Percentile(samples, 0.999),
+                samples[samples.size() - 1] / 1000.0);
+        calls += samples.size();
+    }
+    printf("total: %d calls in %.3fs, %.0f calls/s, %d errors, %d messages\n",
+            calls, seconds, calls / seconds, total->errors, total->messages);
+}
+
+static void Usage(const char* me) {
+    fprintf(stderr, "usage: %s [-p processes] [-t threads] [-n iterations] "
+            "[-H hotplug_ms]\n", me);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int processes = 1;
+    int threads = 4;
+    int iterations = 10000;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:n:H:")) != -1) {
+        switch (opt) {
+        case 'p': processes = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'H': gHotplugMs = atoi(optarg); break;
+        default: Usage(argv[0]);
+        }
+    }
+    if (processes < 1 || threads < 1 || iterations < 1)
+        Usage(argv[0]);
+
+    // Fork before the binder driver is opened, each process has its own
+    int fds[processes];
+    pid_t pids[processes];
+    for (int p = 1; p < processes; p++) {
+        int pipefd[2];
+        if (pipe(pipefd) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        pids[p] = fork();
+        if (pids[p] < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pids[p] == 0) {
+            close(pipefd[0]);
+            Results results;
+            RunProcess(threads, iterations, &results);
+            WriteResults(pipefd[1], results);
+            _exit(0);
+        }
+        close(pipefd[1]);
+        fds[p] = pipefd[0];
+    }
+
+    Results total;
+    RunProcess(threads, iterations, &total);
+    for (int p = 1; p < processes; p++) {
+        if (!ReadResults(fds[p], &total))
+            fprintf(stderr, "lost the results of process %d\n", pids[p]);
+        close(fds[p]);
+        waitpid(pids[p], NULL, 0);
+    }
+    printf("%d processes x %d threads x %d iterations, hotplug every %dms\n",
+            processes, threads, iterations, gHotplugMs);
+    PrintReport(&total);
+    return 0;
+}
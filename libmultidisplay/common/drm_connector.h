@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * DRM connector and EDID helpers shared by the drm_hdmi of the MDS
+ * (native) and of the legacy MDS (ctp_legacy/native).
+ */
+
+#ifndef _DRM_CONNECTOR_H
+#define _DRM_CONNECTOR_H
+
+#include <stdint.h>
+#include <string.h>
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#define DRM_EDID_BLOCK_SIZE     (128)
+
+#define DRM_SINK_DISCONNECTED   (0)
+#define DRM_SINK_HDMI           (1)
+#define DRM_SINK_DVI            (2)
+
+// Id of the first connector of this type, 0 if there is none.
+// Connectors don't change at runtime, the Id can be kept.
+static inline uint32_t drm_find_connector_id(int fd, uint32_t connector_type)
+{
+    drmModeRes *resources = drmModeGetResources(fd);
+    uint32_t id = 0;
+
+    if (resources == NULL)
+        return 0;
+    for (int i = 0; resources->connectors != NULL &&
+            i < resources->count_connectors && id == 0; i++) {
+        drmModeConnector *connector = drmModeGetConnector(fd, resources->connectors[i]);
+        if (connector == NULL)
+            continue;
+        if (connector->connector_type == connector_type)
+            id = connector->connector_id;
+        drmModeFreeConnector(connector);
+    }
+    drmModeFreeResources(resources);
+    return id;
+}
+
+// Index of the named property in the connector properties, or -1.
+// *propId caches the property Id, 0 until the property is found.
+static inline int drm_find_connector_prop(int fd, drmModeConnectorPtr connector,
+        const char* name, uint32_t* propId)
+{
+    for (int i = 0; i < connector->count_props; i++) {
+        if (*propId != 0) {
+            if (connector->props[i] == *propId)
+                return i;
+            continue;
+        }
+        drmModePropertyPtr props = drmModeGetProperty(fd, connector->props[i]);
+        if (!props)
+            continue;
+        bool found = !strncmp(props->name, name, sizeof(props->name));
+        drmModeFreeProperty(props);
+        if (found) {
+            *propId = connector->props[i];
+            return i;
+        }
+    }
+    return -1;
+}
+
+// HDMI or DVI sink, from the HDMI VSDB of the CEA extension.
+// *audio is set from the basic audio flag of the extension.
+static inline int drm_edid_get_sink_type(const char* edid, int length, bool* audio)
+{
+    *audio = false;
+    if (edid[126] == 0 || length < 2 * DRM_EDID_BLOCK_SIZE)
+        return DRM_SINK_DVI;
+
+    const char* ext = edid + DRM_EDID_BLOCK_SIZE;
+    if (ext[0] == 0x02 && (ext[3] & 0x40))
+        *audio = true;
+    // search VSDB in extend edid
+    for (int j = 0; j <= DRM_EDID_BLOCK_SIZE - 3; j++) {
+        if (ext[j]   == 0x03 &&
+            ext[j+1] == 0x0c &&
+            ext[j+2] == 0x00)
+            return DRM_SINK_HDMI;
+    }
+    return DRM_SINK_DVI;
+}
+
+#endif // _DRM_CONNECTOR_H
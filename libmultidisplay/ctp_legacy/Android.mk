@@ -65,6 +65,7 @@ ifeq ($(ENABLE_GEN_GRAPHICS),true)
 endif
 
 LOCAL_C_INCLUDES += $(call include-path-for, frameworks-av)
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../common
 
 #LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)
 
@@ -19,6 +19,7 @@
 //#define LOG_NDEBUG 0
 
 #include <utils/Log.h>
+#include <utils/Timers.h>
 #include <binder/IServiceManager.h>
 #include <binder/IPCThreadState.h>
 #include <display/IMultiDisplayComposer.h>
@@ -29,6 +30,9 @@
 namespace android {
 namespace intel {
 
+// A request to turn MIPI off waits this long for a request which
+// supersedes it, as each toggle power cycles the panel
+#define MIPI_OFF_DEBOUNCE_MS 300
 
 #define MDC_CHECK_INIT() \
 do { \
@@ -547,25 +551,35 @@ int MultiDisplayComposer::setHdmiModeInfo(int width, int height,
     return MDS_NO_ERROR;
 }
 
-int MultiDisplayComposer::setDisplayScalingLocked(uint32_t mode,
-         uint32_t stepx, uint32_t stepy) {
+// SurfaceFlinger is looked up once, and again after a failed transaction
+sp<IBinder> MultiDisplayComposer::getSurfaceComposer_l() {
     if (mSurfaceComposer == NULL) {
         const sp<IServiceManager> sm = defaultServiceManager();
         const String16 name("SurfaceFlinger");
         mSurfaceComposer = sm->getService(name);
-        if (mSurfaceComposer == NULL) {
-            return -1;
-        }
+    }
+    return mSurfaceComposer;
+}
+
+// The scaling mode and both steps are set in one transaction
+int MultiDisplayComposer::setDisplayScalingLocked(uint32_t mode,
+         uint32_t stepx, uint32_t stepy) {
+    sp<IBinder> composer = getSurfaceComposer_l();
+    if (composer == NULL) {
+        return -1;
     }
 
     uint32_t scale;
     Parcel data, reply;
-    const String16 token("android.ui.ISurfaceComposer");
+    static const String16 token("android.ui.ISurfaceComposer");
 
     scale = mode | stepx << 16 | stepy << 24;
     data.writeInterfaceToken(token);
     data.writeInt32(scale);
-    mSurfaceComposer->transact(SFIntelHDMIScalingSetting, data, &reply);
+    if (composer->transact(SFIntelHDMIScalingSetting, data, &reply) != NO_ERROR) {
+        mSurfaceComposer = NULL;
+        return -1;
+    }
     return reply.readInt32();
 }
 
@@ -635,11 +649,21 @@ bool MultiDisplayComposer::threadLoop() {
     while(true) {
         {
             Mutex::Autolock _l(mMipiLock);
-            if (mMipiReq == NO_MIPI_REQ)
+            while (mMipiReq == NO_MIPI_REQ)
                 mMipiCon.wait(mMipiLock);
+            // Only the last request is applied, an off request once it
+            // has not been superseded for MIPI_OFF_DEBOUNCE_MS
+            nsecs_t deadline = systemTime() + ms2ns(MIPI_OFF_DEBOUNCE_MS);
+            while (mMipiReq == MIPI_OFF_REQ) {
+                nsecs_t left = deadline - systemTime();
+                if (left <= 0)
+                    break;
+                mMipiCon.waitRelative(mMipiLock, left);
+            }
             mipiOn = (mMipiReq == MIPI_ON_REQ) ? true : false;
             mMipiReq = NO_MIPI_REQ;
         }
+        // No-op when MIPI is already in the requested state
         setMipiMode_l(mipiOn);
     }
     return MDS_NO_ERROR;
@@ -650,22 +674,20 @@ bool MultiDisplayComposer::isHdmiTimingDynamicSettingEnable_l() {
     return true;
     // Presentation mode checking depends on GFX SF patch,
     // this patch hasn't been ported
-    if (mSurfaceComposer == NULL) {
-        const sp<IServiceManager> sm = defaultServiceManager();
-        const String16 name("SurfaceFlinger");
-        mSurfaceComposer = sm->getService(name);
-        if (mSurfaceComposer == NULL) {
-            return true;
-        }
+    sp<IBinder> composer = getSurfaceComposer_l();
+    if (composer == NULL) {
+        return true;
     }
 
     Parcel data, reply;
     int ret = -1;
-    const String16 token("android.ui.ISurfaceComposer");
+    static const String16 token("android.ui.ISurfaceComposer");
     data.writeInterfaceToken(token);
-    status_t status = mSurfaceComposer->transact(SFIntelQueryPresentationMode, data, &reply);
+    status_t status = composer->transact(SFIntelQueryPresentationMode, data, &reply);
     if (status == NO_ERROR)
         ret = reply.readInt32();
+    else
+        mSurfaceComposer = NULL;
     ALOGI("Enable HDMI Timing dynamic setting %d", ret);
     return (ret ? false : true);
 }
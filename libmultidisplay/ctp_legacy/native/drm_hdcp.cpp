@@ -19,9 +19,17 @@
 
 #include <utils/Log.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <linux/netlink.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cutils/properties.h>
 #include "drm_hdmi.h"
 #include "drm_hdcp.h"
@@ -34,11 +42,17 @@ extern "C" {
 
 
 
-static int g_hdcpStatusCheckTimer = 0;
+static pthread_t g_hdcpMonitorThread;
+static bool g_hdcpMonitorRunning = false;
+// Written to stop the link monitor
+static int g_hdcpMonitorPipe[2] = { -1, -1 };
 #define HDCP_ENABLE_NUM_OF_TRY      4
 #define HDCP_CHECK_NUM_OF_TRY       1
 #define HDCP_ENABLE_DELAY_USEC      30000 // 30 ms
 #define HDCP_STATUS_CHECK_INTERVAL  2 // 2 seconds
+// The check interval doubles up to this while the link stays authenticated
+#define HDCP_STATUS_CHECK_MAX_INTERVAL  32 // 32 seconds
+#define HDCP_UEVENT_MSG_LEN         2048
 // 120ms delay after disabling IED is required for successful hdcp
 // authentication with some AV receivers anything less than 100ms
 // resulted in Ri mismatch
@@ -47,11 +61,12 @@ static int g_hdcpStatusCheckTimer = 0;
 #define IED_SESSION_ID      0x11
 
 // Forward declaration
-static void drm_hdcp_check_link_status();
 static bool drm_hdcp_start_link_checking();
 static void drm_hdcp_stop_link_checking();
-static bool drm_hdcp_enable_and_check();
-static bool drm_hdcp_enable_hdcp_work();
+
+// Set by the link monitor once an authentication completes, until the
+// link is found unauthenticated or HDCP is disabled
+static volatile bool g_hdcpAuthenticated = false;
 
 static bool drm_hdcp_isSupported()
 {
@@ -189,137 +204,240 @@ static bool drm_check_ied_session()
     }
 }
 
-static void drm_hdcp_check_link_status(union sigval sig)
+static int64_t drm_hdcp_now_ms()
 {
-    bool b = false;
-    b = drm_hdcp_isAuthenticated();
-    if (!b) {
-	    ALOGI("HDCP is not authenticated, restarting authentication process.");
-	    drm_hdcp_enable_hdcp_work();
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static bool drm_hdcp_start_link_checking()
+static int drm_hdcp_open_uevent_socket()
 {
-    int ret;
-    struct sigevent sev;
-    struct itimerspec its;
-
-    if (g_hdcpStatusCheckTimer) {
-        ALOGW("HDCP status checking timer has been created.");
-        return false;
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_pid = 0; // let the kernel pick a port
+    addr.nl_groups = 0xffffffff;
+
+    int fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    memset(&sev, 0, sizeof(sev));
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_value.sival_ptr = NULL;
-    sev.sigev_notify_function = drm_hdcp_check_link_status;
-
-    ret = timer_create(CLOCK_REALTIME, &sev, &g_hdcpStatusCheckTimer);
-    if (ret != 0) {
-        ALOGE("Failed to create HDCP status checking timer.");
-        return false;
+// Drain the pending uevents, return true if one of them is from DRM
+static bool drm_hdcp_has_drm_uevent(int fd)
+{
+    char msg[HDCP_UEVENT_MSG_LEN + 2];
+    bool drm = false;
+    ssize_t len;
+    while ((len = recv(fd, msg, HDCP_UEVENT_MSG_LEN, 0)) > 0) {
+        msg[len] = msg[len + 1] = '\0';
+        for (const char *key = msg; *key; key += strlen(key) + 1) {
+            if (!strcmp(key, "SUBSYSTEM=drm")) {
+                drm = true;
+                break;
+            }
+        }
     }
+    // Uevents may have been lost, check the link
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        drm = true;
+    return drm;
+}
 
-    its.it_value.tv_sec = -1; // never expire
-    its.it_value.tv_nsec = 0;
-    its.it_interval.tv_sec = HDCP_STATUS_CHECK_INTERVAL; // 2 seconds
-    its.it_interval.tv_nsec = 0;
+/*
+ * Authentication steps run by the link monitor. An attempt enables HDCP
+ * and checks the link, and the next one runs HDCP_ENABLE_DELAY_USEC
+ * later, so the panel receives video and can start the authentication
+ * (HDCP spec 1.3, section 2.3). The display IED stays off from the
+ * start of the authentication until it completes, which keeps the
+ * protected surfaces off the link meanwhile.
+ */
+struct drm_hdcp_auth {
+    bool running;
+    int attempt;
+};
 
-    ret = timer_settime(g_hdcpStatusCheckTimer, TIMER_ABSTIME, &its, NULL);
-    if (ret != 0) {
-        ALOGE("Failed to set HDCP status checking timer.");
-        timer_delete(g_hdcpStatusCheckTimer);
-        g_hdcpStatusCheckTimer = 0;
-        return false;
+static void drm_hdcp_auth_start(drm_hdcp_auth *auth)
+{
+    ALOGV("Disabling Display IED ");
+    if (!drm_hdcp_disable_display_ied()) {
+        ALOGE("drm_hdcp_disable_display_ied FAILED!!!");
     }
-    return true;
+    g_hdcpAuthenticated = false;
+    auth->running = true;
+    auth->attempt = 0;
 }
 
-static void drm_hdcp_stop_link_checking()
+static void drm_hdcp_auth_finish(drm_hdcp_auth *auth, bool authenticated)
 {
-    int ret;
-    struct itimerspec its;
-
-    if (g_hdcpStatusCheckTimer == 0) {
-        ALOGV("HDCP status checking timer has been deleted.");
-        return;
+    if (!authenticated) {
+        // HDCP can be re-authenticated by the link monitor.
+        ALOGI("HDCP authentication will be restarted in %d seconds.", HDCP_STATUS_CHECK_INTERVAL);
     }
-
-    its.it_value.tv_sec = 0;
-    its.it_value.tv_nsec = 0;
-    its.it_interval.tv_sec = 0;
-    its.it_interval.tv_nsec = 0;
-
-    ret = timer_settime(g_hdcpStatusCheckTimer, TIMER_ABSTIME, &its, NULL);
-    if (ret != 0) {
-        ALOGE("Failed to reset HDCP status checking timer.");
+    ALOGV("Re-enabling Display IED ");
+    if (!drm_hdcp_enable_display_ied()) {
+        ALOGE("drm_hdcp_enable_display_ied FAILED!!!");
     }
-
-    timer_delete(g_hdcpStatusCheckTimer);
-    g_hdcpStatusCheckTimer = 0;
+    g_hdcpAuthenticated = authenticated;
+    auth->running = false;
 }
 
-static bool drm_hdcp_enable_and_check()
+// One attempt, return false when the authentication is over
+static bool drm_hdcp_auth_step(drm_hdcp_auth *auth)
 {
-    ALOGV("Entering %s", __func__);
-    bool ret = false;
-    int i, j;
-
-    for (i = 0; i < HDCP_ENABLE_NUM_OF_TRY; i++) {
-        ALOGV("Try to enable and check HDCP at iteration %d", i);
-        if (drm_hdcp_enable() == false) {
-            if (drm_hdmi_getConnectionStatus() == 0) {
-                ALOGW("HDMI is disconnected, abort HDCP enabling and checking.");
-                return true;
-            }
-        } else {
-            for (j = 0; j < HDCP_CHECK_NUM_OF_TRY; j++) {
-                if (drm_hdcp_isAuthenticated() == false) {
-                    break;
-                }
-            }
-            if (j == HDCP_CHECK_NUM_OF_TRY) {
-                ret = true;
+    ALOGV("Try to enable and check HDCP at iteration %d", auth->attempt);
+    if (drm_hdcp_enable() == false) {
+        if (drm_hdmi_getConnectionStatus() == 0) {
+            ALOGW("HDMI is disconnected, abort HDCP enabling and checking.");
+            drm_hdcp_auth_finish(auth, true);
+            return false;
+        }
+    } else {
+        int j;
+        for (j = 0; j < HDCP_CHECK_NUM_OF_TRY; j++) {
+            if (drm_hdcp_isAuthenticated() == false) {
                 break;
             }
         }
-        // Adding delay to make sure panel receives video signal so it can start HDCP authentication.
-        // (HDCP spec 1.3, section 2.3)
-        usleep(HDCP_ENABLE_DELAY_USEC);
+        if (j == HDCP_CHECK_NUM_OF_TRY) {
+            drm_hdcp_auth_finish(auth, true);
+            return false;
+        }
     }
-
-    ALOGV("Leaving %s", __func__);
-    return ret;
+    if (++auth->attempt == HDCP_ENABLE_NUM_OF_TRY) {
+        drm_hdcp_auth_finish(auth, false);
+        return false;
+    }
+    return true;
 }
 
-static bool drm_hdcp_enable_hdcp_work()
+/*
+ * Authenticate, then check the link when the DRM driver sends a uevent
+ * (hotplug, link change), and periodically as a fallback. The period
+ * starts at HDCP_STATUS_CHECK_INTERVAL and doubles after each good
+ * check, up to HDCP_STATUS_CHECK_MAX_INTERVAL, so a stable link rarely
+ * wakes the CPU. Without the uevent socket, the link is checked every
+ * HDCP_STATUS_CHECK_INTERVAL. A lost authentication starts over.
+ */
+static void* drm_hdcp_link_monitor(void*)
 {
-    bool ret = true;
-    sec_result_t res;
+    int ueventFd = drm_hdcp_open_uevent_socket();
+    if (ueventFd < 0)
+        ALOGW("Failed to open uevent socket, polling HDCP link status.");
+
+    struct pollfd fds[2];
+    fds[0].fd = g_hdcpMonitorPipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = ueventFd;
+    fds[1].events = POLLIN;
+    int nfds = (ueventFd >= 0) ? 2 : 1;
+
+    drm_hdcp_auth auth;
+    drm_hdcp_auth_start(&auth);
+    int interval = HDCP_STATUS_CHECK_INTERVAL;
+    int64_t deadline = drm_hdcp_now_ms();
+    while (true) {
+        int64_t timeout = deadline - drm_hdcp_now_ms();
+        if (timeout < 0)
+            timeout = 0;
+        fds[0].revents = fds[1].revents = 0;
+        int ret = poll(fds, nfds, (int)timeout);
+        if (ret < 0 && errno != EINTR) {
+            ALOGE("Failed to wait for HDCP link events, %d", errno);
+            break;
+        }
+        if (fds[0].revents)
+            break;
+
+        bool event = (nfds > 1 && fds[1].revents &&
+                drm_hdcp_has_drm_uevent(ueventFd));
+        if (drm_hdcp_now_ms() < deadline && (auth.running || !event))
+            continue;
+
+        if (auth.running) {
+            if (drm_hdcp_auth_step(&auth)) {
+                deadline = drm_hdcp_now_ms() + HDCP_ENABLE_DELAY_USEC / 1000;
+            } else {
+                interval = HDCP_STATUS_CHECK_INTERVAL;
+                deadline = drm_hdcp_now_ms() + interval * 1000;
+            }
+            continue;
+        }
 
-    ALOGV("Disabling Display IED ");
-    if (!drm_hdcp_disable_display_ied()) {
-        ALOGE("drm_hdcp_disable_display_ied FAILED!!!");
+        if (!drm_hdcp_isAuthenticated()) {
+            ALOGI("HDCP is not authenticated, restarting authentication process.");
+            drm_hdcp_auth_start(&auth);
+            deadline = drm_hdcp_now_ms();
+            continue;
+        }
+        if (event || ueventFd < 0) {
+            interval = HDCP_STATUS_CHECK_INTERVAL;
+        } else if (interval < HDCP_STATUS_CHECK_MAX_INTERVAL) {
+            interval *= 2;
+        }
+        deadline = drm_hdcp_now_ms() + interval * 1000;
     }
 
-    ret = drm_hdcp_enable_and_check();
-    if (!ret) {
-        // Don't return here as HDCP can be re-authenticated during periodic time check.
-        ALOGI("HDCP authentication will be restarted in %d seconds.", HDCP_STATUS_CHECK_INTERVAL);
+    // Stopped during an authentication, which must not leave IED off
+    if (auth.running)
+        drm_hdcp_enable_display_ied();
+    if (ueventFd >= 0)
+        close(ueventFd);
+    return NULL;
+}
+
+static bool drm_hdcp_start_link_checking()
+{
+    if (g_hdcpMonitorRunning) {
+        ALOGW("HDCP link monitor has been started.");
+        return false;
     }
-    ALOGV("Re-enabling Display IED ");
-    if (!drm_hdcp_enable_display_ied()) {
-        ALOGE("drm_hdcp_enable_display_ied FAILED!!!");
+
+    if (pipe(g_hdcpMonitorPipe) != 0) {
+        ALOGE("Failed to create HDCP link monitor pipe.");
+        return false;
+    }
+    if (pthread_create(&g_hdcpMonitorThread, NULL, drm_hdcp_link_monitor, NULL) != 0) {
+        ALOGE("Failed to create HDCP link monitor.");
+        close(g_hdcpMonitorPipe[0]);
+        close(g_hdcpMonitorPipe[1]);
+        g_hdcpMonitorPipe[0] = g_hdcpMonitorPipe[1] = -1;
+        return false;
     }
+    g_hdcpMonitorRunning = true;
+    return true;
+}
 
-    return ret;
+static void drm_hdcp_stop_link_checking()
+{
+    if (!g_hdcpMonitorRunning) {
+        ALOGV("HDCP link monitor has been stopped.");
+        return;
+    }
+
+    char stop = 1;
+    if (write(g_hdcpMonitorPipe[1], &stop, sizeof(stop)) != sizeof(stop)) {
+        ALOGE("Failed to stop HDCP link monitor.");
+    }
+    pthread_join(g_hdcpMonitorThread, NULL);
+    close(g_hdcpMonitorPipe[0]);
+    close(g_hdcpMonitorPipe[1]);
+    g_hdcpMonitorPipe[0] = g_hdcpMonitorPipe[1] = -1;
+    g_hdcpMonitorRunning = false;
 }
 
 void drm_hdcp_disable_hdcp(bool connected)
 {
     ALOGV("Entering %s", __func__);
     drm_hdcp_stop_link_checking();
+    g_hdcpAuthenticated = false;
     if (connected) {
         // disable HDCP if HDMI is  connected.
         drm_hdcp_disable();
@@ -347,16 +465,20 @@ bool drm_hdcp_enable_hdcp()
     if (false) {
         ALOGW("HDCP is not supported, abort HDCP enabling.");
         ret = false;
-        // this may be fake indication during quick plug/unplug cycle, and unplug event may be filtered out, so status timer still needs to be set.
-    } else {
-        ret = drm_hdcp_enable_hdcp_work();
+        // this may be fake indication during quick plug/unplug cycle, and unplug event may be filtered out, so link monitor still needs to be started.
+    } else if (!drm_hdcp_start_link_checking()) {
+        // The link monitor authenticates, without it there is no HDCP
+        ret = false;
     }
 
-    // Ignore return value
-    drm_hdcp_start_link_checking();
-
     ALOGV("Leaving %s", __func__);
-    // Return success as HDCP authentication failure may be recoverable.
+    // The authentication completes in the link monitor, see
+    // drm_hdcp_is_authenticated. Its failure may be recoverable.
     return ret;
 }
 
+bool drm_hdcp_is_authenticated()
+{
+    return g_hdcpAuthenticated;
+}
+
@@ -21,10 +21,14 @@
 
 #ifdef ENABLE_HDCP
 void drm_hdcp_disable_hdcp(bool connected);
+// Starts the authentication in the background, and returns at once
 bool drm_hdcp_enable_hdcp();
+// Whether the authentication started by drm_hdcp_enable_hdcp completed
+bool drm_hdcp_is_authenticated();
 #else
 void drm_hdcp_disable_hdcp(bool connected) {}
 bool drm_hdcp_enable_hdcp() { return true; }
+bool drm_hdcp_is_authenticated() { return true; }
 #endif
 
 
@@ -27,6 +27,7 @@
 #include "drm_hdmi.h"
 #include "xf86drm.h"
 #include "xf86drmMode.h"
+#include "drm_connector.h"
 
 
 #define HDMI_FORCE_VIDEO_ON_OFF 1
@@ -46,32 +47,22 @@ typedef struct _drmContext {
     MDSHDMITiming modeSelected;
     char productInfo[EDID_PRODUCT_INFO_LEN];
     drmModeConnectorPtr hdmiConnector;
+    // Found once, the connectors and properties of a device don't change
+    uint32_t hdmiConnectorId;
+    uint32_t edidPropId;
 } drmContext;
 
 static drmContext gDrmCxt;
 
+// Only the connector of this type is probed, by its cached Id
 static drmModeConnector* getConnector(int fd, uint32_t connector_type)
 {
     ALOGV("Entering %s, %d", __func__, connector_type);
-    drmModeRes *resources = drmModeGetResources(fd);
+    if (gDrmCxt.hdmiConnectorId == 0)
+        gDrmCxt.hdmiConnectorId = drm_find_connector_id(fd, connector_type);
     drmModeConnector *connector = NULL;
-    int i;
-
-    if (resources == NULL || resources->connectors == NULL) {
-        ALOGE("%s: drmModeGetResources failed.", __func__);
-        return NULL;
-    }
-    for (i = 0; i < resources->count_connectors; i++) {
-        connector = drmModeGetConnector(fd, resources->connectors[i]);
-        if (connector == NULL)
-            continue;
-        if (connector->connector_type == connector_type)
-            break;
-
-        drmModeFreeConnector(connector);
-        connector = NULL;
-    }
-    drmModeFreeResources(resources);
+    if (gDrmCxt.hdmiConnectorId != 0)
+        connector = drmModeGetConnector(fd, gDrmCxt.hdmiConnectorId);
     if (connector == NULL) {
         ALOGE("%s: Failed to get conector", __func__);
     }
@@ -344,17 +335,11 @@ int drm_hdmi_getConnectionStatus()
         return 0;
 
     // Read EDID, and check whether it's HDMI or DVI interface
-    int ret = 0, i, j;
-    for (i = 0; i < connector->count_props; i++) {
-        drmModePropertyPtr props = drmModeGetProperty(gDrmCxt.drmFD, connector->props[i]);
-        if (!props)
-            continue;
-
-        if (props->name == NULL ||
-                strncmp(props->name, "EDID", sizeof("EDID")) != 0) {
-            drmModeFreeProperty(props);
-            continue;
-        }
+    int ret = 0;
+    int i = drm_find_connector_prop(gDrmCxt.drmFD, connector, "EDID", &gDrmCxt.edidPropId);
+    do {
+        if (i < 0)
+            break;
 
         uint64_t* edid = &connector->prop_values[i];
         drmModePropertyBlobPtr edidBlob = drmModeGetPropertyBlob(gDrmCxt.drmFD, *edid);
@@ -362,7 +347,8 @@ int drm_hdmi_getConnectionStatus()
             edidBlob->data == NULL ||
             edidBlob->length < HDMI_TIMING_MAX) {
             ALOGE("%s: Invalid EDID Blob.", __func__);
-            drmModeFreeProperty(props);
+            if (edidBlob)
+                drmModeFreePropertyBlob(edidBlob);
             ret = 0;
             break;
         }
@@ -380,25 +366,10 @@ int drm_hdmi_getConnectionStatus()
 
         drm_select_preferredmode(connector);
 
-        ret = 2; // DVI
-        if (edid_binary[126] == 0) {
-            drmModeFreeProperty(props);
-            break;
-        }
-
-        // search VSDB in extend edid
-        for (j = 0; j <= HDMI_TIMING_MAX - 3; j++) {
-            int n = HDMI_TIMING_MAX + j;
-            if (edid_binary[n]   == 0x03 &&
-                edid_binary[n+1] == 0x0c &&
-                edid_binary[n+2] == 0x00) {
-                ret = 1; //HDMI
-                break;
-            }
-        }
-        drmModeFreeProperty(props);
-        break;
-    }
+        bool audio = false;
+        ret = drm_edid_get_sink_type(edid_binary, edidBlob->length, &audio);
+        drmModeFreePropertyBlob(edidBlob);
+    } while (0);
 
     ALOGV("%s: connect status is %d", __func__, ret);
     return ret;
@@ -114,6 +114,7 @@ private:
     uint32_t mScaleMode;
     uint32_t mScaleStepX;
     uint32_t mScaleStepY;
+    sp<IBinder> getSurfaceComposer_l();
     int setDisplayScalingLocked(uint32_t mode,
          uint32_t stepx, uint32_t stepy);
 
@@ -88,6 +88,8 @@ public class DisplayObserver {
     private final int MSG_START_MONITORING_INPUT = 4;
     private final int MSG_STOP_MONITORING_INPUT = 5;
     private final int INPUT_TIMEOUT_MSEC = 5000;
+    // MDS is only told about the transitions, not about each touch event
+    private volatile boolean mInputActive = false;
 
     // Broadcast receiver for device connections intent broadcasts
     private final BroadcastReceiver mReceiver = new DisplayObserverBroadcastReceiver();
@@ -112,8 +114,11 @@ public class DisplayObserver {
     private WindowManagerPolicy.WindowManagerFuncs mWindowManagerFuncs;
 
     public void onInputEvent() {
-        logv("input is active");
-        mDs.updateInputState(true);
+        if (!mInputActive) {
+            logv("input is active");
+            mInputActive = true;
+            mDs.updateInputState(true);
+        }
         if (mHandler.hasMessages(MSG_INPUT_TIMEOUT))
             mHandler.removeMessages(MSG_INPUT_TIMEOUT);
 
@@ -365,6 +370,7 @@ public class DisplayObserver {
                 break;
             case MSG_INPUT_TIMEOUT:
                 logv("input is idle");
+                mInputActive = false;
                 mDs.updateInputState(false);
                 break;
             case MSG_START_MONITORING_INPUT:
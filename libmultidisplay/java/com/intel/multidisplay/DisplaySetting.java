@@ -55,6 +55,10 @@ public class DisplaySetting {
     public static final int EDP_HDMI    = 1;
     public static final int EDP_DVI     = 2;
 
+    /// Values of each timing in getHdmiTimingList:
+    /// width, height, refresh, interlace and ratio
+    public static final int HDMI_TIMING_FIELDS = 5;
+
     public static final String MDS_EDP_HOTPLUG         = "android.intel.mds.EXTERNAL_DP_HOTPLUG";
     public static final String MDS_GET_HDMI_INFO       = "android.intel.mds.GET.HDMI_INFO";
     public static final String MDS_SET_HDMI_MODE       = "android.intel.mds.SET.HDMI_MODE";
@@ -75,13 +79,17 @@ public class DisplaySetting {
     private static native int     native_getHdmiTiming(int width[],
                                                 int height[], int refresh[],
                                                 int interlace[], int ratio[]);
+    private static native int     native_getHdmiTimingList(int timings[]);
     private static native boolean native_setHdmiTiming(int width, int height,
                             int refresh, int interlace, int ratio);
     private static native int     native_getHdmiInfoCount();
     private static native boolean native_setHdmiScaleType(int Type);
     private static native boolean native_setHdmiOverscan(int h, int v);
+    private static native boolean native_setHdmiScaling(int Type, int h, int v);
+    private static native boolean native_setHdmiConfig(int index, int Type, int h, int v);
     private static native int     native_updatePhoneCallState(boolean state);
     private static native int     native_updateInputState(boolean state);
+    private static native int     native_updatePowerSaveState(boolean state);
     private static native int     native_setVppState(int dpyId, boolean state, int status);
 
     public DisplaySetting() {
@@ -114,6 +122,10 @@ public class DisplaySetting {
                                     refresh, interlace, ratio);
     }
 
+    public int getHdmiTimingList(int timings[]) {
+        return native_getHdmiTimingList(timings);
+    }
+
     public boolean setHdmiTiming(int width, int height,
                         int refresh, int interlace, int ratio) {
         return native_setHdmiTiming(width, height,
@@ -136,6 +148,17 @@ public class DisplaySetting {
         return native_setHdmiOverscan(hValue, vValue);
     }
 
+    // The scale type and the overscan in a single call to the service
+    public boolean setHdmiScaling(int Type, int hValue, int vValue) {
+        return native_setHdmiScaling(Type, hValue, vValue);
+    }
+
+    // The timing at index in getHdmiTimingList, the scale type and
+    // the overscan in a single call to the service, with one mode set
+    public boolean setHdmiConfig(int index, int Type, int hValue, int vValue) {
+        return native_setHdmiConfig(index, Type, hValue, vValue);
+    }
+
     public int updatePhoneCallState(boolean phoneState) {
         return native_updatePhoneCallState(phoneState);
     }
@@ -144,6 +167,11 @@ public class DisplaySetting {
         return native_updateInputState(inputState);
     }
 
+    /// Thermal throttling or low battery
+    public int updatePowerSaveState(boolean powerSave) {
+        return native_updatePowerSaveState(powerSave);
+    }
+
     public int setVppState(int dpyId, boolean state, int status) {
         return native_setVppState(dpyId, state, status);
     }
@@ -17,6 +17,9 @@
 
 
 //#define LOG_NDEBUG 0
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "JNIHelp.h"
 #include "jni.h"
 #include <android_runtime/AndroidRuntime.h>
@@ -36,11 +39,35 @@ namespace intel {
 
 
 #define CLASS_PATH_NAME  "com/intel/multidisplay/DisplaySetting"
+// Same as HDMI_TIMING_MAX of the service
+#define HDMI_TIMING_MAX  128
+// width, height, refresh, interlace and ratio of each timing in a packed list
+#define HDMI_TIMING_FIELDS 5
+// How often the reconnection thread looks for MDS after it died
+#define MDS_RECONNECT_INTERVAL_US 500000
 
 sp<IMDService>  gMds = NULL;
 static Mutex    gMutex;
 static sp<class JNIMDSListener>    gListener = NULL;
 static int32_t  gListenerId = -1;
+static sp<IBinder::DeathRecipient> gDeathRecipient = NULL;
+static sp<Thread> gReconnectThread = NULL;
+// The interfaces of gMds, each got once, dropped with it when MDS dies
+static sp<IMultiDisplayHdmiControl> gHdmiControl = NULL;
+static sp<IMultiDisplayInfoProvider> gInfoProvider = NULL;
+static sp<IMultiDisplayEventMonitor> gEventMonitor = NULL;
+static sp<IMultiDisplaySinkRegistrar> gSinkRegistrar = NULL;
+#ifdef TARGET_HAS_ISV
+static sp<IMultiDisplayVppConfig> gVppConfig = NULL;
+#endif
+// The timing list last got from MDS, only sent again when its version changes
+static MDSHdmiTiming gTimings[HDMI_TIMING_MAX];
+static int32_t  gTimingCount = 0;
+static int32_t  gTimingVersion = -1;
+
+static struct {
+    jmethodID onMdsMessage;
+} gDisplaySettingClassInfo;
 
 
 class JNIMDSListener : public BnMultiDisplayListener
@@ -53,22 +80,66 @@ public:
 private:
     jobject mServiceObj; // reference to DisplaySetting Java object to call back
     jmethodID mOnMdsMessageMethodID; // onMdsMessage method id
+    // The mode changes which arrive while a binder thread is calling
+    // Java are coalesced, that thread then delivers the last one
+    Mutex mDispatchLock;
+    bool mDispatching;
+    bool mPending;
+    int mPendingMode;
 };
 
+// The JNIEnv of each binder thread, got or attached once
+static pthread_key_t gEnvKey;
+// Set on the threads attached here, to detach them when they exit
+static pthread_key_t gAttachedKey;
+static pthread_once_t gEnvKeyOnce = PTHREAD_ONCE_INIT;
+
+static void detachThreadJNIEnv(void*)
+{
+    JavaVM* vm = AndroidRuntime::getJavaVM();
+    if (vm)
+        vm->DetachCurrentThread();
+}
+
+static void createEnvKeys()
+{
+    pthread_key_create(&gEnvKey, NULL);
+    pthread_key_create(&gAttachedKey, detachThreadJNIEnv);
+}
+
+static JNIEnv* getThreadJNIEnv()
+{
+    pthread_once(&gEnvKeyOnce, createEnvKeys);
+    JNIEnv* env = (JNIEnv*)pthread_getspecific(gEnvKey);
+    if (env)
+        return env;
+
+    JavaVM* vm = AndroidRuntime::getJavaVM();
+    if (vm == NULL)
+        return NULL;
+    if (vm->GetEnv((void**)&env, JNI_VERSION_1_4) != JNI_OK) {
+        JavaVMAttachArgs args = { JNI_VERSION_1_4, "MDSListener", NULL };
+        if (vm->AttachCurrentThread(&env, &args) != JNI_OK)
+            return NULL;
+        pthread_setspecific(gAttachedKey, env);
+    }
+    pthread_setspecific(gEnvKey, env);
+    return env;
+}
+
 JNIMDSListener::JNIMDSListener(JNIEnv* env, jobject thiz, jobject serviceObj)
 {
     ALOGI("Creating JNI MDS listener.");
-    jclass clazz = env->FindClass(CLASS_PATH_NAME);
-    mOnMdsMessageMethodID = NULL;
-    if (clazz == NULL) {
-        ALOGE("%s: Fail to find class %s", __func__, CLASS_PATH_NAME);
-    } else {
-        mOnMdsMessageMethodID = env->GetMethodID(clazz, "onMdsMessage", "(II)V");
-        if (mOnMdsMessageMethodID == NULL) {
-            ALOGE("%s: Fail to find onMdsMessage method.", __func__);
-        }
+    // Looked up once when the natives are registered
+    mOnMdsMessageMethodID = gDisplaySettingClassInfo.onMdsMessage;
+    if (mOnMdsMessageMethodID == NULL) {
+        ALOGE("%s: Fail to find onMdsMessage method.", __func__);
     }
 
+    mDispatching = false;
+    mPending = false;
+    mPendingMode = 0;
+
     mServiceObj  = env->NewGlobalRef(serviceObj);
     if (!mServiceObj) {
         ALOGE("%s: Fail to reference serviceObj!", __func__);
@@ -86,45 +157,196 @@ JNIMDSListener::~JNIMDSListener() {
 
 status_t JNIMDSListener::onMdsMessage(int msg, void* value, int size)
 {
-    JNIEnv *env = AndroidRuntime::getJNIEnv();
-    if (env == NULL) {
-        ALOGE("%s: Faild to get JNI Env.", __func__);
-        return NO_INIT;
-    }
+    if (msg != (int)MDS_MSG_MODE_CHANGE)
+        return NO_ERROR;
 
     if (!mServiceObj || !mOnMdsMessageMethodID) {
         ALOGE("%s: Invalid service object or method ID", __func__);
         return NO_INIT;
     }
 
-    if (msg == (int)MDS_MSG_MODE_CHANGE) {
+    {
+        AutoMutex _l(mDispatchLock);
         ALOGV("Get a MDS mode change message %d, 0x%x", msg, *((int*)value));
-        env->CallVoidMethod(mServiceObj, mOnMdsMessageMethodID, (int)msg, *((int*)value));
+        mPendingMode = *((int*)value);
+        mPending = true;
+        // The thread in Java delivers it when it returns
+        if (mDispatching)
+            return NO_ERROR;
+        mDispatching = true;
     }
 
-    if (env->ExceptionCheck()) {
-        ALOGW("%s: Exception occurred while posting message.", __func__);
-        env->ExceptionClear();
+    JNIEnv *env = getThreadJNIEnv();
+    if (env == NULL) {
+        ALOGE("%s: Faild to get JNI Env.", __func__);
+        AutoMutex _l(mDispatchLock);
+        mDispatching = false;
+        return NO_INIT;
+    }
+
+    while (true) {
+        int mode;
+        {
+            AutoMutex _l(mDispatchLock);
+            if (!mPending) {
+                mDispatching = false;
+                break;
+            }
+            mode = mPendingMode;
+            mPending = false;
+        }
+        env->CallVoidMethod(mServiceObj, mOnMdsMessageMethodID, msg, mode);
+        if (env->ExceptionCheck()) {
+            ALOGW("%s: Exception occurred while posting message.", __func__);
+            env->ExceptionClear();
+        }
     }
 
     return NO_ERROR;
 }
 
-static jboolean MDS_InitMDSClient(JNIEnv* env, jobject thiz, jobject serviceObj)
+static sp<IMultiDisplayHdmiControl> getHdmiControl_l()
 {
-    AutoMutex _l(gMutex);
-    if (env == NULL || thiz == NULL || serviceObj == NULL) {
-        ALOGE("%s: Invalid jvm parameters.", __func__);
-        return false;
-    }
+    if (gHdmiControl == NULL && gMds != NULL)
+        gHdmiControl = gMds->getHdmiControl();
+    return gHdmiControl;
+}
+
+static sp<IMultiDisplayInfoProvider> getInfoProvider_l()
+{
+    if (gInfoProvider == NULL && gMds != NULL)
+        gInfoProvider = gMds->getInfoProvider();
+    return gInfoProvider;
+}
+
+static sp<IMultiDisplayEventMonitor> getEventMonitor_l()
+{
+    if (gEventMonitor == NULL && gMds != NULL)
+        gEventMonitor = gMds->getEventMonitor();
+    return gEventMonitor;
+}
+
+static sp<IMultiDisplaySinkRegistrar> getSinkRegistrar_l()
+{
+    if (gSinkRegistrar == NULL && gMds != NULL)
+        gSinkRegistrar = gMds->getSinkRegistrar();
+    return gSinkRegistrar;
+}
+
+#ifdef TARGET_HAS_ISV
+static sp<IMultiDisplayVppConfig> getVppConfig_l()
+{
+    if (gVppConfig == NULL && gMds != NULL)
+        gVppConfig = gMds->getVppConfig();
+    return gVppConfig;
+}
+#endif
 
+static sp<IMDService> findMds(bool wait)
+{
     sp<IServiceManager> sm = defaultServiceManager();
     if (sm == NULL) {
         ALOGE("%s: Fail to get service manager", __func__);
+        return NULL;
+    }
+    String16 name(INTEL_MDS_SERVICE_NAME);
+    return interface_cast<IMDService>(wait ? sm->getService(name) : sm->checkService(name));
+}
+
+static void resetMds_l()
+{
+    gMds = NULL;
+    gListenerId = -1;
+    gHdmiControl = NULL;
+    gInfoProvider = NULL;
+    gEventMonitor = NULL;
+    gSinkRegistrar = NULL;
+#ifdef TARGET_HAS_ISV
+    gVppConfig = NULL;
+#endif
+    gTimingCount = 0;
+    gTimingVersion = -1;
+}
+
+// Watches mds and registers gListener to it
+static bool connectMds_l(const sp<IMDService>& mds)
+{
+    gMds = mds;
+    gMds->asBinder()->linkToDeath(gDeathRecipient);
+    sp<IMultiDisplaySinkRegistrar> sinkRegistrar = getSinkRegistrar_l();
+    if (sinkRegistrar == NULL)
+        return false;
+    gListenerId = sinkRegistrar->registerListener(gListener,
+            "DisplaySetting", MDS_MSG_MODE_CHANGE);
+    ALOGV("MDS JNI listener ID %d", gListenerId);
+    return true;
+}
+
+// Waits for MDS to come back, off the binder and UI threads, then
+// registers the listener again and delivers the mode missed meanwhile
+class JNIMDSReconnectThread : public Thread
+{
+public:
+    JNIMDSReconnectThread() : Thread(false) {}
+
+private:
+    virtual bool threadLoop()
+    {
+        sp<IMDService> mds = findMds(false);
+        sp<JNIMDSListener> listener;
+        int mode = 0;
+        if (mds != NULL) {
+            AutoMutex _l(gMutex);
+            if (exitPending() || gListener == NULL || gMds != NULL)
+                return false;
+            if (connectMds_l(mds)) {
+                ALOGI("%s: Reconnected to MDS", __func__);
+                sp<IMultiDisplayInfoProvider> infoProvider = getInfoProvider_l();
+                if (infoProvider != NULL)
+                    mode = infoProvider->getDisplayMode(false);
+                listener = gListener;
+            } else {
+                resetMds_l();
+            }
+        }
+        if (listener != NULL) {
+            listener->onMdsMessage(MDS_MSG_MODE_CHANGE, &mode, sizeof(mode));
+            return false;
+        }
+        usleep(MDS_RECONNECT_INTERVAL_US);
+        return !exitPending();
+    }
+};
+
+class JNIMDSDeathRecipient : public IBinder::DeathRecipient
+{
+public:
+    virtual void binderDied(const wp<IBinder>& who)
+    {
+        AutoMutex _l(gMutex);
+        if (gMds == NULL || gMds->asBinder().get() != who.unsafe_get())
+            return;
+        ALOGW("%s: MDS died, reconnecting", __func__);
+        resetMds_l();
+        if (gListener == NULL)
+            return;
+        if (gReconnectThread == NULL || !gReconnectThread->isRunning()) {
+            gReconnectThread = new JNIMDSReconnectThread();
+            gReconnectThread->run("MDSReconnect");
+        }
+    }
+};
+
+static jboolean MDS_InitMDSClient(JNIEnv* env, jobject thiz, jobject serviceObj)
+{
+    if (env == NULL || thiz == NULL || serviceObj == NULL) {
+        ALOGE("%s: Invalid jvm parameters.", __func__);
         return false;
     }
-    gMds = interface_cast<IMDService>(sm->getService(String16(INTEL_MDS_SERVICE_NAME)));
-    if (gMds == NULL) {
+    // Looked up without the lock, getService may wait for MDS to start
+    sp<IMDService> mds = findMds(true);
+    AutoMutex _l(gMutex);
+    if (mds == NULL) {
         ALOGE("%s: Failed to get MDS service", __func__);
         return false;
     }
@@ -134,24 +356,29 @@ static jboolean MDS_InitMDSClient(JNIEnv* env, jobject thiz, jobject serviceObj)
         ALOGE("%s: Failed to create JNIMDSListener instance.", __func__);
         return false;
     }
-    sp<IMultiDisplaySinkRegistrar> sinkRegistrar = NULL;
-    if ((sinkRegistrar = gMds->getSinkRegistrar()) == NULL)
+    if (gDeathRecipient == NULL)
+        gDeathRecipient = new JNIMDSDeathRecipient();
+    if (!connectMds_l(mds)) {
+        resetMds_l();
         return false;
-    gListenerId = sinkRegistrar->registerListener(gListener,
-            "DisplaySetting", MDS_MSG_MODE_CHANGE);
-    ALOGV("MDS JNI listener ID %d", gListenerId);
+    }
     return true;
 }
 
 static jboolean MDS_DeInitMDSClient(JNIEnv* env, jobject obj)
 {
     AutoMutex _l(gMutex);
-    sp<IMultiDisplaySinkRegistrar> sinkRegistrar = NULL;
-    if (gListenerId >= 0 && gListener != NULL && gMds != NULL &&
-            (sinkRegistrar = gMds->getSinkRegistrar()) != NULL) {
+    sp<IMultiDisplaySinkRegistrar> sinkRegistrar = getSinkRegistrar_l();
+    if (gListenerId >= 0 && gListener != NULL && sinkRegistrar != NULL) {
         sinkRegistrar->unregisterListener(gListenerId);
     }
-    gListenerId = -1;
+    if (gMds != NULL)
+        gMds->asBinder()->unlinkToDeath(gDeathRecipient);
+    // It sees gListener is gone, and stops
+    if (gReconnectThread != NULL)
+        gReconnectThread->requestExit();
+    gReconnectThread = NULL;
+    resetMds_l();
     gListener   = NULL;
     ALOGI("%s: Release MultiDisplay JNI client.", __func__);
     return true;
@@ -160,12 +387,43 @@ static jboolean MDS_DeInitMDSClient(JNIEnv* env, jobject obj)
 static jint MDS_getMode(JNIEnv* env, jobject obj)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return 0;
-    sp<IMultiDisplayInfoProvider> infoProvider = gMds->getInfoProvider();
+    sp<IMultiDisplayInfoProvider> infoProvider = getInfoProvider_l();
     if (infoProvider == NULL) return 0;
     return infoProvider->getDisplayMode(true);
 }
 
+// Refresh gTimings, MDS only sends the list if it changed
+static int32_t updateHdmiTimings_l()
+{
+    sp<IMultiDisplayHdmiControl> hdmiControl = getHdmiControl_l();
+    if (hdmiControl == NULL) return 0;
+    int32_t version = gTimingVersion;
+    int32_t count = 0;
+    if (hdmiControl->getHdmiTimings(&version, &count, gTimings, HDMI_TIMING_MAX) != NO_ERROR) {
+        ALOGE("%s: Fail to get HDMI timings", __func__);
+        gHdmiControl = NULL;
+        gTimingVersion = -1;
+        gTimingCount = 0;
+        return 0;
+    }
+    ALOGV("HDMI timing list version %d -> %d, %d timings", gTimingVersion, version, count);
+    gTimingVersion = version;
+    gTimingCount = count;
+    return count;
+}
+
+static void setTimingField(JNIEnv* env, jintArray array, int count, size_t offset)
+{
+    if (array == NULL) return;
+    jint values[HDMI_TIMING_MAX];
+    jsize length = env->GetArrayLength(array);
+    if (count > length)
+        count = length;
+    for (int i = 0; i < count; i++)
+        values[i] = *(const int*)((const char*)&gTimings[i] + offset);
+    env->SetIntArrayRegion(array, 0, count, values);
+}
+
 static jint MDS_getHdmiTiming(
     JNIEnv* env,
     jobject obj,
@@ -176,50 +434,35 @@ static jint MDS_getHdmiTiming(
     jintArray ratio)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return 0;
-    sp<IMultiDisplayHdmiControl> hdmiControl = gMds->getHdmiControl();
-    if (hdmiControl == NULL) return 0;
-    int32_t* pWidth = env->GetIntArrayElements(width, NULL);
-    int32_t* pHeight = env->GetIntArrayElements(height, NULL);
-    int32_t* pRefresh = env->GetIntArrayElements(refresh, NULL);
-    int32_t* pInterlace = env->GetIntArrayElements(interlace, NULL);
-    int32_t* pRatio = env->GetIntArrayElements(ratio, NULL);
     // The total supported timing count
-    jint iCount = hdmiControl->getHdmiTimingCount();
-
-    if (iCount > 0) {
-        jint i,j;
-        MDSHdmiTiming *list[iCount];
-        memset(list, 0, iCount * sizeof(MDSHdmiTiming*));
-        for (i = 0; i < iCount; i++) {
-            list[i] = (MDSHdmiTiming *)malloc(sizeof(MDSHdmiTiming));
-            if (list[i] == NULL) {
-                for (j = 0; j < i; j++)
-                    if (list[j]) free(list[j]);
-                return 0;
-            }
-            memset(list[i], 0, sizeof(MDSHdmiTiming));
-        }
-
-        hdmiControl->getHdmiTimingList(iCount, list);
-        for (i = 0; i < iCount; i++) {
-            pRatio[i]     = list[i]->ratio;
-            pWidth[i]     = list[i]->width;
-            pHeight[i]    = list[i]->height;
-            pRefresh[i]   = list[i]->refresh;
-            pInterlace[i] = list[i]->interlace;
-        }
+    jint iCount = updateHdmiTimings_l();
+    setTimingField(env, width, iCount, offsetof(MDSHdmiTiming, width));
+    setTimingField(env, height, iCount, offsetof(MDSHdmiTiming, height));
+    setTimingField(env, refresh, iCount, offsetof(MDSHdmiTiming, refresh));
+    setTimingField(env, interlace, iCount, offsetof(MDSHdmiTiming, interlace));
+    setTimingField(env, ratio, iCount, offsetof(MDSHdmiTiming, ratio));
+    return iCount;
+}
 
-        for (i = 0; i < iCount; i++) {
-            if (list[i]) free(list[i]);
-        }
+// All the timings in one array of HDMI_TIMING_FIELDS values each
+static jint MDS_getHdmiTimingList(JNIEnv* env, jobject obj, jintArray timings)
+{
+    AutoMutex _l(gMutex);
+    if (timings == NULL) return 0;
+    jint iCount = updateHdmiTimings_l();
+    jsize length = env->GetArrayLength(timings) / HDMI_TIMING_FIELDS;
+    if (iCount > length)
+        iCount = length;
+    jint values[HDMI_TIMING_MAX * HDMI_TIMING_FIELDS];
+    for (jint i = 0; i < iCount; i++) {
+        jint* value = &values[i * HDMI_TIMING_FIELDS];
+        value[0] = gTimings[i].width;
+        value[1] = gTimings[i].height;
+        value[2] = gTimings[i].refresh;
+        value[3] = gTimings[i].interlace;
+        value[4] = gTimings[i].ratio;
     }
-
-    env->ReleaseIntArrayElements(width, pWidth, 0);
-    env->ReleaseIntArrayElements(height, pHeight, 0);
-    env->ReleaseIntArrayElements(refresh, pRefresh, 0);
-    env->ReleaseIntArrayElements(interlace, pInterlace, 0);
-    env->ReleaseIntArrayElements(ratio, pRatio, 0);
+    env->SetIntArrayRegion(timings, 0, iCount * HDMI_TIMING_FIELDS, values);
     return iCount;
 }
 
@@ -233,9 +476,8 @@ static jboolean MDS_setHdmiTiming(
     jint ratio)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return false;
-    sp<IMultiDisplayHdmiControl> hdmiControl = gMds->getHdmiControl();
-    if (hdmiControl == NULL) return 0;
+    sp<IMultiDisplayHdmiControl> hdmiControl = getHdmiControl_l();
+    if (hdmiControl == NULL) return false;
 
     MDSHdmiTiming timing;
     timing.ratio = ratio;
@@ -251,17 +493,14 @@ static jboolean MDS_setHdmiTiming(
 static jint MDS_getHdmiInfoCount(JNIEnv* env, jobject obj)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return 0;
-    sp<IMultiDisplayHdmiControl> hdmiControl = gMds->getHdmiControl();
-    if (hdmiControl == NULL) return 0;
-    return hdmiControl->getHdmiTimingCount();
+    // Gets the list too, the getHdmiTiming which follows is then free
+    return updateHdmiTimings_l();
 }
 
 static jboolean MDS_setHdmiScaleType(JNIEnv* env, jobject obj, jint type)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return false;
-    sp<IMultiDisplayHdmiControl> hdmiControl = gMds->getHdmiControl();
+    sp<IMultiDisplayHdmiControl> hdmiControl = getHdmiControl_l();
     if (hdmiControl == NULL) return false;
     status_t ret = hdmiControl->setHdmiScalingType((MDS_SCALING_TYPE)type);
     return (ret == NO_ERROR ? true : false);
@@ -270,18 +509,44 @@ static jboolean MDS_setHdmiScaleType(JNIEnv* env, jobject obj, jint type)
 static jboolean MDS_setHdmiOverscan(JNIEnv* env, jobject obj, jint hValue, jint vValue)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return false;
-    sp<IMultiDisplayHdmiControl> hdmiControl = gMds->getHdmiControl();
+    sp<IMultiDisplayHdmiControl> hdmiControl = getHdmiControl_l();
     if (hdmiControl == NULL) return false;
     status_t ret = hdmiControl->setHdmiOverscan(hValue, vValue);
     return (ret == NO_ERROR ? true : false);
 }
 
+static jboolean MDS_setHdmiScaling(JNIEnv* env, jobject obj, jint type, jint hValue, jint vValue)
+{
+    AutoMutex _l(gMutex);
+    sp<IMultiDisplayHdmiControl> hdmiControl = getHdmiControl_l();
+    if (hdmiControl == NULL) return false;
+    status_t ret = hdmiControl->setHdmiScaling((MDS_SCALING_TYPE)type, hValue, vValue);
+    return (ret == NO_ERROR ? true : false);
+}
+
+// The timing at index in the list got by getHdmiTimingList, the scale
+// type and the overscan in a single call to the service
+static jboolean MDS_setHdmiConfig(JNIEnv* env, jobject obj,
+        jint index, jint type, jint hValue, jint vValue)
+{
+    AutoMutex _l(gMutex);
+    sp<IMultiDisplayHdmiControl> hdmiControl = getHdmiControl_l();
+    if (hdmiControl == NULL) return false;
+    if (gTimingVersion < 0)
+        updateHdmiTimings_l();
+    if (index < 0 || index >= gTimingCount) {
+        ALOGE("%s: Invalid timing index %d of %d", __func__, index, gTimingCount);
+        return false;
+    }
+    status_t ret = hdmiControl->setHdmiConfig(gTimings[index],
+            (MDS_SCALING_TYPE)type, hValue, vValue);
+    return (ret == NO_ERROR ? true : false);
+}
+
 static jint MDS_updatePhoneCallState(JNIEnv* env, jobject obj, jboolean state)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return 0;
-    sp<IMultiDisplayEventMonitor> eventMonitor = gMds->getEventMonitor();
+    sp<IMultiDisplayEventMonitor> eventMonitor = getEventMonitor_l();
     if (eventMonitor == NULL) return 0;
     return eventMonitor->updatePhoneCallState(state);
 }
@@ -289,18 +554,24 @@ static jint MDS_updatePhoneCallState(JNIEnv* env, jobject obj, jboolean state)
 static jint MDS_updateInputState(JNIEnv* env, jobject obj, jboolean state)
 {
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return 0;
-    sp<IMultiDisplayEventMonitor> eventMonitor = gMds->getEventMonitor();
+    sp<IMultiDisplayEventMonitor> eventMonitor = getEventMonitor_l();
     if (eventMonitor == NULL) return 0;
     return eventMonitor->updateInputState(state);
 }
 
+static jint MDS_updatePowerSaveState(JNIEnv* env, jobject obj, jboolean state)
+{
+    AutoMutex _l(gMutex);
+    sp<IMultiDisplayEventMonitor> eventMonitor = getEventMonitor_l();
+    if (eventMonitor == NULL) return 0;
+    return eventMonitor->updatePowerSaveState(state);
+}
+
 static jint MDS_setVppState(JNIEnv* env, jobject obj, int dpyId, jboolean state, int status)
 {
 #ifdef TARGET_HAS_ISV
     AutoMutex _l(gMutex);
-    if (gMds == NULL) return 0;
-    sp<IMultiDisplayVppConfig> vppConfig = gMds->getVppConfig();
+    sp<IMultiDisplayVppConfig> vppConfig = getVppConfig_l();
     if (vppConfig == NULL) return 0;
     return vppConfig->setVppState((MDS_DISPLAY_ID)dpyId, state, status);
 #else
@@ -315,11 +586,15 @@ static JNINativeMethod sMethods[] = {
     {"native_getMode", "()I", (void*)MDS_getMode},
     {"native_setHdmiTiming", "(IIIII)Z", (void*)MDS_setHdmiTiming},
     {"native_getHdmiTiming", "([I[I[I[I[I)I", (void*)MDS_getHdmiTiming},
+    {"native_getHdmiTimingList", "([I)I", (void*)MDS_getHdmiTimingList},
     {"native_getHdmiInfoCount", "()I", (void*)MDS_getHdmiInfoCount},
     {"native_setHdmiScaleType", "(I)Z", (void*)MDS_setHdmiScaleType},
     {"native_setHdmiOverscan", "(II)Z", (void*)MDS_setHdmiOverscan},
+    {"native_setHdmiScaling", "(III)Z", (void*)MDS_setHdmiScaling},
+    {"native_setHdmiConfig", "(IIII)Z", (void*)MDS_setHdmiConfig},
     {"native_updatePhoneCallState", "(Z)I", (void*)MDS_updatePhoneCallState},
     {"native_updateInputState", "(Z)I", (void*)MDS_updateInputState},
+    {"native_updatePowerSaveState", "(Z)I", (void*)MDS_updatePowerSaveState},
     {"native_setVppState", "(IZI)I", (void*)MDS_setVppState},
 };
 
@@ -331,6 +606,7 @@ int register_intel_multidisplay_DisplaySetting(JNIEnv* env)
         ALOGE("%s: Fail to find class %s", __func__, CLASS_PATH_NAME);
         return -1;
     }
+    gDisplaySettingClassInfo.onMdsMessage = env->GetMethodID(clazz, "onMdsMessage", "(II)V");
     int ret = jniRegisterNativeMethods(env, CLASS_PATH_NAME, sMethods, NELEM(sMethods));
     ALOGV("Leaving %s, return = %d", __func__, ret);
     return ret;
@@ -22,6 +22,7 @@
 #include <binder/Parcel.h>
 
 #include <display/IMultiDisplayCallback.h>
+#include "MultiDisplayParcel.h"
 
 namespace android {
 namespace intel {
@@ -34,8 +35,54 @@ enum {
     MDS_CB_SET_HDMI_SCALING_TYPE,
     MDS_CB_SET_HDMI_OVERSCAN,
     MDS_CB_SET_INPUT_STATE,
+    MDS_CB_SET_HDMI_SCALING_ASYNC,
+    MDS_CB_SET_HDMI_CONFIG,
 };
 
+enum {
+    MDS_COMPLETION_DONE = IBinder::FIRST_CALL_TRANSACTION,
+};
+
+void MultiDisplayCompletion::complete(const sp<IBinder>& done, status_t result) {
+    if (done == NULL)
+        return;
+    Parcel data;
+    data.writeInt32(result);
+    done->transact(MDS_COMPLETION_DONE, data, NULL, IBinder::FLAG_ONEWAY);
+}
+
+status_t MultiDisplayCompletion::onTransact(
+    uint32_t code, const Parcel& data, Parcel* reply, uint32_t flags)
+{
+    if (code == MDS_COMPLETION_DONE) {
+        onComplete(data.readInt32());
+        return NO_ERROR;
+    }
+    return BBinder::onTransact(code, data, reply, flags);
+}
+
+status_t IMultiDisplayCallback::setHdmiScaling(
+        MDS_SCALING_TYPE type, int hValue, int vValue) {
+    status_t result = setHdmiScalingType(type);
+    if (result == NO_ERROR)
+        result = setHdmiOverscan(hValue, vValue);
+    return result;
+}
+
+status_t IMultiDisplayCallback::setHdmiScalingAsync(MDS_SCALING_TYPE type,
+        int hValue, int vValue, const sp<MultiDisplayCompletion>& done) {
+    MultiDisplayCompletion::complete(done, setHdmiScaling(type, hValue, vValue));
+    return NO_ERROR;
+}
+
+status_t IMultiDisplayCallback::setHdmiConfig(const MDSHdmiTiming& timing,
+        MDS_SCALING_TYPE type, int hValue, int vValue) {
+    status_t result = setHdmiTiming(timing);
+    if (result == NO_ERROR)
+        result = setHdmiScaling(type, hValue, vValue);
+    return result;
+}
+
 class BpMultiDisplayCallback : public BpInterface<IMultiDisplayCallback>
 {
 public:
@@ -75,7 +122,7 @@ public:
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayCallback::getInterfaceDescriptor());
 
-        data.write(&timing, sizeof(MDSHdmiTiming));
+        writeHdmiTiming(&data, timing);
         status_t result = remote()->transact(
                 MDS_CB_SET_HDMI_TIMING, data, &reply);
         if (result != NO_ERROR) {
@@ -111,6 +158,37 @@ public:
         return result;
     }
 
+    virtual status_t setHdmiScalingAsync(MDS_SCALING_TYPE type,
+            int hValue, int vValue, const sp<MultiDisplayCompletion>& done) {
+        if (done == NULL)
+            return BAD_VALUE;
+        Parcel data;
+        data.writeInterfaceToken(IMultiDisplayCallback::getInterfaceDescriptor());
+        data.writeInt32(type);
+        data.writeInt32(hValue);
+        data.writeInt32(vValue);
+        data.writeStrongBinder(done);
+        return remote()->transact(
+                MDS_CB_SET_HDMI_SCALING_ASYNC, data, NULL, IBinder::FLAG_ONEWAY);
+    }
+
+    virtual status_t setHdmiConfig(const MDSHdmiTiming& timing,
+            MDS_SCALING_TYPE type, int hValue, int vValue) {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayCallback::getInterfaceDescriptor());
+        writeHdmiTiming(&data, timing);
+        data.writeInt32(type);
+        data.writeInt32(hValue);
+        data.writeInt32(vValue);
+        status_t result = remote()->transact(
+                MDS_CB_SET_HDMI_CONFIG, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        return result;
+    }
+
     virtual status_t updateInputState(bool state) {
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayCallback::getInterfaceDescriptor());
@@ -152,7 +230,10 @@ status_t BnMultiDisplayCallback::onTransact(
         case MDS_CB_SET_HDMI_TIMING: {
             CHECK_INTERFACE(IMultiDisplayCallback, data, reply);
             MDSHdmiTiming timing;
-            data.read(&timing, sizeof(MDSHdmiTiming));
+            if (readHdmiTiming(data, &timing) != NO_ERROR) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
+            }
             ALOGV("%s: set HDMI timing, %dx%d@%dx%dx%d", __func__,
                     timing.width, timing.height, timing.refresh, timing.ratio);
             int32_t ret = setHdmiTiming(timing);
@@ -176,6 +257,34 @@ status_t BnMultiDisplayCallback::onTransact(
             reply->writeInt32(ret);
             return NO_ERROR;
         } break;
+        case MDS_CB_SET_HDMI_SCALING_ASYNC: {
+            CHECK_INTERFACE(IMultiDisplayCallback, data, reply);
+            int32_t type = data.readInt32();
+            int32_t hValue = data.readInt32();
+            int32_t vValue = data.readInt32();
+            sp<IBinder> done = data.readStrongBinder();
+            ALOGV("%s: set HDMI scaling type %d, overscan h:%d v:%d",
+                    __func__, type, hValue, vValue);
+            int32_t ret = setHdmiScaling((MDS_SCALING_TYPE)type, hValue, vValue);
+            MultiDisplayCompletion::complete(done, ret);
+            return NO_ERROR;
+        } break;
+        case MDS_CB_SET_HDMI_CONFIG: {
+            CHECK_INTERFACE(IMultiDisplayCallback, data, reply);
+            MDSHdmiTiming timing;
+            if (readHdmiTiming(data, &timing) != NO_ERROR) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
+            }
+            int32_t type = data.readInt32();
+            int32_t hValue = data.readInt32();
+            int32_t vValue = data.readInt32();
+            ALOGV("%s: set HDMI config, %dx%d@%d, scaling %d, overscan %d,%d", __func__,
+                    timing.width, timing.height, timing.refresh, type, hValue, vValue);
+            int32_t ret = setHdmiConfig(timing, (MDS_SCALING_TYPE)type, hValue, vValue);
+            reply->writeInt32(ret);
+            return NO_ERROR;
+        } break;
         case MDS_CB_SET_INPUT_STATE: {
             CHECK_INTERFACE(IMultiDisplayCallback, data, reply);
             bool state = (data.readInt32() == 1 ? true : false);
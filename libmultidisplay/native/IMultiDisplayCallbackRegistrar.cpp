@@ -31,6 +31,7 @@ namespace intel {
 enum {
     MDS_SERVER_REGISTER_CALLBACK = IBinder::FIRST_CALL_TRANSACTION,
     MDS_SERVER_UNREGISTER_CALLBACK,
+    MDS_SERVER_SHARE_DRM_DEVICE,
 };
 
 class BpMultiDisplayCallbackRegistrar:public BpInterface<IMultiDisplayCallbackRegistrar> {
@@ -65,6 +66,19 @@ public:
         result = reply.readInt32();
         return result;
     }
+
+    virtual status_t shareDrmDevice(int fd) {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayCallbackRegistrar::getInterfaceDescriptor());
+        data.writeFileDescriptor(fd);
+        status_t result = remote()->transact(
+                MDS_SERVER_SHARE_DRM_DEVICE, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        return result;
+    }
 };
 
 IMPLEMENT_META_INTERFACE(MultiDisplayCallbackRegistrar,"com.intel.MultiDisplayCallbackRegistrar");
@@ -89,6 +103,14 @@ status_t BnMultiDisplayCallbackRegistrar::onTransact(
             reply->writeInt32(ret);
             return NO_ERROR;
         } break;
+        case MDS_SERVER_SHARE_DRM_DEVICE: {
+            CHECK_INTERFACE(IMultiDisplayCallbackRegistrar, data, reply);
+            // Owned by the parcel, the implementation dups it
+            int fd = data.readFileDescriptor();
+            status_t ret = shareDrmDevice(fd);
+            reply->writeInt32(ret);
+            return NO_ERROR;
+        } break;
         default:
             return BBinder::onTransact(code, data, reply, flags);
     } // switch
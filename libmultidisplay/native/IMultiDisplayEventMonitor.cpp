@@ -32,6 +32,7 @@ namespace intel {
 enum {
     MDS_SERVER_SET_PHONE_CALL_STATE = IBinder::FIRST_CALL_TRANSACTION,
     MDS_SERVER_SET_INPUT_STATE,
+    MDS_SERVER_SET_POWER_SAVE_STATE,
 };
 
 class BpMultiDisplayEventMonitor:public BpInterface<IMultiDisplayEventMonitor> {
@@ -66,6 +67,19 @@ public:
         result = reply.readInt32();
         return result;
     }
+
+    virtual status_t updatePowerSaveState(bool state) {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayEventMonitor::getInterfaceDescriptor());
+        data.writeInt32(state ? 1 : 0);
+        status_t result = remote()->transact(
+                MDS_SERVER_SET_POWER_SAVE_STATE, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        return result;
+    }
 };
 
 IMPLEMENT_META_INTERFACE(MultiDisplayEventMonitor,"com.intel.MultiDisplayEventMonitor");
@@ -88,6 +102,13 @@ status_t BnMultiDisplayEventMonitor::onTransact(
             reply->writeInt32(ret);
             return NO_ERROR;
         } break;
+        case MDS_SERVER_SET_POWER_SAVE_STATE: {
+            CHECK_INTERFACE(IMultiDisplayEventMonitor, data, reply);
+            bool state = (data.readInt32() == 1 ? true : false);
+            status_t ret = updatePowerSaveState(state);
+            reply->writeInt32(ret);
+            return NO_ERROR;
+        } break;
     } // switch
     return BBinder::onTransact(code, data, reply, flags);
 }
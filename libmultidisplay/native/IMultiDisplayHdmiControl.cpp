@@ -24,6 +24,7 @@
 
 #include <display/IMultiDisplayHdmiControl.h>
 #include "drm_hdmi.h"
+#include "MultiDisplayParcel.h"
 
 namespace android {
 namespace intel {
@@ -38,6 +39,9 @@ enum {
     MDS_SERVER_SET_HDMI_SCALING_TYPE,
     MDS_SERVER_SET_HDMI_OVER_SCAN,
     MDS_SERVER_CHECK_HDMI_TIMING_FIXED,
+    MDS_SERVER_GET_HDMI_TIMINGS,
+    MDS_SERVER_SET_HDMI_SCALING,
+    MDS_SERVER_SET_HDMI_CONFIG,
 };
 
 class BpMultiDisplayHdmiControl : public BpInterface<IMultiDisplayHdmiControl> {
@@ -49,7 +53,7 @@ public:
     virtual status_t setHdmiTiming(const MDSHdmiTiming& timing) {
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayHdmiControl::getInterfaceDescriptor());
-        data.write(&timing, sizeof(MDSHdmiTiming));
+        writeHdmiTiming(&data, timing);
         status_t result = remote()->transact(
                 MDS_SERVER_SET_HDMI_TIMING, data, &reply);
         if (result != NO_ERROR) {
@@ -83,14 +87,55 @@ public:
         if (result != NO_ERROR) {
             return result;
         }
-        for (int i = 0; i < timingCount; i++) {
+        result = reply.readInt32();
+        if (result != NO_ERROR) {
+            return result;
+        }
+        MDSHdmiTiming timings[HDMI_TIMING_MAX];
+        int32_t number = 0;
+        result = readHdmiTimings(reply, timings, timingCount, &number);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        for (int i = 0; i < number; i++) {
             if (list[i] == NULL)
                 return BAD_VALUE;
+            memcpy(list[i], &timings[i], sizeof(MDSHdmiTiming));
+        }
+        return NO_ERROR;
+    }
 
-            reply.read((void*)list[i], sizeof(MDSHdmiTiming));
+    virtual status_t getHdmiTimings(int32_t* version, int32_t* count,
+            MDSHdmiTiming* list, int32_t max) {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayHdmiControl::getInterfaceDescriptor());
+        if (version == NULL || count == NULL || list == NULL ||
+                max <= 0 || max > HDMI_TIMING_MAX) {
+            return BAD_VALUE;
+        }
+        data.writeInt32(*version);
+        data.writeInt32(max);
+        status_t result = remote()->transact(
+                MDS_SERVER_GET_HDMI_TIMINGS, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
         }
         result = reply.readInt32();
-        return result;
+        int32_t current = reply.readInt32();
+        int32_t number = reply.readInt32();
+        if (result != NO_ERROR || number < 0 || number > max) {
+            return (result != NO_ERROR ? result : UNKNOWN_ERROR);
+        }
+        // Only sent when the caller's list is out of date
+        if (current != *version) {
+            int32_t sent = 0;
+            if (readHdmiTimings(reply, list, max, &sent) != NO_ERROR || sent != number) {
+                return UNKNOWN_ERROR;
+            }
+        }
+        *version = current;
+        *count = number;
+        return NO_ERROR;
     }
 
     virtual status_t getCurrentHdmiTiming(MDSHdmiTiming* timing) {
@@ -104,9 +149,11 @@ public:
         if (result != NO_ERROR) {
             return result;
         }
-        reply.read((void *)timing, sizeof(MDSHdmiTiming));
         result = reply.readInt32();
-        return result;
+        if (result != NO_ERROR) {
+            return result;
+        }
+        return readHdmiTiming(reply, timing);
     }
 
     virtual status_t setHdmiTimingByIndex(int index) {
@@ -161,6 +208,38 @@ public:
         return result;
     }
 
+    virtual status_t setHdmiScaling(MDS_SCALING_TYPE type, int hValue, int vValue) {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayHdmiControl::getInterfaceDescriptor());
+        data.writeInt32(type);
+        data.writeInt32(hValue);
+        data.writeInt32(vValue);
+        status_t result = remote()->transact(
+                MDS_SERVER_SET_HDMI_SCALING, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        return result;
+    }
+
+    virtual status_t setHdmiConfig(const MDSHdmiTiming& timing,
+            MDS_SCALING_TYPE type, int hValue, int vValue) {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayHdmiControl::getInterfaceDescriptor());
+        writeHdmiTiming(&data, timing);
+        data.writeInt32(type);
+        data.writeInt32(hValue);
+        data.writeInt32(vValue);
+        status_t result = remote()->transact(
+                MDS_SERVER_SET_HDMI_CONFIG, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        return result;
+    }
+
     virtual bool checkHdmiTimingIsFixed() {
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayHdmiControl::getInterfaceDescriptor());
@@ -182,7 +261,10 @@ status_t BnMultiDisplayHdmiControl::onTransact(
         case MDS_SERVER_SET_HDMI_TIMING: {
             CHECK_INTERFACE(IMultiDisplayHdmiControl, data, reply);
             MDSHdmiTiming timing;
-            data.read(&timing, sizeof(MDSHdmiTiming));
+            if (readHdmiTiming(data, &timing) != NO_ERROR) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
+            }
             status_t ret = setHdmiTiming(timing);
             reply->writeInt32(ret);
             return NO_ERROR;
@@ -196,34 +278,48 @@ status_t BnMultiDisplayHdmiControl::onTransact(
         case MDS_SERVER_GET_HDMI_TIMING_LIST: {
             CHECK_INTERFACE(IMultiDisplayHdmiControl, data, reply);
             const int count = data.readInt32();
-            MDSHdmiTiming *list[count];
-            memset(list, 0, count * sizeof(MDSHdmiTiming *));
-            for (int i = 0; i < count; i++) {
-                list[i] = (MDSHdmiTiming *)malloc(sizeof(MDSHdmiTiming));
-                if (list[i] == NULL) {
-                    for (int j = 0; j < i; j++)
-                        if (list[j]) free(list[j]);
-                    return NO_ERROR;
-                }
-                memset(list[i], 0, sizeof(MDSHdmiTiming));
+            if (count <= 0 || count > HDMI_TIMING_MAX) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
             }
+            MDSHdmiTiming timings[count];
+            MDSHdmiTiming *list[count];
+            memset(timings, 0, count * sizeof(MDSHdmiTiming));
+            for (int i = 0; i < count; i++)
+                list[i] = &timings[i];
 
-            int ret = getHdmiTimingList(count, (MDSHdmiTiming **)list);
-
-            for (int i = 0; i < count; i++) {
-                reply->write((const void*)list[i], sizeof(MDSHdmiTiming));
-                free(list[i]);
-                list[i] = NULL;
+            status_t ret = getHdmiTimingList(count, (MDSHdmiTiming **)list);
+            reply->writeInt32(ret);
+            if (ret == NO_ERROR)
+                writeHdmiTimings(reply, timings, count);
+            return NO_ERROR;
+        } break;
+        case MDS_SERVER_GET_HDMI_TIMINGS: {
+            CHECK_INTERFACE(IMultiDisplayHdmiControl, data, reply);
+            int32_t version = data.readInt32();
+            int32_t max = data.readInt32();
+            if (max <= 0 || max > HDMI_TIMING_MAX) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
             }
+            MDSHdmiTiming list[max];
+            int32_t current = version;
+            int32_t count = 0;
+            status_t ret = getHdmiTimings(&current, &count, list, max);
             reply->writeInt32(ret);
+            reply->writeInt32(current);
+            reply->writeInt32(count);
+            if (ret == NO_ERROR && current != version)
+                writeHdmiTimings(reply, list, count);
             return NO_ERROR;
         } break;
         case MDS_SERVER_GET_CURRENT_HDMI_TIMING: {
             CHECK_INTERFACE(IMultiDisplayHdmiControl, data, reply);
             MDSHdmiTiming timing;
             status_t ret = getCurrentHdmiTiming(&timing);
-            reply->write((const void *)&timing, sizeof(MDSHdmiTiming));
             reply->writeInt32(ret);
+            if (ret == NO_ERROR)
+                writeHdmiTiming(reply, timing);
             return NO_ERROR;
         } break;
         case MDS_SERVER_SET_HDMI_TIMING_BY_INDEX: {
@@ -254,6 +350,29 @@ status_t BnMultiDisplayHdmiControl::onTransact(
             reply->writeInt32(ret);
             return NO_ERROR;
         } break;
+        case MDS_SERVER_SET_HDMI_SCALING: {
+            CHECK_INTERFACE(IMultiDisplayHdmiControl, data, reply);
+            MDS_SCALING_TYPE type = (MDS_SCALING_TYPE)data.readInt32();
+            int32_t hValue = data.readInt32();
+            int32_t vValue = data.readInt32();
+            status_t ret = setHdmiScaling(type, hValue, vValue);
+            reply->writeInt32(ret);
+            return NO_ERROR;
+        } break;
+        case MDS_SERVER_SET_HDMI_CONFIG: {
+            CHECK_INTERFACE(IMultiDisplayHdmiControl, data, reply);
+            MDSHdmiTiming timing;
+            if (readHdmiTiming(data, &timing) != NO_ERROR) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
+            }
+            MDS_SCALING_TYPE type = (MDS_SCALING_TYPE)data.readInt32();
+            int32_t hValue = data.readInt32();
+            int32_t vValue = data.readInt32();
+            status_t ret = setHdmiConfig(timing, type, hValue, vValue);
+            reply->writeInt32(ret);
+            return NO_ERROR;
+        } break;
         case MDS_SERVER_CHECK_HDMI_TIMING_FIXED: {
             CHECK_INTERFACE(IMultiDisplayInfoProvider, data, reply);
             bool ret = checkHdmiTimingIsFixed();
@@ -21,8 +21,11 @@
 #include <utils/Log.h>
 #include <utils/RefBase.h>
 #include <binder/Parcel.h>
+#include <utils/threads.h>
 
 #include <display/IMultiDisplayInfoProvider.h>
+#include <display/MultiDisplayStatePage.h>
+#include "MultiDisplayParcel.h"
 
 namespace android {
 namespace intel {
@@ -35,16 +38,46 @@ enum {
     MDS_SERVER_GET_DISPLAY_MODE,
     MDS_SERVER_GET_DECODER_OUTPUT_RESOLUTION,
     MDS_SERVER_GET_VPP_STATE,
+    MDS_SERVER_GET_STATE_PAGE,
+    MDS_SERVER_GET_STATE_SNAPSHOT,
 };
 
+// Only the active sessions are written, with their optional parts
+enum {
+    MDS_SNAPSHOT_INFO           = 1 << 0,
+    MDS_SNAPSHOT_DECODER_CONFIG = 1 << 1,
+};
+
+// The state queries are answered from the state page of the service
+// once it is mapped, and fall back to a transaction otherwise.
 class BpMultiDisplayInfoProvider:public BpInterface<IMultiDisplayInfoProvider> {
+private:
+    Mutex mStateLock;
+    bool  mStateChecked;
+    MultiDisplayStateReader mState;
+
+    bool mapStatePage() {
+        Mutex::Autolock _l(mStateLock);
+        if (!mStateChecked) {
+            mStateChecked = true;
+            if (!mState.map(getStatePage()))
+                ALOGW("MDS state page is unavailable");
+        }
+        return mState.isMapped();
+    }
 public:
     BpMultiDisplayInfoProvider(const sp<IBinder>& impl)
-        : BpInterface<IMultiDisplayInfoProvider>(impl)
+        : BpInterface<IMultiDisplayInfoProvider>(impl),
+        mStateChecked(false)
     {
     }
 
     virtual int getVideoSessionNumber() {
+        if (mapStatePage()) {
+            MDSStatePage page;
+            mState.read(&page);
+            return page.sessionNumber;
+        }
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayInfoProvider::getInterfaceDescriptor());
         status_t result = remote()->transact(
@@ -56,6 +89,13 @@ public:
     }
 
     virtual MDS_VIDEO_STATE getVideoState(int sessionId) {
+        if (mapStatePage()) {
+            if (sessionId < 0 || sessionId >= MDS_VIDEO_SESSION_MAX_VALUE)
+                return MDS_VIDEO_STATE_UNKNOWN;
+            MDSStatePage page;
+            mState.read(&page);
+            return (MDS_VIDEO_STATE)page.sessions[sessionId].state;
+        }
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayInfoProvider::getInterfaceDescriptor());
         data.writeInt32(sessionId);
@@ -74,18 +114,36 @@ public:
         if (info == NULL) {
             return BAD_VALUE;
         }
+        if (mapStatePage()) {
+            if (sessionId < 0 || sessionId >= MDS_VIDEO_SESSION_MAX_VALUE)
+                return UNKNOWN_ERROR;
+            MDSStatePage page;
+            mState.read(&page);
+            const MDSVideoSessionState& session = page.sessions[sessionId];
+            if (session.state != MDS_VIDEO_PREPARED || !session.infoValid)
+                return UNKNOWN_ERROR;
+            memcpy(info, &session.info, sizeof(MDSVideoSourceInfo));
+            return NO_ERROR;
+        }
         data.writeInt32(sessionId);
         status_t result = remote()->transact(
                 MDS_SERVER_GET_VIDEO_SOURCE_INFO, data, &reply);
         if (result != NO_ERROR) {
             return result;
         }
-        reply.read((void *)info, sizeof(MDSVideoSourceInfo));
         result = reply.readInt32();
-        return result;
+        if (result != NO_ERROR) {
+            return result;
+        }
+        return readVideoSourceInfo(reply, info);
     }
 
     virtual MDS_DISPLAY_MODE getDisplayMode(bool wait) {
+        if (mapStatePage()) {
+            MDSStatePage page;
+            mState.read(&page);
+            return (MDS_DISPLAY_MODE)page.mode;
+        }
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayInfoProvider::getInterfaceDescriptor());
         data.writeInt32(wait ? 1 : 0);
@@ -124,6 +182,11 @@ public:
     }
 
     virtual uint32_t getVppState() {
+        if (mapStatePage()) {
+            MDSStatePage page;
+            mState.read(&page);
+            return page.vppState;
+        }
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayInfoProvider::getInterfaceDescriptor());
         status_t result = remote()->transact(
@@ -133,6 +196,74 @@ public:
         }
         return reply.readInt32();
     }
+
+    virtual sp<IMemoryHeap> getStatePage() {
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayInfoProvider::getInterfaceDescriptor());
+        status_t result = remote()->transact(
+                MDS_SERVER_GET_STATE_PAGE, data, &reply);
+        if (result != NO_ERROR) {
+            return NULL;
+        }
+        return interface_cast<IMemoryHeap>(reply.readStrongBinder());
+    }
+
+    virtual status_t getStateSnapshot(MDSStateSnapshot* snapshot) {
+        Parcel data, reply;
+        if (snapshot == NULL) {
+            return BAD_VALUE;
+        }
+        data.writeInterfaceToken(IMultiDisplayInfoProvider::getInterfaceDescriptor());
+        status_t result = remote()->transact(
+                MDS_SERVER_GET_STATE_SNAPSHOT, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        if (result != NO_ERROR) {
+            return result;
+        }
+        memset(snapshot, 0, sizeof(MDSStateSnapshot));
+        snapshot->mode = (MDS_DISPLAY_MODE)reply.readInt32();
+        snapshot->vppState = reply.readInt32();
+        snapshot->vppPolicy = reply.readInt32();
+        int32_t planes = reply.readInt32();
+        if (planes < 0 || planes > MDS_OVERLAY_PLANE_MAX) {
+            return UNKNOWN_ERROR;
+        }
+        for (int32_t i = 0; i < MDS_OVERLAY_PLANE_MAX; i++) {
+            snapshot->overlays[i].sessionId = -1;
+        }
+        for (int32_t i = 0; i < planes; i++) {
+            if (readOverlayConfig(reply, &snapshot->overlays[i]) != NO_ERROR) {
+                return UNKNOWN_ERROR;
+            }
+        }
+        int32_t number = reply.readInt32();
+        if (number < 0 || number > MDS_VIDEO_SESSION_MAX_VALUE) {
+            return UNKNOWN_ERROR;
+        }
+        snapshot->sessionNumber = number;
+        for (int32_t i = 0; i < number; i++) {
+            MDSVideoSessionSnapshot* session = &snapshot->sessions[i];
+            session->sessionId = reply.readInt32();
+            session->state = (MDS_VIDEO_STATE)reply.readInt32();
+            int32_t parts = reply.readInt32();
+            if (parts & MDS_SNAPSHOT_INFO) {
+                session->infoValid = true;
+                if (readVideoSourceInfo(reply, &session->info) != NO_ERROR) {
+                    return UNKNOWN_ERROR;
+                }
+            }
+            if (parts & MDS_SNAPSHOT_DECODER_CONFIG) {
+                session->decoderConfigValid = true;
+                if (readDecoderConfig(reply, &session->decoderConfig) != NO_ERROR) {
+                    return UNKNOWN_ERROR;
+                }
+            }
+        }
+        return NO_ERROR;
+    }
 };
 
 IMPLEMENT_META_INTERFACE(MultiDisplayInfoProvider,"com.intel.MultiDisplayInfoProvider");
@@ -159,8 +290,9 @@ status_t BnMultiDisplayInfoProvider::onTransact(
             MDSVideoSourceInfo info;
             int32_t sessionId = data.readInt32();
             status_t ret = getVideoSourceInfo(sessionId, &info);
-            reply->write((const void *)&info, sizeof(MDSVideoSourceInfo));
             reply->writeInt32(ret);
+            if (ret == NO_ERROR)
+                writeVideoSourceInfo(reply, info);
             return NO_ERROR;
         } break;
         case MDS_SERVER_GET_DISPLAY_MODE: {
@@ -196,6 +328,40 @@ status_t BnMultiDisplayInfoProvider::onTransact(
             reply->writeInt32(ret);
             return NO_ERROR;
         } break;
+        case MDS_SERVER_GET_STATE_PAGE: {
+            CHECK_INTERFACE(IMultiDisplayInfoProvider, data, reply);
+            sp<IMemoryHeap> heap = getStatePage();
+            reply->writeStrongBinder(heap != NULL ? heap->asBinder() : NULL);
+            return NO_ERROR;
+        } break;
+        case MDS_SERVER_GET_STATE_SNAPSHOT: {
+            CHECK_INTERFACE(IMultiDisplayInfoProvider, data, reply);
+            MDSStateSnapshot snapshot;
+            status_t ret = getStateSnapshot(&snapshot);
+            reply->writeInt32(ret);
+            if (ret != NO_ERROR)
+                return NO_ERROR;
+            reply->writeInt32(snapshot.mode);
+            reply->writeInt32(snapshot.vppState);
+            reply->writeInt32(snapshot.vppPolicy);
+            reply->writeInt32(MDS_OVERLAY_PLANE_MAX);
+            for (int32_t i = 0; i < MDS_OVERLAY_PLANE_MAX; i++)
+                writeOverlayConfig(reply, snapshot.overlays[i]);
+            reply->writeInt32(snapshot.sessionNumber);
+            for (int32_t i = 0; i < snapshot.sessionNumber; i++) {
+                const MDSVideoSessionSnapshot& session = snapshot.sessions[i];
+                int32_t parts = (session.infoValid ? MDS_SNAPSHOT_INFO : 0) |
+                    (session.decoderConfigValid ? MDS_SNAPSHOT_DECODER_CONFIG : 0);
+                reply->writeInt32(session.sessionId);
+                reply->writeInt32(session.state);
+                reply->writeInt32(parts);
+                if (session.infoValid)
+                    writeVideoSourceInfo(reply, session.info);
+                if (session.decoderConfigValid)
+                    writeDecoderConfig(reply, session.decoderConfig);
+            }
+            return NO_ERROR;
+        } break;
     } // switch
     return BBinder::onTransact(code, data, reply, flags);
 }
@@ -30,8 +30,14 @@ namespace intel {
 
 enum {
     ON_MDS_EVENT = IBinder::FIRST_CALL_TRANSACTION,
+    NOTIFY_MDS_EVENT,
 };
 
+status_t IMultiDisplayListener::notifyMdsMessage(
+        int msg, void* value, int size, uint32_t seq) {
+    return onMdsMessage(msg, value, size);
+}
+
 class BpMultiDisplayListener : public BpInterface<IMultiDisplayListener>
 {
 public:
@@ -59,6 +65,22 @@ public:
         result = reply.readInt32();
         return result;
     }
+
+    virtual status_t notifyMdsMessage(int msg, void* value, int size, uint32_t seq) {
+        Parcel data;
+        data.writeInterfaceToken(IMultiDisplayListener::getInterfaceDescriptor());
+        if (value == NULL || (uint32_t)size < sizeof(int))
+            return BAD_VALUE;
+
+        data.writeInt32(msg);
+        data.writeInt32(size);
+        data.write(value, size);
+        data.writeInt32(seq);
+
+        ALOGV("%s: mode %d, 0x%x, seq %u", __func__, msg, *((int*)value), seq);
+
+        return remote()->transact(NOTIFY_MDS_EVENT, data, NULL, IBinder::FLAG_ONEWAY);
+    }
 };
 
 IMPLEMENT_META_INTERFACE(MultiDisplayListener, "com.intel.MultiDisplayListener");
@@ -85,6 +107,23 @@ status_t BnMultiDisplayListener::onTransact(
             }
             return NO_ERROR;
        } break;
+        case NOTIFY_MDS_EVENT: {
+            ALOGV("%s", __func__);
+            CHECK_INTERFACE(IMultiDisplayListener, data, reply);
+            int32_t msg = data.readInt32();
+            int32_t size = data.readInt32();
+            if (size < (int32_t)sizeof(int))
+                return BAD_VALUE;
+            void* value = (void *)malloc(size);
+            if (value == NULL)
+                return NO_MEMORY;
+            data.read(value, size);
+            uint32_t seq = data.readInt32();
+            ALOGV("%s: mode %d, 0x%x, seq %u", __func__, msg, *((int*)value), seq);
+            notifyMdsMessage(msg, value, size, seq);
+            free(value);
+            return NO_ERROR;
+        } break;
     }
     return BBinder::onTransact(code, data, reply, flags);
 }
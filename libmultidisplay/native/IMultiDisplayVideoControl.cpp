@@ -24,6 +24,7 @@
 
 
 #include <display/IMultiDisplayVideoControl.h>
+#include "MultiDisplayParcel.h"
 
 namespace android {
 namespace intel {
@@ -34,6 +35,7 @@ enum {
     MDS_SERVER_RESET_VIDEO_PLAYBACK,
     MDS_SERVER_UPDATE_VIDEO_STATE,
     MDS_SERVER_UPDATE_VIDEO_SOURCE_INFO,
+    MDS_SERVER_UPDATE_VIDEO_SESSION,
 };
 
 class BpMultiDisplayVideoControl : public BpInterface<IMultiDisplayVideoControl> {
@@ -84,7 +86,7 @@ public:
         Parcel data, reply;
         data.writeInterfaceToken(IMultiDisplayVideoControl::getInterfaceDescriptor());
         data.writeInt32(sessionId);
-        data.write(&info, sizeof(MDSVideoSourceInfo));
+        writeVideoSourceInfo(&data, info);
         status_t result = remote()->transact(
                 MDS_SERVER_UPDATE_VIDEO_SOURCE_INFO, data, &reply);
         if (result != NO_ERROR) {
@@ -94,6 +96,27 @@ public:
         return result;
     }
 
+    virtual status_t updateVideoSession(int32_t* sessionId,
+            MDS_VIDEO_STATE state, const MDSVideoSourceInfo* info) {
+        if (sessionId == NULL)
+            return BAD_VALUE;
+        Parcel data, reply;
+        data.writeInterfaceToken(IMultiDisplayVideoControl::getInterfaceDescriptor());
+        data.writeInt32(*sessionId);
+        data.writeInt32(state);
+        data.writeInt32(info != NULL ? 1 : 0);
+        if (info != NULL)
+            writeVideoSourceInfo(&data, *info);
+        status_t result = remote()->transact(
+                MDS_SERVER_UPDATE_VIDEO_SESSION, data, &reply);
+        if (result != NO_ERROR) {
+            return result;
+        }
+        result = reply.readInt32();
+        *sessionId = reply.readInt32();
+        return result;
+    }
+
 };
 
 IMPLEMENT_META_INTERFACE(MultiDisplayVideoControl,"com.intel.MultiDisplayVideoControl");
@@ -126,11 +149,31 @@ status_t BnMultiDisplayVideoControl::onTransact(
             CHECK_INTERFACE(IMultiDisplayVideoControl, data, reply);
             int32_t sessionId = data.readInt32();
             MDSVideoSourceInfo info;
-            data.read(&info, sizeof(MDSVideoSourceInfo));
+            if (readVideoSourceInfo(data, &info) != NO_ERROR) {
+                reply->writeInt32(BAD_VALUE);
+                return NO_ERROR;
+            }
             status_t ret = updateVideoSourceInfo(sessionId, info);
             reply->writeInt32(ret);
             return NO_ERROR;
         } break;
+        case MDS_SERVER_UPDATE_VIDEO_SESSION: {
+            CHECK_INTERFACE(IMultiDisplayVideoControl, data, reply);
+            int32_t sessionId = data.readInt32();
+            MDS_VIDEO_STATE state = (MDS_VIDEO_STATE)data.readInt32();
+            MDSVideoSourceInfo info;
+            bool hasInfo = data.readInt32() != 0;
+            if (hasInfo && readVideoSourceInfo(data, &info) != NO_ERROR) {
+                reply->writeInt32(BAD_VALUE);
+                reply->writeInt32(sessionId);
+                return NO_ERROR;
+            }
+            status_t ret = updateVideoSession(&sessionId, state,
+                    hasInfo ? &info : NULL);
+            reply->writeInt32(ret);
+            reply->writeInt32(sessionId);
+            return NO_ERROR;
+        } break;
     } // switch
     return BBinder::onTransact(code, data, reply, flags);
 }
@@ -19,12 +19,14 @@
 //#define LOG_NDEBUG 0
 
 #include <utils/Log.h>
+#include <cutils/atomic.h>
 #include <utils/RefBase.h>
 #include <binder/Parcel.h>
 
 #include <binder/IServiceManager.h>
 #include <binder/IPCThreadState.h>
 #include "MultiDisplayComposer.h"
+#include "MultiDisplayStats.h"
 #include "drm_hdmi.h"
 #ifdef TARGET_HAS_ISV
 #include "VPPSetting.h"
@@ -33,6 +35,25 @@
 namespace android {
 namespace intel {
 
+static MultiDisplayCallStats sMutexWaitStats("mMutex wait");
+static MultiDisplayCallStats sDrmMutexWaitStats("mDrmMutex wait");
+static MultiDisplayCallStats sBroadcastStats("broadcast");
+static MultiDisplayCallStats sDispatchStats("dispatch");
+// Stages of an HDMI hotplug, from its notification by HWC
+static MultiDisplayCallStats sHotplugQueueStats("hotplug queue");
+static MultiDisplayCallStats sHotplugProbeStats("hotplug drm probe");
+static MultiDisplayCallStats sHotplugModeStats("hotplug mode update");
+static MultiDisplayCallStats sHotplugAudioStats("hotplug audio switch");
+static MultiDisplayCallStats sHotplugScalingStats("hotplug scaling reset");
+static MultiDisplayCallStats sHotplugTotalStats("hotplug total");
+
+// Minimum time between 2 input states sent to HWC
+static const nsecs_t MDS_INPUT_STATE_INTERVAL = 100000000; // 100ms
+// Idle time of the mirrored primary before the HDMI refresh rate is lowered,
+// and before the external display is paused
+static const nsecs_t MDS_HDMI_IDLE_LOW_REFRESH_DELAY = 30000000000LL; // 30s
+static const nsecs_t MDS_HDMI_IDLE_PAUSE_DELAY = 600000000000LL; // 10min
+
 #define MDC_CHECK_INIT() \
 do { \
     if (mDrmInit == false) { \
@@ -52,10 +73,13 @@ do { \
 
 MultiDisplayListener::MultiDisplayListener(int msg, int32_t id,
         const char* client, sp<IMultiDisplayListener> listener) {
-    mMsg  = msg;
+    mMsg  = msg & ~MDS_MSG_FLAG_SYNC;
+    mSync = (msg & MDS_MSG_FLAG_SYNC) != 0;
+    mSeq  = 0;
     mId   = id;
     mName = new String8(client);
     mListener = listener;
+    mIsVideoDriver = !strncmp("VideoDriver", client, sizeof("VideoDriver"));
 }
 
 MultiDisplayListener::~MultiDisplayListener() {
@@ -66,22 +90,33 @@ MultiDisplayListener::~MultiDisplayListener() {
     mListener = NULL;
 }
 
-void MultiDisplayListener::dump() {
-    if (mName == NULL) {
-        ALOGE("Error listener");
-        return;
+void MultiDisplayListener::queueMessage(
+        int msg, const void* value, int size) {
+    // A pending mode change is superseded by the new one, only keep the
+    // latest mode, plus the one-shot VPP change event of the pending one.
+    if (msg == MDS_MSG_MODE_CHANGE && !mQueue.isEmpty()) {
+        MultiDisplayMessage& last = mQueue.editTop();
+        if (last.mMsg == msg && size == sizeof(int) &&
+                last.mValue.size() == sizeof(int)) {
+            int mode = *(const int*)value |
+                (*(const int*)last.mValue.array() & MDS_VPP_CHANGED);
+            memcpy(last.mValue.editArray(), &mode, sizeof(int));
+            // The replaced message leaves a gap in the sequence
+            last.mSeq = ++mSeq;
+            return;
+        }
     }
-    ALOGV("Listener info: %d, %d, %s, %p",
-            mMsg, mId, mName->string(), mListener.get());
+    MultiDisplayMessage message;
+    message.mMsg = msg;
+    message.mSeq = ++mSeq;
+    if (value != NULL && size > 0)
+        message.mValue.appendArray((const uint8_t*)value, size);
+    mQueue.push(message);
 }
 
-
-void MultiDisplayVideoSession::dump(int index) {
-    if (mState < MDS_VIDEO_PREPARING ||
-            mState >= MDS_VIDEO_UNPREPARED)
-        return;
-    ALOGV("\t[%d] %d, %dx%d@%d", index, mState,
-            mInfo.displayW, mInfo.displayH, mInfo.frameRate);
+void MultiDisplayListener::dequeueMessage(MultiDisplayMessage* message) {
+    *message = mQueue[0];
+    mQueue.removeAt(0);
 }
 
 MultiDisplayComposer::MultiDisplayComposer() :
@@ -89,18 +124,98 @@ MultiDisplayComposer::MultiDisplayComposer() :
 #ifdef TARGET_HAS_ISV
     mDisplayId(MDS_DISPLAY_PRIMARY),
 #endif
+    mPowerSave(false),
+    mVppPolicy(MDS_VPP_NONE),
+    mExternalWidth(0),
+    mExternalHeight(0),
     mListenerId(0),
     mMode(MDS_MODE_NONE),
     mScaleType(MDS_SCALING_NONE),
+    mScalingGeneration(0),
+    mPhoneCallState(-1),
+    mInputState(-1),
+    mPhoneCallPending(false),
+    mInputPending(false),
+    mPhoneCallNotified(-1),
+    mInputNotified(-1),
+    mInputDeadline(0),
     mHorizontalStep(0),
     mVerticalStep(0),
     mSurfaceComposer(NULL),
-    mMDSCallback(NULL)
+    mMDSCallback(NULL),
+    mDispatchIndex(0),
+    mDispatchExit(false),
+    mHotplugPending(false),
+    mHotplugTime(0),
+    mHotplugConnected(false),
+    mHotplugExit(false),
+    mHdmiProbed(0),
+    mHdmiProbePending(false),
+    mRateMatchSession(-1),
+    mRateMatchFps(0),
+    mRateMatchPending(false),
+    mRateMatchSavedValid(false),
+    mHdmiIdleSince(0),
+    mHdmiPowerStage(MDS_HDMI_POWER_ACTIVE),
+    mPowerSavedValid(false),
+    mHdmiAudioConnected(false),
+    mUserTimingValid(false),
+    mProfilePending(false),
+    mStatePage(NULL),
+    mActiveSessions(0),
+    mPlayingSessions(0),
+    mDecoderConfigSessions(0),
+    mVideoContentValid(false)
 {
+    memset(mListenerIdMap, 0, sizeof(mListenerIdMap));
+    memset(mOverlays, 0, sizeof(mOverlays));
+    for (int i = 0; i < MDS_OVERLAY_PLANE_MAX; i++)
+        mOverlays[i].sessionId = -1;
+    memset(&mHdmiState, 0, sizeof(mHdmiState));
+    memset(&mUserTiming, 0, sizeof(mUserTiming));
+    memset(&mVideoContent, 0, sizeof(mVideoContent));
+    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++)
+        mVideoGenerations[i] = 1;
+    mDeathRecipient = new MultiDisplayDeathRecipient(this);
+    // Clients can only map the state page read-only
+    mStateHeap = new MemoryHeapBase(sizeof(MDSStatePage),
+            MemoryHeapBase::READ_ONLY, "MultiDisplayState");
+    if (mStateHeap->getHeapID() < 0 || mStateHeap->getBase() == MAP_FAILED) {
+        ALOGE("Fail to allocate the state page");
+        mStateHeap = NULL;
+        mStatePage = &mLocalState;
+    } else {
+        mStatePage = (MDSStatePage*)mStateHeap->getBase();
+    }
+    memset(mStatePage, 0, sizeof(MDSStatePage));
     init();
+    publishStateLocked();
+    mDispatcher = new MultiDisplayDispatcher(this);
+    mDispatcher->run("MDSDispatcher", PRIORITY_DISPLAY);
+    mHotplugWorker = new MultiDisplayHotplugWorker(this);
+    mHotplugWorker->run("MDSHotplug", PRIORITY_DISPLAY);
 }
 
 MultiDisplayComposer::~MultiDisplayComposer() {
+    if (mHotplugWorker != NULL) {
+        {
+            MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+            mHotplugExit = true;
+            mHotplugCond.signal();
+        }
+        mHotplugWorker->requestExitAndWait();
+        mHotplugWorker = NULL;
+    }
+    if (mDispatcher != NULL) {
+        {
+            MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+            mDispatchExit = true;
+            mDispatchCond.signal();
+        }
+        mDispatcher->requestExitAndWait();
+        mDispatcher = NULL;
+    }
+
     drm_cleanup();
 
     // Remove all the listeners.
@@ -113,7 +228,11 @@ MultiDisplayComposer::~MultiDisplayComposer() {
         }
         mListeners.clear();
     }
+    for (int type = 0; type < MDS_MSG_TYPE_MAX; type++)
+        mMsgListeners[type].clear();
 
+    if (mSurfaceComposer != NULL)
+        mSurfaceComposer->unlinkToDeath(mDeathRecipient);
     mSurfaceComposer = NULL;
     mMDSCallback = NULL;
 }
@@ -127,54 +246,132 @@ void MultiDisplayComposer::init() {
     mDrmInit = true;
 
     initVideoSessions_l();
-    updateHdmiConnectStatusLocked();
+    // The HDMI connector is probed at the first hotplug or HDMI query,
+    // or after HWC registers, with the DRM device it may share
+    publishStateLocked();
     // TODO: if HDMI is connected, update vpp policy
     //setDisplayState_l(MDS_DISPLAY_EXTERNAL, VPPSetting::isVppOn());
 }
 
+// Called with mDrmMutex and mMutex held
 status_t MultiDisplayComposer::updateHdmiConnectStatusLocked() {
     MDC_CHECK_INIT();
 
+    int connectStatus = probeHdmiConnectStatus_l();
+    getHdmiState_l(&mHdmiState);
+    setHdmiConnectStatusLocked(connectStatus);
+    return NO_ERROR;
+}
+
+// Called with mDrmMutex held
+int MultiDisplayComposer::probeHdmiConnectStatus_l() {
+    android_atomic_release_store(1, &mHdmiProbed);
     int connectStatus = drm_hdmi_getConnectionStatus();
+    if (connectStatus != DRM_HDMI_CONNECTED &&
+            connectStatus != DRM_DVI_CONNECTED)
+        drm_hdmi_onHdmiDisconnected();
+    ALOGI("HDMI audio is %s", drm_hdmi_isAudioSupported() ? "supported" : "not supported");
+    return connectStatus;
+}
+
+// The first HDMI access, the later ones only check mHdmiProbed
+void MultiDisplayComposer::probeHdmiOnce() {
+    if (android_atomic_acquire_load(&mHdmiProbed))
+        return;
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    if (mHdmiProbed)
+        return;
+    int mode = mMode;
+    updateHdmiConnectStatusLocked();
+    if (mode != mMode)
+        broadcastModeLocked(false);
+}
+
+status_t MultiDisplayComposer::shareDrmDevice(int fd) {
+    if (fd < 0)
+        return BAD_VALUE;
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    return drm_set_dev_fd(fd) ? NO_ERROR : UNKNOWN_ERROR;
+}
+
+// Called with mDrmMutex held
+void MultiDisplayComposer::getHdmiState_l(MDSHdmiState* state) {
+    memset(state, 0, sizeof(MDSHdmiState));
+    if (!mDrmInit || drm_hdmi_getTimingVersion() == 0)
+        return;
+    // The count first, it may parse the timings and change the version
+    state->timingCount = drm_hdmi_getTimingNumber();
+    state->timingVersion = drm_hdmi_getTimingVersion();
+    state->timingFixed = drm_hdmi_timing_is_fixed() ? 1 : 0;
+    state->currentValid =
+        (drm_hdmi_get_current_timing(&state->current) == NO_ERROR) ? 1 : 0;
+    state->audioValid = drm_hdmi_getAudioCaps(&state->audio) ? 1 : 0;
+}
+
+// Called with mDrmMutex held, after the timing is set
+void MultiDisplayComposer::publishHdmiState_l() {
+    MDSHdmiState state;
+    getHdmiState_l(&state);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    mHdmiState = state;
+    publishStateLocked();
+}
+
+void MultiDisplayComposer::setHdmiConnectStatusLocked(int connectStatus) {
     if (connectStatus == DRM_HDMI_CONNECTED) {
-        mMode |= MDS_HDMI_CONNECTED;
+        setModeBitsLocked(MDS_HDMI_CONNECTED);
     } else if (connectStatus == DRM_DVI_CONNECTED) {
-        mMode |= MDS_DVI_CONNECTED;
+        setModeBitsLocked(MDS_DVI_CONNECTED);
     } else {
-        mMode &= ~(MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED);
-        drm_hdmi_onHdmiDisconnected();
+        clearModeBitsLocked(MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED);
     }
     ALOGI("ConnectStatus is %d, mode is 0x%x", connectStatus, mMode);
-    return NO_ERROR;
+    updateHdmiIdle_l();
+    publishStateLocked();
 }
 
 status_t MultiDisplayComposer::registerCallback(const sp<IMultiDisplayCallback>& cbk) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
     if (cbk.get() == NULL) {
         ALOGE("Callback is null");
         return BAD_VALUE;
     }
+    if (mMDSCallback != NULL)
+        mMDSCallback->asBinder()->unlinkToDeath(mDeathRecipient);
     mMDSCallback = cbk;
+    mMDSCallback->asBinder()->linkToDeath(mDeathRecipient);
 
     // Make sure the hdmi status is aligned
-    // between MDS and hwc.
-    updateHdmiConnectStatusLocked();
+    // between MDS and hwc, by the hotplug worker the first time
+    if (mHdmiProbed) {
+        updateHdmiConnectStatusLocked();
+    } else {
+        mHdmiProbePending = true;
+    }
+    // And the phone call and input states
+    mPhoneCallPending = true;
+    mInputPending = true;
+    mHotplugCond.signal();
     return NO_ERROR;
 }
 
 status_t MultiDisplayComposer::unregisterCallback(const sp<IMultiDisplayCallback>& cbk) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    if (mMDSCallback != NULL)
+        mMDSCallback->asBinder()->unlinkToDeath(mDeathRecipient);
     mMDSCallback = NULL;
     return NO_ERROR;
 }
 
 status_t MultiDisplayComposer::updateHdmiConnectionStatus(bool connected) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
     return notifyHotplugLocked(MDS_DISPLAY_EXTERNAL, connected);
 }
 
 status_t MultiDisplayComposer::updateWidiConnectionStatus(bool connected) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
     return notifyHotplugLocked(MDS_DISPLAY_VIRTUAL, connected);
 }
 
@@ -182,58 +379,418 @@ status_t MultiDisplayComposer::notifyHotplugLocked(
         MDS_DISPLAY_ID dispId, bool connected) {
     ALOGI("Display ID:%d, connected state:%d", dispId, connected);
     // Notify widi video extended mode
-    int mode = mMode;
     // update vpp policy
     //setVppState_l(dispId, connected);
     if (dispId == MDS_DISPLAY_VIRTUAL) {
         if (connected)
-            mMode |= MDS_WIDI_ON;
+            setModeBitsLocked(MDS_WIDI_ON);
         else
-            mMode &= ~MDS_WIDI_ON;
-        broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE, &mMode, sizeof(mMode), false);
+            clearModeBitsLocked(MDS_WIDI_ON);
+        updateVppPolicy_l();
+        updateOverlayConfig_l();
+        publishStateLocked();
+        broadcastModeLocked(false);
+        updateVideoContent_l();
         return NO_ERROR;
     }
-    // Notify hdmi hotplug and switch audio
-    if (hasVideoPlaying_l()) {
-        mMode |= MDS_VIDEO_ON;
+    // The hdmi hotplug is handled by the hotplug worker
+    mHotplugConnected = connected;
+    if (!mHotplugPending)
+        mHotplugTime = systemTime();
+    mHotplugPending = true;
+    mHotplugCond.signal();
+    return NO_ERROR;
+}
+
+bool MultiDisplayComposer::processHotplug() {
+    bool hotplug = false;
+    bool connected = false;
+    nsecs_t hotplugTime = 0;
+    bool rateMatch = false;
+    int fps = 0;
+    bool phoneCall = false;
+    bool probe = false;
+    bool profile = false;
+    bool input = false;
+    int powerStage = MDS_HDMI_POWER_ACTIVE;
+    nsecs_t deadline = 0;
+    sp<IMultiDisplayCallback> callback;
+    {
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        while (!mHotplugExit) {
+            if (mHotplugPending || mRateMatchPending || mPhoneCallPending ||
+                    mHdmiProbePending || mProfilePending)
+                break;
+            nsecs_t now = systemTime();
+            if (getHdmiPowerStage_l(now, &deadline) != mHdmiPowerStage)
+                break;
+            if (mInputPending) {
+                // Rate limited, the latest state is sent at the deadline
+                if (now >= mInputDeadline)
+                    break;
+                if (deadline == 0 || mInputDeadline < deadline)
+                    deadline = mInputDeadline;
+            }
+            if (deadline == 0)
+                mHotplugCond.wait(mMutex);
+            else
+                mHotplugCond.waitRelative(mMutex, deadline - now);
+        }
+        if (mHotplugExit)
+            return false;
+        hotplug = mHotplugPending;
+        connected = mHotplugConnected;
+        hotplugTime = mHotplugTime;
+        mHotplugPending = false;
+        rateMatch = mRateMatchPending;
+        fps = mRateMatchFps;
+        mRateMatchPending = false;
+        phoneCall = mPhoneCallPending;
+        mPhoneCallPending = false;
+        probe = mHdmiProbePending;
+        mHdmiProbePending = false;
+        profile = mProfilePending;
+        mProfilePending = false;
+        input = (mInputPending && systemTime() >= mInputDeadline);
+        if (input)
+            mInputPending = false;
+        powerStage = getHdmiPowerStage_l(systemTime(), &deadline);
+        callback = mMDSCallback;
+    }
+    if (phoneCall || input)
+        deliverEvents(callback, phoneCall, input);
+    if (probe && !hotplug)
+        probeHdmiOnce();
+    if (hotplug) {
+        // The power stage is applied to the new state at the next round
+        sHotplugQueueStats.record(systemTime() - hotplugTime);
+        handleHotplug(connected);
+        sHotplugTotalStats.record(systemTime() - hotplugTime);
+        // The user config of the last sink went with it
+        saveHdmiProfile(false);
+        return true;
+    }
+    if (profile)
+        saveHdmiProfile(true);
+    // Back to the full refresh rate before it is matched to a video
+    setHdmiPowerStage(powerStage);
+    if (rateMatch)
+        matchVideoRefreshRate(fps);
+    return true;
+}
+
+void MultiDisplayComposer::handleHotplug(bool connected) {
+    // Probe the DRM connector, without blocking the video control
+    int connectStatus = DRM_HDMI_DISCONNECTED;
+    MDSHdmiTiming timing;
+    memset(&timing, 0, sizeof(timing));
+    MDSHdmiState hdmi;
+    // The scaling of the profile of a known sink, none for a new one
+    int savedType = MDS_SCALING_NONE;
+    int savedH = 0;
+    int savedV = 0;
+    {
+        MultiDisplayCallTrace trace(sHotplugProbeStats);
+        MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+        if (mDrmInit) {
+            drm_hdmi_onHotplug();
+            connectStatus = probeHdmiConnectStatus_l();
+            if (connectStatus == DRM_HDMI_DISCONNECTED ||
+                    drm_hdmi_get_current_timing(&timing) != NO_ERROR)
+                memset(&timing, 0, sizeof(timing));
+            if (connectStatus != DRM_HDMI_DISCONNECTED)
+                drm_hdmi_getSinkScaling(&savedType, &savedH, &savedV);
+        }
+        getHdmiState_l(&hdmi);
+        // HWC sets the timing again on a hotplug
+        mRateMatchSavedValid = false;
+        mPowerSavedValid = false;
+        // Switch audio before the mode is updated, the audio HAL finds
+        // the audio capability of the sink in the state page
+        if (connected != mHdmiAudioConnected) {
+            MultiDisplayCallTrace audioTrace(sHotplugAudioStats);
+            {
+                MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+                mHdmiState = hdmi;
+                publishStateLocked();
+            }
+            drm_hdmi_notify_audio_hotplug(connected);
+            mHdmiAudioConnected = connected;
+        }
+    }
+
+    // Update the mode, the listeners are notified by the dispatcher
+    bool changed = false;
+    bool rescale;
+    {
+        MultiDisplayCallTrace trace(sHotplugModeStats);
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        mHdmiState = hdmi;
+        mUserTimingValid = false;
+        MultiDisplayEventLog::record(MDS_EVENT_HOTPLUG, -1, mMode, connected ? 1 : 0);
+        int mode = mMode;
+        if (hasVideoPlaying_l()) {
+            setModeBitsLocked(MDS_VIDEO_ON);
+        } else {
+            clearModeBitsLocked(MDS_VIDEO_ON);
+        }
+        if (mDrmInit)
+            setHdmiConnectStatusLocked(connectStatus);
+        else
+            publishStateLocked();
+        mExternalWidth = timing.width;
+        mExternalHeight = timing.height;
+        updateVppPolicy_l();
+        updateOverlayConfig_l();
+        publishStateLocked();
+        changed = (mode != mMode);
+        if (changed)
+            broadcastModeLocked(false);
+        // Match the new sink to the video which is still playing
+        mRateMatchPending = (mRateMatchSession >= 0 &&
+                (mMode & (MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED)));
+        rescale = (mScaleType != savedType ||
+                (int)mHorizontalStep != savedH || (int)mVerticalStep != savedV);
+    }
+
+    // Reset oversan compensation and scaling type, or set those the user
+    // chose for the sink, without waiting for HWC
+    if (rescale) {
+        MultiDisplayCallTrace trace(sHotplugScalingStats);
+        requestHdmiScaling(true, (MDS_SCALING_TYPE)savedType, true, savedH, savedV);
+    }
+}
+
+// Called by the worker, which writes the profile of a new sink after its
+// hotplug, and the timing and scaling of the user after they are applied
+void MultiDisplayComposer::saveHdmiProfile(bool userConfig) {
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    if (!mDrmInit)
+        return;
+    if (userConfig) {
+        MDSHdmiTiming timing;
+        bool timingValid;
+        int type, hVal, vVal;
+        {
+            MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+            timing = mUserTiming;
+            timingValid = mUserTimingValid;
+            type = mScaleType;
+            hVal = mHorizontalStep;
+            vVal = mVerticalStep;
+        }
+        drm_hdmi_setSinkConfig(timingValid ? &timing : NULL, type, hVal, vVal);
+    }
+    drm_hdmi_saveSinkProfiles();
+}
+
+// The HDMI refresh rate is matched to the frame rate of the first PREPARED
+// session, e.g. 24Hz or 48Hz for a film, and restored when it is closed
+void MultiDisplayComposer::requestRateMatch_l(int index, MDS_VIDEO_STATE state) {
+    if (state == MDS_VIDEO_PREPARED && mRateMatchSession < 0) {
+        MDSVideoSourceInfo info;
+        if (!(mMode & (MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED)) ||
+                mVideos[index].getInfo(&info) != NO_ERROR || info.frameRate <= 0)
+            return;
+        mRateMatchSession = index;
+        mRateMatchFps = info.frameRate;
+    } else if (state != MDS_VIDEO_PREPARED && index == mRateMatchSession) {
+        mRateMatchSession = -1;
+        mRateMatchFps = 0;
     } else {
-        mMode &= ~MDS_VIDEO_ON;
+        return;
     }
-    updateHdmiConnectStatusLocked();
+    mRateMatchPending = true;
+    mHotplugCond.signal();
+}
 
-    if (mode != mMode) {
-        int connection = connected ? 1 : 0;
-        broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE, &mMode, sizeof(mMode), false);
-        drm_hdmi_notify_audio_hotplug(connected);
+void MultiDisplayComposer::matchVideoRefreshRate(int fps) {
+    sp<IMultiDisplayCallback> callback;
+    {
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        callback = mMDSCallback;
     }
-    // set oversan compensation and scaling type
-    status_t result = UNKNOWN_ERROR;
-    // Check the callback implementation
-    if (mMDSCallback != NULL) {
-        if (mScaleType != MDS_SCALING_NONE)
-            result = mMDSCallback->setHdmiScalingType(MDS_SCALING_NONE);
-        if (result == NO_ERROR &&
-                (mHorizontalStep != 0 || mVerticalStep != 0))
-            result = mMDSCallback->setHdmiOverscan(0, 0);
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    if (callback == NULL || !mDrmInit)
+        return;
+    if (fps <= 0) {
+        if (!mRateMatchSavedValid)
+            return;
+        mRateMatchSavedValid = false;
+        MDSHdmiTiming timing = mRateMatchSavedTiming;
+        if (drm_hdmi_checkTiming(&timing))
+            callback->setHdmiTiming(timing);
+        publishHdmiState_l();
+        ALOGI("Restore HDMI timing %dx%d@%d", timing.width, timing.height, timing.refresh);
+        return;
     }
-    // If not implemented in callback, call SurfaceFlinger directly!
-    if (result != NO_ERROR) {
-        if (mScaleType != MDS_SCALING_NONE ||
-                mHorizontalStep != 0 || mVerticalStep != 0)
-            result = setDisplayScalingLocked(MDS_SCALING_NONE, 0, 0);
+    if (mRateMatchSavedValid)
+        return;
+    // 23.976, 29.97 and 59.94 fps are truncated by the players
+    if (fps == 23 || fps == 29 || fps == 59)
+        fps++;
+    MDSHdmiTiming current;
+    if (drm_hdmi_get_current_timing(&current) != NO_ERROR ||
+            current.refresh % fps == 0)
+        return;
+    MDSHdmiTiming timing;
+    if (!drm_hdmi_findRefreshRate(fps, &timing)) {
+        ALOGV("No HDMI timing matches %d fps", fps);
+        return;
     }
+    bool matched = drm_hdmi_checkTiming(&timing) &&
+            callback->setHdmiTiming(timing) == NO_ERROR;
+    publishHdmiState_l();
+    if (!matched)
+        return;
+    mRateMatchSavedTiming = current;
+    mRateMatchSavedValid = true;
+    ALOGI("Match HDMI timing %dx%d@%d to %d fps",
+            timing.width, timing.height, timing.refresh, fps);
+}
 
-    if (result == NO_ERROR) {
-        mScaleType = MDS_SCALING_NONE;
-        mHorizontalStep = 0;
-        mVerticalStep = 0;
+// The first playing video with a frame rate, like the overlay bypass,
+// or the UI if there is none
+void MultiDisplayComposer::computeVideoContent_l(MDSVideoContentInfo* content) {
+    content->contentType = MDS_CONTENT_UI;
+    content->frameRate = 0;
+    content->sessionId = -1;
+    for (uint32_t sessions = mPlayingSessions; sessions != 0; sessions &= sessions - 1) {
+        int index = __builtin_ctz(sessions);
+        MDSVideoSourceInfo info;
+        if (mVideos[index].getInfo(&info) != NO_ERROR || info.frameRate <= 0)
+            continue;
+        content->contentType = info.isProtected ?
+            MDS_CONTENT_PROTECTED_VIDEO : MDS_CONTENT_VIDEO;
+        content->frameRate = info.frameRate;
+        content->sessionId =
+            (mVideoGenerations[index] << MDS_VIDEO_SESSION_INDEX_BITS) | index;
+        return;
     }
+}
 
-    return NO_ERROR;
+// Sends the content to the Widi sinks when it changes, or when Widi connects
+void MultiDisplayComposer::updateVideoContent_l() {
+    if (!(mMode & MDS_WIDI_ON)) {
+        mVideoContentValid = false;
+        return;
+    }
+    MDSVideoContentInfo content;
+    computeVideoContent_l(&content);
+    if (mVideoContentValid &&
+            !memcmp(&content, &mVideoContent, sizeof(content)))
+        return;
+    mVideoContent = content;
+    mVideoContentValid = true;
+    ALOGV("Widi content %d, %d fps, session 0x%x",
+            content.contentType, content.frameRate, content.sessionId);
+    broadcastMessageLocked((int)MDS_MSG_VIDEO_CONTENT,
+            &content, sizeof(content), false);
+}
+
+// The external pipe only mirrors a static primary: HDMI is connected,
+// there is no video session, and the input is idle
+void MultiDisplayComposer::updateHdmiIdle_l() {
+    bool idle = (mMode & (MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED)) &&
+            mActiveSessions == 0 &&
+            android_atomic_acquire_load(&mInputState) == 0;
+    if (idle == (mHdmiIdleSince != 0))
+        return;
+    mHdmiIdleSince = idle ? systemTime() : 0;
+    mHotplugCond.signal();
+}
+
+// The power stage for the idle time at now, and when the next one is due,
+// 0 if there is none
+int MultiDisplayComposer::getHdmiPowerStage_l(nsecs_t now, nsecs_t* deadline) {
+    *deadline = 0;
+    if (mHdmiIdleSince == 0)
+        return MDS_HDMI_POWER_ACTIVE;
+    nsecs_t idle = now - mHdmiIdleSince;
+    if (idle >= MDS_HDMI_IDLE_PAUSE_DELAY)
+        return MDS_HDMI_POWER_PAUSED;
+    if (idle >= MDS_HDMI_IDLE_LOW_REFRESH_DELAY) {
+        *deadline = mHdmiIdleSince + MDS_HDMI_IDLE_PAUSE_DELAY;
+        return MDS_HDMI_POWER_LOW_REFRESH;
+    }
+    *deadline = mHdmiIdleSince + MDS_HDMI_IDLE_LOW_REFRESH_DELAY;
+    return MDS_HDMI_POWER_ACTIVE;
+}
+
+// Called by the worker. The refresh rate is lowered first, which keeps
+// the link and the mirrored content, and the external display is only
+// paused after a longer idle time. Any activity restores both at once.
+void MultiDisplayComposer::setHdmiPowerStage(int stage) {
+    int current;
+    sp<IMultiDisplayCallback> callback;
+    {
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        current = mHdmiPowerStage;
+        callback = mMDSCallback;
+        if (current == stage)
+            return;
+        if (current == MDS_HDMI_POWER_PAUSED)
+            pauseExternalDisplayLocked(false);
+    }
+    {
+        MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+        if (current == MDS_HDMI_POWER_ACTIVE)
+            lowerHdmiRefreshRate_l(callback);
+        else if (stage == MDS_HDMI_POWER_ACTIVE)
+            restoreHdmiRefreshRate_l(callback);
+    }
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    if (stage == MDS_HDMI_POWER_PAUSED)
+        pauseExternalDisplayLocked(true);
+    // Even if it fails, not to retry until the state changes
+    mHdmiPowerStage = stage;
+    ALOGI("HDMI power stage %d -> %d", current, stage);
+}
+
+// Called with mDrmMutex held
+void MultiDisplayComposer::lowerHdmiRefreshRate_l(
+        const sp<IMultiDisplayCallback>& callback) {
+    MDSHdmiTiming current;
+    MDSHdmiTiming timing;
+    if (callback == NULL || !mDrmInit || mPowerSavedValid ||
+            drm_hdmi_get_current_timing(&current) != NO_ERROR ||
+            !drm_hdmi_findRefreshRate(0, &timing) ||
+            timing.refresh >= current.refresh)
+        return;
+    bool lowered = drm_hdmi_checkTiming(&timing) &&
+            callback->setHdmiTiming(timing) == NO_ERROR;
+    publishHdmiState_l();
+    if (!lowered)
+        return;
+    mPowerSavedTiming = current;
+    mPowerSavedValid = true;
+    ALOGI("Lower HDMI timing to %dx%d@%d", timing.width, timing.height, timing.refresh);
+}
+
+// Called with mDrmMutex held
+void MultiDisplayComposer::restoreHdmiRefreshRate_l(
+        const sp<IMultiDisplayCallback>& callback) {
+    if (!mPowerSavedValid)
+        return;
+    mPowerSavedValid = false;
+    MDSHdmiTiming timing = mPowerSavedTiming;
+    if (callback == NULL || !mDrmInit || !drm_hdmi_checkTiming(&timing))
+        return;
+    callback->setHdmiTiming(timing);
+    publishHdmiState_l();
+    ALOGI("Restore HDMI timing %dx%d@%d", timing.width, timing.height, timing.refresh);
+}
+
+bool MultiDisplayHotplugWorker::threadLoop() {
+    return mComposer->processHotplug();
 }
 
 status_t MultiDisplayComposer::updateVideoState(int sessionId, MDS_VIDEO_STATE state) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    return updateVideoState_l(sessionId, state);
+}
+
+status_t MultiDisplayComposer::updateVideoState_l(int sessionId, MDS_VIDEO_STATE state) {
     status_t result = NO_ERROR;
     //FIXME: Video user space driver works at different process,
     // When MDS receive a UNPREPARING or UNPREPARED state,
@@ -242,99 +799,190 @@ status_t MultiDisplayComposer::updateVideoState(int sessionId, MDS_VIDEO_STATE s
     // it may cause a Binder erorr.
     bool ignoreVideoDriver = false;
 
-    ALOGV("set Video Session [%d] state:%d", sessionId, state);
+    ALOGV("set Video Session [0x%x] state:%d", sessionId, state);
     // Check video session
-    CHECK_VIDEO_SESSION_ID(sessionId, UNKNOWN_ERROR);
-    if (mVideos[sessionId].getState() == state) {
-        ALOGW("same video playback state %d for session %d", state, sessionId);
+    int index = getVideoSessionIndex_l(sessionId);
+    CHECK_VIDEO_SESSION_ID(index, UNKNOWN_ERROR);
+    if (mVideos[index].getState() == state) {
+        ALOGW("same video playback state %d for session %d", state, index);
         return NO_ERROR;
     }
 
-    if (mVideos[sessionId].setState(state) != NO_ERROR) {
-        ALOGW("failed to update state %d for session %d", state, sessionId);
+    if (setVideoSessionState_l(index, state) != NO_ERROR) {
+        ALOGW("failed to update state %d for session %d", state, index);
         return UNKNOWN_ERROR;
     }
+    MultiDisplayEventLog::record(MDS_EVENT_VIDEO_STATE, index, mMode, state);
 
-    // Reset video session if player is closed
-    if (state >= MDS_VIDEO_UNPREPARED) {
-        mVideos[sessionId].init();
+    // The session has been reset if player is closed
+    if (state >= MDS_VIDEO_UNPREPARED)
         ignoreVideoDriver = true;
-    }
+    requestRateMatch_l(index, state);
+    updateHdmiIdle_l();
+    updateVideoContent_l();
 
     int mode = mMode;
     if (hasVideoPlaying_l())
-        mMode |= MDS_VIDEO_ON;
+        setModeBitsLocked(MDS_VIDEO_ON);
     else
-        mMode &= ~MDS_VIDEO_ON;
+        clearModeBitsLocked(MDS_VIDEO_ON);
+    updateVppPolicy_l();
+    updateOverlayConfig_l();
+    publishStateLocked();
 
     if (mMDSCallback != NULL)
-        result = mMDSCallback->updateVideoState(sessionId, state);
+        result = mMDSCallback->updateVideoState(index, state);
     if (mode != mMode) {
-        broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE,
-                &mMode, sizeof(mMode), ignoreVideoDriver);
+        broadcastModeLocked(ignoreVideoDriver);
     }
 
     return result;
 }
 
 MDS_VIDEO_STATE MultiDisplayComposer::getVideoState(int sessionId) {
-    Mutex::Autolock lock(mMutex);
+    MDSVideoSessionState session;
     // Check video session
-    CHECK_VIDEO_SESSION_ID(sessionId, MDS_VIDEO_STATE_UNKNOWN);
-    ALOGV("get Video Session [%d] state %d", sessionId, mVideos[sessionId].getState());
-    return mVideos[sessionId].getState();
+    int index = readVideoSession(sessionId, &session);
+    CHECK_VIDEO_SESSION_ID(index, MDS_VIDEO_STATE_UNKNOWN);
+    ALOGV("get Video Session [%d] state %d", index, session.state);
+    return (MDS_VIDEO_STATE)session.state;
 }
 
 int MultiDisplayComposer::getVideoSessionNumber() {
-    //TODO: avoid deadlock issue in HWC
-    //Mutex::Autolock lock(mMutex);
-    return getVideoSessionSize_l();
+    // Lock free, so HWC can call it from its callbacks
+    int32_t number;
+    MultiDisplayStateReader::read(mStatePage, &number,
+            &mStatePage->sessionNumber, sizeof(number));
+    return number;
 }
 
 status_t MultiDisplayComposer::updateVideoSourceInfo(int sessionId, const MDSVideoSourceInfo& info) {
     MDC_CHECK_INIT();
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    return updateVideoSourceInfo_l(sessionId, info);
+}
+
+status_t MultiDisplayComposer::updateVideoSourceInfo_l(int sessionId, const MDSVideoSourceInfo& info) {
     ALOGV("mode[0x%x]protected[%d]w[%d]h[%d]fps[%d]interlace[%d]",
         mMode, info.isProtected, info.displayW,
         info.displayH, info.frameRate, info.isInterlaced);
 
     // Check video session
-    CHECK_VIDEO_SESSION_ID(sessionId, UNKNOWN_ERROR);
-    if (mVideos[sessionId].setInfo(info) != NO_ERROR)
+    int index = getVideoSessionIndex_l(sessionId);
+    CHECK_VIDEO_SESSION_ID(index, UNKNOWN_ERROR);
+    if (mVideos[index].setInfo(info) != NO_ERROR)
         return UNKNOWN_ERROR;
-    dumpVideoSession_l();
+    // The info may come after the state
+    if (mVideos[index].getState() == MDS_VIDEO_PREPARED)
+        requestRateMatch_l(index, MDS_VIDEO_PREPARED);
+    updateVppPolicy_l();
+    publishStateLocked();
+    updateVideoContent_l();
+    MultiDisplayEventLog::record(MDS_EVENT_VIDEO_INFO, index, mMode, info.frameRate);
     return NO_ERROR;
 }
 
+status_t MultiDisplayComposer::updateVideoSession(int32_t* sessionId,
+        MDS_VIDEO_STATE state, const MDSVideoSourceInfo* info) {
+    if (sessionId == NULL)
+        return BAD_VALUE;
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    // Allocated and moved out of UNPREPARED under the same lock,
+    // so two players can't get the same session
+    if (*sessionId < 0) {
+        *sessionId = allocateVideoSessionId_l();
+        if (*sessionId < 0)
+            return UNKNOWN_ERROR;
+    }
+    if (info != NULL && mDrmInit) {
+        status_t result = updateVideoSourceInfo_l(*sessionId, *info);
+        if (result != NO_ERROR)
+            return result;
+    }
+    return updateVideoState_l(*sessionId, state);
+}
+
 status_t MultiDisplayComposer::getVideoSourceInfo(int sessionId, MDSVideoSourceInfo *info) {
     if (info == NULL)
         return BAD_VALUE;
-    Mutex::Autolock lock(mMutex);
+    MDSVideoSessionState session;
     // Check video session
-    CHECK_VIDEO_SESSION_ID(sessionId, UNKNOWN_ERROR);
-    if (mVideos[sessionId].getState() != MDS_VIDEO_PREPARED)
+    int index = readVideoSession(sessionId, &session);
+    CHECK_VIDEO_SESSION_ID(index, UNKNOWN_ERROR);
+    if (session.state != MDS_VIDEO_PREPARED || !session.infoValid)
         return UNKNOWN_ERROR;
-    return mVideos[sessionId].getInfo(info);
+    memcpy(info, &session.info, sizeof(MDSVideoSourceInfo));
+    return NO_ERROR;
+}
+
+// Takes mMutex, only on a transition
+void MultiDisplayComposer::requestEvent(bool* pending) {
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    *pending = true;
+    mHotplugCond.signal();
+    updateHdmiIdle_l();
+}
+
+// Called by the worker, without any lock
+void MultiDisplayComposer::deliverEvents(
+        const sp<IMultiDisplayCallback>& callback, bool phoneCall, bool input) {
+    // registerCallback asks for the states again, for a new HWC
+    if (callback != mEventCallback) {
+        mEventCallback = callback;
+        mPhoneCallNotified = -1;
+        mInputNotified = -1;
+    }
+    if (callback == NULL)
+        return;
+    int32_t state = android_atomic_acquire_load(&mPhoneCallState);
+    if (phoneCall && state >= 0 && state != mPhoneCallNotified) {
+        ALOGV("the phone call state : %d", state);
+        if (callback->blankSecondaryDisplay(state != 0) == NO_ERROR)
+            mPhoneCallNotified = state;
+    }
+    state = android_atomic_acquire_load(&mInputState);
+    if (input && state >= 0 && state != mInputNotified) {
+        ALOGV("the input state:%d", state);
+        if (callback->updateInputState(state != 0) == NO_ERROR)
+            mInputNotified = state;
+        mInputDeadline = systemTime() + MDS_INPUT_STATE_INTERVAL;
+    }
 }
 
 status_t MultiDisplayComposer::updatePhoneCallState(bool blank) {
-    Mutex::Autolock lock(mMutex);
-    ALOGV("the phone call state : %d", blank);
-    if (mMDSCallback == NULL)
-        return NO_INIT;
-    return mMDSCallback->blankSecondaryDisplay(blank);
+    int32_t state = blank ? 1 : 0;
+    if (android_atomic_acquire_load(&mPhoneCallState) == state)
+        return NO_ERROR;
+    android_atomic_release_store(state, &mPhoneCallState);
+    requestEvent(&mPhoneCallPending);
+    return NO_ERROR;
 }
 
 status_t MultiDisplayComposer::updateInputState(bool state) {
-    Mutex::Autolock lock(mMutex);
-    ALOGV("the input state:%d", state);
-    if (mMDSCallback == NULL)
-        return NO_INIT;
-    return mMDSCallback->updateInputState(state);
+    // Called on each touch event, the same state costs no lock
+    int32_t value = state ? 1 : 0;
+    if (android_atomic_acquire_load(&mInputState) == value)
+        return NO_ERROR;
+    android_atomic_release_store(value, &mInputState);
+    requestEvent(&mInputPending);
+    return NO_ERROR;
+}
+
+status_t MultiDisplayComposer::updatePowerSaveState(bool state) {
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    ALOGV("the power save state:%d", state);
+    if (mPowerSave == state)
+        return NO_ERROR;
+    mPowerSave = state;
+    if (updateVppPolicy_l())
+        publishStateLocked();
+    return NO_ERROR;
 }
 
 status_t MultiDisplayComposer::setHdmiTiming(const MDSHdmiTiming& timing) {
-    Mutex::Autolock lock(mMutex);
+    probeHdmiOnce();
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
 
     if (mMDSCallback == NULL)
         return NO_INIT;
@@ -342,94 +990,242 @@ status_t MultiDisplayComposer::setHdmiTiming(const MDSHdmiTiming& timing) {
     memcpy(&real, &timing, sizeof(MDSHdmiTiming));
     if (!drm_hdmi_checkTiming(&real))
         return UNKNOWN_ERROR;
+    // The timing of the user is kept after the video and the idle time
+    mRateMatchSavedValid = false;
+    mPowerSavedValid = false;
 
-    return mMDSCallback->setHdmiTiming(real);
+    status_t result = mMDSCallback->setHdmiTiming(real);
+    getHdmiState_l(&mHdmiState);
+    if (result == NO_ERROR) {
+        mExternalWidth = real.width;
+        mExternalHeight = real.height;
+        mUserTiming = real;
+        mUserTimingValid = true;
+        mProfilePending = true;
+        mHotplugCond.signal();
+        if (updateOverlayConfig_l())
+            broadcastModeLocked(false);
+    }
+    publishStateLocked();
+    return result;
 }
 
 int MultiDisplayComposer::getHdmiTimingCount() {
-    Mutex::Autolock lock(mMutex);
-
-    return drm_hdmi_getTimingNumber();
+    int32_t count;
+    MultiDisplayStateReader::read(mStatePage, &count,
+            &mStatePage->hdmi.timingCount, sizeof(count));
+    return count;
 }
 
 status_t MultiDisplayComposer::getHdmiTimingList(
         int count, MDSHdmiTiming **list) {
-    Mutex::Autolock lock(mMutex);
+    probeHdmiOnce();
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
     bool ret = drm_hdmi_getTimings(count, list);
     return (ret == false ? UNKNOWN_ERROR : NO_ERROR);
 }
 
+status_t MultiDisplayComposer::getHdmiTimings(int32_t* version,
+        int32_t* count, MDSHdmiTiming* list, int32_t max) {
+    if (version == NULL || count == NULL || list == NULL ||
+            max <= 0 || max > HDMI_TIMING_MAX)
+        return BAD_VALUE;
+    probeHdmiOnce();
+    // The list is unchanged, no need to wait for the DRM
+    MDSHdmiState hdmi;
+    MultiDisplayStateReader::read(mStatePage, &hdmi,
+            &mStatePage->hdmi, sizeof(hdmi));
+    if (hdmi.timingVersion == *version) {
+        *count = (hdmi.timingCount > max) ? max : hdmi.timingCount;
+        return NO_ERROR;
+    }
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    // The count first, it may parse the timings and change the version
+    *count = drm_hdmi_getTimingNumber();
+    int32_t current = drm_hdmi_getTimingVersion();
+    if (current == 0)
+        *count = 0;
+    if (*count > max)
+        *count = max;
+    if (current == *version)
+        return NO_ERROR;
+    *version = current;
+    if (*count <= 0)
+        return NO_ERROR;
+    MDSHdmiTiming* timings[HDMI_TIMING_MAX];
+    for (int i = 0; i < *count; i++)
+        timings[i] = &list[i];
+    if (!drm_hdmi_getTimings(*count, timings))
+        return UNKNOWN_ERROR;
+    return NO_ERROR;
+}
+
 status_t MultiDisplayComposer::getCurrentHdmiTiming(MDSHdmiTiming* timing) {
-    Mutex::Autolock lock(mMutex);
     if (timing == NULL)
         return UNKNOWN_ERROR;
-    return drm_hdmi_get_current_timing(timing);
+    MDSHdmiState hdmi;
+    MultiDisplayStateReader::read(mStatePage, &hdmi,
+            &mStatePage->hdmi, sizeof(hdmi));
+    if (!hdmi.currentValid)
+        return UNKNOWN_ERROR;
+    memcpy(timing, &hdmi.current, sizeof(MDSHdmiTiming));
+    return NO_ERROR;
 }
 
 status_t MultiDisplayComposer::setHdmiTimingByIndex(int index) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
 
     return UNKNOWN_ERROR;
 }
 
 int MultiDisplayComposer::getCurrentHdmiTimingIndex() {
-    Mutex::Autolock lock(mMutex);
     return -1;
 }
 
 status_t MultiDisplayComposer::setHdmiScalingType(MDS_SCALING_TYPE type) {
     ALOGV("set scaling type:%d", type);
-    Mutex::Autolock lock(mMutex);
-    status_t result = UNKNOWN_ERROR;
-    // Check the callback implementation
-    if (mMDSCallback != NULL)
-        result = mMDSCallback->setHdmiScalingType(type);
+    return requestHdmiScaling(true, type, false, 0, 0);
+}
 
-    // If not implemented in callback, call SurfaceFlinger directly!
-    if (result != NO_ERROR)
-        result = setDisplayScalingLocked((uint32_t)type,
-            mHorizontalStep, mVerticalStep);
+status_t MultiDisplayComposer::setHdmiOverscan(int hVal, int vVal) {
+    hVal = (hVal > overscan_max) ? 0: (overscan_max - hVal);
+    vVal = (vVal > overscan_max) ? 0: (overscan_max - vVal);
+    ALOGV("set overscan, h_val:%d, v_val:%d", hVal, vVal);
+    return requestHdmiScaling(false, MDS_SCALING_NONE, true, hVal, vVal);
+}
 
-    if (result == NO_ERROR)
+status_t MultiDisplayComposer::setHdmiScaling(MDS_SCALING_TYPE type, int hVal, int vVal) {
+    hVal = (hVal > overscan_max) ? 0: (overscan_max - hVal);
+    vVal = (vVal > overscan_max) ? 0: (overscan_max - vVal);
+    ALOGV("set scaling type:%d, h_val:%d, v_val:%d", type, hVal, vVal);
+    return requestHdmiScaling(true, type, true, hVal, vVal);
+}
+
+// The timing, the scaling type and the overscan steps of the user in one
+// request, which HWC commits with one mode set
+status_t MultiDisplayComposer::setHdmiConfig(const MDSHdmiTiming& timing,
+        MDS_SCALING_TYPE type, int hVal, int vVal) {
+    hVal = (hVal > overscan_max) ? 0: (overscan_max - hVal);
+    vVal = (vVal > overscan_max) ? 0: (overscan_max - vVal);
+    ALOGV("set config %dx%d@%d, scaling type:%d, h_val:%d, v_val:%d",
+            timing.width, timing.height, timing.refresh, type, hVal, vVal);
+    probeHdmiOnce();
+    MultiDisplayAutolock drmLock(mDrmMutex, sDrmMutexWaitStats);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+
+    if (mMDSCallback == NULL)
+        return NO_INIT;
+    MDSHdmiTiming real;
+    memcpy(&real, &timing, sizeof(MDSHdmiTiming));
+    if (!drm_hdmi_checkTiming(&real))
+        return UNKNOWN_ERROR;
+    // The timing of the user is kept after the video and the idle time
+    mRateMatchSavedValid = false;
+    mPowerSavedValid = false;
+    // A scaling request still pending is superseded by this one
+    ++mScalingGeneration;
+
+    status_t result = mMDSCallback->setHdmiConfig(real, type, hVal, vVal);
+    bool scaled = (result == NO_ERROR);
+    if (!scaled) {
+        // One by one, with the scaling through SurfaceFlinger
+        result = mMDSCallback->setHdmiTiming(real);
+    }
+    getHdmiState_l(&mHdmiState);
+    if (result == NO_ERROR) {
+        mExternalWidth = real.width;
+        mExternalHeight = real.height;
+        mUserTiming = real;
+        mUserTimingValid = true;
+        mProfilePending = true;
+        mHotplugCond.signal();
+        if (!scaled)
+            return completeHdmiScaling_l(type, hVal, vVal, UNKNOWN_ERROR);
         mScaleType = type;
+        mHorizontalStep = hVal;
+        mVerticalStep = vVal;
+        MultiDisplayEventLog::record(MDS_EVENT_SCALING, type, mMode, result);
+        if (updateOverlayConfig_l())
+            broadcastModeLocked(false);
+    }
+    publishStateLocked();
+    return result;
+}
 
+// The scaling type and the overscan steps go to the callback in one
+// asynchronous request, which is not waited for: the new state is taken,
+// published and broadcast when the callback completes it. The part which
+// is not set is kept from the current state.
+status_t MultiDisplayComposer::requestHdmiScaling(bool setType, MDS_SCALING_TYPE type,
+        bool setOverscan, int hVal, int vVal) {
+    sp<IMultiDisplayCallback> callback;
+    sp<MultiDisplayCompletion> done;
+    uint32_t generation;
+    {
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        if (!setType)
+            type = mScaleType;
+        if (!setOverscan) {
+            hVal = mHorizontalStep;
+            vVal = mVerticalStep;
+        }
+        // A request still pending is superseded by this one
+        generation = ++mScalingGeneration;
+        callback = mMDSCallback;
+        if (callback == NULL)
+            return completeHdmiScaling_l(type, hVal, vVal, UNKNOWN_ERROR);
+        done = new MultiDisplayScalingCompletion(this, generation, type, hVal, vVal);
+    }
+    status_t result = callback->setHdmiScalingAsync(type, hVal, vVal, done);
+    if (result != NO_ERROR) {
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        if (generation == mScalingGeneration)
+            result = completeHdmiScaling_l(type, hVal, vVal, result);
+    }
     return result;
 }
 
-status_t MultiDisplayComposer::setHdmiOverscan(int hVal, int vVal) {
-    Mutex::Autolock lock(mMutex);
-    status_t result = UNKNOWN_ERROR;
-    hVal = (hVal > overscan_max) ? 0: (overscan_max - hVal);
-    vVal = (vVal > overscan_max) ? 0: (overscan_max - vVal);
-    ALOGV("set overscan, h_val:%d, v_val:%d", hVal, vVal);
-    // Check the callback implementation
-    if (mMDSCallback != NULL)
-        result = mMDSCallback->setHdmiOverscan(hVal, vVal);
+void MultiDisplayComposer::onHdmiScalingComplete(uint32_t generation,
+        MDS_SCALING_TYPE type, int hVal, int vVal, status_t result) {
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    if (generation != mScalingGeneration) {
+        ALOGV("Scaling request %u superseded", generation);
+        return;
+    }
+    completeHdmiScaling_l(type, hVal, vVal, result);
+}
 
-    // If not implemented in callback, call SurfaceFlinger directly!
+status_t MultiDisplayComposer::completeHdmiScaling_l(
+        MDS_SCALING_TYPE type, int hVal, int vVal, status_t result) {
+    // If not implemented in callback, a single call to SurfaceFlinger
     if (result != NO_ERROR)
-        result = setDisplayScalingLocked(
-                (uint32_t)mScaleType, hVal, vVal);
+        result = setDisplayScalingLocked((uint32_t)type, hVal, vVal);
+    MultiDisplayEventLog::record(MDS_EVENT_SCALING, type, mMode, result);
 
     if (result == NO_ERROR) {
+        mScaleType = type;
         mHorizontalStep = hVal;
         mVerticalStep = vVal;
+        // Kept in the profile of the sink, by the worker
+        mProfilePending = true;
+        mHotplugCond.signal();
+        if (updateOverlayConfig_l())
+            broadcastModeLocked(false);
+        publishStateLocked();
     }
     return result;
 }
 
+void MultiDisplayScalingCompletion::onComplete(status_t result) {
+    sp<MultiDisplayComposer> composer = mComposer.promote();
+    if (composer != NULL)
+        composer->onHdmiScalingComplete(mGeneration, mType, mHorizontalStep, mVerticalStep, result);
+}
+
 MDS_DISPLAY_MODE MultiDisplayComposer::getDisplayMode(bool wait) {
-    if (wait) {
-        mMutex.lock();
-    } else {
-        if (mMutex.tryLock() == -EBUSY) {
-            return MDS_MODE_NONE;
-        }
-    }
-    //ALOGV("Mode is 0x%x, %d", mMode, wait);
-    MDS_DISPLAY_MODE mode = (MDS_DISPLAY_MODE)mMode;
-    mMutex.unlock();
-    return mode;
+    // mMode is published atomically, the current mode is always
+    // returned without the lock, whatever "wait" is.
+    return (MDS_DISPLAY_MODE)android_atomic_acquire_load(&mMode);
 }
 
 int32_t MultiDisplayComposer::registerListener(
@@ -440,201 +1236,379 @@ int32_t MultiDisplayComposer::registerListener(
         ALOGE("Fail to register a new listener");
         return -1;
     }
-    Mutex::Autolock _l(mMutex);
-    if (mListeners.size() >= MDS_LISTENER_MAX_VALUE ||
-            mListenerId >= MDS_LISTENER_MAX_VALUE) {
+    MultiDisplayAutolock _l(mMutex, sMutexWaitStats);
+    int32_t newId = allocateListenerId_l();
+    if (newId < 0) {
         ALOGE("Up to the maximum of listener %d", MDS_LISTENER_MAX_VALUE);
         return -1;
     }
-    int32_t newId = mListenerId;
-    for (size_t i = 0; i < mListeners.size(); i++) {
-        if (mListeners.keyAt(i) == newId) {
-            ALOGE("The listener %p is already registered!", listener.get());
-            return -1;
-        }
-    }
     MultiDisplayListener* plistener =
         new MultiDisplayListener(msg, newId, name, listener);
-    plistener->dump();
+    MultiDisplayEventLog::record(MDS_EVENT_LISTENER_ADD, newId, mMode, msg);
     mListeners.add(newId, plistener);
-    mListenerId++;
-    // Find a valid Id
-    if (mListenerId >= MDS_LISTENER_MAX_VALUE) {
-        mListenerId = 0;
-        for (; mListenerId < MDS_LISTENER_MAX_VALUE; mListenerId++) {
-            bool used = false;
-            for (size_t i = 0; i < mListeners.size(); i++) {
-                if (mListeners.keyAt(i) == mListenerId) {
-                    used = true;
-                    break;
-                }
-            }
-            if (!used) break;
-        }
-        ALOGV("The next valid listener Id: %d", mListenerId);
+    // Local listeners cannot die on their own, the error is expected
+    listener->asBinder()->linkToDeath(mDeathRecipient);
+    for (int type = 0; type < MDS_MSG_TYPE_MAX; type++) {
+        if (plistener->checkMsg(1 << type))
+            mMsgListeners[type].push(plistener);
+    }
+    // A Widi sink which comes after the content still gets it
+    if (mVideoContentValid && plistener->checkMsg(MDS_MSG_VIDEO_CONTENT)) {
+        plistener->queueMessage(MDS_MSG_VIDEO_CONTENT,
+                &mVideoContent, sizeof(mVideoContent));
+        mDispatchCond.signal();
     }
     return newId;
 }
 
 status_t MultiDisplayComposer::unregisterListener(int32_t listenerId) {
-    Mutex::Autolock _l(mMutex);
+    MultiDisplayAutolock _l(mMutex, sMutexWaitStats);
     if (listenerId < 0) {
         ALOGE("Error listener ID");
         return BAD_VALUE;
     }
+    ssize_t index = mListeners.indexOfKey(listenerId);
+    if (index < 0)
+        return NO_ERROR;
+    ALOGV("Find a matched listener to unregister:\n");
+    MultiDisplayListener* listener = mListeners.valueAt(index);
+    if (listener != NULL && listener->getListener() != NULL)
+        listener->getListener()->asBinder()->unlinkToDeath(mDeathRecipient);
+    removeListener_l(index);
+    return NO_ERROR;
+}
+
+void MultiDisplayComposer::removeListener_l(size_t index) {
+    MultiDisplayListener* listener = mListeners.valueAt(index);
+    freeListenerId_l(mListeners.keyAt(index));
+    mListeners.removeItemsAt(index);
+    if (listener == NULL)
+        return;
+    MultiDisplayEventLog::record(MDS_EVENT_LISTENER_REMOVE,
+            listener->getId(), mMode, listener->getMsg());
+    for (int type = 0; type < MDS_MSG_TYPE_MAX; type++) {
+        Vector<MultiDisplayListener*>& listeners = mMsgListeners[type];
+        for (size_t i = 0; i < listeners.size(); i++) {
+            if (listeners[i] == listener) {
+                listeners.removeAt(i);
+                break;
+            }
+        }
+    }
+    delete listener;
+}
+
+void MultiDisplayComposer::binderDied(const wp<IBinder>& who) {
+    MultiDisplayAutolock _l(mMutex, sMutexWaitStats);
+    IBinder* binder = who.unsafe_get();
     for (size_t i = 0; i < mListeners.size(); i++) {
-        if (mListeners.keyAt(i) != listenerId)
-            continue;
         MultiDisplayListener* listener = mListeners.valueAt(i);
-        if (listener == NULL)
+        if (listener != NULL && listener->getListener() != NULL &&
+                listener->getListener()->asBinder().get() == binder) {
+            ALOGW("Listener %d (%s) died", listener->getId(), listener->getName());
+            removeListener_l(i);
+            return;
+        }
+    }
+    if (mMDSCallback != NULL && mMDSCallback->asBinder().get() == binder) {
+        ALOGW("MDS callback died");
+        mMDSCallback = NULL;
+    }
+    if (mSurfaceComposer != NULL && mSurfaceComposer.get() == binder) {
+        ALOGW("SurfaceFlinger died");
+        mSurfaceComposer = NULL;
+    }
+}
+
+void MultiDisplayDeathRecipient::binderDied(const wp<IBinder>& who) {
+    sp<MultiDisplayComposer> composer = mComposer.promote();
+    if (composer != NULL)
+        composer->binderDied(who);
+}
+
+int32_t MultiDisplayComposer::allocateListenerId_l() {
+    // First free Id from mListenerId, wrapping around, so that the Id of
+    // a listener which just left is not given again at once
+    for (int i = 0; i < MDS_LISTENER_ID_WORDS; i++) {
+        int word = ((mListenerId >> 5) + i) % MDS_LISTENER_ID_WORDS;
+        uint32_t free = ~mListenerIdMap[word];
+        if (i == 0)
+            free &= ~0U << (mListenerId & 31);
+        if (free == 0)
+            continue;
+        int32_t id = (word << 5) + __builtin_ctz(free);
+        if (id >= MDS_LISTENER_MAX_VALUE)
             continue;
-        ALOGV("Find a matched listener to unregister:\n");
-        listener->dump();
-        mListeners.removeItem(listenerId);
-        delete listener;
-        listener = NULL;
-        break;
+        mListenerIdMap[word] |= 1U << (id & 31);
+        mListenerId = (id + 1) % MDS_LISTENER_MAX_VALUE;
+        return id;
     }
-    return NO_ERROR;
+    // Ids below mListenerId in its own word
+    int word = mListenerId >> 5;
+    uint32_t free = ~mListenerIdMap[word] & ~(~0U << (mListenerId & 31));
+    if (free == 0)
+        return -1;
+    int32_t id = (word << 5) + __builtin_ctz(free);
+    mListenerIdMap[word] |= 1U << (id & 31);
+    mListenerId = (id + 1) % MDS_LISTENER_MAX_VALUE;
+    return id;
+}
+
+void MultiDisplayComposer::freeListenerId_l(int32_t id) {
+    if (id >= 0 && id < MDS_LISTENER_MAX_VALUE)
+        mListenerIdMap[id >> 5] &= ~(1U << (id & 31));
 }
 
 void MultiDisplayComposer::broadcastMessageLocked(
         int msg, void* value, int size, bool ignoreVideoDriver) {
-    if (mListeners.size() == 0)
+    // Messages are single bits, @see MDS_MESSAGE
+    if (msg == 0 || (msg & (msg - 1)) != 0) {
+        ALOGE("Invalid message 0x%x", msg);
+        return;
+    }
+    const Vector<MultiDisplayListener*>& listeners =
+        mMsgListeners[__builtin_ctz(msg)];
+    if (listeners.size() == 0)
         return;
 
-    for (size_t index = 0; index < mListeners.size(); index++) {
-        MultiDisplayListener* listener = mListeners.valueAt(index);
-        if (listener == NULL)
-            continue;
-        listener->dump();
-        const char* name = listener->getName();
-        if (ignoreVideoDriver && name != NULL &&
-                !strncmp("VideoDriver", name, sizeof("VideoDriver"))) {
+    MultiDisplayCallTrace trace(sBroadcastStats);
+    MultiDisplayEventLog::record(MDS_EVENT_BROADCAST, -1, mMode, msg);
+    // Messages are queued here and delivered by the dispatcher thread,
+    // so a slow listener never blocks the composer lock.
+    bool queued = false;
+    for (size_t index = 0; index < listeners.size(); index++) {
+        MultiDisplayListener* listener = listeners[index];
+        if (ignoreVideoDriver && listener->isVideoDriver()) {
             ALOGV("Ignoring an invalid video driver message");
             continue;
         }
-        if (listener->checkMsg(msg)) {
-            sp<IMultiDisplayListener> ielistener = listener->getListener();
-            if (ielistener != NULL)
-                ielistener->onMdsMessage(msg, value, size);
+        listener->queueMessage(msg, value, size);
+        queued = true;
+    }
+    if (queued)
+        mDispatchCond.signal();
+}
+
+bool MultiDisplayComposer::dispatchMessage() {
+    MultiDisplayMessage message;
+    sp<IMultiDisplayListener> ielistener;
+    bool sync = false;
+    {
+        MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+        MultiDisplayListener* listener = NULL;
+        while (!mDispatchExit) {
+            // Round robin, so that the queue of a slow listener
+            // does not delay the messages of the others
+            size_t size = mListeners.size();
+            for (size_t i = 0; i < size; i++) {
+                size_t index = (mDispatchIndex + i) % size;
+                MultiDisplayListener* l = mListeners.valueAt(index);
+                if (l != NULL && l->hasMessage()) {
+                    listener = l;
+                    mDispatchIndex = index + 1;
+                    break;
+                }
+            }
+            if (listener != NULL)
+                break;
+            mDispatchCond.wait(mMutex);
         }
+        if (mDispatchExit)
+            return false;
+        listener->dequeueMessage(&message);
+        ielistener = listener->getListener();
+        sync = listener->isSync();
     }
+    if (ielistener != NULL) {
+        MultiDisplayCallTrace trace(sDispatchStats);
+        if (sync)
+            ielistener->onMdsMessage(message.mMsg,
+                    message.mValue.editArray(), message.mValue.size());
+        else
+            ielistener->notifyMdsMessage(message.mMsg,
+                    message.mValue.editArray(), message.mValue.size(), message.mSeq);
+    }
+    return true;
 }
 
-status_t MultiDisplayComposer::setDisplayScalingLocked(uint32_t mode,
-         uint32_t stepx, uint32_t stepy) {
+bool MultiDisplayDispatcher::threadLoop() {
+    return mComposer->dispatchMessage();
+}
+
+// SurfaceFlinger is looked up once, and again after it died
+sp<IBinder> MultiDisplayComposer::getSurfaceComposer_l() {
     if (mSurfaceComposer == NULL) {
         const sp<IServiceManager> sm = defaultServiceManager();
         const String16 name("SurfaceFlinger");
         mSurfaceComposer = sm->getService(name);
-        if (mSurfaceComposer == NULL) {
-            return UNKNOWN_ERROR;
-        }
+        if (mSurfaceComposer != NULL)
+            mSurfaceComposer->linkToDeath(mDeathRecipient);
     }
+    return mSurfaceComposer;
+}
 
-    uint32_t scale;
-    Parcel data, reply;
-    const String16 token("android.ui.ISurfaceComposer");
+status_t MultiDisplayComposer::transactSurfaceComposer_l(uint32_t code, int32_t value) {
+    sp<IBinder> composer = getSurfaceComposer_l();
+    if (composer == NULL)
+        return UNKNOWN_ERROR;
 
-    scale = mode | stepx << 16 | stepy << 24;
+    Parcel data, reply;
+    static const String16 token("android.ui.ISurfaceComposer");
     data.writeInterfaceToken(token);
-    data.writeInt32(scale);
-    mSurfaceComposer->transact(SFIntelHDMIScalingSetting, data, &reply);
+    data.writeInt32(value);
+    status_t result = composer->transact(code, data, &reply);
+    if (result != NO_ERROR)
+        return result;
     return reply.readInt32();
 }
 
+// The scaling type and both overscan steps are set in one transaction
+status_t MultiDisplayComposer::setDisplayScalingLocked(uint32_t mode,
+         uint32_t stepx, uint32_t stepy) {
+    return transactSurfaceComposer_l(SFIntelHDMIScalingSetting,
+            mode | stepx << 16 | stepy << 24);
+}
+
+status_t MultiDisplayComposer::pauseExternalDisplayLocked(bool pause) {
+    return transactSurfaceComposer_l(SFIntelPauseExternalDisplay, pause ? 1 : 0);
+}
+
 int MultiDisplayComposer::getVideoSessionSize_l() {
-    int size = 0;
-    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++) {
-        if (mVideos[i].getState() != MDS_VIDEO_UNPREPARED)
-            size++;
-    }
+    int size = __builtin_popcount(mActiveSessions);
     ALOGV("get video session number %d", size);
     return size;
 }
 
 int MultiDisplayComposer::allocateVideoSessionId() {
-    Mutex::Autolock lock(mMutex);
-    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++) {
-        if (mVideos[i].getState() == MDS_VIDEO_UNPREPARED) {
-            ALOGV("Allocate a new Video Session ID %d", i);
-            return i;
-        }
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    return allocateVideoSessionId_l();
+}
+
+int MultiDisplayComposer::allocateVideoSessionId_l() {
+    uint32_t free = ~mActiveSessions;
+    int index = (free != 0) ? __builtin_ctz(free) : MDS_VIDEO_SESSION_MAX_VALUE;
+    if (index >= MDS_VIDEO_SESSION_MAX_VALUE) {
+        ALOGE("Fail to allocate session ID");
+        return -1;
+    }
+    int sessionId = (mVideoGenerations[index] << MDS_VIDEO_SESSION_INDEX_BITS) | index;
+    ALOGV("Allocate a new Video Session ID 0x%x", sessionId);
+    return sessionId;
+}
+
+// Index of the session in mVideos, or -1 if the Id is invalid or stale
+int MultiDisplayComposer::getVideoSessionIndex_l(int sessionId) {
+    if (sessionId < 0)
+        return -1;
+    int index = sessionId & ((1 << MDS_VIDEO_SESSION_INDEX_BITS) - 1);
+    int generation = sessionId >> MDS_VIDEO_SESSION_INDEX_BITS;
+    if (index >= MDS_VIDEO_SESSION_MAX_VALUE)
+        return -1;
+    // HWC and the info provider only know the index
+    if (generation != 0 && generation != mVideoGenerations[index]) {
+        ALOGW("Stale video session ID 0x%x, session %d is at generation %d",
+                sessionId, index, mVideoGenerations[index]);
+        return -1;
     }
+    return index;
+}
 
-    ALOGE("Fail to allocate session ID");
-    return -1;
+// Same as getVideoSessionIndex_l, from the published state without the lock
+int MultiDisplayComposer::readVideoSession(int sessionId, MDSVideoSessionState* session) {
+    if (sessionId < 0)
+        return -1;
+    int index = sessionId & ((1 << MDS_VIDEO_SESSION_INDEX_BITS) - 1);
+    int generation = sessionId >> MDS_VIDEO_SESSION_INDEX_BITS;
+    if (index >= MDS_VIDEO_SESSION_MAX_VALUE)
+        return -1;
+    MultiDisplayStateReader::read(mStatePage, session,
+            &mStatePage->sessions[index], sizeof(MDSVideoSessionState));
+    if (generation != 0 && generation != session->idGeneration) {
+        ALOGW("Stale video session ID 0x%x, session %d is at generation %d",
+                sessionId, index, session->idGeneration);
+        return -1;
+    }
+    return index;
+}
+
+status_t MultiDisplayComposer::setVideoSessionState_l(int index, MDS_VIDEO_STATE state) {
+    if (mVideos[index].setState(state) != NO_ERROR)
+        return UNKNOWN_ERROR;
+    uint32_t bit = 1U << index;
+    if (state == MDS_VIDEO_UNPREPARED) {
+        // Reset video session if player is closed
+        mVideos[index].init();
+        if (mActiveSessions & bit) {
+            int generation = (mVideoGenerations[index] + 1) & MDS_VIDEO_SESSION_GENERATION_MASK;
+            mVideoGenerations[index] = (generation != 0) ? generation : 1;
+        }
+        mActiveSessions &= ~bit;
+        mPlayingSessions &= ~bit;
+        mDecoderConfigSessions &= ~bit;
+        return NO_ERROR;
+    }
+    mActiveSessions |= bit;
+    if (state == MDS_VIDEO_PREPARED)
+        mPlayingSessions |= bit;
+    else
+        mPlayingSessions &= ~bit;
+    return NO_ERROR;
 }
 
 void MultiDisplayComposer::initVideoSessions_l() {
     for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++) {
-        mVideos[i].init();
+        setVideoSessionState_l(i, MDS_VIDEO_UNPREPARED);
     }
 }
 
 status_t MultiDisplayComposer::resetVideoPlayback() {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
     if (getVideoSessionSize_l() <= 0)
         return NO_ERROR;
 
     // TODO: for each video session, send MDS_VIDEO_UNPREPARED
+    if (mRateMatchSession >= 0)
+        requestRateMatch_l(mRateMatchSession, MDS_VIDEO_UNPREPARED);
     initVideoSessions_l();
+    updateHdmiIdle_l();
 
     if (mMDSCallback != NULL) {
         mMDSCallback->updateVideoState(-1, MDS_VIDEO_UNPREPARED);
     }
 
     // exit extended mode
-    mMode &= ~MDS_VIDEO_ON;
-    broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE, &mMode, sizeof(mMode), false);
+    clearModeBitsLocked(MDS_VIDEO_ON);
+    updateVppPolicy_l();
+    updateOverlayConfig_l();
+    publishStateLocked();
+    broadcastModeLocked(false);
+    updateVideoContent_l();
 
     return NO_ERROR;
 }
 
 bool MultiDisplayComposer::hasVideoPlaying_l() {
-    int size = 0;
-    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++) {
-        if (mVideos[i].getState() == MDS_VIDEO_PREPARED) {
-            size++;
-        }
-    }
-    return (size >= 1 ? true : false);
-}
-
-void MultiDisplayComposer::dumpVideoSession_l() {
-    ALOGV("All Video Session info:\n");
-    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++)
-        mVideos[i].dump(i);
-    return;
+    return mPlayingSessions != 0;
 }
 
+// The first session with a decoder config
 int MultiDisplayComposer::getValidDecoderConfigVideoSession_l() {
-    int index = -1;
-    int32_t width  = 0;
-    int32_t height = 0;
-    int32_t offX   = 0;
-    int32_t offY   = 0;
-    int32_t bufW   = 0;
-    int32_t bufH   = 0;
-    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++) {
-        if (mVideos[i].getDecoderOutputResolution(
-                    &width, &height, &offX, &offY, &bufW, &bufH) == NO_ERROR) {
-            index = i;
-            break;
-        }
-    }
-    return index;
+    if (mDecoderConfigSessions == 0)
+        return -1;
+    return __builtin_ctz(mDecoderConfigSessions);
 }
 
-//TODO: The input "sessionId" is ignored now
+// The config of the session, or of the first configured one for the
+// callers which don't give a session
 status_t MultiDisplayComposer::getDecoderOutputResolution(
         int sessionId, int32_t* width, int32_t* height,
         int32_t* offX, int32_t* offY,
         int32_t* bufWidth, int32_t* bufHeight) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
     status_t result = NO_ERROR;
-    int index = getValidDecoderConfigVideoSession_l();
+    int index = getVideoSessionIndex_l(sessionId);
+    if (index < 0 || !(mDecoderConfigSessions & (1U << index)))
+        index = getValidDecoderConfigVideoSession_l();
     if (index < 0)
         return UNKNOWN_ERROR;
     // Check video session
@@ -650,14 +1624,130 @@ status_t MultiDisplayComposer::setDecoderOutputResolution(
         int sessionId, int32_t width, int32_t height,
         int32_t offX, int32_t offY,
         int32_t bufWidth, int32_t bufHeight) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
 
     // Check video session
-    CHECK_VIDEO_SESSION_ID(sessionId, UNKNOWN_ERROR);
+    int index = getVideoSessionIndex_l(sessionId);
+    CHECK_VIDEO_SESSION_ID(index, UNKNOWN_ERROR);
     ALOGV("set video session %d decoder Output resolution %dx%d, %dx%d, %dx%d",
-            sessionId, width, height, offX, offY, bufWidth, bufHeight);
-    return mVideos[sessionId].setDecoderOutputResolution(
+            index, width, height, offX, offY, bufWidth, bufHeight);
+    status_t result = mVideos[index].setDecoderOutputResolution(
             width, height, offX, offY, bufWidth, bufHeight);
+    if (result == NO_ERROR) {
+        MultiDisplayEventLog::record(MDS_EVENT_DECODER_CONFIG, index, mMode, width);
+        mDecoderConfigSessions |= 1U << index;
+        if (updateOverlayConfig_l())
+            broadcastModeLocked(false);
+        publishStateLocked();
+    }
+    return result;
+}
+
+// The crop and the destination of the decoder buffer of a session in
+// an area of the external display, false if the overlay plane can't show it
+bool MultiDisplayComposer::computeOverlayConfig_l(int index, MDS_SCALING_TYPE type,
+        int32_t areaX, int32_t areaY, int32_t areaW, int32_t areaH,
+        MDSOverlayConfig* overlay) {
+    int32_t width = 0, height = 0, offX = 0, offY = 0, bufW = 0, bufH = 0;
+    if (mVideos[index].getDecoderOutputResolution(
+                &width, &height, &offX, &offY, &bufW, &bufH) != NO_ERROR)
+        return false;
+    if (width <= 0 || height <= 0 || offX < 0 || offY < 0 ||
+            offX + width > bufW || offY + height > bufH)
+        return false;
+    int32_t dstW = areaW;
+    int32_t dstH = areaH;
+    if (type == MDS_SCALING_CENTER && width <= areaW && height <= areaH) {
+        dstW = width;
+        dstH = height;
+    } else if (type != MDS_SCALING_FULL_SCREEN) {
+        // Keep the aspect ratio
+        if ((int64_t)width * areaH > (int64_t)height * areaW)
+            dstH = (int32_t)((int64_t)height * areaW / width) & ~1;
+        else
+            dstW = (int32_t)((int64_t)width * areaH / height) & ~1;
+    }
+    if (dstW <= 0 || dstH <= 0 ||
+            dstW * MDS_OVERLAY_MAX_DOWNSCALE < width ||
+            dstH * MDS_OVERLAY_MAX_DOWNSCALE < height)
+        return false;
+    overlay->sessionId = index;
+    overlay->cropX = offX;
+    overlay->cropY = offY;
+    overlay->cropWidth = width;
+    overlay->cropHeight = height;
+    overlay->dstX = areaX + (areaW - dstW) / 2;
+    overlay->dstY = areaY + (areaH - dstH) / 2;
+    overlay->dstWidth = dstW;
+    overlay->dstHeight = dstH;
+    return true;
+}
+
+int64_t MultiDisplayComposer::getDecodedArea_l(int index) {
+    int32_t width = 0, height = 0, offX = 0, offY = 0, bufW = 0, bufH = 0;
+    if (mVideos[index].getDecoderOutputResolution(
+                &width, &height, &offX, &offY, &bufW, &bufH) != NO_ERROR)
+        return 0;
+    return (int64_t)width * height;
+}
+
+// Returns true if MDS_OVERLAY_BYPASS changed, the caller publishes the state
+bool MultiDisplayComposer::updateOverlayConfig_l() {
+    MDSOverlayConfig overlays[MDS_OVERLAY_PLANE_MAX];
+    memset(overlays, 0, sizeof(overlays));
+    for (int i = 0; i < MDS_OVERLAY_PLANE_MAX; i++)
+        overlays[i].sessionId = -1;
+    // Extended mode on HDMI, the overscan compensation needs the GPU
+    uint32_t sessions = mDecoderConfigSessions & mPlayingSessions;
+    bool bypass = false;
+    if (sessions != 0 && (mMode & MDS_VIDEO_ON) && !(mMode & MDS_WIDI_ON) &&
+            (mMode & (MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED)) &&
+            mExternalWidth > 0 && mExternalHeight > 0 &&
+            mHorizontalStep == 0 && mVerticalStep == 0) {
+        int32_t outW = mExternalWidth;
+        int32_t outH = mExternalHeight;
+        int32_t pipW = (outW / MDS_OVERLAY_PIP_DIVISOR) & ~1;
+        int32_t pipH = (outH / MDS_OVERLAY_PIP_DIVISOR) & ~1;
+        // The largest video on the main plane, the next one in the
+        // picture-in-picture window. A video which the plane can't
+        // scale is composed by the GPU, each stream on its own.
+        for (int plane = 0; plane < MDS_OVERLAY_PLANE_MAX && sessions != 0; ) {
+            int index = -1;
+            int64_t area = -1;
+            for (uint32_t left = sessions; left != 0; left &= left - 1) {
+                int i = __builtin_ctz(left);
+                int64_t a = getDecodedArea_l(i);
+                if (a > area) {
+                    area = a;
+                    index = i;
+                }
+            }
+            sessions &= ~(1U << index);
+            bool shown = (plane == 0) ?
+                computeOverlayConfig_l(index, mScaleType,
+                        0, 0, outW, outH, &overlays[plane]) :
+                computeOverlayConfig_l(index, MDS_SCALING_ASPECT,
+                        outW - pipW - MDS_OVERLAY_PIP_MARGIN,
+                        outH - pipH - MDS_OVERLAY_PIP_MARGIN,
+                        pipW, pipH, &overlays[plane]);
+            if (!shown) {
+                ALOGV("Video session %d is composed by the GPU", index);
+                // The next videos still go in the picture-in-picture window
+                if (plane == 0)
+                    plane++;
+                continue;
+            }
+            bypass = true;
+            plane++;
+        }
+    }
+    memcpy(mOverlays, overlays, sizeof(overlays));
+    int mode = mMode;
+    if (bypass)
+        setModeBitsLocked(MDS_OVERLAY_BYPASS);
+    else
+        clearModeBitsLocked(MDS_OVERLAY_BYPASS);
+    return mode != mMode;
 }
 
 #ifdef TARGET_HAS_ISV
@@ -682,18 +1772,26 @@ status_t MultiDisplayComposer::setVppState_l(
         ALOGV("Leaving %s, %d", __func__, mDisplayId);
     } else {
         ALOGI("%s: VPP setting changed, ready to broadcast message.", __func__);
-        mMode |= MDS_VPP_CHANGED;
-        broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE, &mMode, sizeof(mMode), false);
-        mMode &= ~MDS_VPP_CHANGED;
+        // One-shot event, only in the broadcast copy of the mode
+        int mode = mMode | MDS_VPP_CHANGED;
+        mVppPolicy = computeVppPolicy_l();
+        publishStateLocked();
+        broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE, &mode, sizeof(mode), false);
+        return NO_ERROR;
     }
+    publishStateLocked();
     return NO_ERROR;
 }
 
 uint32_t MultiDisplayComposer::getVppState() {
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    return getVppState_l();
+}
+
+uint32_t MultiDisplayComposer::getVppState_l() {
     bool ret = false;
     uint32_t vpp_status = 0;
 
-    Mutex::Autolock lock(mMutex);
     //TODO: only for WIDI now
     if (mDisplayId != MDS_DISPLAY_VIRTUAL)
         ret = VPPSetting::isVppOn(&vpp_status);
@@ -703,15 +1801,119 @@ uint32_t MultiDisplayComposer::getVppState() {
 
 status_t MultiDisplayComposer::setVppState(
         MDS_DISPLAY_ID dpyId, bool connected, int status) {
-    Mutex::Autolock lock(mMutex);
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
     ALOGV("%s:%d, %d, %d", __func__, __LINE__, dpyId, connected);
     return setVppState_l(dpyId, connected, status);
 }
+
+// Only the post processing which helps the output display is run
+uint32_t MultiDisplayComposer::computeVppPolicy_l() {
+    uint32_t status = 0;
+    // VPP is off in the settings, or WIDI, where it is disabled
+    if (mPlayingSessions == 0 || (mMode & MDS_WIDI_ON) ||
+            !VPPSetting::isVppOn(&status))
+        return MDS_VPP_NONE;
+    MDSVideoSourceInfo info;
+    if (mVideos[__builtin_ctz(mPlayingSessions)].getInfo(&info) != NO_ERROR)
+        return MDS_VPP_NONE;
+
+    uint32_t policy = MDS_VPP_NONE;
+    // Without it the output is wrong, so it is kept in power save
+    if (info.isInterlaced)
+        policy |= MDS_VPP_DEINTERLACE;
+    if (mPowerSave)
+        return policy;
+    bool external = (mMode & (MDS_HDMI_CONNECTED | MDS_DVI_CONNECTED)) != 0;
+    // The refresh rate of HDMI is matched to the content instead
+    if (!external && info.frameRate > 0 && info.frameRate <= 30)
+        policy |= MDS_VPP_FRC;
+    if (external && ((info.displayW > 0 && info.displayW < 1280) ||
+            (info.displayH > 0 && info.displayH < 720)))
+        policy |= MDS_VPP_SCALING;
+    return policy;
+}
+#endif
+
+// Returns true if the policy changed, the caller publishes the state
+bool MultiDisplayComposer::updateVppPolicy_l() {
+#ifdef TARGET_HAS_ISV
+    uint32_t policy = computeVppPolicy_l();
+    if (policy == mVppPolicy)
+        return false;
+    ALOGI("VPP policy 0x%x -> 0x%x", mVppPolicy, policy);
+    mVppPolicy = policy;
+    // One-shot event, only in the broadcast copy of the mode
+    int mode = mMode | MDS_VPP_CHANGED;
+    broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE, &mode, sizeof(mode), false);
+    return true;
+#else
+    return false;
+#endif
+}
+
+status_t MultiDisplayComposer::getStateSnapshot(MDSStateSnapshot* snapshot) {
+    if (snapshot == NULL)
+        return BAD_VALUE;
+    MultiDisplayAutolock lock(mMutex, sMutexWaitStats);
+    memset(snapshot, 0, sizeof(MDSStateSnapshot));
+    snapshot->mode = (MDS_DISPLAY_MODE)mMode;
+#ifdef TARGET_HAS_ISV
+    snapshot->vppState = getVppState_l();
+#endif
+    snapshot->vppPolicy = mVppPolicy;
+    memcpy(snapshot->overlays, mOverlays, sizeof(mOverlays));
+    int number = 0;
+    for (uint32_t active = mActiveSessions; active != 0; active &= active - 1) {
+        int i = __builtin_ctz(active);
+        MDS_VIDEO_STATE state = mVideos[i].getState();
+        MDSVideoSessionSnapshot* session = &snapshot->sessions[number++];
+        session->sessionId = i;
+        session->state = state;
+        // Same conditions as getVideoSourceInfo and getDecoderOutputResolution
+        session->infoValid = (state == MDS_VIDEO_PREPARED &&
+                mVideos[i].getInfo(&session->info) == NO_ERROR);
+        MDSDecoderConfig* config = &session->decoderConfig;
+        session->decoderConfigValid = (mVideos[i].getDecoderOutputResolution(
+                &config->width, &config->height, &config->offX, &config->offY,
+                &config->bufWidth, &config->bufHeight) == NO_ERROR);
+    }
+    snapshot->sessionNumber = number;
+    return NO_ERROR;
+}
+
+sp<IMemoryHeap> MultiDisplayComposer::getStatePage() {
+    return mStateHeap;
+}
+
+void MultiDisplayComposer::publishStateLocked() {
+    // Odd generation while the page is written, see MDSStatePage
+    int32_t generation = mStatePage->generation;
+    android_atomic_release_store(generation + 1, &mStatePage->generation);
+    android_memory_barrier();
+
+    mStatePage->mode = mMode;
+#ifdef TARGET_HAS_ISV
+    mStatePage->vppState = getVppState_l();
 #endif
+    mStatePage->vppPolicy = mVppPolicy;
+    memcpy(mStatePage->overlays, mOverlays, sizeof(mOverlays));
+    mStatePage->hdmi = mHdmiState;
+    mStatePage->sessionNumber = getVideoSessionSize_l();
+    for (int i = 0; i < MDS_VIDEO_SESSION_MAX_VALUE; i++) {
+        MDSVideoSessionState& session = mStatePage->sessions[i];
+        session.state = mVideos[i].getState();
+        session.idGeneration = mVideoGenerations[i];
+        session.infoValid = (mVideos[i].getInfo(&session.info) == NO_ERROR) ? 1 : 0;
+    }
+
+    android_atomic_release_store(generation + 2, &mStatePage->generation);
+}
 
 bool MultiDisplayComposer::checkHdmiTimingIsFixed() {
-    Mutex::Autolock lock(mMutex);
-    return drm_hdmi_timing_is_fixed();
+    int32_t fixed;
+    MultiDisplayStateReader::read(mStatePage, &fixed,
+            &mStatePage->hdmi.timingFixed, sizeof(fixed));
+    return fixed != 0;
 }
 
 }; // namespace intel
@@ -22,10 +22,14 @@
 #include <utils/String16.h>
 #include <utils/RefBase.h>
 #include <utils/Vector.h>
+#include <utils/threads.h>
+#include <binder/MemoryHeapBase.h>
+#include <cutils/atomic.h>
 #include <display/IMultiDisplayListener.h>
 #include <display/IMultiDisplayCallback.h>
 #include <display/IMultiDisplayInfoProvider.h>
 #include <display/MultiDisplayType.h>
+#include <display/MultiDisplayStatePage.h>
 
 namespace android {
 namespace intel {
@@ -39,12 +43,26 @@ enum {
     SFIntelPauseExternalDisplay
 };
 
+// A message waiting in the queue of a listener
+struct MultiDisplayMessage {
+    int             mMsg;
+    uint32_t        mSeq;
+    Vector<uint8_t> mValue;
+};
+
 class MultiDisplayListener {
 private:
     int      mMsg;
     int32_t  mId;
     String8* mName;
+    bool     mIsVideoDriver;
+    // Registered with MDS_MSG_FLAG_SYNC
+    bool     mSync;
+    // Sequence number of the last queued message
+    uint32_t mSeq;
     sp<IMultiDisplayListener> mListener;
+    // Messages not yet delivered, protected by the composer lock
+    Vector<MultiDisplayMessage> mQueue;
 public:
     MultiDisplayListener(int msg, int32_t id,
             const char* client, sp<IMultiDisplayListener>);
@@ -66,7 +84,17 @@ public:
     inline int32_t getId() {
         return mId;
     }
-    void dump();
+    inline bool isVideoDriver() {
+        return mIsVideoDriver;
+    }
+    inline bool isSync() {
+        return mSync;
+    }
+    inline bool hasMessage() {
+        return !mQueue.isEmpty();
+    }
+    void queueMessage(int msg, const void* value, int size);
+    void dequeueMessage(MultiDisplayMessage* message);
 };
 
 class MultiDisplayVideoSession {
@@ -79,10 +107,10 @@ private:
     int32_t             mDecoderConfigHeight;
     int32_t             mDecoderConfigOffX;
     int32_t             mDecoderConfigOffY;
-    int32_t             mDecoderConfigBufWidth;;
+    int32_t             mDecoderConfigBufWidth;
     int32_t             mDecoderConfigBufHeight;
-    // TODO: Only 1 decoder config is valid now
-    // May need support multiple decoder configs
+    // Each session keeps the last config its decoder set,
+    // the composer gives each one an overlay plane
     bool                mDecoderConfigValid;
 public:
 
@@ -145,7 +173,56 @@ public:
         mInfoValid = false;
         mDecoderConfigValid  = false;
     }
-    void dump(int index);
+};
+
+class MultiDisplayComposer;
+
+// Delivers the queued listener messages outside of the composer lock
+class MultiDisplayDispatcher : public Thread {
+private:
+    MultiDisplayComposer* mComposer;
+public:
+    MultiDisplayDispatcher(MultiDisplayComposer* composer)
+        : Thread(false), mComposer(composer) {}
+    virtual bool threadLoop();
+};
+
+// Handles the HDMI hotplugs and power stages, and forwards the phone call
+// and input states to HWC, outside of the binder threads
+class MultiDisplayHotplugWorker : public Thread {
+private:
+    MultiDisplayComposer* mComposer;
+public:
+    MultiDisplayHotplugWorker(MultiDisplayComposer* composer)
+        : Thread(false), mComposer(composer) {}
+    virtual bool threadLoop();
+};
+
+// Removes the listeners and the callback of the clients which die
+class MultiDisplayDeathRecipient : public IBinder::DeathRecipient {
+private:
+    wp<MultiDisplayComposer> mComposer;
+public:
+    MultiDisplayDeathRecipient(const wp<MultiDisplayComposer>& composer)
+        : mComposer(composer) {}
+    virtual void binderDied(const wp<IBinder>& who);
+};
+
+// Result of an asynchronous scaling request to the callback
+class MultiDisplayScalingCompletion : public MultiDisplayCompletion {
+private:
+    wp<MultiDisplayComposer> mComposer;
+    uint32_t mGeneration;
+    MDS_SCALING_TYPE mType;
+    int mHorizontalStep;
+    int mVerticalStep;
+public:
+    MultiDisplayScalingCompletion(const wp<MultiDisplayComposer>& composer,
+            uint32_t generation, MDS_SCALING_TYPE type, int hVal, int vVal)
+        : mComposer(composer), mGeneration(generation), mType(type),
+          mHorizontalStep(hVal), mVerticalStep(vVal) {}
+protected:
+    virtual void onComplete(status_t result);
 };
 
 class MultiDisplayComposer : public RefBase {
@@ -158,6 +235,7 @@ public:
     status_t updateVideoState(int, MDS_VIDEO_STATE);
     status_t resetVideoPlayback();
     status_t updateVideoSourceInfo(int, const MDSVideoSourceInfo&);
+    status_t updateVideoSession(int32_t*, MDS_VIDEO_STATE, const MDSVideoSourceInfo*);
 
     // Infomation provider
     int getVideoSessionNumber();
@@ -165,6 +243,7 @@ public:
     status_t getVideoSourceInfo(int, MDSVideoSourceInfo*);
     MDS_DISPLAY_MODE getDisplayMode(bool);
     uint32_t getVppState();
+    status_t getStateSnapshot(MDSStateSnapshot*);
 
     // Sink Registrar
     int32_t  registerListener(const sp<IMultiDisplayListener>&, const char*, int);
@@ -173,16 +252,20 @@ public:
     // Callback registrar
     status_t registerCallback(const sp<IMultiDisplayCallback>&);
     status_t unregisterCallback(const sp<IMultiDisplayCallback>&);
+    status_t shareDrmDevice(int fd);
 
     // Hdmi control
     status_t setHdmiTiming(const MDSHdmiTiming&);
     int getHdmiTimingCount();
     status_t getHdmiTimingList(int, MDSHdmiTiming**);
+    status_t getHdmiTimings(int32_t*, int32_t*, MDSHdmiTiming*, int32_t);
     status_t getCurrentHdmiTiming(MDSHdmiTiming*);
     status_t setHdmiTimingByIndex(int);
     int getCurrentHdmiTimingIndex();
     status_t setHdmiScalingType(MDS_SCALING_TYPE);
     status_t setHdmiOverscan(int, int);
+    status_t setHdmiScaling(MDS_SCALING_TYPE, int, int);
+    status_t setHdmiConfig(const MDSHdmiTiming&, MDS_SCALING_TYPE, int, int);
     bool checkHdmiTimingIsFixed();
 
     // Display connection state observer
@@ -192,6 +275,7 @@ public:
     // Event monitor
     status_t updateInputState(bool);
     status_t updatePhoneCallState(bool);
+    status_t updatePowerSaveState(bool);
 
     // Decoder configure
     status_t getDecoderOutputResolution(int, int32_t*, int32_t*, int32_t*, int32_t*, int32_t*, int32_t*);
@@ -202,12 +286,48 @@ public:
     status_t setVppState(MDS_DISPLAY_ID, bool, int);
 #endif
 
+    // Listener message dispatch, called by the dispatcher thread
+    bool dispatchMessage();
+
+    // HDMI hotplug and refresh rate matching, called by the hotplug worker thread
+    bool processHotplug();
+
+    // State page shared with the clients
+    sp<IMemoryHeap> getStatePage();
+
+    // A listener or the callback died
+    void binderDied(const wp<IBinder>& who);
+
+    // The callback completed a scaling request
+    void onHdmiScalingComplete(uint32_t generation,
+            MDS_SCALING_TYPE type, int hVal, int vVal, status_t result);
+
 private:
     // Assume it is impossible that there are up to 64 cocurrent running video driver
     static const int MDS_LISTENER_MAX_VALUE = (MDS_VIDEO_SESSION_MAX_VALUE * 4);
+    static const int MDS_LISTENER_ID_WORDS = (MDS_LISTENER_MAX_VALUE + 31) / 32;
+    // One bit per message type, @see MDS_MESSAGE
+    static const int MDS_MSG_TYPE_MAX = 32;
+    // A video session Id is (generation << MDS_VIDEO_SESSION_INDEX_BITS) | index,
+    // generation 0 stands for a bare index, @see getVideoSessionIndex_l
+    static const int MDS_VIDEO_SESSION_INDEX_BITS = 8;
+    static const int MDS_VIDEO_SESSION_GENERATION_MASK = 0x7fffff;
+    // Beyond it the overlay plane can't downscale the video
+    static const int MDS_OVERLAY_MAX_DOWNSCALE = 2;
+    // The picture-in-picture window is 1/MDS_OVERLAY_PIP_DIVISOR of the
+    // external display, MDS_OVERLAY_PIP_MARGIN off its bottom right corner
+    static const int MDS_OVERLAY_PIP_DIVISOR = 3;
+    static const int MDS_OVERLAY_PIP_MARGIN = 32;
+    // Power stages of the HDMI pipe mirroring an idle primary
+    static const int MDS_HDMI_POWER_ACTIVE      = 0;
+    static const int MDS_HDMI_POWER_LOW_REFRESH = 1;
+    static const int MDS_HDMI_POWER_PAUSED      = 2;
     bool     mDrmInit;
-    int      mMode;
+    // Only changed with mMutex held, read without it by getDisplayMode()
+    volatile int32_t mMode;
     mutable  Mutex mMutex;
+    // Protects the drm_hdmi state, taken before mMutex when both are held
+    mutable  Mutex mDrmMutex;
     uint32_t mHorizontalStep;
     uint32_t mVerticalStep;
 #ifdef TARGET_HAS_ISV
@@ -218,29 +338,168 @@ private:
     // else id = MDS_DISPLAY_PRIMARY
     MDS_DISPLAY_ID mDisplayId;
 #endif
+    // Thermal throttling or low battery, @see MDS_VPP_POLICY
+    bool     mPowerSave;
+    uint32_t mVppPolicy;
+    // Size of the HDMI timing, for the overlay bypass
+    int32_t  mExternalWidth;
+    int32_t  mExternalHeight;
+    MDSOverlayConfig mOverlays[MDS_OVERLAY_PLANE_MAX];
     MDS_SCALING_TYPE mScaleType;
+    // Bumped by each scaling request, only the last one is completed
+    uint32_t mScalingGeneration;
+    // Phone call and input states, -1 until the first update. They are
+    // flipped without any lock, and only the transitions wake the worker,
+    // which forwards the latest ones to HWC, the input state at most
+    // once per MDS_INPUT_STATE_INTERVAL.
+    volatile int32_t mPhoneCallState;
+    volatile int32_t mInputState;
+    bool    mPhoneCallPending;
+    bool    mInputPending;
+    // Owned by the worker: what HWC was last told, and when
+    int32_t mPhoneCallNotified;
+    int32_t mInputNotified;
+    nsecs_t mInputDeadline;
+    sp<IMultiDisplayCallback> mEventCallback;
+    // Next listener Id to try, and the Ids in use
     int32_t mListenerId;
+    uint32_t mListenerIdMap[MDS_LISTENER_ID_WORDS];
 
     sp<IBinder> mSurfaceComposer;
     sp<IMultiDisplayCallback> mMDSCallback;
 
     KeyedVector<int32_t, MultiDisplayListener* > mListeners;
+    // Listeners of each message type
+    Vector<MultiDisplayListener*> mMsgListeners[MDS_MSG_TYPE_MAX];
+    sp<MultiDisplayDeathRecipient> mDeathRecipient;
+    sp<MultiDisplayDispatcher> mDispatcher;
+    Condition mDispatchCond;
+    size_t mDispatchIndex;
+    bool mDispatchExit;
+    sp<MultiDisplayHotplugWorker> mHotplugWorker;
+    Condition mHotplugCond;
+    // Only the latest HDMI state is handled when hotplugs pile up
+    bool mHotplugPending;
+    bool mHotplugConnected;
+    // When the first of the pending hotplugs was notified
+    nsecs_t mHotplugTime;
+    bool mHotplugExit;
+    // Set once the HDMI connector is probed, read without any lock
+    volatile int32_t mHdmiProbed;
+    // HWC registered before the first probe, the worker does it
+    bool mHdmiProbePending;
+    // Refresh rate matching of the HDMI timing to a video session:
+    // the session, its frame rate, 0 to restore the timing, and whether
+    // the worker has to apply it
+    int  mRateMatchSession;
+    int  mRateMatchFps;
+    bool mRateMatchPending;
+    // The timing before the match, with mDrmMutex held
+    MDSHdmiTiming mRateMatchSavedTiming;
+    bool mRateMatchSavedValid;
+    // Power gating of the HDMI pipe while it mirrors an idle primary:
+    // since when it is idle, 0 if it is not, and the stage the worker
+    // has applied, @see setHdmiPowerStage
+    nsecs_t mHdmiIdleSince;
+    int     mHdmiPowerStage;
+    // The timing before the low refresh rate, with mDrmMutex held
+    MDSHdmiTiming mPowerSavedTiming;
+    bool mPowerSavedValid;
+    // The last audio hotplug sent to the driver, with mDrmMutex held
+    bool mHdmiAudioConnected;
+    // The timing the user set for the connected sink, and whether the
+    // worker has to keep it and the scaling in the profile of the sink
+    MDSHdmiTiming mUserTiming;
+    bool mUserTimingValid;
+    bool mProfilePending;
+    // The published state, which the read-only queries copy without
+    // any lock, so that they never wait for a hotplug or a mode set.
+    // mLocalState stands for the page if ashmem can't be allocated.
+    sp<MemoryHeapBase> mStateHeap;
+    MDSStatePage* mStatePage;
+    MDSStatePage  mLocalState;
+    // Taken from drm_hdmi with mDrmMutex held, published with mMutex held
+    MDSHdmiState  mHdmiState;
     MultiDisplayVideoSession mVideos[MDS_VIDEO_SESSION_MAX_VALUE];
+    // Sessions which are not UNPREPARED, PREPARED, and with a decoder config,
+    // kept by setVideoSessionState_l so that no lookup scans mVideos
+    uint32_t mActiveSessions;
+    uint32_t mPlayingSessions;
+    uint32_t mDecoderConfigSessions;
+    // Bumped when a session is released, so that its old Id goes stale
+    int32_t  mVideoGenerations[MDS_VIDEO_SESSION_MAX_VALUE];
+    // The content last sent to the Widi sinks, invalid while Widi is off
+    MDSVideoContentInfo mVideoContent;
+    bool mVideoContentValid;
 
     void init();
+    int  allocateVideoSessionId_l();
+    status_t updateVideoState_l(int, MDS_VIDEO_STATE);
+    status_t updateVideoSourceInfo_l(int, const MDSVideoSourceInfo&);
     void broadcastMessageLocked(int msg, void* value, int size, bool ignoreVideoDriver);
+    int32_t allocateListenerId_l();
+    void freeListenerId_l(int32_t id);
+    void removeListener_l(size_t index);
     status_t setDisplayScalingLocked(uint32_t mode, uint32_t stepx, uint32_t stepy);
+    status_t requestHdmiScaling(bool setType, MDS_SCALING_TYPE type,
+            bool setOverscan, int hVal, int vVal);
+    status_t completeHdmiScaling_l(MDS_SCALING_TYPE type, int hVal, int vVal, status_t result);
     status_t updateHdmiConnectStatusLocked();
+    int  probeHdmiConnectStatus_l();
+    void probeHdmiOnce();
+    void getHdmiState_l(MDSHdmiState* state);
+    void publishHdmiState_l();
+    void setHdmiConnectStatusLocked(int connectStatus);
     MultiDisplayVideoSession* getVideoSession_l(int sessionId);
+    int  getVideoSessionIndex_l(int sessionId);
+    int  readVideoSession(int sessionId, MDSVideoSessionState* session);
+    status_t setVideoSessionState_l(int index, MDS_VIDEO_STATE state);
     int  getVideoSessionSize_l();
     void initVideoSessions_l();
     bool hasVideoPlaying_l();
-    void dumpVideoSession_l();
     int  getValidDecoderConfigVideoSession_l();
     status_t notifyHotplugLocked(MDS_DISPLAY_ID, bool);
+    void handleHotplug(bool connected);
+    void saveHdmiProfile(bool userConfig);
+    void requestEvent(bool* pending);
+    void deliverEvents(const sp<IMultiDisplayCallback>& callback,
+            bool phoneCall, bool input);
+    void requestRateMatch_l(int index, MDS_VIDEO_STATE state);
+    void computeVideoContent_l(MDSVideoContentInfo* content);
+    void updateVideoContent_l();
+    void matchVideoRefreshRate(int fps);
+    void updateHdmiIdle_l();
+    int  getHdmiPowerStage_l(nsecs_t now, nsecs_t* deadline);
+    void setHdmiPowerStage(int stage);
+    void lowerHdmiRefreshRate_l(const sp<IMultiDisplayCallback>& callback);
+    void restoreHdmiRefreshRate_l(const sp<IMultiDisplayCallback>& callback);
+    status_t pauseExternalDisplayLocked(bool pause);
+    sp<IBinder> getSurfaceComposer_l();
+    status_t transactSurfaceComposer_l(uint32_t code, int32_t value);
 #ifdef TARGET_HAS_ISV
     status_t setVppState_l(MDS_DISPLAY_ID, bool, int);
+    uint32_t getVppState_l();
+    uint32_t computeVppPolicy_l();
 #endif
+    bool updateVppPolicy_l();
+    bool updateOverlayConfig_l();
+    bool computeOverlayConfig_l(int index, MDS_SCALING_TYPE type,
+            int32_t areaX, int32_t areaY, int32_t areaW, int32_t areaH,
+            MDSOverlayConfig* overlay);
+    int64_t getDecodedArea_l(int index);
+    void publishStateLocked();
+
+    inline void setModeBitsLocked(int bits) {
+        android_atomic_or(bits, &mMode);
+    }
+    inline void clearModeBitsLocked(int bits) {
+        android_atomic_and(~bits, &mMode);
+    }
+    inline void broadcastModeLocked(bool ignoreVideoDriver) {
+        int mode = mMode;
+        broadcastMessageLocked((int)MDS_MSG_MODE_CHANGE,
+                &mode, sizeof(mode), ignoreVideoDriver);
+    }
 
     inline bool checkMode(int value, int bit) {
         return (value & bit) == bit ? true : false;
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __MULTIDISPLAY_PARCEL_H__
+#define __MULTIDISPLAY_PARCEL_H__
+
+#include <string.h>
+#include <utils/Errors.h>
+#include <binder/Parcel.h>
+
+#include <display/MultiDisplayType.h>
+#include <display/IMultiDisplayInfoProvider.h>
+
+namespace android {
+namespace intel {
+
+/**
+ * Wire format of the MDS structs, independent of their C layout.
+ * A struct is a header, (MDS_PARCEL_VERSION << 16) | number of fields,
+ * followed by its fields as int32, without any padding. A later version
+ * may append fields, which an older reader skips. An array is the header
+ * of its struct and the count, followed by all the fields in one flat buffer.
+ */
+#define MDS_PARCEL_VERSION 1
+
+#define MDS_PARCEL_VIDEO_SOURCE_INFO_FIELDS 4
+#define MDS_PARCEL_HDMI_TIMING_FIELDS       6
+#define MDS_PARCEL_OVERLAY_CONFIG_FIELDS    9
+#define MDS_PARCEL_DECODER_CONFIG_FIELDS    6
+
+// Bits of the flags field of MDSVideoSourceInfo
+#define MDS_PARCEL_VIDEO_INTERLACED (1 << 0)
+#define MDS_PARCEL_VIDEO_PROTECTED  (1 << 1)
+
+inline void writeParcelHeader(Parcel* p, int32_t fields) {
+    p->writeInt32((MDS_PARCEL_VERSION << 16) | fields);
+}
+
+// The number of fields on the wire, at least the expected ones, or -1
+inline int32_t readParcelHeader(const Parcel& p, int32_t fields) {
+    int32_t header = p.readInt32();
+    if ((header >> 16) != MDS_PARCEL_VERSION || (header & 0xffff) < fields)
+        return -1;
+    return header & 0xffff;
+}
+
+inline status_t writeParcelFields(Parcel* p, const int32_t* fields, int32_t n) {
+    writeParcelHeader(p, n);
+    int32_t* dst = (int32_t*)p->writeInplace(n * sizeof(int32_t));
+    if (dst == NULL)
+        return NO_MEMORY;
+    memcpy(dst, fields, n * sizeof(int32_t));
+    return NO_ERROR;
+}
+
+inline status_t readParcelFields(const Parcel& p, int32_t* fields, int32_t n) {
+    int32_t wire = readParcelHeader(p, n);
+    if (wire < 0)
+        return BAD_VALUE;
+    const int32_t* src = (const int32_t*)p.readInplace(wire * sizeof(int32_t));
+    if (src == NULL)
+        return BAD_VALUE;
+    memcpy(fields, src, n * sizeof(int32_t));
+    return NO_ERROR;
+}
+
+inline void toParcelFields(const MDSVideoSourceInfo& info, int32_t* f) {
+    f[0] = info.frameRate;
+    f[1] = info.displayW;
+    f[2] = info.displayH;
+    f[3] = (info.isInterlaced ? MDS_PARCEL_VIDEO_INTERLACED : 0) |
+        (info.isProtected ? MDS_PARCEL_VIDEO_PROTECTED : 0);
+}
+
+inline void fromParcelFields(const int32_t* f, MDSVideoSourceInfo* info) {
+    info->frameRate    = f[0];
+    info->displayW     = f[1];
+    info->displayH     = f[2];
+    info->isInterlaced = (f[3] & MDS_PARCEL_VIDEO_INTERLACED) != 0;
+    info->isProtected  = (f[3] & MDS_PARCEL_VIDEO_PROTECTED) != 0;
+}
+
+inline void toParcelFields(const MDSHdmiTiming& timing, int32_t* f) {
+    f[0] = timing.width;
+    f[1] = timing.height;
+    f[2] = (int32_t)timing.refresh;
+    f[3] = timing.interlace;
+    f[4] = timing.ratio;
+    f[5] = (int32_t)timing.flags;
+}
+
+inline void fromParcelFields(const int32_t* f, MDSHdmiTiming* timing) {
+    timing->width     = f[0];
+    timing->height    = f[1];
+    timing->refresh   = (uint32_t)f[2];
+    timing->interlace = f[3];
+    timing->ratio     = f[4];
+    timing->flags     = (uint32_t)f[5];
+}
+
+inline void toParcelFields(const MDSOverlayConfig& overlay, int32_t* f) {
+    f[0] = overlay.sessionId;
+    f[1] = overlay.cropX;
+    f[2] = overlay.cropY;
+    f[3] = overlay.cropWidth;
+    f[4] = overlay.cropHeight;
+    f[5] = overlay.dstX;
+    f[6] = overlay.dstY;
+    f[7] = overlay.dstWidth;
+    f[8] = overlay.dstHeight;
+}
+
+inline void fromParcelFields(const int32_t* f, MDSOverlayConfig* overlay) {
+    overlay->sessionId  = f[0];
+    overlay->cropX      = f[1];
+    overlay->cropY      = f[2];
+    overlay->cropWidth  = f[3];
+    overlay->cropHeight = f[4];
+    overlay->dstX       = f[5];
+    overlay->dstY       = f[6];
+    overlay->dstWidth   = f[7];
+    overlay->dstHeight  = f[8];
+}
+
+inline void toParcelFields(const MDSDecoderConfig& config, int32_t* f) {
+    f[0] = config.width;
+    f[1] = config.height;
+    f[2] = config.offX;
+    f[3] = config.offY;
+    f[4] = config.bufWidth;
+    f[5] = config.bufHeight;
+}
+
+inline void fromParcelFields(const int32_t* f, MDSDecoderConfig* config) {
+    config->width     = f[0];
+    config->height    = f[1];
+    config->offX      = f[2];
+    config->offY      = f[3];
+    config->bufWidth  = f[4];
+    config->bufHeight = f[5];
+}
+
+inline status_t writeVideoSourceInfo(Parcel* p, const MDSVideoSourceInfo& info) {
+    int32_t f[MDS_PARCEL_VIDEO_SOURCE_INFO_FIELDS];
+    toParcelFields(info, f);
+    return writeParcelFields(p, f, MDS_PARCEL_VIDEO_SOURCE_INFO_FIELDS);
+}
+
+inline status_t readVideoSourceInfo(const Parcel& p, MDSVideoSourceInfo* info) {
+    int32_t f[MDS_PARCEL_VIDEO_SOURCE_INFO_FIELDS];
+    status_t result = readParcelFields(p, f, MDS_PARCEL_VIDEO_SOURCE_INFO_FIELDS);
+    if (result == NO_ERROR)
+        fromParcelFields(f, info);
+    return result;
+}
+
+inline status_t writeHdmiTiming(Parcel* p, const MDSHdmiTiming& timing) {
+    int32_t f[MDS_PARCEL_HDMI_TIMING_FIELDS];
+    toParcelFields(timing, f);
+    return writeParcelFields(p, f, MDS_PARCEL_HDMI_TIMING_FIELDS);
+}
+
+inline status_t readHdmiTiming(const Parcel& p, MDSHdmiTiming* timing) {
+    int32_t f[MDS_PARCEL_HDMI_TIMING_FIELDS];
+    status_t result = readParcelFields(p, f, MDS_PARCEL_HDMI_TIMING_FIELDS);
+    if (result == NO_ERROR)
+        fromParcelFields(f, timing);
+    return result;
+}
+
+inline status_t writeOverlayConfig(Parcel* p, const MDSOverlayConfig& overlay) {
+    int32_t f[MDS_PARCEL_OVERLAY_CONFIG_FIELDS];
+    toParcelFields(overlay, f);
+    return writeParcelFields(p, f, MDS_PARCEL_OVERLAY_CONFIG_FIELDS);
+}
+
+inline status_t readOverlayConfig(const Parcel& p, MDSOverlayConfig* overlay) {
+    int32_t f[MDS_PARCEL_OVERLAY_CONFIG_FIELDS];
+    status_t result = readParcelFields(p, f, MDS_PARCEL_OVERLAY_CONFIG_FIELDS);
+    if (result == NO_ERROR)
+        fromParcelFields(f, overlay);
+    return result;
+}
+
+inline status_t writeDecoderConfig(Parcel* p, const MDSDecoderConfig& config) {
+    int32_t f[MDS_PARCEL_DECODER_CONFIG_FIELDS];
+    toParcelFields(config, f);
+    return writeParcelFields(p, f, MDS_PARCEL_DECODER_CONFIG_FIELDS);
+}
+
+inline status_t readDecoderConfig(const Parcel& p, MDSDecoderConfig* config) {
+    int32_t f[MDS_PARCEL_DECODER_CONFIG_FIELDS];
+    status_t result = readParcelFields(p, f, MDS_PARCEL_DECODER_CONFIG_FIELDS);
+    if (result == NO_ERROR)
+        fromParcelFields(f, config);
+    return result;
+}
+
+// A whole timing list in one flat buffer
+inline status_t writeHdmiTimings(Parcel* p, const MDSHdmiTiming* list, int32_t count) {
+    writeParcelHeader(p, MDS_PARCEL_HDMI_TIMING_FIELDS);
+    p->writeInt32(count);
+    if (count <= 0)
+        return NO_ERROR;
+    int32_t* dst = (int32_t*)p->writeInplace(
+            count * MDS_PARCEL_HDMI_TIMING_FIELDS * sizeof(int32_t));
+    if (dst == NULL)
+        return NO_MEMORY;
+    for (int32_t i = 0; i < count; i++)
+        toParcelFields(list[i], dst + i * MDS_PARCEL_HDMI_TIMING_FIELDS);
+    return NO_ERROR;
+}
+
+inline status_t readHdmiTimings(const Parcel& p,
+        MDSHdmiTiming* list, int32_t max, int32_t* count) {
+    int32_t wire = readParcelHeader(p, MDS_PARCEL_HDMI_TIMING_FIELDS);
+    int32_t number = p.readInt32();
+    if (wire < 0 || number < 0 || number > max)
+        return BAD_VALUE;
+    *count = number;
+    if (number == 0)
+        return NO_ERROR;
+    const int32_t* src = (const int32_t*)p.readInplace(
+            number * wire * sizeof(int32_t));
+    if (src == NULL)
+        return BAD_VALUE;
+    for (int32_t i = 0; i < number; i++)
+        fromParcelFields(src + i * wire, &list[i]);
+    return NO_ERROR;
+}
+
+}; // namespace intel
+}; // namespace android
+
+#endif
@@ -17,6 +17,7 @@
  */
 
 //#define LOG_NDEBUG 0
+#include <unistd.h>
 #include <utils/Log.h>
 #include <utils/Errors.h>
 
@@ -25,6 +26,7 @@
 
 #include <display/MultiDisplayService.h>
 #include "MultiDisplayComposer.h"
+#include "MultiDisplayStats.h"
 
 namespace android {
 namespace intel {
@@ -39,38 +41,50 @@ do { \
 } while(0)
 
 #define IMPLEMENT_API_0(CLASS, OBJECT, INTERFACE, RETURN, ERR)               \
+    static MultiDisplayCallStats s##CLASS##_##INTERFACE(#INTERFACE); \
     RETURN CLASS::INTERFACE() {                         \
         MDC_CHECK_OBJECT(OBJECT, ERR);                                         \
+        MultiDisplayCallTrace trace(s##CLASS##_##INTERFACE);                   \
         return OBJECT->INTERFACE();                            \
     }
 
 #define IMPLEMENT_API_1(CLASS, OBJECT, INTERFACE, PARAM0, RETURN, ERR)       \
+    static MultiDisplayCallStats s##CLASS##_##INTERFACE(#INTERFACE); \
     RETURN CLASS::INTERFACE(PARAM0 p0) {                \
         MDC_CHECK_OBJECT(OBJECT, ERR);                                         \
+        MultiDisplayCallTrace trace(s##CLASS##_##INTERFACE);                   \
         return OBJECT->INTERFACE(p0);                          \
     }
 
 #define IMPLEMENT_API_2(CLASS, OBJECT, INTERFACE, PARAM0, PARAM1, RETURN, ERR)          \
+    static MultiDisplayCallStats s##CLASS##_##INTERFACE(#INTERFACE); \
     RETURN CLASS::INTERFACE(PARAM0 p0, PARAM1 p1) {                \
         MDC_CHECK_OBJECT(OBJECT, ERR);                                                    \
+        MultiDisplayCallTrace trace(s##CLASS##_##INTERFACE);                              \
         return OBJECT->INTERFACE(p0, p1);                                 \
     }
 
 #define IMPLEMENT_API_3(CLASS, OBJECT, INTERFACE, PARAM0, PARAM1, PARAM2, RETURN, ERR)  \
+    static MultiDisplayCallStats s##CLASS##_##INTERFACE(#INTERFACE); \
     RETURN CLASS::INTERFACE(PARAM0 p0, PARAM1 p1, PARAM2 p2) {     \
         MDC_CHECK_OBJECT(OBJECT, ERR);                                                    \
+        MultiDisplayCallTrace trace(s##CLASS##_##INTERFACE);                              \
         return OBJECT->INTERFACE(p0, p1, p2);                             \
     }
 
 #define IMPLEMENT_API_4(CLASS, OBJECT, INTERFACE, PARAM0, PARAM1, PARAM2, PARAM3, RETURN, ERR)  \
+    static MultiDisplayCallStats s##CLASS##_##INTERFACE(#INTERFACE);          \
     RETURN CLASS::INTERFACE(PARAM0 p0, PARAM1 p1, PARAM2 p2, PARAM3 p3) {     \
         MDC_CHECK_OBJECT(OBJECT, ERR);                                                    \
+        MultiDisplayCallTrace trace(s##CLASS##_##INTERFACE);                              \
         return OBJECT->INTERFACE(p0, p1, p2, p3);                             \
     }
 
 #define IMPLEMENT_API_7(CLASS, OBJECT, INTERFACE, PARAM0, PARAM1, PARAM2, PARAM3, PARAM4, PARAM5, PARAM6, RETURN, ERR)  \
+    static MultiDisplayCallStats s##CLASS##_##INTERFACE(#INTERFACE);                                           \
     RETURN CLASS::INTERFACE(PARAM0 p0, PARAM1 p1, PARAM2 p2, PARAM3 p3, PARAM4 p4, PARAM5 p5, PARAM6 p6) {     \
         MDC_CHECK_OBJECT(OBJECT, ERR);                                                    \
+        MultiDisplayCallTrace trace(s##CLASS##_##INTERFACE);                              \
         return OBJECT->INTERFACE(p0, p1, p2, p3, p4, p5, p6);                             \
     }
 
@@ -84,10 +98,13 @@ public:
     int getHdmiTimingCount();
     status_t setHdmiTiming(const MDSHdmiTiming&);
     status_t getHdmiTimingList(int, MDSHdmiTiming**);
+    status_t getHdmiTimings(int32_t*, int32_t*, MDSHdmiTiming*, int32_t);
     status_t getCurrentHdmiTiming(MDSHdmiTiming*);
     status_t setHdmiTimingByIndex(int);
     status_t setHdmiScalingType(MDS_SCALING_TYPE);
     status_t setHdmiOverscan(int, int);
+    status_t setHdmiScaling(MDS_SCALING_TYPE, int, int);
+    status_t setHdmiConfig(const MDSHdmiTiming&, MDS_SCALING_TYPE, int, int);
     bool checkHdmiTimingIsFixed();
     static sp<MultiDisplayHdmiControlImpl> getInstance() {
         return sHdmiInstance;
@@ -110,7 +127,10 @@ IMPLEMENT_API_1(MultiDisplayHdmiControlImpl, pCom, getCurrentHdmiTiming, MDSHdmi
 IMPLEMENT_API_1(MultiDisplayHdmiControlImpl, pCom, setHdmiScalingType, MDS_SCALING_TYPE, status_t, NO_INIT)
 IMPLEMENT_API_1(MultiDisplayHdmiControlImpl, pCom, setHdmiTimingByIndex, int, status_t, NO_INIT)
 IMPLEMENT_API_2(MultiDisplayHdmiControlImpl, pCom, setHdmiOverscan, int, int, status_t, NO_INIT)
+IMPLEMENT_API_3(MultiDisplayHdmiControlImpl, pCom, setHdmiScaling, MDS_SCALING_TYPE, int, int, status_t, NO_INIT)
 IMPLEMENT_API_2(MultiDisplayHdmiControlImpl, pCom, getHdmiTimingList, int, MDSHdmiTiming**, status_t, NO_INIT)
+IMPLEMENT_API_4(MultiDisplayHdmiControlImpl, pCom, getHdmiTimings, int32_t*, int32_t*, MDSHdmiTiming*, int32_t, status_t, NO_INIT)
+IMPLEMENT_API_4(MultiDisplayHdmiControlImpl, pCom, setHdmiConfig, const MDSHdmiTiming&, MDS_SCALING_TYPE, int, int, status_t, NO_INIT)
 
 // singleton
 class MultiDisplayVideoControlImpl : public BnMultiDisplayVideoControl {
@@ -123,6 +143,7 @@ public:
     status_t updateVideoState(int, MDS_VIDEO_STATE);
     status_t resetVideoPlayback();
     status_t updateVideoSourceInfo(int, const MDSVideoSourceInfo&);
+    status_t updateVideoSession(int32_t*, MDS_VIDEO_STATE, const MDSVideoSourceInfo*);
     static sp<MultiDisplayVideoControlImpl> getInstance() {
         return sVideoInstance;
     }
@@ -140,6 +161,7 @@ IMPLEMENT_API_0(MultiDisplayVideoControlImpl, pCom, resetVideoPlayback, status_t
 IMPLEMENT_API_0(MultiDisplayVideoControlImpl, pCom, allocateVideoSessionId, int, -1)
 IMPLEMENT_API_2(MultiDisplayVideoControlImpl, pCom, updateVideoState, int, MDS_VIDEO_STATE, status_t, NO_INIT)
 IMPLEMENT_API_2(MultiDisplayVideoControlImpl, pCom, updateVideoSourceInfo, int, const MDSVideoSourceInfo&, status_t, NO_INIT)
+IMPLEMENT_API_3(MultiDisplayVideoControlImpl, pCom, updateVideoSession, int32_t*, MDS_VIDEO_STATE, const MDSVideoSourceInfo*, status_t, NO_INIT)
 
 
 class MultiDisplaySinkRegistrarImpl : public BnMultiDisplaySinkRegistrar {
@@ -176,6 +198,7 @@ public:
     MultiDisplayCallbackRegistrarImpl(const sp<MultiDisplayComposer>& com);
     status_t registerCallback(const sp<IMultiDisplayCallback>&);
     status_t unregisterCallback(const sp<IMultiDisplayCallback>&);
+    status_t shareDrmDevice(int);
     static sp<MultiDisplayCallbackRegistrarImpl> getInstance() {
         return sCbInstance;
     }
@@ -192,6 +215,7 @@ MultiDisplayCallbackRegistrarImpl::MultiDisplayCallbackRegistrarImpl(const sp<Mu
 
 IMPLEMENT_API_1(MultiDisplayCallbackRegistrarImpl, pCom, registerCallback,   const sp<IMultiDisplayCallback>&, status_t, NO_INIT)
 IMPLEMENT_API_1(MultiDisplayCallbackRegistrarImpl, pCom, unregisterCallback, const sp<IMultiDisplayCallback>&, status_t, NO_INIT)
+IMPLEMENT_API_1(MultiDisplayCallbackRegistrarImpl, pCom, shareDrmDevice,     int, status_t, NO_INIT)
 
 class MultiDisplayInfoProviderImpl : public BnMultiDisplayInfoProvider {
 private:
@@ -205,6 +229,8 @@ public:
     MDS_DISPLAY_MODE getDisplayMode(bool);
     status_t getVideoSourceInfo(int, MDSVideoSourceInfo*);
     status_t getDecoderOutputResolution(int, int32_t* width, int32_t* height, int32_t* offX, int32_t* offY, int32_t* bufW, int32_t* bufH);
+    sp<IMemoryHeap> getStatePage();
+    status_t getStateSnapshot(MDSStateSnapshot*);
     static sp<MultiDisplayInfoProviderImpl> getInstance() {
         return sInfoInstance;
     }
@@ -220,6 +246,8 @@ MultiDisplayInfoProviderImpl::MultiDisplayInfoProviderImpl(const sp<MultiDisplay
 
 IMPLEMENT_API_0(MultiDisplayInfoProviderImpl, pCom, getVideoSessionNumber, int, 0)
 IMPLEMENT_API_0(MultiDisplayInfoProviderImpl, pCom, getVppState, uint32_t, false)
+IMPLEMENT_API_0(MultiDisplayInfoProviderImpl, pCom, getStatePage, sp<IMemoryHeap>, NULL)
+IMPLEMENT_API_1(MultiDisplayInfoProviderImpl, pCom, getStateSnapshot, MDSStateSnapshot*, status_t, NO_INIT)
 IMPLEMENT_API_1(MultiDisplayInfoProviderImpl, pCom, getVideoState, int,  MDS_VIDEO_STATE, MDS_VIDEO_STATE_UNKNOWN)
 IMPLEMENT_API_1(MultiDisplayInfoProviderImpl, pCom, getDisplayMode, bool, MDS_DISPLAY_MODE,  MDS_MODE_NONE)
 IMPLEMENT_API_2(MultiDisplayInfoProviderImpl, pCom, getVideoSourceInfo, int,  MDSVideoSourceInfo*, status_t, NO_INIT)
@@ -233,6 +261,7 @@ public:
     MultiDisplayEventMonitorImpl(const sp<MultiDisplayComposer>& com);
     status_t updatePhoneCallState(bool);
     status_t updateInputState(bool);
+    status_t updatePowerSaveState(bool);
     static sp<MultiDisplayEventMonitorImpl> getInstance() {
         return sEventInstance;
     }
@@ -248,6 +277,7 @@ MultiDisplayEventMonitorImpl::MultiDisplayEventMonitorImpl(const sp<MultiDisplay
 
 IMPLEMENT_API_1(MultiDisplayEventMonitorImpl, pCom, updatePhoneCallState,  bool,  status_t, NO_INIT)
 IMPLEMENT_API_1(MultiDisplayEventMonitorImpl, pCom, updateInputState,      bool,  status_t, NO_INIT)
+IMPLEMENT_API_1(MultiDisplayEventMonitorImpl, pCom, updatePowerSaveState,  bool,  status_t, NO_INIT)
 
 class MultiDisplayConnectionObserverImpl : public BnMultiDisplayConnectionObserver {
 private:
@@ -526,6 +556,42 @@ void MultiDisplayService::instantiate() {
         ALOGE("Failed to start %s service", INTEL_MDS_SERVICE_NAME);
 }
 
+#ifdef PGO_INSTRUMENT
+extern "C" void __gcov_flush(void);
+#endif
+
+status_t MultiDisplayService::dump(int fd, const Vector<String16>& args) {
+    String8 result;
+    if (!checkCallingPermission(String16("android.permission.DUMP"))) {
+        result.appendFormat("Permission Denial: can't dump %s from pid=%d, uid=%d\n",
+                INTEL_MDS_SERVICE_NAME,
+                IPCThreadState::self()->getCallingPid(),
+                IPCThreadState::self()->getCallingUid());
+        write(fd, result.string(), result.length());
+        return NO_ERROR;
+    }
+    result.appendFormat("%s:\n", INTEL_MDS_SERVICE_NAME);
+    MultiDisplayCallStats::dumpAll(result);
+    MultiDisplayEventLog::dumpAll(result);
+    for (size_t i = 0; i < args.size(); i++) {
+        if (String8(args[i]) == "reset") {
+            MultiDisplayCallStats::resetAll();
+            result.append("  reset\n");
+            break;
+        }
+#ifdef PGO_INSTRUMENT
+        // The service never exits, its profile is written on demand
+        if (String8(args[i]) == "pgo-flush") {
+            __gcov_flush();
+            result.append("  profile written\n");
+            break;
+        }
+#endif
+    }
+    write(fd, result.string(), result.length());
+    return NO_ERROR;
+}
+
 sp<IMultiDisplayHdmiControl> MultiDisplayService::getHdmiControl() {
 	return MultiDisplayHdmiControlImpl::getInstance();
 }
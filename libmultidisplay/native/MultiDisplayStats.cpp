@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <cutils/atomic.h>
+
+#include "MultiDisplayStats.h"
+#include "device_metrics.h"
+
+namespace android {
+namespace intel {
+
+// Zero initialized before any static constructor runs
+MultiDisplayCallStats* MultiDisplayCallStats::sHead = NULL;
+
+static pthread_once_t sMetricsOnce = PTHREAD_ONCE_INIT;
+static struct device_metrics* sMetrics = NULL;
+
+static void mapMetrics() {
+    sMetrics = device_metrics_map("mds");
+}
+
+MultiDisplayCallStats::MultiDisplayCallStats(const char* name)
+    : mName(name), mCount(0), mMaxUs(0), mTotalNs(0),
+      mMetric(NULL), mMetricChecked(0) {
+    memset((void*)mBuckets, 0, sizeof(mBuckets));
+    // Static instances are constructed before any binder thread runs
+    mNext = sHead;
+    sHead = this;
+}
+
+struct device_metric* MultiDisplayCallStats::getMetric() {
+    if (android_atomic_acquire_load(&mMetricChecked))
+        return mMetric;
+    // Registering twice from 2 threads returns the same metric
+    pthread_once(&sMetricsOnce, mapMetrics);
+    mMetric = device_metrics_get(sMetrics, mName, DEVICE_METRIC_HISTOGRAM);
+    android_atomic_release_store(1, &mMetricChecked);
+    return mMetric;
+}
+
+void MultiDisplayCallStats::record(nsecs_t latency) {
+    int32_t us = (int32_t)(latency / 1000);
+    int bucket = 0;
+    if (us > 0) {
+        bucket = 32 - __builtin_clz(us);
+        if (bucket >= MDS_STATS_BUCKETS)
+            bucket = MDS_STATS_BUCKETS - 1;
+    }
+    android_atomic_inc(&mCount);
+    android_atomic_inc(&mBuckets[bucket]);
+    __sync_fetch_and_add(&mTotalNs, latency);
+    int32_t max = mMaxUs;
+    while (us > max) {
+        if (android_atomic_cmpxchg(max, us, &mMaxUs) == 0)
+            break;
+        max = mMaxUs;
+    }
+    device_metric_observe(getMetric(), us);
+}
+
+void MultiDisplayCallStats::reset() {
+    android_atomic_release_store(0, &mCount);
+    android_atomic_release_store(0, &mMaxUs);
+    __sync_lock_test_and_set(&mTotalNs, 0);
+    for (int i = 0; i < MDS_STATS_BUCKETS; i++)
+        android_atomic_release_store(0, &mBuckets[i]);
+}
+
+void MultiDisplayCallStats::dumpAll(String8& result) {
+    result.append("  name: count, avg(us), max(us), histogram(us <= limit: count)\n");
+    for (MultiDisplayCallStats* s = sHead; s != NULL; s = s->mNext) {
+        int32_t count = s->mCount;
+        if (count == 0)
+            continue;
+        result.appendFormat("  %s: %d, %lld, %d,", s->mName, count,
+                (long long)(s->mTotalNs / count / 1000), s->mMaxUs);
+        for (int i = 0; i < MDS_STATS_BUCKETS; i++) {
+            if (s->mBuckets[i] == 0)
+                continue;
+            if (i == MDS_STATS_BUCKETS - 1)
+                result.appendFormat(" >%d: %d", (1 << (i - 1)) - 1, s->mBuckets[i]);
+            else
+                result.appendFormat(" %d: %d", (1 << i) - 1, s->mBuckets[i]);
+        }
+        result.append("\n");
+    }
+}
+
+void MultiDisplayCallStats::resetAll() {
+    for (MultiDisplayCallStats* s = sHead; s != NULL; s = s->mNext)
+        s->reset();
+}
+
+volatile int32_t MultiDisplayEventLog::sNext = 0;
+MultiDisplayEventLog::Entry MultiDisplayEventLog::sEntries[MDS_EVENT_LOG_SIZE];
+
+static const char* sEventNames[MDS_EVENT_TYPE_MAX] = {
+    "broadcast",
+    "video state",
+    "video info",
+    "decoder config",
+    "listener add",
+    "listener remove",
+    "hotplug",
+    "scaling",
+};
+
+void MultiDisplayEventLog::record(MDS_EVENT_TYPE type,
+        int32_t session, int32_t mode, int32_t value) {
+    int32_t seq = android_atomic_inc(&sNext);
+    Entry& entry = sEntries[seq & (MDS_EVENT_LOG_SIZE - 1)];
+    android_atomic_release_store(0, &entry.seq);
+    entry.type = (int16_t)type;
+    entry.session = (int16_t)session;
+    entry.mode = mode;
+    entry.value = value;
+    entry.time = systemTime();
+    android_atomic_release_store(seq + 1, &entry.seq);
+}
+
+void MultiDisplayEventLog::dumpAll(String8& result) {
+    int32_t next = android_atomic_acquire_load(&sNext);
+    int32_t first = (next > MDS_EVENT_LOG_SIZE) ? next - MDS_EVENT_LOG_SIZE : 0;
+    nsecs_t now = systemTime();
+    result.append("  events: ms ago, event, session, mode, value\n");
+    for (int32_t seq = first; seq < next; seq++) {
+        const Entry& entry = sEntries[seq & (MDS_EVENT_LOG_SIZE - 1)];
+        if (android_atomic_acquire_load(&entry.seq) != seq + 1)
+            continue;
+        Entry copy = entry;
+        android_memory_barrier();
+        if (android_atomic_acquire_load(&entry.seq) != seq + 1 ||
+                copy.type < 0 || copy.type >= MDS_EVENT_TYPE_MAX)
+            continue;
+        result.appendFormat("  %lld, %s, %d, 0x%x, %d\n",
+                (long long)((now - copy.time) / 1000000), sEventNames[copy.type],
+                copy.session, copy.mode, copy.value);
+    }
+}
+
+}; // namespace intel
+}; // namespace android
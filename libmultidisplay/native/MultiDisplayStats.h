@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __MULTIDISPLAY_STATS_H__
+#define __MULTIDISPLAY_STATS_H__
+
+#ifndef ATRACE_TAG
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#endif
+
+#include <utils/Timers.h>
+#include <utils/Trace.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+
+struct device_metric;
+
+namespace android {
+namespace intel {
+
+// Buckets of log2(latency in us): <1us, <2us, <4us, ..., >=16ms
+#define MDS_STATS_BUCKETS 16
+
+/**
+ * @brief Call counter and latency histogram of one MDS API or lock,
+ * updated without any lock. The instances are static, they register
+ * themselves in a global list at load time, which dumpAll walks.
+ * The latencies are also published in the "mds" device metrics.
+ */
+class MultiDisplayCallStats {
+private:
+    const char*            mName;
+    volatile int32_t       mCount;
+    volatile int32_t       mMaxUs;
+    volatile int64_t       mTotalNs;
+    volatile int32_t       mBuckets[MDS_STATS_BUCKETS];
+    // Registered by the first record, NULL if there are no device metrics
+    struct device_metric*  mMetric;
+    volatile int32_t       mMetricChecked;
+    MultiDisplayCallStats* mNext;
+    static MultiDisplayCallStats* sHead;
+    struct device_metric* getMetric();
+public:
+    explicit MultiDisplayCallStats(const char* name);
+    inline const char* getName() const {
+        return mName;
+    }
+    void record(nsecs_t latency);
+    void reset();
+    static void dumpAll(String8& result);
+    static void resetAll();
+};
+
+// Entries of the event log, a power of 2
+#define MDS_EVENT_LOG_SIZE 256
+
+/** @brief Composer events kept in the event log */
+typedef enum {
+    MDS_EVENT_BROADCAST = 0,   /**< value: the message */
+    MDS_EVENT_VIDEO_STATE,     /**< value: @see MDS_VIDEO_STATE */
+    MDS_EVENT_VIDEO_INFO,      /**< value: the frame rate */
+    MDS_EVENT_DECODER_CONFIG,  /**< value: the decoder output width */
+    MDS_EVENT_LISTENER_ADD,    /**< session: the listener Id, value: its messages */
+    MDS_EVENT_LISTENER_REMOVE, /**< session: the listener Id, value: its messages */
+    MDS_EVENT_HOTPLUG,         /**< value: 1 if connected */
+    MDS_EVENT_SCALING,         /**< value: the result, the scaling type in session */
+    MDS_EVENT_TYPE_MAX,
+} MDS_EVENT_TYPE;
+
+/**
+ * @brief History of the composer events, for the field issues.
+ * An event is a few words stored in a fixed ring without any lock or
+ * formatting, only dumpAll formats them. An entry which is being
+ * overwritten while it is dumped is skipped.
+ */
+class MultiDisplayEventLog {
+private:
+    struct Entry {
+        volatile int32_t seq;   // sequence + 1 once written, 0 while writing
+        int16_t          type;
+        int16_t          session;
+        int32_t          mode;
+        int32_t          value;
+        nsecs_t          time;
+    };
+    static volatile int32_t sNext;
+    static Entry            sEntries[MDS_EVENT_LOG_SIZE];
+public:
+    static void record(MDS_EVENT_TYPE type, int32_t session, int32_t mode, int32_t value);
+    static void dumpAll(String8& result);
+};
+
+/** @brief Records the time of a scope, and brackets it in systrace */
+class MultiDisplayCallTrace {
+private:
+    MultiDisplayCallStats& mStats;
+    nsecs_t                mStart;
+public:
+    explicit MultiDisplayCallTrace(MultiDisplayCallStats& stats)
+        : mStats(stats), mStart(systemTime()) {
+        ATRACE_BEGIN(stats.getName());
+    }
+    ~MultiDisplayCallTrace() {
+        ATRACE_END();
+        mStats.record(systemTime() - mStart);
+    }
+};
+
+/**
+ * @brief Same as Mutex::Autolock, recording how long the lock was waited for.
+ * An uncontended lock is recorded as a 0 wait without reading the clock.
+ */
+class MultiDisplayAutolock {
+private:
+    Mutex& mLock;
+public:
+    MultiDisplayAutolock(Mutex& mutex, MultiDisplayCallStats& stats)
+        : mLock(mutex) {
+        if (mLock.tryLock() == NO_ERROR) {
+            stats.record(0);
+            return;
+        }
+        ATRACE_BEGIN(stats.getName());
+        nsecs_t start = systemTime();
+        mLock.lock();
+        stats.record(systemTime() - start);
+        ATRACE_END();
+    }
+    ~MultiDisplayAutolock() {
+        mLock.unlock();
+    }
+};
+
+}; // namespace intel
+}; // namespace android
+
+#endif
@@ -22,6 +22,8 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <string.h>
 #include <utils/Vector.h>
 #ifndef VPG_DRM
@@ -30,76 +32,133 @@
 #include "drm_hdmi.h"
 #include "xf86drm.h"
 #include "xf86drmMode.h"
+#include "drm_connector.h"
+#include "MultiDisplayStats.h"
 
 namespace android {
 namespace intel {
 
 
 #define EDID_PRODUCT_INFO_LEN   8
+#define EDID_CACHE_MAX          4
 #define PREFERRED_VREFRESH      60  // 60Hz
 #define DRM_DEVICE_NAME         "/dev/card0"
+// The EDID cache, kept across reboots
+#define HDMI_PROFILE_PATH       "/data/system/mds_hdmi_sinks"
+#define HDMI_PROFILE_MAGIC      (0x4d445348) // "MDSH"
+#define HDMI_PROFILE_VERSION    (1)
 
+// Hotplug stages in DRM, reading the connector and parsing a new sink
+static MultiDisplayCallStats sConnectorStats("hotplug drm connector");
+static MultiDisplayCallStats sNewSinkStats("hotplug drm new sink");
 
 typedef struct _drmContext {
+    // Opened at the first HDMI access, or shared by HWC, -1 until then
     int  drmFD;
     bool hdmiSupported;
+    // hdmiSupported is only known once the device is open
+    bool supportChecked;
     //bool newDevice;
     bool connected;
     int  preferredModeIndex;
     // The position of user selcected timing in Hdmi timings backup
     // and indicate user has selected a special timing
     int  selectedModeIndex;
-#if 0 // Don't keep prevoius device EDID
-    char productInfo[EDID_PRODUCT_INFO_LEN];
-#endif
+    // Audio capability of the connected sink
+    bool audioSupported;
+    // Parsed with the EDID, formats is 0 if it is not known
+    MDSHdmiAudioCaps audioCaps;
+    // Entry of the connected sink in the EDID cache, or -1
+    int  edidCacheIndex;
+    // Ranked by scoreHdmiTiming, the best first
     Vector<MDSHdmiTiming*> hdmiTimings;
+    // The first timing of the same resolution and scan, and the next one,
+    // or -1, @see groupHdmiTimings
+    int  refreshHead[HDMI_TIMING_MAX];
+    int  refreshNext[HDMI_TIMING_MAX];
+    // Changed with hdmiTimings, @see drm_hdmi_getTimingVersion
+    int32_t timingVersion;
     drmModeConnectorPtr hdmiConnector;
+    // Found once, the connectors and properties of a device don't change
+    uint32_t hdmiConnectorId;
+    uint32_t edidPropId;
+    // Connection status, only probed again after a hotplug
+    bool statusValid;
+    int  connectStatus;
 } drmContext;
 
 static drmContext gDrmCxt;
 
-static drmModeConnector* getConnector(int fd, uint32_t connector_type)
+// What is parsed from the EDID of a sink, so reconnecting it skips parsing
+typedef struct _edidCacheEntry {
+    bool valid;
+    // manufacturer, product code and serial number
+    char productInfo[EDID_PRODUCT_INFO_LEN];
+    // checksums of the base block and of the extension block
+    char checksum[2];
+    int  connectStatus;
+    bool audioSupported;
+    MDSHdmiAudioCaps audioCaps;
+    int  preferredModeIndex;
+    int  timingNumber;
+    MDSHdmiTiming timings[HDMI_TIMING_MAX];
+    // What the user chose for the sink: the timing, or -1, the scaling
+    // type and the overscan steps
+    int  selectedModeIndex;
+    int  scaleType;
+    int  horizontalStep;
+    int  verticalStep;
+} edidCacheEntry;
+
+static edidCacheEntry gEdidCache[EDID_CACHE_MAX];
+static int gEdidCacheNext = 0;
+
+// The file of the EDID cache, @see loadHdmiProfiles
+typedef struct _hdmiProfileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entrySize;
+    int32_t  next;
+} hdmiProfileHeader;
+
+// Read once, at the first probe, and changed since it was saved
+static bool gProfilesLoaded = false;
+static bool gProfilesDirty = false;
+
+static uint32_t getHdmiConnectorId()
 {
-    ALOGV("Entering %s, %d", __func__, connector_type);
-    drmModeRes *resources = drmModeGetResources(fd);
-    drmModeConnector *connector = NULL;
-    int i;
+    if (gDrmCxt.hdmiConnectorId == 0) {
+#ifndef VPG_DRM
+        gDrmCxt.hdmiConnectorId = drm_find_connector_id(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_DVID);
+#else
+        gDrmCxt.hdmiConnectorId = drm_find_connector_id(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_HDMIA);
+        if (gDrmCxt.hdmiConnectorId == 0)
+            gDrmCxt.hdmiConnectorId = drm_find_connector_id(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_HDMIB);
+#endif
+    }
+    return gDrmCxt.hdmiConnectorId;
+}
 
-    if (resources == NULL || resources->connectors == NULL) {
-        ALOGE("%s: drmModeGetResources failed.", __func__);
+// Only the HDMI connector is probed, by its cached Id
+static drmModeConnector* getConnector()
+{
+    uint32_t id = getHdmiConnectorId();
+    if (id == 0) {
+        ALOGE("%s: Failed to get conector", __func__);
         return NULL;
     }
-    for (i = 0; i < resources->count_connectors; i++) {
-        connector = drmModeGetConnector(fd, resources->connectors[i]);
-        if (connector == NULL)
-            continue;
-        if (connector->count_modes <= 0)
-            continue;
-        if (connector->connector_type == connector_type)
-            break;
-
+    drmModeConnector *connector = drmModeGetConnector(gDrmCxt.drmFD, id);
+    if (connector != NULL && connector->count_modes <= 0) {
         drmModeFreeConnector(connector);
         connector = NULL;
     }
-    drmModeFreeResources(resources);
-    if (connector == NULL) {
-        ALOGE("%s: Failed to get conector", __func__);
-    }
-    ALOGV("Leaving %s, %d", __func__, connector_type);
     return connector;
 }
 
 static drmModeConnectorPtr getHdmiConnector()
 {
     if (gDrmCxt.hdmiConnector == NULL)
-#ifndef VPG_DRM
-        gDrmCxt.hdmiConnector = getConnector(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_DVID);
-#else
-        gDrmCxt.hdmiConnector = getConnector(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_HDMIA);
-        if (gDrmCxt.hdmiConnector == NULL) {
-            gDrmCxt.hdmiConnector = getConnector(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_HDMIB);
-        }
-#endif
+        gDrmCxt.hdmiConnector = getConnector();
     if (gDrmCxt.hdmiConnector == NULL || gDrmCxt.hdmiConnector->modes == NULL) {
         ALOGW("Please check HDMI cable is connected or not");
         return NULL;
@@ -107,96 +166,17 @@ static drmModeConnectorPtr getHdmiConnector()
     return gDrmCxt.hdmiConnector;
 }
 
-static inline bool drm_is_preferred_flags(unsigned int flags)
-{
-#ifndef VPG_DRM
-    // prefer 16:9 over 4:3  and progressive over interlaced.
-    if ((flags & DRM_MODE_FLAG_PAR16_9) && !(flags & DRM_MODE_FLAG_INTERLACE))
-        return true;
-    return false;
-#else
-    return true;
-#endif
-}
-
-static void drm_select_preferredmode(drmModeConnectorPtr connector)
-{
-    int index_preferred = -1;
-    int hdisplay = 0, vdisplay = 0;
-    int index_720P = -1, index_1080P = -1, index_max = -1;
-    int i;
-
-    drmModeModeInfoPtr mode;
-    for (i = 0; i < connector->count_modes; i++) {
-        mode = connector->modes + i;
-        ALOGV("mode #%d: %dx%d@%dHz, flags = %#x", i,
-                connector->modes[i].hdisplay,
-                connector->modes[i].vdisplay,
-                connector->modes[i].vrefresh,
-                connector->modes[i].flags);
-
-        if (mode->type & DRM_MODE_TYPE_PREFERRED) {
-            index_preferred = i;
-            break;
-        }
-        if (mode->hdisplay == 1280 &&
-            mode->vdisplay == 720 &&
-            mode->vrefresh == PREFERRED_VREFRESH) {
-            if (index_720P == -1) {
-                index_720P = i;
-            } else  if (drm_is_preferred_flags(mode->flags)) {
-                index_720P = i;
-            }
-        }
-        if (mode->hdisplay == 1920 &&
-            mode->vdisplay == 1080 &&
-            mode->vrefresh == PREFERRED_VREFRESH) {
-            if (index_1080P == -1) {
-                index_1080P = i;
-            } else  if (drm_is_preferred_flags(mode->flags)) {
-                index_1080P = i;
-            }
-        }
-        if (mode->hdisplay > hdisplay &&
-            mode->vdisplay > vdisplay &&
-            mode->vrefresh == PREFERRED_VREFRESH) {
-            hdisplay = mode->hdisplay;
-            vdisplay = mode->vdisplay;
-            index_max = i;
-        } else if (mode->hdisplay == hdisplay &&
-                   mode->vdisplay == vdisplay &&
-                   mode->vrefresh == PREFERRED_VREFRESH) {
-            if (drm_is_preferred_flags(mode->flags)) {
-                index_max = i;
-            }
-        }
-    }
-
-    gDrmCxt.preferredModeIndex = 0;
-    if (index_preferred != -1 &&
-            connector->modes[index_preferred].vrefresh == PREFERRED_VREFRESH) {
-        gDrmCxt.preferredModeIndex = index_preferred;
-    } else if (index_1080P != -1) {
-        gDrmCxt.preferredModeIndex = index_1080P;
-    } else if (index_720P != -1) {
-        gDrmCxt.preferredModeIndex = index_720P;
-    } else if (index_max != -1) {
-        gDrmCxt.preferredModeIndex = index_max;
-    }
-
-    index_preferred = gDrmCxt.preferredModeIndex;
-    ALOGI("HDMI preferred timing is: %dx%d@%dHz, index = %d",
-            connector->modes[index_preferred].hdisplay,
-            connector->modes[index_preferred].vdisplay,
-            connector->modes[index_preferred].vrefresh,
-            index_preferred);
-
+static void bumpHdmiTimingVersion() {
+    // 0 is for no timing list, and -1 for a client without one
+    if (++gDrmCxt.timingVersion <= 0)
+        gDrmCxt.timingVersion = 1;
 }
 
 static void addHdmiTimings(MDSHdmiTiming* dst) {
     MDSHdmiTiming* bak = new MDSHdmiTiming;
     memcpy(bak, dst, sizeof(MDSHdmiTiming));
     gDrmCxt.hdmiTimings.add(bak);
+    bumpHdmiTimingVersion();
 }
 
 static void clearHdmiTimings() {
@@ -207,43 +187,441 @@ static void clearHdmiTimings() {
         timing = NULL;
     }
     gDrmCxt.hdmiTimings.clear();
+    bumpHdmiTimingVersion();
     ALOGV("Clear Hdmi Timings backup, %d", gDrmCxt.hdmiTimings.size());
 }
 
+#ifndef VPG_DRM
+static void getEdidCacheKey(const char* edid, int length,
+        char* productInfo, char* checksum) {
+    // offset of product_info
+    memcpy(productInfo, edid + 8, EDID_PRODUCT_INFO_LEN);
+    checksum[0] = edid[HDMI_TIMING_MAX - 1];
+    checksum[1] = 0;
+    if (edid[126] != 0 && length >= 2 * HDMI_TIMING_MAX)
+        checksum[1] = edid[2 * HDMI_TIMING_MAX - 1];
+}
+
+static int findEdidCache(const char* edid, int length) {
+    char productInfo[EDID_PRODUCT_INFO_LEN];
+    char checksum[2];
+    getEdidCacheKey(edid, length, productInfo, checksum);
+    for (int i = 0; i < EDID_CACHE_MAX; i++) {
+        edidCacheEntry* entry = &gEdidCache[i];
+        if (entry->valid &&
+                !memcmp(entry->productInfo, productInfo, EDID_PRODUCT_INFO_LEN) &&
+                !memcmp(entry->checksum, checksum, sizeof(checksum)))
+            return i;
+    }
+    return -1;
+}
+
+// The short audio descriptors and the speaker allocation of the data
+// blocks of the CEA extension
+static void parseEdidAudioCaps(const char* edid, int length, MDSHdmiAudioCaps* caps) {
+    memset(caps, 0, sizeof(MDSHdmiAudioCaps));
+    if (edid[126] == 0 || length < 2 * HDMI_TIMING_MAX)
+        return;
+    const uint8_t* ext = (const uint8_t*)edid + HDMI_TIMING_MAX;
+    if (ext[0] != 0x02)
+        return;
+    // Data blocks are in revision 3, up to the first detailed timing
+    int end = (ext[2] >= 4 && ext[2] < HDMI_TIMING_MAX) ? ext[2] : HDMI_TIMING_MAX - 1;
+    if (ext[1] < 3)
+        end = 4;
+    for (int i = 4; i < end; i += (ext[i] & 0x1f) + 1) {
+        int tag = ext[i] >> 5;
+        int len = ext[i] & 0x1f;
+        if (i + len >= end)
+            break;
+        if (tag == 4 && len >= 1) {
+            caps->speakers = ext[i + 1];
+            continue;
+        }
+        if (tag != 1)
+            continue;
+        for (int j = i + 1; j + 2 <= i + len; j += 3) {
+            int format = (ext[j] >> 3) & 0x0f;
+            caps->formats |= 1 << format;
+            if (format != 1)
+                continue;
+            int channels = (ext[j] & 0x07) + 1;
+            if (channels > caps->maxChannels)
+                caps->maxChannels = channels;
+            caps->sampleRates |= ext[j + 1] & 0x7f;
+            caps->sampleSizes |= ext[j + 2] & 0x07;
+        }
+    }
+    // Basic audio is 2 channel LPCM at 32, 44.1 and 48kHz, 16 bits
+    if ((ext[3] & 0x40) && !(caps->formats & (1 << 1))) {
+        caps->formats |= 1 << 1;
+        caps->maxChannels = 2;
+        caps->sampleRates |= 0x07;
+        caps->sampleSizes |= 0x01;
+    }
+}
+
+static int addEdidCache(const char* edid, int length, int connectStatus, bool audio) {
+    int index = gEdidCacheNext;
+    gEdidCacheNext = (gEdidCacheNext + 1) % EDID_CACHE_MAX;
+    edidCacheEntry* entry = &gEdidCache[index];
+    getEdidCacheKey(edid, length, entry->productInfo, entry->checksum);
+    entry->connectStatus = connectStatus;
+    entry->audioSupported = audio;
+    parseEdidAudioCaps(edid, length, &entry->audioCaps);
+    // Filled by parseHdmiTimings
+    entry->preferredModeIndex = -1;
+    entry->timingNumber = 0;
+    entry->selectedModeIndex = -1;
+    entry->scaleType = MDS_SCALING_NONE;
+    entry->horizontalStep = 0;
+    entry->verticalStep = 0;
+    entry->valid = true;
+    gProfilesDirty = true;
+    return index;
+}
+
+static void groupHdmiTimings();
+
+// Restore the parsed timings of a known sink, they are cached ranked
+static void loadEdidCache(int index) {
+    const edidCacheEntry* entry = &gEdidCache[index];
+    clearHdmiTimings();
+    for (int i = 0; i < entry->timingNumber; i++)
+        addHdmiTimings((MDSHdmiTiming*)&entry->timings[i]);
+    groupHdmiTimings();
+    gDrmCxt.preferredModeIndex = entry->preferredModeIndex;
+    gDrmCxt.selectedModeIndex = entry->selectedModeIndex;
+    gDrmCxt.audioSupported = entry->audioSupported;
+    gDrmCxt.audioCaps = entry->audioCaps;
+}
+
+static void saveEdidCacheTimings() {
+    if (gDrmCxt.edidCacheIndex < 0)
+        return;
+    edidCacheEntry* entry = &gEdidCache[gDrmCxt.edidCacheIndex];
+    int number = gDrmCxt.hdmiTimings.size();
+    for (int i = 0; i < number; i++)
+        memcpy(&entry->timings[i], gDrmCxt.hdmiTimings.itemAt(i), sizeof(MDSHdmiTiming));
+    entry->timingNumber = number;
+    entry->preferredModeIndex = gDrmCxt.preferredModeIndex;
+    gProfilesDirty = true;
+}
+
+/*
+ * The cache of the sinks seen before the boot, so that a device booting
+ * docked to a known TV skips the parsing and ranking of its timings, and
+ * drives it in the timing and scaling its user chose. An entry which
+ * does not hold together is dropped, the whole file if it is from
+ * another version.
+ */
+static void loadHdmiProfiles() {
+    gProfilesLoaded = true;
+    FILE* file = fopen(HDMI_PROFILE_PATH, "rb");
+    if (file == NULL)
+        return;
+    hdmiProfileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+            header.magic != HDMI_PROFILE_MAGIC ||
+            header.version != HDMI_PROFILE_VERSION ||
+            header.entrySize != sizeof(edidCacheEntry) ||
+            fread(gEdidCache, sizeof(gEdidCache), 1, file) != 1) {
+        ALOGW("%s: ignore %s", __func__, HDMI_PROFILE_PATH);
+        memset(gEdidCache, 0, sizeof(gEdidCache));
+        fclose(file);
+        return;
+    }
+    fclose(file);
+    for (int i = 0; i < EDID_CACHE_MAX; i++) {
+        edidCacheEntry* entry = &gEdidCache[i];
+        if (entry->timingNumber <= 0 || entry->timingNumber > HDMI_TIMING_MAX ||
+                entry->preferredModeIndex >= entry->timingNumber ||
+                entry->selectedModeIndex >= entry->timingNumber)
+            entry->valid = false;
+    }
+    gEdidCacheNext = (header.next >= 0 && header.next < EDID_CACHE_MAX) ? header.next : 0;
+}
+
+// Written to a new file first, so that a crash leaves the old one
+static bool saveHdmiProfiles() {
+    char path[sizeof(HDMI_PROFILE_PATH) + 4];
+    snprintf(path, sizeof(path), "%s.tmp", HDMI_PROFILE_PATH);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        ALOGE("%s: Failed to create %s, %s", __func__, path, strerror(errno));
+        return false;
+    }
+    hdmiProfileHeader header;
+    header.magic = HDMI_PROFILE_MAGIC;
+    header.version = HDMI_PROFILE_VERSION;
+    header.entrySize = sizeof(edidCacheEntry);
+    header.next = gEdidCacheNext;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(gEdidCache, sizeof(gEdidCache), 1, file) == 1 &&
+            fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+    if (!written || rename(path, HDMI_PROFILE_PATH) != 0) {
+        ALOGE("%s: Failed to write %s, %s", __func__, HDMI_PROFILE_PATH, strerror(errno));
+        unlink(path);
+        return false;
+    }
+    return true;
+}
+#endif
+
+#define TIMING_HASH_SIZE    (2 * HDMI_TIMING_MAX)
+
+static bool isSameTiming(const MDSHdmiTiming* a, const MDSHdmiTiming* b) {
+    if (a->width != b->width || a->height != b->height ||
+            a->refresh != b->refresh)
+        return false;
+#ifndef VPG_DRM
+    int mask = DRM_MODE_FLAG_INTERLACE | DRM_MODE_FLAG_PAR16_9 | DRM_MODE_FLAG_PAR4_3;
+    return (a->flags & mask) == (b->flags & mask);
+#else
+    return a->flags == b->flags && a->ratio == b->ratio;
+#endif
+}
+
+static unsigned int hashTiming(const MDSHdmiTiming* t) {
+#ifndef VPG_DRM
+    int flags = t->flags & (DRM_MODE_FLAG_INTERLACE | DRM_MODE_FLAG_PAR16_9 | DRM_MODE_FLAG_PAR4_3);
+#else
+    int flags = t->flags ^ (t->ratio << 24);
+#endif
+    unsigned int h = (unsigned int)t->width * 31 + (unsigned int)t->height;
+    h = h * 31 + (unsigned int)t->refresh;
+    h = h * 31 + (unsigned int)flags;
+    return (h ^ (h >> 16)) % TIMING_HASH_SIZE;
+}
+
+/*
+ * The rank of a timing, the higher the better. By order of weight:
+ * the preferred mode of the sink at 60Hz, then the 1080P, the 720P and
+ * any other mode at 60Hz, then the modes at other rates; the largest
+ * first; progressive, 16:9 and the highest refresh rate first.
+ */
+static int64_t scoreHdmiTiming(const MDSHdmiTiming* t, bool sinkPreferred) {
+    int64_t tier = 0;
+    if (t->refresh == PREFERRED_VREFRESH) {
+        if (sinkPreferred)
+            tier = 4;
+        else if (t->width == 1920 && t->height == 1080)
+            tier = 3;
+        else if (t->width == 1280 && t->height == 720)
+            tier = 2;
+        else
+            tier = 1;
+    }
+    int64_t score = (tier << 32) | ((uint32_t)t->width * t->height);
+    score = (score << 1) | (t->interlace ? 0 : 1);
+    score = (score << 1) | (t->ratio == 2 ? 1 : 0);
+    score = (score << 8) | (t->refresh > 255 ? 255 : t->refresh);
+    return score;
+}
+
+// Link the timings of the same resolution and scan, in rank order, so
+// the refresh rates of a mode are found without a scan of the list
+static void groupHdmiTimings() {
+    int number = gDrmCxt.hdmiTimings.size();
+    for (int i = 0; i < number; i++) {
+        const MDSHdmiTiming* t = gDrmCxt.hdmiTimings.itemAt(i);
+        gDrmCxt.refreshHead[i] = i;
+        gDrmCxt.refreshNext[i] = -1;
+        for (int j = i - 1; j >= 0; j--) {
+            const MDSHdmiTiming* prev = gDrmCxt.hdmiTimings.itemAt(j);
+            if (prev->width == t->width && prev->height == t->height &&
+                    prev->interlace == t->interlace) {
+                gDrmCxt.refreshHead[i] = gDrmCxt.refreshHead[j];
+                gDrmCxt.refreshNext[j] = i;
+                break;
+            }
+        }
+    }
+}
+
+// Sort the timings by score, stable so equal ones keep the sink order.
+// The preferred timing is then the first one.
+static void rankHdmiTimings(int sinkPreferred) {
+    int number = gDrmCxt.hdmiTimings.size();
+    if (number <= 0)
+        return;
+    MDSHdmiTiming* ranked[number];
+    int64_t scores[number];
+    for (int i = 0; i < number; i++) {
+        MDSHdmiTiming* t = gDrmCxt.hdmiTimings.itemAt(i);
+        int64_t score = scoreHdmiTiming(t, i == sinkPreferred);
+        int j = i;
+        for (; j > 0 && scores[j - 1] < score; j--) {
+            ranked[j] = ranked[j - 1];
+            scores[j] = scores[j - 1];
+        }
+        ranked[j] = t;
+        scores[j] = score;
+    }
+    for (int i = 0; i < number; i++)
+        gDrmCxt.hdmiTimings.editItemAt(i) = ranked[i];
+    groupHdmiTimings();
+    gDrmCxt.preferredModeIndex = 0;
+}
+
+/*
+ * Parse HDMI timings, and save them ranked in gDrmCxt.hdmiTimings.
+ * Duplicated modes are found with a hash of the timings, and the
+ * preferred timing is the best ranked one, @see scoreHdmiTiming.
+ */
+static int parseHdmiTimings() {
+    ALOGV("Entering %s", __func__);
+    gDrmCxt.preferredModeIndex = -1;
+    drmModeConnector *connector = getHdmiConnector();
+    if (connector == NULL) {
+        ALOGE("%s: Failed to get HDMI connector.", __func__);
+        return 0;
+    }
+    if (connector->count_modes < 0 || connector->count_modes > HDMI_TIMING_MAX) {
+        ALOGW("%s: unexpected count of modes %d", __func__, connector->count_modes);
+        drmModeFreeConnector(connector);
+        gDrmCxt.hdmiConnector = NULL;
+        return 0;
+    }
+    // index in gDrmCxt.hdmiTimings, -1 for an empty slot
+    int slots[TIMING_HASH_SIZE];
+    memset(slots, -1, sizeof(slots));
+    for (size_t j = 0; j < gDrmCxt.hdmiTimings.size(); j++) {
+        unsigned int h = hashTiming(gDrmCxt.hdmiTimings.itemAt(j));
+        while (slots[h] >= 0)
+            h = (h + 1) % TIMING_HASH_SIZE;
+        slots[h] = j;
+    }
+
+    int sinkPreferred = -1;
+    int validCnt = 0;
+    // get resolution of each mode
+    for (int i = 0; i < connector->count_modes; i++) {
+        drmModeModeInfoPtr mode = connector->modes + i;
+        int tmpF = mode->flags;
+        MDSHdmiTiming dst;
+        dst.width   = mode->hdisplay;
+        dst.height  = mode->vdisplay;
+        dst.refresh = mode->vrefresh;
+        dst.interlace = 0;
+        if (tmpF & DRM_MODE_FLAG_INTERLACE)
+            dst.interlace = 1;
+        dst.ratio = 0;
+#ifndef VPG_DRM
+        if (tmpF & DRM_MODE_FLAG_PAR16_9)
+            dst.ratio = 2;
+        else if (tmpF & DRM_MODE_FLAG_PAR4_3)
+            dst.ratio = 1;
+#else
+        if (mode->picture_aspect_ratio == HDMI_PICTURE_ASPECT_16_9)
+            dst.ratio = 2;
+        else if (mode->picture_aspect_ratio == HDMI_PICTURE_ASPECT_4_3)
+            dst.ratio = 1;
+#endif
+        dst.flags = tmpF;
+
+        int timing = -1;
+        unsigned int h = hashTiming(&dst);
+        while (slots[h] >= 0) {
+            if (isSameTiming(gDrmCxt.hdmiTimings.itemAt(slots[h]), &dst)) {
+                timing = slots[h];
+                break;
+            }
+            h = (h + 1) % TIMING_HASH_SIZE;
+        }
+        if (timing >= 0) {
+            ALOGV("A duplicated timing:%dx%d@%dx%0xx",
+                    dst.width, dst.height, dst.refresh, tmpF);
+        } else {
+            // Save Hdmi timing
+            timing = gDrmCxt.hdmiTimings.size();
+            slots[h] = timing;
+            addHdmiTimings(&dst);
+            validCnt++;
+            ALOGV("Add timing: %dx%d@%dx0x%0x", dst.width, dst.height, dst.refresh, tmpF);
+        }
+
+        if (sinkPreferred < 0 && (mode->type & DRM_MODE_TYPE_PREFERRED))
+            sinkPreferred = timing;
+    }
+
+    rankHdmiTimings(sinkPreferred);
+    if (gDrmCxt.hdmiTimings.size() > 0) {
+        MDSHdmiTiming* preferred = gDrmCxt.hdmiTimings.itemAt(gDrmCxt.preferredModeIndex);
+        ALOGI("HDMI preferred timing is: %dx%d@%dHz, index = %d",
+                preferred->width, preferred->height, preferred->refresh,
+                gDrmCxt.preferredModeIndex);
+    }
+#ifndef VPG_DRM
+    saveEdidCacheTimings();
+#endif
+    return validCnt;
+}
+
+// Nothing is opened nor probed here, so MDS starts without any DRM access
 bool drm_init()
 {
     //gDrmCxt.newDevice = false;;
+    gDrmCxt.drmFD = -1;
+    gDrmCxt.hdmiSupported = false;
+    gDrmCxt.supportChecked = false;
     gDrmCxt.connected = false;
     gDrmCxt.preferredModeIndex = -1;
     gDrmCxt.selectedModeIndex = -1;
     gDrmCxt.hdmiConnector = NULL;
-#if 0 // Don't keep prevoius device EDID
-    memset(gDrmCxt.productInfo, 0,EDID_PRODUCT_INFO_LEN);
-#endif
-#ifndef VPG_DRM
-    gDrmCxt.drmFD = open(DRM_DEVICE_NAME, O_RDWR, 0);
+    gDrmCxt.hdmiConnectorId = 0;
+    gDrmCxt.edidPropId = 0;
+    gDrmCxt.statusValid = false;
+    gDrmCxt.connectStatus = 0;
+    gDrmCxt.audioSupported = false;
+    memset(&gDrmCxt.audioCaps, 0, sizeof(gDrmCxt.audioCaps));
+    gDrmCxt.edidCacheIndex = -1;
+    bumpHdmiTimingVersion();
+    gDrmCxt.hdmiTimings.setCapacity(HDMI_TIMING_MAX);
+    return true;
+}
+
+static bool openDrmDevice()
+{
     if (gDrmCxt.drmFD <= 0) {
-        ALOGE("%s: Failed to open %s", __func__, DRM_DEVICE_NAME);
-        return false;
-    }
-    drmModeConnectorPtr connector = getConnector(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_DVID);
+#ifndef VPG_DRM
+        gDrmCxt.drmFD = open(DRM_DEVICE_NAME, O_RDWR, 0);
+        if (gDrmCxt.drmFD <= 0) {
+            ALOGE("%s: Failed to open %s", __func__, DRM_DEVICE_NAME);
+            return false;
+        }
 #else
-    gDrmCxt.drmFD = drmOpen("i915", NULL);
-    if (gDrmCxt.drmFD <= 0) {
-        ALOGE("%s: Failed to open drm", __func__);
-        return false;
+        gDrmCxt.drmFD = drmOpen("i915", NULL);
+        if (gDrmCxt.drmFD <= 0) {
+            ALOGE("%s: Failed to open drm", __func__);
+            return false;
+        }
+#endif
     }
-    drmModeConnectorPtr connector = getConnector(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_HDMIA);
-    if (connector == NULL) {
-        connector = getConnector(gDrmCxt.drmFD, DRM_MODE_CONNECTOR_HDMIB);
+    if (!gDrmCxt.supportChecked) {
+        drmModeConnectorPtr connector = getConnector();
+        gDrmCxt.hdmiSupported = (connector != NULL);
+        gDrmCxt.supportChecked = true;
+        if (connector) {
+            drmModeFreeConnector(connector);
+            connector = NULL;
+        }
     }
-#endif
-    gDrmCxt.hdmiSupported = (connector != NULL);
-    if (connector) {
-        drmModeFreeConnector(connector);
-        connector = NULL;
+    return true;
+}
+
+bool drm_set_dev_fd(int fd)
+{
+    int shared = dup(fd);
+    if (shared < 0) {
+        ALOGE("%s: Failed to dup the DRM device %d", __func__, fd);
+        return false;
     }
-    gDrmCxt.hdmiTimings.setCapacity(HDMI_TIMING_MAX);
+    // The connectors are looked up by Id, which is the same on both
+    if (gDrmCxt.drmFD > 0)
+        drmClose(gDrmCxt.drmFD);
+    gDrmCxt.drmFD = shared;
     return true;
 }
 
@@ -257,10 +635,18 @@ void drm_cleanup()
     memset(&gDrmCxt, 0, sizeof(drmContext));
 }
 
+void drm_hdmi_onHotplug(void)
+{
+    gDrmCxt.statusValid = false;
+}
+
 bool drm_hdmi_onHdmiDisconnected(void)
 {
     clearHdmiTimings();
     gDrmCxt.connected = false;
+    gDrmCxt.audioSupported = false;
+    memset(&gDrmCxt.audioCaps, 0, sizeof(gDrmCxt.audioCaps));
+    gDrmCxt.edidCacheIndex = -1;
     if (gDrmCxt.hdmiConnector)
         drmModeFreeConnector(gDrmCxt.hdmiConnector);
     gDrmCxt.hdmiConnector = NULL;
@@ -271,6 +657,8 @@ bool drm_hdmi_onHdmiDisconnected(void)
 bool drm_hdmi_notify_audio_hotplug(bool plugin)
 {
 #ifndef VPG_DRM
+    if (!openDrmDevice())
+        return false;
     struct drm_psb_disp_ctrl dp_ctrl;
     memset(&dp_ctrl, 0, sizeof(dp_ctrl));
     dp_ctrl.cmd = DRM_PSB_HDMI_NOTIFY_HOTPLUG_TO_AUDIO;
@@ -287,30 +675,32 @@ bool drm_hdmi_notify_audio_hotplug(bool plugin)
 int drm_hdmi_getConnectionStatus()
 {
     ALOGV("Entering %s", __func__);
-    if (!gDrmCxt.hdmiSupported)
+    if (!openDrmDevice() || !gDrmCxt.hdmiSupported)
         return 0;
+    if (gDrmCxt.statusValid)
+        return gDrmCxt.connectStatus;
 
     if (gDrmCxt.hdmiConnector)
         drmModeFreeConnector(gDrmCxt.hdmiConnector);
     gDrmCxt.hdmiConnector = NULL;
     // reset connection status
     gDrmCxt.connected = false;
+    gDrmCxt.audioSupported = false;
+    memset(&gDrmCxt.audioCaps, 0, sizeof(gDrmCxt.audioCaps));
+    gDrmCxt.edidCacheIndex = -1;
+    gDrmCxt.statusValid = true;
+    gDrmCxt.connectStatus = 0;
+    MultiDisplayCallTrace trace(sConnectorStats);
     drmModeConnector *connector = getHdmiConnector();
     if (connector == NULL)
         return 0;
     int ret = 0;
 #ifndef VPG_DRM
     // Read EDID, and check whether it's HDMI or DVI interface
-    for (int i = 0; i < connector->count_props; i++) {
-        drmModePropertyPtr props = drmModeGetProperty(gDrmCxt.drmFD, connector->props[i]);
-        if (!props)
-            continue;
-
-        if (props->name == NULL ||
-                strncmp(props->name, "EDID", sizeof("EDID")) != 0) {
-            drmModeFreeProperty(props);
-            continue;
-        }
+    int i = drm_find_connector_prop(gDrmCxt.drmFD, connector, "EDID", &gDrmCxt.edidPropId);
+    do {
+        if (i < 0)
+            break;
 
         uint64_t* edid = &connector->prop_values[i];
         drmModePropertyBlobPtr edidBlob = drmModeGetPropertyBlob(gDrmCxt.drmFD, *edid);
@@ -318,134 +708,51 @@ int drm_hdmi_getConnectionStatus()
             edidBlob->data == NULL ||
             edidBlob->length < HDMI_TIMING_MAX) {
             ALOGE("%s: Invalid EDID Blob.", __func__);
-            drmModeFreeProperty(props);
+            if (edidBlob)
+                drmModeFreePropertyBlob(edidBlob);
             ret = 0;
             break;
         }
 
         char* edid_binary = (char *)edidBlob->data;
-        // offset of product_info
-        char* product_info = edid_binary + 8;
+        int length = edidBlob->length;
         gDrmCxt.connected = true;
-#if 0   // Don't keep prevoius device EDID
-        gDrmCxt.newDevice = false;
-        if (memcmp(gDrmCxt.productInfo, product_info, EDID_PRODUCT_INFO_LEN)) {
-            ALOGI("A new HDMI sink is connected.");
-            gDrmCxt.newDevice = true;
-            memcpy(gDrmCxt.productInfo, product_info, EDID_PRODUCT_INFO_LEN);
-            //clear HDMI timings backup
-            clearHdmiTimings();
-        }
-#endif
-        drm_select_preferredmode(connector);
-
-        ret = 2; // DVI
-        if (edid_binary[126] == 0) {
-            drmModeFreeProperty(props);
+        if (!gProfilesLoaded)
+            loadHdmiProfiles();
+        int index = findEdidCache(edid_binary, length);
+        if (index >= 0) {
+            ALOGI("A known HDMI sink is connected.");
+            loadEdidCache(index);
+            gDrmCxt.edidCacheIndex = index;
+            ret = gEdidCache[index].connectStatus;
+            drmModeFreePropertyBlob(edidBlob);
             break;
         }
-
-        // search VSDB in extend edid
-        for (int j = 0; j <= HDMI_TIMING_MAX - 3; j++) {
-            int n = HDMI_TIMING_MAX + j;
-            if (edid_binary[n]   == 0x03 &&
-                edid_binary[n+1] == 0x0c &&
-                edid_binary[n+2] == 0x00) {
-                ret = 1; //HDMI
-                break;
-            }
-        }
-        drmModeFreeProperty(props);
-        break;
-    }
+        MultiDisplayCallTrace newSinkTrace(sNewSinkStats);
+        bool audio = false;
+        ret = drm_edid_get_sink_type(edid_binary, length, &audio);
+        gDrmCxt.audioSupported = audio;
+        gDrmCxt.edidCacheIndex = addEdidCache(edid_binary, length, ret, audio);
+        gDrmCxt.audioCaps = gEdidCache[gDrmCxt.edidCacheIndex].audioCaps;
+        drmModeFreePropertyBlob(edidBlob);
+        // A new sink, its timings replace the backup
+        clearHdmiTimings();
+        parseHdmiTimings();
+    } while (0);
 #else
     if (connector->connection == DRM_MODE_CONNECTED) {
         gDrmCxt.connected = true;
-        drm_select_preferredmode(connector);
+        gDrmCxt.audioSupported = true;
+        if (gDrmCxt.hdmiTimings.size() == 0)
+            parseHdmiTimings();
         ret = 1; // Deault is HDMI on Gen
     }
 #endif
     ALOGD("External Display device is %d", ret);
+    gDrmCxt.connectStatus = ret;
     return ret;
 }
 
-/*
- * Parse HDMI timings,
- * and save them in gDrmCxt.hdmiTimings
- */
-static int parseHdmiTimings() {
-    ALOGV("Entering %s", __func__);
-    drmModeConnector *connector = getHdmiConnector();
-    if (connector == NULL) {
-        ALOGE("%s: Failed to get HDMI connector.", __func__);
-        return 0;
-    }
-    if (connector->count_modes < 0 || connector->count_modes > HDMI_TIMING_MAX) {
-        ALOGW("%s: unexpected count of modes %d", __func__, connector->count_modes);
-        drmModeFreeConnector(connector);
-        gDrmCxt.hdmiConnector = NULL;
-        return 0;
-    }
-    int validCnt = 0;
-    // get resolution of each mode
-    for (int i = 0; i < connector->count_modes; i++) {
-        int tmpW = connector->modes[i].hdisplay;
-        int tmpV = connector->modes[i].vdisplay;
-        unsigned int tmpR = connector->modes[i].vrefresh;
-        int tmpF = connector->modes[i].flags;
-#ifdef VPG_DRM
-        unsigned int tmpA = connector->modes[i].picture_aspect_ratio;
-#endif
-        bool duplicated = false;
-        for (size_t j = 0; j < gDrmCxt.hdmiTimings.size(); j++) {
-            MDSHdmiTiming* bak = gDrmCxt.hdmiTimings.itemAt(j);
-            if (bak != NULL &&
-                    bak->width == tmpW && bak->height == tmpV &&
-#ifndef VPG_DRM
-                    (bak->flags & DRM_MODE_FLAG_INTERLACE) == (tmpF & DRM_MODE_FLAG_INTERLACE) &&
-                    (bak->flags & DRM_MODE_FLAG_PAR16_9) == (tmpF & DRM_MODE_FLAG_PAR16_9) &&
-                    (bak->flags & DRM_MODE_FLAG_PAR4_3) == (tmpF & DRM_MODE_FLAG_PAR4_3) &&
-                    bak->refresh == tmpR) {
-#else
-                    bak->refresh == tmpR && bak->flags == tmpF &&
-                    bak->ratio == tmpA ) {
-#endif
-                duplicated = true;
-                break;
-            }
-        }
-        if (duplicated) {
-            ALOGV("A duplicated timing:%dx%d@%dx%0xx", tmpW, tmpV, tmpR, tmpF);
-            continue;
-        }
-        MDSHdmiTiming dst;
-        dst.width   = tmpW;
-        dst.height  = tmpV;
-        dst.refresh = tmpR;
-        dst.interlace = 0;
-        if (tmpF & DRM_MODE_FLAG_INTERLACE)
-            dst.interlace = 1;
-        dst.ratio = 0;
-#ifndef VPG_DRM
-        if (tmpF & DRM_MODE_FLAG_PAR16_9)
-            dst.ratio = 2;
-        else if (tmpF & DRM_MODE_FLAG_PAR4_3)
-            dst.ratio = 1;
-#else
-        if (tmpA == HDMI_PICTURE_ASPECT_16_9)
-            dst.ratio = 2;
-        else if (tmpA == HDMI_PICTURE_ASPECT_4_3)
-            dst.ratio = 1;
-#endif
-        dst.flags = tmpF;
-        // Save Hdmi timing
-        addHdmiTimings(&dst);
-        validCnt++;
-        ALOGV("Add timing: %dx%d@%dx0x%0x", tmpW, tmpV, tmpR, tmpF);
-    }
-    return validCnt;
-}
-
 int drm_hdmi_getTimingNumber() {
     ALOGV("Entering %s", __func__);
     if (!gDrmCxt.hdmiSupported || !gDrmCxt.connected) {
@@ -483,12 +790,16 @@ bool drm_hdmi_getTimings(int count, MDSHdmiTiming** list)
     return true;
 }
 
-bool drm_hdmi_checkTiming(MDSHdmiTiming* timing)
+int32_t drm_hdmi_getTimingVersion()
+{
+    if (!gDrmCxt.hdmiSupported || !gDrmCxt.connected)
+        return 0;
+    return gDrmCxt.timingVersion;
+}
+
+// Index of the timing in gDrmCxt.hdmiTimings, or -1
+static int findHdmiTiming(const MDSHdmiTiming* timing)
 {
-    if (!timing || !gDrmCxt.hdmiSupported || !gDrmCxt.connected) {
-        ALOGE("%s: HDMI is not supported or not connected.", __func__);
-        return false;
-    }
     unsigned int i = 0;
     unsigned int size = gDrmCxt.hdmiTimings.size();
     for (; i < size; i++) {
@@ -502,16 +813,24 @@ bool drm_hdmi_checkTiming(MDSHdmiTiming* timing)
                 timing->height == bak->height &&
                 timing->refresh == bak->refresh &&
                 timing->interlace == bak->interlace &&
-                timing->ratio == bak->ratio) {
-            timing->flags = bak->flags;
-            gDrmCxt.selectedModeIndex = i;
-            break;
-        }
+                timing->ratio == bak->ratio)
+            return i;
     }
-    if (i >= size) {
-        ALOGE("Fail to get a matched Hdmi timing, %d, %d", i, size);
+    ALOGE("Fail to get a matched Hdmi timing, %d, %d", i, size);
+    return -1;
+}
+
+bool drm_hdmi_checkTiming(MDSHdmiTiming* timing)
+{
+    if (!timing || !gDrmCxt.hdmiSupported || !gDrmCxt.connected) {
+        ALOGE("%s: HDMI is not supported or not connected.", __func__);
         return false;
     }
+    int i = findHdmiTiming(timing);
+    if (i < 0)
+        return false;
+    timing->flags = gDrmCxt.hdmiTimings.itemAt(i)->flags;
+    gDrmCxt.selectedModeIndex = i;
     return true;
 }
 #if 0
@@ -521,6 +840,19 @@ bool drm_hdmi_isDeviceChanged()
 }
 #endif
 
+bool drm_hdmi_isAudioSupported()
+{
+    return gDrmCxt.connected && gDrmCxt.audioSupported;
+}
+
+bool drm_hdmi_getAudioCaps(MDSHdmiAudioCaps* caps)
+{
+    if (caps == NULL || !drm_hdmi_isAudioSupported() || gDrmCxt.audioCaps.formats == 0)
+        return false;
+    memcpy(caps, &gDrmCxt.audioCaps, sizeof(MDSHdmiAudioCaps));
+    return true;
+}
+
 bool drm_hdmi_timing_is_fixed()
 {
     return (gDrmCxt.selectedModeIndex >= 0 ? true : false);
@@ -553,5 +885,89 @@ status_t drm_hdmi_get_current_timing(MDSHdmiTiming* timing)
     return UNKNOWN_ERROR;
 }
 
+bool drm_hdmi_setSinkConfig(const MDSHdmiTiming* timing,
+        int scaleType, int hStep, int vStep)
+{
+#ifndef VPG_DRM
+    if (!gDrmCxt.connected || gDrmCxt.edidCacheIndex < 0)
+        return false;
+    edidCacheEntry* entry = &gEdidCache[gDrmCxt.edidCacheIndex];
+    int selected = entry->selectedModeIndex;
+    if (timing != NULL) {
+        selected = findHdmiTiming(timing);
+        if (selected < 0)
+            return false;
+    }
+    if (selected == entry->selectedModeIndex && scaleType == entry->scaleType &&
+            hStep == entry->horizontalStep && vStep == entry->verticalStep)
+        return true;
+    entry->selectedModeIndex = selected;
+    entry->scaleType = scaleType;
+    entry->horizontalStep = hStep;
+    entry->verticalStep = vStep;
+    gProfilesDirty = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool drm_hdmi_getSinkScaling(int* scaleType, int* hStep, int* vStep)
+{
+    *scaleType = MDS_SCALING_NONE;
+    *hStep = 0;
+    *vStep = 0;
+#ifndef VPG_DRM
+    if (!gDrmCxt.connected || gDrmCxt.edidCacheIndex < 0)
+        return false;
+    const edidCacheEntry* entry = &gEdidCache[gDrmCxt.edidCacheIndex];
+    *scaleType = entry->scaleType;
+    *hStep = entry->horizontalStep;
+    *vStep = entry->verticalStep;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void drm_hdmi_saveSinkProfiles()
+{
+#ifndef VPG_DRM
+    if (gProfilesDirty && saveHdmiProfiles())
+        gProfilesDirty = false;
+#endif
+}
+
+bool drm_hdmi_findRefreshRate(int fps, MDSHdmiTiming* timing)
+{
+    if (timing == NULL || !gDrmCxt.connected)
+        return false;
+    int current = gDrmCxt.selectedModeIndex;
+    if (current < 0)
+        current = gDrmCxt.preferredModeIndex;
+    if (current < 0 || current >= (int)gDrmCxt.hdmiTimings.size())
+        return false;
+    const MDSHdmiTiming* cur = gDrmCxt.hdmiTimings.itemAt(current);
+    const MDSHdmiTiming* best = NULL;
+    uint32_t bestDelta = 0;
+    for (int i = gDrmCxt.refreshHead[current]; i >= 0; i = gDrmCxt.refreshNext[i]) {
+        const MDSHdmiTiming* t = gDrmCxt.hdmiTimings.itemAt(i);
+        if (t->refresh == 0 || (fps > 0 && t->refresh % fps != 0))
+            continue;
+        uint32_t delta = t->refresh;
+        if (fps > 0)
+            delta = (t->refresh > cur->refresh) ?
+                t->refresh - cur->refresh : cur->refresh - t->refresh;
+        if (best == NULL || delta < bestDelta) {
+            best = t;
+            bestDelta = delta;
+        }
+    }
+    if (best == NULL)
+        return false;
+    memcpy(timing, best, sizeof(MDSHdmiTiming));
+    return true;
+}
+
 }; // namespace intel
 }; // namespace android
@@ -35,21 +35,42 @@ namespace intel {
 
 bool drm_init();
 void drm_cleanup();
+// Use a dup of fd, the DRM device of HWC, instead of opening one
+bool drm_set_dev_fd(int fd);
 int  drm_get_dev_fd();
 int  drm_get_ioctl_offset();
 
+// A hotplug happened, the connection status must be probed again
+void drm_hdmi_onHotplug(void);
 bool drm_hdmi_onHdmiDisconnected(void);
 bool drm_hdmi_notify_audio_hotplug(bool connected);
 // return 0 - disconnected, 1 - HDMI connected, 2 - DVI connected
 int  drm_hdmi_getConnectionStatus();
 int  drm_hdmi_getTimingNumber();
-// get all unique (non-duplicated) modes
+// get all unique (non-duplicated) modes, the preferred one first
 bool drm_hdmi_getTimings(int count, MDSHdmiTiming** list);
+// changed whenever the timing list is, 0 if there is no list
+int32_t drm_hdmi_getTimingVersion();
 
 bool drm_hdmi_checkTiming(MDSHdmiTiming* info);
 //bool drm_hdmi_isDeviceChanged();
+// the connected sink supports basic audio
+bool drm_hdmi_isAudioSupported();
+// the audio capability parsed from the EDID of the connected sink
+bool drm_hdmi_getAudioCaps(MDSHdmiAudioCaps* caps);
 bool drm_hdmi_timing_is_fixed();
 status_t drm_hdmi_get_current_timing(MDSHdmiTiming* timing);
+// the timing of the current resolution and scan, with the refresh rate
+// multiple of fps the closest to the current one, or the lowest if fps is 0
+bool drm_hdmi_findRefreshRate(int fps, MDSHdmiTiming* timing);
+// Keep the timing, NULL for the current one, the scaling type and the
+// overscan steps chosen for the connected sink in its profile
+bool drm_hdmi_setSinkConfig(const MDSHdmiTiming* timing,
+        int scaleType, int hStep, int vStep);
+// the scaling of the profile of the connected sink, false if it has none
+bool drm_hdmi_getSinkScaling(int* scaleType, int* hStep, int* vStep);
+// Write the profiles of the sinks to /data if they changed
+void drm_hdmi_saveSinkProfiles();
 
 }; // namespace intel
 }; // namespace android
@@ -28,6 +28,25 @@
 namespace android {
 namespace intel {
 
+/*
+ * Completion of an asynchronous callback request, created by the caller
+ * and handed over with the request: the callback side reports the result
+ * of the request to it through a oneway transaction.
+ */
+class MultiDisplayCompletion : public BBinder {
+public:
+    // Sends result to the completion done, a local or a remote one
+    static void complete(const sp<IBinder>& done, status_t result);
+
+protected:
+    virtual void onComplete(status_t result) = 0;
+
+    virtual status_t onTransact(uint32_t code,
+                                const Parcel& data,
+                                Parcel* reply,
+                                uint32_t flags = 0);
+};
+
 class IMultiDisplayCallback : public IInterface {
 public:
     DECLARE_META_INTERFACE(MultiDisplayCallback);
@@ -74,6 +93,38 @@ public:
      *     !=0: on failure
      */
     virtual status_t setHdmiOverscan(int hValue, int vValue) = 0;
+
+    /*
+     * set the scale type and the overscan compensation of display in one
+     * request. By default it calls setHdmiScalingType, then setHdmiOverscan
+     * param: please refer MultiDisplayType.h
+     * return:
+     *       0: on success
+     *     !=0: on failure
+     */
+    virtual status_t setHdmiScaling(MDS_SCALING_TYPE type, int hValue, int vValue);
+
+    /*
+     * asynchronous form of setHdmiScaling: it returns once the request is
+     * sent, and done gets the result of setHdmiScaling
+     * return:
+     *       0: the request is sent
+     *     !=0: on failure, done is not called
+     */
+    virtual status_t setHdmiScalingAsync(MDS_SCALING_TYPE type,
+            int hValue, int vValue, const sp<MultiDisplayCompletion>& done);
+
+    /*
+     * set the resolution, the scale type and the overscan compensation of
+     * HDMI in one request, which the display can commit with a single mode
+     * set. By default it calls setHdmiTiming, then setHdmiScaling
+     * param: please refer MultiDisplayType.h
+     * return:
+     *       0: on success
+     *     !=0: on failure
+     */
+    virtual status_t setHdmiConfig(const MDSHdmiTiming& timing,
+            MDS_SCALING_TYPE type, int hValue, int vValue);
     /*
      * set the state of touch screen or key input
      * param: please refer MultiDisplayType.h
@@ -47,6 +47,14 @@ public:
      * return: @see status_t in <utils/Errors.h>
      */
     virtual status_t unregisterCallback(const sp<IMultiDisplayCallback>&) = 0;
+
+    /**
+     * @brief Share the DRM device of the display with MDS, which then
+     * uses it for the HDMI probing instead of opening its own
+     * @param fd The DRM device, MDS keeps a dup of it
+     * return: @see status_t in <utils/Errors.h>
+     */
+    virtual status_t shareDrmDevice(int fd) = 0;
 };
 
 
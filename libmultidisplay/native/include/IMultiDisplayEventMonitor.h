@@ -44,6 +44,13 @@ public:
      * @return @see status_t in <utils/Errors.h>
      */
     virtual status_t updateInputState(bool state) = 0;
+    /**
+     * @brief Update the power save state, thermal throttling or low battery
+     * @param bool state, true indicates only the necessary video post
+     *        processing should run, @see MDS_VPP_POLICY
+     * @return @see status_t in <utils/Errors.h>
+     */
+    virtual status_t updatePowerSaveState(bool state) = 0;
 };
 
 class BnMultiDisplayEventMonitor : public BnInterface<IMultiDisplayEventMonitor> {
@@ -54,6 +54,19 @@ public:
      */
     virtual status_t getHdmiTimingList(int count, MDSHdmiTiming** list) = 0;
 
+    /**
+     * @brief Get the timing count and list of HDMI in one call,
+     *        the list is only sent if it changed since the caller got it
+     * @param version in: the version of the list the caller has, -1 for none,
+     *        out: the current version, 0 if there is no timing list
+     * @param count out: the total timing count, as @see getHdmiTimingCount
+     * @param list  up to max timings, only filled if the version changed
+     * @param max   the size of list
+     * return: @see status_t in <utils/Errors.h>
+     */
+    virtual status_t getHdmiTimings(int32_t* version, int32_t* count,
+            MDSHdmiTiming* list, int32_t max) = 0;
+
     /**
      * @brief Get the HDMI timing which is used now
      * @param timing The current timing in use
@@ -89,6 +102,29 @@ public:
      */
     virtual status_t setHdmiOverscan(int hValue, int vValue) = 0;
 
+    /**
+     * @brief Set the scale type and the overscan compensation of HDMI
+     *        at once, as @see setHdmiScalingType and @see setHdmiOverscan
+     * @param type  @see MDS_SCALING_TYPE in MultiDisplayType.h
+     * @param hValue
+     * @param vValue
+     * @return @see status_t in <utils/Errors.h>
+     */
+    virtual status_t setHdmiScaling(MDS_SCALING_TYPE type, int hValue, int vValue) = 0;
+
+    /**
+     * @brief Set the timing, the scale type and the overscan compensation
+     *        of HDMI at once, as @see setHdmiTiming and @see setHdmiScaling,
+     *        committed with one mode set
+     * @param timing The timing which is going to be set. @see MDSHdmiTiming
+     * @param type  @see MDS_SCALING_TYPE in MultiDisplayType.h
+     * @param hValue
+     * @param vValue
+     * @return @see status_t in <utils/Errors.h>
+     */
+    virtual status_t setHdmiConfig(const MDSHdmiTiming& timing,
+            MDS_SCALING_TYPE type, int hValue, int vValue) = 0;
+
     /**
      * @brief check HDMI timing whether is fixed
      * @param
@@ -22,6 +22,7 @@
 #include <utils/Errors.h>
 #include <utils/RefBase.h>
 #include <binder/IInterface.h>
+#include <binder/IMemory.h>
 
 #include <display/MultiDisplayType.h>
 
@@ -41,8 +42,51 @@ typedef enum {
     MDS_WIDI_ON         = 1 << 2,  /**< WIDI is connected*/
     MDS_VIDEO_ON        = 1 << 3,  /**< Video is playing */
     MDS_VPP_CHANGED     = 1 << 4,  /**< VPP status is changed */
+    MDS_OVERLAY_BYPASS  = 1 << 5,  /**< A video can bypass composition, @see MDSOverlayConfig */
 } MDS_DISPLAY_MODE;
 
+/**
+ * @brief The video post processing which helps the output display,
+ * decided by MDS from the playing video, the display mode and the
+ * power save state, @see updatePowerSaveState
+ */
+typedef enum {
+    MDS_VPP_NONE        = 0,
+    MDS_VPP_DEINTERLACE = 1,       /**< interlaced content */
+    MDS_VPP_FRC         = 1 << 1,  /**< low frame rate content on the panel */
+    MDS_VPP_SCALING     = 1 << 2,  /**< SD content on an external display */
+} MDS_VPP_POLICY;
+
+/** @brief Decoder output configuration of a video session */
+typedef struct {
+    int32_t width;
+    int32_t height;
+    int32_t offX;
+    int32_t offY;
+    int32_t bufWidth;
+    int32_t bufHeight;
+} MDSDecoderConfig;
+
+/** @brief An active video session in a state snapshot */
+typedef struct {
+    int32_t            sessionId;
+    MDS_VIDEO_STATE    state;
+    bool               infoValid;          /**< info is valid */
+    MDSVideoSourceInfo info;
+    bool               decoderConfigValid; /**< decoderConfig is valid */
+    MDSDecoderConfig   decoderConfig;
+} MDSVideoSessionSnapshot;
+
+/** @brief Every state of the information provider at once */
+typedef struct {
+    MDS_DISPLAY_MODE        mode;
+    uint32_t                vppState;
+    uint32_t                vppPolicy;     /**< @see MDS_VPP_POLICY */
+    MDSOverlayConfig        overlays[MDS_OVERLAY_PLANE_MAX];
+    int32_t                 sessionNumber; /**< valid entries in sessions */
+    MDSVideoSessionSnapshot sessions[MDS_VIDEO_SESSION_MAX_VALUE];
+} MDSStateSnapshot;
+
 class IMultiDisplayInfoProvider : public IInterface {
 public:
     DECLARE_META_INTERFACE(MultiDisplayInfoProvider);
@@ -69,10 +113,8 @@ public:
 
     /**
      * @brife Get display mode
-     * @param wait "ture" means this interface will be blocked
-     *             until getting an accurate mode,
-     *             "false" means it will return immediatly,
-     *             but couldn't ensure the mode is right.
+     * @param wait kept for compatibility, the current mode is
+     *             always returned without blocking.
      * @return: @see MDS_DISPLAY_MODE
      */
     virtual MDS_DISPLAY_MODE getDisplayMode(bool wait) = 0;
@@ -80,8 +122,10 @@ public:
     /**
      * @brief Get the decoder configure
      * @param
-     *         int videoSessionId: Video Session id,
-     *                             for support multiple decoder configure.
+     *         int videoSessionId: Video Session id, each session has its
+     *                             own decoder configure. -1, or a session
+     *                             without one, gives the first configured
+     *                             session.
      *         int32_t* width:      the width  of decoder output
      *         int32_t* height:     the height of decoder output
      * @return @see status_t in <utils/Errors.h>
@@ -98,6 +142,22 @@ public:
      * @return @see VPP_SETTING_STATUS in VPPSetting.h
      */
      virtual uint32_t getVppState() = 0;
+
+    /**
+     * @brief Get the read-only ashmem page where MDS publishes its state
+     * @param
+     * @return @see MDSStatePage in MultiDisplayStatePage.h,
+     *         NULL if the service does not publish it
+     */
+     virtual sp<IMemoryHeap> getStatePage() = 0;
+
+    /**
+     * @brief Get the mode, the vpp state and all the active video sessions
+     *        in one transaction
+     * @param snapshot @see MDSStateSnapshot
+     * @return @see status_t in <utils/Errors.h>
+     */
+     virtual status_t getStateSnapshot(MDSStateSnapshot* snapshot) = 0;
 };
 
 
@@ -30,7 +30,12 @@ namespace intel {
 
 /** @brief The messages MDS broadcasts to listeners */
 typedef enum {
-    MDS_MSG_MODE_CHANGE = 1 << 1,
+    MDS_MSG_MODE_CHANGE   = 1 << 1,
+    // The content of the Widi virtual display, a MDSVideoContentInfo
+    MDS_MSG_VIDEO_CONTENT = 1 << 3,
+    // Not a message, a flag of the registration: the listener gets its
+    // messages through onMdsMessage, and MDS waits for each reply
+    MDS_MSG_FLAG_SYNC     = 1 << 30,
 } MDS_MESSAGE;
 
 class IMultiDisplayListener : public IInterface
@@ -41,6 +46,14 @@ public:
     // onMdsMessage is called by MultiDisplay Service
     // to notify the message to registered listeners.
     virtual status_t onMdsMessage(int msg, void* value, int size) = 0;
+
+    // The oneway form MDS uses unless the listener registered with
+    // MDS_MSG_FLAG_SYNC: MDS does not wait for the listener, whose reply
+    // is dropped. seq counts the messages of this listener, from 1, and
+    // skips the ones a newer message replaced in the queue, so that a gap
+    // tells the listener that it missed updates. By default it calls
+    // onMdsMessage.
+    virtual status_t notifyMdsMessage(int msg, void* value, int size, uint32_t seq);
 };
 
 class BnMultiDisplayListener : public BnInterface<IMultiDisplayListener>
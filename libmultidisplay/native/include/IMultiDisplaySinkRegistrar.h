@@ -39,7 +39,9 @@ public:
      * polling method.
      * @param listener: inherit and implement IMultiDisplayListener.
      * @param name: client name, ensure it is not a null pointer
-     * @param msg: messge type, @see MDS_MESSAGE in MultiDisplayType.h
+     * @param msg: messge type, @see MDS_MESSAGE in MultiDisplayType.h,
+     *        or'ed with MDS_MSG_FLAG_SYNC to get the messages through
+     *        the synchronous onMdsMessage instead of notifyMdsMessage
      * @return: return a listener Id
      *          >= 0 indicate a valid listenner
      *          <  0 indicate an invalid listener
@@ -58,6 +58,17 @@ public:
      * @return @see status_t in <utils/Errors.h>
      */
     virtual status_t updateVideoSourceInfo(int sessionId, const MDSVideoSourceInfo& info) = 0;
+
+    /**
+     * @brief Allocate a session if needed, update its info and state in one call
+     * @param sessionId, the session to update, a new session is allocated if it is < 0,
+     *        and its id returned here
+     * @param state @see MDS_VIDEO_STATE in MultiDisplayType.h
+     * @param info the video playback info, NULL to keep the current one
+     * @return @see status_t in <utils/Errors.h>
+     */
+    virtual status_t updateVideoSession(int32_t* sessionId,
+            MDS_VIDEO_STATE state, const MDSVideoSourceInfo* info) = 0;
 };
 
 class BnMultiDisplayVideoControl : public BnInterface<IMultiDisplayVideoControl> {
@@ -74,6 +74,11 @@ public:
     static char* const getServiceName() { return INTEL_MDS_SERVICE_NAME; }
     static void instantiate();
 
+    // Call counts and latencies of the APIs, of the composer locks and
+    // of the hotplug stages, "reset" clears them after the dump,
+    // then the last composer events, @see MultiDisplayEventLog
+    virtual status_t dump(int fd, const Vector<String16>& args);
+
     virtual sp<IMultiDisplayHdmiControl>         getHdmiControl();
     virtual sp<IMultiDisplayVideoControl>        getVideoControl();
     virtual sp<IMultiDisplayEventMonitor>        getEventMonitor();
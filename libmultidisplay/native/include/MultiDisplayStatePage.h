@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: tianyang.zhu@intel.com
+ */
+
+#ifndef __ANDROID_INTEL_MULTIDISPLAY_STATEPAGE_H__
+#define __ANDROID_INTEL_MULTIDISPLAY_STATEPAGE_H__
+
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <utils/RefBase.h>
+#include <cutils/atomic.h>
+#include <binder/IMemory.h>
+
+#include <display/MultiDisplayType.h>
+
+namespace android {
+namespace intel {
+
+/** @brief The state of a video session in the state page */
+typedef struct {
+    int32_t            state;        /**< @see MDS_VIDEO_STATE */
+    int32_t            idGeneration; /**< generation of the current session ID */
+    int32_t            infoValid;    /**< 1: info is valid */
+    MDSVideoSourceInfo info;
+} MDSVideoSessionState;
+
+/** @brief The HDMI state in the state page */
+typedef struct {
+    int32_t       timingVersion; /**< @see getHdmiTimings, 0: not connected */
+    int32_t       timingCount;   /**< @see getHdmiTimingCount */
+    int32_t       timingFixed;   /**< @see checkHdmiTimingIsFixed */
+    int32_t       currentValid;  /**< 1: current is valid */
+    MDSHdmiTiming current;       /**< @see getCurrentHdmiTiming */
+    int32_t       audioValid;    /**< 1: audio is valid */
+    MDSHdmiAudioCaps audio;      /**< published before the audio hotplug */
+} MDSHdmiState;
+
+/**
+ * @brief The MDS state published in an ashmem page, read-only for clients
+ * The service increments generation before and after each update,
+ * so it is odd while the page is being written, and a reader knows
+ * the state has changed when the generation is not the one it read.
+ */
+typedef struct {
+    volatile int32_t     generation;
+    int32_t              mode;          /**< @see MDS_DISPLAY_MODE */
+    uint32_t             vppState;      /**< @see getVppState */
+    uint32_t             vppPolicy;     /**< @see MDS_VPP_POLICY */
+    MDSOverlayConfig     overlays[MDS_OVERLAY_PLANE_MAX]; /**< @see MDS_OVERLAY_BYPASS */
+    MDSHdmiState         hdmi;
+    int32_t              sessionNumber; /**< @see getVideoSessionNumber */
+    MDSVideoSessionState sessions[MDS_VIDEO_SESSION_MAX_VALUE];
+} MDSStatePage;
+
+/**
+ * @brief Client side access to the state page, without any IPC once mapped
+ */
+class MultiDisplayStateReader {
+private:
+    sp<IMemoryHeap>     mHeap;
+    const MDSStatePage* mPage;
+public:
+    MultiDisplayStateReader() : mPage(NULL) {}
+
+    bool map(const sp<IMemoryHeap>& heap) {
+        if (heap == NULL || heap->getBase() == MAP_FAILED ||
+                heap->getSize() < sizeof(MDSStatePage))
+            return false;
+        mHeap = heap;
+        mPage = (const MDSStatePage*)heap->getBase();
+        return true;
+    }
+    inline bool isMapped() const {
+        return mPage != NULL;
+    }
+    inline int32_t getGeneration() const {
+        return android_atomic_acquire_load(&mPage->generation);
+    }
+    // Copy a consistent snapshot of the page
+    void read(MDSStatePage* snapshot) const {
+        read(mPage, snapshot, mPage, sizeof(MDSStatePage));
+    }
+    // Copy a consistent snapshot of a part of the page, e.g. a session
+    static void read(const MDSStatePage* page,
+            void* dst, const void* src, size_t size) {
+        while (true) {
+            int32_t generation = android_atomic_acquire_load(&page->generation);
+            if (generation & 1) {
+                // The service is updating the page
+                sched_yield();
+                continue;
+            }
+            memcpy(dst, src, size);
+            android_memory_barrier();
+            if (android_atomic_acquire_load(&page->generation) == generation)
+                return;
+        }
+    }
+};
+
+}; // namespace intel
+}; // namespace android
+
+#endif
@@ -27,6 +27,8 @@ namespace intel {
 
 
 static const int MDS_VIDEO_SESSION_MAX_VALUE = 16;
+/** Overlay planes of the external display, the first one is the main video */
+static const int MDS_OVERLAY_PLANE_MAX = 2;
 
 /** @brief The display ID */
 typedef enum {
@@ -54,6 +56,19 @@ typedef struct {
     uint32_t    flags;      /**< expended flag */
 } MDSHdmiTiming;
 
+/**
+ * @brief Audio capability of the HDMI sink, from the short audio
+ * descriptors and the speaker allocation of its EDID, so that the audio
+ * HAL configures the output without reading the EDID again
+ */
+typedef struct {
+    int32_t     formats;     /**< bit n: CEA audio format code n, bit 1 is LPCM */
+    int32_t     maxChannels; /**< of LPCM */
+    int32_t     sampleRates; /**< of LPCM, bits 0-6: 32, 44.1, 48, 88.2, 96, 176.4, 192kHz */
+    int32_t     sampleSizes; /**< of LPCM, bits 0-2: 16, 20, 24 bits */
+    int32_t     speakers;    /**< CEA speaker allocation */
+} MDSHdmiAudioCaps;
+
 /** @brief The state of video playback
  * 2 state machines for clear content and proteced content
  * Clear content:     UNPREPARED->PREPARED->UNPREPARED->UNPREPARED
@@ -68,6 +83,42 @@ typedef enum {
     MDS_VIDEO_UNPREPARED    = 4,
 } MDS_VIDEO_STATE;
 
+/**
+ * @brief Scan out of a decoder buffer on an overlay plane of the external
+ * display in extended mode, computed by MDS from the decoder output,
+ * the HDMI timing and the scaling type. The largest playing video gets
+ * the first plane, scaled as the scaling type tells, the next one is
+ * shown as a picture-in-picture on the second plane.
+ */
+typedef struct {
+    int32_t sessionId;   /**< the session of the buffer, -1 if there is no bypass */
+    int32_t cropX;       /**< the source rectangle in the decoder buffer */
+    int32_t cropY;
+    int32_t cropWidth;
+    int32_t cropHeight;
+    int32_t dstX;        /**< the destination rectangle on the external display */
+    int32_t dstY;
+    int32_t dstWidth;
+    int32_t dstHeight;
+} MDSOverlayConfig;
+
+/** @brief What the virtual display mirrors, @see MDSVideoContentInfo */
+typedef enum {
+    MDS_CONTENT_UI              = 0, /**< no video, frames only change with the UI */
+    MDS_CONTENT_VIDEO           = 1,
+    MDS_CONTENT_PROTECTED_VIDEO = 2,
+} MDS_CONTENT_TYPE;
+
+/**
+ * @brief The content of the Widi virtual display, so that the sink encodes
+ * at the native rate of the video, and skips the unchanged frames of the UI
+ */
+typedef struct {
+    int32_t contentType; /**< @see MDS_CONTENT_TYPE */
+    int32_t frameRate;   /**< of the video, 0 for the UI */
+    int32_t sessionId;   /**< the video session, -1 for the UI */
+} MDSVideoContentInfo;
+
 /** @brief The scaling type @see SurfaceFligner.h */
 typedef enum {
     MDS_SCALING_NONE        = 0,
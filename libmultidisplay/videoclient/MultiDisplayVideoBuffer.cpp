@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+//#define LOG_NDEBUG 0
+
+#include <utils/Log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "linux/psb_drm.h"
+#include "drm/psb_ttm_placement_user.h"
+#include "xf86drm.h"
+
+#include <display/MultiDisplayVideoBuffer.h>
+
+namespace android {
+namespace intel {
+
+#define DRM_DEVICE_NAME         "/dev/card0"
+#define TTM_PLACEMENT_EXT       "psb_ttm_placement_alphadrop"
+#define VIDEO_GETPARAM_EXT      "lnc_video_getparam"
+#define VIDEO_BUFFER_PAGE_SIZE  4096
+
+// Tiled MMU heap the display scans out, never evicted while it may be shown
+#define VIDEO_BUFFER_PLACEMENT \
+    (DRM_PSB_FLAG_MEM_MMU_TILING | TTM_PL_FLAG_WC | \
+     TTM_PL_FLAG_SHARED | TTM_PL_FLAG_NO_EVICT)
+
+MultiDisplayVideoBuffer::MultiDisplayVideoBuffer()
+    : mFd(-1),
+      mTtmOffset(0),
+      mVideoOffset(0),
+      mCount(0) {
+    memset(mBuffers, 0, sizeof(mBuffers));
+}
+
+MultiDisplayVideoBuffer::~MultiDisplayVideoBuffer() {
+    release();
+    if (mFd >= 0)
+        close(mFd);
+}
+
+status_t MultiDisplayVideoBuffer::getExtension(const char* name, uint32_t* offset) {
+    union drm_psb_extension_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    strncpy(arg.extension, name, sizeof(arg.extension) - 1);
+    int ret = drmCommandWriteRead(mFd, DRM_PSB_EXTENSION, &arg, sizeof(arg));
+    if (ret != 0 || !arg.rep.exists) {
+        ALOGE("%s: No %s extension, %d", __func__, name, ret);
+        return NAME_NOT_FOUND;
+    }
+    *offset = arg.rep.driver_ioctl_offset;
+    return NO_ERROR;
+}
+
+status_t MultiDisplayVideoBuffer::init() {
+    Mutex::Autolock _l(mLock);
+    if (mFd >= 0)
+        return NO_ERROR;
+    int fd = open(DRM_DEVICE_NAME, O_RDWR, 0);
+    if (fd < 0) {
+        ALOGE("%s: Failed to open %s, %s", __func__, DRM_DEVICE_NAME, strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+    mFd = fd;
+    if (getExtension(TTM_PLACEMENT_EXT, &mTtmOffset) != NO_ERROR ||
+            getExtension(VIDEO_GETPARAM_EXT, &mVideoOffset) != NO_ERROR) {
+        close(mFd);
+        mFd = -1;
+        return NAME_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
+
+status_t MultiDisplayVideoBuffer::createBuffer_l(uint32_t size, Buffer* buffer) {
+    union ttm_pl_create_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.req.size = (size + VIDEO_BUFFER_PAGE_SIZE - 1) & ~(VIDEO_BUFFER_PAGE_SIZE - 1);
+    arg.req.placement = VIDEO_BUFFER_PLACEMENT;
+    arg.req.page_alignment = 1;
+    int ret = drmCommandWriteRead(mFd, mTtmOffset + TTM_PL_CREATE, &arg, sizeof(arg));
+    if (ret != 0) {
+        ALOGE("%s: Failed to create a scanout buffer of %u bytes, %d", __func__, size, ret);
+        return NO_MEMORY;
+    }
+    buffer->handle    = arg.rep.handle;
+    buffer->gpuOffset = arg.rep.gpu_offset;
+    buffer->size      = arg.rep.bo_size;
+    buffer->mapHandle = arg.rep.map_handle;
+    buffer->cpu       = NULL;
+    return NO_ERROR;
+}
+
+void MultiDisplayVideoBuffer::destroyBuffer_l(Buffer* buffer) {
+    if (buffer->cpu != NULL)
+        munmap(buffer->cpu, buffer->size);
+    struct ttm_pl_reference_req arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.handle = buffer->handle;
+    drmCommandWrite(mFd, mTtmOffset + TTM_PL_UNREF, &arg, sizeof(arg));
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+status_t MultiDisplayVideoBuffer::allocate(int count, uint32_t size) {
+    if (count <= 0 || count > MDS_VIDEO_BUFFER_MAX || size == 0)
+        return BAD_VALUE;
+    Mutex::Autolock _l(mLock);
+    if (mFd < 0)
+        return NO_INIT;
+    while (mCount > 0)
+        destroyBuffer_l(&mBuffers[--mCount]);
+    for (; mCount < count; mCount++) {
+        status_t result = createBuffer_l(size, &mBuffers[mCount]);
+        if (result != NO_ERROR) {
+            while (mCount > 0)
+                destroyBuffer_l(&mBuffers[--mCount]);
+            return result;
+        }
+    }
+    ALOGV("%s: %d scanout buffers of %u bytes", __func__, count, size);
+    return NO_ERROR;
+}
+
+void MultiDisplayVideoBuffer::release() {
+    Mutex::Autolock _l(mLock);
+    while (mCount > 0)
+        destroyBuffer_l(&mBuffers[--mCount]);
+}
+
+int MultiDisplayVideoBuffer::getBufferCount() {
+    Mutex::Autolock _l(mLock);
+    return mCount;
+}
+
+status_t MultiDisplayVideoBuffer::getBuffer(int index,
+        uint32_t* handle, uint64_t* gpuOffset) {
+    Mutex::Autolock _l(mLock);
+    if (index < 0 || index >= mCount)
+        return BAD_INDEX;
+    if (handle != NULL)
+        *handle = mBuffers[index].handle;
+    if (gpuOffset != NULL)
+        *gpuOffset = mBuffers[index].gpuOffset;
+    return NO_ERROR;
+}
+
+status_t MultiDisplayVideoBuffer::lock(int index, bool write, void** cpu) {
+    Mutex::Autolock _l(mLock);
+    if (index < 0 || index >= mCount || cpu == NULL)
+        return BAD_VALUE;
+    Buffer* buffer = &mBuffers[index];
+    if (buffer->cpu == NULL) {
+        // Only mapped on the first CPU access, the decoder rarely needs one
+        void* addr = mmap64(NULL, buffer->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, mFd, (off64_t)buffer->mapHandle);
+        if (addr == MAP_FAILED) {
+            ALOGE("%s: Failed to map buffer %d, %s", __func__, index, strerror(errno));
+            return NO_MEMORY;
+        }
+        buffer->cpu = addr;
+    }
+    struct ttm_pl_synccpu_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.handle = buffer->handle;
+    arg.access_mode = TTM_PL_SYNCCPU_MODE_READ |
+        (write ? TTM_PL_SYNCCPU_MODE_WRITE : 0);
+    arg.op = ttm_pl_synccpu_arg::TTM_PL_SYNCCPU_OP_GRAB;
+    int ret = drmCommandWrite(mFd, mTtmOffset + TTM_PL_SYNCCPU, &arg, sizeof(arg));
+    if (ret != 0) {
+        ALOGE("%s: Failed to grab buffer %d, %d", __func__, index, ret);
+        return UNKNOWN_ERROR;
+    }
+    *cpu = buffer->cpu;
+    return NO_ERROR;
+}
+
+status_t MultiDisplayVideoBuffer::unlock(int index) {
+    Mutex::Autolock _l(mLock);
+    if (index < 0 || index >= mCount)
+        return BAD_VALUE;
+    struct ttm_pl_synccpu_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.handle = mBuffers[index].handle;
+    arg.access_mode = TTM_PL_SYNCCPU_MODE_READ | TTM_PL_SYNCCPU_MODE_WRITE;
+    arg.op = ttm_pl_synccpu_arg::TTM_PL_SYNCCPU_OP_RELEASE;
+    int ret = drmCommandWrite(mFd, mTtmOffset + TTM_PL_SYNCCPU, &arg, sizeof(arg));
+    return ret == 0 ? NO_ERROR : UNKNOWN_ERROR;
+}
+
+status_t MultiDisplayVideoBuffer::flip(int index, const MDSVideoFrameLayout& layout) {
+    Mutex::Autolock _l(mLock);
+    if (index < 0 || index >= mCount)
+        return BAD_VALUE;
+    Buffer* buffer = &mBuffers[index];
+    if (layout.lumaOffset >= buffer->size || layout.chromaOffset >= buffer->size)
+        return BAD_VALUE;
+
+    // The display must not scan out a frame the decoder is still writing
+    struct ttm_pl_waitidle_arg idle;
+    memset(&idle, 0, sizeof(idle));
+    idle.handle = buffer->handle;
+    idle.mode = TTM_PL_WAITIDLE_MODE_LAZY;
+    int ret = drmCommandWrite(mFd, mTtmOffset + TTM_PL_WAITIDLE, &idle, sizeof(idle));
+    if (ret != 0) {
+        ALOGE("%s: Failed to wait for buffer %d, %d", __func__, index, ret);
+        return UNKNOWN_ERROR;
+    }
+
+    // NV12, both chroma planes are interleaved in one
+    struct drm_video_displaying_frameinfo info;
+    memset(&info, 0, sizeof(info));
+    info.buf_handle      = buffer->handle;
+    info.width           = layout.width;
+    info.height          = layout.height;
+    info.size            = buffer->size;
+    info.format          = layout.format;
+    info.luma_stride     = layout.lumaStride;
+    info.chroma_u_stride = layout.chromaStride;
+    info.chroma_v_stride = layout.chromaStride;
+    info.luma_offset     = layout.lumaOffset;
+    info.chroma_u_offset = layout.chromaOffset;
+    info.chroma_v_offset = layout.chromaOffset;
+
+    struct drm_lnc_video_getparam_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.key = IMG_VIDEO_SET_DISPLAYING_FRAME;
+    arg.value = (uint64_t)(uintptr_t)&info;
+    ret = drmCommandWriteRead(mFd, mVideoOffset, &arg, sizeof(arg));
+    if (ret != 0) {
+        ALOGE("%s: Failed to flip buffer %d, %d", __func__, index, ret);
+        return UNKNOWN_ERROR;
+    }
+    return NO_ERROR;
+}
+
+}; // namespace intel
+}; // namespace android
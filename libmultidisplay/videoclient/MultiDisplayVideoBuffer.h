@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2012-2013, Intel Corporation. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef __ANDROID_INTEL_MULTIDISPLAYVIDEOBUFFER_H__
+#define __ANDROID_INTEL_MULTIDISPLAYVIDEOBUFFER_H__
+
+#include <stdint.h>
+#include <utils/Errors.h>
+#include <utils/threads.h>
+
+namespace android {
+namespace intel {
+
+#define MDS_VIDEO_BUFFER_MAX 8
+
+/** @brief Layout of a decoded NV12 frame in its buffer */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;       /**< fourcc of the frame */
+    uint32_t lumaStride;
+    uint32_t chromaStride;
+    uint32_t lumaOffset;
+    uint32_t chromaOffset;
+} MDSVideoFrameLayout;
+
+/**
+ * @brief Scanout capable TTM buffers for the extended video mode
+ * The decoder writes its frames straight into these buffers, which
+ * are placed in the tiled MMU heap the display can scan out, and a
+ * frame is then flipped to the HDMI pipe without a blit through HWC.
+ * The buffers are shared, so that the VA context of the decoder can
+ * reference them by their handle.
+ */
+class MultiDisplayVideoBuffer {
+private:
+    struct Buffer {
+        uint32_t handle;
+        uint64_t gpuOffset;
+        uint64_t size;
+        uint64_t mapHandle;
+        void*    cpu;
+    };
+    Mutex    mLock;
+    int      mFd;
+    uint32_t mTtmOffset;
+    uint32_t mVideoOffset;
+    int      mCount;
+    Buffer   mBuffers[MDS_VIDEO_BUFFER_MAX];
+
+    status_t getExtension(const char* name, uint32_t* offset);
+    status_t createBuffer_l(uint32_t size, Buffer* buffer);
+    void destroyBuffer_l(Buffer* buffer);
+public:
+    MultiDisplayVideoBuffer();
+    ~MultiDisplayVideoBuffer();
+    // Opens the DRM device and finds the TTM and video ioctls
+    status_t init();
+    // Allocates count buffers of size bytes, releasing the previous ones
+    status_t allocate(int count, uint32_t size);
+    void release();
+    int getBufferCount();
+    // TTM handle and GPU offset of a buffer, for the decoder
+    status_t getBuffer(int index, uint32_t* handle, uint64_t* gpuOffset);
+    // CPU access to a buffer, synchronized with the GPU
+    status_t lock(int index, bool write, void** cpu);
+    status_t unlock(int index);
+    // Shows a decoded frame on the HDMI pipe, once the decoder is done with it
+    status_t flip(int index, const MDSVideoFrameLayout& layout);
+};
+
+}; // namespace intel
+}; // namespace android
+
+#endif
@@ -33,11 +33,16 @@
 namespace android {
 namespace intel {
 
+Mutex MultiDisplayVideoClient::sServiceLock;
+sp<IMDService> MultiDisplayVideoClient::sService;
+sp<IMultiDisplayVideoControl> MultiDisplayVideoClient::sVideo;
+sp<MultiDisplayVideoClient::DeathNotifier> MultiDisplayVideoClient::sDeathNotifier;
 
 MultiDisplayVideoClient::MultiDisplayVideoClient() {
     mSessionId = -1;
     mVideo = NULL;
     mState = MDS_VIDEO_UNPREPARED;
+    mInfoValid = false;
 };
 
 
@@ -46,7 +51,10 @@ MultiDisplayVideoClient::~MultiDisplayVideoClient() {
     close();
 };
 
+// Called with sServiceLock held
 sp<IMDService> MultiDisplayVideoClient::getService() {
+    if (sService != NULL)
+        return sService;
     sp<IServiceManager> sm = defaultServiceManager();
     if (sm == NULL) {
         ALOGW("%s: Failed to get service manager", __func__);
@@ -58,12 +66,35 @@ sp<IMDService> MultiDisplayVideoClient::getService() {
         ALOGW("%s: Failed to get MDS service", __func__);
         return NULL;
     }
+    if (sDeathNotifier == NULL)
+        sDeathNotifier = new DeathNotifier();
+    mds->asBinder()->linkToDeath(sDeathNotifier);
+    sService = mds;
     return mds;
 }
 
+sp<IMultiDisplayVideoControl> MultiDisplayVideoClient::getVideoControl() {
+    Mutex::Autolock _l(sServiceLock);
+    if (sVideo != NULL)
+        return sVideo;
+    sp<IMDService> mds = getService();
+    if (mds == NULL)
+        return NULL;
+    sVideo = mds->getVideoControl();
+    return sVideo;
+}
+
+void MultiDisplayVideoClient::DeathNotifier::binderDied(const wp<IBinder>& who) {
+    ALOGW("MDS died, drop the cached proxies");
+    Mutex::Autolock _l(sServiceLock);
+    sService = NULL;
+    sVideo = NULL;
+}
+
 void MultiDisplayVideoClient::close() {
     mSessionId = -1;
     mState = MDS_VIDEO_UNPREPARED;
+    mInfoValid = false;
     mVideo = NULL;
 }
 
@@ -84,15 +115,30 @@ status_t MultiDisplayVideoClient::prepare(int state, bool isProtected) {
         return UNKNOWN_ERROR;
     }
     if (mVideo == NULL) {
-        sp<IMDService> mds = getService();
-        if (mds == NULL) {
+        mVideo = getVideoControl();
+        if (mVideo == NULL) {
             return UNKNOWN_ERROR;
         }
-        mVideo = mds->getVideoControl();
     }
-    if (mSessionId < 0) {
-        mSessionId = mVideo->allocateVideoSessionId();
+    return NO_ERROR;
+}
+
+// One IPC: the session is allocated by the MDS if needed,
+// and the info is only sent when it has changed
+status_t MultiDisplayVideoClient::update(int state, const MDSVideoSourceInfo* info) {
+    if (info != NULL && mInfoValid &&
+            !memcmp(info, &mInfo, sizeof(MDSVideoSourceInfo)))
+        info = NULL;
+    int32_t sessionId = mSessionId;
+    mVideo->updateVideoSession(&sessionId, (MDS_VIDEO_STATE)state, info);
+    mSessionId = sessionId;
+    if (info != NULL) {
+        memcpy(&mInfo, info, sizeof(MDSVideoSourceInfo));
+        mInfoValid = true;
     }
+    if (state == MDS_VIDEO_UNPREPARED)
+        close();
+    mState = state;
     return NO_ERROR;
 }
 
@@ -101,8 +147,8 @@ status_t MultiDisplayVideoClient::setVideoState(int state,
     if (prepare(state, isProtected) != NO_ERROR)
         return UNKNOWN_ERROR;
 
+    MDSVideoSourceInfo info;
     if (state == MDS_VIDEO_PREPARED) {
-        MDSVideoSourceInfo info;
         memset(&info, 0, sizeof(MDSVideoSourceInfo));
         info.isProtected = isProtected;
         if (meta != NULL && meta.get() != NULL) {
@@ -116,24 +162,21 @@ status_t MultiDisplayVideoClient::setVideoState(int state,
                 info.displayH = 0;
             }
         }
-        mVideo->updateVideoSourceInfo(mSessionId, info);
         ALOGI("%s: Video source Info %d x %d @ %d fps", __func__,
                info.displayW, info.displayH, info.frameRate);
     }
-    mVideo->updateVideoState(mSessionId, (MDS_VIDEO_STATE)state);
-    if (state == MDS_VIDEO_UNPREPARED)
-        close();
-    mState = state;
-    return NO_ERROR;
+    return update(state, state == MDS_VIDEO_PREPARED ? &info : NULL);
 }
 
 status_t MultiDisplayVideoClient::setVideoState(int state,
         bool isProtected, const sp<AMessage> &msg) {
     if (prepare(state, isProtected) != NO_ERROR)
         return UNKNOWN_ERROR;
+    MDSVideoSourceInfo info;
+    bool hasInfo = false;
     if (state == MDS_VIDEO_PREPARED) {
         if (msg != NULL && msg.get() != NULL) {
-            MDSVideoSourceInfo info;
+            hasInfo = true;
             memset(&info, 0, sizeof(MDSVideoSourceInfo));
             info.isProtected = isProtected;
             bool success = msg->findInt32("frame-rate", &info.frameRate);
@@ -145,24 +188,15 @@ status_t MultiDisplayVideoClient::setVideoState(int state,
             success = msg->findInt32("height", &info.displayH);
             if (!success)
                 info.displayH = 0;
-            mVideo->updateVideoSourceInfo(mSessionId, info);
             ALOGI("%s: Video source Info %d x %d @ %d fps ", __func__,
                      info.displayW, info.displayH, info.frameRate);
         }
     }
-    mVideo->updateVideoState(mSessionId, (MDS_VIDEO_STATE)state);
-    if (state == MDS_VIDEO_UNPREPARED)
-        close();
-    mState = state;
-    return NO_ERROR;
+    return update(state, hasInfo ? &info : NULL);
 }
 
 status_t MultiDisplayVideoClient::reset() {
-    sp<IMDService> mds = getService();
-    if (mds == NULL) {
-        return UNKNOWN_ERROR;
-    }
-    sp<IMultiDisplayVideoControl> video = mds->getVideoControl();
+    sp<IMultiDisplayVideoControl> video = getVideoControl();
     if (video == NULL) {
         return UNKNOWN_ERROR;
     }
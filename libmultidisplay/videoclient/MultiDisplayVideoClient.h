@@ -21,6 +21,7 @@
 
 #include <utils/Errors.h>
 #include <utils/RefBase.h>
+#include <utils/threads.h>
 #include <binder/IInterface.h>
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/MetaData.h>
@@ -36,11 +37,27 @@ namespace intel {
 
 class MultiDisplayVideoClient : public RefBase {
 private:
+    // Drops the cached proxies when the MDS dies
+    class DeathNotifier : public IBinder::DeathRecipient {
+    public:
+        virtual void binderDied(const wp<IBinder>& who);
+    };
+    // Proxies shared by all the clients of the process
+    static Mutex sServiceLock;
+    static sp<IMDService> sService;
+    static sp<IMultiDisplayVideoControl> sVideo;
+    static sp<DeathNotifier> sDeathNotifier;
+
     int mSessionId;
     int mState;
+    // Last info sent to the MDS for this session
+    MDSVideoSourceInfo mInfo;
+    bool mInfoValid;
     sp<IMultiDisplayVideoControl> mVideo;
-    sp<IMDService> getService();
+    static sp<IMDService> getService();
+    static sp<IMultiDisplayVideoControl> getVideoControl();
     status_t prepare(int state, bool isProtected);
+    status_t update(int state, const MDSVideoSourceInfo* info);
     void close();
 public:
     MultiDisplayVideoClient();
@@ -0,0 +1,56 @@
+ifeq ($(TARGET_ARCH),x86)
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	mdp_bench.cpp
+
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../codecs \
+	$(TOP)/frameworks/base/include/media/stagefright/openmax
+
+# Count heap allocations made by the statically linked plugins as well.
+LOCAL_LDFLAGS := \
+	-Wl,--wrap=malloc \
+	-Wl,--wrap=calloc \
+	-Wl,--wrap=realloc
+
+LOCAL_WHOLE_STATIC_LIBRARIES := \
+	lib_stagefright_mdp_aacdec \
+	lib_stagefright_mdp_aacenc \
+	lib_stagefright_mdp_mp3dec \
+	lib_stagefright_mdp_vorbisdec \
+	lib_stagefright_mdp_wmadec \
+	lib_stagefright_mdp_amrnbdec \
+	lib_stagefright_mdp_amrnbenc \
+	lib_stagefright_mdp_amrwbdec \
+	lib_stagefright_mdp_amrwbenc
+
+LOCAL_STATIC_LIBRARIES := \
+	libmc_amrcommon \
+	libmc_aac_dec \
+	libmc_aac_enc \
+	libmc_mp3_dec \
+	libmc_vorbis_dec \
+	libmc_wma_dec \
+	libmc_gsmamr \
+	libmc_amrwb \
+	libmc_codec_common \
+	libmc_core
+
+LOCAL_SHARED_LIBRARIES := \
+	libstagefright \
+	libstagefright_foundation \
+	libbinder \
+	libutils \
+	libcutils \
+	libc \
+	libstdc++ \
+	libm
+
+LOCAL_MODULE := mdp_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+endif
@@ -0,0 +1,552 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// Standalone throughput benchmark for the MDP codec plugins.
+//
+//   mdp_bench <codec> <file> [iterations]
+//   mdp_bench --compare <codec> <file> [iterations]
+//
+// Decoders read the first audio track of <file> through MediaExtractor.
+// Encoders read <file> as raw 16 bit mono PCM at the codec sample rate.
+// Every read() of the plugin is timed; the report gives the speed in
+// multiples of real time, read() latency percentiles, peak RSS and heap
+// allocations per second, followed by the AUTO_TIMER and CodecStats dumps
+// of plugins built against the current media_codecs headers.
+//
+// --compare decodes the track through the plugin and through the AOSP
+// software decoder of the same type (OMX.google.*, run by mediaserver), and
+// reports for both the speed, the CPU time of the whole system (busy jiffies
+// of /proc/stat, which include mediaserver; an energy proxy as long as the
+// cpufreq governor keeps a fixed frequency) and how far their output is from
+// bit exact. It ends with the order the two decoders should have in
+// media_codecs.xml, the one using less CPU time first.
+
+#define LOG_TAG "mdp_bench"
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <media/stagefright/DataSource.h>
+#include <media/stagefright/FileSource.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaBufferGroup.h>
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaExtractor.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <media/stagefright/OMXClient.h>
+#include <media/stagefright/OMXCodec.h>
+#include <binder/ProcessState.h>
+#include <utils/Vector.h>
+
+#include "UMCMacro.h"
+#include "UMCPerfTracing.h"
+#include "UMCCodecStats.h"
+#include "UMCCpuDispatch.h"
+
+namespace android {
+FACTORY_CREATE_DECL(CIPAACDecoder)
+FACTORY_CREATE_DECL(CIPMP3Decoder)
+FACTORY_CREATE_DECL(CIPVorbisDecoder)
+FACTORY_CREATE_DECL(CIPWMADecoder)
+FACTORY_CREATE_DECL(CIPAMRNBDecoder)
+FACTORY_CREATE_DECL(CIPAMRWBDecoder)
+FACTORY_CREATE_ENCODER_DECL(CIPAACEncoder)
+FACTORY_CREATE_ENCODER_DECL(CIPAMRNBEncoder)
+FACTORY_CREATE_ENCODER_DECL(CIPAMRWBEncoder)
+}
+
+using namespace android;
+
+// Heap allocations made anywhere in the process, plugins included.
+static volatile int32_t gNumAllocations = 0;
+
+void *operator new(size_t size) {
+    __sync_fetch_and_add(&gNumAllocations, 1);
+    return malloc(size);
+}
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+void *operator new(size_t size, const std::nothrow_t &) throw() {
+    __sync_fetch_and_add(&gNumAllocations, 1);
+    return malloc(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &nt) throw() {
+    return operator new(size, nt);
+}
+void operator delete(void *p) throw() {
+    free(p);
+}
+void operator delete[](void *p) throw() {
+    free(p);
+}
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    __sync_fetch_and_add(&gNumAllocations, 1);
+    return __real_malloc(size);
+}
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    __sync_fetch_and_add(&gNumAllocations, 1);
+    return __real_calloc(nmemb, size);
+}
+void *__wrap_realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&gNumAllocations, 1);
+    return __real_realloc(ptr, size);
+}
+}
+
+// Feeds a raw 16 bit mono PCM file to an encoder, kNumSamplesPerRead at a time.
+struct RawPCMSource : public MediaSource {
+    enum { kNumSamplesPerRead = 1024 };
+
+    RawPCMSource(FILE *file, int32_t sampleRate)
+        :mFile(file)
+        ,mSampleRate(sampleRate)
+        ,mNumSamplesRead(0)
+        ,mBufferGroup(NULL)
+    {
+    }
+
+    virtual status_t start(MetaData *params) {
+        mBufferGroup = new MediaBufferGroup;
+        mBufferGroup->add_buffer(new MediaBuffer(kNumSamplesPerRead * sizeof(int16_t)));
+        mNumSamplesRead = 0;
+        fseek(mFile, 0, SEEK_SET);
+        return OK;
+    }
+
+    virtual status_t stop() {
+        SafeDelete(mBufferGroup);
+        return OK;
+    }
+
+    virtual sp<MetaData> getFormat() {
+        sp<MetaData> meta = new MetaData;
+        meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_AUDIO_RAW);
+        meta->setInt32(kKeyChannelCount, 1);
+        meta->setInt32(kKeySampleRate, mSampleRate);
+        return meta;
+    }
+
+    virtual status_t read(MediaBuffer **out, const ReadOptions *options) {
+        *out = NULL;
+        MediaBuffer *buffer;
+        status_t err = mBufferGroup->acquire_buffer(&buffer);
+        if (OK != err) {
+            return err;
+        }
+        size_t numRead = fread(buffer->data(), sizeof(int16_t), kNumSamplesPerRead, mFile);
+        if (0 == numRead) {
+            buffer->release();
+            return ERROR_END_OF_STREAM;
+        }
+        buffer->set_range(0, numRead * sizeof(int16_t));
+        buffer->meta_data()->clear();
+        buffer->meta_data()->setInt64(kKeyTime, mNumSamplesRead * US_PER_SECOND / mSampleRate);
+        mNumSamplesRead += numRead;
+        *out = buffer;
+        return OK;
+    }
+
+protected:
+    virtual ~RawPCMSource() {
+        stop();
+    }
+
+private:
+    FILE *mFile;
+    int32_t mSampleRate;
+    int64_t mNumSamplesRead;
+    MediaBufferGroup *mBufferGroup;
+};
+
+struct CodecEntry {
+    const char *name;
+    sp<MediaSource> (*makeDecoder)(const sp<MediaSource> &source);
+    sp<MediaSource> (*makeEncoder)(const sp<MediaSource> &source, const sp<MetaData> &meta);
+    const char *encoderMime;
+    int32_t encoderSampleRate;
+    int32_t encoderBitRate;
+    const char *component;          // names in media_codecs.xml, for --compare
+    const char *googleComponent;
+};
+
+static const CodecEntry kCodecs[] = {
+    { "aac",       MakeCIPAACDecoder,    NULL, NULL, 0, 0, "OMX.Intel.aac.decoder",    "OMX.google.aac.decoder" },
+    { "mp3",       MakeCIPMP3Decoder,    NULL, NULL, 0, 0, "OMX.Intel.mp3.decoder",    "OMX.google.mp3.decoder" },
+    { "vorbis",    MakeCIPVorbisDecoder, NULL, NULL, 0, 0, "OMX.Intel.vorbis.decoder", "OMX.google.vorbis.decoder" },
+    { "wma",       MakeCIPWMADecoder,    NULL, NULL, 0, 0, NULL, NULL },
+    { "amrnb",     MakeCIPAMRNBDecoder,  NULL, NULL, 0, 0, "OMX.Intel.amrnb.decoder",  "OMX.google.amrnb.decoder" },
+    { "amrwb",     MakeCIPAMRWBDecoder,  NULL, NULL, 0, 0, "OMX.Intel.amrwb.decoder",  "OMX.google.amrwb.decoder" },
+    { "aac-enc",   NULL, MakeCIPAACEncoder,   MEDIA_MIMETYPE_AUDIO_AAC,    16000, 32000, NULL, NULL },
+    { "amrnb-enc", NULL, MakeCIPAMRNBEncoder, MEDIA_MIMETYPE_AUDIO_AMR_NB, 8000,  12200, NULL, NULL },
+    { "amrwb-enc", NULL, MakeCIPAMRWBEncoder, MEDIA_MIMETYPE_AUDIO_AMR_WB, 16000, 23850, NULL, NULL },
+};
+
+static sp<MediaSource> OpenAudioTrack(const char *path) {
+    DataSource::RegisterDefaultSniffers();
+    sp<DataSource> dataSource = new FileSource(path);
+    if (OK != dataSource->initCheck()) {
+        return NULL;
+    }
+    sp<MediaExtractor> extractor = MediaExtractor::Create(dataSource);
+    if (NULL == extractor.get()) {
+        return NULL;
+    }
+    for (size_t i = 0; i < extractor->countTracks(); i++) {
+        const char *mime;
+        sp<MetaData> meta = extractor->getTrackMetaData(i);
+        if (meta->findCString(kKeyMIMEType, &mime) && !strncasecmp(mime, "audio/", 6)) {
+            return extractor->getTrack(i);
+        }
+    }
+    return NULL;
+}
+
+static int CompareTicks(const void *a, const void *b) {
+    long long lhs = *(const long long *)a;
+    long long rhs = *(const long long *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static long PeakRssKb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+static void Usage(const char *me) {
+    fprintf(stderr, "usage: %s <codec> <file> [iterations]\n"
+                    "       %s --compare <codec> <file> [iterations]\ncodecs:", me, me);
+    for (size_t i = 0; i < sizeof(kCodecs) / sizeof(kCodecs[0]); i++) {
+        fprintf(stderr, " %s", kCodecs[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+// Busy and total jiffies of all CPUs, from the first line of /proc/stat
+static bool SystemCpuJiffies(long long *busy, long long *total) {
+    FILE *file = fopen("/proc/stat", "r");
+    if (NULL == file) {
+        return false;
+    }
+    long long user, nice, system, idle, iowait, irq, softirq;
+    int n = fscanf(file, "cpu %lld %lld %lld %lld %lld %lld %lld",
+                   &user, &nice, &system, &idle, &iowait, &irq, &softirq);
+    fclose(file);
+    if (7 != n) {
+        return false;
+    }
+    *busy = user + nice + system + irq + softirq;
+    *total = *busy + idle + iowait;
+    return true;
+}
+
+// The CPU time is only an energy proxy at a fixed frequency
+static void CheckCpuGovernor() {
+    char governor[32] = "";
+    FILE *file = fopen("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", "r");
+    if (NULL != file) {
+        if (NULL == fgets(governor, sizeof(governor), file)) {
+            governor[0] = '\0';
+        }
+        fclose(file);
+    }
+    governor[strcspn(governor, "\n")] = '\0';
+    if (strcmp(governor, "performance") && strcmp(governor, "userspace")) {
+        printf("warning: cpufreq governor is '%s', CPU times are not at a fixed frequency\n", governor);
+    }
+}
+
+// One decoder of --compare
+struct CompareRun {
+    const char *component;
+    int64_t mediaUs;
+    double readUs;
+    double cpuMs;
+    Vector<int16_t> pcm;            // output of the first iteration
+};
+
+static bool RunDecoder(const char *path, bool google, const CodecEntry *codec,
+        const sp<IOMX> &omx, int iterations, CompareRun *run) {
+    run->component = google ? codec->googleComponent : codec->component;
+    run->mediaUs = 0;
+    run->readUs = 0;
+    run->cpuMs = 0;
+    run->pcm.clear();
+    long long busyBefore, totalBefore, busyAfter, totalAfter;
+
+    for (int it = 0; it < iterations; it++) {
+        sp<MediaSource> track = OpenAudioTrack(path);
+        if (NULL == track.get()) {
+            fprintf(stderr, "%s: no audio track\n", path);
+            return false;
+        }
+        sp<MediaSource> decoder = google
+                ? OMXCodec::Create(omx, track->getFormat(), false, track, codec->googleComponent)
+                : codec->makeDecoder(track);
+        if (NULL == decoder.get() || OK != decoder->start()) {
+            fprintf(stderr, "%s: failed to start\n", run->component);
+            return false;
+        }
+        int32_t sampleRate = 0;
+        int32_t numChannels = 1;
+        sp<MetaData> format = decoder->getFormat();
+        format->findInt32(kKeySampleRate, &sampleRate);
+        format->findInt32(kKeyChannelCount, &numChannels);
+
+        SystemCpuJiffies(&busyBefore, &totalBefore);
+        long long ticks = 0;
+        for (;;) {
+            MediaBuffer *buffer = NULL;
+            long long start = GET_TICKS();
+            status_t err = decoder->read(&buffer, NULL);
+            ticks += GET_TICKS() - start;
+            if (INFO_FORMAT_CHANGED == err) {
+                format = decoder->getFormat();
+                format->findInt32(kKeySampleRate, &sampleRate);
+                format->findInt32(kKeyChannelCount, &numChannels);
+                continue;
+            }
+            if (OK != err) {
+                break;
+            }
+            size_t numSamples = buffer->range_length() / sizeof(int16_t);
+            if (sampleRate > 0 && numChannels > 0) {
+                run->mediaUs += (int64_t)(numSamples / numChannels) * US_PER_SECOND / sampleRate;
+            }
+            if (0 == it) {
+                run->pcm.appendArray((const int16_t *)((const uint8_t *)buffer->data() + buffer->range_offset()),
+                                     numSamples);
+            }
+            buffer->release();
+        }
+        SystemCpuJiffies(&busyAfter, &totalAfter);
+        decoder->stop();
+
+        run->readUs += PerfTicksToUs(ticks);
+        run->cpuMs += (busyAfter - busyBefore) * 1000.0 / sysconf(_SC_CLK_TCK);
+    }
+    return true;
+}
+
+static int Compare(const CodecEntry *codec, const char *path, int iterations) {
+    if (NULL == codec->googleComponent) {
+        fprintf(stderr, "%s: no AOSP decoder to compare with\n", codec->name);
+        return 1;
+    }
+    ProcessState::self()->startThreadPool();
+    OMXClient client;
+    if (OK != client.connect()) {
+        fprintf(stderr, "failed to connect to the OMX service\n");
+        return 1;
+    }
+    CheckCpuGovernor();
+
+    CompareRun runs[2];
+    for (int i = 0; i < 2; i++) {
+        if (!RunDecoder(path, 1 == i, codec, client.interface(), iterations, &runs[i])) {
+            client.disconnect();
+            return 1;
+        }
+        const CompareRun &run = runs[i];
+        printf("%s: %.1f ms media, speed %.1fx real time, cpu %.1f ms (%.2f ms per second of media)\n",
+               run.component, run.mediaUs / 1000.0, run.readUs > 0 ? run.mediaUs / run.readUs : 0.0,
+               run.cpuMs, run.mediaUs > 0 ? run.cpuMs * 1e6 / run.mediaUs : 0.0);
+    }
+    client.disconnect();
+
+    // Both decoders put out 16 bit PCM of the same layout
+    const Vector<int16_t> &a = runs[0].pcm;
+    const Vector<int16_t> &b = runs[1].pcm;
+    size_t n = (a.size() < b.size()) ? a.size() : b.size();
+    size_t numDiffering = 0;
+    int maxDiff = 0;
+    for (size_t i = 0; i < n; i++) {
+        int diff = abs((int)a[i] - (int)b[i]);
+        if (diff) {
+            numDiffering++;
+            if (diff > maxDiff) {
+                maxDiff = diff;
+            }
+        }
+    }
+    if (0 == numDiffering && a.size() == b.size()) {
+        printf("output: bit exact, %d samples\n", (int)n);
+    } else {
+        printf("output: %d of %d samples differ, max difference %d, lengths %d and %d\n",
+               (int)numDiffering, (int)n, maxDiff, (int)a.size(), (int)b.size());
+    }
+
+    // Per second of media, the iterations may not decode the same length
+    double cost0 = runs[0].mediaUs > 0 ? runs[0].cpuMs / runs[0].mediaUs : 0.0;
+    double cost1 = runs[1].mediaUs > 0 ? runs[1].cpuMs / runs[1].mediaUs : 0.0;
+    int first = (cost1 < cost0) ? 1 : 0;
+    printf("rank: %s before %s\n", runs[first].component, runs[1 - first].component);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *me = argv[0];
+    bool compare = (argc > 1 && !strcmp(argv[1], "--compare"));
+    if (compare) {
+        argc--;
+        argv++;
+    }
+    if (argc < 3) {
+        Usage(me);
+        return 1;
+    }
+    const CodecEntry *codec = NULL;
+    for (size_t i = 0; i < sizeof(kCodecs) / sizeof(kCodecs[0]); i++) {
+        if (!strcmp(argv[1], kCodecs[i].name)) {
+            codec = &kCodecs[i];
+        }
+    }
+    if (NULL == codec) {
+        Usage(me);
+        return 1;
+    }
+    int iterations = (argc > 3) ? atoi(argv[3]) : 1;
+    if (compare) {
+        return Compare(codec, argv[2], iterations > 0 ? iterations : 1);
+    }
+
+    FILE *pcmFile = NULL;
+    Vector<long long> readTicks;
+    int64_t mediaUs = 0;
+    long long totalTicks = 0;
+    int32_t allocationsBefore = gNumAllocations;
+
+    for (int it = 0; it < iterations; it++) {
+        sp<MediaSource> plugin;
+        int32_t sampleRate = 0;
+        int32_t numChannels = 1;
+        if (NULL != codec->makeDecoder) {
+            sp<MediaSource> track = OpenAudioTrack(argv[2]);
+            if (NULL == track.get()) {
+                fprintf(stderr, "%s: no audio track\n", argv[2]);
+                return 1;
+            }
+            plugin = codec->makeDecoder(track);
+        } else {
+            if (NULL == pcmFile && NULL == (pcmFile = fopen(argv[2], "rb"))) {
+                perror(argv[2]);
+                return 1;
+            }
+            sp<MetaData> meta = new MetaData;
+            meta->setCString(kKeyMIMEType, codec->encoderMime);
+            meta->setInt32(kKeySampleRate, codec->encoderSampleRate);
+            meta->setInt32(kKeyChannelCount, 1);
+            meta->setInt32(kKeyBitRate, codec->encoderBitRate);
+            plugin = codec->makeEncoder(new RawPCMSource(pcmFile, codec->encoderSampleRate), meta);
+            sampleRate = codec->encoderSampleRate;
+        }
+        if (NULL == plugin.get() || OK != plugin->start()) {
+            fprintf(stderr, "%s: failed to start plugin\n", codec->name);
+            return 1;
+        }
+        sp<MetaData> format = plugin->getFormat();
+        if (NULL != codec->makeDecoder && NULL != format.get()) {
+            format->findInt32(kKeySampleRate, &sampleRate);
+            format->findInt32(kKeyChannelCount, &numChannels);
+        }
+
+        int64_t lastTimeUs = 0;
+        for (;;) {
+            MediaBuffer *buffer = NULL;
+            long long start = GET_TICKS();
+            status_t err = plugin->read(&buffer, NULL);
+            long long ticks = GET_TICKS() - start;
+            if (INFO_FORMAT_CHANGED == err) {
+                format = plugin->getFormat();
+                format->findInt32(kKeySampleRate, &sampleRate);
+                format->findInt32(kKeyChannelCount, &numChannels);
+                continue;
+            }
+            if (OK != err) {
+                break;
+            }
+            readTicks.push(ticks);
+            totalTicks += ticks;
+            if (NULL != codec->makeDecoder) {
+                if (sampleRate > 0 && numChannels > 0) {
+                    mediaUs += (int64_t)(buffer->range_length() / (sizeof(int16_t) * numChannels))
+                               * US_PER_SECOND / sampleRate;
+                }
+            } else {
+                int64_t timeUs;
+                if (buffer->meta_data()->findInt64(kKeyTime, &timeUs)) {
+                    lastTimeUs = timeUs;
+                }
+            }
+            buffer->release();
+        }
+        if (NULL == codec->makeDecoder) {
+            // Encoder output times are frame starts, one frame is 20 ms.
+            mediaUs += lastTimeUs + 20000;
+        }
+        plugin->stop();
+    }
+    int32_t numAllocations = gNumAllocations - allocationsBefore;
+
+    if (readTicks.isEmpty()) {
+        fprintf(stderr, "%s: no output\n", codec->name);
+        return 1;
+    }
+    qsort(readTicks.editArray(), readTicks.size(), sizeof(long long), CompareTicks);
+    size_t n = readTicks.size();
+    double readUs = PerfTicksToUs(totalTicks);
+
+    printf("%s: %d iteration(s), %d reads, %.1f ms media in %.1f ms of read()\n",
+           codec->name, iterations, (int)n, mediaUs / 1000.0, readUs / 1000.0);
+    printf("speed: %.1fx real time\n", readUs > 0 ? mediaUs / readUs : 0.0);
+    UMCCpuFeatures features;
+    UMCGetCpuFeatures(&features);
+    printf("kernels: %s\n", UMCCpuDispatchName(features));
+    printf("read() latency us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+           PerfTicksToUs(readTicks[n / 2]), PerfTicksToUs(readTicks[n * 9 / 10]),
+           PerfTicksToUs(readTicks[n * 99 / 100]), PerfTicksToUs(readTicks[n - 1]));
+    printf("peak rss: %ld kB\n", PeakRssKb());
+    printf("allocations: %d (%.1f per second of media)\n",
+           numAllocations, mediaUs > 0 ? numAllocations * 1e6 / mediaUs : 0.0);
+
+    fflush(stdout);
+    GlobalTimer::DumpAll(STDOUT_FILENO);
+    CodecStats::DumpAll(STDOUT_FILENO);
+
+    if (NULL != pcmFile) {
+        fclose(pcmFile);
+    }
+    return 0;
+}
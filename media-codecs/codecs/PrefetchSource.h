@@ -0,0 +1,203 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef PREFETCH_SOURCE_H_
+#define PREFETCH_SOURCE_H_
+
+#include <pthread.h>
+
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+#include "UMCMacro.h"
+
+namespace android {
+
+// Warms up the decoder of the next track while the current one is playing.
+//
+// prefetch() runs start() and the first read()s of the wrapped decoder on a
+// background thread, at background priority: codec init, first frame decode,
+// the format check (INFO_FORMAT_CHANGED) and the encoder delay skip are all
+// done by the time the previous track ends. start() then only waits for the
+// warm-up to finish, and the first read()s return the prefetched results.
+// Without prefetch() the wrapper behaves like the decoder itself. When
+// prefetching, the params passed to start() are ignored in favour of those
+// given to prefetch().
+//
+// Use it through FACTORY_CREATE_IMPL_PREFETCH in UMCMacro.h.
+struct PrefetchSource : public MediaSource {
+    enum { kMaxPrefetchReads = 4 };
+
+    PrefetchSource(const sp<MediaSource> &source)
+        :mSource(source)
+        ,mState(IDLE)
+        ,mStartStatus(OK)
+    {
+    }
+
+    // Starts warming up the decoder, params are those start() will get.
+    status_t prefetch(MetaData *params) {
+        Mutex::Autolock autoLock(mLock);
+        if (IDLE != mState) {
+            return INVALID_OPERATION;
+        }
+        mParams.clear();
+        if (NULL != params) {
+            mParams = new MetaData(*params);
+        }
+        if (0 != pthread_create(&mThread, NULL, ThreadWrapper, this)) {
+            LOGE("PrefetchSource: failed to create prefetch thread");
+            return NO_MEMORY;
+        }
+        mState = PREFETCHING;
+        return OK;
+    }
+
+    virtual status_t start(MetaData *params) {
+        Mutex::Autolock autoLock(mLock);
+        if (PREFETCHING == mState) {
+            mLock.unlock();
+            pthread_join(mThread, NULL);
+            mLock.lock();
+            // The params of the prefetch() call are the ones in effect.
+            mState = (OK == mStartStatus) ? STARTED : IDLE;
+            return mStartStatus;
+        }
+        if (IDLE != mState) {
+            return UNKNOWN_ERROR;
+        }
+        status_t err = mSource->start(params);
+        if (OK == err) {
+            mState = STARTED;
+        }
+        return err;
+    }
+
+    virtual status_t stop() {
+        Mutex::Autolock autoLock(mLock);
+        if (PREFETCHING == mState) {
+            mLock.unlock();
+            pthread_join(mThread, NULL);
+            mLock.lock();
+            mState = (OK == mStartStatus) ? STARTED : IDLE;
+        }
+        if (STARTED != mState) {
+            return OK;
+        }
+        flush_l();
+        mState = IDLE;
+        return mSource->stop();
+    }
+
+    virtual sp<MetaData> getFormat() {
+        return mSource->getFormat();
+    }
+
+    virtual status_t read(MediaBuffer **out, const ReadOptions *options) {
+        Mutex::Autolock autoLock(mLock);
+        *out = NULL;
+        if (STARTED != mState) {
+            return UNKNOWN_ERROR;
+        }
+
+        int64_t seekTimeUs;
+        ReadOptions::SeekMode seekMode;
+        if (options && options->getSeekTo(&seekTimeUs, &seekMode)) {
+            // Prefetched data is from the start of the track.
+            flush_l();
+        }
+        if (!mPrefetched.isEmpty()) {
+            Entry entry = mPrefetched[0];
+            mPrefetched.removeAt(0);
+            *out = entry.buffer;
+            return entry.status;
+        }
+        return mSource->read(out, options);
+    }
+
+protected:
+    virtual ~PrefetchSource() {
+        stop();
+    }
+
+private:
+    enum State {
+        IDLE,
+        PREFETCHING,
+        STARTED,
+    };
+
+    static void *ThreadWrapper(void *me) {
+        static_cast<PrefetchSource *>(me)->threadEntry();
+        return NULL;
+    }
+
+    void threadEntry() {
+        androidSetThreadPriority(0, ANDROID_PRIORITY_BACKGROUND);
+
+        // mLock is not held here: start() and stop() join this thread first,
+        // and read() is not allowed before start().
+        mStartStatus = mSource->start(mParams.get());
+        if (OK == mStartStatus) {
+            // Read up to and including the first decoded buffer.
+            for (int i = 0; i < kMaxPrefetchReads; i++) {
+                Entry entry;
+                entry.buffer = NULL;
+                entry.status = mSource->read(&entry.buffer, NULL);
+                mPrefetched.push(entry);
+                if (INFO_FORMAT_CHANGED != entry.status) {
+                    break;
+                }
+            }
+        }
+        mParams.clear();
+    }
+
+    void flush_l() {
+        for (size_t i = 0; i < mPrefetched.size(); i++) {
+            SafeRelease(mPrefetched.editItemAt(i).buffer);
+        }
+        mPrefetched.clear();
+    }
+
+    struct Entry {
+        MediaBuffer *buffer;
+        status_t status;
+    };
+
+    sp<MediaSource> mSource;
+    Mutex mLock;
+    pthread_t mThread;
+    State mState;
+    status_t mStartStatus;
+    sp<MetaData> mParams;
+    Vector<Entry> mPrefetched;
+
+    PrefetchSource(const PrefetchSource &);//no copy
+    PrefetchSource &operator=(const PrefetchSource &);//no copy
+};
+
+}//namespace android
+
+#endif //PREFETCH_SOURCE_H_
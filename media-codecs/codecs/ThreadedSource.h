@@ -0,0 +1,312 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef THREADED_SOURCE_H_
+#define THREADED_SOURCE_H_
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+#include "UMCMacro.h"
+#include "UMCSchedPolicy.h"
+
+namespace android {
+
+// Meta data keys for the decode-ahead and encode-ahead wrappers (start()
+// params or source format):
+enum {
+    kKeyDecodeAheadDepth = 'dahD',    // key for Int32 number of decoded buffers queued ahead of read()
+    kKeyDecodeAheadPriority = 'dahP', // key for Int32 Android priority of the decode-ahead thread
+    kKeyEncodeAheadDepth = 'eahD',    // key for Int32 number of encoded buffers queued ahead of read()
+    kKeyEncodeAheadPriority = 'eahP', // key for Int32 Android priority of the encode-ahead thread
+};
+
+#define PROP_DECODE_AHEAD_DEPTH    "media.mdp.decode_ahead.depth"
+#define PROP_DECODE_AHEAD_PRIORITY "media.mdp.decode_ahead.prio"
+#define DEFAULT_DECODE_AHEAD_DEPTH 4
+#define MAX_DECODE_AHEAD_DEPTH     16
+
+#define PROP_ENCODE_AHEAD_DEPTH    "media.mdp.encode_ahead.depth"
+#define PROP_ENCODE_AHEAD_PRIORITY "media.mdp.encode_ahead.prio"
+#define DEFAULT_ENCODE_AHEAD_DEPTH 2
+
+// What the wrapped source of a ThreadedSource is:
+enum {
+    THREADED_DECODER = 0,
+    THREADED_ENCODER = 1,
+};
+
+// Runs the wrapped decoder on its own thread and keeps a bounded queue of
+// decoded buffers filled, so that a stall in the extractor does not reach the
+// sink. read() only dequeues. A seek drops the queue, and any buffer the
+// worker was decoding when the seek arrived is discarded.
+//
+// An encoder is wrapped the same way, with a smaller queue: it encodes as
+// soon as its source has a frame, on a thread of its own, rather than on
+// the thread of the writer, which then only muxes. As the worker never
+// waits for read(), the queue adds no latency, only room for the writer
+// to fall behind, e.g. while a video frame is written.
+//
+// Use it through FACTORY_CREATE_IMPL_THREADED or
+// FACTORY_CREATE_ENCODER_IMPL_THREADED in UMCMacro.h.
+struct ThreadedSource : public MediaSource {
+    ThreadedSource(const sp<MediaSource> &source, int role = THREADED_DECODER)
+        :mSource(source)
+        ,mRole(role)
+        ,mDepth(DEFAULT_DECODE_AHEAD_DEPTH)
+        ,mPriority(ANDROID_PRIORITY_AUDIO)
+        ,mStarted(false)
+        ,mStopping(false)
+        ,mSeekPending(false)
+        ,mSeekTimeUs(0)
+        ,mSeekMode(ReadOptions::SEEK_CLOSEST_SYNC)
+        ,mGeneration(0)
+        ,mFinalStatus(OK)
+    {
+    }
+
+    virtual status_t start(MetaData *params) {
+        Mutex::Autolock autoLock(mLock);
+        if (mStarted) {
+            return UNKNOWN_ERROR;
+        }
+
+        sp<MetaData> srcFormat = mSource->getFormat();
+        bool encoder = (THREADED_ENCODER == mRole);
+        if (encoder) {
+            mDepth = getConfig(params, srcFormat, kKeyEncodeAheadDepth, PROP_ENCODE_AHEAD_DEPTH, DEFAULT_ENCODE_AHEAD_DEPTH);
+            mPriority = getConfig(params, srcFormat, kKeyEncodeAheadPriority, PROP_ENCODE_AHEAD_PRIORITY, ANDROID_PRIORITY_AUDIO);
+        } else {
+            mDepth = getConfig(params, srcFormat, kKeyDecodeAheadDepth, PROP_DECODE_AHEAD_DEPTH, DEFAULT_DECODE_AHEAD_DEPTH);
+            mPriority = getConfig(params, srcFormat, kKeyDecodeAheadPriority, PROP_DECODE_AHEAD_PRIORITY, ANDROID_PRIORITY_AUDIO);
+        }
+        if (mDepth <= 0) {
+            mDepth = 1;
+        } else if (mDepth > MAX_DECODE_AHEAD_DEPTH) {
+            mDepth = MAX_DECODE_AHEAD_DEPTH;
+        }
+        // On top of the priority: real-time class, core and cgroup
+        GetSchedPolicy(params, srcFormat, encoder ? PROP_SCHED_ENCODE : PROP_SCHED_DECODE, &mSchedPolicy);
+
+        // The codec needs one output buffer per queued entry, plus the one
+        // being worked on, or the worker would block in acquire.
+        sp<MetaData> codecParams = (NULL != params) ? new MetaData(*params) : new MetaData;
+        int32_t count;
+        if (!codecParams->findInt32(kKeyOutputBufferCount, &count)) {
+            codecParams->setInt32(kKeyOutputBufferCount, mDepth + 1);
+        }
+
+        status_t err = mSource->start(codecParams.get());
+        if (OK != err) {
+            return err;
+        }
+
+        mStopping = false;
+        mSeekPending = false;
+        mFinalStatus = OK;
+        if (0 != pthread_create(&mThread, NULL, ThreadWrapper, this)) {
+            LOGE("ThreadedSource: failed to create %s-ahead thread", encoder ? "encode" : "decode");
+            mSource->stop();
+            return NO_MEMORY;
+        }
+        mStarted = true;
+        LOGV("ThreadedSource started, %s, depth %d, priority %d",
+                encoder ? "encoder" : "decoder", mDepth, mPriority);
+        return OK;
+    }
+
+    virtual status_t stop() {
+        {
+            Mutex::Autolock autoLock(mLock);
+            if (!mStarted) {
+                return OK;
+            }
+            mStopping = true;
+            mCondition.broadcast();
+        }
+        pthread_join(mThread, NULL);
+
+        Mutex::Autolock autoLock(mLock);
+        flushQueue_l();
+        mStarted = false;
+        return mSource->stop();
+    }
+
+    virtual sp<MetaData> getFormat() {
+        return mSource->getFormat();
+    }
+
+    virtual status_t read(MediaBuffer **out, const ReadOptions *options) {
+        Mutex::Autolock autoLock(mLock);
+        *out = NULL;
+        if (!mStarted) {
+            return UNKNOWN_ERROR;
+        }
+
+        int64_t seekTimeUs;
+        ReadOptions::SeekMode seekMode;
+        if (options && options->getSeekTo(&seekTimeUs, &seekMode)) {
+            // Anything queued or in flight belongs to the old position.
+            flushQueue_l();
+            mGeneration++;
+            mSeekPending = true;
+            mSeekTimeUs = seekTimeUs;
+            mSeekMode = seekMode;
+            mFinalStatus = OK;
+            mCondition.broadcast();
+        }
+
+        while (mQueue.isEmpty() && OK == mFinalStatus) {
+            mCondition.wait(mLock);
+        }
+        if (mQueue.isEmpty()) {
+            return mFinalStatus;
+        }
+
+        Entry entry = mQueue[0];
+        mQueue.removeAt(0);
+        mCondition.broadcast();
+        *out = entry.buffer;
+        return entry.status;
+    }
+
+protected:
+    virtual ~ThreadedSource() {
+        stop();
+    }
+
+private:
+    static int32_t getConfig(MetaData *params, const sp<MetaData> &srcFormat,
+                             uint32_t key, const char *prop, int32_t defaultValue) {
+        int32_t value;
+        if (NULL != params && params->findInt32(key, &value)) {
+            return value;
+        }
+        if (NULL != srcFormat.get() && srcFormat->findInt32(key, &value)) {
+            return value;
+        }
+        char propValue[PROPERTY_VALUE_MAX];
+        if (property_get(prop, propValue, NULL) > 0) {
+            return atoi(propValue);
+        }
+        return defaultValue;
+    }
+
+    static void *ThreadWrapper(void *me) {
+        static_cast<ThreadedSource *>(me)->threadLoop();
+        return NULL;
+    }
+
+    void threadLoop() {
+        androidSetThreadPriority(0, mPriority);
+        if (mSchedPolicy.isSet()) {
+            ApplySchedPolicy(mSchedPolicy, gettid());
+        }
+
+        Mutex::Autolock autoLock(mLock);
+        for (;;) {
+            while (!mStopping && !mSeekPending
+                    && (mQueue.size() >= (size_t)mDepth || OK != mFinalStatus)) {
+                mCondition.wait(mLock);
+            }
+            if (mStopping) {
+                break;
+            }
+
+            ReadOptions options;
+            if (mSeekPending) {
+                options.setSeekTo(mSeekTimeUs, mSeekMode);
+                mSeekPending = false;
+            }
+            uint32_t generation = mGeneration;
+
+            MediaBuffer *buffer = NULL;
+            status_t err;
+            mLock.unlock();
+            err = mSource->read(&buffer, &options);
+            mLock.lock();
+
+            if (generation != mGeneration) {
+                // A seek came in while decoding, this result is stale.
+                SafeRelease(buffer);
+                continue;
+            }
+            if (OK == err || INFO_FORMAT_CHANGED == err) {
+                // Format changes are passed on in order with the buffers.
+                Entry entry;
+                entry.buffer = (OK == err) ? buffer : NULL;
+                entry.status = err;
+                mQueue.push(entry);
+            } else {
+                SafeRelease(buffer);
+                mFinalStatus = err;
+            }
+            mCondition.broadcast();
+        }
+    }
+
+    void flushQueue_l() {
+        for (size_t i = 0; i < mQueue.size(); i++) {
+            if (NULL != mQueue[i].buffer) {
+                mQueue[i].buffer->release();
+            }
+        }
+        mQueue.clear();
+    }
+
+    sp<MediaSource> mSource;
+    int mRole;          // THREADED_*
+    int32_t mDepth;
+    int32_t mPriority;
+    CodecSchedPolicy mSchedPolicy;
+
+    Mutex mLock;
+    Condition mCondition;
+    pthread_t mThread;
+    bool mStarted;
+    bool mStopping;
+
+    bool mSeekPending;
+    int64_t mSeekTimeUs;
+    ReadOptions::SeekMode mSeekMode;
+    uint32_t mGeneration;
+
+    struct Entry {
+        MediaBuffer *buffer;
+        status_t status;
+    };
+    Vector<Entry> mQueue;
+    status_t mFinalStatus;
+
+    ThreadedSource(const ThreadedSource &);//no copy
+    ThreadedSource &operator=(const ThreadedSource &);//no copy
+};
+
+}//namespace android
+
+#endif //THREADED_SOURCE_H_
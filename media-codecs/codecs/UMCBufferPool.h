@@ -0,0 +1,186 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_BUFFER_POOL_H_
+#define UMC_BUFFER_POOL_H_
+
+#include <string.h>
+
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaErrors.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+namespace android {
+
+// Pool of output buffers owned by a decoder plugin.
+//
+// All buffers are allocated once in init() and handed out again as soon as the
+// sink releases them, so steady-state decoding neither allocates nor copies.
+// If the codec asks for a bigger frame, grow() raises the pool buffer size in
+// place: buffers that became too small are dropped when they come back and are
+// re-created at the new size on the next acquire().
+class UMCBufferPool : public MediaBufferObserver {
+public:
+    UMCBufferPool()
+        :mBufferSize(0)
+        ,mNumBuffers(0)
+        ,mNumOwned(0)
+    {
+    }
+
+    virtual ~UMCBufferPool() {
+        Mutex::Autolock autoLock(mLock);
+        for (size_t i = 0; i < mFree.size(); i++) {
+            destroyBuffer(mFree[i]);
+        }
+        mFree.clear();
+    }
+
+    // Pre-allocates numBuffers buffers of bufferSize bytes each.
+    status_t init(size_t numBuffers, size_t bufferSize) {
+        Mutex::Autolock autoLock(mLock);
+        if (0 == numBuffers || 0 == bufferSize) {
+            return BAD_VALUE;
+        }
+        mNumBuffers = numBuffers;
+        mBufferSize = bufferSize;
+        while (mNumOwned < mNumBuffers) {
+            MediaBuffer *pBuffer = createBuffer(mBufferSize);
+            if (NULL == pBuffer) {
+                return NO_MEMORY;
+            }
+            mFree.push(pBuffer);
+        }
+        return OK;
+    }
+
+    // Blocks until a buffer of at least bufferSize() bytes is available.
+    status_t acquire(MediaBuffer **out) {
+        Mutex::Autolock autoLock(mLock);
+        *out = NULL;
+        for (;;) {
+            while (!mFree.isEmpty()) {
+                MediaBuffer *pBuffer = mFree.top();
+                mFree.pop();
+                if (pBuffer->size() < mBufferSize) {
+                    // Retired by a previous grow(), replace it below.
+                    destroyBuffer(pBuffer);
+                    continue;
+                }
+                pBuffer->add_ref();
+                pBuffer->reset();
+                *out = pBuffer;
+                return OK;
+            }
+            if (mNumOwned < mNumBuffers) {
+                MediaBuffer *pBuffer = createBuffer(mBufferSize);
+                if (NULL == pBuffer) {
+                    return NO_MEMORY;
+                }
+                pBuffer->add_ref();
+                *out = pBuffer;
+                return OK;
+            }
+            mCondition.wait(mLock);
+        }
+    }
+
+    // Replaces *buffer (acquired from this pool) with a buffer of newSize bytes,
+    // keeping the first keepBytes of its contents. Raises the pool buffer size so
+    // that all later frames get the bigger buffer without reallocation.
+    status_t grow(MediaBuffer **buffer, size_t newSize, size_t keepBytes) {
+        MediaBuffer *pOld = *buffer;
+        MediaBuffer *pNew = NULL;
+        {
+            Mutex::Autolock autoLock(mLock);
+            if (newSize <= mBufferSize && pOld->size() >= newSize) {
+                return OK;
+            }
+            if (newSize > mBufferSize) {
+                mBufferSize = newSize;
+            }
+            pNew = createBuffer(mBufferSize);
+            if (NULL == pNew) {
+                return NO_MEMORY;
+            }
+            pNew->add_ref();
+        }
+        if (keepBytes > 0) {
+            memcpy(pNew->data(), pOld->data(), keepBytes);
+        }
+        // The old buffer is too small now and is dropped when it comes back.
+        pOld->release();
+        *buffer = pNew;
+        return OK;
+    }
+
+    // Blocks until the sink has returned every buffer handed out by the pool.
+    void waitForAllReturned() {
+        Mutex::Autolock autoLock(mLock);
+        while (mFree.size() < mNumOwned) {
+            mCondition.wait(mLock);
+        }
+    }
+
+    size_t bufferSize() const {
+        return mBufferSize;
+    }
+
+    virtual void signalBufferReturned(MediaBuffer *buffer) {
+        Mutex::Autolock autoLock(mLock);
+        if (buffer->size() < mBufferSize || mNumOwned > mNumBuffers) {
+            destroyBuffer(buffer);
+        } else {
+            mFree.push(buffer);
+        }
+        mCondition.signal();
+    }
+
+private:
+    MediaBuffer *createBuffer(size_t size) {
+        MediaBuffer *pBuffer = new MediaBuffer(size);
+        if (NULL != pBuffer) {
+            pBuffer->setObserver(this);
+            mNumOwned++;
+        }
+        return pBuffer;
+    }
+
+    void destroyBuffer(MediaBuffer *buffer) {
+        buffer->setObserver(NULL);
+        buffer->release();
+        mNumOwned--;
+    }
+
+    Mutex mLock;
+    Condition mCondition;
+    Vector<MediaBuffer *> mFree;
+    size_t mBufferSize;
+    size_t mNumBuffers;
+    size_t mNumOwned;
+
+    UMCBufferPool(const UMCBufferPool &);//no copy
+    UMCBufferPool &operator=(const UMCBufferPool &);//no copy
+};
+
+}//namespace android
+
+#endif //UMC_BUFFER_POOL_H_
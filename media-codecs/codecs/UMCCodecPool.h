@@ -0,0 +1,196 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_CODEC_POOL_H_
+#define UMC_CODEC_POOL_H_
+
+#include <stdlib.h>
+
+#include <cutils/properties.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+#include "umc_audio_codec.h"
+
+// Number of idle codec instances kept per plugin, 0 disables pooling.
+#define PROP_CODEC_POOL_SIZE    "media.mdp.codec_pool.size"
+#define DEFAULT_CODEC_POOL_SIZE 2
+#define MAX_CODEC_POOL_SIZE     8
+// 1 runs Init() again on pooled instances that were already initialised
+#define PROP_CODEC_POOL_REINIT  "media.mdp.codec_pool.reinit"
+
+namespace android {
+
+// Process wide pool of idle UMC::AudioCodec instances of one plugin (one per
+// factory function). Short-lived decoders (notification sounds, UI clicks)
+// take an instance that was reset by the previous user instead of building a
+// new one. Init() is still called on every start(), since its parameters
+// depend on the stream.
+//
+// Init() is where the cores build their constant tables (Huffman and VLC
+// decoding tables, windows, IMDCT and FFT twiddles) into the memory of the
+// instance. The cores are prebuilt, so these tables cannot be moved to a
+// shared read-only section; what the pool does instead is keep them: an
+// instance initialised with the default parameters is pooled as such, and
+// the next user only resets it, as a seek does, rather than building the
+// tables again.
+template<UMC::AudioCodec* (&fnFactory)()>
+class UMCCodecPool {
+public:
+    // *pInitialized tells if the instance went through Init() with the
+    // default parameters already, and only needs a Reset(). If setupKey is
+    // not 0, an instance set up for a stream of that key is preferred, and
+    // *pSetUp tells if one was found: it has gone through Init() and the
+    // headers of an identical stream, and only needs a Reset() too.
+    static UMC::AudioCodec *Acquire(bool *pInitialized, uint64_t setupKey = 0, bool *pSetUp = NULL) {
+        Pool &pool = GetPool();
+        *pInitialized = false;
+        if (NULL != pSetUp) {
+            *pSetUp = false;
+        }
+        {
+            Mutex::Autolock autoLock(pool.mLock);
+            if (!pool.mIdle.isEmpty()) {
+                size_t index = pool.mIdle.size() - 1;
+                for (size_t i = 0; 0 != setupKey && i < pool.mIdle.size(); i++) {
+                    if (pool.mIdle[i].setupKey == setupKey) {
+                        index = i;
+                        break;
+                    }
+                }
+                Idle idle = pool.mIdle[index];
+                pool.mIdle.removeAt(index);
+                *pInitialized = idle.initialized && !pool.mReinit;
+                if (NULL != pSetUp) {
+                    *pSetUp = 0 != setupKey && idle.setupKey == setupKey && !pool.mReinit;
+                }
+                return idle.pCodec;
+            }
+        }
+        return (fnFactory)();
+    }
+
+    // Takes back an instance from Acquire(), deleting it if the pool is full.
+    // initialized is false if the instance was never initialised, or was
+    // with parameters of its stream. setupKey is the key of the stream the
+    // instance was set up for, 0 if none; such an instance takes the place
+    // of the oldest one of a full pool.
+    static void Release(UMC::AudioCodec *pCodec, bool initialized, uint64_t setupKey = 0) {
+        if (NULL == pCodec) {
+            return;
+        }
+        pCodec->Reset();
+
+        UMC::AudioCodec *pEvicted = pCodec;
+        Pool &pool = GetPool();
+        {
+            Mutex::Autolock autoLock(pool.mLock);
+            if (pool.mMaxIdle > 0 && (pool.mIdle.size() < pool.mMaxIdle || 0 != setupKey)) {
+                pEvicted = NULL;
+                if (pool.mIdle.size() >= pool.mMaxIdle) {
+                    pEvicted = pool.mIdle[0].pCodec;
+                    pool.mIdle.removeAt(0);
+                }
+                Idle idle;
+                idle.pCodec = pCodec;
+                idle.initialized = initialized;
+                idle.setupKey = setupKey;
+                pool.mIdle.push(idle);
+            }
+        }
+        delete pEvicted;
+    }
+
+private:
+    struct Idle {
+        UMC::AudioCodec *pCodec;
+        bool initialized;
+        uint64_t setupKey;      // stream the instance is set up for, 0 if none
+    };
+
+    struct Pool {
+        Pool()
+            :mMaxIdle(DEFAULT_CODEC_POOL_SIZE)
+            ,mReinit(false)
+        {
+            char value[PROPERTY_VALUE_MAX];
+            if (property_get(PROP_CODEC_POOL_SIZE, value, NULL) > 0) {
+                int size = atoi(value);
+                mMaxIdle = (size < 0) ? 0 : (size > MAX_CODEC_POOL_SIZE) ? MAX_CODEC_POOL_SIZE : size;
+            }
+            if (property_get(PROP_CODEC_POOL_REINIT, value, NULL) > 0) {
+                mReinit = atoi(value) != 0;
+            }
+        }
+        ~Pool() {
+            for (size_t i = 0; i < mIdle.size(); i++) {
+                delete mIdle[i].pCodec;
+            }
+        }
+
+        Mutex mLock;
+        Vector<Idle> mIdle;
+        size_t mMaxIdle;
+        bool mReinit;
+    };
+
+    static Pool &GetPool() {
+        static Pool pool;
+        return pool;
+    }
+};
+
+// Setup key of a stream: a hash of the headers its codec is set up from,
+// the Vorbis identification and setup headers of the source format, or 0
+// if it has none. The hash is a 64 bit FNV-1a, which also covers the
+// sizes of the headers.
+inline uint64_t GetSetupKey(const sp<MetaData> &srcFormat)
+{
+    static const uint32_t kSetupKeys[] = { kKeyVorbisInfo, kKeyVorbisBooks };
+    uint64_t hash = 14695981039346656037ULL;
+    bool found = false;
+
+    if (NULL == srcFormat.get()) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(kSetupKeys) / sizeof(kSetupKeys[0]); i++) {
+        uint32_t type;
+        const void *data;
+        size_t size;
+        if (!srcFormat->findData(kSetupKeys[i], &type, &data, &size)) {
+            continue;
+        }
+        found = true;
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t j = 0; j < size; j++) {
+            hash = (hash ^ bytes[j]) * 1099511628211ULL;
+        }
+        hash = (hash ^ size) * 1099511628211ULL;
+    }
+    if (!found) {
+        return 0;
+    }
+    return (0 != hash) ? hash : 1;
+}
+
+}//namespace android
+
+#endif //UMC_CODEC_POOL_H_
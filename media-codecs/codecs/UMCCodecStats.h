@@ -0,0 +1,169 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_CODEC_STATS_H_
+#define UMC_CODEC_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "UMCPerfTracing.h"
+#include "device_metrics.h"
+
+// Per-codec counters shared by all instances of one plugin (keyed by LOG_TAG).
+// Every counter is updated with atomics, so the decode path never takes a lock,
+// and CodecStats::DumpAll() can be called from a dump handler at any time.
+// Frames, cpu time per frame and underruns are also published in the "mdp"
+// device metrics, which metrics_dump reads.
+struct CodecStats
+{
+    volatile int64_t frames;          // output buffers produced
+    volatile int64_t bytesIn;         // compressed (or PCM, for encoders) bytes consumed
+    volatile int64_t cpuTicks;        // GET_TICKS() spent in read()
+    volatile int64_t firstFrameNs;    // CLOCK_MONOTONIC of first and last output,
+    volatile int64_t lastFrameNs;     // used for frames per second
+    volatile int32_t underruns;       // source read failures and concealed frames
+    volatile int32_t formatChanges;   // INFO_FORMAT_CHANGED returned
+    volatile int32_t bufferReallocs;  // output buffers grown on codec request
+    volatile int32_t seeks;
+    volatile int64_t seekTicks;       // from seek request to first output after it
+
+    char name[64];
+    CodecStats *next;
+
+    // <name>.frames, <name>.cpu_us and <name>.underruns, NULL if the
+    // device metrics are not available
+    device_metric *framesMetric;
+    device_metric *cpuMetric;
+    device_metric *underrunsMetric;
+
+    // Returns the counters registered under name, creating them on first use.
+    // Call once per codec instance and keep the pointer.
+    static CodecStats *Get(const char *name)
+    {
+        CodecStats *volatile &head = ListHead();
+        for (CodecStats *stats = head; NULL != stats; stats = stats->next) {
+            if (!strcmp(stats->name, name)) {
+                return stats;
+            }
+        }
+        CodecStats *stats = new CodecStats;
+        if (NULL == stats) {
+            // Never hand out NULL, the hot path does not check.
+            static CodecStats unregistered;
+            return &unregistered;
+        }
+        memset(stats, 0, sizeof(*stats));
+        strncpy(stats->name, name, sizeof(stats->name) - 1);
+        stats->framesMetric = GetMetric(name, ".frames", DEVICE_METRIC_COUNTER);
+        stats->cpuMetric = GetMetric(name, ".cpu_us", DEVICE_METRIC_HISTOGRAM);
+        stats->underrunsMetric = GetMetric(name, ".underruns", DEVICE_METRIC_COUNTER);
+        do {
+            stats->next = head;
+            // Lost a race against another Get() for the same name: use the winner.
+            for (CodecStats *other = stats->next; NULL != other; other = other->next) {
+                if (!strcmp(other->name, name)) {
+                    delete stats;
+                    return other;
+                }
+            }
+        } while (!__sync_bool_compare_and_swap(&head, stats->next, stats));
+        return stats;
+    }
+
+    void AddFrame(size_t bytesConsumed, long long ticks)
+    {
+        int64_t now = getMonotonicNs1();
+        __sync_fetch_and_add(&frames, (int64_t)1);
+        __sync_fetch_and_add(&bytesIn, (int64_t)bytesConsumed);
+        __sync_fetch_and_add(&cpuTicks, (int64_t)ticks);
+        __sync_bool_compare_and_swap(&firstFrameNs, (int64_t)0, now);
+        lastFrameNs = now;
+        device_metric_add(framesMetric, 1);
+        device_metric_observe(cpuMetric, (int64_t)PerfTicksToUs(ticks));
+    }
+    void AddBytes(size_t bytesConsumed)
+    {
+        __sync_fetch_and_add(&bytesIn, (int64_t)bytesConsumed);
+    }
+    void AddUnderrun()
+    {
+        __sync_fetch_and_add(&underruns, 1);
+        device_metric_add(underrunsMetric, 1);
+    }
+    void AddFormatChange()
+    {
+        __sync_fetch_and_add(&formatChanges, 1);
+    }
+    void AddBufferRealloc()
+    {
+        __sync_fetch_and_add(&bufferReallocs, 1);
+    }
+    void AddSeek(long long ticks)
+    {
+        __sync_fetch_and_add(&seeks, 1);
+        __sync_fetch_and_add(&seekTicks, (int64_t)ticks);
+    }
+
+    void Dump(int fd) const
+    {
+        char line[512];
+        int64_t numFrames = frames;
+        double cpuUs = PerfTicksToUs(cpuTicks);
+        double spanS = (lastFrameNs - firstFrameNs) / 1e9;
+        int len = snprintf(line, sizeof(line),
+                           "%s: frames %lld (%.1f/s); bytes in %lld; cpu %.1f us/frame; "
+                           "underruns %d; format changes %d; buffer reallocs %d; seeks %d (avg %.1f us)\n",
+                           name, (long long)numFrames, spanS > 0 ? numFrames / spanS : 0.0,
+                           (long long)bytesIn, numFrames ? cpuUs / numFrames : 0.0,
+                           underruns, formatChanges, bufferReallocs, seeks,
+                           seeks ? PerfTicksToUs(seekTicks) / seeks : 0.0);
+        if (len > 0) {
+            write(fd, line, len);
+        }
+    }
+
+    static void DumpAll(int fd)
+    {
+        for (CodecStats *stats = ListHead(); NULL != stats; stats = stats->next) {
+            stats->Dump(fd);
+        }
+    }
+
+private:
+    static device_metric *GetMetric(const char *name, const char *suffix, uint32_t type)
+    {
+        // Mapped once per plugin library
+        static device_metrics *metrics = device_metrics_map("mdp");
+        char metricName[DEVICE_METRICS_NAME_LEN];
+        snprintf(metricName, sizeof(metricName), "%s%s", name, suffix);
+        return device_metrics_get(metrics, metricName, type);
+    }
+
+    static CodecStats *volatile &ListHead()
+    {
+        static CodecStats *volatile head = NULL;
+        return head;
+    }
+};
+
+#endif //UMC_CODEC_STATS_H_
@@ -0,0 +1,90 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_CPU_DISPATCH_H_
+#define UMC_CPU_DISPATCH_H_
+
+#include <pthread.h>
+#include <cpuid.h>
+
+// Kernel variant selection of the mc_* codec cores.
+//
+// The cores in libmc_core.a and the codec archives are built with several
+// variants of their hot kernels, a generic SSE2 one and Atom tuned SSSE3 and
+// MOVBE ones. Each dispatched call picks a variant from
+// __intel_cpu_indicator, which __intel_cpu_indicator_init() sets from CPUID.
+// Left alone, the first dispatched call of the process does it, in the middle
+// of decoding the first frame; UMCCpuDispatchInit() does it once when a
+// plugin is created instead, and logs the variant the board gets, so that
+// one image runs the SSSE3 kernels on Clovertrail and the SSE2 ones on
+// boards without them.
+extern "C" void __intel_cpu_indicator_init(void);
+
+namespace android {
+
+struct UMCCpuFeatures {
+    bool sse2;
+    bool sse3;
+    bool ssse3;
+    bool movbe;
+};
+
+inline void UMCGetCpuFeatures(UMCCpuFeatures *features){
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    features->sse2 = features->sse3 = features->ssse3 = features->movbe = false;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+    features->sse2 = (edx & bit_SSE2) != 0;
+    features->sse3 = (ecx & bit_SSE3) != 0;
+    features->ssse3 = (ecx & bit_SSSE3) != 0;
+    features->movbe = (ecx & (1 << 22)) != 0;
+}
+
+// Name of the kernel variant the cores run on this CPU
+inline const char *UMCCpuDispatchName(const UMCCpuFeatures &features){
+    if (features.ssse3 && features.movbe) {
+        return "SSSE3+MOVBE (Atom)";
+    }
+    if (features.ssse3) {
+        return "SSSE3";
+    }
+    if (features.sse2) {
+        return "SSE2";
+    }
+    return "generic";
+}
+
+inline void UMCCpuDispatchOnce(){
+    UMCCpuFeatures features;
+    UMCGetCpuFeatures(&features);
+    __intel_cpu_indicator_init();
+    LOGI("Media Codecs kernels: %s", UMCCpuDispatchName(features));
+}
+
+// Selects the kernel variants of the codec cores, once per process.
+inline void UMCCpuDispatchInit(){
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, UMCCpuDispatchOnce);
+}
+
+}//namespace android
+
+#endif //UMC_CPU_DISPATCH_H_
@@ -33,11 +33,21 @@
 
 // max no. of consecutive frames with no sync-word to be allowed
 #define  MAX_NUM_SYNC_MISS 29
+// Largest gap or overlap, in time, between two frames decoded into the same
+// buffer in batch mode, that of the rounding of the container timestamps
+#define BATCH_TIME_TOLERANCE_US 1000
 
+#include "UMCMacro.h"
 #include "UMCPerfTracing.h"
+#include "UMCBufferPool.h"
+#include "UMCCodecStats.h"
+#include "UMCCodecPool.h"
+#include "UMCCpuDispatch.h"
+#include "UMCDownmix.h"
+#include "UMCFormatProbe.h"
 #include <media/stagefright/MediaSource.h>
-#include <media/stagefright/SkipCutBuffer.h>
 #include <utils/threads.h>
+#include <utils/Vector.h>
 
 #include "mc_version.h"
 #include "umc_audio_codec.h"
@@ -67,18 +77,36 @@ namespace android {
         virtual UMC::Status InitDecoder();
         virtual status_t CheckFormatChange(bool &isResetReadFromBeginning);
         virtual int32_t getDecoderDelay();                        // In samples
+        virtual UMC::Status FlushDecoder();                       // Drops codec history on seek, keeps the configuration
+        status_t decode_l(MediaBuffer **pBuffer, const ReadOptions *options);
+        status_t decodeBatch_l(MediaBuffer **pBuffer, const ReadOptions *options);
+        void probeFormat_l(const sp<MetaData> &srcFormat);
+        void trimDelay_l(MediaBuffer *pBuffer);
+        void trimPadding_l();
+        void releaseHeldBuffers_l();
 
         sp<MediaSource> mSource;
         sp<MetaData> mMeta;
 
-        sp<SkipCutBuffer> mSkipCutBuffer;
         bool mIsFirstBuffer;
 
+        // Gapless trimming, done on the ranges of the output buffers. The
+        // encoder delay is skipped as it is decoded, and the buffers holding
+        // the last mPaddingBytes are held back until the end of stream tells
+        // which of their bytes are padding.
+        size_t mDelayBytes;
+        size_t mPaddingBytes;
+        Vector<MediaBuffer *> mHeldBuffers;
+        size_t mHeldBytes;
+        size_t mMaxHeldBuffers;
+        bool mReachedEOS;
+
         bool mStarted;
         bool mmultiChannelSupport;
         bool mAllowSyncWordMissing;
+        bool mIsAacSource;                                        // Source MIME type, resolved once
 
-        MediaBufferGroup *mBufferGroup;
+        UMCBufferPool *mBufferPool;
 
         int64_t mAnchorTimeUs;
         int32_t mNumDecodedBuffers;
@@ -86,11 +114,40 @@ namespace android {
         int32_t mNumSamplesLeftInFrame;
         int32_t mSyncWordMissCnt;
 
+        // Output format accepted by the last CheckFormatChange, so that a seek
+        // does not have to probe the stream format again.
+        bool mFormatNegotiated;
+        bool mSeekFormatCheckPending;
+        uint32_t mNegotiatedSampleRate;
+        uint32_t mNegotiatedChannels;
+
+        // PCM_OUTPUT_* format of the output buffers, the codec decodes 16-bit
+        // samples which are widened in place.
+        int32_t mPcmFormat;
+        size_t mSampleSize;
+
+        // 5.1 output downmixed to stereo in the decoder, when the sink has
+        // no multi-channel support
+        bool mDownmix;
+        DownmixCoeffs mDownmixCoeffs;
+
+        // Batch mode: up to mFramesPerBuffer consecutive frames per output
+        // buffer. A frame which does not fit in, or the error ending the
+        // batch, is kept for the next read().
+        size_t mFramesPerBuffer;
+        MediaBuffer *mPendingBuffer;
+        status_t mPendingStatus;
+
         Mutex mLock;
         MediaBuffer *mInputBuffer;
         void init();
 
+        CodecStats           *mStats;
+
         UMC::AudioCodec      *mpAudioUMCDecoder;
+        bool                  mCodecInitialized;              // Init() done with the default parameters, see UMCCodecPool
+        uint64_t              mSetupKey;                      // hash of the set-up headers of the stream, see GetSetupKey()
+        bool                  mCodecSetUp;                    // Init() and the set-up headers of the stream done already, InitDecoder() of the plugin may skip them
         UMC::AudioData        mInData;
         UMC::AudioData        mOutData;
 
@@ -99,6 +156,25 @@ namespace android {
         UMCAudioDecoder &operator=(const UMCAudioDecoder &);//no copy
     };
 
+    // Moves the 5.1 samples of the AAC decoder (C, L, R, Ls, Rs, LFE) to the
+    // Android order (L, R, C, LFE, Ls, Rs), for any sample size.
+    template<typename T>
+    inline void ReorderAac51(T *samples, size_t count)
+    {
+        T center_sample, lfe_sample;
+
+        for (size_t i = 0; i + 6 <= count; i += 6) {
+             center_sample   = samples[i];        //saving center-channel sample
+             lfe_sample      = samples[i+5];      //saving lfe_sample
+             samples[i]      = samples[i+1];      //moving front left sample to first pos
+             samples[i+1]    = samples[i+2];      //moving front-right sample to second pos
+             samples[i+5]    = samples[i+4];      //moving rear-right sample to last pos
+             samples[i+4]    = samples[i+3];      //moving rear-left sample to fifth pos
+             samples[i+2]    = center_sample;     //copying center-sample to third pos
+             samples[i+3]    = lfe_sample;        //copying lfe-sample to fourth pos
+        }
+    }
+
     template<FNCreateDecoder fnFactory>
     UMCAudioDecoder<fnFactory>::UMCAudioDecoder(const sp<MediaSource> &source)
         :mSource(source)
@@ -106,17 +182,37 @@ namespace android {
         ,mStarted(false)
         ,mAllowSyncWordMissing(true)
         ,mmultiChannelSupport(false)
-        ,mBufferGroup(NULL)
-        ,mSkipCutBuffer(NULL)
+        ,mIsAacSource(false)
+        ,mBufferPool(NULL)
         ,mIsFirstBuffer(false)
+        ,mDelayBytes(0)
+        ,mPaddingBytes(0)
+        ,mHeldBytes(0)
+        ,mMaxHeldBuffers(0)
+        ,mReachedEOS(false)
         ,mAnchorTimeUs(0)
         ,mNumDecodedBuffers(0)
         ,mNumSamplesOutput(0)
         ,mNumSamplesLeftInFrame(-1)
         ,mSyncWordMissCnt(0)
+        ,mFormatNegotiated(false)
+        ,mSeekFormatCheckPending(false)
+        ,mNegotiatedSampleRate(0)
+        ,mNegotiatedChannels(0)
+        ,mPcmFormat(PCM_OUTPUT_16_BIT)
+        ,mSampleSize(sizeof(int16_t))
+        ,mDownmix(false)
+        ,mFramesPerBuffer(1)
+        ,mPendingBuffer(NULL)
+        ,mPendingStatus(OK)
         ,mInputBuffer(NULL)
+        ,mStats(CodecStats::Get(LOG_TAG))
         ,mpAudioUMCDecoder(NULL)
+        ,mCodecInitialized(false)
+        ,mSetupKey(0)
+        ,mCodecSetUp(false)
     {
+        UMCCpuDispatchInit();
         if(NULL != mMeta.get()){
             sp<MetaData> srcFormat = mSource->getFormat();
             if(NULL != srcFormat.get()){
@@ -125,6 +221,10 @@ namespace android {
 
                 mMeta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_AUDIO_RAW);
 
+                const char *mimeType;
+                mIsAacSource = srcFormat->findCString(kKeyMIMEType, &mimeType)
+                        && !strcasecmp(mimeType, MEDIA_MIMETYPE_AUDIO_AAC);
+
                 int32_t iMultiChannelSupport = 0;
 
                 if (srcFormat->findInt32(kKeyMultichannelSupport, &iMultiChannelSupport)) {
@@ -154,7 +254,10 @@ namespace android {
                         mInData.SetDataSize(0);
                         mOutData.SetDataSize(0);
 
-                        mpAudioUMCDecoder = (fnFactory)();
+                        // A decoder which last decoded this very stream
+                        // has parsed its setup headers already
+                        mSetupKey = GetSetupKey(srcFormat);
+                        mpAudioUMCDecoder = UMCCodecPool<fnFactory>::Acquire(&mCodecInitialized, mSetupKey, &mCodecSetUp);
                     }
                 }
             }
@@ -166,11 +269,18 @@ namespace android {
     template<FNCreateDecoder fnFactory>
     status_t UMCAudioDecoder<fnFactory>::InitDecoder()
     {
+        // A pooled instance keeps the tables of its first Init(), and was
+        // reset when it was released; so does one set up for this stream
+        if (mCodecInitialized || mCodecSetUp) {
+            LOGV("UMCAudioDecoder::InitDecoder(): pooled instance, Init() skipped");
+            return OK;
+        }
         UMC::AudioCodecParams acParams;
         acParams.m_lpMemoryAllocator=NULL;
         UMC::Status initStatus = mpAudioUMCDecoder->Init(&acParams);
         switch (initStatus) {
             case UMC::UMC_OK:
+                mCodecInitialized = true;
                 return OK;
 
             case UMC::UMC_ERR_ALLOC:
@@ -194,8 +304,8 @@ namespace android {
 
         mOutData.Close();
         mInData.Close();
-        LOGV("delete mpAudioUMCDecoder; {");
-        delete mpAudioUMCDecoder;
+        LOGV("UMCCodecPool::Release(mpAudioUMCDecoder); {");
+        UMCCodecPool<fnFactory>::Release(mpAudioUMCDecoder, mCodecInitialized, mCodecSetUp ? mSetupKey : 0);
         mpAudioUMCDecoder = NULL;
         LOGV("~UMCAudioDecoder()  }");
         LOGI("UMC Decoder plugin deleted");
@@ -219,10 +329,9 @@ namespace android {
             LOGE("UMCDecoder::start 'NULL==mMeta && mpAudioUMCDecoder' - NO_MEMORY %d", __LINE__);
             return NO_MEMORY;
         }
-        MediaBuffer *pBuffer;
-        mBufferGroup = new MediaBufferGroup;
-        if (NULL == mBufferGroup) {
-            LOGE("UMCDecoder::start 'new MediaBufferGroup' - NO_MEMORY %d", __LINE__);
+        mBufferPool = new UMCBufferPool;
+        if (NULL == mBufferPool) {
+            LOGE("UMCDecoder::start 'new UMCBufferPool' - NO_MEMORY %d", __LINE__);
             return NO_MEMORY;
         }
 
@@ -230,19 +339,36 @@ namespace android {
         status_t result = InitDecoder();
         LOGV("UMCAudioDecoder::InitDecoder() returned '%d' {%d}", result, __LINE__);
         if (OK != result) {
-            goto deleteMediaBufferGroup_exit;
+            goto deleteBufferPool_exit;
         }
 
         mpAudioUMCDecoder->GetInfo(&acParams);
 
-        if ((pBuffer = new MediaBuffer(acParams.m_SuggestedOutputSize)) == NULL) {
-            LOGE("UMCDecoder::start 'new MediaBuffer(%d)' NO_MEMORY {%d}", acParams.m_SuggestedOutputSize,  __LINE__);
-            result = NO_MEMORY;
-            goto deleteMediaBufferGroup_exit;
+        result = mSource->start();
+        LOGV("UMCAudioDecoder::start mSource->start returned '%d' {%d}", result, __LINE__);
+        if (OK != result) {
+            goto deleteBufferPool_exit;
         }
+        // If the source never limits the number of valid samples contained
+        // in the input data, we'll assume that all of the decoded samples are valid.
+        mNumSamplesLeftInFrame = -1;
+        mAnchorTimeUs = 0;
 
-        mBufferGroup->add_buffer(pBuffer);
-        LOGV("UMCDecoder::start{buffer size%d} %d", acParams.m_SuggestedOutputSize, __LINE__);
+        // The output format is taken from the stream headers, before the
+        // buffer sizes that depend on it
+        probeFormat_l(meta);
+
+        mPcmFormat = GetPcmOutputFormat(params, meta);
+        mSampleSize = GetPcmSampleSize(mPcmFormat);
+        mMeta->setInt32(kKeyPcmOutputFormat, mPcmFormat);
+
+        mDownmix = !mmultiChannelSupport && GetDownmixStereo(params, meta);
+        if (mDownmix) {
+            GetDownmixCoeffs(meta, &mDownmixCoeffs);
+            if (mMeta->findInt32(kKeyChannelCount, &numchannels) && numchannels == 6) {
+                mMeta->setInt32(kKeyChannelCount, 2);
+            }
+        }
 
         if (!meta->findInt32(kKeyEncoderDelay, &delay)) {
             delay = 0;
@@ -250,43 +376,61 @@ namespace android {
         if (!meta->findInt32(kKeyEncoderPadding, &padding)) {
             padding = 0;
         }
+        mDelayBytes = 0;
+        mPaddingBytes = 0;
+        mMaxHeldBuffers = 0;
         if (delay + padding) {
             if (mMeta->findInt32(kKeyChannelCount, &numchannels)) {
-                size_t frameSize = numchannels * sizeof(int16_t);
+                size_t frameSize = numchannels * mSampleSize;
                 // Decoder delay has to be accomodated inside padding+delay itself.
                 if (padding > getDecoderDelay()) {
                      padding -= getDecoderDelay();
                 }
                 LOGV("delay %d frameSize %d padding %d", delay, frameSize, padding);
-                mSkipCutBuffer = new SkipCutBuffer(delay * frameSize, padding * frameSize);
+                mDelayBytes = delay * frameSize;
+                mPaddingBytes = padding * frameSize;
+            }
+        }
+        if (mPaddingBytes) {
+            // Enough buffers to cover the padding, a frame being less than a
+            // pool buffer, and one more for the buffer being decoded
+            size_t frameBytes = acParams.m_SuggestedOutputSize / sizeof(int16_t) * mSampleSize;
+            if (mDownmix) {
+                frameBytes /= 3;
             }
+            mMaxHeldBuffers = mPaddingBytes / (frameBytes ? frameBytes : 1) + 2;
         }
 
-        result = mSource->start();
-        LOGV("UMCAudioDecoder::start mSource->start returned '%d' {%d}", result, __LINE__);
+        // Size the pool for the worst-case frame reported by the codec up front,
+        // so the decode loop never has to reallocate in steady state. The
+        // held back buffers come on top of those in flight to the sink, and
+        // so does the pending buffer of the batch mode.
+        mFramesPerBuffer = GetFramesPerBuffer(params, meta);
+        result = mBufferPool->init(GetOutputBufferCount(params, meta) + mMaxHeldBuffers
+                + (mFramesPerBuffer > 1 ? 1 : 0),
+                acParams.m_SuggestedOutputSize / sizeof(int16_t) * mSampleSize * mFramesPerBuffer);
         if (OK != result) {
-            goto releaseMediaBuffer_exit;
+            LOGE("UMCDecoder::start 'mBufferPool->init(%d)' returned %d {%d}", acParams.m_SuggestedOutputSize, result, __LINE__);
+            goto stopSource_exit;
         }
-        // If the source never limits the number of valid samples contained
-        // in the input data, we'll assume that all of the decoded samples are valid.
-        mNumSamplesLeftInFrame = -1;
+        LOGV("UMCDecoder::start{buffer size%d} %d", acParams.m_SuggestedOutputSize, __LINE__);
 
-        mAnchorTimeUs = 0;
         mNumDecodedBuffers = 0;
+        mFormatNegotiated = false;
+        mSeekFormatCheckPending = false;
+        mHeldBytes = 0;
+        mReachedEOS = false;
         mStarted = true;
         mIsFirstBuffer = true;
 
         LOGV("UMCAudioDecoder::start OK...exiting {%d}", __LINE__);
         return OK;
 
-releaseMediaBuffer_exit:
-        if (mSkipCutBuffer != NULL) {
-            mSkipCutBuffer->clear();
-        }
-        SafeRelease(pBuffer);
-
-deleteMediaBufferGroup_exit:
-        SafeDelete(mBufferGroup);
+stopSource_exit:
+        SafeRelease(mInputBuffer);
+        mSource->stop();
+deleteBufferPool_exit:
+        SafeDelete(mBufferPool);
         return result;
 
     }
@@ -297,15 +441,14 @@ deleteMediaBufferGroup_exit:
 
         LOGV("UMCAudioDecoder::stop Locked { {%d}", __LINE__);
 
-        if(mBufferGroup != NULL) {
-            MediaBuffer *pBuffer;
-            LOGV("UMCAudioDecoder::stop acquire_buffer {");
-            mBufferGroup->acquire_buffer(&pBuffer);
-            LOGV("UMCAudioDecoder::stop acquire_buffer } buffer->refcount()  %d",pBuffer->refcount() );
-            SafeRelease(pBuffer);
-            LOGV("UMCAudioDecoder::stop SafeDelete(mBufferGroup); {");
-            SafeDelete(mBufferGroup);
-            LOGV("UMCAudioDecoder::stop SafeDelete(mBufferGroup); }");
+        releaseHeldBuffers_l();
+        if(mBufferPool != NULL) {
+            LOGV("UMCAudioDecoder::stop waitForAllReturned {");
+            mBufferPool->waitForAllReturned();
+            LOGV("UMCAudioDecoder::stop waitForAllReturned }");
+            LOGV("UMCAudioDecoder::stop SafeDelete(mBufferPool); {");
+            SafeDelete(mBufferPool);
+            LOGV("UMCAudioDecoder::stop SafeDelete(mBufferPool); }");
         }
         LOGV("UMCAudioDecoder::stop SafeRelease(mInputBuffer); {");
         SafeRelease(mInputBuffer);
@@ -315,10 +458,6 @@ deleteMediaBufferGroup_exit:
         if(mStarted){
             LOGV("UMCAudioDecoder::stop mSource->stop(); {");
 
-            if (mSkipCutBuffer != NULL) {
-                mSkipCutBuffer->clear();
-            }
-
             status_t result = mSource->stop();
             LOGV("UMCAudioDecoder::stop mSource->stop(); }");
             if(mpAudioUMCDecoder){
@@ -343,14 +482,178 @@ deleteMediaBufferGroup_exit:
     status_t UMCAudioDecoder<fnFactory>::read(MediaBuffer **out, const ReadOptions *options) {
         Mutex::Autolock autoLock(mLock);
 
-        LOGV("-----------------------\nUMCAudioDecoder::read Locked {%d}", __LINE__);
+        LOGV_HOT("-----------------------\nUMCAudioDecoder::read Locked {%d}", __LINE__);
 
         if (mStarted != true) {
-             LOGV("UMCAudioDecoder::read called before calling start", __LINE__);
+             LOGV_HOT("UMCAudioDecoder::read called before calling start", __LINE__);
              return UNKNOWN_ERROR;
         }
+        *out = NULL;
+
+        int64_t seekTimeUs;
+        ReadOptions::SeekMode mode;
+        if (options && options->getSeekTo(&seekTimeUs, &mode)) {
+            // The held back buffers are from before the seek point
+            releaseHeldBuffers_l();
+            mReachedEOS = false;
+        }
+
+        for (;;) {
+            if (mReachedEOS) {
+                while (!mHeldBuffers.isEmpty()) {
+                    MediaBuffer *pBuffer = mHeldBuffers[0];
+                    mHeldBuffers.removeAt(0);
+                    if (pBuffer->range_length() != 0) {
+                        *out = pBuffer;
+                        return OK;
+                    }
+                    // Nothing but padding
+                    pBuffer->release();
+                }
+                return ERROR_END_OF_STREAM;
+            }
+
+            MediaBuffer *pBuffer = NULL;
+            status_t err = decodeBatch_l(&pBuffer, options);
+            options = NULL;
+            if (ERROR_END_OF_STREAM == err) {
+                trimPadding_l();
+                mReachedEOS = true;
+                continue;
+            }
+            if (OK != err) {
+                if (INFO_FORMAT_CHANGED == err) {
+                    // The held back samples are of the former format
+                    releaseHeldBuffers_l();
+                }
+                return err;
+            }
+
+            trimDelay_l(pBuffer);
+            if (0 == mPaddingBytes) {
+                *out = pBuffer;
+                return OK;
+            }
+
+            // Hold back the buffers the padding may be in, at most
+            // mMaxHeldBuffers so that the pool is never drained.
+            mHeldBuffers.push(pBuffer);
+            mHeldBytes += pBuffer->range_length();
+            MediaBuffer *pFirst = mHeldBuffers[0];
+            if (mHeldBytes - pFirst->range_length() >= mPaddingBytes
+                    || mHeldBuffers.size() >= mMaxHeldBuffers) {
+                mHeldBuffers.removeAt(0);
+                mHeldBytes -= pFirst->range_length();
+                *out = pFirst;
+                return OK;
+            }
+        }
+    }
+
+    template<FNCreateDecoder fnFactory>
+    void UMCAudioDecoder<fnFactory>::trimDelay_l(MediaBuffer *pBuffer) {
+        if (0 == mDelayBytes) {
+            return;
+        }
+        size_t skip = pBuffer->range_length() < mDelayBytes ? pBuffer->range_length() : mDelayBytes;
+        pBuffer->set_range(pBuffer->range_offset() + skip, pBuffer->range_length() - skip);
+        mDelayBytes -= skip;
+    }
+
+    // Drops the padding from the end of the held back buffers
+    template<FNCreateDecoder fnFactory>
+    void UMCAudioDecoder<fnFactory>::trimPadding_l() {
+        size_t cut = mPaddingBytes;
+        for (size_t i = mHeldBuffers.size(); i-- > 0 && cut > 0;) {
+            MediaBuffer *pBuffer = mHeldBuffers[i];
+            size_t len = pBuffer->range_length() < cut ? pBuffer->range_length() : cut;
+            pBuffer->set_range(pBuffer->range_offset(), pBuffer->range_length() - len);
+            cut -= len;
+        }
+        mHeldBytes = 0;
+    }
+
+    template<FNCreateDecoder fnFactory>
+    void UMCAudioDecoder<fnFactory>::releaseHeldBuffers_l() {
+        for (size_t i = 0; i < mHeldBuffers.size(); i++) {
+            SafeRelease(mHeldBuffers.editItemAt(i));
+        }
+        mHeldBuffers.clear();
+        mHeldBytes = 0;
+        SafeRelease(mPendingBuffer);
+        mPendingStatus = OK;
+    }
+
+    // Decodes the next output buffer, with up to mFramesPerBuffer frames in
+    // batch mode, e.g. the frames of the several WMA payloads of an ASF
+    // packet: the sink then gets one buffer, with one read() and one set of
+    // meta data, instead of one per frame. The frames following the first
+    // are copied after it as long as their time follows on, so that the
+    // time of the buffer stays the one of its first sample.
+    template<FNCreateDecoder fnFactory>
+    status_t UMCAudioDecoder<fnFactory>::decodeBatch_l(MediaBuffer **out, const ReadOptions *options) {
+        MediaBuffer *pBuffer = NULL;
+        status_t err;
+
+        *out = NULL;
+        // A seek has dropped what was pending, see read()
+        if (NULL != mPendingBuffer) {
+            pBuffer = mPendingBuffer;
+            mPendingBuffer = NULL;
+        } else if (OK != mPendingStatus) {
+            err = mPendingStatus;
+            mPendingStatus = OK;
+            return err;
+        } else {
+            err = decode_l(&pBuffer, options);
+            if (OK != err || mFramesPerBuffer <= 1) {
+                *out = pBuffer;
+                return err;
+            }
+        }
+
+        int32_t channels = 0;
+        int32_t sampleRate = 0;
+        int64_t timeUs = 0;
+        mMeta->findInt32(kKeyChannelCount, &channels);
+        mMeta->findInt32(kKeySampleRate, &sampleRate);
+        pBuffer->meta_data()->findInt64(kKeyTime, &timeUs);
+        size_t frameBytes = channels * mSampleSize;
+        for (size_t frames = 1; frames < mFramesPerBuffer && frameBytes && sampleRate > 0; frames++) {
+            MediaBuffer *pNext = NULL;
+            err = decode_l(&pNext, NULL);
+            if (OK != err) {
+                mPendingStatus = err;
+                break;
+            }
+
+            int64_t nextTimeUs = 0;
+            pNext->meta_data()->findInt64(kKeyTime, &nextTimeUs);
+            int64_t endTimeUs = timeUs + (int64_t)(pBuffer->range_length() / frameBytes)
+                    * US_PER_SECOND / sampleRate;
+            int64_t gapUs = nextTimeUs - endTimeUs;
+            size_t room = pBuffer->size() - pBuffer->range_offset() - pBuffer->range_length();
+            if (pNext->range_length() > room
+                    || gapUs > BATCH_TIME_TOLERANCE_US || gapUs < -BATCH_TIME_TOLERANCE_US) {
+                mPendingBuffer = pNext;
+                break;
+            }
+            memcpy((uint8_t *)pBuffer->data() + pBuffer->range_offset() + pBuffer->range_length(),
+                    (const uint8_t *)pNext->data() + pNext->range_offset(), pNext->range_length());
+            pBuffer->set_range(pBuffer->range_offset(), pBuffer->range_length() + pNext->range_length());
+            pNext->release();
+        }
+        *out = pBuffer;
+        return OK;
+    }
+
+    // Decodes the next output buffer, trimmed of the decoder delay only
+    template<FNCreateDecoder fnFactory>
+    status_t UMCAudioDecoder<fnFactory>::decode_l(MediaBuffer **out, const ReadOptions *options) {
         status_t err = 0;
         UMC::Status decoderStatus = OK;
+        long long readStartTicks = GET_TICKS();
+        size_t bytesConsumed = 0;
 
         *out = NULL;
         int64_t seekTimeUs;
@@ -361,9 +664,9 @@ deleteMediaBufferGroup_exit:
         int32_t numSamplesDecoded = 0;
         int32_t numChannels;
 
-        status_t status = mBufferGroup->acquire_buffer(&pBuffer);
+        status_t status = mBufferPool->acquire(&pBuffer);
         if (OK != status ) {
-            LOGE("mBufferGroup->acquire_buffer(&pBuffer) returned %d {%d}", status, __LINE__);
+            LOGE("mBufferPool->acquire(&pBuffer) returned %d {%d}", status, __LINE__);
             return status;
         }
         bool isDecodingSucceed = true; // assume that decoding will be sucessfull
@@ -382,15 +685,17 @@ deleteMediaBufferGroup_exit:
 
             SafeRelease(mInputBuffer);
             // Make sure that the next buffer output does not still
-            // depend on fragments from the last one decoded.
-            LOGV("seeking... mpAudioUMCDecoder->Reset() {%d}", __LINE__);
-            mpAudioUMCDecoder->Reset();
+            // depend on fragments from the last one decoded. The negotiated
+            // format and the gapless trimming setup are kept across the seek.
+            LOGV_HOT("seeking... FlushDecoder() {%d}", __LINE__);
+            FlushDecoder();
+            mSeekFormatCheckPending = true;
         } else {
             seekTimeUs = -1;
         }
 
         do {
-            LOGV("UMCAudioDecoder::read mInputBuffer == %p {%d}", mInputBuffer, __LINE__);
+            LOGV_HOT("UMCAudioDecoder::read mInputBuffer == %p {%d}", mInputBuffer, __LINE__);
             if (NULL == mInputBuffer) {
                 if(isNeedSeekOptions)
                 {
@@ -401,11 +706,12 @@ deleteMediaBufferGroup_exit:
                 {
                     err = mSource->read(&mInputBuffer, &optionsNoSeek);
                 }
-                LOGV("UMCAudioDecoder::read mSource->read returned(%d) {%d}", err, __LINE__);
+                LOGV_HOT("UMCAudioDecoder::read mSource->read returned(%d) {%d}", err, __LINE__);
 
                 if (OK != err) {
                     if (ERROR_IO == err) {
                         LOGD("UMCAudioDecoder::input data read (mSource->read) returned %d, considering ERROR_IO\n", err);
+                        mStats->AddUnderrun();
                         SafeRelease(pBuffer);
                         return ERROR_IO;
                     } else {
@@ -414,16 +720,28 @@ deleteMediaBufferGroup_exit:
                         return ERROR_END_OF_STREAM;
                     }
                 }
+                // Per-buffer meta data cannot change while the buffer is being
+                // consumed, so it is only looked up when a new buffer arrives.
                 int64_t timeUs;
                 sp<MetaData> inputFormat = mInputBuffer->meta_data();
+                int32_t numFrameSamples;
+                if (inputFormat.get() && inputFormat->findInt32(kKeyValidSamples, &numFrameSamples)) {
+                    if (numFrameSamples < 0) {
+                        LOGE("seekTimeUs = %lli {%d}", seekTimeUs, __LINE__);
+                        SafeRelease(pBuffer);
+                        return BAD_VALUE;
+                    }
+                    mNumSamplesLeftInFrame = numFrameSamples;
+                    LOGV_HOT("Number of valid samples in frame is limited to %d {%d}", mNumSamplesLeftInFrame, __LINE__);
+                }
                 if (inputFormat.get() && inputFormat->findInt64(kKeyTime, &timeUs)) {
                     if (mAnchorTimeUs != timeUs) {
-                        LOGV("Anchor time changed on %d frame! Before %lld, after %lld", mNumDecodedBuffers, mAnchorTimeUs, timeUs);
+                        LOGV_HOT("Anchor time changed on %d frame! Before %lld, after %lld", mNumDecodedBuffers, mAnchorTimeUs, timeUs);
                     }
 
                     mAnchorTimeUs = timeUs;
                     mNumSamplesOutput = 0;
-                    LOGV("UMCAudioDecoder::read mAnchorTimeUs->%lld, mNumSamplesOutput->0 {%d}", mAnchorTimeUs, __LINE__);
+                    LOGV_HOT("UMCAudioDecoder::read mAnchorTimeUs->%lld, mNumSamplesOutput->0 {%d}", mAnchorTimeUs, __LINE__);
                 } else {
                     // We must have a new timestamp after seeking.
                     if (seekTimeUs >= 0){
@@ -432,23 +750,11 @@ deleteMediaBufferGroup_exit:
                         return BAD_VALUE;
                     }
                 }
-                LOGV("UMCAudioDecoder::read {%d}", __LINE__);
+                LOGV_HOT("UMCAudioDecoder::read {%d}", __LINE__);
             }
 
-            sp<MetaData> inputFormat = mInputBuffer->meta_data();
-            int32_t numFrameSamples;
-            if (inputFormat.get() && inputFormat->findInt32(kKeyValidSamples, &numFrameSamples)) {
-                if (numFrameSamples < 0) {
-                    LOGE("seekTimeUs = %lli {%d}", seekTimeUs, __LINE__);
-                    SafeRelease(pBuffer);
-                    return BAD_VALUE;
-                }
-                mNumSamplesLeftInFrame = numFrameSamples;
-                LOGV("Number of valid samples in frame is limited to %d {%d}", mNumSamplesLeftInFrame, __LINE__);
-            }
-
-            LOGV("mInputBuffer data pointer = %p,range_offset = %d, range_length = %d", mInputBuffer->data(), mInputBuffer->range_offset(), mInputBuffer->range_length());
-            LOGV("buffer data pointer = %p, size = %d, mOutData ptr = %p", pBuffer->data(), pBuffer->size(), mOutData.GetBufferPointer());
+            LOGV_HOT("mInputBuffer data pointer = %p,range_offset = %d, range_length = %d", mInputBuffer->data(), mInputBuffer->range_offset(), mInputBuffer->range_length());
+            LOGV_HOT("buffer data pointer = %p, size = %d, mOutData ptr = %p", pBuffer->data(), pBuffer->size(), mOutData.GetBufferPointer());
 
             mInData.SetBufferPointer((uint8_t *)mInputBuffer->data() + mInputBuffer->range_offset(),mInputBuffer->range_length());
             mInData.SetDataSize( mInputBuffer->range_length());
@@ -457,14 +763,20 @@ deleteMediaBufferGroup_exit:
 
             // Decode frame
             do {
-                mOutData.SetBufferPointer( static_cast<uint8_t *>(pBuffer->data()), pBuffer->size() );
+                // The codec only gets the part of the buffer its 16-bit samples
+                // still fit in once they are widened.
+                mOutData.SetBufferPointer( static_cast<uint8_t *>(pBuffer->data()), pBuffer->size() / mSampleSize * sizeof(int16_t) );
                 mOutData.MoveDataPointer(decodedDataSize);
                 mOutData.SetDataSize(0);
 
                 AUTO_TIMER(LOG_TAG);
-                LOGV("before getframe mInData & mOutData size: %d & %d", mInData.GetDataSize(), mOutData.GetDataSize());
+                LOGV_HOT("before getframe mInData & mOutData size: %d & %d", mInData.GetDataSize(), mOutData.GetDataSize());
                 decoderStatus = mpAudioUMCDecoder->GetFrame( &mInData, &mOutData );
-                LOGV(" after getframe mInData & mOutData size: %d & %d", mInData.GetDataSize(), mOutData.GetDataSize());
+                LOGV_HOT(" after getframe mInData & mOutData size: %d & %d", mInData.GetDataSize(), mOutData.GetDataSize());
+                if (mOutData.m_info.iSampleFrequency > 0 && mOutData.m_info.iChannels > 0) {
+                    AUTO_TIMER_MEDIA_US((int64_t)(mOutData.GetDataSize() / (sizeof(int16_t) * mOutData.m_info.iChannels))
+                                        * US_PER_SECOND / mOutData.m_info.iSampleFrequency);
+                }
 
                 if (decoderStatus == UMC::UMC_OK) {
                     mSyncWordMissCnt = 0;
@@ -472,7 +784,7 @@ deleteMediaBufferGroup_exit:
                 // Increment decoded data size:
                 size_t decodedDataSizeOnIteration = mOutData.GetDataSize();
                 decodedDataSize += decodedDataSizeOnIteration;
-                LOGV("Decoded %d bytes of data on current iteration. Total bytes per frame equals %d bytes so far.",
+                LOGV_HOT("Decoded %d bytes of data on current iteration. Total bytes per frame equals %d bytes so far.",
                      decodedDataSizeOnIteration, decodedDataSize);
 
                 if (decoderStatus == UMC::UMC_ERR_NOT_ENOUGH_BUFFER) {
@@ -488,45 +800,18 @@ deleteMediaBufferGroup_exit:
                     }
 
                     if (params.m_SuggestedOutputSize > sizeBefore) {
-                        LOGV("Trying to reallocate output buffer with new suggested size: %d", params.m_SuggestedOutputSize);
-
-                        MediaBufferGroup* pNewBufferGroup = new MediaBufferGroup;
-
-                        LOGV("Create new buffer group.");
-                        if(NULL==pNewBufferGroup){
-                            LOGE("UMCDecoder::start 'new MediaBufferGroup' NO_MEMORY {%d}",  __LINE__);
-                            return NO_MEMORY;
-                        }
-
-                        LOGV("Create new media buffer.");
-                        MediaBuffer *pNewBuffer = new MediaBuffer(params.m_SuggestedOutputSize);
-                        if (NULL == pNewBuffer) {
-                            SafeDelete(pNewBufferGroup);
-                            LOGE("UMCDecoder::start 'new MediaBuffer(%d)' NO_MEMORY {%d}", params.m_SuggestedOutputSize,  __LINE__);
-                            return NO_MEMORY;
-                        }
-
-                        // Copy decoded output data to new buffer:
-                        LOGV("Copy %d bytes of decoded data to the new buffer.", decodedDataSize);
-                        memcpy(pNewBuffer->data(), pBuffer->data(), decodedDataSize );
-
-                        LOGV("Add new buffer to the new buffer group.");
-                        pNewBufferGroup->add_buffer(pNewBuffer);
-                        status_t status = pNewBufferGroup->acquire_buffer(&pNewBuffer);
-                        if (OK != status ) {
+                        LOGV_HOT("Growing output buffer pool to new suggested size: %d", params.m_SuggestedOutputSize);
+
+                        // The pool keeps the decoded part of the frame and serves
+                        // every later frame at the new size, no group rebuild.
+                        mStats->AddBufferRealloc();
+                        status_t status = mBufferPool->grow(&pBuffer,
+                                params.m_SuggestedOutputSize / sizeof(int16_t) * mSampleSize, decodedDataSize);
+                        if (OK != status) {
                             SafeRelease(pBuffer);
-                            SafeDelete(pNewBufferGroup);
-                            LOGE("pNewBufferGroup->acquire_buffer(&pNewBuffer) returned %d {%d}", status, __LINE__);
+                            LOGE("mBufferPool->grow(%d) returned %d {%d}", params.m_SuggestedOutputSize, status, __LINE__);
                             return status;
                         }
-
-                        LOGV("Release old buffer & group and replace them with a new buffer & group.");
-                        SafeRelease(pBuffer);
-                        SafeDelete(mBufferGroup);
-
-                        pBuffer      = pNewBuffer;
-                        mBufferGroup = pNewBufferGroup;
-
                     } else {
                         LOGE("New suggested output buffer size is equal or smaller than before: %d", params.m_SuggestedOutputSize);
                         decoderStatus = ERROR_BUFFER_TOO_SMALL;
@@ -536,19 +821,35 @@ deleteMediaBufferGroup_exit:
             while(decoderStatus == UMC::UMC_ERR_NOT_ENOUGH_BUFFER);
 
             // Set output data pointer to beginnging of buffer and adjust data size appropriately:
-            LOGV("Reset output data buffer pointer to beginning and set data size to the total decoded bytes per frame %d.", decodedDataSize);
+            LOGV_HOT("Reset output data buffer pointer to beginning and set data size to the total decoded bytes per frame %d.", decodedDataSize);
             mOutData.Reset();
             mOutData.SetDataSize(decodedDataSize);
 
             if(decoderStatus == UMC::UMC_OK && mOutData.GetDataSize() != 0)
             {
                mNumDecodedBuffers++;
+               // A frame came out, so the codec holds the set-up of the stream
+               mCodecSetUp = (0 != mSetupKey);
             }
 
-            if ((mNumDecodedBuffers == 1) && (decoderStatus == UMC::UMC_OK)) {
+            bool isFormatCheckNeeded = (mNumDecodedBuffers == 1);
+            if (mSeekFormatCheckPending && (decoderStatus == UMC::UMC_OK) && mOutData.GetDataSize() != 0) {
+                mSeekFormatCheckPending = false;
+                // Only probe again if the stream parameters changed across the seek.
+                isFormatCheckNeeded = !mFormatNegotiated
+                    || mOutData.m_info.iSampleFrequency != mNegotiatedSampleRate
+                    || mOutData.m_info.iChannels != mNegotiatedChannels;
+            }
+
+            if (isFormatCheckNeeded && (decoderStatus == UMC::UMC_OK)) {
 
                 bool isResetReadFromBeginning = false;
                 status_t checkStatus = CheckFormatChange(isResetReadFromBeginning);
+                if (checkStatus == OK || checkStatus == INFO_FORMAT_CHANGED) {
+                    mFormatNegotiated = true;
+                    mNegotiatedSampleRate = mOutData.m_info.iSampleFrequency;
+                    mNegotiatedChannels = mOutData.m_info.iChannels;
+                }
                 if (checkStatus != OK) {
                   LOGW("Format changed, releasing buffers.");
                   SafeRelease(pBuffer);
@@ -563,6 +864,7 @@ deleteMediaBufferGroup_exit:
                           mNumDecodedBuffers = 0;
                       }
 
+                      mStats->AddFormatChange();
                       return INFO_FORMAT_CHANGED;
                   } else {
                       LOGW("Check format changed returned unexpected error: %d", checkStatus);
@@ -581,7 +883,7 @@ deleteMediaBufferGroup_exit:
                         isRecoverable = false;
                     }
                 }
-                LOGV("UMC decoder returned error %d...%srecoverable, dataSizeBeforeDecode=%d", decoderStatus, isRecoverable?"":"UN", dataSizeBeforeDecode);
+                LOGV_HOT("UMC decoder returned error %d...%srecoverable, dataSizeBeforeDecode=%d", decoderStatus, isRecoverable?"":"UN", dataSizeBeforeDecode);
 
                 if (!isRecoverable) {
                     SafeRelease(pBuffer);
@@ -592,20 +894,23 @@ deleteMediaBufferGroup_exit:
                 // This is recoverable, just ignore the current frame and
                 // play silence instead.
                 LOGW("substituting %d bytes of silence", pBuffer->size());
+                mStats->AddUnderrun();
                 memset(pBuffer->data(), 0, pBuffer->size());
+                bytesConsumed += dataSizeBeforeDecode;
                 mInputBuffer->set_range(
                     mInputBuffer->range_offset() + dataSizeBeforeDecode,
                     mInputBuffer->range_length() - dataSizeBeforeDecode);
 
             } else {
-                    LOGV("mInputBuffer( range_offset=%d, range_length=%d) dataSizeBeforeDecode=%d mInData.GetDataSize=%d ",
+                    LOGV_HOT("mInputBuffer( range_offset=%d, range_length=%d) dataSizeBeforeDecode=%d mInData.GetDataSize=%d ",
                             mInputBuffer->range_offset(), mInputBuffer->range_length(), dataSizeBeforeDecode, mInData.GetDataSize());
-                    LOGV("mInputBuffer->set_range(%d, %d)", mInputBuffer->range_offset() + (dataSizeBeforeDecode - mInData.GetDataSize()),
+                    LOGV_HOT("mInputBuffer->set_range(%d, %d)", mInputBuffer->range_offset() + (dataSizeBeforeDecode - mInData.GetDataSize()),
                             mInputBuffer->range_length() - (dataSizeBeforeDecode - mInData.GetDataSize()));
 
                     mInputBuffer->set_range(
                             mInputBuffer->range_offset() + (dataSizeBeforeDecode - mInData.GetDataSize()),
                             mInputBuffer->range_length() - (dataSizeBeforeDecode - mInData.GetDataSize()));
+                    bytesConsumed += dataSizeBeforeDecode - mInData.GetDataSize();
             }
             channels = mOutData.m_info.iChannels;
             numSamplesDecoded = mOutData.GetDataSize() / (sizeof(int16_t) * (channels?channels:1));
@@ -614,31 +919,31 @@ deleteMediaBufferGroup_exit:
             int32_t outputBufferRange = mOutData.GetDataSize();
             if (mNumSamplesLeftInFrame >= 0) {
                 if (numSamplesDecoded > mNumSamplesLeftInFrame) {
-                    LOGV("Discarding %d samples at end of frame", numSamplesDecoded - mNumSamplesLeftInFrame);
+                    LOGV_HOT("Discarding %d samples at end of frame", numSamplesDecoded - mNumSamplesLeftInFrame);
                     numSamplesDecoded = mNumSamplesLeftInFrame;
                     outputBufferRange = numSamplesDecoded * sizeof(int16_t) * mOutData.m_info.iChannels;
                 }
                 mNumSamplesLeftInFrame -= numSamplesDecoded;
             }
 
-           LOGV("buffer->set_range(0, %d)", outputBufferRange);
-            pBuffer->set_range(0, outputBufferRange);
+           LOGV_HOT("buffer->set_range(0, %d)", outputBufferRange);
+            pBuffer->set_range(0, outputBufferRange / sizeof(int16_t) * mSampleSize);
 
             if (mInputBuffer->range_length() == 0) {
                 SafeRelease(mInputBuffer);
-                LOGV("mInputBuffer->range_length() == 0, mInputBuffer released");
+                LOGV_HOT("mInputBuffer->range_length() == 0, mInputBuffer released");
             }
 
             deltaTime = 0;
             if (0 == mNumSamplesOutput) {
                 //Output Port Parameters:
-               LOGV("UMC decoder OutData sample frequency: %d", mOutData.m_info.iSampleFrequency);
-               LOGV("UMC decoder OutData channels number: %d", mOutData.m_info.iChannels);
+               LOGV_HOT("UMC decoder OutData sample frequency: %d", mOutData.m_info.iSampleFrequency);
+               LOGV_HOT("UMC decoder OutData channels number: %d", mOutData.m_info.iChannels);
             } else {
                 // Calculate key delta time:
                 if (mOutData.m_info.iSampleFrequency > 0) {
                     deltaTime = (mNumSamplesOutput * US_PER_SECOND ) / (mOutData.m_info.iSampleFrequency);
-                    LOGV("Frame delta time: %lld",  deltaTime);
+                    LOGV_HOT("Frame delta time: %lld",  deltaTime);
                 }
                 else {
                     LOGW("Failed to calculate key time! Sampling frequency of output audio data is lower or equal to zero: %d", mOutData.m_info.iSampleFrequency);
@@ -647,11 +952,44 @@ deleteMediaBufferGroup_exit:
         isDecodingSucceed = ((UMC::UMC_OK == decoderStatus) & (mOutData.GetDataSize() != 0));
         }
         while(isDecodingSucceed != true);
+
+        /* Fix for BZ 61379.
+         * Re-aligning the 6-channel output pcm buffer as the channel
+         * mapping for pcm output of AAC differs from Android multi-channel
+         * output( system/core/include/system/audio.h)
+         * AUDIO_CHANNEL_OUT_5POINT1  = (AUDIO_CHANNEL_OUT_FRONT_LEFT |
+         *                               AUDIO_CHANNEL_OUT_FRONT_RIGHT |
+         *                               AUDIO_CHANNEL_OUT_FRONT_CENTER |
+         *                               AUDIO_CHANNEL_OUT_LOW_FREQUENCY |
+         *                               AUDIO_CHANNEL_OUT_BACK_LEFT |
+         *                               AUDIO_CHANNEL_OUT_BACK_RIGHT),
+         * It is done on the 16-bit samples of the codec, before the downmix
+         * and the widening.
+         */
+        numChannels = mOutData.m_info.iChannels;
+        size_t numSamples16 = mOutData.GetDataSize() / sizeof(int16_t);
+        if (mIsAacSource && (numChannels == 6)) {
+            ReorderAac51((int16_t *)(pBuffer->data()), numSamples16);
+        }
+
+        // Stereo is written over the 5.1 frames, a third of the data is left
+        // for the widening and the sink.
+        int32_t outputChannels = numChannels;
+        if (mDownmix && (numChannels == 6)) {
+            Downmix51ToStereo((int16_t *)(pBuffer->data()), numSamples16 / 6, mDownmixCoeffs);
+            numSamples16 = numSamples16 / 6 * 2;
+            outputChannels = 2;
+            pBuffer->set_range(0, pBuffer->range_length() / 6 * 2);
+        }
+
+        if (PCM_OUTPUT_16_BIT != mPcmFormat) {
+            WidenPcm16(pBuffer->data(), numSamples16, mPcmFormat);
+        }
         // Set frame key time:
         pBuffer->meta_data()->setInt64( kKeyTime, mAnchorTimeUs + deltaTime);
 
         mNumSamplesOutput += numSamplesDecoded;
-        LOGV("sample_frequency=%d, mNumSamplesOutput=%d, mAnchorTimeUs=%lld, mNumDecodedBuffers=%d",
+        LOGV_HOT("sample_frequency=%d, mNumSamplesOutput=%d, mAnchorTimeUs=%lld, mNumDecodedBuffers=%d",
                 mOutData.m_info.iSampleFrequency, mNumSamplesOutput, mAnchorTimeUs, mNumDecodedBuffers);
 
 
@@ -660,53 +998,70 @@ deleteMediaBufferGroup_exit:
             if (getDecoderDelay())
             {
                 int32_t delayInSamles = getDecoderDelay();
-                int32_t delayInBytes = delayInSamles * mOutData.m_info.iChannels
-                        * sizeof(int16_t);
+                int32_t delayInBytes = delayInSamles * outputChannels
+                        * mSampleSize;
                 pBuffer->set_range(delayInBytes, pBuffer->range_length() - delayInBytes);
             }
             mIsFirstBuffer = false;
         }
-        if (mSkipCutBuffer != NULL) {
-            mSkipCutBuffer->submit(pBuffer);
-        }
+        *out = pBuffer;
 
-        /* Fix for BZ 61379.
-         * Re-aligning the 6-channel output pcm buffer as the channel
-         * mapping for pcm output of AAC differs from Android multi-channel
-         * output( system/core/include/system/audio.h)
-         * AUDIO_CHANNEL_OUT_5POINT1  = (AUDIO_CHANNEL_OUT_FRONT_LEFT |
-         *                               AUDIO_CHANNEL_OUT_FRONT_RIGHT |
-         *                               AUDIO_CHANNEL_OUT_FRONT_CENTER |
-         *                               AUDIO_CHANNEL_OUT_LOW_FREQUENCY |
-         *                               AUDIO_CHANNEL_OUT_BACK_LEFT |
-         *                               AUDIO_CHANNEL_OUT_BACK_RIGHT),
-         */
-        const char *mimeType;
-        sp<MetaData> srcFormat = mSource->getFormat();
-        mMeta->findInt32(kKeyChannelCount, &numChannels);
-        if (srcFormat->findCString(kKeyMIMEType, &mimeType) && (!strcasecmp(mimeType, MEDIA_MIMETYPE_AUDIO_AAC)) && (numChannels == 6)) {
-            int16_t *tmpInputBuffer = (int16_t *)( pBuffer->data());
-            int16_t center_sample, lfe_sample;
-
-            for (int i =0; i <  mOutData.GetDataSize()/2; i+=6) {
-                 center_sample       = tmpInputBuffer[i];        //saving center-channel sample
-                 lfe_sample          = tmpInputBuffer[i+5];      //saving lfe_sample
-                 tmpInputBuffer[i]   = tmpInputBuffer[i+1];      //moving front left sample to first pos
-                 tmpInputBuffer[i+1] = tmpInputBuffer[i+2];      //moving front-right sample to second pos
-                 tmpInputBuffer[i+5] = tmpInputBuffer[i+4];      //moving rear-right sample to last pos
-                 tmpInputBuffer[i+4] = tmpInputBuffer[i+3];      //moving rear-left sample to fifth pos
-                 tmpInputBuffer[i+2] = center_sample;            //copying center-sample to third pos
-                 tmpInputBuffer[i+3] = lfe_sample;               //copying lfe-sample to fourth pos
-            }
+        long long readTicks = GET_TICKS() - readStartTicks;
+        mStats->AddFrame(bytesConsumed, readTicks);
+        if (seekTimeUs >= 0) {
+            mStats->AddSeek(readTicks);
         }
 
-        *out = pBuffer;
-
-        LOGV("output size: %d", mOutData.GetDataSize());
+        LOGV_HOT("output size: %d", mOutData.GetDataSize());
 
         return OK;
     }
 
+    // Reads the first input buffer, which read() decodes first, and takes the
+    // sample rate and channel count of its headers. What the headers do not
+    // tell is still found by CheckFormatChange() on the first decoded frame.
+    template<FNCreateDecoder fnFactory>
+    void UMCAudioDecoder<fnFactory>::probeFormat_l(const sp<MetaData> &srcFormat)
+    {
+        if (OK != mSource->read(&mInputBuffer, NULL)) {
+            // read() reports the error again
+            SafeRelease(mInputBuffer);
+            return;
+        }
+        int64_t timeUs;
+        int32_t numFrameSamples;
+        sp<MetaData> inputFormat = mInputBuffer->meta_data();
+        if (inputFormat.get() && inputFormat->findInt32(kKeyValidSamples, &numFrameSamples)
+                && numFrameSamples >= 0) {
+            mNumSamplesLeftInFrame = numFrameSamples;
+        }
+        if (inputFormat.get() && inputFormat->findInt64(kKeyTime, &timeUs)) {
+            mAnchorTimeUs = timeUs;
+            mNumSamplesOutput = 0;
+        }
+
+        const char *mime = NULL;
+        int32_t probedSampleRate, probedChannels;
+        if (NULL == srcFormat.get() || !srcFormat->findCString(kKeyMIMEType, &mime)
+                || !ProbeStreamFormat(mime, srcFormat,
+                        (const uint8_t *)mInputBuffer->data() + mInputBuffer->range_offset(),
+                        mInputBuffer->range_length(), &probedSampleRate, &probedChannels)) {
+            LOGV("UMCAudioDecoder::probeFormat_l: no header to probe");
+            return;
+        }
+
+        int32_t sampleRate = 0;
+        int32_t numChannels = 0;
+        mMeta->findInt32(kKeySampleRate, &sampleRate);
+        mMeta->findInt32(kKeyChannelCount, &numChannels);
+        if (sampleRate != probedSampleRate || numChannels != probedChannels) {
+            LOGI("Stream headers give %d Hz, %d channels, the container %d Hz, %d channels",
+                    probedSampleRate, probedChannels, sampleRate, numChannels);
+            mMeta->setInt32(kKeySampleRate, probedSampleRate);
+            mMeta->setInt32(kKeyChannelCount, probedChannels);
+        }
+    }
+
     template<FNCreateDecoder fnFactory>
     status_t UMCAudioDecoder<fnFactory>::CheckFormatChange(bool &isResetReadFromBeginning)
     {
@@ -733,9 +1088,14 @@ deleteMediaBufferGroup_exit:
             formatchange = true;
         }
 
-        if (mOutData.m_info.iChannels != (uint32_t)numChannels) {
-            mMeta->setInt32(kKeyChannelCount, mOutData.m_info.iChannels);
-            LOGW("Channel count was %d, but is now %d.", numChannels, mOutData.m_info.iChannels);
+        // 5.1 is output as stereo when it is downmixed
+        uint32_t outputChannels = mOutData.m_info.iChannels;
+        if (mDownmix && outputChannels == 6) {
+            outputChannels = 2;
+        }
+        if (outputChannels != (uint32_t)numChannels) {
+            mMeta->setInt32(kKeyChannelCount, outputChannels);
+            LOGW("Channel count was %d, but is now %d.", numChannels, outputChannels);
             // We don't need to release buffers because data is already correctly decoded.
         }
 
@@ -769,6 +1129,14 @@ deleteMediaBufferGroup_exit:
     {
         return 0;
     }
+
+    // UMC::AudioCodec exposes no finer flush primitive than Reset(); codecs with
+    // a cheaper way to drop the bit reservoir and overlap state override this.
+    template<FNCreateDecoder fnFactory>
+    UMC::Status UMCAudioDecoder<fnFactory>::FlushDecoder()
+    {
+        return mpAudioUMCDecoder->Reset();
+    }
 }//namespace android
 
 #endif //UMC_DECODER_H_
@@ -0,0 +1,138 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_DOWNMIX_H_
+#define UMC_DOWNMIX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "UMCMacro.h"
+
+namespace android {
+
+// Levels are Q14, 16384 is 0 dB
+#define DOWNMIX_LEVEL_SHIFT 14
+#define DOWNMIX_LEVEL_UNITY (1 << DOWNMIX_LEVEL_SHIFT)
+// -3 dB, the ITU-R BS.775 level of the center and surround channels
+#define DOWNMIX_LEVEL_MINUS_3DB 11585
+
+// Stereo downmix matrix of a 5.1 stream, in the Android channel order
+// (L, R, C, LFE, Ls, Rs):
+//   L' = front * L + center * C + lfe * LFE + surround * Ls
+//   R' = front * R + center * C + lfe * LFE + surround * Rs
+struct DownmixCoeffs {
+    int16_t front;
+    int16_t center;
+    int16_t surround;
+    int16_t lfe;
+};
+
+// Matrix of a stream: the center and surround levels relative to the front
+// ones come from the source format (the levels the stream carries) and
+// default to -3 dB, the LFE is dropped. The front channels are at -6 dB so
+// that a full scale stream seldom clips.
+inline void GetDownmixCoeffs(const sp<MetaData> &srcFormat, DownmixCoeffs *coeffs){
+    int32_t center = DOWNMIX_LEVEL_MINUS_3DB;
+    int32_t surround = DOWNMIX_LEVEL_MINUS_3DB;
+    int32_t lfe = 0;
+    if (NULL != srcFormat.get()) {
+        srcFormat->findInt32(kKeyDownmixCenterLevel, &center);
+        srcFormat->findInt32(kKeyDownmixSurroundLevel, &surround);
+        srcFormat->findInt32(kKeyDownmixLfeLevel, &lfe);
+    }
+    int32_t front = DOWNMIX_LEVEL_UNITY / 2;
+    coeffs->front = front;
+    coeffs->center = (front * center) >> DOWNMIX_LEVEL_SHIFT;
+    coeffs->surround = (front * surround) >> DOWNMIX_LEVEL_SHIFT;
+    coeffs->lfe = (front * lfe) >> DOWNMIX_LEVEL_SHIFT;
+}
+
+inline int16_t DownmixClamp(int32_t sample){
+    sample = (sample + (1 << (DOWNMIX_LEVEL_SHIFT - 1))) >> DOWNMIX_LEVEL_SHIFT;
+    if (sample > 32767) {
+        return 32767;
+    }
+    if (sample < -32768) {
+        return -32768;
+    }
+    return sample;
+}
+
+// Downmixes frames 16-bit 5.1 frames to stereo in place: the stereo frames
+// are written from the start of the buffer, behind the 5.1 ones still read.
+inline void Downmix51ToStereo(int16_t *samples, size_t frames, const DownmixCoeffs &coeffs){
+    const int16_t *in = samples;
+    int16_t *out = samples;
+    size_t i = 0;
+
+#ifdef __SSSE3__
+    // Two frames an iteration: the 12 samples are gathered into the pairs
+    // (L, C), (R, C) and (Ls, LFE), (Rs, LFE) of both frames, so that one
+    // pmaddwd of each gives the 4 output samples. The second load only
+    // reaches the last sample of the second frame.
+    const __m128i frontCenter = _mm_set_epi16(coeffs.center, coeffs.front, coeffs.center, coeffs.front,
+            coeffs.center, coeffs.front, coeffs.center, coeffs.front);
+    const __m128i surroundLfe = _mm_set_epi16(coeffs.lfe, coeffs.surround, coeffs.lfe, coeffs.surround,
+            coeffs.lfe, coeffs.surround, coeffs.lfe, coeffs.surround);
+    const __m128i round = _mm_set1_epi32(1 << (DOWNMIX_LEVEL_SHIFT - 1));
+    // Byte indexes of the 16-bit samples, -1 clears the lane
+#define DMX_LANE(s) (char)(2 * (s)), (char)(2 * (s) + 1)
+#define DMX_NONE (char)-1, (char)-1
+    // v0 holds L0 R0 C0 F0 Ls0 Rs0 L1 R1, v1 holds Ls0 Rs0 L1 R1 C1 F1 Ls1 Rs1
+    const __m128i mainLo = _mm_setr_epi8(DMX_LANE(0), DMX_LANE(2), DMX_LANE(1), DMX_LANE(2),
+            DMX_LANE(6), DMX_NONE, DMX_LANE(7), DMX_NONE);
+    const __m128i mainHi = _mm_setr_epi8(DMX_NONE, DMX_NONE, DMX_NONE, DMX_NONE,
+            DMX_NONE, DMX_LANE(4), DMX_NONE, DMX_LANE(4));
+    const __m128i sideLo = _mm_setr_epi8(DMX_LANE(4), DMX_LANE(3), DMX_LANE(5), DMX_LANE(3),
+            DMX_NONE, DMX_NONE, DMX_NONE, DMX_NONE);
+    const __m128i sideHi = _mm_setr_epi8(DMX_NONE, DMX_NONE, DMX_NONE, DMX_NONE,
+            DMX_LANE(6), DMX_LANE(5), DMX_LANE(7), DMX_LANE(5));
+#undef DMX_LANE
+#undef DMX_NONE
+
+    for (; i + 2 <= frames; i += 2) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(in + 6 * i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(in + 6 * i + 4));
+        __m128i main = _mm_or_si128(_mm_shuffle_epi8(v0, mainLo), _mm_shuffle_epi8(v1, mainHi));
+        __m128i side = _mm_or_si128(_mm_shuffle_epi8(v0, sideLo), _mm_shuffle_epi8(v1, sideHi));
+        __m128i sum = _mm_add_epi32(_mm_madd_epi16(main, frontCenter), _mm_madd_epi16(side, surroundLfe));
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), DOWNMIX_LEVEL_SHIFT);
+        _mm_storel_epi64((__m128i *)(out + 2 * i), _mm_packs_epi32(sum, sum));
+    }
+#endif
+
+    for (; i < frames; i++) {
+        const int16_t *f = in + 6 * i;
+        int32_t common = coeffs.center * f[2] + coeffs.lfe * f[3];
+        int16_t left = DownmixClamp(coeffs.front * f[0] + common + coeffs.surround * f[4]);
+        int16_t right = DownmixClamp(coeffs.front * f[1] + common + coeffs.surround * f[5]);
+        out[2 * i] = left;
+        out[2 * i + 1] = right;
+    }
+}
+
+}//namespace android
+
+#endif //UMC_DOWNMIX_H_
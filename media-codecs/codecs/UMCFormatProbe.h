@@ -0,0 +1,219 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_FORMAT_PROBE_H_
+#define UMC_FORMAT_PROBE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MetaData.h>
+
+// Output format of a stream read from its headers, before anything is decoded.
+//
+// UMCAudioDecoder::start() probes the first input buffer with these, so that
+// the format it reports matches the one the codec decodes to, and the first
+// read() does not have to return INFO_FORMAT_CHANGED (which decodes the first
+// frame twice and makes the player recreate its audio track). Only what the
+// headers tell for sure is probed: the SBR and PS extensions of HE-AAC are
+// signalled inside the raw data, so such streams still go through
+// CheckFormatChange() after the first frame.
+
+namespace android {
+
+// MSB first reader of header fields
+struct ProbeBitReader {
+    ProbeBitReader(const uint8_t *data, size_t size)
+        :mData(data)
+        ,mSize(size)
+        ,mBitPos(0)
+        ,mOverrun(false)
+    {
+    }
+
+    uint32_t getBits(size_t n) {
+        uint32_t value = 0;
+        while (n--) {
+            if (mBitPos >= mSize * 8) {
+                mOverrun = true;
+                return 0;
+            }
+            value = (value << 1) | ((mData[mBitPos >> 3] >> (7 - (mBitPos & 7))) & 1);
+            mBitPos++;
+        }
+        return value;
+    }
+
+    void skipBits(size_t n) {
+        mBitPos += n;
+        if (mBitPos > mSize * 8) {
+            mOverrun = true;
+        }
+    }
+
+    bool overrun() const { return mOverrun; }
+
+private:
+    const uint8_t *mData;
+    size_t mSize;
+    size_t mBitPos;
+    bool mOverrun;
+};
+
+inline int32_t ProbeAacSampleRate(uint32_t index){
+    static const int32_t kRates[] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+    };
+    return (index < sizeof(kRates) / sizeof(kRates[0])) ? kRates[index] : 0;
+}
+
+// ADTS frame header. Channel configuration 0 (channels given by a program
+// config element in the raw data) is not probed.
+inline bool ProbeAdtsHeader(const uint8_t *data, size_t size, int32_t *sampleRate, int32_t *channels){
+    if (size < 7 || data[0] != 0xff || (data[1] & 0xf6) != 0xf0) {
+        return false;
+    }
+    int32_t rate = ProbeAacSampleRate((data[2] >> 2) & 0x0f);
+    uint32_t config = ((data[2] & 0x01) << 2) | (data[3] >> 6);
+    if (!rate || !config) {
+        return false;
+    }
+    *sampleRate = rate;
+    *channels = (7 == config) ? 8 : config;
+    return true;
+}
+
+// ADIF header and its first program config element
+inline bool ProbeAdifHeader(const uint8_t *data, size_t size, int32_t *sampleRate, int32_t *channels){
+    if (size < 4 || memcmp(data, "ADIF", 4)) {
+        return false;
+    }
+    ProbeBitReader bits(data + 4, size - 4);
+    if (bits.getBits(1)) {
+        bits.skipBits(72);                  // copyright_id
+    }
+    bits.skipBits(2);                       // original_copy, home
+    uint32_t bitstreamType = bits.getBits(1);
+    bits.skipBits(23 + 4);                  // bitrate, num_program_config_elements
+    if (0 == bitstreamType) {
+        bits.skipBits(20);                  // adif_buffer_fullness
+    }
+
+    bits.skipBits(4 + 2);                   // element_instance_tag, object_type
+    int32_t rate = ProbeAacSampleRate(bits.getBits(4));
+    uint32_t numFront = bits.getBits(4);
+    uint32_t numSide = bits.getBits(4);
+    uint32_t numBack = bits.getBits(4);
+    uint32_t numLfe = bits.getBits(2);
+    bits.skipBits(3 + 4);                   // num_assoc_data, num_valid_cc
+    for (int mixdown = 0; mixdown < 3; mixdown++) {
+        if (bits.getBits(1)) {
+            bits.skipBits(mixdown < 2 ? 4 : 3);
+        }
+    }
+    int32_t count = numLfe;
+    for (uint32_t i = 0; i < numFront + numSide + numBack; i++) {
+        count += bits.getBits(1) ? 2 : 1;   // is_cpe
+        bits.skipBits(4);
+    }
+    if (bits.overrun() || !rate || !count) {
+        return false;
+    }
+    *sampleRate = rate;
+    *channels = count;
+    return true;
+}
+
+// First MPEG audio frame header of the buffer, MPEG-1, 2 and 2.5
+inline bool ProbeMpegAudioHeader(const uint8_t *data, size_t size, int32_t *sampleRate, int32_t *channels){
+    static const int32_t kRates[] = { 44100, 48000, 32000 };
+    for (size_t i = 0; i + 4 <= size; i++) {
+        if (data[i] != 0xff || (data[i + 1] & 0xe0) != 0xe0) {
+            continue;
+        }
+        uint32_t version = (data[i + 1] >> 3) & 0x03;   // 0: 2.5, 2: 2, 3: 1
+        uint32_t layer = (data[i + 1] >> 1) & 0x03;
+        uint32_t bitrateIndex = data[i + 2] >> 4;
+        uint32_t rateIndex = (data[i + 2] >> 2) & 0x03;
+        if (1 == version || 0 == layer || 0x0f == bitrateIndex || 3 == rateIndex) {
+            continue;
+        }
+        int32_t rate = kRates[rateIndex];
+        if (2 == version) {
+            rate /= 2;
+        } else if (0 == version) {
+            rate /= 4;
+        }
+        *sampleRate = rate;
+        *channels = ((data[i + 3] >> 6) == 3) ? 1 : 2;
+        return true;
+    }
+    return false;
+}
+
+// Vorbis identification header
+inline bool ProbeVorbisIdent(const uint8_t *data, size_t size, int32_t *sampleRate, int32_t *channels){
+    if (size < 16 || data[0] != 1 || memcmp(data + 1, "vorbis", 6)) {
+        return false;
+    }
+    if (data[7] || data[8] || data[9] || data[10]) {
+        return false;                       // vorbis_version
+    }
+    int32_t rate = data[12] | (data[13] << 8) | (data[14] << 16) | (data[15] << 24);
+    if (!data[11] || rate <= 0) {
+        return false;
+    }
+    *sampleRate = rate;
+    *channels = data[11];
+    return true;
+}
+
+// Output format of a stream of this MIME type, from its first input buffer
+// or, for Vorbis, from the identification header of the source format.
+inline bool ProbeStreamFormat(const char *mime, const sp<MetaData> &srcFormat,
+        const uint8_t *data, size_t size, int32_t *sampleRate, int32_t *channels){
+    if (NULL == mime) {
+        return false;
+    }
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_AAC)) {
+        return ProbeAdtsHeader(data, size, sampleRate, channels)
+                || ProbeAdifHeader(data, size, sampleRate, channels);
+    }
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_MPEG)) {
+        return ProbeMpegAudioHeader(data, size, sampleRate, channels);
+    }
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_VORBIS)) {
+        uint32_t type;
+        const void *ident;
+        size_t identSize;
+        if (NULL != srcFormat.get() && srcFormat->findData(kKeyVorbisInfo, &type, &ident, &identSize)) {
+            return ProbeVorbisIdent(static_cast<const uint8_t *>(ident), identSize, sampleRate, channels);
+        }
+        return ProbeVorbisIdent(data, size, sampleRate, channels);
+    }
+    return false;
+}
+
+}//namespace android
+
+#endif //UMC_FORMAT_PROBE_H_
@@ -29,6 +29,12 @@
 #ifndef UMC_MACRO_H_
 #define UMC_MACRO_H_
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/properties.h>
+#include <media/stagefright/MetaData.h>
+
 #include "UMCPerfTracing.h"
 
 // Switch IPP to linux code path (defined in Andoird.mk)
@@ -37,6 +43,15 @@
 // Logging control define (comment to disable logging):
 // #define LOG_NDEBUG 0
 
+// Verbose logging inside per-frame decode loops. Formatting costs even when
+// the message is filtered at runtime, so it is compiled out unless the
+// plugin is built with -DUMC_HOT_PATH_LOGGING.
+#ifdef UMC_HOT_PATH_LOGGING
+#define LOGV_HOT(...) LOGV(__VA_ARGS__)
+#else
+#define LOGV_HOT(...) ((void)0)
+#endif
+
 // Factory declaration:
 #define FACTORY_CREATE_DECL(name) \
 sp<MediaSource> Make##name(const sp<MediaSource> &source);
@@ -57,11 +72,50 @@ sp<MediaSource> Make##name(const sp<MediaSource> &source){\
     return new ThreadedSource(new name(source)); \
 }
 
+// Factory implementation(+prefetch): the decoder starts warming up as soon as
+// it is created, so that a player preparing the next track gets a gapless start.
+// PrefetchSource.h should be included in the macro is used
+#define FACTORY_CREATE_IMPL_PREFETCH(name) \
+sp<MediaSource> Make##name(const sp<MediaSource> &source){\
+    sp<PrefetchSource> prefetch = new PrefetchSource(new name(source)); \
+    prefetch->prefetch(NULL); \
+    return prefetch; \
+}
+
+// Factory implementation(+compress offload): MP3 and AAC streams the DSP can
+// play are handed to it, the others are decoded on the CPU as before.
+// UMCOffloadSource.h should be included in the macro is used
+#define FACTORY_CREATE_IMPL_OFFLOAD(name) \
+sp<MediaSource> Make##name(const sp<MediaSource> &source){\
+    if (IsOffloadAvailable(source->getFormat())) \
+        return new UMCOffloadSource<name>(source); \
+    return new name(source); \
+}
+
+// Factory implementation(+PCM cache): short clips are decoded once and then
+// served from the process PCM cache, when media.mdp.pcm_cache.kb is set.
+// UMCPcmCache.h should be included in the macro is used
+#define FACTORY_CREATE_IMPL_PCM_CACHE(name) \
+static sp<MediaSource> Create##name(const sp<MediaSource> &source){\
+    return new name(source); \
+} \
+sp<MediaSource> Make##name(const sp<MediaSource> &source){\
+    return new UMCPcmCacheSource(source, Create##name); \
+}
+
 #define FACTORY_CREATE_ENCODER_IMPL(name)\
 sp<MediaSource> Make##name(const sp<MediaSource> &source, const sp<MetaData> &meta){\
     return new name(source, meta); \
 }
 
+// Encoder factory implementation(+threaded source): the encoder runs ahead
+// of the writer on its own thread, e.g. for camcorder recording.
+// ThreadedSource.h should be included in the macro is used
+#define FACTORY_CREATE_ENCODER_IMPL_THREADED(name)\
+sp<MediaSource> Make##name(const sp<MediaSource> &source, const sp<MetaData> &meta){\
+    return new ThreadedSource(new name(source, meta), THREADED_ENCODER); \
+}
+
 #define US_PER_SECOND 1000000LL
 namespace android{
 
@@ -84,7 +138,157 @@ enum {
     kKeyMultichannelSupport = 'mchS', // key for Int32 flag to enable multi-channel support in MDP plugins
     kKeyMp3DecoderLfeFilterOff = 'lfeO', // key for Int32 flag to turn off LFE filter in MP3 decoder
     kKeyAacParametricStereoModeOff = 'apsO', // key for Int32 flag to turn off Parmetric Stereo mode in AAC decoder
+    kKeyOutputBufferCount = 'obfC', // key for Int32 number of output buffers the decoder may keep in flight
+    kKeyFramesPerBuffer = 'fpbF', // key for Int32 number of codec frames a USC decoder or encoder, or a UMC audio decoder, packs into one buffer
+    kKeyAMRPacketFormat = 'amrP', // key for Int32 AMR_PACKET_* layout of multi-frame USC encoder output
+    kKeyAMRDtx = 'amrD', // key for Int32 flag to enable DTX (VAD and silent frame skipping) in USC encoders
+    kKeyDecoderThreadCount = 'dthC', // key for Int32 number of worker threads a video decoder plugin may use
+    kKeyPcmOutputFormat = 'pcmF', // key for Int32 PCM_OUTPUT_* sample format of UMC audio decoder output
+    kKeyDownmixStereo = 'dmxS', // key for Int32 flag to downmix 5.1 output to stereo in UMC audio decoders
+    kKeyDownmixCenterLevel = 'dmxC', // key for Int32 Q14 level of the center channel in the stereo downmix
+    kKeyDownmixSurroundLevel = 'dmxR', // key for Int32 Q14 level of the surround channels in the stereo downmix
+    kKeyDownmixLfeLevel = 'dmxL', // key for Int32 Q14 level of the LFE channel in the stereo downmix
+};
+
+// Layouts of a USC encoder output buffer holding several frames:
+enum {
+    AMR_PACKET_STORAGE = 0,   // RFC 4867 section 5 storage format, each frame with its own header
+    AMR_PACKET_RTP_OCTET = 1, // RFC 4867 section 4.4 octet-aligned payload: CMR, table of contents, frames
 };
 
+// Sample formats of a UMC audio decoder output buffer:
+enum {
+    PCM_OUTPUT_16_BIT = 0,    // signed 16-bit, what the UMC codecs decode to
+    PCM_OUTPUT_FLOAT = 1,     // 32-bit float in [-1, 1), for a float resampler or mixer
+    PCM_OUTPUT_24_IN_32 = 2,  // signed 24-bit in the low bits of 32, like AUDIO_FORMAT_PCM_8_24_BIT
+};
+
+// Output buffer ring depth, used when neither start() params nor the source
+// format carry kKeyOutputBufferCount:
+#define PROP_OUTPUT_BUFFER_COUNT "media.mdp.outbuf.count"
+#define DEFAULT_OUTPUT_BUFFER_COUNT 1
+#define MAX_OUTPUT_BUFFER_COUNT 8
+
+// Returns how many output buffers a plugin should allocate, so that decoding
+// can run ahead of the sink instead of waiting for each buffer to come back.
+inline size_t GetOutputBufferCount(MetaData *params, const sp<MetaData> &srcFormat){
+    int32_t count = 0;
+    if (NULL == params || !params->findInt32(kKeyOutputBufferCount, &count)) {
+        if (NULL == srcFormat.get() || !srcFormat->findInt32(kKeyOutputBufferCount, &count)) {
+            char value[PROPERTY_VALUE_MAX];
+            if (property_get(PROP_OUTPUT_BUFFER_COUNT, value, NULL) > 0) {
+                count = atoi(value);
+            }
+        }
+    }
+    if (count <= 0) {
+        count = DEFAULT_OUTPUT_BUFFER_COUNT;
+    } else if (count > MAX_OUTPUT_BUFFER_COUNT) {
+        count = MAX_OUTPUT_BUFFER_COUNT;
+    }
+    return count;
+}
+
+// Returns the PCM_OUTPUT_* format an audio decoder should emit, 16-bit
+// unless start() params or the source format ask for another one.
+inline int32_t GetPcmOutputFormat(MetaData *params, const sp<MetaData> &srcFormat){
+    int32_t format = PCM_OUTPUT_16_BIT;
+    if (NULL == params || !params->findInt32(kKeyPcmOutputFormat, &format)) {
+        if (NULL != srcFormat.get()) {
+            srcFormat->findInt32(kKeyPcmOutputFormat, &format);
+        }
+    }
+    if (format != PCM_OUTPUT_FLOAT && format != PCM_OUTPUT_24_IN_32) {
+        format = PCM_OUTPUT_16_BIT;
+    }
+    return format;
+}
+
+// True if an audio decoder should downmix 5.1 output to stereo itself,
+// as asked by start() params or the source format.
+inline bool GetDownmixStereo(MetaData *params, const sp<MetaData> &srcFormat){
+    int32_t downmix = 0;
+    if (NULL == params || !params->findInt32(kKeyDownmixStereo, &downmix)) {
+        if (NULL != srcFormat.get()) {
+            srcFormat->findInt32(kKeyDownmixStereo, &downmix);
+        }
+    }
+    return downmix != 0;
+}
+
+// Bytes of one sample of a PCM_OUTPUT_* format
+inline size_t GetPcmSampleSize(int32_t format){
+    return (PCM_OUTPUT_16_BIT == format) ? sizeof(int16_t) : sizeof(int32_t);
+}
+
+// Widens 16-bit samples to the format in place. The buffer holds
+// the 16-bit samples at its start and must have room for the wide ones,
+// which are written from the end so that no sample is overwritten unread.
+inline void WidenPcm16(void *data, size_t samples, int32_t format){
+    // Through memcpy, the 16-bit and wide samples alias each other
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    int16_t in;
+    if (PCM_OUTPUT_FLOAT == format) {
+        for (size_t i = samples; i-- > 0;) {
+            memcpy(&in, bytes + i * sizeof(in), sizeof(in));
+            float out = in * (1.0f / 32768.0f);
+            memcpy(bytes + i * sizeof(out), &out, sizeof(out));
+        }
+    } else if (PCM_OUTPUT_24_IN_32 == format) {
+        for (size_t i = samples; i-- > 0;) {
+            memcpy(&in, bytes + i * sizeof(in), sizeof(in));
+            int32_t out = (int32_t)in * 256;
+            memcpy(bytes + i * sizeof(out), &out, sizeof(out));
+        }
+    }
+}
+
+#define MAX_FRAMES_PER_BUFFER 16
+
+// Returns how many consecutive frames a frame-based decoder should put into
+// one output buffer (batch mode), 1 unless kKeyFramesPerBuffer is set.
+inline size_t GetFramesPerBuffer(MetaData *params, const sp<MetaData> &srcFormat){
+    int32_t count = 0;
+    if (NULL == params || !params->findInt32(kKeyFramesPerBuffer, &count)) {
+        if (NULL != srcFormat.get()) {
+            srcFormat->findInt32(kKeyFramesPerBuffer, &count);
+        }
+    }
+    if (count <= 0) {
+        count = 1;
+    } else if (count > MAX_FRAMES_PER_BUFFER) {
+        count = MAX_FRAMES_PER_BUFFER;
+    }
+    return count;
+}
+
+// Worker thread count for decoders that can split a frame across cores
+// (VP8 token partitions and loop filter rows), used when neither start()
+// params nor the source format carry kKeyDecoderThreadCount. 0 means one
+// thread per online CPU.
+#define PROP_DECODER_THREAD_COUNT "media.mdp.dec.threads"
+#define MAX_DECODER_THREAD_COUNT 8
+
+inline size_t GetDecoderThreadCount(MetaData *params, const sp<MetaData> &srcFormat){
+    int32_t count = 0;
+    if (NULL == params || !params->findInt32(kKeyDecoderThreadCount, &count)) {
+        if (NULL == srcFormat.get() || !srcFormat->findInt32(kKeyDecoderThreadCount, &count)) {
+            char value[PROPERTY_VALUE_MAX];
+            if (property_get(PROP_DECODER_THREAD_COUNT, value, NULL) > 0) {
+                count = atoi(value);
+            }
+        }
+    }
+    if (count <= 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count <= 0) {
+        count = 1;
+    } else if (count > MAX_DECODER_THREAD_COUNT) {
+        count = MAX_DECODER_THREAD_COUNT;
+    }
+    return count;
+}
+
 }
 #endif //UMC_MACRO_H_
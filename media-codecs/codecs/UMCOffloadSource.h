@@ -0,0 +1,250 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_OFFLOAD_SOURCE_H_
+#define UMC_OFFLOAD_SOURCE_H_
+
+#include <dirent.h>
+#include <string.h>
+
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MetaData.h>
+
+#include "UMCDecoder.h"
+
+namespace android {
+
+// Compress offload of MP3 and AAC to the SST audio DSP, 0 keeps the CPU decoders
+#define PROP_OFFLOAD "media.mdp.offload"
+#define OFFLOAD_DEVICE_DIR "/dev/snd"
+#define OFFLOAD_DEVICE_PREFIX "comprC"
+
+// Sample rates of the codec_offload output in audio_policy.conf
+inline bool IsOffloadSampleRate(int32_t sampleRate){
+    static const int32_t kRates[] = {
+        8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000
+    };
+    for (size_t i = 0; i < sizeof(kRates) / sizeof(kRates[0]); i++) {
+        if (kRates[i] == sampleRate) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if the stream of this format can be played by the DSP: MP3 or AAC,
+// mono or stereo, and a compress device exposed by the SST driver.
+inline bool IsOffloadAvailable(const sp<MetaData> &format){
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(PROP_OFFLOAD, value, "1") > 0 && !atoi(value)) {
+        return false;
+    }
+
+    const char *mime;
+    int32_t channels, sampleRate;
+    if (NULL == format.get() || !format->findCString(kKeyMIMEType, &mime)) {
+        return false;
+    }
+    if (strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_MPEG) && strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_AAC)) {
+        return false;
+    }
+    if (!format->findInt32(kKeyChannelCount, &channels) || channels < 1 || channels > 2) {
+        return false;
+    }
+    if (!format->findInt32(kKeySampleRate, &sampleRate) || !IsOffloadSampleRate(sampleRate)) {
+        return false;
+    }
+
+    DIR *dir = opendir(OFFLOAD_DEVICE_DIR);
+    if (NULL == dir) {
+        return false;
+    }
+    bool found = false;
+    struct dirent *entry;
+    while (!found && NULL != (entry = readdir(dir))) {
+        found = !strncmp(entry->d_name, OFFLOAD_DEVICE_PREFIX, strlen(OFFLOAD_DEVICE_PREFIX));
+    }
+    closedir(dir);
+    return found;
+}
+
+// Hands the encoded bitstream of a UMC decoder plugin to the DSP.
+//
+// Decoder is the plugin (a UMCAudioDecoder), whose CPU decoding stays the
+// fallback. start() decodes the first frame with the UMC codec only to probe
+// the stream: CheckFormatChange() gives the real sample rate and channel
+// count, which the DSP needs up front, and getDecoderDelay() the samples the
+// CPU path trims on the first buffer. The source buffers are then returned as
+// they are, with a format of the source MIME type, for the codec_offload
+// output of the audio HAL, and the gapless metadata trims what the CPU path
+// would have trimmed. If the probed stream does not fit the DSP, read()
+// decodes on the CPU from the probed frame on, and getFormat() is the PCM one.
+//
+// Use it through FACTORY_CREATE_IMPL_OFFLOAD in UMCMacro.h.
+template<class Decoder>
+struct UMCOffloadSource : public Decoder {
+    UMCOffloadSource(const sp<MediaSource> &source)
+        :Decoder(source)
+        ,mOffload(false)
+    {
+    }
+
+    virtual status_t start(MetaData *params) {
+        status_t err = Decoder::start(params);
+        if (OK != err) {
+            return err;
+        }
+        Mutex::Autolock autoLock(this->mLock);
+        mOffload = probe_l();
+        LOGI("UMCOffloadSource: %s", mOffload ? "compress offload" : "CPU decoding");
+        return OK;
+    }
+
+    virtual sp<MetaData> getFormat() {
+        Mutex::Autolock autoLock(this->mLock);
+        if (mOffload) {
+            return mOffloadMeta;
+        }
+        return this->mMeta;
+    }
+
+    virtual status_t read(MediaBuffer **out, const MediaSource::ReadOptions *options) {
+        {
+            Mutex::Autolock autoLock(this->mLock);
+            if (mOffload) {
+                return readOffload_l(out, options);
+            }
+        }
+        return Decoder::read(out, options);
+    }
+
+protected:
+    virtual ~UMCOffloadSource() {
+    }
+
+private:
+    // Decodes the first frame on the CPU, and sets up the offload format from
+    // it. The input buffer the decoder start() read for its format probe is
+    // left untouched for read(), either path.
+    bool probe_l() {
+        if (NULL == this->mInputBuffer) {
+            // read() reports the error again
+            return false;
+        }
+
+        sp<MetaData> srcFormat = this->mSource->getFormat();
+        if (!IsOffloadAvailable(srcFormat)) {
+            return false;
+        }
+
+        MediaBuffer *pBuffer;
+        if (OK != this->mBufferPool->acquire(&pBuffer)) {
+            return false;
+        }
+        this->mInData.SetBufferPointer((uint8_t *)this->mInputBuffer->data() + this->mInputBuffer->range_offset(),
+                this->mInputBuffer->range_length());
+        this->mInData.SetDataSize(this->mInputBuffer->range_length());
+        this->mOutData.SetBufferPointer(static_cast<uint8_t *>(pBuffer->data()), pBuffer->size());
+        this->mOutData.SetDataSize(0);
+        UMC::Status decoderStatus = this->mpAudioUMCDecoder->GetFrame(&this->mInData, &this->mOutData);
+
+        bool isResetReadFromBeginning = false;
+        status_t checkStatus = UNKNOWN_ERROR;
+        if (UMC::UMC_OK == decoderStatus && this->mOutData.GetDataSize() != 0) {
+            checkStatus = this->CheckFormatChange(isResetReadFromBeginning);
+        }
+        this->mOutData.Reset();
+        this->mOutData.SetDataSize(0);
+        SafeRelease(pBuffer);
+        // The CPU path, if it is needed, decodes the probed frame again
+        this->FlushDecoder();
+        if (OK != checkStatus && INFO_FORMAT_CHANGED != checkStatus) {
+            LOGW("UMCOffloadSource: probing returned %d, %d", decoderStatus, checkStatus);
+            return false;
+        }
+
+        int32_t sampleRate, channels;
+        if (!this->mMeta->findInt32(kKeySampleRate, &sampleRate)
+                || !this->mMeta->findInt32(kKeyChannelCount, &channels)) {
+            return false;
+        }
+        mOffloadMeta = new MetaData(*srcFormat.get());
+        mOffloadMeta->setInt32(kKeySampleRate, sampleRate);
+        mOffloadMeta->setInt32(kKeyChannelCount, channels);
+        if (!IsOffloadAvailable(mOffloadMeta)) {
+            mOffloadMeta.clear();
+            return false;
+        }
+
+        // Same trimming as the CPU path: the decoder delay on the first
+        // buffer, then the encoder delay, and the padding less the decoder
+        // delay at the end.
+        int32_t delay = 0;
+        int32_t padding = 0;
+        int32_t decoderDelay = this->getDecoderDelay();
+        srcFormat->findInt32(kKeyEncoderDelay, &delay);
+        srcFormat->findInt32(kKeyEncoderPadding, &padding);
+        if (padding > decoderDelay) {
+            padding -= decoderDelay;
+        }
+        mOffloadMeta->setInt32(kKeyEncoderDelay, delay + decoderDelay);
+        mOffloadMeta->setInt32(kKeyEncoderPadding, padding);
+        LOGV("UMCOffloadSource: %d Hz, %d channels, delay %d padding %d",
+                sampleRate, channels, delay + decoderDelay, padding);
+        return true;
+    }
+
+    status_t readOffload_l(MediaBuffer **out, const MediaSource::ReadOptions *options) {
+        *out = NULL;
+        if (!this->mStarted) {
+            return UNKNOWN_ERROR;
+        }
+
+        int64_t seekTimeUs;
+        MediaSource::ReadOptions::SeekMode mode;
+        if (options && options->getSeekTo(&seekTimeUs, &mode)) {
+            // The probed buffer is from before the seek point
+            SafeRelease(this->mInputBuffer);
+        }
+        if (NULL != this->mInputBuffer) {
+            *out = this->mInputBuffer;
+            this->mInputBuffer = NULL;
+            return OK;
+        }
+
+        status_t err = this->mSource->read(out, options);
+        if (OK != err && ERROR_IO != err) {
+            return ERROR_END_OF_STREAM;
+        }
+        return err;
+    }
+
+    bool mOffload;
+    sp<MetaData> mOffloadMeta;
+
+    UMCOffloadSource(const UMCOffloadSource &);//no copy
+    UMCOffloadSource &operator=(const UMCOffloadSource &);//no copy
+};
+
+}//namespace android
+
+#endif //UMC_OFFLOAD_SOURCE_H_
@@ -0,0 +1,526 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_PCM_CACHE_H_
+#define UMC_PCM_CACHE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <cutils/ashmem.h>
+#include <cutils/properties.h>
+#include <media/stagefright/MediaBuffer.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MediaSource.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/RefBase.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+#include "UMCMacro.h"
+
+// Size of the decoded PCM kept per process, 0 (the default) disables the cache.
+#define PROP_PCM_CACHE_SIZE_KB  "media.mdp.pcm_cache.kb"
+// Longest clip which is cached.
+#define PROP_PCM_CACHE_CLIP_MS  "media.mdp.pcm_cache.ms"
+#define DEFAULT_PCM_CACHE_CLIP_MS 5000
+// Bytes of PCM served in one buffer.
+#define PCM_CACHE_BUFFER_SIZE   8192
+
+namespace android {
+
+// Decoded PCM of one clip, in an ashmem region.
+struct PcmCacheEntry : public RefBase {
+    PcmCacheEntry(const String8 &key, const sp<MetaData> &format)
+        :mKey(key)
+        ,mFormat(format)
+        ,mFd(-1)
+        ,mData(NULL)
+        ,mSize(0)
+    {
+    }
+
+    // Copies size bytes of PCM into a new region.
+    status_t init(const void *data, size_t size) {
+        mFd = ashmem_create_region("umc_pcm_cache", size);
+        if (mFd < 0) {
+            return NO_MEMORY;
+        }
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+        if (MAP_FAILED == addr) {
+            close(mFd);
+            mFd = -1;
+            return NO_MEMORY;
+        }
+        memcpy(addr, data, size);
+        // Read only from now on, the region is shared by the readers
+        mprotect(addr, size, PROT_READ);
+        mData = static_cast<uint8_t *>(addr);
+        mSize = size;
+        return OK;
+    }
+
+    String8 mKey;
+    sp<MetaData> mFormat;
+    int mFd;
+    uint8_t *mData;
+    size_t mSize;
+
+protected:
+    virtual ~PcmCacheEntry() {
+        if (NULL != mData) {
+            munmap(mData, mSize);
+        }
+        if (mFd >= 0) {
+            close(mFd);
+        }
+    }
+};
+
+// Process wide cache of the decoded PCM of short clips, least recently used
+// first out, bounded by PROP_PCM_CACHE_SIZE_KB.
+class UMCPcmCache {
+public:
+    static bool IsEnabled() {
+        return GetCache().mMaxBytes > 0;
+    }
+
+    static int64_t MaxClipUs() {
+        return GetCache().mMaxClipUs;
+    }
+
+    static sp<PcmCacheEntry> Lookup(const String8 &key) {
+        Cache &cache = GetCache();
+        Mutex::Autolock autoLock(cache.mLock);
+        for (size_t i = 0; i < cache.mEntries.size(); i++) {
+            if (cache.mEntries[i]->mKey == key) {
+                sp<PcmCacheEntry> entry = cache.mEntries[i];
+                cache.mEntries.removeAt(i);
+                cache.mEntries.push(entry);
+                return entry;
+            }
+        }
+        return NULL;
+    }
+
+    static void Insert(const sp<PcmCacheEntry> &entry) {
+        Cache &cache = GetCache();
+        Mutex::Autolock autoLock(cache.mLock);
+        if (entry->mSize > cache.mMaxBytes) {
+            return;
+        }
+        while (!cache.mEntries.isEmpty() && cache.mBytes + entry->mSize > cache.mMaxBytes) {
+            cache.mBytes -= cache.mEntries[0]->mSize;
+            cache.mEntries.removeAt(0);
+        }
+        cache.mEntries.push(entry);
+        cache.mBytes += entry->mSize;
+    }
+
+private:
+    struct Cache {
+        Cache()
+            :mMaxBytes(0)
+            ,mMaxClipUs(DEFAULT_PCM_CACHE_CLIP_MS * 1000LL)
+            ,mBytes(0)
+        {
+            char value[PROPERTY_VALUE_MAX];
+            if (property_get(PROP_PCM_CACHE_SIZE_KB, value, NULL) > 0 && atoi(value) > 0) {
+                mMaxBytes = atoi(value) * 1024;
+            }
+            if (property_get(PROP_PCM_CACHE_CLIP_MS, value, NULL) > 0 && atoi(value) > 0) {
+                mMaxClipUs = atoi(value) * 1000LL;
+            }
+        }
+
+        Mutex mLock;
+        Vector<sp<PcmCacheEntry> > mEntries;
+        size_t mMaxBytes;
+        int64_t mMaxClipUs;
+        size_t mBytes;
+    };
+
+    static Cache &GetCache() {
+        static Cache cache;
+        return cache;
+    }
+};
+
+// FNV-1a, for the content hash of the encoded clip
+inline uint64_t PcmCacheHash(uint64_t hash, const uint8_t *data, size_t size){
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Serves short clips from the PCM cache, the decoder is only created on a
+// cache miss.
+//
+// start() reads the whole encoded clip, as long as it is no longer than
+// PROP_PCM_CACHE_CLIP_MS, and looks up its PCM by the source format and the
+// hash of the encoded data. On a miss the clip is decoded once, by a decoder
+// reading the buffers that were hashed, and its PCM is added to the cache.
+// The output buffers point into the ashmem region of the entry, no copy is
+// made. A longer clip, or a disabled cache, is decoded as it is read.
+//
+// Use it through FACTORY_CREATE_IMPL_PCM_CACHE in UMCMacro.h.
+struct UMCPcmCacheSource : public MediaSource, public MediaBufferObserver {
+    typedef sp<MediaSource> (*FNCreateSource)(const sp<MediaSource> &source);
+
+    UMCPcmCacheSource(const sp<MediaSource> &source, FNCreateSource fnCreate)
+        :mSource(source)
+        ,mCreate(fnCreate)
+        ,mStarted(false)
+        ,mSourceStarted(false)
+        ,mPos(0)
+        ,mFrameSize(0)
+        ,mSampleRate(0)
+        ,mNumOut(0)
+    {
+    }
+
+    virtual status_t start(MetaData *params) {
+        Mutex::Autolock autoLock(mLock);
+        if (mStarted) {
+            return UNKNOWN_ERROR;
+        }
+        mPos = 0;
+
+        String8 identity;
+        if (!getIdentity_l(params, &identity)) {
+            // Not cached, the decoder reads the source as usual
+            status_t err = startDecoder_l(params, mSource);
+            mStarted = (OK == err);
+            return err;
+        }
+
+        status_t err = mSource->start();
+        if (OK != err) {
+            return err;
+        }
+        mSourceStarted = true;
+
+        // The encoded clip is read and hashed, then replayed to the decoder
+        sp<ReplaySource> replay = new ReplaySource(mSource);
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (;;) {
+            MediaBuffer *pBuffer = NULL;
+            err = mSource->read(&pBuffer, NULL);
+            if (OK != err) {
+                break;
+            }
+            hash = PcmCacheHash(hash, (const uint8_t *)pBuffer->data() + pBuffer->range_offset(),
+                    pBuffer->range_length());
+            replay->add(pBuffer);
+        }
+        replay->setError(err);
+        if (ERROR_END_OF_STREAM != err) {
+            LOGW("UMCPcmCacheSource: reading the clip returned %d", err);
+            err = startDecoder_l(params, replay);
+        } else {
+            String8 key = identity;
+            key.appendFormat(":%016llx", (unsigned long long)hash);
+            mEntry = UMCPcmCache::Lookup(key);
+            err = OK;
+            if (mEntry == NULL) {
+                err = decodeEntry_l(params, replay, key);
+            }
+            if (OK == err) {
+                err = setupEntry_l();
+            }
+        }
+        if (OK != err) {
+            mSource->stop();
+            mSourceStarted = false;
+            return err;
+        }
+        mStarted = true;
+        return OK;
+    }
+
+    virtual status_t stop() {
+        Mutex::Autolock autoLock(mLock);
+        if (!mStarted) {
+            return OK;
+        }
+        status_t err = OK;
+        if (mDecoder != NULL) {
+            err = mDecoder->stop();
+            mDecoder.clear();
+        }
+        // The buffers point into the entry
+        while (mNumOut > 0) {
+            mCondition.wait(mLock);
+        }
+        mEntry.clear();
+        mStarted = false;
+        if (mSourceStarted) {
+            mSource->stop();
+            mSourceStarted = false;
+        }
+        return err;
+    }
+
+    virtual sp<MetaData> getFormat() {
+        Mutex::Autolock autoLock(mLock);
+        if (mDecoder != NULL) {
+            return mDecoder->getFormat();
+        }
+        if (mEntry != NULL) {
+            return mEntry->mFormat;
+        }
+        return mSource->getFormat();
+    }
+
+    virtual status_t read(MediaBuffer **out, const ReadOptions *options) {
+        Mutex::Autolock autoLock(mLock);
+        *out = NULL;
+        if (!mStarted) {
+            return UNKNOWN_ERROR;
+        }
+        if (mDecoder != NULL) {
+            return mDecoder->read(out, options);
+        }
+
+        int64_t seekTimeUs;
+        ReadOptions::SeekMode mode;
+        if (options && options->getSeekTo(&seekTimeUs, &mode)) {
+            if (seekTimeUs < 0) {
+                return BAD_VALUE;
+            }
+            mPos = (size_t)(seekTimeUs * mSampleRate / US_PER_SECOND) * mFrameSize;
+        }
+        if (mPos >= mEntry->mSize) {
+            return ERROR_END_OF_STREAM;
+        }
+
+        size_t len = mEntry->mSize - mPos;
+        size_t maxLen = PCM_CACHE_BUFFER_SIZE / mFrameSize * mFrameSize;
+        if (len > maxLen) {
+            len = maxLen;
+        }
+        MediaBuffer *pBuffer = new MediaBuffer(mEntry->mData + mPos, len);
+        pBuffer->setObserver(this);
+        pBuffer->add_ref();
+        pBuffer->meta_data()->setInt64(kKeyTime, (int64_t)(mPos / mFrameSize) * US_PER_SECOND / mSampleRate);
+        mNumOut++;
+        mPos += len;
+        *out = pBuffer;
+        return OK;
+    }
+
+    virtual void signalBufferReturned(MediaBuffer *buffer) {
+        Mutex::Autolock autoLock(mLock);
+        buffer->setObserver(NULL);
+        buffer->release();
+        mNumOut--;
+        mCondition.signal();
+    }
+
+protected:
+    virtual ~UMCPcmCacheSource() {
+        stop();
+    }
+
+private:
+    // Replays the buffers read by start(), then the error which ended them.
+    struct ReplaySource : public MediaSource {
+        ReplaySource(const sp<MediaSource> &source)
+            :mSource(source)
+            ,mError(OK)
+        {
+        }
+
+        void add(MediaBuffer *buffer) {
+            mBuffers.push(buffer);
+        }
+
+        void setError(status_t err) {
+            mError = err;
+        }
+
+        // The source is started and stopped by UMCPcmCacheSource
+        virtual status_t start(MetaData *params) {
+            return OK;
+        }
+
+        virtual status_t stop() {
+            return OK;
+        }
+
+        virtual sp<MetaData> getFormat() {
+            return mSource->getFormat();
+        }
+
+        virtual status_t read(MediaBuffer **out, const ReadOptions *options) {
+            *out = NULL;
+            int64_t seekTimeUs;
+            ReadOptions::SeekMode mode;
+            if (options && options->getSeekTo(&seekTimeUs, &mode)) {
+                // Only the replayed clip, from its start, is known
+                flush();
+                return mSource->read(out, options);
+            }
+            if (mBuffers.isEmpty()) {
+                return mError;
+            }
+            *out = mBuffers[0];
+            mBuffers.removeAt(0);
+            return OK;
+        }
+
+    protected:
+        virtual ~ReplaySource() {
+            flush();
+        }
+
+    private:
+        void flush() {
+            for (size_t i = 0; i < mBuffers.size(); i++) {
+                SafeRelease(mBuffers.editItemAt(i));
+            }
+            mBuffers.clear();
+        }
+
+        sp<MediaSource> mSource;
+        Vector<MediaBuffer *> mBuffers;
+        status_t mError;
+    };
+
+    // Source format and decoder settings, if the clip may be cached
+    bool getIdentity_l(MetaData *params, String8 *identity) {
+        if (!UMCPcmCache::IsEnabled()) {
+            return false;
+        }
+        sp<MetaData> format = mSource->getFormat();
+        const char *mime;
+        int32_t sampleRate, channels;
+        int64_t durationUs;
+        if (NULL == format.get() || !format->findCString(kKeyMIMEType, &mime)
+                || !format->findInt32(kKeySampleRate, &sampleRate)
+                || !format->findInt32(kKeyChannelCount, &channels)
+                || !format->findInt64(kKeyDuration, &durationUs)
+                || durationUs > UMCPcmCache::MaxClipUs()) {
+            return false;
+        }
+        identity->appendFormat("%s:%d:%d:%lld:%d:%d", mime, sampleRate, channels,
+                (long long)durationUs, GetPcmOutputFormat(params, format),
+                GetDownmixStereo(params, format) ? 1 : 0);
+        return true;
+    }
+
+    status_t startDecoder_l(MetaData *params, const sp<MediaSource> &source) {
+        mDecoder = mCreate(source);
+        if (mDecoder == NULL) {
+            return NO_MEMORY;
+        }
+        status_t err = mDecoder->start(params);
+        if (OK != err) {
+            mDecoder.clear();
+        }
+        return err;
+    }
+
+    // Decodes the whole clip into a new cache entry
+    status_t decodeEntry_l(MetaData *params, const sp<MediaSource> &replay, const String8 &key) {
+        status_t err = startDecoder_l(params, replay);
+        if (OK != err) {
+            return err;
+        }
+        uint8_t *pcm = NULL;
+        size_t size = 0;
+        for (;;) {
+            MediaBuffer *pBuffer = NULL;
+            err = mDecoder->read(&pBuffer, NULL);
+            if (INFO_FORMAT_CHANGED == err) {
+                continue;
+            }
+            if (OK != err) {
+                break;
+            }
+            size_t len = pBuffer->range_length();
+            uint8_t *grown = (uint8_t *)realloc(pcm, size + len);
+            if (NULL == grown) {
+                pBuffer->release();
+                err = NO_MEMORY;
+                break;
+            }
+            pcm = grown;
+            memcpy(pcm + size, (const uint8_t *)pBuffer->data() + pBuffer->range_offset(), len);
+            size += len;
+            pBuffer->release();
+        }
+        sp<MetaData> format = mDecoder->getFormat();
+        mDecoder->stop();
+        mDecoder.clear();
+        if (ERROR_END_OF_STREAM == err && size > 0) {
+            mEntry = new PcmCacheEntry(key, new MetaData(*format.get()));
+            err = mEntry->init(pcm, size);
+            if (OK == err) {
+                UMCPcmCache::Insert(mEntry);
+            } else {
+                mEntry.clear();
+            }
+        } else if (OK == err || ERROR_END_OF_STREAM == err) {
+            err = ERROR_MALFORMED;
+        }
+        free(pcm);
+        return err;
+    }
+
+    status_t setupEntry_l() {
+        int32_t channels;
+        int32_t format = PCM_OUTPUT_16_BIT;
+        if (!mEntry->mFormat->findInt32(kKeySampleRate, &mSampleRate)
+                || !mEntry->mFormat->findInt32(kKeyChannelCount, &channels)
+                || mSampleRate <= 0 || channels <= 0) {
+            mEntry.clear();
+            return ERROR_MALFORMED;
+        }
+        mEntry->mFormat->findInt32(kKeyPcmOutputFormat, &format);
+        mFrameSize = channels * GetPcmSampleSize(format);
+        return OK;
+    }
+
+    sp<MediaSource> mSource;
+    FNCreateSource mCreate;
+    sp<MediaSource> mDecoder;
+    sp<PcmCacheEntry> mEntry;
+    Mutex mLock;
+    Condition mCondition;
+    bool mStarted;
+    bool mSourceStarted;
+    size_t mPos;
+    size_t mFrameSize;
+    int32_t mSampleRate;
+    size_t mNumOut;
+
+    UMCPcmCacheSource(const UMCPcmCacheSource &);//no copy
+    UMCPcmCacheSource &operator=(const UMCPcmCacheSource &);//no copy
+};
+
+}//namespace android
+
+#endif //UMC_PCM_CACHE_H_
@@ -23,9 +23,12 @@ Portions Copyright (c) 2011 Intel Corporation.
 #define PERF_GATHER_H_
 
 #include <sys/time.h>
-//#include <time.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #define USE_RDTSC // enable RDTSC counter
 #define COLLECT_PERFORMANCE
@@ -48,40 +51,252 @@ static unsigned long long int rdtsc1(void)
    return ((unsigned long long)a) | (((unsigned long long)d) << 32);;
 }
 
-#ifdef USE_RDTSC
-    #define GET_TICKS()  rdtsc1()
+static long long getMonotonicNs1()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_nsec + ts.tv_sec * 1000000000ll;
+}
+
+static void cpuid1(unsigned leaf, unsigned &a, unsigned &b, unsigned &c, unsigned &d)
+{
+#if defined(__i386__) && defined(__PIC__)
+   // ebx holds the GOT pointer in 32-bit PIC code
+   __asm__ volatile("xchgl %%ebx, %1\n\tcpuid\n\txchgl %%ebx, %1"
+                    : "=a" (a), "=r" (b), "=c" (c), "=d" (d) : "a" (leaf));
 #else
-    #define GET_TICKS()  getNowUs1()
+   __asm__ volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (leaf));
 #endif
+}
+
+// Invariant TSC (CPUID 0x80000007, EDX bit 8) ticks at a constant rate
+// whatever the P-state, otherwise DVFS makes ticks incomparable.
+static bool isTscInvariant1()
+{
+    unsigned a, b, c, d;
+    cpuid1(0x80000000, a, b, c, d);
+    if (a < 0x80000007) {
+        return false;
+    }
+    cpuid1(0x80000007, a, b, c, d);
+    return (d >> 8) & 1;
+}
+
+#define PERF_CALIBRATION_US 5000 // TSC calibration window
+
+// Tick source picked once per process: TSC when it is invariant and
+// USE_RDTSC is set, CLOCK_MONOTONIC (ticks == ns) otherwise.
+struct PerfClockCalibration
+{
+    bool useTsc;
+    double nsPerTick;
+};
+
+static PerfClockCalibration PerfCalibrate()
+{
+    PerfClockCalibration cal;
+    cal.useTsc = false;
+    cal.nsPerTick = 1.0;
+#ifdef USE_RDTSC
+    if (isTscInvariant1()) {
+        long long ns0 = getMonotonicNs1();
+        long long tsc0 = rdtsc1();
+        usleep(PERF_CALIBRATION_US);
+        long long ns1 = getMonotonicNs1();
+        long long tsc1 = rdtsc1();
+        if (tsc1 > tsc0 && ns1 > ns0) {
+            cal.useTsc = true;
+            cal.nsPerTick = double(ns1 - ns0) / double(tsc1 - tsc0);
+        }
+    }
+#endif
+    return cal;
+}
+
+inline const PerfClockCalibration &PerfGetCalibration()
+{
+    static const PerfClockCalibration cal = PerfCalibrate();
+    return cal;
+}
+
+inline long long PerfGetTicks()
+{
+    return PerfGetCalibration().useTsc ? (long long)rdtsc1() : getMonotonicNs1();
+}
+
+inline double PerfTicksToUs(long long ticks)
+{
+    return ticks * PerfGetCalibration().nsPerTick / 1000.0;
+}
+
+#define GET_TICKS()  PerfGetTicks()
+
+#define PERF_TIMER_MAX_SLOTS    8   // per-thread accumulators kept by each timer
+#define PERF_TIMER_HIST_BUCKETS 32  // latency histogram, bucket N counts ticks in [2^(N-1), 2^N)
+
+// Accumulator owned by one thread (or a few, once there are more threads than
+// slots). Updated with atomics only, readers may take a snapshot at any time.
+struct PerfTimerSlot
+{
+    volatile int32_t number_calls;
+    volatile int64_t ticks;
+    volatile int64_t min_ticks;
+    volatile int64_t max_ticks;
+    volatile int64_t media_us;
+    volatile int32_t histogram[PERF_TIMER_HIST_BUCKETS];
+};
+
+// Aggregated view over all slots of a timer.
+struct PerfTimerStats
+{
+    int32_t number_calls;
+    int64_t ticks;
+    int64_t min_ticks;
+    int64_t max_ticks;
+    int64_t media_us;
+    int32_t histogram[PERF_TIMER_HIST_BUCKETS];
+};
+
+// Returns the accumulator slot of the calling thread.
+inline int PerfThreadSlot()
+{
+    static volatile int32_t next_slot = 0;
+    static __thread int slot = -1;
+    if (slot < 0) {
+        slot = __sync_fetch_and_add(&next_slot, 1) % PERF_TIMER_MAX_SLOTS;
+    }
+    return slot;
+}
+
+inline int PerfHistogramBucket(long long val)
+{
+    if (val <= 0) {
+        return 0;
+    }
+    int bucket = 64 - __builtin_clzll((unsigned long long)val);
+    return bucket < PERF_TIMER_HIST_BUCKETS ? bucket : PERF_TIMER_HIST_BUCKETS - 1;
+}
 
 class GlobalTimer
 {
 public:
     GlobalTimer(const char *name)
     {
-        number_calls = 0;
-        ticks = 0;
+        memset(m_slots, 0, sizeof(m_slots));
+        for (int i = 0; i < PERF_TIMER_MAX_SLOTS; i++) {
+            m_slots[i].min_ticks = LLONG_MAX;
+        }
         strncpy(m_name, name, sizeof(m_name)/sizeof(m_name[0])-1);
+        m_name[sizeof(m_name)/sizeof(m_name[0])-1] = 0;
+
+        // Publish the timer so that DumpAll() can find it, lock-free.
+        GlobalTimer *volatile &head = ListHead();
+        do {
+            m_next = head;
+        } while (!__sync_bool_compare_and_swap(&head, m_next, this));
     }
     void Add(long long val)
     {
-        ticks += val;
-        number_calls++;
+        PerfTimerSlot &slot = m_slots[PerfThreadSlot()];
+
+        __sync_fetch_and_add(&slot.number_calls, 1);
+        __sync_fetch_and_add(&slot.ticks, (int64_t)val);
+        __sync_fetch_and_add(&slot.histogram[PerfHistogramBucket(val)], 1);
+
+        int64_t cur = slot.min_ticks;
+        while (val < cur && !__sync_bool_compare_and_swap(&slot.min_ticks, cur, (int64_t)val)) {
+            cur = slot.min_ticks;
+        }
+        cur = slot.max_ticks;
+        while (val > cur && !__sync_bool_compare_and_swap(&slot.max_ticks, cur, (int64_t)val)) {
+            cur = slot.max_ticks;
+        }
+    }
+    // Accounts the duration of the media produced by the timed calls,
+    // used to report the real-time factor.
+    void AddMediaTime(long long us)
+    {
+        __sync_fetch_and_add(&m_slots[PerfThreadSlot()].media_us, (int64_t)us);
     }
-    void Close()
+    void Snapshot(PerfTimerStats &stats) const
     {
-    float averageTicks = float(ticks) / number_calls;
-
-    printf("%s; %d; %lld; %.6f;", m_name, number_calls, ticks, averageTicks);
+        memset(&stats, 0, sizeof(stats));
+        stats.min_ticks = LLONG_MAX;
+        for (int i = 0; i < PERF_TIMER_MAX_SLOTS; i++) {
+            const PerfTimerSlot &slot = m_slots[i];
+            stats.number_calls += slot.number_calls;
+            stats.ticks += slot.ticks;
+            stats.media_us += slot.media_us;
+            if (slot.min_ticks < stats.min_ticks) {
+                stats.min_ticks = slot.min_ticks;
+            }
+            if (slot.max_ticks > stats.max_ticks) {
+                stats.max_ticks = slot.max_ticks;
+            }
+            for (int j = 0; j < PERF_TIMER_HIST_BUCKETS; j++) {
+                stats.histogram[j] += slot.histogram[j];
+            }
+        }
+        if (0 == stats.number_calls) {
+            stats.min_ticks = 0;
+        }
+    }
+    // Writes one line of statistics, followed by the non-empty histogram buckets.
+    void Dump(int fd) const
+    {
+        PerfTimerStats stats;
+        char line[256];
+        Snapshot(stats);
 
+        float averageTicks = stats.number_calls ? float(stats.ticks) / stats.number_calls : 0.f;
+        double totalUs = PerfTicksToUs(stats.ticks);
+        double averageUs = stats.number_calls ? totalUs / stats.number_calls : 0.0;
+        // Real-time factor: seconds of media produced per second of CPU.
+        double rtFactor = totalUs > 0.0 ? stats.media_us / totalUs : 0.0;
+        int len = snprintf(line, sizeof(line),
+                           "%s; calls %d; ticks %lld; avg %.6f; avg %.3f us; min %.3f us; max %.3f us; x%.1f realtime; %s\n",
+                           m_name, stats.number_calls, (long long)stats.ticks, averageTicks,
+                           averageUs, PerfTicksToUs(stats.min_ticks), PerfTicksToUs(stats.max_ticks),
+                           rtFactor, PerfGetCalibration().useTsc ? "tsc" : "monotonic");
+        WriteLine(fd, line, len);
+        for (int j = 0; j < PERF_TIMER_HIST_BUCKETS; j++) {
+            if (stats.histogram[j]) {
+                len = snprintf(line, sizeof(line), "    < 2^%d: %d\n", j, stats.histogram[j]);
+                WriteLine(fd, line, len);
+            }
+        }
+    }
+    // Dumps every timer of the process, e.g. from a dumpsys handler.
+    static void DumpAll(int fd)
+    {
+        for (GlobalTimer *timer = ListHead(); NULL != timer; timer = timer->m_next) {
+            timer->Dump(fd);
+        }
+    }
+    void Close()
+    {
+        Dump(STDOUT_FILENO);
     }
     ~GlobalTimer()
     {
         Close();
     }
 protected:
-    int number_calls;
-    long long ticks;
+    static GlobalTimer *volatile &ListHead()
+    {
+        static GlobalTimer *volatile head = NULL;
+        return head;
+    }
+    static void WriteLine(int fd, const char *line, int len)
+    {
+        if (len > 0) {
+            write(fd, line, len);
+        }
+    }
+
+    PerfTimerSlot m_slots[PERF_TIMER_MAX_SLOTS];
+    GlobalTimer *m_next;
     char m_name[1024];
 };
 
@@ -108,8 +323,12 @@ protected:
 #define AUTO_TIMER(NAME)                            \
     static GlobalTimer global_timer(NAME);          \
     LocalTimer local_timer(global_timer);
+// Media duration produced inside the enclosing AUTO_TIMER scope
+#define AUTO_TIMER_MEDIA_US(US)                     \
+    global_timer.AddMediaTime(US);
 #else
 #define AUTO_TIMER(NAME)
+#define AUTO_TIMER_MEDIA_US(US)
 #endif
 
 #endif  //PERF_GATHER_H_
@@ -0,0 +1,172 @@
+/*
+Portions Copyright (c) 2011 Intel Corporation.
+*/
+
+/*
+* Copyright (C) 2009 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef UMC_SCHED_POLICY_H_
+#define UMC_SCHED_POLICY_H_
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <cutils/properties.h>
+#include <cutils/sched_policy.h>
+#include <media/stagefright/MetaData.h>
+#include <utils/threads.h>
+
+// Scheduling of the thread a plugin decodes or encodes on.
+//
+// Each setting comes from start() params, then the source format (where the
+// framework puts what media_codecs.xml gives the codec), then the properties
+// <prefix>.prio, <prefix>.rt, <prefix>.cpu and <prefix>.group of the plugin
+// class, and is left alone if none of them has it:
+//   prio   Android priority (nice level), e.g. -16 for ANDROID_PRIORITY_AUDIO
+//   rt     SCHED_FIFO priority 1..99, which overrides prio; needs
+//          CAP_SYS_NICE, the thread keeps prio if it is refused
+//   cpu    core the thread is pinned to
+//   group  SP_* cgroup of cutils/sched_policy.h
+#define PROP_SCHED_VOICE  "media.mdp.sched.voice"   // USC (AMR) decoders and encoders
+#define PROP_SCHED_DECODE "media.mdp.sched.decode"  // decode-ahead threads
+#define PROP_SCHED_ENCODE "media.mdp.sched.encode"  // encode-ahead threads
+
+#define MAX_SCHED_FIFO_PRIORITY 99
+
+namespace android {
+
+// Meta data keys of the scheduling policy (start() params or source format):
+enum {
+    kKeySchedPriority = 'scPr',  // key for Int32 Android priority of the codec thread
+    kKeySchedFifo = 'scRt',      // key for Int32 SCHED_FIFO priority of the codec thread
+    kKeySchedCpu = 'scCp',       // key for Int32 core the codec thread is pinned to
+    kKeySchedGroup = 'scGr',     // key for Int32 SP_* cgroup of the codec thread
+};
+
+struct CodecSchedPolicy {
+    CodecSchedPolicy()
+        :hasPriority(false), priority(0)
+        ,fifo(0)
+        ,cpu(-1)
+        ,hasGroup(false), group(0)
+    {
+    }
+
+    bool isSet() const {
+        return hasPriority || fifo > 0 || cpu >= 0 || hasGroup;
+    }
+
+    bool hasPriority;
+    int32_t priority;
+    int32_t fifo;       // 0: not real-time
+    int32_t cpu;        // -1: any core
+    bool hasGroup;
+    int32_t group;
+};
+
+inline bool GetSchedSetting(MetaData *params, const sp<MetaData> &srcFormat,
+        uint32_t key, const char *prefix, const char *suffix, int32_t *value){
+    if (NULL != params && params->findInt32(key, value)) {
+        return true;
+    }
+    if (NULL != srcFormat.get() && srcFormat->findInt32(key, value)) {
+        return true;
+    }
+    char prop[PROPERTY_KEY_MAX];
+    char propValue[PROPERTY_VALUE_MAX];
+    snprintf(prop, sizeof(prop), "%s.%s", prefix, suffix);
+    if (property_get(prop, propValue, NULL) > 0) {
+        *value = atoi(propValue);
+        return true;
+    }
+    return false;
+}
+
+inline void GetSchedPolicy(MetaData *params, const sp<MetaData> &srcFormat,
+        const char *prefix, CodecSchedPolicy *policy){
+    *policy = CodecSchedPolicy();
+    int32_t value;
+    if (GetSchedSetting(params, srcFormat, kKeySchedPriority, prefix, "prio", &value)) {
+        policy->hasPriority = true;
+        policy->priority = value;
+    }
+    if (GetSchedSetting(params, srcFormat, kKeySchedFifo, prefix, "rt", &value)) {
+        policy->fifo = (value < 0) ? 0 : (value > MAX_SCHED_FIFO_PRIORITY) ? MAX_SCHED_FIFO_PRIORITY : value;
+    }
+    if (GetSchedSetting(params, srcFormat, kKeySchedCpu, prefix, "cpu", &value)) {
+        policy->cpu = (value < 0 || value >= CPU_SETSIZE) ? -1 : value;
+    }
+    if (GetSchedSetting(params, srcFormat, kKeySchedGroup, prefix, "group", &value)) {
+        policy->hasGroup = true;
+        policy->group = value;
+    }
+}
+
+// Applies the policy to the thread tid. Each setting that is refused is
+// logged and skipped, the others still apply.
+inline void ApplySchedPolicy(const CodecSchedPolicy &policy, pid_t tid){
+    if (policy.hasGroup && 0 != set_sched_policy(tid, (SchedPolicy)policy.group)) {
+        LOGW("Codec thread %d: cgroup %d refused", tid, policy.group);
+    }
+    if (policy.hasPriority) {
+        // androidSetThreadPriority() also moves the thread to the cgroup of
+        // the priority, which would undo the one given
+        int err = policy.hasGroup ? setpriority(PRIO_PROCESS, tid, policy.priority)
+                                  : androidSetThreadPriority(tid, policy.priority);
+        if (0 != err) {
+            LOGW("Codec thread %d: priority %d refused", tid, policy.priority);
+        }
+    }
+    if (policy.fifo > 0) {
+        struct sched_param param;
+        param.sched_priority = policy.fifo;
+        if (0 != sched_setscheduler(tid, SCHED_FIFO, &param)) {
+            LOGW("Codec thread %d: SCHED_FIFO %d refused", tid, policy.fifo);
+        }
+    }
+    if (policy.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(policy.cpu, &cpus);
+        if (0 != sched_setaffinity(tid, sizeof(cpus), &cpus)) {
+            LOGW("Codec thread %d: core %d refused", tid, policy.cpu);
+        }
+    }
+    LOGV("Codec thread %d: prio %d, rt %d, cpu %d, group %d", tid,
+            policy.hasPriority ? policy.priority : 0, policy.fifo, policy.cpu,
+            policy.hasGroup ? policy.group : -1);
+}
+
+// For plugins running on the thread that calls read(): applies the policy
+// the first time a thread reads, so a new caller thread gets it too.
+inline void ApplySchedPolicyToCaller(const CodecSchedPolicy &policy, pid_t *pAppliedTid){
+    if (!policy.isSet()) {
+        return;
+    }
+    pid_t tid = gettid();
+    if (tid != *pAppliedTid) {
+        ApplySchedPolicy(policy, tid);
+        *pAppliedTid = tid;
+    }
+}
+
+}//namespace android
+
+#endif //UMC_SCHED_POLICY_H_
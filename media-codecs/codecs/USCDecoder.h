@@ -32,6 +32,9 @@ Portions Copyright (c) 2011 Intel Corporation.
 #include <media/stagefright/MediaSource.h>
 
 #include "CIPAMRCommon.h"
+#include "UMCCodecStats.h"
+#include "UMCCpuDispatch.h"
+#include "UMCSchedPolicy.h"
 
 namespace android {
 
@@ -53,10 +56,27 @@ protected:
     virtual ~USCDecoder();
 
 private:
+    // Decodes the next frame of mInputBuffer into pOut (kNumSamplesPerFrame samples).
+    status_t decodeFrame(int16_t *pOut);
+
+    // Per frame type (FT field of the IETF frame header) decoding parameters.
+    // Resolved once from amr_common for codecType, indexed by FT in read().
+    enum { kNumFrameModes = 16 };
+    struct FrameModeInfo {
+        Frame_Type_3GPP mode;
+        Epp32s length;              // frame length in bytes, header included
+        Epp32s bitrate;
+        Epp32s uscFrameType;
+        Epp32s *pOrderMapTbl;       // active frames only
+        Epp32s frameLenBits;
+    };
+    void initFrameModes();
+
     sp<MediaSource> mSource;
     bool mStarted;
 
     MediaBufferGroup *mBufferGroup;
+    size_t mFramesPerBuffer;
 
     int64_t mAnchorTimeUs;
     int64_t mNumSamplesOutput;
@@ -72,6 +92,11 @@ private:
     USC_Handle mUSCDecoder;
     USC_CodecInfo mInfo;
     Epp32s mPrevBitrate;
+    FrameModeInfo mFrameModes[kNumFrameModes];
+    CodecStats *mStats;
+
+    CodecSchedPolicy mSchedPolicy;  // applied to the threads calling read()
+    pid_t mSchedTid;
 
     USCDecoder(const USCDecoder &);
     USCDecoder &operator=(const USCDecoder &);
@@ -84,15 +109,38 @@ USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
     : mSource(source),
       mStarted(false),
       mBufferGroup(NULL),
+      mFramesPerBuffer(1),
       mAnchorTimeUs(0),
       mNumSamplesOutput(0),
       mInputBuffer(NULL),
       maxNumSkipedFrames(7),
       numSkipedFrames(7),
-      mrUSCAMRFxns (GetUSCFunctions<codecType>()) {
+      mrUSCAMRFxns (GetUSCFunctions<codecType>()),
+      mStats(CodecStats::Get(LOG_TAG)),
+      mSchedTid(0) {
+    UMCCpuDispatchInit();
+    initFrameModes();
     LOGI("USC Decoder plugin created, Media Codecs version: %s", MediaCodecs_GetVersion() );
 }
 
+template<size_t uInBufferSize, SAMPLES_PER_FRAME kNumSamplesPerFrame, int32_t kSampleRate, AMRCodecType codecType>
+void USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
+::initFrameModes() {
+    for (int ft = 0; ft < kNumFrameModes; ft++) {
+        FrameModeInfo &info = mFrameModes[ft];
+        // IETF header byte: F=0, FT, Q=1.
+        uint8_t header = (uint8_t)((ft << 3) | 0x04);
+        info.mode = GetFrameTypeLength(codecType, &header, &info.length);
+        info.bitrate = GetBitRate(codecType, info.mode);
+        info.uscFrameType = GetUSCFrameType(codecType, info.mode);
+        info.pOrderMapTbl = NULL;
+        info.frameLenBits = 0;
+        if (0 != info.bitrate && 0 == info.uscFrameType) {
+            GetBitReordersTable(codecType, info.mode, &info.pOrderMapTbl, &info.frameLenBits);
+        }
+    }
+}
+
 template<size_t uInBufferSize, SAMPLES_PER_FRAME kNumSamplesPerFrame, int32_t kSampleRate, AMRCodecType codecType>
 USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
 ::~USCDecoder() {
@@ -110,15 +158,25 @@ status_t USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
     }
 
     mBufferGroup = new MediaBufferGroup;
-    MediaBuffer *pOutBuf = new MediaBuffer(kNumSamplesPerFrame * sizeof(int16_t));
-    if (NULL == mBufferGroup || NULL == pOutBuf) {
-        delete mBufferGroup;
-        mBufferGroup = NULL;
-
+    if (NULL == mBufferGroup) {
         LOGE("Failed to allocate memory");
         return NO_MEMORY;
     }
-    mBufferGroup->add_buffer(pOutBuf);
+    mFramesPerBuffer = GetFramesPerBuffer(params, mSource->getFormat());
+    GetSchedPolicy(params, mSource->getFormat(), PROP_SCHED_VOICE, &mSchedPolicy);
+    mSchedTid = 0;
+    size_t numOutBufs = GetOutputBufferCount(params, mSource->getFormat());
+    for (size_t i = 0; i < numOutBufs; i++) {
+        MediaBuffer *pOutBuf = new MediaBuffer(mFramesPerBuffer * kNumSamplesPerFrame * sizeof(int16_t));
+        if (NULL == pOutBuf) {
+            delete mBufferGroup;
+            mBufferGroup = NULL;
+
+            LOGE("Failed to allocate memory");
+            return NO_MEMORY;
+        }
+        mBufferGroup->add_buffer(pOutBuf);
+    }
 
     if (mrUSCAMRFxns.std.GetInfo((USC_Handle)NULL, &mInfo) != USC_NoError) {
         LOGE("USC GetInfo failed");
@@ -202,17 +260,10 @@ status_t USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
     }
 
     *out = NULL;
+    ApplySchedPolicyToCaller(mSchedPolicy, &mSchedTid);
     int64_t seekTimeUs;
     ReadOptions::SeekMode seekMode;
-    USC_Bitstream in;
-    USC_PCMStream usc_out;
-    Epp32s *pOrderMapTbl;
-    Epp32s frameLenBits;
-    Epp32s bitrate, frameType;
-    Epp32s STI, usc_mode;
-    Epp32s FrameLength;
-
-
+    long long readStartTicks = GET_TICKS();
 
     if (options && options->getSeekTo(&seekTimeUs, &seekMode)) {
         if(seekTimeUs < 0){
@@ -260,30 +311,80 @@ status_t USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
         }
     }
 
+    MediaBuffer *buffer;
+    if(OK != mBufferGroup->acquire_buffer(&buffer)){
+        return ERROR_MALFORMED;
+    }
+
+    // In batch mode keep decoding frames while they come from the same input
+    // buffer, the output then carries the time stamp of its first frame.
+    int16_t *pOut = (int16_t *)buffer->data();
+    size_t numFrames = 0;
+    while (numFrames < mFramesPerBuffer && NULL != mInputBuffer) {
+        err = decodeFrame(pOut + numFrames * kNumSamplesPerFrame);
+        if (OK != err) {
+            if (0 == numFrames) {
+                buffer->release();
+                return err;
+            }
+            // Report the error on the next read, return what was decoded.
+            break;
+        }
+        numFrames++;
+    }
+
+    buffer->set_range(0, numFrames * kNumSamplesPerFrame * sizeof(int16_t));
+
+    buffer->meta_data()->setInt64(
+        kKeyTime,
+        mAnchorTimeUs
+        + (mNumSamplesOutput * US_PER_SECOND) / kSampleRate);
+
+    mNumSamplesOutput += numFrames * kNumSamplesPerFrame;
+
+    *out = buffer;
+
+    long long readTicks = GET_TICKS() - readStartTicks;
+    mStats->AddFrame(0, readTicks);
+    if (seekTimeUs >= 0) {
+        mStats->AddSeek(readTicks);
+    }
+
+    return OK;
+}
+
+template<size_t uInBufferSize, SAMPLES_PER_FRAME kNumSamplesPerFrame, int32_t kSampleRate, AMRCodecType codecType>
+status_t USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
+::decodeFrame(int16_t *pOut) {
+    USC_Bitstream in;
+    USC_PCMStream usc_out;
+    Epp32s bitrate, frameType;
+    Epp32s STI, usc_mode;
+    Epp32s FrameLength;
+
     uint8_t *inputPtr =
         ( uint8_t *)mInputBuffer->data() + mInputBuffer->range_offset();
-    Frame_Type_3GPP frame_mode =  GetFrameTypeLength(codecType, inputPtr, &FrameLength);
-    FrameLength--;
+    const FrameModeInfo &frameMode = mFrameModes[(inputPtr[0] >> 3) & (kNumFrameModes - 1)];
+    FrameLength = frameMode.length - 1;
     inputPtr++;
-    LOGV("FrameLength =%d,frame_mode =%d,range_length =%u",FrameLength,frame_mode,mInputBuffer->range_length());
+    LOGV("FrameLength =%d,frame_mode =%d,range_length =%u",FrameLength,frameMode.mode,mInputBuffer->range_length());
 
-    bitrate = GetBitRate(codecType, frame_mode);
+    bitrate = frameMode.bitrate;
     if (bitrate == 0) {
-        LOGE("Invalid bitrate, mode: %d", frame_mode);
+        LOGE("Invalid bitrate, mode: %d", frameMode.mode);
         return ERROR_MALFORMED;
     }
 
-    frameType = GetUSCFrameType(codecType, frame_mode);
+    frameType = frameMode.uscFrameType;
     if (frameType == 0) {
-        GetBitReordersTable(codecType, frame_mode, &pOrderMapTbl, &frameLenBits);
-        RTP2USCActiveFrame(&inputPtr, mInputSampleBuffer, FrameLength, pOrderMapTbl, frameLenBits);
+        RTP2USCActiveFrame(&inputPtr, mInputSampleBuffer, FrameLength, frameMode.pOrderMapTbl, frameMode.frameLenBits);
         in.pBuffer = (char *)mInputSampleBuffer;
     } else if (frameType == 1) {
         RTP2USCSIDFrame(&inputPtr, mInputSampleBuffer, FrameLength, &STI, &usc_mode, codecType);
         if (STI == 1) {
             frameType = 2;
         }
-        bitrate = GetBitRate(codecType, usc_mode);
+        bitrate = mFrameModes[usc_mode & (kNumFrameModes - 1)].bitrate;
         in.pBuffer = (char *)mInputSampleBuffer;
     } else if (frameType == 3) {
         bitrate = mPrevBitrate;
@@ -297,25 +398,20 @@ status_t USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
     in.bitrate = bitrate;
     in.nbytes = FrameLength;
 
-    MediaBuffer *buffer;
-    if(OK != mBufferGroup->acquire_buffer(&buffer)){
-        return ERROR_MALFORMED;
-    }
-
-    usc_out.pBuffer = (char *)(buffer->data());
+    usc_out.pBuffer = (char *)pOut;
     usc_out.pcmType.bitPerSample = 16;
 
     USC_Status decStatus;
     {
         AUTO_TIMER(LOG_TAG);
         decStatus = mrUSCAMRFxns.Decode(mUSCDecoder, &in, &usc_out);
+        AUTO_TIMER_MEDIA_US(kNumSamplesPerFrame * US_PER_SECOND / kSampleRate);
     }
 
     LOGV("Decode status: %d usc_out.nbytes %d", decStatus, usc_out.nbytes);
     if (decStatus != USC_NoError) {
         LOGE("Decode Failed Status: %d", decStatus);
-        buffer->release();
-        buffer = NULL;
+        mStats->AddUnderrun();
         return ERROR_MALFORMED;
     }
 
@@ -327,26 +423,16 @@ status_t USCDecoder<uInBufferSize, kNumSamplesPerFrame, kSampleRate, codecType>
 
     mPrevBitrate = bitrate;
 
-    buffer->set_range(0, kNumSamplesPerFrame * sizeof(int16_t));
-
     mInputBuffer->set_range(
         mInputBuffer->range_offset() + FrameLength + 1,
         mInputBuffer->range_length() - FrameLength - 1);
+    mStats->AddBytes(FrameLength + 1);
 
     if (mInputBuffer->range_length() == 0) {
         mInputBuffer->release();
         mInputBuffer = NULL;
     }
 
-    buffer->meta_data()->setInt64(
-        kKeyTime,
-        mAnchorTimeUs
-        + (mNumSamplesOutput * US_PER_SECOND) / kSampleRate);
-
-    mNumSamplesOutput += kNumSamplesPerFrame;
-
-    *out = buffer;
-
     return OK;
 }
 
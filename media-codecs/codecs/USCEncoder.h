@@ -33,8 +33,18 @@ Portions Copyright (c) 2011 Intel Corporation.
 #include "usc2ietf.h"
 
 #include "CIPAMRCommon.h"
+#include "UMCCodecStats.h"
+#include "UMCCpuDispatch.h"
+#include "UMCSchedPolicy.h"
 
 
+// DTX idle skipping: while the encoder is in a DTX period, frames whose
+// mean energy stays below the threshold are sent as NO_DATA without running
+// the encoder. A real encode is forced after DTX_MAX_SKIPPED_FRAMES skipped
+// frames so that the comfort noise keeps getting SID updates.
+#define DTX_SILENCE_ENERGY_THRESHOLD 64  // mean square of 16 bit samples, about -54 dBFS
+#define DTX_MAX_SKIPPED_FRAMES 7
+
 namespace android {
 
 struct MediaBufferGroup;
@@ -60,12 +70,18 @@ protected:
     virtual ~USCEncoder();
 
 private:
+    // Encodes the next frame into pOut as an IETF frame (header byte included).
+    // *pWallClockTimeUs is the drift time of a source buffer read for it, or -1.
+    status_t encodeFrame(uint8_t *pOut, Epp32s *pSize, int64_t *pWallClockTimeUs);
+    static bool isSilentFrame(const int16_t *pFrame);
 
     sp<MediaSource> mSource;
     sp<MetaData>    mMeta;
     bool mStarted;
 
     MediaBufferGroup *mBufferGroup;
+    size_t mFramesPerBuffer;
+    int32_t mPacketFormat;
 
     void *mEncState;
     void *mSidState;
@@ -82,6 +98,10 @@ private:
     int16_t mInputFrame[kNumSamplesPerFrame];
     int32_t mNumInputSamples;
 
+    bool mDtxEnabled;
+    bool mInDtx;                // last encoded frame was SID or NO_DATA
+    int mNumDtxSkippedFrames;
+
     USC_Fxns &mrUSCAMRFxns;
     USC_CodecInfo mInfo;
     USC_MemBank *mBanksEnc;
@@ -89,6 +109,12 @@ private:
     USC_Handle mUSCEncoder;
 
     char mTempOutputBuffer[uEncodedFrameSize];// uEncodedFrameSize is max encoded frame size for NB encoded frame
+    uint8_t mPackedFrame[uEncodedFrameSize];// IETF frame before it is split into TOC entry and data
+
+    CodecStats *mStats;
+
+    CodecSchedPolicy mSchedPolicy;  // applied to the threads calling read()
+    pid_t mSchedTid;
 
     USCEncoder(const USCEncoder &);
     USCEncoder &operator=(const USCEncoder &);
@@ -103,6 +129,8 @@ USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtpFT, codec
       mMeta(meta),
       mStarted(false),
       mBufferGroup(NULL),
+      mFramesPerBuffer(1),
+      mPacketFormat(AMR_PACKET_STORAGE),
       mEncState(NULL),
       mSidState(NULL),
       mAnchorTimeUs(0),
@@ -110,10 +138,16 @@ USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtpFT, codec
       mInputBuffer(NULL),
       mMode(0),
       mNumInputSamples(0),
+      mDtxEnabled(false),
+      mInDtx(false),
+      mNumDtxSkippedFrames(0),
       mrUSCAMRFxns(GetUSCFunctions<codecType>()),
       mBanksEnc (NULL),
       mNumBanksEnc(0),
-      mUSCEncoder(NULL) {
+      mUSCEncoder(NULL),
+      mStats(CodecStats::Get(LOG_TAG)),
+      mSchedTid(0) {
+    UMCCpuDispatchInit();
     LOGI("USC Encoder plugin created, Media Codecs version: %s", MediaCodecs_GetVersion() );
 }
 
@@ -147,7 +181,12 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
 
     mInfo.params.direction = USC_ENCODE;
     mInfo.params.law = 0;
-    mInfo.params.modes.vad = 0;// suppress silence compression
+    int32_t dtx = 0;
+    if ((NULL == params || !params->findInt32(kKeyAMRDtx, &dtx)) && !mMeta->findInt32(kKeyAMRDtx, &dtx)) {
+        dtx = 0;
+    }
+    mDtxEnabled = (0 != dtx);
+    mInfo.params.modes.vad = mDtxEnabled ? 1 : 0;// suppress silence compression unless DTX is asked for
     mInfo.params.pcmType.sample_frequency = kSampleRate;
     mInfo.params.pcmType.nChannels = 1;
 
@@ -164,8 +203,18 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
     mInfo.params.pcmType.bitPerSample = 16;
 
 
+    mFramesPerBuffer = GetFramesPerBuffer(params, mMeta);
+    if ((NULL == params || !params->findInt32(kKeyAMRPacketFormat, &mPacketFormat))
+            && !mMeta->findInt32(kKeyAMRPacketFormat, &mPacketFormat)) {
+        mPacketFormat = AMR_PACKET_STORAGE;
+    }
+    LOGV("%d frames per buffer, packet format %d", mFramesPerBuffer, mPacketFormat);
+    GetSchedPolicy(params, mMeta, PROP_SCHED_VOICE, &mSchedPolicy);
+    mSchedTid = 0;
+
     mBufferGroup = new MediaBufferGroup;
-    MediaBuffer *pOutBuf = new MediaBuffer(uEncodedFrameSize);
+    // The RTP layout adds one CMR byte, TOC entries replace the frame headers.
+    MediaBuffer *pOutBuf = new MediaBuffer(mFramesPerBuffer * uEncodedFrameSize + 1);
     if (NULL == mBufferGroup || NULL == pOutBuf) {
         delete mBufferGroup;
         mBufferGroup = NULL;
@@ -182,6 +231,8 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
     mAnchorTimeUs = 0;
     mNumFramesOutput = 0;
     mNumInputSamples = 0;
+    mInDtx = false;
+    mNumDtxSkippedFrames = 0;
     mSource->start(params);
     mStarted = true;
 
@@ -241,21 +292,104 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
         return BAD_VALUE;
     }
 
-    status_t err;
-    USC_PCMStream usc_in;
-    USC_Bitstream usc_out;
-    Epp32s  size;
-    bool readFromSource = false;
-    int64_t wallClockTimeUs = -1;
-
     int64_t seekTimeUs;
     ReadOptions::SeekMode mode;
     CHECK(options == NULL || !options->getSeekTo(&seekTimeUs, &mode));
     *out = NULL;
+    ApplySchedPolicyToCaller(mSchedPolicy, &mSchedTid);
+    long long readStartTicks = GET_TICKS();
+
+    MediaBuffer *buffer;
+    CHECK_EQ(mBufferGroup->acquire_buffer(&buffer), (status_t)OK);
+    uint8_t *outPtr = (uint8_t *)buffer->data();
+
+    // In the RTP layout the frame data follows the CMR byte and one TOC entry
+    // per frame, which are only known once the packet is complete.
+    bool rtpPacket = (AMR_PACKET_RTP_OCTET == mPacketFormat);
+    uint8_t toc[MAX_FRAMES_PER_BUFFER];
+    size_t dataOffset = rtpPacket ? 1 + mFramesPerBuffer : 0;
+    size_t length = 0;
+
+    int64_t firstMediaTimeUs = mNumFramesOutput * 20000LL;
+    int64_t driftTimeUs = 0;
+    bool hasDriftTime = false;
+    size_t numFrames = 0;
+    while (numFrames < mFramesPerBuffer) {
+        uint8_t *framePtr = rtpPacket ? mPackedFrame : outPtr + dataOffset + length;
+        Epp32s size;
+        int64_t wallClockTimeUs;
+        status_t err = encodeFrame(framePtr, &size, &wallClockTimeUs);
+        if (OK != err) {
+            if (0 == numFrames) {
+                buffer->release();
+                return err;
+            }
+            // Send what was encoded, the error comes back on the next read.
+            break;
+        }
+
+        if (rtpPacket) {
+            // F bit set on all but the last entry, fixed up below.
+            toc[numFrames] = framePtr[0] | 0x80;
+            memcpy(outPtr + dataOffset + length, framePtr + 1, size - 1);
+            length += size - 1;
+        } else {
+            length += size;
+        }
+
+        // Each frame of 160/320 samples is 20ms long.
+        int64_t mediaTimeUs = mNumFramesOutput * 20000LL;
+        if (-1 != wallClockTimeUs) {
+            driftTimeUs = mediaTimeUs - wallClockTimeUs;
+            hasDriftTime = true;
+        }
+        ++mNumFramesOutput;
+        ++numFrames;
+    }
+
+    if (rtpPacket) {
+        if (numFrames < mFramesPerBuffer) {
+            memmove(outPtr + 1 + numFrames, outPtr + dataOffset, length);
+        }
+        outPtr[0] = 0xF0;// CMR: no mode request
+        toc[numFrames - 1] &= ~0x80;
+        memcpy(outPtr + 1, toc, numFrames);
+        length += 1 + numFrames;
+    }
+
+    buffer->set_range(0, length);
+
+    buffer->meta_data()->setInt64(
+            kKeyTime, mAnchorTimeUs + firstMediaTimeUs);
+
+    if (hasDriftTime) {
+        buffer->meta_data()->setInt64(kKeyDriftTime, driftTimeUs);
+    }
+
+    *out = buffer;
+
+    mStats->AddFrame(numFrames * kNumSamplesPerFrame * sizeof(int16_t), GET_TICKS() - readStartTicks);
+
+    return OK;
+}
+
+template<size_t uEncodedFrameSize, SAMPLES_PER_FRAME kNumSamplesPerFrame, SAMPLE_RATE kSampleRate, int32_t kSidRtpFT, AMRCodecType codecType>
+status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtpFT, codecType>
+::encodeFrame(uint8_t *outPtr, Epp32s *pSize, int64_t *pWallClockTimeUs) {
+    status_t err;
+    USC_PCMStream usc_in;
+    USC_Bitstream usc_out;
+    const size_t frameBytes = kNumSamplesPerFrame * sizeof(int16_t);
+    // Frame to encode: mInputFrame, or the source buffer itself when the
+    // whole frame is there (directInput), saving the copy into mInputFrame.
+    const uint8_t *pFrame = (const uint8_t *)mInputFrame;
+    bool directInput = false;
+
+    *pWallClockTimeUs = -1;
 
     while (mNumInputSamples < kNumSamplesPerFrame) {
         if (mInputBuffer == NULL) {
-            err = mSource->read(&mInputBuffer, options);
+            err = mSource->read(&mInputBuffer);
 
             if (err != OK) {
                 if (mNumInputSamples == 0) {
@@ -271,17 +405,23 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
 
             size_t align = mInputBuffer->range_length() % sizeof(int16_t);
             CHECK_EQ(align, 0);
-            readFromSource = true;
 
             int64_t timeUs;
             if (mInputBuffer->meta_data()->findInt64(kKeyDriftTime, &timeUs)) {
-                wallClockTimeUs = timeUs;
+                *pWallClockTimeUs = timeUs;
             }
             if (mInputBuffer->meta_data()->findInt64(kKeyAnchorTime, &timeUs)) {
                 mAnchorTimeUs = timeUs;
             }
-        } else {
-            readFromSource = false;
+        }
+
+        const uint8_t *pSrc = (const uint8_t *)mInputBuffer->data()
+                + mInputBuffer->range_offset();
+        if (0 == mNumInputSamples && mInputBuffer->range_length() >= frameBytes
+                && 0 == ((uintptr_t)pSrc % sizeof(int16_t))) {
+            pFrame = pSrc;
+            directInput = true;
+            break;
         }
 
         size_t copy =
@@ -291,10 +431,7 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
             copy = mInputBuffer->range_length();
         }
 
-        memcpy(&mInputFrame[mNumInputSamples],
-               (const uint8_t *)mInputBuffer->data()
-                    + mInputBuffer->range_offset(),
-               copy);
+        memcpy(&mInputFrame[mNumInputSamples], pSrc, copy);
 
         mNumInputSamples += copy / sizeof(int16_t);
 
@@ -308,13 +445,9 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
         }
     }
 
-    MediaBuffer *buffer;
-    CHECK_EQ(mBufferGroup->acquire_buffer(&buffer), (status_t)OK);
-    uint8_t *outPtr = (uint8_t *)buffer->data();
-
     usc_in.bitrate = mInfo.params.modes.bitrate;
-    usc_in.nbytes = kNumSamplesPerFrame*sizeof(int16_t);
-    usc_in.pBuffer = (char*)mInputFrame;
+    usc_in.nbytes = frameBytes;
+    usc_in.pBuffer = (char*)pFrame;
     usc_in.pcmType.bitPerSample = mInfo.params.pcmType.bitPerSample;
     usc_in.pcmType.nChannels = mInfo.params.pcmType.nChannels;
     usc_in.pcmType.sample_frequency = mInfo.params.pcmType.sample_frequency;
@@ -322,45 +455,63 @@ status_t USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtp
     usc_out.pBuffer = mTempOutputBuffer;
 
 
-    USC_Status encStatus;
-    {
+    USC_Status encStatus = USC_NoError;
+    bool skipEncode = mDtxEnabled && mInDtx
+            && mNumDtxSkippedFrames < DTX_MAX_SKIPPED_FRAMES
+            && isSilentFrame((const int16_t *)pFrame);
+    if (skipEncode) {
+        usc_out.frametype = 3;// NO_DATA
+        usc_out.nbytes = 0;
+        mNumDtxSkippedFrames++;
+    } else {
       AUTO_TIMER(LOG_TAG);
       encStatus = mrUSCAMRFxns.Encode(mUSCEncoder, &usc_in, &usc_out);
+      AUTO_TIMER_MEDIA_US(20000LL);
+      mNumDtxSkippedFrames = 0;
+      mInDtx = (USC_NoError == encStatus && 0 != usc_out.frametype);
+    }
+    if (directInput) {
+        // The frame has been consumed straight from the source buffer.
+        mInputBuffer->set_range(
+                mInputBuffer->range_offset() + frameBytes,
+                mInputBuffer->range_length() - frameBytes);
+        if (mInputBuffer->range_length() == 0) {
+            mInputBuffer->release();
+            mInputBuffer = NULL;
+        }
     }
     if (encStatus != USC_NoError) {
         LOGE("Encode Failed Status: %d", encStatus);
+        mStats->AddUnderrun();
         return ERROR_UNSUPPORTED;
     }
     if (usc_out.frametype == 0) {
-            USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, usc_out.nbytes, &size, mMode, codecType);
+            USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, usc_out.nbytes, pSize, mMode, codecType);
     } else if (usc_out.frametype == 1) {
-            USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, usc_out.nbytes, &size, kSidRtpFT, codecType);
+            USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, usc_out.nbytes, pSize, kSidRtpFT, codecType);
     } else if (usc_out.frametype == 2) {
-            USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, usc_out.nbytes, &size, kSidRtpFT, codecType, 1);
+            USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, usc_out.nbytes, pSize, kSidRtpFT, codecType, 1);
     } else {
-        USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, 0, &size, AMR_UNTR_RTP_FT, codecType);
-    }
-
-
-    buffer->set_range(0, size);
-
-    // Each frame of 160/320 samples is 20ms long.
-    int64_t mediaTimeUs = mNumFramesOutput * 20000LL;
-    buffer->meta_data()->setInt64(
-            kKeyTime, mAnchorTimeUs + mediaTimeUs);
-
-    if (readFromSource && wallClockTimeUs != -1) {
-        buffer->meta_data()->setInt64(kKeyDriftTime,
-            mediaTimeUs - wallClockTimeUs);
+        USCToIETF((Epp8u *)usc_out.pBuffer, outPtr, 0, pSize, AMR_UNTR_RTP_FT, codecType);
     }
 
-    ++mNumFramesOutput;
-
-    *out = buffer;
-
     mNumInputSamples = 0;
 
     return OK;
 }
 
+template<size_t uEncodedFrameSize, SAMPLES_PER_FRAME kNumSamplesPerFrame, SAMPLE_RATE kSampleRate, int32_t kSidRtpFT, AMRCodecType codecType>
+bool USCEncoder<uEncodedFrameSize, kNumSamplesPerFrame, kSampleRate, kSidRtpFT, codecType>
+::isSilentFrame(const int16_t *pFrame) {
+    const int64_t maxEnergy = (int64_t)DTX_SILENCE_ENERGY_THRESHOLD * kNumSamplesPerFrame;
+    int64_t energy = 0;
+    for (int i = 0; i < kNumSamplesPerFrame; i++) {
+        energy += (int32_t)pFrame[i] * pFrame[i];
+        if (energy >= maxEnergy) {
+            return false;
+        }
+    }
+    return true;
+}
+
 }  // namespace android
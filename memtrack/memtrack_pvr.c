@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Memtrack HAL reporting the GL and graphics memory of a process,
+ * from the per-process records of the PVR gralloc
+ */
+
+#define LOG_TAG "memtrack-pvr"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <hardware/memtrack.h>
+
+#include "hal_public.h"
+
+/* Distinct flags of the records of one type */
+#define MAX_RECORD_FLAGS 8
+
+static pthread_mutex_t gralloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static const IMG_gralloc_module_public_t *gralloc;
+
+static int pvr_memtrack_init(const struct memtrack_module *module)
+{
+    const hw_module_t *hw_module;
+    int err = 0;
+
+    (void)module;
+    pthread_mutex_lock(&gralloc_lock);
+    if (gralloc)
+        goto out;
+    err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &hw_module);
+    if (err) {
+        ALOGE("Failed to load the gralloc module: %s", strerror(-err));
+        goto out;
+    }
+    gralloc = (const IMG_gralloc_module_public_t *)hw_module;
+    if (!gralloc->GetMemTrackRecords) {
+        ALOGE("The gralloc module has no memtrack records");
+        gralloc = NULL;
+        err = -ENOSYS;
+    }
+out:
+    pthread_mutex_unlock(&gralloc_lock);
+    return err;
+}
+
+static int pvr_memtrack_get_memory(const struct memtrack_module *module,
+                                   pid_t pid, int type,
+                                   struct memtrack_record *records,
+                                   size_t *num_records)
+{
+    IMG_memtrack_record_public_t *pvr_records = NULL;
+    struct memtrack_record sums[MAX_RECORD_FLAGS];
+    size_t num_pvr_records = 0, num_sums = 0, i, j;
+    int err;
+
+    if (type != MEMTRACK_TYPE_GL && type != MEMTRACK_TYPE_GRAPHICS)
+        return -EINVAL;
+    if (!gralloc && pvr_memtrack_init(module))
+        return -ENODEV;
+
+    err = gralloc->GetMemTrackRecords(gralloc, &pvr_records, &num_pvr_records);
+    if (err) {
+        ALOGE("Failed to get the memtrack records: %d", err);
+        return err;
+    }
+
+    /* One record per flags, the sum of the records of the process */
+    for (i = 0; i < num_pvr_records; i++) {
+        const IMG_memtrack_record_public_t *r = &pvr_records[i];
+
+        if (r->pid != pid || (int)r->eType != type)
+            continue;
+        for (j = 0; j < num_sums; j++)
+            if (sums[j].flags == r->base.flags)
+                break;
+        if (j == num_sums) {
+            if (num_sums == MAX_RECORD_FLAGS)
+                continue;
+            sums[num_sums].flags = r->base.flags;
+            sums[num_sums].size_in_bytes = 0;
+            num_sums++;
+        }
+        sums[j].size_in_bytes += r->base.size_in_bytes;
+    }
+    /* The records are copied for the caller */
+    free(pvr_records);
+
+    /* The caller asks for the number of records with *num_records == 0 */
+    for (i = 0; i < num_sums && i < *num_records; i++)
+        records[i] = sums[i];
+    *num_records = num_sums;
+    return 0;
+}
+
+static struct hw_module_methods_t memtrack_module_methods = {
+    .open = NULL,
+};
+
+struct memtrack_module HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .module_api_version = MEMTRACK_MODULE_API_VERSION_0_1,
+        .hal_api_version = HARDWARE_HAL_API_VERSION,
+        .id = MEMTRACK_HARDWARE_MODULE_ID,
+        .name = "PVR Memory Tracker HAL",
+        .author = "Intel Corporation",
+        .methods = &memtrack_module_methods,
+    },
+    .init = pvr_memtrack_init,
+    .getMemory = pvr_memtrack_get_memory,
+};
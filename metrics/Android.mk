@@ -0,0 +1,23 @@
+# Copyright (C) 2014 Intel Corporation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# device_metrics.h is header only, the modules which publish into it
+# add this directory to their includes
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := metrics_dump.c
+LOCAL_MODULE := metrics_dump
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
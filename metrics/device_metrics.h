@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVICE_METRICS_H
+#define DEVICE_METRICS_H
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Counters and histograms of the hot paths of the device, registered by
+ * name in one file per module under DEVICE_METRICS_DIR, which
+ * metrics_dump reads.
+ *
+ * The file is mapped shared, and everything in it is updated with
+ * atomics: a metric is registered by claiming a free slot, and updating
+ * it never takes a lock nor makes a system call. The counters are kept
+ * across restarts of the module, /dev is cleared at boot.
+ *
+ * The writers of a module are the processes of one user, the file is
+ * created read-only for the others.
+ */
+#define DEVICE_METRICS_DIR       "/dev/metrics"
+#define DEVICE_METRICS_MAGIC     0x4d564544  /* "DEVM" */
+#define DEVICE_METRICS_VERSION   1
+#define DEVICE_METRICS_MAX       64
+#define DEVICE_METRICS_NAME_LEN  40
+/* Buckets of the samples: 0, then [2^(i-1), 2^i), the last one unbounded */
+#define DEVICE_METRICS_BUCKETS   16
+
+/* type of a metric slot */
+#define DEVICE_METRIC_FREE       0
+#define DEVICE_METRIC_CLAIMED    1  /* the name is being written */
+#define DEVICE_METRIC_COUNTER    2
+#define DEVICE_METRIC_HISTOGRAM  3
+
+struct device_metric {
+    volatile uint32_t type;
+    uint32_t reserved;
+    char name[DEVICE_METRICS_NAME_LEN];
+    volatile int64_t count;     /* counter value, or number of samples */
+    volatile int64_t sum;       /* of the samples */
+    volatile int64_t max;       /* of the samples */
+    volatile uint32_t buckets[DEVICE_METRICS_BUCKETS];
+};
+
+struct device_metrics {
+    volatile uint32_t magic;    /* set last, once the header is valid */
+    uint32_t version;
+    uint32_t size;              /* number of metrics */
+    uint32_t metric_size;       /* sizeof(struct device_metric) */
+    uint32_t reserved[4];
+    struct device_metric metrics[DEVICE_METRICS_MAX];
+};
+
+/* Maps the metrics of module, created on first use, or NULL */
+static inline struct device_metrics *device_metrics_map(const char *module)
+{
+    struct device_metrics *m;
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", DEVICE_METRICS_DIR, module);
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    /* Only grows an empty file, the other writers keep their metrics */
+    if (ftruncate(fd, sizeof(struct device_metrics)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    m = (struct device_metrics *)mmap(NULL, sizeof(struct device_metrics),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        return NULL;
+    if (m->magic == DEVICE_METRICS_MAGIC &&
+            (m->version != DEVICE_METRICS_VERSION ||
+             m->metric_size != sizeof(struct device_metric))) {
+        /* Left by another version of the module */
+        munmap(m, sizeof(struct device_metrics));
+        return NULL;
+    }
+    if (m->magic != DEVICE_METRICS_MAGIC) {
+        /* Same values from every writer which races here */
+        m->version = DEVICE_METRICS_VERSION;
+        m->size = DEVICE_METRICS_MAX;
+        m->metric_size = sizeof(struct device_metric);
+        __atomic_store_n(&m->magic, DEVICE_METRICS_MAGIC, __ATOMIC_RELEASE);
+    }
+    return m;
+}
+
+/*
+ * The metric of this name and type, registered on first use, or NULL if
+ * m is NULL or full. Call once per call site and keep the pointer.
+ */
+static inline struct device_metric *device_metrics_get(struct device_metrics *m,
+        const char *name, uint32_t type)
+{
+    uint32_t i;
+
+    if (!m)
+        return NULL;
+    for (i = 0; i < DEVICE_METRICS_MAX; i++) {
+        struct device_metric *metric = &m->metrics[i];
+        uint32_t t = __atomic_load_n(&metric->type, __ATOMIC_ACQUIRE);
+
+        if (t == DEVICE_METRIC_FREE) {
+            if (__sync_bool_compare_and_swap(&metric->type,
+                    DEVICE_METRIC_FREE, DEVICE_METRIC_CLAIMED)) {
+                strncpy(metric->name, name, DEVICE_METRICS_NAME_LEN - 1);
+                __atomic_store_n(&metric->type, type, __ATOMIC_RELEASE);
+                return metric;
+            }
+            /* Another writer took the slot, maybe for the same name */
+            t = __atomic_load_n(&metric->type, __ATOMIC_ACQUIRE);
+        }
+        while (t == DEVICE_METRIC_CLAIMED) {
+            sched_yield();
+            t = __atomic_load_n(&metric->type, __ATOMIC_ACQUIRE);
+        }
+        if (t == type && !strncmp(metric->name, name, DEVICE_METRICS_NAME_LEN - 1))
+            return metric;
+    }
+    return NULL;
+}
+
+/* Adds value to a counter */
+static inline void device_metric_add(struct device_metric *metric, int64_t value)
+{
+    if (metric)
+        __sync_fetch_and_add(&metric->count, value);
+}
+
+/* Adds a sample to a histogram */
+static inline void device_metric_observe(struct device_metric *metric, int64_t value)
+{
+    int64_t max;
+    int bucket = 0;
+
+    if (!metric)
+        return;
+    if (value < 0)
+        value = 0;
+    if (value > 0) {
+        bucket = 64 - __builtin_clzll((uint64_t)value);
+        if (bucket >= DEVICE_METRICS_BUCKETS)
+            bucket = DEVICE_METRICS_BUCKETS - 1;
+    }
+    __sync_fetch_and_add(&metric->count, (int64_t)1);
+    __sync_fetch_and_add(&metric->sum, value);
+    __sync_fetch_and_add(&metric->buckets[bucket], 1);
+    max = metric->max;
+    while (value > max) {
+        if (__sync_bool_compare_and_swap(&metric->max, max, value))
+            break;
+        max = metric->max;
+    }
+}
+
+#endif
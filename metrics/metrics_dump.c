@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Prints the metrics of every module, or of the modules given, e.g.
+ *   metrics_dump mds healthd
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "device_metrics.h"
+
+static void dump_metric(const struct device_metric *metric, uint32_t type)
+{
+    char name[DEVICE_METRICS_NAME_LEN];
+    int64_t count = metric->count;
+    int i;
+
+    memcpy(name, metric->name, sizeof(name));
+    name[sizeof(name) - 1] = '\0';
+    if (type == DEVICE_METRIC_COUNTER) {
+        printf("  %s: %lld\n", name, (long long)count);
+        return;
+    }
+    if (count == 0)
+        return;
+    printf("  %s: %lld, avg %lld, max %lld,", name, (long long)count,
+            (long long)(metric->sum / count), (long long)metric->max);
+    for (i = 0; i < DEVICE_METRICS_BUCKETS; i++) {
+        if (metric->buckets[i] == 0)
+            continue;
+        if (i == 0)
+            printf(" 0: %u", metric->buckets[i]);
+        else if (i == DEVICE_METRICS_BUCKETS - 1)
+            printf(" >=%d: %u", 1 << (i - 1), metric->buckets[i]);
+        else
+            printf(" <%d: %u", 1 << i, metric->buckets[i]);
+    }
+    printf("\n");
+}
+
+static int dump_module(const char *module)
+{
+    const struct device_metrics *m;
+    char path[64];
+    struct stat sb;
+    uint32_t i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", DEVICE_METRICS_DIR, module);
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(struct device_metrics)) {
+        fprintf(stderr, "%s is not a metrics file\n", path);
+        close(fd);
+        return -1;
+    }
+    m = (const struct device_metrics *)mmap(NULL, sizeof(struct device_metrics),
+            PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != DEVICE_METRICS_MAGIC ||
+            m->version != DEVICE_METRICS_VERSION ||
+            m->metric_size != sizeof(struct device_metric)) {
+        fprintf(stderr, "%s has an unknown version\n", path);
+        munmap((void *)m, sizeof(struct device_metrics));
+        return -1;
+    }
+
+    printf("%s:\n", module);
+    for (i = 0; i < DEVICE_METRICS_MAX; i++) {
+        const struct device_metric *metric = &m->metrics[i];
+        uint32_t type = __atomic_load_n(&metric->type, __ATOMIC_ACQUIRE);
+
+        if (type == DEVICE_METRIC_FREE)
+            break;
+        if (type == DEVICE_METRIC_COUNTER || type == DEVICE_METRIC_HISTOGRAM)
+            dump_metric(metric, type);
+    }
+    munmap((void *)m, sizeof(struct device_metrics));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int ret = 0;
+    int i;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            if (dump_module(argv[i]))
+                ret = 1;
+        }
+        return ret;
+    }
+
+    dir = opendir(DEVICE_METRICS_DIR);
+    if (!dir) {
+        fprintf(stderr, "Could not open %s: %s\n", DEVICE_METRICS_DIR, strerror(errno));
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (dump_module(entry->d_name))
+            ret = 1;
+    }
+    closedir(dir);
+    return ret;
+}
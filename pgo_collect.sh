@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Collects the profile of the modules including OptPgo.mk, from a device
+# running a build with TARGET_PGO := instrument, into pgo/ for a build
+# with TARGET_PGO := optimize.
+#
+#   pgo_collect.sh [runs] [mds_bench options]
+#
+# The device must be rooted, the script sets SELinux permissive so that
+# the services can write their profile. mds_bench is run the given number
+# of times (3 by default). The profile counters of every process exiting,
+# and of MDS on pgo-flush, are added to the same files on the device, so
+# the profile pulled is the merge of all the runs.
+
+set -e
+
+DIR=$(cd $(dirname $0) && pwd)
+PROFILE=$DIR/pgo
+DEVICE_PATH=/data/local/tmp/pgo
+
+RUNS=3
+if [ $# -gt 0 ]; then
+  RUNS=$1
+  shift
+fi
+
+adb root
+adb wait-for-device
+adb shell setenforce 0
+adb shell "rm -rf $DEVICE_PATH && mkdir -p $DEVICE_PATH && chmod 777 $DEVICE_PATH"
+# Drop the counters of the boot, the profile is the one of the benchmarks
+adb shell dumpsys display.intel.mds pgo-flush > /dev/null
+adb shell "rm -rf $DEVICE_PATH/*"
+
+for i in $(seq $RUNS); do
+  echo "mds_bench run $i of $RUNS"
+  adb shell mds_bench "$@"
+done
+adb shell dumpsys display.intel.mds pgo-flush | grep -q "profile written" || {
+  echo "MDS is not instrumented, build with TARGET_PGO := instrument"
+  exit 1
+}
+
+rm -rf "$PROFILE"
+mkdir -p "$PROFILE"
+adb pull $DEVICE_PATH "$PROFILE"
+echo "profile of $(find "$PROFILE" -name '*.gcda' | wc -l) objects in $PROFILE"
@@ -0,0 +1,84 @@
+# zram swap set up from the RAM of the board
+
+ZRAM=/sys/block/zram0
+ZRAM_DEV=/dev/block/zram0
+# Smallest disk, the size of the former fstab.zram
+ZRAM_MIN_KB=204800
+# Data compressed by the benchmark of the compressor
+BENCH_FILE=/system/framework/framework.jar
+BENCH_KB=8192
+
+# Centiseconds since boot
+uptime_cs() {
+	read up idle < /proc/uptime
+	echo ${up%.*}${up#*.}
+}
+
+# RAM of the board, 1 GB and 2 GB variants
+while read key value unit; do
+	if [ "$key" = "MemTotal:" ]; then
+		mem_kb=$value
+		break
+	fi
+done < /proc/meminfo
+
+# A quarter of the RAM
+zram_kb=$((mem_kb / 4))
+if [ $zram_kb -lt $ZRAM_MIN_KB ]; then
+	zram_kb=$ZRAM_MIN_KB
+fi
+
+cpus=0
+while read key value; do
+	case "$key" in
+	processor) cpus=$((cpus + 1));;
+	esac
+done < /proc/cpuinfo
+
+# Compression streams and algorithm are only set before the disk size,
+# and a reset drops them
+setup_disk() {
+	# One compression stream per CPU, when the kernel has several
+	if [ -e $ZRAM/max_comp_streams -a $cpus -gt 1 ]; then
+		echo $cpus > $ZRAM/max_comp_streams
+	fi
+	# lz4 is faster than lzo for a similar ratio
+	if [ -e $ZRAM/comp_algorithm ]; then
+		case "`cat $ZRAM/comp_algorithm`" in
+		*lz4*) echo lz4 > $ZRAM/comp_algorithm;;
+		esac
+	fi
+	echo $((zram_kb * 1024)) > $ZRAM/disksize
+}
+
+setup_disk || exit 1
+
+# Measure how fast pages are compressed before choosing the swappiness.
+# The disk is reset afterwards, so that the benchmark data is freed.
+swappiness=100
+if [ -e $BENCH_FILE ]; then
+	start=`uptime_cs`
+	dd if=$BENCH_FILE of=$ZRAM_DEV bs=4096 count=$((BENCH_KB / 4)) 2> /dev/null
+	elapsed=$((`uptime_cs` - start))
+	if [ $elapsed -lt 1 ]; then
+		elapsed=1
+	fi
+	# KB per centisecond, 1000 is about 100 MB/s
+	rate=$((BENCH_KB / elapsed))
+	if [ $rate -lt 500 ]; then
+		swappiness=60
+	elif [ $rate -lt 1000 ]; then
+		swappiness=80
+	fi
+	echo 1 > $ZRAM/reset
+	setup_disk || exit 1
+	log -p i -t zram "compressed $BENCH_KB KB in $elapsed cs"
+fi
+
+mkswap $ZRAM_DEV || exit 1
+swapon $ZRAM_DEV || exit 1
+echo $swappiness > /proc/sys/vm/swappiness
+
+log -p i -t zram "$zram_kb KB, $cpus CPUs, swappiness $swappiness"
+
+exit 0